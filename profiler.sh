@@ -10,6 +10,7 @@ usage() {
     echo "  dump              dump collected data without stopping profiling session"
     echo "  check             check if the specified profiling event is available"
     echo "  status            print profiling status"
+    echo "  metrics           print profiler overhead counters"
     echo "  list              list profiling events supported by the target JVM"
     echo "  collect           collect profile for the specified period of time"
     echo "                    and then stop (default action)"
@@ -24,7 +25,7 @@ usage() {
     echo "  -g                print method signatures"
     echo "  -a                annotate Java methods"
     echo "  -l                prepend library names"
-    echo "  -o fmt            output format: flat|traces|collapsed|flamegraph|tree|jfr"
+    echo "  -o fmt            output format: flat|traces|collapsed|flamegraph|tree|jfr|binary|pprof"
     echo "  -I include        output only stack traces containing the specified pattern"
     echo "  -X exclude        exclude stack traces with the specified pattern"
     echo "  -v, --version     display version string"
@@ -34,65 +35,92 @@ usage() {
     echo "  --reverse         generate stack-reversed FlameGraph / Call tree"
     echo ""
     echo "  --loop time       run profiler in a loop"
+    echo "  --rotate time     keep profiling and write the last interval to file every time"
+    echo "  --rotatefiles n   with --rotate, cycle %n in the file name through n files"
     echo "  --alloc bytes     allocation profiling interval in bytes"
     echo "  --lock duration   lock profiling threshold in nanoseconds"
+    echo "  --lockstats       aggregate lock wait time by lock class and call site"
+    echo "  --latency         build lock wait time histograms per call trace"
+    echo "                    or time calls of instrumented methods"
+    echo "  --callcount       count all calls of instrumented methods or perf event hits"
+    echo "  --live            with alloc or nativemem, show only allocations that are still alive"
+    echo "  --nativemem bytes native memory profiling interval in bytes"
     echo "  --total           accumulate the total value (time, bytes, etc.)"
     echo "  --all-user        only include user-mode events"
     echo "  --sched           group threads by scheduling policy"
-    echo "  --cstack mode     how to traverse C stack: fp|dwarf|lbr|no"
+    echo "  --pauses          mark samples taken during GC and safepoint pauses"
+    echo "  --thread-cpu      measure CPU time of every thread"
+    echo "  --numa            place sample buffers on the NUMA node of their CPU"
+    echo "  --vm-walker       walk Java stacks without AsyncGetCallTrace"
+    echo "  --stack-copy size unwind native frames later from a copy of the stack"
+    echo "  --cstack mode     how to traverse C stack: fp|dwarf|lbr|auto|vm|no"
     echo "  --begin function  begin profiling when function is executed"
     echo "  --end function    end profiling when function is executed"
+    echo "  --thread-window   with --begin/--end, profile each thread only inside its own window"
     echo "  --ttsp            time-to-safepoint profiling"
     echo "  --jfrsync config  synchronize profiler with JFR recording"
     echo "  --fdtransfer      use fdtransfer to serve perf requests"
     echo "                    from the non-privileged target"
     echo ""
     echo "<pid> is a numeric process ID of the target JVM"
+    echo "      or a comma separated list of IDs to profile several JVMs at once;"
+    echo "      then the -f filename must contain %p, which is replaced with the ID"
     echo "      or 'jps' keyword to find running JVM automatically"
     echo "      or the application's name as it would appear in the jps tool"
     echo ""
     echo "Example: $0 -d 30 -f profile.html 3456"
+    echo "         $0 -d 30 -f profile-%p.html 3456,3457,3458"
     echo "         $0 start -i 999000 jps"
     echo "         $0 stop -o flat jps"
     echo "         $0 -d 5 -e alloc MyAppName"
     exit 1
 }
 
+mirror_file() {
+    # Try to access the file of every target both directly and through /proc/[pid]/root,
+    # in case the target namespace differs. %p in the name stands for the target pid
+    for TARGET in $PIDS; do
+        NAME=$(echo "$1" | sed "s/%p/$TARGET/g")
+        if [ ! -f "$NAME" ] && [ "$UNAME_S" = "Linux" ]; then
+            NAME="/proc/$TARGET/root$NAME"
+        fi
+        if [ -f "$NAME" ]; then
+            if [ "$MULTI_PID" = true ]; then
+                echo "--- $TARGET ---"
+            fi
+            cat "$NAME"
+            rm "$NAME"
+        fi
+    done
+}
+
 mirror_output() {
     # Mirror output from temporary file to local terminal
     if [ "$USE_TMP" = true ]; then
-        if [ -f "$FILE" ]; then
-            cat "$FILE"
-            rm "$FILE"
-        elif [ -f "$ROOT_PREFIX$FILE" ]; then
-            cat "$ROOT_PREFIX$FILE"
-            rm "$ROOT_PREFIX$FILE"
-        fi
+        mirror_file "$FILE"
     fi
 }
 
 mirror_log() {
-    # Try to access the log file both directly and through /proc/[pid]/root,
-    # in case the target namespace differs
-    if [ -f "$LOG" ]; then
-        cat "$LOG" >&2
-        rm "$LOG"
-    elif [ -f "$ROOT_PREFIX$LOG" ]; then
-        cat "$ROOT_PREFIX$LOG" >&2
-        rm "$ROOT_PREFIX$LOG"
-    fi
+    mirror_file "$LOG" >&2
 }
 
 check_if_terminated() {
-    if ! kill -0 "$PID" 2> /dev/null; then
-        mirror_output
-        exit 0
-    fi
+    # Keep profiling while at least one of the targets is alive
+    for TARGET in $PIDS; do
+        if kill -0 "$TARGET" 2> /dev/null; then
+            return
+        fi
+    done
+    mirror_output
+    exit 0
 }
 
 fdtransfer() {
     if [ "$USE_FDTRANSFER" = "true" ]; then
-        "$FDTRANSFER" "$PID"
+        for TARGET in $PIDS; do
+            "$FDTRANSFER" "$TARGET"
+        done
     fi
 }
 
@@ -112,6 +140,16 @@ jattach() {
             fi
         fi
 
+        # Do not leave the profiler running in the targets that did start
+        if [ "$MULTI_PID" = true ]; then
+            case "$1" in
+                start*|resume*)
+                    echo "Stopping the profiler in other targets"
+                    "$JATTACH" "$PID" load "$PROFILER" true "stop,file=/dev/null" > /dev/null 2>&1
+                    ;;
+            esac
+        fi
+
         mirror_log
         exit $RET
     fi
@@ -145,7 +183,7 @@ while [ $# -gt 0 ]; do
         -h|"-?")
             usage
             ;;
-        start|resume|stop|dump|check|status|list|collect)
+        start|resume|stop|dump|check|status|metrics|list|collect)
             ACTION="$1"
             ;;
         -v|--version)
@@ -220,11 +258,11 @@ while [ $# -gt 0 ]; do
         --samples|--total)
             FORMAT="$FORMAT,${1#--}"
             ;;
-        --alloc|--lock|--chunksize|--chunktime)
+        --alloc|--lock|--nativemem|--chunksize|--chunktime|--monitor|--rotatefiles)
             PARAMS="$PARAMS,${1#--}=$2"
             shift
             ;;
-        --timeout|--loop)
+        --timeout|--loop|--rotate)
             if [ "$ACTION" = "collect" ]; then
                 ACTION="start"
             fi
@@ -237,6 +275,34 @@ while [ $# -gt 0 ]; do
         --sched)
             PARAMS="$PARAMS,sched"
             ;;
+        --pauses)
+            PARAMS="$PARAMS,pauses"
+            ;;
+        --thread-cpu)
+            PARAMS="$PARAMS,threadcpu"
+            ;;
+        --numa)
+            PARAMS="$PARAMS,numa"
+            ;;
+        --vm-walker)
+            PARAMS="$PARAMS,vmwalker"
+            ;;
+        --stack-copy)
+            PARAMS="$PARAMS,stackcopy=$2"
+            shift
+            ;;
+        --live)
+            PARAMS="$PARAMS,live"
+            ;;
+        --lockstats)
+            PARAMS="$PARAMS,lockstats"
+            ;;
+        --latency)
+            PARAMS="$PARAMS,latency"
+            ;;
+        --callcount)
+            PARAMS="$PARAMS,callcount"
+            ;;
         --cstack|--call-graph)
             PARAMS="$PARAMS,cstack=$2"
             shift
@@ -245,6 +311,9 @@ while [ $# -gt 0 ]; do
             PARAMS="$PARAMS,${1#--}=$2"
             shift
             ;;
+        --thread-window)
+            PARAMS="$PARAMS,threadwindow"
+            ;;
         --ttsp)
             PARAMS="$PARAMS,begin=SafepointSynchronize::begin,end=RuntimeService::record_safepoint_synchronized"
             ;;
@@ -296,10 +365,31 @@ if [ "$PID" = "" ] && [ "$ACTION" != "version" ]; then
     usage
 fi
 
+# With several targets, jattach attaches to all of them in parallel
+# and replaces %p in the arguments with the pid of each target
+PIDS=$(echo "$PID" | tr ',' ' ')
+case "$PID" in
+    *,*)
+        MULTI_PID=true
+        TARGET_ID="%p"
+        case "$USE_TMP$FILE" in
+            false*%p*) ;;
+            false*)
+                echo "With several process IDs, the -f filename must contain %p"
+                exit 1
+                ;;
+        esac
+        ;;
+    *)
+        MULTI_PID=false
+        TARGET_ID="$PID"
+        ;;
+esac
+
 # If no -f argument is given, use temporary file to transfer output to caller terminal.
 # Let the target process create the file in case this script is run by superuser.
 if [ "$USE_TMP" = true ]; then
-    FILE=/tmp/async-profiler.$$.$PID
+    FILE=/tmp/async-profiler.$$.$TARGET_ID
 else
     case "$FILE" in
         /*)
@@ -311,14 +401,9 @@ else
             ;;
     esac
 fi
-LOG=/tmp/async-profiler-log.$$.$PID
+LOG=/tmp/async-profiler-log.$$.$TARGET_ID
 
 UNAME_S=$(uname -s)
-if [ "$UNAME_S" = "Linux" ]; then
-    ROOT_PREFIX="/proc/$PID/root"
-else
-    ROOT_PREFIX=""
-fi
 
 case $ACTION in
     start|resume)
@@ -331,7 +416,7 @@ case $ACTION in
     stop|dump)
         jattach "$ACTION,file=$FILE,$OUTPUT$FORMAT"
         ;;
-    status|list)
+    status|metrics|list)
         jattach "$ACTION,file=$FILE"
         ;;
     collect)
@@ -14,51 +14,60 @@
  * limitations under the License.
  */
 
+#include <string.h>
 #include "allocTracer.h"
+#include "classIdCache.h"
+#include "log.h"
 #include "profiler.h"
 #include "stackFrame.h"
 #include "vmStructs.h"
 
 
 int AllocTracer::_trap_kind;
-Trap AllocTracer::_in_new_tlab(0);
-Trap AllocTracer::_outside_tlab(1);
+Trap AllocTracer::_in_new_tlab(0, AllocTracer::trapHandler);
+Trap AllocTracer::_outside_tlab(1, AllocTracer::trapHandler);
 
 u64 AllocTracer::_interval;
+u64 AllocTracer::_base_interval;
 volatile u64 AllocTracer::_allocated_bytes;
 
+bool AllocTracer::_poll = false;
+bool AllocTracer::_installed = false;
+volatile int AllocTracer::_armed_threads = 0;
+volatile int AllocTracer::_switching = 0;
+AllocThread AllocTracer::_threads[ALLOC_THREADS];
 
-// Called whenever our breakpoint trap is hit
-void AllocTracer::trapHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+
+// Called whenever one of the allocation traps is hit
+void AllocTracer::trapHandler(Trap* trap, void* ucontext) {
     StackFrame frame(ucontext);
     int event_type;
     uintptr_t total_size;
     uintptr_t instance_size;
 
-    // PC points either to BREAKPOINT instruction or to the next one
-    if (_in_new_tlab.covers(frame.pc())) {
+    if (trap == &_in_new_tlab) {
         // send_allocation_in_new_tlab(Klass* klass, HeapWord* obj, size_t tlab_size, size_t alloc_size, Thread* thread)
         // send_allocation_in_new_tlab_event(KlassHandle klass, size_t tlab_size, size_t alloc_size)
         event_type = BCI_ALLOC;
         total_size = _trap_kind == 1 ? frame.arg2() : frame.arg1();
         instance_size = _trap_kind == 1 ? frame.arg3() : frame.arg2();
-    } else if (_outside_tlab.covers(frame.pc())) {
+    } else {
         // send_allocation_outside_tlab(Klass* klass, HeapWord* obj, size_t alloc_size, Thread* thread)
         // send_allocation_outside_tlab_event(KlassHandle klass, size_t alloc_size);
         event_type = BCI_ALLOC_OUTSIDE_TLAB;
         total_size = _trap_kind == 1 ? frame.arg2() : frame.arg1();
         instance_size = 0;
-    } else {
-        // Not our trap
-        Profiler::instance()->trapHandler(signo, siginfo, ucontext);
-        return;
     }
 
     // Leave the trapped function by simulating "ret" instruction
     uintptr_t klass = frame.arg0();
     frame.ret();
 
-    if (_enabled) {
+    if (!_enabled) {
+        return;
+    } else if (_poll) {
+        recordPolledAllocation(ucontext, event_type, klass, total_size, instance_size);
+    } else {
         recordAllocation(ucontext, event_type, klass, total_size, instance_size);
     }
 }
@@ -75,13 +84,129 @@ void AllocTracer::recordAllocation(void* ucontext, int event_type, uintptr_t rkl
     event._instance_size = instance_size;
 
     if (VMStructs::hasClassNames()) {
-        VMSymbol* symbol = VMKlass::fromHandle(rklass)->name();
-        event._class_id = Profiler::instance()->classMap()->lookup(symbol->body(), symbol->length());
+        event._class_id = ClassIdCache::lookup(VMKlass::fromHandle(rklass));
     }
 
     Profiler::instance()->recordSample(ucontext, total_size, event_type, &event);
 }
 
+// A thread is the only one to add or remove itself, so there are no duplicate entries
+AllocThread* AllocTracer::findThread(int tid, bool add) {
+    const u32 mask = ALLOC_THREADS - 1;
+    u32 start = (u32)tid * 0x9e3779b1 & mask;
+    AllocThread* free_slot = NULL;
+
+    for (u32 i = 0; i < 16; i++) {
+        AllocThread* t = &_threads[(start + i) & mask];
+        int slot_tid = t->tid;
+        if (slot_tid == tid) {
+            return t;
+        } else if (slot_tid <= 0) {
+            // -1 marks a removed thread; nothing has been added past an empty slot
+            if (free_slot == NULL) free_slot = t;
+            if (slot_tid == 0) break;
+        }
+    }
+
+    if (add && free_slot != NULL) {
+        int prev = free_slot->tid;
+        if (prev <= 0 && __sync_bool_compare_and_swap(&free_slot->tid, prev, tid)) {
+            free_slot->armed = false;
+            free_slot->last_sample = (u64)-1;
+            return free_slot;
+        }
+    }
+    return NULL;
+}
+
+// Brings trap state in line with the number of armed threads. Whoever loses
+// the race leaves it to the next sample; the state is rechecked after switching
+void AllocTracer::switchTraps() {
+    while (_installed != (_armed_threads > 0)) {
+        if (!__sync_bool_compare_and_swap(&_switching, 0, 1)) {
+            return;
+        }
+        if (!_poll) {
+            // Stopped meanwhile
+            __sync_fetch_and_sub(&_switching, 1);
+            return;
+        }
+        if (_armed_threads > 0) {
+            _installed = _in_new_tlab.install() && _outside_tlab.install();
+        } else {
+            _in_new_tlab.uninstall();
+            _outside_tlab.uninstall();
+            _installed = false;
+        }
+        __sync_fetch_and_sub(&_switching, 1);
+    }
+}
+
+void AllocTracer::pollThread(int tid) {
+    if (!_poll) {
+        return;
+    }
+
+    VMThread* vm_thread = VMThread::current();
+    AllocThread* t;
+    if (vm_thread == NULL || (t = findThread(tid, true)) == NULL) {
+        return;
+    }
+
+    u64 allocated = vm_thread->allocatedBytes();
+    if (t->last_sample > allocated) {
+        // A new thread, possibly reusing the id of one that has exited
+        t->last_sample = allocated;
+    } else if (!t->armed && allocated - t->last_sample >= _interval) {
+        t->armed = true;
+        atomicInc(_armed_threads);
+    }
+
+    switchTraps();
+}
+
+void AllocTracer::removeThread(int tid) {
+    if (!_poll) {
+        return;
+    }
+
+    AllocThread* t = findThread(tid, false);
+    if (t != NULL) {
+        if (t->armed) {
+            t->armed = false;
+            atomicInc(_armed_threads, -1);
+        }
+        t->tid = -1;
+    }
+}
+
+// Only armed threads are sampled, with everything they have allocated since their last sample
+void AllocTracer::recordPolledAllocation(void* ucontext, int event_type, uintptr_t rklass,
+                                         uintptr_t total_size, uintptr_t instance_size) {
+    VMThread* vm_thread = VMThread::current();
+    AllocThread* t;
+    if (vm_thread == NULL || (t = findThread(OS::threadId(), false)) == NULL || !t->armed) {
+        return;
+    }
+
+    u64 allocated = vm_thread->allocatedBytes() + total_size;
+    u64 weight = allocated - t->last_sample;
+    t->last_sample = allocated;
+    t->armed = false;
+    atomicInc(_armed_threads, -1);
+
+    AllocEvent event;
+    event._class_id = 0;
+    event._total_size = total_size;
+    event._instance_size = instance_size;
+
+    if (VMStructs::hasClassNames()) {
+        event._class_id = ClassIdCache::lookup(VMKlass::fromHandle(rklass));
+    }
+
+    Profiler::instance()->recordSample(ucontext, weight, event_type, &event);
+}
+
 Error AllocTracer::check(Arguments& args) {
     if (_in_new_tlab.entry() != 0 && _outside_tlab.entry() != 0) {
         return Error::OK;
@@ -117,9 +242,22 @@ Error AllocTracer::start(Arguments& args) {
         return error;
     }
 
-    _interval = args._alloc;
+    _interval = _base_interval = args._alloc;
     _allocated_bytes = 0;
 
+    // Without execution samples, there is nothing to read the counters of allocated bytes
+    _poll = args._alloc_poll && args._event != NULL && args._alloc > 1 && VMThread::hasAllocatedBytes();
+    if (args._alloc_poll && !_poll) {
+        Log::warn("allocpoll needs an execution event and Thread::_allocated_bytes; traps stay armed");
+    }
+
+    if (_poll) {
+        memset((void*)_threads, 0, sizeof(_threads));
+        _armed_threads = 0;
+        _installed = false;
+        return Error::OK;
+    }
+
     if (!_in_new_tlab.install() || !_outside_tlab.install()) {
         return Error("Cannot install allocation breakpoints");
     }
@@ -128,6 +266,13 @@ Error AllocTracer::start(Arguments& args) {
 }
 
 void AllocTracer::stop() {
+    // Execution samples may still be polling threads, and must not install the traps again
+    _poll = false;
+    while (!__sync_bool_compare_and_swap(&_switching, 0, 1)) {
+        spinPause();
+    }
     _in_new_tlab.uninstall();
     _outside_tlab.uninstall();
+    _installed = false;
+    __sync_fetch_and_sub(&_switching, 1);
 }
@@ -23,6 +23,17 @@
 #include "trap.h"
 
 
+// Size of the open addressing table of threads watched in the allocpoll mode
+const int ALLOC_THREADS = 8192;
+
+// Allocated bytes of a thread at its last allocation sample; armed after the thread
+// has allocated one more interval, until its next TLAB refill is recorded
+struct AllocThread {
+    volatile int tid;
+    volatile bool armed;
+    u64 last_sample;
+};
+
 class AllocTracer : public Engine {
   private:
     static int _trap_kind;
@@ -30,10 +41,23 @@ class AllocTracer : public Engine {
     static Trap _outside_tlab;
 
     static u64 _interval;
+    static u64 _base_interval;
     static volatile u64 _allocated_bytes;
 
+    // allocpoll: execution samples read the allocated bytes of the current thread,
+    // and traps are installed only while some thread has crossed its next sampling point
+    static bool _poll;
+    static bool _installed;
+    static volatile int _armed_threads;
+    static volatile int _switching;
+    static AllocThread _threads[ALLOC_THREADS];
+
+    static AllocThread* findThread(int tid, bool add);
+    static void switchTraps();
     static void recordAllocation(void* ucontext, int event_type, uintptr_t rklass,
                                  uintptr_t total_size, uintptr_t instance_size);
+    static void recordPolledAllocation(void* ucontext, int event_type, uintptr_t rklass,
+                                       uintptr_t total_size, uintptr_t instance_size);
 
   public:
     const char* title() {
@@ -48,7 +72,16 @@ class AllocTracer : public Engine {
     Error start(Arguments& args);
     void stop();
 
-    static void trapHandler(int signo, siginfo_t* siginfo, void* ucontext);
+    long scaleInterval(double factor) {
+        _interval = (u64)(_base_interval * factor);
+        return (long)_interval;
+    }
+
+    static void trapHandler(Trap* trap, void* ucontext);
+
+    // Called in the signal handler of an execution sample of the current thread
+    static void pollThread(int tid);
+    static void removeThread(int tid);
 };
 
 #endif // _ALLOCTRACER_H
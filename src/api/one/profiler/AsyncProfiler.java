@@ -17,6 +17,8 @@
 package one.profiler;
 
 import java.io.IOException;
+import java.io.OutputStream;
+import java.nio.ByteBuffer;
 
 /**
  * Java API for in-process profiling. Serves as a wrapper around
@@ -25,6 +27,16 @@ import java.io.IOException;
  * libasyncProfiler.so.
  */
 public class AsyncProfiler implements AsyncProfilerMXBean {
+    private static final int STREAM_CHUNK_SIZE = 65536;
+
+    /** Indices of the counters filled by {@link #getStats(long[])} */
+    public static final int STAT_RUNNING = 0;
+    public static final int STAT_SAMPLES = 1;
+    public static final int STAT_FAILURES = 2;  // 12 entries, one per AsyncGetCallTrace failure type
+    public static final int STAT_STORAGE_OVERFLOW = 14;
+    public static final int STAT_JFR_BYTES = 15;
+    public static final int STAT_COUNT = 16;
+
     private static AsyncProfiler instance;
 
     private AsyncProfiler() {
@@ -98,6 +110,21 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
     @Override
     public native long getSamples();
 
+    /**
+     * Fill the given array with profiler counters, see STAT_* constants for the layout.
+     * Neither allocates nor waits for the profiler, so it is suitable for frequent polling.
+     * An array shorter than {@link #STAT_COUNT} receives only the first counters.
+     *
+     * @param stats Array to fill
+     * @return The number of counters the profiler provides
+     */
+    public int getStats(long[] stats) {
+        if (stats == null) {
+            throw new NullPointerException();
+        }
+        return getStats0(stats);
+    }
+
     /**
      * Get profiler agent version, e.g. "1.0"
      *
@@ -129,6 +156,48 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
         return execute0(command);
     }
 
+    /**
+     * Parse a profiling command once, so that it can be executed repeatedly
+     * with {@link #execute(long)} without parsing it again.
+     * The handle must be released with {@link #releaseCommand(long)}.
+     *
+     * @param command Profiling command, the same as for {@link #execute(String)}
+     * @return Handle of the parsed command
+     * @throws IllegalArgumentException If failed to parse the command
+     */
+    public long parseCommand(String command) throws IllegalArgumentException {
+        if (command == null) {
+            throw new NullPointerException();
+        }
+        return parseCommand0(command);
+    }
+
+    /**
+     * Execute a command previously parsed by {@link #parseCommand(String)}
+     *
+     * @param command Handle of the parsed command
+     * @return The command result
+     * @throws IOException If failed to create output file
+     */
+    public String execute(long command) throws IllegalStateException, IOException {
+        if (command == 0) {
+            throw new IllegalArgumentException("Invalid command handle");
+        }
+        return executeCommand0(command);
+    }
+
+    /**
+     * Free a command parsed by {@link #parseCommand(String)}.
+     * The handle must not be used afterwards.
+     *
+     * @param command Handle of the parsed command
+     */
+    public void releaseCommand(long command) {
+        if (command != 0) {
+            releaseCommand0(command);
+        }
+    }
+
     /**
      * Dump profile in 'collapsed stacktraces' format
      *
@@ -174,6 +243,61 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
         }
     }
 
+    /**
+     * Dump collapsed stack traces in a compact binary form directly into a direct ByteBuffer.
+     * The format is a list of traces, each one being a counter value and an array of frame IDs,
+     * followed by the table of frame names. See binaryProfile.h for the exact layout.
+     * <p>
+     * If the profile fits in the remaining space of the buffer, it is written
+     * at the current position, and the position is advanced past the profile.
+     * Otherwise the position stays the same, and the contents of the remaining space is undefined.
+     * In both cases the full size of the profile is returned.
+     *
+     * @param counter Which counter to store in the output
+     * @param buffer Direct buffer to write the profile to
+     * @return Size of the profile in bytes
+     * @throws IllegalArgumentException If the buffer is not direct
+     */
+    public long dumpBinary(Counter counter, ByteBuffer buffer) {
+        if (!buffer.isDirect()) {
+            throw new IllegalArgumentException("Direct buffer required");
+        }
+        int position = buffer.position();
+        int limit = buffer.limit();
+        long size = dumpBinary0("binary," + counter.name().toLowerCase(), buffer, position, limit);
+        if (size <= limit - position) {
+            buffer.position(position + (int) size);
+        }
+        return size;
+    }
+
+    /**
+     * Stream collapsed stack traces in the binary form of {@link #dumpBinary(Counter, ByteBuffer)}
+     * to the given OutputStream in fixed-size pieces. The stream is called while
+     * the profiler is locked, so it must not use the profiler API itself.
+     *
+     * @param counter Which counter to store in the output
+     * @param out Stream to write the profile to
+     * @throws IOException If the stream fails to write
+     */
+    public void dumpBinary(Counter counter, OutputStream out) throws IOException {
+        if (out == null) {
+            throw new NullPointerException();
+        }
+        dumpBinary1("binary," + counter.name().toLowerCase(), out, new byte[STREAM_CHUNK_SIZE]);
+    }
+
+    /**
+     * Set the context of the current thread, e.g. the ID of the request or the trace span
+     * it is working on. JFR execution and allocation events carry the context ID,
+     * and with the 'context' option, only threads with a nonzero context are sampled.
+     *
+     * @param contextId Context ID, or 0 to clear the context
+     */
+    public void setContext(long contextId) {
+        setContext0(contextId);
+    }
+
     /**
      * Add the given thread to the set of profiled threads.
      * 'filter' option must be enabled to use this method.
@@ -211,5 +335,12 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
     private native void start0(String event, long interval, boolean reset) throws IllegalStateException;
     private native void stop0() throws IllegalStateException;
     private native String execute0(String command) throws IllegalArgumentException, IllegalStateException, IOException;
+    private native long parseCommand0(String command) throws IllegalArgumentException;
+    private native String executeCommand0(long command) throws IllegalStateException, IOException;
+    private native void releaseCommand0(long command);
+    private native int getStats0(long[] stats);
     private native void filterThread0(Thread thread, boolean enable);
+    private native void setContext0(long contextId);
+    private native long dumpBinary0(String command, ByteBuffer buffer, int position, int limit);
+    private native void dumpBinary1(String command, OutputStream out, byte[] chunk) throws IOException;
 }
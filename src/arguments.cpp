@@ -59,35 +59,106 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     dump             - dump collected data without stopping profiling session
 //     check            - check if the specified profiling event is available
 //     status           - print profiling status (inactive / running for X seconds)
+//     metrics          - print profiler overhead counters in Prometheus text format
 //     list             - show the list of available profiling events
 //     version[=full]   - display the agent version
-//     event=EVENT      - which event to trace (cpu, wall, cache-misses, etc.)
+//     event=EVENT      - which event to trace (cpu, wall, offcpu, cache-misses, etc.)
+//                        repeat to sample several perf events at once, e.g. event=cycles,event=cache-misses;
+//                        interval applies to the first one, the others use their default intervals
+//                        or several Java methods: event=com.foo.*.handle*,event=com.foo.Bar.run
 //     alloc[=BYTES]    - profile allocations with BYTES interval
+//     sampledalloc     - sample allocations with JVM TI SampledObjectAlloc (JDK 11+)
+//                        instead of breakpoints in libjvm; does not need HotSpot debug symbols
+//     allocpoll        - with alloc and an execution event, install allocation breakpoints only
+//                        while a thread sampled by that event has allocated another interval
+//     live[=N]         - with alloc or nativemem, track up to N sampled allocations (default 1024)
+//                        and dump only those still alive, i.e. potential memory leaks;
+//                        implies sampledalloc
 //     lock[=DURATION]  - profile contended locks longer than DURATION ns
+//     lockstats        - with lock, aggregate wait time per lock class and call site
+//                        for the "Contention by lock" section of the text output
+//     callcount        - with a Java method event, only count calls without recording stack traces;
+//                        with a perf event (e.g. a breakpoint or uprobe), count every hit per thread
+//     latency          - with lock, build a histogram of wait times per call trace;
+//                        with a Java method event, time every call of the instrumented methods
+//     nativemem[=BYTES] - profile malloc/calloc/realloc and anonymous mmap of native libraries
+//                        with BYTES interval (default 512k)
 //     collapsed        - dump collapsed stacks (the format used by FlameGraph script)
 //     flamegraph       - produce Flame Graph in HTML format
 //     tree             - produce call tree in HTML format
+//     binary           - dump collapsed stacks in the compact binary form described in binaryProfile.h
+//     pprof            - dump gzip compressed profile in the pprof (profile.proto) format
 //     jfr              - dump events in Java Flight Recorder format
 //     jfrsync[=CONFIG] - start Java Flight Recording with the given config along with the profiler 
 //     traces[=N]       - dump top N call traces
 //     flat[=N]         - dump top N methods (aka flat profile)
 //     samples          - count the number of samples (default)
 //     total            - count the total value (time, bytes, etc.) instead of samples
+//     delta            - dump only the counts added since the previous delta dump
+//                        (collapsed, flamegraph, tree, binary and pprof output)
 //     chunksize=N      - approximate size of JFR chunk in bytes (default: 100 MB)
 //     chunktime=N      - duration of JFR chunk in seconds (default: 1 hour)
+//     compress         - gzip every JFR chunk separately (implied by file=*.jfr.gz)
+//     nocache          - drop written JFR data from the page cache, so that it does not evict application data
+//     allocbatch[=TIME]- merge consecutive JFR allocation samples of a thread with the same stack trace and class
+//                        into one profiler.AllocationBatch event per TIME window (10ms by default)
+//     maxsize=N        - keep only the last N bytes of JFR chunks; the file is written on dump/stop
+//     maxage=N         - keep only JFR chunks of the last N seconds; the file is written on dump/stop
+//     monitor=N        - period of JFR CPU load and process statistics events in ns (default: 1s)
 //     timeout=TIME     - automatically stop profiler at TIME (absolute or relative)
 //     loop=TIME        - run profiler in a loop (continuous profiling)
+//     rotate=TIME      - continuous profiling without restarts: every TIME, write the samples
+//                        of the last interval to file and keep recording; implies delta
+//     rotatefiles=N    - with rotate, cycle %n in the file name through 0..N-1 (default: unlimited)
 //     interval=N       - sampling interval in ns (default: 10'000'000, i.e. 10 ms)
 //     jstackdepth=N    - maximum Java stack depth (default: 2048)
+//     concurrency=N    - number of sample slots (default: number of CPUs, but not less than 16)
 //     safemode=BITS    - disable stack recovery techniques (default: 0, i.e. everything enabled)
-//     file=FILENAME    - output file name for dumping
+//     wallthreads=N    - number of threads signaled per tick by the wall clock sampler
+//                        (on OpenJ9: number of threads walked per tick, default: all threads)
+//                        (default: adapted to the measured cost of the signal handler)
+//     wallsamplers=N   - number of threads sending wall clock signals (default: 1 per 1024 threads, up to 4)
+//     overhead=PCT     - keep time spent in sampling handlers below PCT percent of one CPU
+//                        by increasing interval, alloc and lock thresholds when needed
+//     memlimit=SIZE    - keep call traces, dictionaries and JFR buffers within SIZE bytes:
+//                        when approaching the limit, truncate deep stacks, then merge new traces,
+//                        then sample less often
+//     file=FILENAME    - output file name for dumping;
+//                        tcp://host:port or unix:/path streams finished JFR chunks to a collector
 //     log=FILENAME     - log warnings and errors to the given dedicated stream
 //     loglevel=LEVEL   - logging level: TRACE, DEBUG, INFO, WARN, ERROR, or NONE
 //     filter=FILTER    - thread filter
+//     context          - record only samples of threads with a context set by AsyncProfiler.setContext();
+//                        JFR execution and allocation events carry the context ID in any case
 //     threads          - profile different threads separately
 //     sched            - group threads by scheduling policy
+//     pauses           - time GC pauses and mark samples taken during a GC or at a safepoint
+//     threadcpu        - measure CPU time of every thread to compare with its samples
+//     numa             - place per-CPU sample buffers on the NUMA node of their CPU
+//     vmwalker         - walk Java stacks using VMStructs instead of AsyncGetCallTrace
+//     tracetrie        - store call traces in a prefix tree to save memory on deep stacks
+//     fold             - aggregate samples into a call tree right away instead of storing traces
+//                        (flamegraph and tree output only)
+//     leafdepth=N      - store only N innermost frames per trace and share the outer frames
+//                        of deeper traces as root segments
+//     hugepages        - back call trace storage with transparent huge pages
+//     symbols=MODE     - when to parse symbols of native libraries: 'eager' (default) or 'lazy',
+//                        i.e. on demand while dumping results
+//     preload          - with -agentpath, do not delay JVM startup: initialize the agent
+//                        in a background thread after VM init, so that later commands start at once
+//     symcache=DIR     - directory to cache parsed symbols and unwind tables of native libraries and the kernel
+//     namecache        - keep resolved Java and native frame names between dumps (e.g. in loop mode)
+//     rawpc            - record native frames as raw addresses and resolve them in bulk at dump time
 //     cstack=MODE      - how to collect C stack frames in addition to Java stack
-//                        MODE is 'fp' (Frame Pointer), 'dwarf', 'lbr' (Last Branch Record) or 'no'
+//                        MODE is 'fp' (Frame Pointer), 'dwarf', 'lbr' (Last Branch Record), 'no'
+//                        'auto' (FP in libraries with frame pointers, DWARF elsewhere)
+//                        or 'vm' (like 'auto', walking native and Java frames in one pass)
+//     stackcopy[=SIZE] - copy the top SIZE bytes of the stack (16k by default, up to 64k) in the signal
+//                        handler and unwind native frames of execution samples later on a separate thread
+//     perfbatch        - collect perf_event samples from mmap rings in batches instead of one signal
+//                        per sample; Java frames are not walked in this mode
+//     percpu           - open one perf_event per CPU for the process cgroup instead of one per thread;
+//                        implies perfbatch
 //     allkernel        - include only kernel-mode events
 //     alluser          - include only user-mode events
 //     fdtransfer       - use fdtransfer to pass fds to the profiler
@@ -100,6 +171,7 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     exclude=PATTERN  - exclude stack traces containing PATTERN
 //     begin=FUNCTION   - begin profiling when FUNCTION is executed
 //     end=FUNCTION     - end profiling when FUNCTION is executed
+//     threadwindow     - with begin/end, profile only the thread between its own begin and end
 //     title=TITLE      - FlameGraph title
 //     minwidth=PCT     - FlameGraph minimum frame width in percent
 //     reverse          - generate stack-reversed FlameGraph / Call tree
@@ -145,6 +217,9 @@ Error Arguments::parse(const char* args) {
             CASE("status")
                 _action = ACTION_STATUS;
 
+            CASE("metrics")
+                _action = ACTION_METRICS;
+
             CASE("list")
                 _action = ACTION_LIST;
 
@@ -161,6 +236,12 @@ Error Arguments::parse(const char* args) {
             CASE("tree")
                 _output = OUTPUT_TREE;
 
+            CASE("binary")
+                _output = OUTPUT_BINARY;
+
+            CASE("pprof")
+                _output = OUTPUT_PPROF;
+
             CASE("jfr")
                 _output = OUTPUT_JFR;
                 if (value != NULL) {
@@ -186,6 +267,9 @@ Error Arguments::parse(const char* args) {
             CASE("total")
                 _counter = COUNTER_TOTAL;
 
+            CASE("delta")
+                _delta = true;
+
             CASE("chunksize")
                 if (value == NULL || (_chunk_size = parseUnits(value, BYTES)) < 0) {
                     msg = "Invalid chunksize";
@@ -196,6 +280,33 @@ Error Arguments::parse(const char* args) {
                     msg = "Invalid chunktime";
                 }
 
+            CASE("compress")
+                _jfr_compress = true;
+
+            CASE("nocache")
+                _jfr_nocache = true;
+
+            CASE("allocbatch")
+                _alloc_batch = value == NULL ? 10000000 : parseUnits(value, NANOS);
+                if (_alloc_batch <= 0) {
+                    msg = "Invalid allocbatch";
+                }
+
+            CASE("maxsize")
+                if (value == NULL || (_jfr_max_size = parseUnits(value, BYTES)) <= 0) {
+                    msg = "Invalid maxsize";
+                }
+
+            CASE("maxage")
+                if (value == NULL || (_jfr_max_age = parseUnits(value, SECONDS)) <= 0) {
+                    msg = "Invalid maxage";
+                }
+
+            CASE("monitor")
+                if (value == NULL || (_monitor_period = parseUnits(value, NANOS)) <= 0) {
+                    msg = "Invalid monitor";
+                }
+
             // Basic options
             CASE("event")
                 if (value == NULL || value[0] == 0) {
@@ -205,7 +316,8 @@ Error Arguments::parse(const char* args) {
                 } else if (strcmp(value, EVENT_LOCK) == 0) {
                     if (_lock <= 0) _lock = 1;
                 } else if (_event != NULL) {
-                    msg = "Duplicate event argument";
+                    // Only perf events or Java methods can be combined; this is verified when the profiler starts
+                    appendToEmbeddedList(_extra_events, value);
                 } else {
                     _event = value;
                 }
@@ -221,18 +333,55 @@ Error Arguments::parse(const char* args) {
                     msg = "Invalid loop duration";
                 }
 
+            CASE("rotate")
+                if (value == NULL || (_rotate = (int)parseUnits(value, SECONDS)) <= 0 || !_persistent) {
+                    msg = "Invalid rotate interval";
+                }
+
+            CASE("rotatefiles")
+                if (value == NULL || (_rotate_files = atoi(value)) <= 0) {
+                    msg = "rotatefiles must be > 0";
+                }
+
             CASE("alloc")
                 _alloc = value == NULL ? 1 : parseUnits(value, BYTES);
                 if (_alloc < 0) {
                     msg = "alloc must be >= 0";
                 }
 
+            CASE("sampledalloc")
+                _sampled_alloc = true;
+
+            CASE("allocpoll")
+                _alloc_poll = true;
+
+            CASE("live")
+                _live = value == NULL ? 1024 : atoi(value);
+                if (_live <= 0) {
+                    msg = "live must be > 0";
+                }
+
+            CASE("nativemem")
+                _nativemem = value == NULL ? 512 * 1024 : parseUnits(value, BYTES);
+                if (_nativemem < 0) {
+                    msg = "nativemem must be >= 0";
+                }
+
             CASE("lock")
                 _lock = value == NULL ? 1 : parseUnits(value, NANOS);
                 if (_lock < 0) {
                     msg = "lock must be >= 0";
                 }
 
+            CASE("lockstats")
+                _lock_stats = true;
+
+            CASE("callcount")
+                _call_count = true;
+
+            CASE("latency")
+                _latency = true;
+
             CASE("interval")
                 if (value == NULL || (_interval = parseUnits(value, UNIVERSAL)) <= 0) {
                     msg = "Invalid interval";
@@ -243,6 +392,31 @@ Error Arguments::parse(const char* args) {
                     msg = "jstackdepth must be > 0";
                 }
 
+            CASE("concurrency")
+                if (value == NULL || (_concurrency = atoi(value)) <= 0) {
+                    msg = "concurrency must be > 0";
+                }
+
+            CASE("wallthreads")
+                if (value == NULL || (_wall_threads = atoi(value)) <= 0) {
+                    msg = "wallthreads must be > 0";
+                }
+
+            CASE("wallsamplers")
+                if (value == NULL || (_wall_samplers = atoi(value)) <= 0) {
+                    msg = "wallsamplers must be > 0";
+                }
+
+            CASE("overhead")
+                if (value == NULL || (_overhead = atof(value)) <= 0 || _overhead > 100) {
+                    msg = "overhead must be between 0 and 100";
+                }
+
+            CASE("memlimit")
+                if (value == NULL || (_mem_limit = parseUnits(value, BYTES)) <= 0) {
+                    msg = "Invalid memlimit";
+                }
+
             CASE("safemode")
                 _safe_mode = value == NULL ? INT_MAX : (int)strtol(value, NULL, 0);
 
@@ -269,6 +443,9 @@ Error Arguments::parse(const char* args) {
             CASE("filter")
                 _filter = value == NULL ? "" : value;
 
+            CASE("context")
+                _context = true;
+
             CASE("include")
                 if (value != NULL) appendToEmbeddedList(_include, value);
 
@@ -278,9 +455,56 @@ Error Arguments::parse(const char* args) {
             CASE("threads")
                 _threads = true;
 
+            CASE("threadcpu")
+                _thread_cpu = true;
+
+            CASE("numa")
+                _numa = true;
+
+            CASE("vmwalker")
+                _vm_walker = true;
+
             CASE("sched")
                 _sched = true;
 
+            CASE("pauses")
+                _pauses = true;
+
+            CASE("tracetrie")
+                _trace_trie = true;
+
+            CASE("fold")
+                _fold = true;
+
+            CASE("leafdepth")
+                if (value == NULL || (_leaf_depth = atoi(value)) <= 0) {
+                    msg = "leafdepth must be > 0";
+                }
+
+            CASE("hugepages")
+                _huge_pages = true;
+
+            CASE("symbols")
+                if (value == NULL || (strcmp(value, "lazy") != 0 && strcmp(value, "eager") != 0)) {
+                    msg = "symbols must be 'lazy' or 'eager'";
+                }
+                _lazy_symbols = value != NULL && strcmp(value, "lazy") == 0;
+
+            CASE("preload")
+                _preload = true;
+
+            CASE("namecache")
+                _name_cache = true;
+
+            CASE("rawpc")
+                _raw_pc = true;
+
+            CASE("symcache")
+                if (value == NULL || value[0] == 0) {
+                    msg = "symcache must not be empty";
+                }
+                _symbol_cache = value;
+
             CASE("allkernel")
                 _ring = RING_KERNEL;
 
@@ -295,11 +519,28 @@ Error Arguments::parse(const char* args) {
                         _cstack = CSTACK_DWARF;
                     } else if (value[0] == 'l') {
                         _cstack = CSTACK_LBR;
+                    } else if (value[0] == 'a') {
+                        _cstack = CSTACK_AUTO;
+                    } else if (value[0] == 'v') {
+                        _cstack = CSTACK_VM;
                     } else {
                         _cstack = CSTACK_FP;
                     }
                 }
 
+            CASE("stackcopy")
+                if (value == NULL) {
+                    _stack_copy = 16 * 1024;
+                } else if ((_stack_copy = parseUnits(value, BYTES)) <= 0 || _stack_copy > 64 * 1024) {
+                    msg = "stackcopy must be between 1 and 64k bytes";
+                }
+
+            CASE("perfbatch")
+                _perf_batch = true;
+
+            CASE("percpu")
+                _perf_per_cpu = true;
+
             // Output style modifiers
             CASE("simple")
                 _style |= STYLE_SIMPLE;
@@ -322,6 +563,9 @@ Error Arguments::parse(const char* args) {
             CASE("end")
                 _end = value;
 
+            CASE("threadwindow")
+                _thread_window = true;
+
             // FlameGraph options
             CASE("title")
                 _title = value;
@@ -342,7 +586,7 @@ Error Arguments::parse(const char* args) {
         return Error(msg);
     }
 
-    if (_event == NULL && _alloc == 0 && _lock == 0) {
+    if (_event == NULL && _alloc == 0 && _lock == 0 && _nativemem == 0) {
         _event = EVENT_CPU;
     }
 
@@ -359,12 +603,22 @@ Error Arguments::parse(const char* args) {
         _action = ACTION_DUMP;
     }
 
+    if (_rotate > 0) {
+        if (_loop) {
+            return Error("rotate cannot be combined with loop");
+        } else if (_file == NULL || _output == OUTPUT_TEXT || _output == OUTPUT_JFR) {
+            return Error("rotate requires file with collapsed, flamegraph, tree, binary or pprof output");
+        }
+        _delta = true;
+    }
+
     return Error::OK;
 }
 
 const char* Arguments::file() {
     if (_file != NULL && strchr(_file, '%') != NULL) {
-        return expandFilePattern(_buf, EXTRA_BUF_SIZE - 1, _file);
+        return expandFilePattern(_buf, EXTRA_BUF_SIZE - 1, _file,
+                                 _rotate_files > 0 ? _rotation % _rotate_files : _rotation);
     }
     return _file;
 }
@@ -386,7 +640,8 @@ long long Arguments::hash(const char* arg) {
 
 // Expands %p to the process id
 //         %t to the timestamp
-const char* Arguments::expandFilePattern(char* dest, size_t max_size, const char* pattern) {
+//         %n to the index of the file in rotate mode
+const char* Arguments::expandFilePattern(char* dest, size_t max_size, const char* pattern, int index) {
     char* ptr = dest;
     char* end = dest + max_size - 1;
 
@@ -407,6 +662,9 @@ const char* Arguments::expandFilePattern(char* dest, size_t max_size, const char
                                 t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
                                 t.tm_hour, t.tm_min, t.tm_sec);
                 continue;
+            } else if (c == 'n') {
+                ptr += snprintf(ptr, end - ptr, "%d", index);
+                continue;
             } else if (c == '{') {
                 char env_key[128];
                 const char* p = strchr(pattern, '}');
@@ -430,12 +688,21 @@ const char* Arguments::expandFilePattern(char* dest, size_t max_size, const char
 }
 
 Output Arguments::detectOutputFormat(const char* file) {
+    if (strncmp(file, "tcp://", 6) == 0 || strncmp(file, "unix:", 5) == 0) {
+        // Only JFR can be streamed
+        return OUTPUT_JFR;
+    }
+
     const char* ext = strrchr(file, '.');
     if (ext != NULL) {
         if (strcmp(ext, ".html") == 0) {
             return OUTPUT_FLAMEGRAPH;
         } else if (strcmp(ext, ".jfr") == 0) {
             return OUTPUT_JFR;
+        } else if (strcmp(ext, ".gz") == 0 && ext - file >= 4 && strncmp(ext - 4, ".jfr", 4) == 0) {
+            return OUTPUT_JFR;
+        } else if (strcmp(ext, ".pprof") == 0 || (strcmp(ext, ".gz") == 0 && ext - file >= 3 && strncmp(ext - 3, ".pb", 3) == 0)) {
+            return OUTPUT_PPROF;
         } else if (strcmp(ext, ".collapsed") == 0 || strcmp(ext, ".folded") == 0) {
             return OUTPUT_COLLAPSED;
         } else if (strcmp(ext, ".svg") == 0) {
@@ -28,6 +28,7 @@ const char* const EVENT_ALLOC  = "alloc";
 const char* const EVENT_LOCK   = "lock";
 const char* const EVENT_WALL   = "wall";
 const char* const EVENT_ITIMER = "itimer";
+const char* const EVENT_OFFCPU = "offcpu";
 
 enum Action {
     ACTION_NONE,
@@ -37,6 +38,7 @@ enum Action {
     ACTION_DUMP,
     ACTION_CHECK,
     ACTION_STATUS,
+    ACTION_METRICS,
     ACTION_LIST,
     ACTION_VERSION,
     ACTION_FULL_VERSION
@@ -66,7 +68,9 @@ enum CStack {
     CSTACK_NO,
     CSTACK_FP,
     CSTACK_DWARF,
-    CSTACK_LBR
+    CSTACK_LBR,
+    CSTACK_AUTO,
+    CSTACK_VM
 };
 
 enum Output {
@@ -76,7 +80,9 @@ enum Output {
     OUTPUT_COLLAPSED,
     OUTPUT_FLAMEGRAPH,
     OUTPUT_TREE,
-    OUTPUT_JFR
+    OUTPUT_JFR,
+    OUTPUT_BINARY,
+    OUTPUT_PPROF
 };
 
 enum JfrOption {
@@ -124,7 +130,7 @@ class Arguments {
     void appendToEmbeddedList(int& list, char* value);
 
     static long long hash(const char* arg);
-    static const char* expandFilePattern(char* dest, size_t max_size, const char* pattern);
+    static const char* expandFilePattern(char* dest, size_t max_size, const char* pattern, int index);
     static Output detectOutputFormat(const char* file);
     static long parseUnits(const char* str, const Multiplier* multipliers);
     static int parseTimeout(const char* str);
@@ -134,35 +140,76 @@ class Arguments {
     Counter _counter;
     Ring _ring;
     const char* _event;
+    int _extra_events;
     int _timeout;
+    int _rotate;
+    int _rotate_files;
+    int _rotation;
     long _interval;
     long _alloc;
     long _lock;
+    long _nativemem;
     int  _jstackdepth;
+    int  _concurrency;
     int _safe_mode;
+    int _wall_threads;
+    int _wall_samplers;
+    double _overhead;
+    long _mem_limit;
     const char* _file;
     const char* _log;
     const char* _loglevel;
     const char* _unknown_arg;
     const char* _filter;
+    bool _context;
     int _include;
     int _exclude;
     bool _loop;
     bool _threads;
     bool _sched;
+    bool _pauses;
+    bool _trace_trie;
+    bool _fold;
+    int _leaf_depth;
+    bool _huge_pages;
+    bool _lazy_symbols;
+    bool _preload;
+    const char* _symbol_cache;
+    bool _name_cache;
+    bool _raw_pc;
     bool _fdtransfer;
     const char* _fdtransfer_path;
     int _style;
     CStack _cstack;
+    bool _perf_batch;
+    bool _perf_per_cpu;
+    bool _sampled_alloc;
+    bool _alloc_poll;
+    int _live;
+    bool _lock_stats;
+    bool _call_count;
+    bool _latency;
     Output _output;
     long _chunk_size;
     long _chunk_time;
     const char* _jfr_sync;
     int _jfr_options;
+    bool _jfr_compress;
+    bool _jfr_nocache;
+    long _jfr_max_size;
+    long _jfr_max_age;
+    long _alloc_batch;
+    long _monitor_period;
     int _dump_traces;
     int _dump_flat;
+    bool _delta;
     const char* _begin;
     const char* _end;
+    bool _thread_window;
+    bool _thread_cpu;
+    bool _numa;
+    bool _vm_walker;
+    int _stack_copy;
     // FlameGraph parameters
     const char* _title;
     double _minwidth;
@@ -176,35 +223,76 @@ class Arguments {
         _counter(COUNTER_SAMPLES),
         _ring(RING_ANY),
         _event(NULL),
+        _extra_events(0),
         _timeout(0),
+        _rotate(0),
+        _rotate_files(0),
+        _rotation(0),
         _interval(0),
         _alloc(0),
         _lock(0),
+        _nativemem(0),
         _jstackdepth(DEFAULT_JSTACKDEPTH),
+        _concurrency(0),
         _safe_mode(0),
+        _wall_threads(0),
+        _wall_samplers(0),
+        _overhead(0),
+        _mem_limit(0),
         _file(NULL),
         _log(NULL),
         _loglevel(NULL),
         _unknown_arg(NULL),
         _filter(NULL),
+        _context(false),
         _include(0),
         _exclude(0),
         _loop(false),
         _threads(false),
         _sched(false),
+        _pauses(false),
+        _trace_trie(false),
+        _fold(false),
+        _leaf_depth(0),
+        _huge_pages(false),
+        _lazy_symbols(false),
+        _preload(false),
+        _symbol_cache(NULL),
+        _name_cache(false),
+        _raw_pc(false),
         _fdtransfer(false),
         _fdtransfer_path(NULL),
         _style(0),
         _cstack(CSTACK_DEFAULT),
+        _perf_batch(false),
+        _perf_per_cpu(false),
+        _sampled_alloc(false),
+        _alloc_poll(false),
+        _live(0),
+        _lock_stats(false),
+        _call_count(false),
+        _latency(false),
         _output(OUTPUT_NONE),
         _chunk_size(100 * 1024 * 1024),
         _chunk_time(3600),
         _jfr_sync(NULL),
         _jfr_options(0),
+        _jfr_compress(false),
+        _jfr_nocache(false),
+        _jfr_max_size(0),
+        _jfr_max_age(0),
+        _alloc_batch(0),
+        _monitor_period(0),
         _dump_traces(0),
         _dump_flat(0),
+        _delta(false),
         _begin(NULL),
         _end(NULL),
+        _thread_window(false),
+        _thread_cpu(false),
+        _numa(false),
+        _vm_walker(false),
+        _stack_copy(0),
         _title(NULL),
         _minwidth(0),
         _reverse(false) {
@@ -228,6 +316,8 @@ class Arguments {
     }
 
     friend class FrameName;
+    friend class Instrument;
+    friend class PerfEvents;
     friend class Recording;
 };
 
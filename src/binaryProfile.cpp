@@ -0,0 +1,85 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "binaryProfile.h"
+#include "frameName.h"
+
+
+BinaryProfile::BinaryProfile(std::ostream& out, Counter counter) : _out(out) {
+    _buf.assign("ASPB", 4);
+    _buf.push_back((char)VERSION);
+    putVarint(_buf, counter == COUNTER_TOTAL ? 1 : 0);
+    _out.write(_buf.data(), _buf.size());
+}
+
+void BinaryProfile::putVarint(std::string& buf, u64 value) {
+    while (value > 0x7f) {
+        buf.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    buf.push_back((char)value);
+}
+
+u32 BinaryProfile::internName(const char* name) {
+    std::map<std::string, u32>::iterator it = _name_ids.lower_bound(name);
+    if (it != _name_ids.end() && it->first == name) {
+        return it->second;
+    }
+
+    u32 id = _name_ids.size();
+    _name_ids.insert(it, std::map<std::string, u32>::value_type(name, id));
+
+    size_t length = strlen(name);
+    putVarint(_name_table, length);
+    _name_table.append(name, length);
+    return id;
+}
+
+u32 BinaryProfile::frameId(FrameName& fn, ASGCT_CallFrame& frame) {
+    u64 key2 = frame.bci < 0 ? (u32)frame.bci : 1ULL << 32 | FrameType::decode(frame.bci);
+
+    u32 id;
+    if (!_frame_ids.get((u64)(uintptr_t)frame.method_id, key2, id)) {
+        id = internName(fn.name(frame));
+        _frame_ids.put((u64)(uintptr_t)frame.method_id, key2, id);
+    }
+    return id;
+}
+
+void BinaryProfile::addTrace(u64 value, int num_frames, const u32* name_ids) {
+    if (num_frames <= 0) {
+        return;
+    }
+
+    _buf.clear();
+    putVarint(_buf, num_frames);
+    putVarint(_buf, value);
+    for (int i = 0; i < num_frames; i++) {
+        putVarint(_buf, name_ids[i]);
+    }
+    _out.write(_buf.data(), _buf.size());
+}
+
+void BinaryProfile::finish() {
+    _buf.clear();
+    putVarint(_buf, 0);
+    putVarint(_buf, _name_ids.size());
+    _out.write(_buf.data(), _buf.size());
+    _out.write(_name_table.data(), _name_table.size());
+    _out.flush();
+}
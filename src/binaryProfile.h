@@ -0,0 +1,65 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BINARYPROFILE_H
+#define _BINARYPROFILE_H
+
+#include <iostream>
+#include <map>
+#include <string>
+#include "arch.h"
+#include "arguments.h"
+#include "pairMap.h"
+#include "vmEntry.h"
+
+
+class FrameName;
+
+// Compact binary form of collapsed stacks, written as traces are added,
+// so that the whole profile never exists in memory as text.
+// All integers are unsigned LEB128 varints.
+//
+//   header:  "ASPB" version:u8 counter:varint (0 = samples, 1 = total)
+//   traces:  { depth:varint value:varint name_id:varint[depth] }*  depth = 0 terminates the list
+//   names:   count:varint { length:varint utf8:byte[length] }*
+//
+// Frames of a trace go from the root to the leaf. Name ids index the frame table
+// that follows the traces, since names become known only while traces are written.
+class BinaryProfile {
+  private:
+    std::ostream& _out;
+    std::map<std::string, u32> _name_ids;
+    PairMap _frame_ids;
+    std::string _name_table;
+    std::string _buf;
+
+    static void putVarint(std::string& buf, u64 value);
+    u32 internName(const char* name);
+
+  public:
+    static const u8 VERSION = 1;
+
+    BinaryProfile(std::ostream& out, Counter counter);
+
+    // Same interning rules as FlameGraph::frameId
+    u32 frameId(FrameName& fn, ASGCT_CallFrame& frame);
+
+    void addTrace(u64 value, int num_frames, const u32* name_ids);
+
+    void finish();
+};
+
+#endif // _BINARYPROFILE_H
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BUFFER_H
+#define _BUFFER_H
+
+#include <arpa/inet.h>
+#include <string.h>
+#include "arch.h"
+#include "os.h"
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+// The branch-free varint encoder writes bytes in little-endian order with a single store
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define FAST_VARINT
+#endif
+
+
+const int BUFFER_SIZE = 1024;
+const int BUFFER_LIMIT = BUFFER_SIZE - 128;
+const int RECORDING_BUFFER_SIZE = 65536;
+const int RECORDING_BUFFER_LIMIT = RECORDING_BUFFER_SIZE - 4096;
+const int MAX_STRING_LENGTH = 8191;
+
+
+class Buffer {
+  private:
+    int _offset;
+    char _data[BUFFER_SIZE - sizeof(int)];
+
+  public:
+    Buffer() : _offset(0) {
+    }
+
+    const char* data() const {
+        return _data;
+    }
+
+    int offset() const {
+        return _offset;
+    }
+
+    int skip(int delta) {
+        int offset = _offset;
+        _offset = offset + delta;
+        return offset;
+    }
+
+    void reset() {
+        _offset = 0;
+    }
+
+    void put(const char* v, u32 len) {
+        memcpy(_data + _offset, v, len);
+        _offset += (int)len;
+    }
+
+    void put8(char v) {
+        _data[_offset++] = v;
+    }
+
+    void put16(short v) {
+        *(short*)(_data + _offset) = htons(v);
+        _offset += 2;
+    }
+
+    void put32(int v) {
+        *(int*)(_data + _offset) = htonl(v);
+        _offset += 4;
+    }
+
+    void put64(u64 v) {
+        *(u64*)(_data + _offset) = OS::hton64(v);
+        _offset += 8;
+    }
+
+    void putFloat(float v) {
+        union {
+            float f;
+            int i;
+        } u;
+
+        u.f = v;
+        put32(u.i);
+    }
+
+#ifdef FAST_VARINT
+    // Values up to 56 bits are encoded with one unaligned 8-byte store;
+    // the bytes past the encoded length are overwritten by subsequent puts.
+    // Relies on the headroom every buffer keeps above its flush limit
+    void putVar32(u32 v) {
+        putVarFast(v);
+    }
+
+    void putVar64(u64 v) {
+        if (v < (1ULL << 56)) {
+            putVarFast(v);
+        } else {
+            putVarSlow(v);
+        }
+    }
+
+    void putVarFast(u64 v) {
+        int len = (70 - __builtin_clzll(v | 1)) / 7;
+        u64 encoded = spreadBits(v) | (0x0080808080808080ULL >> (64 - 8 * len));
+        memcpy(_data + _offset, &encoded, 8);
+        _offset += len;
+    }
+
+    // Spreads the low 56 bits of v into 8 groups of 7 bits, one per byte
+    static u64 spreadBits(u64 v) {
+#ifdef __BMI2__
+        return _pdep_u64(v, 0x7f7f7f7f7f7f7f7fULL);
+#else
+        return (v & 0x7f)
+            | (v << 1 & 0x7f00ULL)
+            | (v << 2 & 0x7f0000ULL)
+            | (v << 3 & 0x7f000000ULL)
+            | (v << 4 & 0x7f00000000ULL)
+            | (v << 5 & 0x7f0000000000ULL)
+            | (v << 6 & 0x7f000000000000ULL)
+            | (v << 7 & 0x7f00000000000000ULL);
+#endif
+    }
+#else
+    void putVar32(u32 v) {
+        while (v > 0x7f) {
+            _data[_offset++] = (char)v | 0x80;
+            v >>= 7;
+        }
+        _data[_offset++] = (char)v;
+    }
+
+    void putVar64(u64 v) {
+        putVarSlow(v);
+    }
+#endif
+
+    void putVarSlow(u64 v) {
+        int iter = 0;
+        while (v > 0x1fffff) {
+            _data[_offset++] = (char)v | 0x80; v >>= 7;
+            _data[_offset++] = (char)v | 0x80; v >>= 7;
+            _data[_offset++] = (char)v | 0x80; v >>= 7;
+            if (++iter == 3) return;
+        }
+        while (v > 0x7f) {
+            _data[_offset++] = (char)v | 0x80;
+            v >>= 7;
+        }
+        _data[_offset++] = (char)v;
+    }
+
+    void putUtf8(const char* v) {
+        if (v == NULL) {
+            put8(0);
+        } else {
+            size_t len = strlen(v);
+            putUtf8(v, len < MAX_STRING_LENGTH ? len : MAX_STRING_LENGTH);
+        }
+    }
+
+    void putUtf8(const char* v, u32 len) {
+        put8(3);
+        putVar32(len);
+        put(v, len);
+    }
+
+    void put8(int offset, char v) {
+        _data[offset] = v;
+    }
+
+    void putVar32(int offset, u32 v) {
+        _data[offset] = v | 0x80;
+        _data[offset + 1] = (v >> 7) | 0x80;
+        _data[offset + 2] = (v >> 14) | 0x80;
+        _data[offset + 3] = (v >> 21) | 0x80;
+        _data[offset + 4] = (v >> 28);
+    }
+};
+
+class RecordingBuffer : public Buffer {
+  private:
+    char _buf[RECORDING_BUFFER_SIZE - sizeof(Buffer)];
+
+  public:
+    RecordingBuffer() : Buffer() {
+    }
+};
+
+#endif // _BUFFER_H
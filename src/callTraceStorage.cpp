@@ -14,9 +14,13 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "callTraceStorage.h"
+#include "counters.h"
+#include "methodTable.h"
 #include "os.h"
+#include "pairMap.h"
 
 
 static const u32 INITIAL_CAPACITY = 65536;
@@ -32,9 +36,11 @@ class LongHashTable {
     u32 _padding1[15];
     volatile u32 _size;
     u32 _padding2[15];
+    volatile u32 _dirty_size[2];
+    u32 _padding3[14];
 
     static size_t getSize(u32 capacity) {
-        size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity;
+        size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample) + sizeof(u32) * 3) * capacity;
         return (size + OS::page_mask) & ~OS::page_mask;
     }
 
@@ -45,10 +51,16 @@ class LongHashTable {
             table->_prev = prev;
             table->_capacity = capacity;
             table->_size = 0;
+            table->_dirty_size[0] = 0;
+            table->_dirty_size[1] = 0;
         }
         return table;
     }
 
+    size_t usedMemory() {
+        return getSize(_capacity);
+    }
+
     LongHashTable* destroy() {
         LongHashTable* prev = _prev;
         OS::safeFree(this, getSize(_capacity));
@@ -59,12 +71,16 @@ class LongHashTable {
         return _prev;
     }
 
+    void setPrev(LongHashTable* prev) {
+        _prev = prev;
+    }
+
     u32 capacity() {
         return _capacity;
     }
 
     u32 size() {
-        return _size;
+        return _size < _capacity ? _size : _capacity;
     }
 
     u32 incSize() {
@@ -79,24 +95,91 @@ class LongHashTable {
         return (CallTraceSample*)(keys() + _capacity);
     }
 
+    // Occupied slots in the order of insertion, so that readers do not need to scan the whole table.
+    // Every element is slot + 1; zero means the writer has not published the slot yet
+    u32* index() {
+        return (u32*)(values() + _capacity);
+    }
+
+    void addToIndex(u32 size, u32 slot) {
+        if (size <= _capacity) {
+            storeRelease(index()[size - 1], slot + 1);
+        }
+    }
+
+    // Slots updated in a delta epoch. Even and odd epochs have separate lists, so that writers
+    // fill one of them while the dumper reads the other. Every slot is added once per epoch,
+    // so a list never holds more than capacity elements. Like in the index, elements are slot + 1
+    u32* dirty(u32 epoch) {
+        return index() + _capacity * (1 + (epoch & 1));
+    }
+
+    // May exceed capacity: elements past it are not stored
+    u32 dirtySize(u32 epoch) {
+        return _dirty_size[epoch & 1];
+    }
+
+    void addDirty(u32 epoch, u32 slot) {
+        u32 size = __sync_fetch_and_add(&_dirty_size[epoch & 1], 1);
+        if (size < _capacity) {
+            storeRelease(dirty(epoch)[size], slot + 1);
+        }
+    }
+
+    // Fails if more elements have been reserved since the size was read
+    bool resetDirty(u32 epoch, u32 size) {
+        return __sync_bool_compare_and_swap(&_dirty_size[epoch & 1], size, 0);
+    }
+
     void clear() {
-        memset(keys(), 0, (sizeof(u64) + sizeof(CallTraceSample)) * _capacity);
+        memset(keys(), 0, (sizeof(u64) + sizeof(CallTraceSample) + sizeof(u32) * 3) * _capacity);
         _size = 0;
+        _dirty_size[0] = 0;
+        _dirty_size[1] = 0;
+    }
+
+    // Number of probes the put() sequence needs to reach the given slot from the home slot of the key
+    u32 probeLength(u32 slot) {
+        u32 mask = _capacity - 1;
+        u32 current = keys()[slot] & mask;
+        u32 step = 0;
+        while (current != slot && step < _capacity) {
+            current = (current + ++step) & mask;
+        }
+        return step;
     }
 };
 
 
-CallTrace CallTraceStorage::_overflow_trace = {1, {BCI_ERROR, (jmethodID)"storage_overflow"}};
+CallTrace CallTraceStorage::_overflow_trace = {1, 0, NULL, {BCI_ERROR, (jmethodID)"storage_overflow"}};
 
-CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK) {
+CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK, true), _trie() {
     _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
+    _thread_table = NULL;
     _overflow = 0;
+    _use_trie = false;
+    _leaf_frames = 0;
+    _segment_table = NULL;
+    _flat_bytes = 0;
+    _stored_bytes = 0;
+    _epoch = 1;
+    _depth_limit = 0;
+    _merge_frames = 0;
+    _truncated = 0;
+    _merged = 0;
+    _prefetch_table = NULL;
 }
 
 CallTraceStorage::~CallTraceStorage() {
     while (_current_table != NULL) {
         _current_table = _current_table->destroy();
     }
+    while (_thread_table != NULL) {
+        _thread_table = _thread_table->destroy();
+    }
+    while (_segment_table != NULL) {
+        _segment_table = _segment_table->destroy();
+    }
 }
 
 void CallTraceStorage::clear() {
@@ -104,18 +187,148 @@ void CallTraceStorage::clear() {
         _current_table = _current_table->destroy();
     }
     _current_table->clear();
+    if (_thread_table != NULL) {
+        while (_thread_table->prev() != NULL) {
+            _thread_table = _thread_table->destroy();
+        }
+        _thread_table->clear();
+    }
+    if (_segment_table != NULL) {
+        while (_segment_table->prev() != NULL) {
+            _segment_table = _segment_table->destroy();
+        }
+        _segment_table->clear();
+    }
     _allocator.clear();
+    _trie.clear();
     _overflow = 0;
+    _flat_bytes = 0;
+    _stored_bytes = 0;
+    _truncated = 0;
+    _merged = 0;
+}
+
+// Should be called only when the storage is empty
+void CallTraceStorage::useFrameTrie(bool enabled) {
+    _use_trie = enabled;
+}
+
+// NULL stops queueing methods of new traces
+void CallTraceStorage::prefetchMethods(MethodTable* table) {
+    _prefetch_table = table;
+}
+
+// Should be called only when the storage is empty
+void CallTraceStorage::useThreadTable(bool enabled) {
+    if (enabled && _thread_table == NULL) {
+        _thread_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
+    } else if (!enabled) {
+        while (_thread_table != NULL) {
+            _thread_table = _thread_table->destroy();
+        }
+    }
+}
+
+// Huge pages reduce TLB misses when dump scans traces spread over the arena
+void CallTraceStorage::useHugePages(bool enabled) {
+    _allocator.useHugePages(enabled);
+}
+
+// Traces with more than leaf_frames frames are stored as their innermost leaf_frames frames
+// plus a reference to the shared trace of the remaining outer frames (the root segment).
+// Deep recursive stacks that differ only near the leaf then keep one copy of their common bottom.
+// 0 disables root segments. Should be called only when the storage is empty
+void CallTraceStorage::useRootSegments(int leaf_frames) {
+    _leaf_frames = leaf_frames;
+    if (leaf_frames > 0 && _segment_table == NULL) {
+        _segment_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
+    } else if (leaf_frames <= 0) {
+        while (_segment_table != NULL) {
+            _segment_table = _segment_table->destroy();
+        }
+    }
+}
+
+// Everything the storage has taken from the OS: the trace arena, the frame trie and all hash tables
+size_t CallTraceStorage::usedMemory() {
+    size_t bytes = _allocator.usedMemory() + _trie.usedMemory();
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        bytes += table->usedMemory();
+    }
+    for (LongHashTable* table = _thread_table; table != NULL; table = table->prev()) {
+        bytes += table->usedMemory();
+    }
+    for (LongHashTable* table = _segment_table; table != NULL; table = table->prev()) {
+        bytes += table->usedMemory();
+    }
+    return bytes;
+}
+
+ASGCT_CallFrame* CallTraceStorage::frames(CallTrace* trace, std::vector<ASGCT_CallFrame>& buf) {
+    if (trace->trie_node == 0 && trace->root == NULL) {
+        return trace->frames;
+    }
+
+    buf.resize(trace->num_frames);
+    int leaf_frames = trace->root != NULL ? trace->num_frames - trace->root->num_frames : trace->num_frames;
+    if (trace->trie_node == 0) {
+        for (int i = 0; i < leaf_frames; i++) {
+            buf[i] = trace->frames[i];
+        }
+    } else {
+        u32 node = trace->trie_node;
+        for (int i = 0; i < leaf_frames; i++) {
+            TrieNode* n = _trie.node(node);
+            buf[i] = n->frame;
+            node = n->parent;
+        }
+    }
+
+    if (trace->root != NULL) {
+        // Root segments are stored without a root of their own
+        std::vector<ASGCT_CallFrame> root_buf;
+        ASGCT_CallFrame* root_frames = frames(trace->root, root_buf);
+        for (int i = leaf_frames; i < trace->num_frames; i++) {
+            buf[i] = root_frames[i - leaf_frames];
+        }
+    }
+    return &buf[0];
+}
+
+// Frames of a sample with the thread frame put back at its original place
+ASGCT_CallFrame* CallTraceStorage::frames(const CallTraceSample* sample, std::vector<ASGCT_CallFrame>& buf, int& num_frames) {
+    CallTrace* trace = sample->trace;
+    num_frames = trace->num_frames;
+    if (sample->tid == 0) {
+        return frames(trace, buf);
+    }
+
+    if (trace->trie_node == 0 && trace->root == NULL) {
+        buf.assign(trace->frames, trace->frames + num_frames);
+    } else {
+        frames(trace, buf);
+    }
+
+    ASGCT_CallFrame thread_frame;
+    thread_frame.bci = BCI_THREAD_ID;
+    thread_frame.method_id = (jmethodID)(uintptr_t)sample->tid;
+    buf.insert(buf.begin() + (num_frames - sample->outer_frames), thread_frame);
+
+    num_frames++;
+    return &buf[0];
 }
 
 void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
+        u32* index = table->index();
         u32 capacity = table->capacity();
+        u32 size = table->size();
 
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0 && loadAcquire(values[slot].samples) != 0) {
+        for (u32 i = 0; i < size; i++) {
+            u32 slot = loadAcquire(index[i]) - 1;
+            if (slot < capacity && keys[slot] != 0 && loadAcquire(values[slot].samples) != 0) {
                 // Reset samples to avoid duplication of call traces between JFR chunks
                 values[slot].samples = 0;
                 map[capacity - (INITIAL_CAPACITY - 1) + slot] = values[slot].trace;
@@ -128,32 +341,354 @@ void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
     }
 }
 
-void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
+// Inverse of the id computation in findSample(): every table generation owns a distinct id range.
+// Ids are stable until the next compact()
+CallTrace* CallTraceStorage::findTrace(u32 call_trace_id) {
+    if (call_trace_id == OVERFLOW_TRACE_ID) {
+        return &_overflow_trace;
+    }
+
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        u32 capacity = table->capacity();
+        u32 slot = call_trace_id - (capacity - (INITIAL_CAPACITY - 1));
+        if (slot < capacity) {
+            return table->keys()[slot] != 0 ? table->values()[slot].trace : NULL;
+        }
+    }
+    return NULL;
+}
+
+void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
+    // Growing the vector of a big table would copy it over and over, and fault in new pages each time
+    size_t total = 0;
+    for (LongHashTable* table = sampleTable(); table != NULL; table = table->prev()) {
+        total += table->size();
+    }
+    samples.reserve(samples.size() + total);
+
+    for (LongHashTable* table = sampleTable(); table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
+        u32* index = table->index();
         u32 capacity = table->capacity();
+        u32 size = table->size();
 
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
+        for (u32 i = 0; i < size; i++) {
+            u32 slot = loadAcquire(index[i]) - 1;
+            if (slot < capacity && keys[slot] != 0) {
                 samples.push_back(&values[slot]);
             }
         }
     }
 }
 
-void CallTraceStorage::collectSamples(std::map<u64, CallTraceSample>& map) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+// Copies non-empty samples into a flat array. A trace that was hit again after the table grew
+// has a sample in more than one generation; such samples are merged into one
+void CallTraceStorage::collectSamples(std::vector<CallTraceSample>& samples) {
+    size_t total = 0;
+    for (LongHashTable* table = sampleTable(); table != NULL; table = table->prev()) {
+        total += table->size();
+    }
+    samples.reserve(samples.size() + total);
+
+    for (LongHashTable* table = sampleTable(); table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
+        u32* index = table->index();
         u32 capacity = table->capacity();
+        u32 size = table->size();
 
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0 && loadAcquire(values[slot].counter) != 0) {
-                map[keys[slot]] += values[slot];
+        for (u32 i = 0; i < size; i++) {
+            u32 slot = loadAcquire(index[i]) - 1;
+            if (slot < capacity && keys[slot] != 0 && loadAcquire(values[slot].counter) != 0) {
+                samples.push_back(values[slot]);
             }
         }
     }
+
+    if (sampleTable()->prev() != NULL) {
+        mergeDuplicates(samples);
+    }
+}
+
+// Returns samples that changed since the previous call, with values replaced by the difference.
+// Only the slots touched in the current epoch are visited, so the cost depends on the activity
+// in the interval rather than the size of the storage.
+// Safe to call while put() is in progress: writers switch to the next epoch and its dirty list first,
+// and the dumper drains the list of the finished epoch. A put() that started before the switch
+// may still add to that list while it is drained; such slots are either picked up by this call,
+// or stay on the list until the next epoch of the same parity
+void CallTraceStorage::collectDeltas(std::vector<CallTraceSample>& samples) {
+    u32 epoch = __sync_fetch_and_add(&_epoch, 1);
+
+    bool rescanned = false;
+    for (LongHashTable* table = sampleTable(); table != NULL; table = table->prev()) {
+        rescanned |= drainDirty(table, epoch, &samples);
+    }
+
+    // Without compaction, a sample may have been updated in two generations
+    // if the table grew during the epoch; a rescan may visit a slot twice
+    if (sampleTable()->prev() != NULL || rescanned) {
+        mergeDuplicates(samples);
+    }
+
+    // Dirty lists of the trace table are not needed when samples are kept per thread
+    if (_thread_table != NULL) {
+        for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+            drainDirty(table, epoch, NULL);
+        }
+    }
+}
+
+// Points the delta samples to flat copies of their traces, so that the samples outlive clear().
+// Copies are packed in one malloc'ed block, which the caller frees when done with the samples
+void* CallTraceStorage::detachDeltas(std::vector<CallTraceSample>& samples) {
+    size_t size = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        int num_frames = samples[i].trace->num_frames;
+        size += sizeof(CallTrace) + (num_frames > 1 ? num_frames - 1 : 0) * sizeof(ASGCT_CallFrame);
+    }
+
+    char* block = (char*)malloc(size > 0 ? size : 1);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    std::vector<ASGCT_CallFrame> buf;
+    char* ptr = block;
+    for (size_t i = 0; i < samples.size(); i++) {
+        CallTrace* trace = samples[i].trace;
+        CallTrace* copy = (CallTrace*)ptr;
+        copy->num_frames = trace->num_frames;
+        copy->trie_node = 0;
+        copy->root = NULL;
+        memcpy(copy->frames, frames(trace, buf), trace->num_frames * sizeof(ASGCT_CallFrame));
+        samples[i].trace = copy;
+        ptr += sizeof(CallTrace) + (trace->num_frames > 1 ? trace->num_frames - 1 : 0) * sizeof(ASGCT_CallFrame);
+    }
+    return block;
+}
+
+// Samples of the same trace and thread are migrated between generations with the same trace pointer
+void CallTraceStorage::mergeDuplicates(std::vector<CallTraceSample>& samples) {
+    PairMap index;
+    u32 count = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        u32 first;
+        if (!index.get((u64)(uintptr_t)samples[i].trace, (u64)(u32)samples[i].tid, first)) {
+            index.put((u64)(uintptr_t)samples[i].trace, (u64)(u32)samples[i].tid, count);
+            samples[count++] = samples[i];
+        } else {
+            samples[first].samples += samples[i].samples;
+            samples[first].counter += samples[i].counter;
+        }
+    }
+    samples.resize(count);
+}
+
+// Counters keep growing concurrently: read them once, so that the next delta starts exactly here.
+// Samples may have been reset by a JFR dump in between
+static void takeDelta(CallTraceSample& s, std::vector<CallTraceSample>* samples) {
+    u64 current_samples = loadAcquire(s.samples);
+    u64 current_counter = loadAcquire(s.counter);
+    CallTraceSample delta = s;
+    delta.samples = current_samples >= s.reported_samples ? current_samples - s.reported_samples : current_samples;
+    delta.counter = current_counter >= s.reported_counter ? current_counter - s.reported_counter : current_counter;
+    s.reported_samples = current_samples;
+    s.reported_counter = current_counter;
+
+    // A put() in progress may have counted the sample but not added its counter yet
+    if (delta.counter != 0 || delta.samples != 0) {
+        samples->push_back(delta);
+    }
+}
+
+// Returns true if the list has overflowed and the whole table was scanned instead
+bool CallTraceStorage::drainDirty(LongHashTable* table, u32 epoch, std::vector<CallTraceSample>* samples) {
+    CallTraceSample* values = table->values();
+    u32* dirty = table->dirty(epoch);
+    u32 capacity = table->capacity();
+
+    bool overflow = false;
+    u32 done = 0;
+    u32 size;
+    do {
+        size = table->dirtySize(epoch);
+        u32 end = size < capacity ? size : capacity;
+        overflow |= size > capacity;
+
+        for (u32 i = done; i < end; i++) {
+            // The writer has reserved the element but may not have stored it yet
+            u32 slot;
+            while ((slot = loadAcquire(dirty[i])) == 0) {
+                spinPause();
+            }
+            dirty[i] = 0;
+
+            CallTraceSample& s = values[slot - 1];
+            if (samples != NULL && s.trace != NULL) {
+                takeDelta(s, samples);
+            }
+        }
+        done = end;
+    } while (!table->resetDirty(epoch, size));
+
+    // Slots past the capacity of the list were not stored, and their epoch is already marked,
+    // so they would not be listed again. Deltas are relative to the last reported values,
+    // so checking every slot gives the same result as a complete list
+    if (overflow && samples != NULL) {
+        u32* index = table->index();
+        u32 table_size = table->size();
+        for (u32 i = 0; i < table_size; i++) {
+            u32 slot = loadAcquire(index[i]) - 1;
+            if (slot < capacity && values[slot].trace != NULL) {
+                takeDelta(values[slot], samples);
+            }
+        }
+    }
+    return overflow;
+}
+
+void CallTraceStorage::getStats(CallTraceStorageStats& stats) {
+    stats.generations = 0;
+    stats.capacity = 0;
+    stats.size = 0;
+    stats.max_probe = 0;
+    stats.avg_probe = 0;
+
+    u64 total_probes = 0;
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        u32* index = table->index();
+        u32 capacity = table->capacity();
+        u32 size = table->size();
+
+        for (u32 i = 0; i < size; i++) {
+            u32 slot = loadAcquire(index[i]) - 1;
+            if (slot < capacity) {
+                u32 probes = table->probeLength(slot);
+                total_probes += probes;
+                if (probes > stats.max_probe) stats.max_probe = probes;
+            }
+        }
+
+        stats.generations++;
+        stats.capacity += capacity;
+        stats.size += size;
+    }
+
+    if (stats.size > 0) {
+        stats.avg_probe = (double)total_probes / stats.size;
+    }
+
+    stats.flat_bytes = _flat_bytes;
+    stats.used_bytes = _stored_bytes + _trie.usedMemory();
+    stats.trie_nodes = _trie.nodeCount();
+
+    stats.root_segments = 0;
+    for (LongHashTable* table = _segment_table; table != NULL; table = table->prev()) {
+        stats.root_segments += table->size();
+    }
+}
+
+// The tables have grown since the last compaction, so lookups and dumps visit several generations
+bool CallTraceStorage::hasGenerations() {
+    return _current_table->prev() != NULL || (_thread_table != NULL && _thread_table->prev() != NULL);
+}
+
+// Merges all previous generations into a single table, so that memory occupied
+// by the old tables is reclaimed, and dumps do not need to visit duplicate entries.
+// Must be called when no put() is in progress. Call trace IDs may change after compaction.
+void CallTraceStorage::compact() {
+    _current_table = compact(_current_table);
+    if (_thread_table != NULL) {
+        _thread_table = compact(_thread_table);
+    }
+}
+
+LongHashTable* CallTraceStorage::compact(LongHashTable* current) {
+    if (current->prev() == NULL) {
+        return current;
+    }
+
+    u64 total_size = 0;
+    for (LongHashTable* table = current; table != NULL; table = table->prev()) {
+        total_size += table->size();
+    }
+
+    // Keep the load factor below 0.75, even if all keys in different generations are distinct
+    u32 capacity = current->capacity();
+    while (total_size >= capacity / 4 * 3 && capacity < 0x40000000) {
+        capacity *= 2;
+    }
+
+    LongHashTable* target = current;
+    if (capacity > current->capacity()) {
+        target = LongHashTable::allocate(NULL, capacity);
+        if (target == NULL) {
+            return current;
+        }
+    }
+
+    for (LongHashTable* table = current; table != NULL; table = table->prev()) {
+        if (table != target) {
+            mergeInto(target, table);
+        }
+    }
+
+    LongHashTable* prev = target == current ? current->prev() : current;
+    while (prev != NULL) {
+        prev = prev->destroy();
+    }
+    target->setPrev(NULL);
+    return target;
+}
+
+void CallTraceStorage::mergeInto(LongHashTable* target, LongHashTable* source) {
+    u64* src_keys = source->keys();
+    CallTraceSample* src_values = source->values();
+    u32* src_index = source->index();
+    u32 src_capacity = source->capacity();
+    u32 src_size = source->size();
+
+    u64* keys = target->keys();
+    CallTraceSample* values = target->values();
+    u32 capacity = target->capacity();
+
+    for (u32 i = 0; i < src_size; i++) {
+        u32 src_slot = src_index[i] - 1;
+        if (src_slot >= src_capacity || src_keys[src_slot] == 0) {
+            continue;
+        }
+
+        u64 hash = src_keys[src_slot];
+        u32 slot = hash & (capacity - 1);
+        u32 step = 0;
+        while (keys[slot] != hash && keys[slot] != 0 && ++step < capacity) {
+            slot = (slot + step) & (capacity - 1);
+        }
+
+        if (keys[slot] == 0) {
+            keys[slot] = hash;
+            target->addToIndex(target->incSize(), slot);
+            values[slot].trace = src_values[src_slot].trace;
+            values[slot].tid = src_values[src_slot].tid;
+            values[slot].outer_frames = src_values[src_slot].outer_frames;
+        } else if (keys[slot] != hash) {
+            atomicInc(_overflow);
+            continue;
+        }
+
+        values[slot].samples += src_values[src_slot].samples;
+        values[slot].counter += src_values[src_slot].counter;
+        values[slot].reported_samples += src_values[src_slot].reported_samples;
+        values[slot].reported_counter += src_values[src_slot].reported_counter;
+
+        // Keep changes of the current epoch visible to the next delta dump
+        if (src_values[src_slot].epoch == _epoch && values[slot].epoch != _epoch) {
+            values[slot].epoch = _epoch;
+            target->addDirty(_epoch, slot);
+        }
+    }
 }
 
 // Adaptation of MurmurHash64A by Austin Appleby
@@ -188,15 +723,54 @@ u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
     return h;
 }
 
-CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames) {
+// With a root segment, only the frames above it are stored
+CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames, CallTrace* root) {
     const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
+    int total_frames = num_frames;
+    if (root != NULL) {
+        num_frames -= root->num_frames;
+    }
+
+    // Frames of the root segment were queued when the segment itself was stored
+    MethodTable* prefetch_table = _prefetch_table;
+    if (prefetch_table != NULL) {
+        for (int i = 0; i < num_frames; i++) {
+            if (frames[i].method_id != NULL && frames[i].bci > BCI_NATIVE_FRAME) {
+                prefetch_table->enqueue(frames[i].method_id);
+            }
+        }
+    }
+
+    if (_use_trie && num_frames > 0) {
+        // Insert frames starting from the outermost one, so that common prefixes are shared
+        u32 node = 0;
+        for (int i = num_frames - 1; i >= 0; i--) {
+            if ((node = _trie.put(node, frames[i])) == 0) break;
+        }
+
+        if (node != 0) {
+            CallTrace* buf = (CallTrace*)_allocator.alloc(header_size);
+            if (buf != NULL) {
+                buf->num_frames = total_frames;
+                buf->trie_node = node;
+                buf->root = root;
+                atomicInc(_stored_bytes, header_size);
+            }
+            return buf;
+        }
+        // Out of trie memory: fall back to a flat trace
+    }
+
     CallTrace* buf = (CallTrace*)_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
     if (buf != NULL) {
-        buf->num_frames = num_frames;
+        buf->num_frames = total_frames;
+        buf->trie_node = 0;
+        buf->root = root;
         // Do not use memcpy inside signal handler
         for (int i = 0; i < num_frames; i++) {
             buf->frames[i] = frames[i];
         }
+        atomicInc(_stored_bytes, header_size + num_frames * sizeof(ASGCT_CallFrame));
     }
     return buf;
 }
@@ -220,50 +794,176 @@ CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
     return table->values()[slot].trace;
 }
 
-u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
-    u64 hash = calcHash(num_frames, frames);
-
-    LongHashTable* table = _current_table;
+// Returns the sample slot of the key in the current table, inserting it if needed.
+// A new slot takes the trace from the previous generation, or the given one, or stores the frames
+CallTraceSample* CallTraceStorage::findSample(LongHashTable* table, LongHashTable** current, u64 key, CallTrace* trace,
+                                              int num_frames, ASGCT_CallFrame* frames, CallTrace* root,
+                                              int tid, int outer_frames, u32& id) {
     u64* keys = table->keys();
     u32 capacity = table->capacity();
-    u32 slot = hash & (capacity - 1);
+    u32 slot = key & (capacity - 1);
     u32 step = 0;
 
-    while (keys[slot] != hash) {
+    while (keys[slot] != key) {
         if (keys[slot] == 0) {
-            if (!__sync_bool_compare_and_swap(&keys[slot], 0, hash)) {
+            if (!__sync_bool_compare_and_swap(&keys[slot], 0, key)) {
                 continue;
             }
 
             // Increment the table size, and if the load factor exceeds 0.75, reserve a new table
-            if (table->incSize() == capacity * 3 / 4) {
+            u32 size = table->incSize();
+            if (size == capacity * 3 / 4) {
                 LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2);
                 if (new_table != NULL) {
-                    __sync_bool_compare_and_swap(&_current_table, table, new_table);
+                    __sync_bool_compare_and_swap(current, table, new_table);
                 }
             }
 
-            // Migrate from a previous table to save space
-            CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash);
             if (trace == NULL) {
-                trace = storeCallTrace(num_frames, frames);
+                // Migrate from a previous table to save space
+                trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), key);
+                if (trace == NULL) {
+                    trace = storeCallTrace(num_frames, frames, root);
+                    if (current != &_segment_table) {
+                        // What the trace would take as a flat array, for the memory stats
+                        atomicInc(_flat_bytes, sizeof(CallTrace) + (num_frames - 1) * sizeof(ASGCT_CallFrame));
+                    }
+                }
             }
-            table->values()[slot].trace = trace;
+            CallTraceSample& s = table->values()[slot];
+            s.trace = trace;
+            s.tid = tid;
+            s.outer_frames = outer_frames;
+            table->addToIndex(size, slot);
             break;
         }
 
         if (++step >= capacity) {
             // Very unlikely case of a table overflow
             atomicInc(_overflow);
-            return OVERFLOW_TRACE_ID;
+            return NULL;
         }
         // Improved version of linear probing
         slot = (slot + step) & (capacity - 1);
     }
 
-    CallTraceSample& s = table->values()[slot];
-    atomicInc(s.samples);
-    atomicInc(s.counter, counter);
+    if (step > 0) {
+        Counters::add(COUNTER_CALL_TRACE_PROBES, step);
+    }
+
+    id = capacity - (INITIAL_CAPACITY - 1) + slot;
+    return &table->values()[slot];
+}
+
+void CallTraceStorage::addSample(LongHashTable* table, CallTraceSample* sample, u64 counter) {
+    atomicInc(sample->samples);
+    atomicInc(sample->counter, counter);
+
+    // The first update in a delta epoch puts the slot on the dirty list
+    u32 epoch = _epoch;
+    u32 last_epoch = sample->epoch;
+    if (last_epoch != epoch && __sync_bool_compare_and_swap(&sample->epoch, last_epoch, epoch)) {
+        table->addDirty(epoch, sample - table->values());
+    }
+}
+
+u64 CallTraceStorage::threadKey(CallTrace* trace, int tid) {
+    u64 key = ((u64)(uintptr_t)trace ^ (u64)(u32)tid << 48 ^ (u32)tid) * 0xc6a4a7935bd1e995ULL;
+    key ^= key >> 47;
+    return key != 0 ? key : 1;
+}
+
+// Returns the shared trace of the given outer frames, storing it if seen for the first time.
+// NULL if the segment has just been inserted by another thread and is not yet published
+CallTrace* CallTraceStorage::findRootSegment(int num_frames, ASGCT_CallFrame* frames, u64 hash) {
+    LongHashTable* table = _segment_table;
+    u32 unused;
+    CallTraceSample* segment = findSample(table, &_segment_table, hash, NULL, num_frames, frames, NULL, 0, 0, unused);
+    return segment != NULL ? segment->trace : NULL;
+}
+
+// Key of the trace in the sample table. With root segments, the key combines the leaf frames
+// with the root segment, which is stored if seen for the first time. Without store_root,
+// returns 0 instead if the root segment is not stored yet, i.e. the trace cannot be stored either
+u64 CallTraceStorage::traceKey(int num_frames, ASGCT_CallFrame* frames, CallTrace** root, bool store_root) {
+    *root = NULL;
+    if (_leaf_frames > 0 && num_frames > _leaf_frames) {
+        u64 root_hash = calcHash(num_frames - _leaf_frames, frames + _leaf_frames);
+        if (store_root) {
+            *root = findRootSegment(num_frames - _leaf_frames, frames + _leaf_frames, root_hash);
+        } else if (findCallTrace(_segment_table, root_hash) == NULL) {
+            return 0;
+        }
+        u64 hash = calcHash(_leaf_frames, frames) ^ (root_hash * 0x9e3779b97f4a7c15ULL);
+        return hash != 0 ? hash : 1;
+    }
+    return calcHash(num_frames, frames);
+}
+
+// Keeps the innermost max_frames frames followed by the marker frame and the outer pseudo-frames.
+// Done in place: callers pass their own scratch buffer of frames
+int CallTraceStorage::truncate(int num_frames, ASGCT_CallFrame* frames, int outer_frames, int max_frames,
+                               const char* marker) {
+    frames[max_frames].bci = BCI_ERROR;
+    frames[max_frames].method_id = (jmethodID)marker;
+    for (int i = 0; i < outer_frames; i++) {
+        frames[max_frames + 1 + i] = frames[num_frames - outer_frames + i];
+    }
+    return max_frames + 1 + outer_frames;
+}
+
+// With tid != 0 and the thread table enabled, the sample is also counted for the thread.
+// The thread frame is not a part of the frames: outer_frames tells how many pseudo-frames
+// at the end of the array would follow it
+u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter, int tid, int outer_frames,
+                          bool count) {
+    int depth_limit = _depth_limit;
+    if (depth_limit > 0 && num_frames - outer_frames > depth_limit + 1) {
+        num_frames = truncate(num_frames, frames, outer_frames, depth_limit, "memlimit_truncated");
+        atomicInc(_truncated);
+    }
+
+    int merge_frames = _merge_frames;
+    if (merge_frames > 0 && num_frames - outer_frames > merge_frames + 1) {
+        // Traces that are already stored keep all their frames. A new trace is cut down to its innermost frames,
+        // where it most likely meets other cold traces of the same leaf. Traces not yet migrated
+        // from the previous table generation count as new
+        CallTrace* known_root;
+        u64 key = traceKey(num_frames, frames, &known_root, false);
+        if (key == 0 || findCallTrace(_current_table, key) == NULL) {
+            num_frames = truncate(num_frames, frames, outer_frames, merge_frames, "memlimit_merged");
+            atomicInc(_merged);
+        }
+    }
+
+    CallTrace* root;
+    u64 hash = traceKey(num_frames, frames, &root, true);
+
+    // The current table may be replaced concurrently, but the sample stays in the one where it was found
+    LongHashTable* table = _current_table;
+    u32 call_trace_id;
+    CallTraceSample* sample = findSample(table, &_current_table, hash, NULL, num_frames, frames, root, 0, 0, call_trace_id);
+    if (sample == NULL) {
+        return OVERFLOW_TRACE_ID;
+    }
+    if (!count) {
+        // Only the trace ID is needed: the caller accounts the sample elsewhere
+        return call_trace_id;
+    }
+    addSample(table, sample, counter);
+
+    // The trace can be still unpublished if another thread has just inserted the same key;
+    // such a rare sample goes only to the aggregated table
+    CallTrace* trace = sample->trace;
+    if (tid != 0 && _thread_table != NULL && trace != NULL) {
+        LongHashTable* thread_table = _thread_table;
+        u32 unused;
+        CallTraceSample* thread_sample = findSample(thread_table, &_thread_table, threadKey(trace, tid), trace,
+                                                    0, NULL, NULL, tid, outer_frames, unused);
+        if (thread_sample != NULL) {
+            addSample(thread_table, thread_sample, counter);
+        }
+    }
 
-    return capacity - (INITIAL_CAPACITY - 1) + slot;
+    return call_trace_id;
 }
@@ -20,14 +20,24 @@
 #include <map>
 #include <vector>
 #include "arch.h"
+#include "frameTrie.h"
 #include "linearAllocator.h"
 #include "vmEntry.h"
 
 
+class MethodTable;
+
+
 class LongHashTable;
 
+// When the trace is stored in the frame trie, trie_node points to its innermost frame,
+// and the frames array is absent. With root segments, the trace keeps only the innermost frames,
+// and root refers to a shared trace of the outer ones; num_frames counts both.
+// Use CallTraceStorage::frames() to access frames in any case.
 struct CallTrace {
     int num_frames;
+    u32 trie_node;
+    CallTrace* root;
     ASGCT_CallFrame frames[1];
 };
 
@@ -35,9 +45,20 @@ struct CallTraceSample {
     CallTrace* trace;
     u64 samples;
     u64 counter;
+    // Values at the time of the previous delta dump
+    u64 reported_samples;
+    u64 reported_counter;
+    // Delta epoch in which the sample was last updated
+    u32 epoch;
+    // Per-thread samples only: the thread, and the number of pseudo-frames
+    // that follow the thread frame in the original trace
+    int tid;
+    int outer_frames;
 
     CallTraceSample& operator+=(const CallTraceSample& s) {
         trace = s.trace;
+        tid = s.tid;
+        outer_frames = s.outer_frames;
         samples += s.samples;
         counter += s.counter;
         return *this;
@@ -48,28 +69,113 @@ struct CallTraceSample {
     }
 };
 
+struct CallTraceStorageStats {
+    u32 generations;
+    u64 capacity;
+    u64 size;
+    u32 max_probe;
+    double avg_probe;
+    u64 flat_bytes;
+    u64 used_bytes;
+    u32 trie_nodes;
+    u64 root_segments;
+};
+
 class CallTraceStorage {
   private:
     static CallTrace _overflow_trace;
 
     LinearAllocator _allocator;
     LongHashTable* _current_table;
+    // (trace, thread) -> samples; the thread is not a part of the trace key,
+    // so that identical stacks of different threads share one stored trace
+    LongHashTable* _thread_table;
     u64 _overflow;
+    FrameTrie _trie;
+    bool _use_trie;
+    // Traces deeper than _leaf_frames share their outer frames via the root segment table
+    int _leaf_frames;
+    LongHashTable* _segment_table;
+    u64 _flat_bytes;
+    u64 _stored_bytes;
+    volatile u32 _epoch;
+    // Degradation under the memory limit; 0 means off
+    volatile int _depth_limit;
+    volatile int _merge_frames;
+    u64 _truncated;
+    u64 _merged;
+    // Receives Java methods of every newly stored trace
+    MethodTable* _prefetch_table;
 
     u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
-    CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames);
+    u64 traceKey(int num_frames, ASGCT_CallFrame* frames, CallTrace** root, bool store_root);
+    static int truncate(int num_frames, ASGCT_CallFrame* frames, int outer_frames, int max_frames, const char* marker);
+    static u64 threadKey(CallTrace* trace, int tid);
+    CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames, CallTrace* root);
+    CallTrace* findRootSegment(int num_frames, ASGCT_CallFrame* frames, u64 hash);
     CallTrace* findCallTrace(LongHashTable* table, u64 hash);
+    CallTraceSample* findSample(LongHashTable* table, LongHashTable** current, u64 key, CallTrace* trace,
+                                int num_frames, ASGCT_CallFrame* frames, CallTrace* root,
+                                int tid, int outer_frames, u32& id);
+    void addSample(LongHashTable* table, CallTraceSample* sample, u64 counter);
+    LongHashTable* compact(LongHashTable* current);
+    void mergeInto(LongHashTable* target, LongHashTable* source);
+    static void mergeDuplicates(std::vector<CallTraceSample>& samples);
+    bool drainDirty(LongHashTable* table, u32 epoch, std::vector<CallTraceSample>* samples);
+    LongHashTable* sampleTable() { return _thread_table != NULL ? _thread_table : _current_table; }
 
   public:
     CallTraceStorage();
     ~CallTraceStorage();
 
     void clear();
+    void useFrameTrie(bool enabled);
+    void useThreadTable(bool enabled);
+    void useHugePages(bool enabled);
+    void useRootSegments(int leaf_frames);
+    void prefetchMethods(MethodTable* table);
+    bool hasGenerations();
+    void compact();
+    void getStats(CallTraceStorageStats& stats);
+    size_t usedMemory();
+
+    // Traces deeper than max_frames keep only their innermost frames
+    void limitDepth(int max_frames) {
+        _depth_limit = max_frames;
+    }
+
+    // Same for new traces only: those already stored are still counted with all frames
+    void mergeColdTraces(int max_frames) {
+        _merge_frames = max_frames;
+    }
     void collectTraces(std::map<u32, CallTrace*>& map);
+    CallTrace* findTrace(u32 call_trace_id);
     void collectSamples(std::vector<CallTraceSample*>& samples);
-    void collectSamples(std::map<u64, CallTraceSample>& map);
+    void collectSamples(std::vector<CallTraceSample>& samples);
+    void collectDeltas(std::vector<CallTraceSample>& samples);
+    void* detachDeltas(std::vector<CallTraceSample>& samples);
+
+    u64 storedBytes() {
+        return _stored_bytes;
+    }
+
+    u64 overflow() {
+        return _overflow;
+    }
+
+    u64 truncated() {
+        return _truncated;
+    }
+
+    u64 merged() {
+        return _merged;
+    }
+
+    ASGCT_CallFrame* frames(CallTrace* trace, std::vector<ASGCT_CallFrame>& buf);
+    ASGCT_CallFrame* frames(const CallTraceSample* sample, std::vector<ASGCT_CallFrame>& buf, int& num_frames);
 
-    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter);
+    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter, int tid = 0, int outer_frames = 0,
+            bool count = true);
 };
 
 #endif // _CALLTRACESTORAGE
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "callTree.h"
+#include "os.h"
+
+
+CallTree::CallTree() : _trie(), _truncated(0) {
+    memset((void*)_counters, 0, sizeof(_counters));
+}
+
+CallTree::~CallTree() {
+    clear();
+}
+
+void CallTree::clear() {
+    _trie.clear();
+    for (u32 i = 0; i < MAX_TRIE_CHUNKS; i++) {
+        if (_counters[i] != NULL) {
+            OS::safeFree(_counters[i], TRIE_CHUNK_SIZE * sizeof(CallTreeCounter));
+            _counters[i] = NULL;
+        }
+    }
+    _truncated = 0;
+}
+
+size_t CallTree::usedMemory() {
+    size_t bytes = _trie.usedMemory();
+    for (u32 i = 0; i < MAX_TRIE_CHUNKS; i++) {
+        if (_counters[i] != NULL) {
+            bytes += TRIE_CHUNK_SIZE * sizeof(CallTreeCounter);
+        }
+    }
+    return bytes;
+}
+
+// Chunks of counters are allocated along with the chunks of trie nodes they belong to
+CallTreeCounter* CallTree::counterOf(u32 id) {
+    u32 chunk = id >> TRIE_CHUNK_BITS;
+    CallTreeCounter* counters = _counters[chunk];
+    if (counters == NULL) {
+        counters = (CallTreeCounter*)OS::safeAlloc(TRIE_CHUNK_SIZE * sizeof(CallTreeCounter));
+        if (counters == NULL) {
+            return NULL;
+        }
+        if (!__sync_bool_compare_and_swap(&_counters[chunk], NULL, counters)) {
+            OS::safeFree(counters, TRIE_CHUNK_SIZE * sizeof(CallTreeCounter));
+            counters = _counters[chunk];
+        }
+    }
+    return &counters[id & (TRIE_CHUNK_SIZE - 1)];
+}
+
+u32 CallTree::put(int num_frames, ASGCT_CallFrame* frames, u64 counter, int tid, int outer_frames) {
+    int thread_pos = num_frames - outer_frames;
+    ASGCT_CallFrame thread_frame;
+    thread_frame.bci = BCI_THREAD_ID;
+    thread_frame.method_id = (jmethodID)(uintptr_t)tid;
+
+    u32 node = 0;
+    bool complete = true;
+    for (int i = num_frames; i > 0; i--) {
+        u32 next;
+        if (i == thread_pos && tid != 0) {
+            if ((next = _trie.put(node, thread_frame)) == 0) {
+                complete = false;
+                break;
+            }
+            node = next;
+        }
+        if ((next = _trie.put(node, frames[i - 1])) == 0) {
+            complete = false;
+            break;
+        }
+        node = next;
+    }
+
+    if (!complete) {
+        // Out of nodes: the rest of the trace is lost, but the sample still counts
+        atomicInc(_truncated);
+    }
+
+    CallTreeCounter* c = counterOf(node);
+    if (c == NULL) {
+        return 0;
+    }
+    atomicInc(c->samples);
+    atomicInc(c->counter, counter);
+    return node;
+}
+
+u32 CallTree::nodeCount() {
+    u32 count = _trie.nodeCount() + 1;
+    return count < TRIE_CHUNK_SIZE * MAX_TRIE_CHUNKS ? count : TRIE_CHUNK_SIZE * MAX_TRIE_CHUNKS;
+}
+
+bool CallTree::getCounter(u32 id, CallTreeCounter& value) {
+    CallTreeCounter* counters = _counters[id >> TRIE_CHUNK_BITS];
+    if (counters == NULL || (id != 0 && !_trie.contains(id))) {
+        return false;
+    }
+    CallTreeCounter* c = &counters[id & (TRIE_CHUNK_SIZE - 1)];
+    value.samples = loadAcquire(c->samples);
+    value.counter = loadAcquire(c->counter);
+    return value.samples != 0;
+}
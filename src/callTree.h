@@ -0,0 +1,71 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CALLTREE_H
+#define _CALLTREE_H
+
+#include <stddef.h>
+#include "arch.h"
+#include "frameTrie.h"
+#include "vmEntry.h"
+
+
+// Samples that end at one node of the call tree
+struct CallTreeCounter {
+    u64 samples;
+    u64 counter;
+};
+
+// Call tree that samples are folded into as they are recorded: a sample walks the frame trie
+// from the outermost frame and adds to the counters of the node where it ends.
+// Nothing is kept per trace, so memory is bounded by the number of distinct nodes.
+// When the node pool is exhausted, a sample is counted at the deepest node it has reached.
+// All operations except clear() are signal safe
+class CallTree {
+  private:
+    FrameTrie _trie;
+    CallTreeCounter* volatile _counters[MAX_TRIE_CHUNKS];
+    u64 _truncated;
+
+    CallTreeCounter* counterOf(u32 id);
+
+  public:
+    CallTree();
+    ~CallTree();
+
+    void clear();
+    size_t usedMemory();
+
+    // Same arguments as CallTraceStorage::put(); the thread frame, if any, goes between
+    // the outer pseudo-frames and the real frames. Returns the leaf node, or 0 if the sample is lost
+    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter, int tid, int outer_frames);
+
+    // Upper bound of node ids, the root included. Parents precede their children
+    u32 nodeCount();
+
+    TrieNode* node(u32 id) {
+        return _trie.node(id);
+    }
+
+    // False if the node has no samples of its own, or does not exist
+    bool getCounter(u32 id, CallTreeCounter& value);
+
+    u64 truncated() {
+        return _truncated;
+    }
+};
+
+#endif // _CALLTREE_H
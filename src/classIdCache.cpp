@@ -0,0 +1,61 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "classIdCache.h"
+#include "profiler.h"
+#include "vmStructs.h"
+
+
+// Marks a slot claimed by a writer that has not published its class ID yet
+static VMKlass* const RESERVED = (VMKlass*)1;
+
+
+ClassIdCache::Entry ClassIdCache::_entries[ClassIdCache::CACHE_SIZE];
+
+
+u32 ClassIdCache::classId(VMSymbol* name) {
+    return Profiler::instance()->classMap()->lookup(name->body(), name->length());
+}
+
+u32 ClassIdCache::lookup(VMKlass* klass) {
+    // Fibonacci hashing; the top bits of the product are the best mixed
+    u32 slot = ((u32)((uintptr_t)klass >> 3) * 0x9e3779b1) >> 20;
+    VMSymbol* name = klass->name();
+
+    for (int i = 0; i < MAX_PROBES; i++) {
+        Entry* e = &_entries[(slot + i) & (CACHE_SIZE - 1)];
+        VMKlass* k = __atomic_load_n(&e->klass, __ATOMIC_ACQUIRE);
+        if (k == klass && e->name == name) {
+            return e->class_id;
+        }
+
+        // A stale slot of an unloaded class stays as is; the probe goes on to the next one
+        if (k == NULL && __sync_bool_compare_and_swap(&e->klass, NULL, RESERVED)) {
+            u32 class_id = classId(name);
+            e->name = name;
+            e->class_id = class_id;
+            __atomic_store_n(&e->klass, klass, __ATOMIC_RELEASE);
+            return class_id;
+        }
+    }
+
+    return classId(name);
+}
+
+void ClassIdCache::clear() {
+    memset(_entries, 0, sizeof(_entries));
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CLASSIDCACHE_H
+#define _CLASSIDCACHE_H
+
+#include "arch.h"
+
+
+class VMKlass;
+class VMSymbol;
+
+// Maps Klass pointers to IDs in the profiler class map, so that the name of a sampled class
+// is hashed once per class rather than on every allocation sample.
+// Lookups are lock-free and signal safe. A slot is published only after its class ID is written
+// and is never changed afterwards. When all probed slots are taken, the class map is asked directly.
+// The address of an unloaded class may be reused by another one, so a hit counts only if the name
+// symbol is also the same; class IDs are keyed by name, so a reloaded class keeps its ID.
+// Must be cleared together with the class map
+class ClassIdCache {
+  private:
+    static const int CACHE_SIZE = 4096;
+    static const int MAX_PROBES = 8;
+
+    struct Entry {
+        VMKlass* volatile klass;
+        VMSymbol* name;
+        u32 class_id;
+    };
+
+    static Entry _entries[CACHE_SIZE];
+
+    static u32 classId(VMSymbol* name);
+
+  public:
+    static u32 lookup(VMKlass* klass);
+    static void clear();
+};
+
+#endif // _CLASSIDCACHE_H
@@ -16,20 +16,68 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "codeCache.h"
 #include "dwarf.h"
+#include "linearAllocator.h"
+#include "os.h"
 
 
+static const size_t SYMBOL_ARENA_CHUNK = 1024 * 1024;
+
+// Number of FrameDesc entries covered by one FrameDescBlock
+static const int FRAME_DESC_BLOCK_SIZE = 32;
+// Marks a block whose locations do not fit in 16-bit deltas
+static const u16 WIDE_BLOCK = 0xffff;
+
+
+// Locations of FrameDesc entries relative to the first entry of the block.
+// delta[0] is either 0 or WIDE_BLOCK; unused trailing deltas are WIDE_BLOCK
+struct FrameDescBlock {
+    u16 delta[FRAME_DESC_BLOCK_SIZE];
+};
+
+
+// All symbol names are allocated in one arena and are never freed individually.
+// It saves malloc overhead and keeps names of adjacent symbols close to each other
+static LinearAllocator* symbolArena() {
+    static LinearAllocator arena(SYMBOL_ARENA_CHUNK);
+    return &arena;
+}
+
 char* NativeFunc::create(const char* name, short lib_index) {
-    NativeFunc* f = (NativeFunc*)malloc(sizeof(NativeFunc) + 1 + strlen(name));
+    // Keep NativeFunc headers aligned
+    size_t size = (sizeof(NativeFunc) + 1 + strlen(name) + 3) & ~(size_t)3;
+    NativeFunc* f = (NativeFunc*)symbolArena()->alloc(size);
+    if (f == NULL) {
+        // The name does not fit in an arena chunk
+        f = (NativeFunc*)malloc(size);
+    }
     f->_lib_index = lib_index;
     f->_mark = 0;
     return strcpy(f->_name, name);
 }
 
-void NativeFunc::destroy(char* name) {
-    free(from(name));
-}
+
+struct SymbolEntry {
+    u64 start;
+    u64 end;
+    char* name;
+
+    static int comparator(const void* e1, const void* e2) {
+        const SymbolEntry* s1 = (const SymbolEntry*)e1;
+        const SymbolEntry* s2 = (const SymbolEntry*)e2;
+        if (s1->start < s2->start) {
+            return -1;
+        } else if (s1->start > s2->start) {
+            return 1;
+        } else if (s1->end == s2->end) {
+            return 0;
+        } else {
+            return s1->end > s2->end ? -1 : 1;
+        }
+    }
+};
 
 
 CodeCache::CodeCache(const char* name, short lib_index, const void* min_address, const void* max_address) {
@@ -41,36 +89,116 @@ CodeCache::CodeCache(const char* name, short lib_index, const void* min_address,
 
     _got_start = NULL;
     _got_end = NULL;
+    memset(_imports, 0, sizeof(_imports));
 
     _dwarf_table = NULL;
     _dwarf_table_length = 0;
+    _dwarf_block_start = NULL;
+    _dwarf_blocks = NULL;
+    _dwarf_block_count = 0;
+    _frame_pointers = true;
 
+    _symbols_loaded = true;
+    _has_marks = false;
+
+    _symbol_base = min_address == NO_MIN_ADDRESS ? NULL : (const char*)min_address;
+    _max_offset = 0;
     _capacity = INITIAL_CODE_CACHE_CAPACITY;
     _count = 0;
-    _blobs = new CodeBlob[_capacity];
+    _starts = new u32[_capacity];
+    _wide_starts = NULL;
+    _lengths = new u32[_capacity];
+    _names = new char*[_capacity];
 }
 
 CodeCache::~CodeCache() {
-    for (int i = 0; i < _count; i++) {
-        NativeFunc::destroy(_blobs[i]._name);
-    }
-    NativeFunc::destroy(_name);
-    delete[] _blobs;
+    delete[] _starts;
+    delete[] _wide_starts;
+    delete[] _lengths;
+    delete[] _names;
     free(_dwarf_table);
+    free(_dwarf_block_start);
+    free(_dwarf_blocks);
 }
 
 void CodeCache::expand() {
-    CodeBlob* old_blobs = _blobs;
-    CodeBlob* new_blobs = new CodeBlob[_capacity * 2];
+    int new_capacity = _capacity * 2;
+
+    u32* new_starts = NULL;
+    u64* new_wide_starts = NULL;
+    if (_wide_starts != NULL) {
+        new_wide_starts = new u64[new_capacity];
+        memcpy(new_wide_starts, _wide_starts, _count * sizeof(u64));
+    } else {
+        new_starts = new u32[new_capacity];
+        memcpy(new_starts, _starts, _count * sizeof(u32));
+    }
+    u32* new_lengths = new u32[new_capacity];
+    memcpy(new_lengths, _lengths, _count * sizeof(u32));
+    char** new_names = new char*[new_capacity];
+    memcpy(new_names, _names, _count * sizeof(char*));
+
+    u32* old_starts = _starts;
+    u64* old_wide_starts = _wide_starts;
+    u32* old_lengths = _lengths;
+    char** old_names = _names;
+
+    _starts = new_starts;
+    _wide_starts = new_wide_starts;
+    _lengths = new_lengths;
+    _names = new_names;
+    _capacity = new_capacity;
+
+    delete[] old_starts;
+    delete[] old_wide_starts;
+    delete[] old_lengths;
+    delete[] old_names;
+}
 
-    memcpy(new_blobs, old_blobs, _count * sizeof(CodeBlob));
+// Switches to 64-bit start offsets, when symbols do not fit in 4 GB from the base
+void CodeCache::widen() {
+    u64* wide_starts = new u64[_capacity];
+    for (int i = 0; i < _count; i++) {
+        wide_starts[i] = _starts[i];
+    }
+    delete[] _starts;
+    _starts = NULL;
+    _wide_starts = wide_starts;
+}
 
-    _capacity *= 2;
-    _blobs = new_blobs;
-    delete[] old_blobs;
+// Moves the base down, so that a symbol below the current base can be added
+void CodeCache::rebase(const char* new_base) {
+    u64 shift = _symbol_base - new_base;
+    if (_wide_starts == NULL && shift + _max_offset > 0xffffffffULL) {
+        widen();
+    }
+
+    if (_wide_starts != NULL) {
+        for (int i = 0; i < _count; i++) {
+            _wide_starts[i] += shift;
+        }
+    } else {
+        for (int i = 0; i < _count; i++) {
+            _starts[i] += (u32)shift;
+        }
+    }
+    _max_offset += shift;
+    _symbol_base = new_base;
 }
 
 void CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
+    if (_symbol_base == NULL) {
+        _symbol_base = (const char*)start;
+    } else if ((const char*)start < _symbol_base) {
+        rebase((const char*)start);
+    }
+
+    u64 start_offset = (u64)((const char*)start - _symbol_base);
+    u64 end_offset = start_offset + (u32)length;
+    if (end_offset > 0xffffffffULL && _wide_starts == NULL) {
+        widen();
+    }
+
     char* name_copy = NativeFunc::create(name, _lib_index);
     // Replace non-printable characters
     for (char* s = name_copy; *s != 0; s++) {
@@ -81,14 +209,21 @@ void CodeCache::add(const void* start, int length, const char* name, bool update
         expand();
     }
 
-    const void* end = (const char*)start + length;
-    _blobs[_count]._start = start;
-    _blobs[_count]._end = end;
-    _blobs[_count]._name = name_copy;
+    if (_wide_starts != NULL) {
+        _wide_starts[_count] = start_offset;
+    } else {
+        _starts[_count] = (u32)start_offset;
+    }
+    _lengths[_count] = (u32)length;
+    _names[_count] = name_copy;
     _count++;
 
+    if (end_offset > _max_offset) {
+        _max_offset = end_offset;
+    }
+
     if (update_bounds) {
-        updateBounds(start, end);
+        updateBounds(start, (const char*)start + length);
     }
 }
 
@@ -100,58 +235,118 @@ void CodeCache::updateBounds(const void* start, const void* end) {
 void CodeCache::sort() {
     if (_count == 0) return;
 
-    qsort(_blobs, _count, sizeof(CodeBlob), CodeBlob::comparator);
+    SymbolEntry* entries = new SymbolEntry[_count];
+    for (int i = 0; i < _count; i++) {
+        entries[i].start = startOffset(i);
+        entries[i].end = entries[i].start + _lengths[i];
+        entries[i].name = _names[i];
+    }
+
+    qsort(entries, _count, sizeof(SymbolEntry), SymbolEntry::comparator);
 
-    if (_min_address == NO_MIN_ADDRESS) _min_address = _blobs[0]._start;
-    if (_max_address == NO_MAX_ADDRESS) _max_address = _blobs[_count - 1]._end;
+    u64 max_end = 0;
+    for (int i = 0; i < _count; i++) {
+        if (_wide_starts != NULL) {
+            _wide_starts[i] = entries[i].start;
+        } else {
+            _starts[i] = (u32)entries[i].start;
+        }
+        _lengths[i] = (u32)(entries[i].end - entries[i].start);
+        _names[i] = entries[i].name;
+        if (entries[i].end > max_end) max_end = entries[i].end;
+    }
+    delete[] entries;
+
+    if (_min_address == NO_MIN_ADDRESS) _min_address = symbolStart(0);
+    if (_max_address == NO_MAX_ADDRESS) _max_address = _symbol_base + max_end;
 }
 
 void CodeCache::mark(NamePredicate predicate) {
     for (int i = 0; i < _count; i++) {
-        const char* blob_name = _blobs[i]._name;
+        const char* blob_name = _names[i];
         if (blob_name != NULL && predicate(blob_name)) {
             NativeFunc::mark(blob_name);
+            _has_marks = true;
         }
     }
 }
 
 const char* CodeCache::find(const void* address) {
+    if (!symbolsLoaded() || _symbol_base == NULL || address < _symbol_base) {
+        return NULL;
+    }
+
+    u64 offset = (const char*)address - _symbol_base;
     for (int i = 0; i < _count; i++) {
-        if (address >= _blobs[i]._start && address < _blobs[i]._end) {
-            return _blobs[i]._name;
+        if (offset >= startOffset(i) && offset < startOffset(i) + _lengths[i]) {
+            return _names[i];
         }
     }
     return NULL;
 }
 
 const char* CodeCache::binarySearch(const void* address) {
+    if (!symbolsLoaded() || _count == 0 || address < _symbol_base) {
+        return _name;
+    }
+
+    u64 offset = (u64)((const char*)address - _symbol_base);
+
+    // Find the last symbol that starts at or below the address
     int low = 0;
     int high = _count - 1;
-
     while (low <= high) {
         int mid = (unsigned int)(low + high) >> 1;
-        if (_blobs[mid]._end <= address) {
+        if (startOffset(mid) <= offset) {
             low = mid + 1;
-        } else if (_blobs[mid]._start > address) {
-            high = mid - 1;
         } else {
-            return _blobs[mid]._name;
+            high = mid - 1;
+        }
+    }
+
+    return high < 0 ? _name : enclosingSymbol(high, offset);
+}
+
+// Resolves addresses sorted in ascending order with a single merge pass over the symbol table,
+// instead of a binary search per address. Gives the same results as binarySearch
+void CodeCache::resolveSorted(const void** addresses, int count, const char** names) {
+    int high = -1;
+    for (int k = 0; k < count; k++) {
+        const void* address = addresses[k];
+        if (!symbolsLoaded() || _count == 0 || address < _symbol_base) {
+            names[k] = _name;
+            continue;
+        }
+
+        u64 offset = (u64)((const char*)address - _symbol_base);
+        while (high + 1 < _count && startOffset(high + 1) <= offset) {
+            high++;
+        }
+        names[k] = high < 0 ? _name : enclosingSymbol(high, offset);
+    }
+}
+
+const char* CodeCache::enclosingSymbol(int high, u64 offset) {
+    // The address may belong to an enclosing symbol that starts a bit earlier
+    for (int i = high; i >= 0 && i > high - 8 && offset - startOffset(i) < 0x100000; i--) {
+        if (offset - startOffset(i) < _lengths[i]) {
+            return _names[i];
         }
     }
 
     // Symbols with zero size can be valid functions: e.g. ASM entry points or kernel code.
     // Also, in some cases (endless loop) the return address may point beyond the function.
-    if (low > 0 && (_blobs[low - 1]._start == _blobs[low - 1]._end || _blobs[low - 1]._end == address)) {
-        return _blobs[low - 1]._name;
+    if (_lengths[high] == 0 || startOffset(high) + _lengths[high] == offset) {
+        return _names[high];
     }
     return _name;
 }
 
 const void* CodeCache::findSymbol(const char* name) {
     for (int i = 0; i < _count; i++) {
-        const char* blob_name = _blobs[i]._name;
+        const char* blob_name = _names[i];
         if (blob_name != NULL && strcmp(blob_name, name) == 0) {
-            return _blobs[i]._start;
+            return symbolStart(i);
         }
     }
     return NULL;
@@ -163,9 +358,9 @@ const void* CodeCache::findSymbolByPrefix(const char* prefix) {
 
 const void* CodeCache::findSymbolByPrefix(const char* prefix, int prefix_len) {
     for (int i = 0; i < _count; i++) {
-        const char* blob_name = _blobs[i]._name;
+        const char* blob_name = _names[i];
         if (blob_name != NULL && strncmp(blob_name, prefix, prefix_len) == 0) {
-            return _blobs[i]._start;
+            return symbolStart(i);
         }
     }
     return NULL;
@@ -185,26 +380,232 @@ const void** CodeCache::findGlobalOffsetEntry(const void* address) {
     return NULL;
 }
 
+void CodeCache::addImport(const void** entry, const char* name) {
+    static const char* const import_names[NUM_IMPORTS] = {"malloc", "calloc", "realloc", "free", "mmap", "munmap"};
+
+    for (int id = 0; id < NUM_IMPORTS; id++) {
+        if (strcmp(name, import_names[id]) == 0) {
+            for (int i = 0; i < IMPORT_SLOTS; i++) {
+                if (_imports[id][i] == NULL || _imports[id][i] == entry) {
+                    _imports[id][i] = entry;
+                    break;
+                }
+            }
+            return;
+        }
+    }
+}
+
+// GOT slots may be in a RELRO segment, which becomes read-only after relocation
+void CodeCache::patchImport(ImportId id, void* hook_func) {
+    for (int i = 0; i < IMPORT_SLOTS; i++) {
+        const void** entry = _imports[id][i];
+        if (entry != NULL && *entry != hook_func) {
+            uintptr_t page = (uintptr_t)entry & ~OS::page_mask;
+            mprotect((void*)page, OS::page_mask + 1, PROT_READ | PROT_WRITE);
+            __atomic_store_n(entry, hook_func, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Code compiled with frame pointers switches CFA to the frame pointer after the prologue
+// of nearly every function, while code without them keeps CFA relative to SP.
+// Each function contributes at least one SP-relative row for its entry point,
+// so the share of FP-relative rows among the entry rows tells one case from the other
+static bool guessFramePointers(FrameDesc* table, int length) {
+    const int entry_cfa = DW_REG_SP | DW_STACK_SLOT << 8;
+    int entries = 0;
+    int fp_frames = 0;
+    for (int i = 0; i < length; i++) {
+        if (table[i].cfa == entry_cfa) {
+            entries++;
+        } else if ((u8)table[i].cfa == DW_REG_FP) {
+            fp_frames++;
+        }
+    }
+    return entries == 0 || fp_frames * 4 >= entries;
+}
+
 void CodeCache::setDwarfTable(FrameDesc* table, int length) {
     _dwarf_table = table;
     _dwarf_table_length = length;
+    _frame_pointers = guessFramePointers(table, length);
+
+    // The table comes sorted by location, since .eh_frame_hdr lists FDEs in address order
+    int block_count = (length + FRAME_DESC_BLOCK_SIZE - 1) / FRAME_DESC_BLOCK_SIZE;
+    u32* block_start = (u32*)malloc(block_count * sizeof(u32));
+    void* blocks = NULL;
+    if (block_start == NULL || posix_memalign(&blocks, sizeof(FrameDescBlock), block_count * sizeof(FrameDescBlock)) != 0) {
+        // Without the index, findFrameDesc falls back to the plain binary search
+        free(block_start);
+        return;
+    }
+
+    for (int b = 0; b < block_count; b++) {
+        FrameDesc* first = &table[b * FRAME_DESC_BLOCK_SIZE];
+        FrameDescBlock* block = (FrameDescBlock*)blocks + b;
+        int count = length - b * FRAME_DESC_BLOCK_SIZE;
+        if (count > FRAME_DESC_BLOCK_SIZE) count = FRAME_DESC_BLOCK_SIZE;
+
+        block_start[b] = first[0].loc;
+        bool wide = first[count - 1].loc - first[0].loc >= WIDE_BLOCK;
+        for (int i = 0; i < FRAME_DESC_BLOCK_SIZE; i++) {
+            block->delta[i] = wide || i >= count ? WIDE_BLOCK : (u16)(first[i].loc - first[0].loc);
+        }
+    }
+
+    _dwarf_block_start = block_start;
+    _dwarf_blocks = (FrameDescBlock*)blocks;
+    _dwarf_block_count = block_count;
+}
+
+static FrameDesc* searchFrameDesc(FrameDesc* table, int length, u32 target_loc) {
+    int low = 0;
+    int high = length - 1;
+
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (table[mid].loc < target_loc) {
+            low = mid + 1;
+        } else if (table[mid].loc > target_loc) {
+            high = mid - 1;
+        } else {
+            return &table[mid];
+        }
+    }
+
+    return low > 0 ? &table[low - 1] : NULL;
 }
 
 FrameDesc* CodeCache::findFrameDesc(const void* pc) {
     u32 target_loc = (const char*)pc - _text_base;
-    int low = 0;
-    int high = _dwarf_table_length - 1;
+    if (_dwarf_blocks == NULL) {
+        return searchFrameDesc(_dwarf_table, _dwarf_table_length, target_loc);
+    }
 
+    // Find the last block that starts at or before target_loc
+    int low = 0;
+    int high = _dwarf_block_count - 1;
     while (low <= high) {
         int mid = (unsigned int)(low + high) >> 1;
-        if (_dwarf_table[mid].loc < target_loc) {
+        if (_dwarf_block_start[mid] <= target_loc) {
             low = mid + 1;
-        } else if (_dwarf_table[mid].loc > target_loc) {
+        } else {
             high = mid - 1;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+
+    int b = low - 1;
+    FrameDesc* first = &_dwarf_table[b * FRAME_DESC_BLOCK_SIZE];
+    const FrameDescBlock* block = &_dwarf_blocks[b];
+    if (block->delta[0] == WIDE_BLOCK) {
+        int count = _dwarf_table_length - b * FRAME_DESC_BLOCK_SIZE;
+        return searchFrameDesc(first, count < FRAME_DESC_BLOCK_SIZE ? count : FRAME_DESC_BLOCK_SIZE, target_loc);
+    }
+
+    // Deltas are sorted, and unused slots hold WIDE_BLOCK, which is never below target delta.
+    // Counting the entries in a loop without branches lets the compiler vectorize it
+    u32 delta = target_loc - _dwarf_block_start[b];
+    u32 target = delta < WIDE_BLOCK ? delta : WIDE_BLOCK - 1;
+    int index = 0;
+    for (int i = 1; i < FRAME_DESC_BLOCK_SIZE; i++) {
+        index += block->delta[i] <= target;
+    }
+    return &first[index];
+}
+
+
+static int compareRanges(const void* a, const void* b) {
+    const CodeCacheRange* r1 = (const CodeCacheRange*)a;
+    const CodeCacheRange* r2 = (const CodeCacheRange*)b;
+    return r1->start < r2->start ? -1 : r1->start > r2->start ? 1 : 0;
+}
+
+CodeCacheIndex::~CodeCacheIndex() {
+    freeRetired();
+    free(_snapshot);
+}
+
+void CodeCacheIndex::freeRetired() {
+    for (CodeCacheSnapshot* s = _retired; s != NULL; ) {
+        CodeCacheSnapshot* next = s->retired_next;
+        free(s);
+        s = next;
+    }
+    _retired = NULL;
+}
+
+void CodeCacheIndex::update(CodeCache** array, int count) {
+    CodeCacheSnapshot* snapshot = (CodeCacheSnapshot*)malloc(sizeof(CodeCacheSnapshot) + count * sizeof(CodeCacheRange));
+    if (snapshot == NULL) {
+        return;
+    }
+
+    snapshot->retired_next = NULL;
+    snapshot->count = count;
+    for (int i = 0; i < count; i++) {
+        snapshot->ranges[i].start = array[i]->minAddress();
+        snapshot->ranges[i].end = array[i]->maxAddress();
+        snapshot->ranges[i].cc = array[i];
+    }
+
+    qsort(snapshot->ranges, count, sizeof(CodeCacheRange), compareRanges);
+
+    // Ranges may overlap; max_end tells how far back the search needs to go
+    const void* max_end = NULL;
+    for (int i = 0; i < count; i++) {
+        if (snapshot->ranges[i].end > max_end) max_end = snapshot->ranges[i].end;
+        snapshot->ranges[i].max_end = max_end;
+    }
+
+    CodeCacheSnapshot* old_snapshot = __atomic_exchange_n(&_snapshot, snapshot, __ATOMIC_SEQ_CST);
+    __sync_fetch_and_add(&_generation, 1);
+
+    if (old_snapshot != NULL) {
+        old_snapshot->retired_next = _retired;
+        _retired = old_snapshot;
+    }
+
+    // Only a reader that entered find() before the exchange above can see a retired snapshot.
+    // If there is no reader now, there will be none for all retired snapshots; otherwise,
+    // they wait for the next update or the destructor
+    if (__atomic_load_n(&_readers, __ATOMIC_SEQ_CST) == 0) {
+        freeRetired();
+    }
+}
+
+CodeCache* CodeCacheIndex::find(const void* address) {
+    __atomic_fetch_add(&_readers, 1, __ATOMIC_SEQ_CST);
+    CodeCache* cc = findInSnapshot(__atomic_load_n(&_snapshot, __ATOMIC_SEQ_CST), address);
+    __atomic_fetch_sub(&_readers, 1, __ATOMIC_RELEASE);
+    return cc;
+}
+
+CodeCache* CodeCacheIndex::findInSnapshot(const CodeCacheSnapshot* snapshot, const void* address) {
+    if (snapshot == NULL) {
+        return NULL;
+    }
+
+    // Find the last range starting at or below the address
+    const CodeCacheRange* ranges = snapshot->ranges;
+    int low = 0;
+    int high = snapshot->count - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (ranges[mid].start <= address) {
+            low = mid + 1;
         } else {
-            return &_dwarf_table[mid];
+            high = mid - 1;
         }
     }
 
-    return low > 0 ? &_dwarf_table[low - 1] : NULL;
+    for (int i = high; i >= 0 && ranges[i].max_end > address; i--) {
+        if (address < ranges[i].end) {
+            return ranges[i].cc;
+        }
+    }
+    return NULL;
 }
@@ -18,6 +18,7 @@
 #define _CODECACHE_H
 
 #include <jvmti.h>
+#include "arch.h"
 
 
 #define NO_MIN_ADDRESS  ((const void*)-1)
@@ -27,6 +28,20 @@ typedef bool (*NamePredicate)(const char* name);
 
 const int INITIAL_CODE_CACHE_CAPACITY = 1000;
 
+// Imported functions whose GOT slots can be redirected to the profiler hooks
+enum ImportId {
+    IM_MALLOC,
+    IM_CALLOC,
+    IM_REALLOC,
+    IM_FREE,
+    IM_MMAP,
+    IM_MUNMAP,
+    NUM_IMPORTS
+};
+
+// A function may have both a PLT slot and a GLOB_DAT slot used for taking its address
+const int IMPORT_SLOTS = 2;
+
 
 class NativeFunc {
   private:
@@ -41,7 +56,6 @@ class NativeFunc {
 
   public:
     static char* create(const char* name, short lib_index);
-    static void destroy(char* name);
 
     static short libIndex(const char* name) {
         return from(name)->_lib_index;
@@ -57,29 +71,8 @@ class NativeFunc {
 };
 
 
-class CodeBlob {
-  public:
-    const void* _start;
-    const void* _end;
-    char* _name;
-
-    static int comparator(const void* c1, const void* c2) {
-        CodeBlob* cb1 = (CodeBlob*)c1;
-        CodeBlob* cb2 = (CodeBlob*)c2;
-        if (cb1->_start < cb2->_start) {
-            return -1;
-        } else if (cb1->_start > cb2->_start) {
-            return 1;
-        } else if (cb1->_end == cb2->_end) {
-            return 0;
-        } else {
-            return cb1->_end > cb2->_end ? -1 : 1;
-        }
-    }
-};
-
-
 class FrameDesc;
+struct FrameDescBlock;
 
 class CodeCache {
   protected:
@@ -91,15 +84,50 @@ class CodeCache {
 
     const void** _got_start;
     const void** _got_end;
+    const void** _imports[NUM_IMPORTS][IMPORT_SLOTS];
 
     FrameDesc* _dwarf_table;
     int _dwarf_table_length;
 
+    // Two-level index over the DWARF table: first locations of fixed-size blocks
+    // for the top-level binary search and cache line sized blocks of location deltas
+    u32* _dwarf_block_start;
+    FrameDescBlock* _dwarf_blocks;
+    int _dwarf_block_count;
+
+    // Guessed from the unwind table: frame pointer chains through this library can be trusted
+    bool _frame_pointers;
+
+    // False while symbols of a lazily registered library are not yet parsed
+    bool _symbols_loaded;
+    // True if mark() has marked any symbol of this library
+    bool _has_marks;
+
+    // Symbols are stored as struct of arrays: start offsets relative to _symbol_base,
+    // lengths and names. Names are allocated in the string arena shared by all CodeCaches.
+    // Start offsets are 32-bit, unless symbols of the library span more than 4 GB:
+    // then _wide_starts replaces _starts
+    const char* _symbol_base;
+    u64 _max_offset;
     int _capacity;
     int _count;
-    CodeBlob* _blobs;
+    u32* _starts;
+    u64* _wide_starts;
+    u32* _lengths;
+    char** _names;
 
     void expand();
+    void widen();
+    void rebase(const char* new_base);
+    const char* enclosingSymbol(int high, u64 offset);
+
+    u64 startOffset(int index) const {
+        return _wide_starts != NULL ? _wide_starts[index] : _starts[index];
+    }
+
+    const void* symbolStart(int index) const {
+        return _symbol_base + startOffset(index);
+    }
 
   public:
     CodeCache(const char* name,
@@ -133,6 +161,18 @@ class CodeCache {
         _text_base = text_base;
     }
 
+    bool symbolsLoaded() const {
+        return __atomic_load_n(&_symbols_loaded, __ATOMIC_ACQUIRE);
+    }
+
+    void setSymbolsLoaded(bool loaded) {
+        __atomic_store_n(&_symbols_loaded, loaded, __ATOMIC_RELEASE);
+    }
+
+    bool hasMarks() const {
+        return _has_marks;
+    }
+
     const void** gotStart() const {
         return _got_start;
     }
@@ -141,6 +181,34 @@ class CodeCache {
         return _got_end;
     }
 
+    int symbolCount() const {
+        return _count;
+    }
+
+    const void* symbolAddress(int index) const {
+        return symbolStart(index);
+    }
+
+    u32 symbolLength(int index) const {
+        return _lengths[index];
+    }
+
+    const char* symbolName(int index) const {
+        return _names[index];
+    }
+
+    FrameDesc* dwarfTable() const {
+        return _dwarf_table;
+    }
+
+    int dwarfTableLength() const {
+        return _dwarf_table_length;
+    }
+
+    bool hasFramePointers() const {
+        return _frame_pointers;
+    }
+
     void add(const void* start, int length, const char* name, bool update_bounds = false);
     void updateBounds(const void* start, const void* end);
     void sort();
@@ -148,6 +216,7 @@ class CodeCache {
 
     const char* find(const void* address);
     const char* binarySearch(const void* address);
+    void resolveSorted(const void** addresses, int count, const char** names);
     const void* findSymbol(const char* name);
     const void* findSymbolByPrefix(const char* prefix);
     const void* findSymbolByPrefix(const char* prefix, int prefix_len);
@@ -155,8 +224,60 @@ class CodeCache {
     void setGlobalOffsetTable(const void* start, unsigned int size);
     const void** findGlobalOffsetEntry(const void* address);
 
+    void addImport(const void** entry, const char* name);
+    bool hasImport(ImportId id) const {
+        return _imports[id][0] != NULL;
+    }
+    void patchImport(ImportId id, void* hook_func);
+
     void setDwarfTable(FrameDesc* table, int length);
     FrameDesc* findFrameDesc(const void* pc);
 };
 
+
+struct CodeCacheRange {
+    const void* start;
+    const void* end;
+    const void* max_end;  // the highest end address among this and all preceding ranges
+    CodeCache* cc;
+};
+
+struct CodeCacheSnapshot {
+    CodeCacheSnapshot* retired_next;
+    int count;
+    CodeCacheRange ranges[1];
+};
+
+// Address index over an array of CodeCaches for signal-safe binary search.
+// update() publishes a new sorted snapshot; readers never block.
+// A replaced snapshot is kept until an update sees no reader inside find(),
+// since a reader that entered before the replacement may still use it.
+class CodeCacheIndex {
+  private:
+    CodeCacheSnapshot* volatile _snapshot;
+    CodeCacheSnapshot* _retired;
+    volatile u32 _generation;
+    volatile int _readers;
+
+    void freeRetired();
+
+    static CodeCache* findInSnapshot(const CodeCacheSnapshot* snapshot, const void* address);
+
+  public:
+    CodeCacheIndex() : _snapshot(NULL), _retired(NULL), _generation(0), _readers(0) {
+    }
+
+    ~CodeCacheIndex();
+
+    // Not thread safe: concurrent updates must be serialized by the caller
+    void update(CodeCache** array, int count);
+
+    CodeCache* find(const void* address);
+
+    // Incremented on every update
+    u32 generation() const {
+        return _generation;
+    }
+};
+
 #endif // _CODECACHE_H
@@ -14,17 +14,24 @@
  * limitations under the License.
  */
 
+import java.io.BufferedInputStream;
 import java.io.BufferedOutputStream;
 import java.io.BufferedReader;
+import java.io.DataInputStream;
+import java.io.EOFException;
 import java.io.FileInputStream;
 import java.io.FileOutputStream;
 import java.io.IOException;
+import java.io.InputStream;
 import java.io.InputStreamReader;
 import java.io.PrintStream;
 import java.io.Reader;
 import java.nio.charset.StandardCharsets;
-import java.util.Map;
-import java.util.TreeMap;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Comparator;
+import java.util.HashMap;
+import java.util.List;
 
 public class FlameGraph {
     public String title = "Flame Graph";
@@ -34,7 +41,10 @@ public class FlameGraph {
     public String input;
     public String output;
 
-    private final Frame root = new Frame();
+    // Frames refer to their names by index, so that every distinct name is stored once
+    private final List<String> names = new ArrayList<>();
+    private final HashMap<String, Integer> nameIds = new HashMap<>();
+    private final Frame root = new Frame(nameId("all"));
     private int depth;
     private long mintotal;
 
@@ -60,7 +70,88 @@ public class FlameGraph {
     }
 
     public void parse() throws IOException {
-        parse(new InputStreamReader(new FileInputStream(input), StandardCharsets.UTF_8));
+        if (isBinaryProfile(input)) {
+            try (InputStream in = new BufferedInputStream(new FileInputStream(input), 65536)) {
+                parseBinary(in);
+            }
+        } else {
+            parse(new InputStreamReader(new FileInputStream(input), StandardCharsets.UTF_8));
+        }
+    }
+
+    public static boolean isBinaryProfile(String file) throws IOException {
+        try (FileInputStream in = new FileInputStream(file)) {
+            byte[] magic = new byte[4];
+            return in.read(magic) == 4 && Arrays.equals(magic, BINARY_MAGIC);
+        }
+    }
+
+    // Collapsed stacks in the compact binary form of the profiler's binary output, see binaryProfile.h.
+    // Frame names follow the traces, so traces are kept as arrays of name ids until the names are read
+    public void parseBinary(InputStream in) throws IOException {
+        DataInputStream data = new DataInputStream(in);
+        byte[] magic = new byte[4];
+        data.readFully(magic);
+        if (!Arrays.equals(magic, BINARY_MAGIC)) {
+            throw new IOException("Not a binary profile");
+        }
+        int version = data.readUnsignedByte();
+        if (version != BINARY_VERSION) {
+            throw new IOException("Unsupported binary profile version " + version);
+        }
+        readVarint(data);  // counter: samples or total
+
+        int[] ids = new int[65536];
+        int idCount = 0;
+        long[] values = new long[1024];
+        int[] depths = new int[1024];
+        int traceCount = 0;
+
+        for (int depth; (depth = (int) readVarint(data)) != 0; ) {
+            if (traceCount == values.length) {
+                values = Arrays.copyOf(values, traceCount * 2);
+                depths = Arrays.copyOf(depths, traceCount * 2);
+            }
+            values[traceCount] = readVarint(data);
+            depths[traceCount++] = depth;
+
+            if (idCount + depth > ids.length) {
+                ids = Arrays.copyOf(ids, Math.max(idCount + depth, ids.length * 2));
+            }
+            for (int i = 0; i < depth; i++) {
+                ids[idCount++] = (int) readVarint(data);
+            }
+        }
+
+        int[] nameMap = new int[(int) readVarint(data)];
+        for (int i = 0; i < nameMap.length; i++) {
+            byte[] name = new byte[(int) readVarint(data)];
+            data.readFully(name);
+            nameMap[i] = nameId(new String(name, StandardCharsets.UTF_8));
+        }
+
+        // Frames of a binary trace go from the root to the leaf, as in the collapsed format
+        for (int t = 0, pos = 0; t < traceCount; t++) {
+            int[] trace = new int[depths[t]];
+            for (int i = 0; i < trace.length; i++) {
+                trace[i] = nameMap[ids[pos++]];
+            }
+            addSample(trace, values[t]);
+        }
+    }
+
+    private static long readVarint(DataInputStream in) throws IOException {
+        long result = 0;
+        for (int shift = 0; ; shift += 7) {
+            int b = in.read();
+            if (b < 0) {
+                throw new EOFException();
+            }
+            result |= (long) (b & 0x7f) << shift;
+            if (b < 0x80) {
+                return result;
+            }
+        }
     }
 
     public void parse(Reader in) throws IOException {
@@ -76,7 +167,26 @@ public class FlameGraph {
         }
     }
 
+    public int nameId(String name) {
+        Integer id = nameIds.get(name);
+        if (id == null) {
+            id = names.size();
+            names.add(name);
+            nameIds.put(name, id);
+        }
+        return id;
+    }
+
     public void addSample(String[] trace, long ticks) {
+        int[] ids = new int[trace.length];
+        for (int i = 0; i < trace.length; i++) {
+            ids[i] = nameId(trace[i]);
+        }
+        addSample(ids, ticks);
+    }
+
+    // Frames are ids of nameId(), from the root to the leaf
+    public void addSample(int[] trace, long ticks) {
         Frame frame = root;
         if (reverse) {
             for (int i = trace.length; --i >= skip; ) {
@@ -95,6 +205,54 @@ public class FlameGraph {
         depth = Math.max(depth, trace.length);
     }
 
+    // Adds all samples of another flame graph built with the same options. Names of the other graph
+    // are remapped to the ids of this one, so the result holds every distinct name once
+    public void merge(FlameGraph other) {
+        int[] nameMap = new int[other.names.size()];
+        for (int i = 0; i < nameMap.length; i++) {
+            nameMap[i] = nameId(other.names.get(i));
+        }
+        mergeFrame(root, other.root, nameMap);
+        depth = Math.max(depth, other.depth);
+    }
+
+    private static void mergeFrame(Frame target, Frame source, int[] nameMap) {
+        target.total += source.total;
+        target.self += source.self;
+        for (Frame child : source.children) {
+            if (child != null) {
+                mergeFrame(target.child(nameMap[child.name]), child, nameMap);
+            }
+        }
+    }
+
+    // Collapsed stacks, one line per frame with self samples, from the root to the leaf
+    // (or the other way round for a reversed graph)
+    public void dumpCollapsed(PrintStream out) {
+        StringBuilder sb = new StringBuilder();
+        for (Frame child : root.sortedChildren(nameOrder)) {
+            printCollapsed(out, child, sb);
+        }
+    }
+
+    private void printCollapsed(PrintStream out, Frame frame, StringBuilder sb) {
+        int length = sb.length();
+        if (length > 0) {
+            sb.append(';');
+        }
+        sb.append(names.get(frame.name));
+
+        if (frame.self > 0) {
+            out.print(sb);
+            out.print(' ');
+            out.println(frame.self);
+        }
+        for (Frame child : frame.sortedChildren(nameOrder)) {
+            printCollapsed(out, child, sb);
+        }
+        sb.setLength(length);
+    }
+
     public void dump() throws IOException {
         if (output == null) {
             dump(System.out);
@@ -116,7 +274,7 @@ public class FlameGraph {
                 "{depth}", depth,
                 "{reverse}", reverse));
 
-        printFrame(out, "all", root, 0, 0);
+        printFrame(out, root, 0, 0);
 
         out.print(FOOTER);
     }
@@ -142,7 +300,8 @@ public class FlameGraph {
         return result.toString();
     }
 
-    private void printFrame(PrintStream out, String title, Frame frame, int level, long x) {
+    private void printFrame(PrintStream out, Frame frame, int level, long x) {
+        String title = names.get(frame.name);
         int type = frameType(title);
         title = stripSuffix(title);
         if (title.indexOf('\\') >= 0) {
@@ -155,10 +314,9 @@ public class FlameGraph {
         out.println("f(" + level + "," + x + "," + frame.total + "," + type + ",'" + title + "')");
 
         x += frame.self;
-        for (Map.Entry<String, Frame> e : frame.entrySet()) {
-            Frame child = e.getValue();
+        for (Frame child : frame.sortedChildren(nameOrder)) {
             if (child.total >= mintotal) {
-                printFrame(out, e.getKey(), child, level + 1, x);
+                printFrame(out, child, level + 1, x);
             }
             x += child.total;
         }
@@ -192,7 +350,7 @@ public class FlameGraph {
     public static void main(String[] args) throws IOException {
         FlameGraph fg = new FlameGraph(args);
         if (fg.input == null) {
-            System.out.println("Usage: java " + FlameGraph.class.getName() + " [options] input.collapsed [output.html]");
+            System.out.println("Usage: java " + FlameGraph.class.getName() + " [options] input.collapsed|input.bin [output.html]");
             System.out.println();
             System.out.println("Options:");
             System.out.println("  --title TITLE");
@@ -206,31 +364,96 @@ public class FlameGraph {
         fg.dump();
     }
 
-    static class Frame extends TreeMap<String, Frame> {
+    // Children are listed in alphabetical order
+    private final Comparator<Frame> nameOrder = new Comparator<Frame>() {
+        @Override
+        public int compare(Frame a, Frame b) {
+            return names.get(a.name).compareTo(names.get(b.name));
+        }
+    };
+
+    // Children are kept in an open addressing table keyed by name id, which takes
+    // much less memory than a map of boxed keys and entry objects
+    static class Frame {
+        private static final Frame[] NO_CHILDREN = new Frame[0];
+
+        final int name;
         long total;
         long self;
+        private Frame[] children = NO_CHILDREN;
+        private int childCount;
+
+        Frame(int name) {
+            this.name = name;
+        }
 
-        Frame child(String title) {
-            Frame child = get(title);
-            if (child == null) {
-                put(title, child = new Frame());
+        Frame child(int name) {
+            if (children.length == 0) {
+                children = new Frame[4];
+            }
+
+            int mask = children.length - 1;
+            int i = hash(name) & mask;
+            for (Frame f; (f = children[i]) != null; i = (i + 1) & mask) {
+                if (f.name == name) {
+                    return f;
+                }
+            }
+
+            Frame child = new Frame(name);
+            children[i] = child;
+            if (++childCount * 2 > children.length) {
+                resize(children.length * 2);
             }
             return child;
         }
 
+        Frame[] sortedChildren(Comparator<Frame> order) {
+            Frame[] result = new Frame[childCount];
+            int count = 0;
+            for (Frame f : children) {
+                if (f != null) {
+                    result[count++] = f;
+                }
+            }
+            Arrays.sort(result, order);
+            return result;
+        }
+
         int depth(long cutoff) {
             int depth = 0;
-            if (size() > 0) {
-                for (Frame child : values()) {
-                    if (child.total >= cutoff) {
-                        depth = Math.max(depth, child.depth(cutoff));
-                    }
+            for (Frame child : children) {
+                if (child != null && child.total >= cutoff) {
+                    depth = Math.max(depth, child.depth(cutoff));
                 }
             }
             return depth + 1;
         }
+
+        private void resize(int newCapacity) {
+            Frame[] newChildren = new Frame[newCapacity];
+            int mask = newCapacity - 1;
+            for (Frame f : children) {
+                if (f != null) {
+                    int i = hash(f.name) & mask;
+                    while (newChildren[i] != null) {
+                        i = (i + 1) & mask;
+                    }
+                    newChildren[i] = f;
+                }
+            }
+            children = newChildren;
+        }
+
+        private static int hash(int name) {
+            int h = name * 0x9e3779b9;
+            return h ^ (h >>> 16);
+        }
     }
 
+    private static final byte[] BINARY_MAGIC = {'A', 'S', 'P', 'B'};
+    private static final int BINARY_VERSION = 1;
+
     private static final String HEADER = "<!DOCTYPE html>\n" +
             "<html lang='en'>\n" +
             "<head>\n" +
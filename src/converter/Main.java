@@ -25,7 +25,9 @@ public class Main {
         System.out.println();
         System.out.println("Available converters:");
         System.out.println("  FlameGraph input.collapsed output.html");
+        System.out.println("  FlameGraph input.bin       output.html");
         System.out.println("  jfr2flame  input.jfr       output.html");
         System.out.println("  jfr2nflx   input.jfr       output.nflx");
+        System.out.println("  merge2flame input...  --output output.html");
     }
 }
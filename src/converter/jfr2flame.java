@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+import one.jfr.Chunk;
 import one.jfr.ClassRef;
 import one.jfr.Dictionary;
 import one.jfr.JfrReader;
@@ -24,11 +25,23 @@ import one.jfr.event.ContendedLock;
 import one.jfr.event.Event;
 import one.jfr.event.EventAggregator;
 import one.jfr.event.ExecutionSample;
+import one.jfr.event.LiveObject;
+import one.jfr.event.MallocEvent;
+import one.jfr.event.OffCpuSample;
 
 import java.io.IOException;
+import java.io.InterruptedIOException;
 import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
 import java.util.Arrays;
 import java.util.HashSet;
+import java.util.List;
+import java.util.Set;
+import java.util.concurrent.Callable;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Future;
 
 /**
  * Converts .jfr output produced by async-profiler to HTML Flame Graph.
@@ -40,6 +53,20 @@ public class jfr2flame {
 
     private final JfrReader jfr;
     private final Dictionary<String> methodNames = new Dictionary<>();
+    // methodId -> pairs of (frame key, FlameGraph name id), see frameId()
+    private final Dictionary<int[]> frameIds = new Dictionary<>();
+
+    // Time window relative to the recording start
+    public long fromNanos;
+    public long toNanos = Long.MAX_VALUE;
+    // Only threads whose name contains this string
+    public String threadFilter;
+    // Only events recorded in this context, see AsyncProfiler.setContext()
+    public long contextFilter;
+    // Chunks decoded in parallel
+    public int jobs = 1;
+    // Keep the chunk index next to the recording
+    public boolean persistIndex;
 
     public jfr2flame(JfrReader jfr) {
         this.jfr = jfr;
@@ -49,8 +76,14 @@ public class jfr2flame {
                         final boolean lines, final boolean bci,
                         final Class<? extends Event> eventClass) throws IOException {
         EventAggregator agg = new EventAggregator(threads, total);
-        for (Event event; (event = jfr.readEvent(eventClass)) != null; ) {
-            agg.collect(event);
+        if (eventClass == LiveObject.class) {
+            collectLiveSnapshot(agg);
+        } else if (!collectChunks(agg, threads, total, eventClass)) {
+            for (Event event; (event = jfr.readEvent(eventClass)) != null; ) {
+                if (contextFilter == 0 || contextOf(event) == contextFilter) {
+                    agg.collect(event);
+                }
+            }
         }
 
         final double ticksToNanos = 1e9 / jfr.ticksPerSec;
@@ -66,23 +99,23 @@ public class jfr2flame {
                     byte[] types = stackTrace.types;
                     int[] locations = stackTrace.locations;
                     String classFrame = getClassFrame(event);
-                    String[] trace = new String[methods.length + (threads ? 1 : 0) + (classFrame != null ? 1 : 0)];
+                    int[] trace = new int[methods.length + (threads ? 1 : 0) + (classFrame != null ? 1 : 0)];
                     if (threads) {
-                        trace[0] = getThreadFrame(event.tid);
+                        trace[0] = fg.nameId(getThreadFrame(event.tid));
                     }
                     int idx = trace.length;
                     if (classFrame != null) {
-                        trace[--idx] = classFrame;
+                        trace[--idx] = fg.nameId(classFrame);
                     }
                     for (int i = 0; i < methods.length; i++) {
-                        String methodName = getMethodName(methods[i], types[i]);
-                        int location;
+                        int location = 0;
+                        char separator = 0;
                         if (lines && (location = locations[i] >>> 16) != 0) {
-                            methodName += ":" + location;
+                            separator = ':';
                         } else if (bci && (location = locations[i] & 0xffff) != 0) {
-                            methodName += "@" + location;
+                            separator = '@';
                         }
-                        trace[--idx] = methodName + FRAME_SUFFIX[types[i]];
+                        trace[--idx] = frameId(fg, methods[i], types[i], location, separator);
                     }
                     fg.addSample(trace, scale ? (long) (value * ticksToNanos) : value);
                 }
@@ -90,6 +123,165 @@ public class jfr2flame {
         });
     }
 
+    // Decodes chunks that may contain matching events, each one into its own aggregator.
+    // Returns false if there is nothing to filter or parallelize, so that the file is simply read through
+    private boolean collectChunks(EventAggregator agg, boolean threads, boolean total,
+                                  Class<? extends Event> eventClass) throws IOException {
+        boolean filter = threadFilter != null || fromNanos > 0 || toNanos != Long.MAX_VALUE;
+        boolean useIndex = threadFilter != null || persistIndex;
+
+        List<Chunk> chunks = useIndex ? jfr.index(persistIndex) : jfr.chunks();
+        if (!filter && (jobs <= 1 || chunks.size() <= 1)) {
+            return false;
+        }
+
+        Set<Integer> tids = threadFilter != null ? findThreads(threadFilter) : null;
+        long from = jfr.startNanos + fromNanos;
+        long to = toNanos == Long.MAX_VALUE ? Long.MAX_VALUE : jfr.startNanos + toNanos;
+        int eventMask = Chunk.eventMask(eventClass);
+
+        ExecutorService executor = Executors.newFixedThreadPool(Math.max(jobs, 1));
+        try {
+            ArrayList<Future<ChunkTask>> tasks = new ArrayList<>();
+            for (Chunk chunk : chunks) {
+                if (chunk.hasEvents(eventMask) && chunk.overlaps(from, to) && (tids == null || chunk.hasAnyThread(tids))) {
+                    ChunkTask task = new ChunkTask(jfr, chunk, new EventAggregator(threads, total), eventClass,
+                                                   tids, contextFilter, from, to);
+                    tasks.add(executor.submit(task));
+                }
+            }
+
+            // Stack traces are resolved through the main reader, so it needs constants of every decoded chunk
+            for (Future<ChunkTask> future : tasks) {
+                ChunkTask task = future.get();
+                jfr.importConstants(task.reader);
+                agg.merge(task.agg);
+                task.reader.close();
+            }
+        } catch (InterruptedException e) {
+            throw new InterruptedIOException();
+        } catch (ExecutionException e) {
+            Throwable cause = e.getCause();
+            if (cause instanceof IOException) throw (IOException) cause;
+            if (cause instanceof RuntimeException) throw (RuntimeException) cause;
+            throw new IOException(cause);
+        } finally {
+            executor.shutdownNow();
+        }
+        return true;
+    }
+
+    // Every dump of a running recording writes all objects that are still alive, so a recording
+    // holds one snapshot of the live heap per dump. Only the last one, i.e. the last chunk
+    // with LiveObject events, describes the heap at the end of the recording
+    private void collectLiveSnapshot(EventAggregator agg) throws IOException {
+        List<Chunk> chunks = jfr.index(persistIndex);
+        for (int i = chunks.size(); --i >= 0; ) {
+            Chunk chunk = chunks.get(i);
+            if (chunk.hasEvents(Chunk.LIVE_OBJECT)) {
+                Set<Integer> tids = threadFilter != null ? findThreads(threadFilter) : null;
+                long from = jfr.startNanos + fromNanos;
+                long to = toNanos == Long.MAX_VALUE ? Long.MAX_VALUE : jfr.startNanos + toNanos;
+                ChunkTask task = new ChunkTask(jfr, chunk, agg, LiveObject.class, tids, contextFilter, from, to).call();
+                jfr.importConstants(task.reader);
+                task.reader.close();
+                return;
+            }
+        }
+    }
+
+    private Set<Integer> findThreads(final String name) {
+        final HashSet<Integer> tids = new HashSet<>();
+        jfr.threads.forEach(new Dictionary.Visitor<String>() {
+            @Override
+            public void visit(long tid, String threadName) {
+                if (threadName != null && threadName.contains(name)) {
+                    tids.add((int) tid);
+                }
+            }
+        });
+        return tids;
+    }
+
+    private static class ChunkTask implements Callable<ChunkTask> {
+        final JfrReader jfr;
+        final Chunk chunk;
+        final EventAggregator agg;
+        final Class<? extends Event> eventClass;
+        final Set<Integer> tids;
+        final long contextId;
+        final long from;
+        final long to;
+        JfrReader reader;
+
+        ChunkTask(JfrReader jfr, Chunk chunk, EventAggregator agg, Class<? extends Event> eventClass,
+                  Set<Integer> tids, long contextId, long from, long to) {
+            this.jfr = jfr;
+            this.chunk = chunk;
+            this.agg = agg;
+            this.eventClass = eventClass;
+            this.tids = tids;
+            this.contextId = contextId;
+            this.from = from;
+            this.to = to;
+        }
+
+        @Override
+        public ChunkTask call() throws IOException {
+            reader = jfr.chunkReader(chunk);
+            boolean checkTime = from > chunk.startNanos || to < chunk.endNanos;
+            for (Event event; (event = reader.readEvent(eventClass)) != null; ) {
+                if (tids != null && !tids.contains(event.tid)) {
+                    continue;
+                }
+                if (contextId != 0 && contextOf(event) != contextId) {
+                    continue;
+                }
+                if (checkTime) {
+                    long time = chunk.ticksToNanos(event.time);
+                    if (time < from || time >= to) continue;
+                }
+                agg.collect(event);
+            }
+            return this;
+        }
+    }
+
+    // Frames are interned in the FlameGraph once per distinct method, type and line (or bci),
+    // so that names are neither resolved nor concatenated again for every stack trace
+    private int frameId(FlameGraph fg, long methodId, byte type, int location, char separator) {
+        int key = (location << 1 | (separator == '@' ? 1 : 0)) << 8 | type;
+        int[] ids = frameIds.get(methodId);
+        if (ids != null) {
+            for (int i = 0; i < ids.length; i += 2) {
+                if (ids[i] == key) {
+                    return ids[i + 1];
+                }
+            }
+        }
+
+        String name = getMethodName(methodId, type);
+        if (separator != 0) {
+            name = name + separator + location;
+        }
+        int id = fg.nameId(name + FRAME_SUFFIX[type]);
+
+        int[] newIds = ids == null ? new int[2] : Arrays.copyOf(ids, ids.length + 2);
+        newIds[newIds.length - 2] = key;
+        newIds[newIds.length - 1] = id;
+        frameIds.put(methodId, newIds);
+        return id;
+    }
+
+    private static long contextOf(Event event) {
+        if (event instanceof ExecutionSample) {
+            return ((ExecutionSample) event).contextId;
+        } else if (event instanceof AllocationSample) {
+            return ((AllocationSample) event).contextId;
+        }
+        return 0;
+    }
+
     private String getThreadFrame(int tid) {
         String threadName = jfr.threads.get(tid);
         return threadName == null ? "[tid=" + tid + ']' : '[' + threadName + " tid=" + tid + ']';
@@ -104,6 +296,9 @@ public class jfr2flame {
         } else if (event instanceof ContendedLock) {
             classId = ((ContendedLock) event).classId;
             suffix = "_[i]";
+        } else if (event instanceof LiveObject) {
+            classId = ((LiveObject) event).classId;
+            suffix = "_[i]";
         } else {
             return null;
         }
@@ -178,38 +373,94 @@ public class jfr2flame {
         return result;
     }
 
+    // Events of the flame graph selected by --alloc, --lock and similar options
+    public static Class<? extends Event> eventClass(Set<String> options) {
+        if (options.contains("--alloc")) {
+            return AllocationSample.class;
+        } else if (options.contains("--lock")) {
+            return ContendedLock.class;
+        } else if (options.contains("--live")) {
+            return LiveObject.class;
+        } else if (options.contains("--nativemem")) {
+            return MallocEvent.class;
+        } else if (options.contains("--offcpu")) {
+            return OffCpuSample.class;
+        }
+        return ExecutionSample.class;
+    }
+
     public static void main(String[] args) throws Exception {
+        // Options with values are handled here, the rest is passed to FlameGraph
+        ArrayList<String> fgArgs = new ArrayList<>();
+        long from = 0;
+        long to = Long.MAX_VALUE;
+        String thread = null;
+        long context = 0;
+        int jobs = Runtime.getRuntime().availableProcessors();
+        for (int i = 0; i < args.length; i++) {
+            String arg = args[i];
+            if (arg.equals("--from")) {
+                from = Long.parseLong(args[++i]) * 1000000;
+            } else if (arg.equals("--to")) {
+                to = Long.parseLong(args[++i]) * 1000000;
+            } else if (arg.equals("--thread")) {
+                thread = args[++i];
+            } else if (arg.equals("--context")) {
+                context = Long.parseLong(args[++i]);
+            } else if (arg.equals("--jobs")) {
+                jobs = Integer.parseInt(args[++i]);
+            } else {
+                fgArgs.add(arg);
+            }
+        }
+        args = fgArgs.toArray(new String[0]);
+
         FlameGraph fg = new FlameGraph(args);
         if (fg.input == null) {
-            System.out.println("Usage: java " + jfr2flame.class.getName() + " [options] input.jfr [output.html]");
+            System.out.println("Usage: java " + jfr2flame.class.getName() + " [options] input.jfr|input.bin [output.html]");
             System.out.println();
             System.out.println("options include all supported FlameGraph options, plus the following:");
             System.out.println("  --alloc    Allocation Flame Graph");
             System.out.println("  --lock     Lock contention Flame Graph");
+            System.out.println("  --live     Live objects Flame Graph (recorded with the live option)");
+            System.out.println("  --nativemem Native memory allocations Flame Graph");
+            System.out.println("  --offcpu   Off-CPU time Flame Graph (recorded with event=offcpu)");
             System.out.println("  --threads  Split profile by threads");
             System.out.println("  --total    Accumulate the total value (time, bytes, etc.)");
             System.out.println("  --lines    Show line numbers");
             System.out.println("  --bci      Show bytecode indices");
+            System.out.println("  --from ms  Skip events before this offset from the recording start");
+            System.out.println("  --to ms    Skip events after this offset from the recording start");
+            System.out.println("  --thread S Only threads whose name contains S");
+            System.out.println("  --context ID Only events recorded with the given context ID");
+            System.out.println("  --jobs N   Decode up to N chunks in parallel (default: number of CPUs)");
+            System.out.println("  --index    Save the chunk index next to the input to speed up next runs");
             System.exit(1);
         }
 
+        if (FlameGraph.isBinaryProfile(fg.input)) {
+            // Binary collapsed stacks of the profiler need no JFR decoding
+            fg.parse();
+            fg.dump();
+            return;
+        }
+
         HashSet<String> options = new HashSet<>(Arrays.asList(args));
         boolean threads = options.contains("--threads");
         boolean total = options.contains("--total");
         boolean lines = options.contains("--lines");
         boolean bci = options.contains("--bci");
-
-        Class<? extends Event> eventClass;
-        if (options.contains("--alloc")) {
-            eventClass = AllocationSample.class;
-        } else if (options.contains("--lock")) {
-            eventClass = ContendedLock.class;
-        } else {
-            eventClass = ExecutionSample.class;
-        }
+        Class<? extends Event> eventClass = eventClass(options);
 
         try (JfrReader jfr = new JfrReader(fg.input)) {
-            new jfr2flame(jfr).convert(fg, threads, total, lines, bci, eventClass);
+            jfr2flame converter = new jfr2flame(jfr);
+            converter.fromNanos = from;
+            converter.toNanos = to;
+            converter.threadFilter = thread;
+            converter.contextFilter = context;
+            converter.jobs = jobs;
+            converter.persistIndex = options.contains("--index");
+            converter.convert(fg, threads, total, lines, bci, eventClass);
         }
 
         fg.dump();
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2020 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import one.jfr.JfrReader;
+import one.jfr.event.Event;
+
+import java.io.BufferedOutputStream;
+import java.io.FileInputStream;
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.io.PrintStream;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.HashSet;
+import java.util.List;
+import java.util.Set;
+import java.util.concurrent.Callable;
+import java.util.concurrent.CompletionService;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorCompletionService;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+
+/**
+ * Merges many profiles, e.g. collected from a fleet of hosts, into one Flame Graph.
+ * Inputs may be .jfr recordings, collapsed stacks or binary profiles in any mix.
+ * Every input is parsed into its own graph on a worker thread; finished graphs are
+ * folded into the result, which keeps one copy of every distinct frame name and
+ * every distinct stack prefix. At most --jobs graphs are in memory besides the result.
+ */
+public class merge2flame {
+
+    private static final byte[] JFR_MAGIC = {'F', 'L', 'R', 0};
+
+    private final String[] fgArgs;
+    private final Set<String> options;
+    private final FlameGraph result;
+
+    // Inputs parsed in parallel
+    public int jobs = 1;
+
+    public merge2flame(String[] fgArgs) {
+        this.fgArgs = fgArgs;
+        this.options = new HashSet<>(Arrays.asList(fgArgs));
+        this.result = new FlameGraph(fgArgs);
+    }
+
+    public FlameGraph merge(List<String> inputs) throws IOException {
+        ExecutorService executor = Executors.newFixedThreadPool(Math.max(jobs, 1));
+        try {
+            CompletionService<FlameGraph> completion = new ExecutorCompletionService<>(executor);
+            int submitted = 0;
+            int merged = 0;
+            while (merged < inputs.size()) {
+                // Keep no more than jobs parsed graphs waiting to be merged
+                while (submitted < inputs.size() && submitted - merged < jobs) {
+                    final String input = inputs.get(submitted++);
+                    completion.submit(new Callable<FlameGraph>() {
+                        @Override
+                        public FlameGraph call() throws IOException {
+                            return parse(input);
+                        }
+                    });
+                }
+                result.merge(completion.take().get());
+                merged++;
+            }
+        } catch (InterruptedException e) {
+            throw new IOException("Interrupted", e);
+        } catch (ExecutionException e) {
+            Throwable cause = e.getCause();
+            if (cause instanceof IOException) {
+                throw (IOException) cause;
+            }
+            throw new IOException(cause);
+        } finally {
+            executor.shutdownNow();
+        }
+        return result;
+    }
+
+    private FlameGraph parse(String input) throws IOException {
+        FlameGraph fg = new FlameGraph(fgArgs);
+        fg.input = input;
+        if (!isJfr(input)) {
+            fg.parse();
+            return fg;
+        }
+
+        try (JfrReader jfr = new JfrReader(input)) {
+            Class<? extends Event> eventClass = jfr2flame.eventClass(options);
+            new jfr2flame(jfr).convert(fg, options.contains("--threads"), options.contains("--total"),
+                    options.contains("--lines"), options.contains("--bci"), eventClass);
+        }
+        return fg;
+    }
+
+    private static boolean isJfr(String file) throws IOException {
+        try (FileInputStream in = new FileInputStream(file)) {
+            byte[] magic = new byte[4];
+            return in.read(magic) == 4 && Arrays.equals(magic, JFR_MAGIC);
+        }
+    }
+
+    public static void main(String[] args) throws Exception {
+        // Inputs and options with values are handled here, the rest is passed to FlameGraph
+        ArrayList<String> fgArgs = new ArrayList<>();
+        ArrayList<String> inputs = new ArrayList<>();
+        String output = null;
+        int jobs = Runtime.getRuntime().availableProcessors();
+        for (int i = 0; i < args.length; i++) {
+            String arg = args[i];
+            if (arg.equals("--output")) {
+                output = args[++i];
+            } else if (arg.equals("--jobs")) {
+                jobs = Integer.parseInt(args[++i]);
+            } else if (arg.equals("--title") || arg.equals("--minwidth") || arg.equals("--skip")) {
+                fgArgs.add(arg);
+                fgArgs.add(args[++i]);
+            } else if (arg.startsWith("--")) {
+                fgArgs.add(arg);
+            } else if (!arg.isEmpty()) {
+                inputs.add(arg);
+            }
+        }
+
+        if (inputs.isEmpty()) {
+            System.out.println("Usage: java " + merge2flame.class.getName() + " [options] input... [--output output.html]");
+            System.out.println();
+            System.out.println("Inputs are .jfr, .collapsed or .bin files in any mix.");
+            System.out.println("options include all supported FlameGraph and jfr2flame event options, plus the following:");
+            System.out.println("  --output F Write the result to F instead of stdout");
+            System.out.println("  --collapsed Write collapsed stacks instead of HTML (default for .collapsed and .txt output)");
+            System.out.println("  --jobs N   Parse up to N inputs in parallel (default: number of CPUs)");
+            System.exit(1);
+        }
+
+        merge2flame merger = new merge2flame(fgArgs.toArray(new String[0]));
+        merger.jobs = jobs;
+        FlameGraph fg = merger.merge(inputs);
+
+        boolean collapsed = fgArgs.contains("--collapsed")
+                || output != null && (output.endsWith(".collapsed") || output.endsWith(".txt"));
+        if (output == null) {
+            dump(fg, System.out, collapsed);
+        } else {
+            try (BufferedOutputStream bos = new BufferedOutputStream(new FileOutputStream(output), 32768);
+                 PrintStream out = new PrintStream(bos, false, "UTF-8")) {
+                dump(fg, out, collapsed);
+            }
+        }
+    }
+
+    private static void dump(FlameGraph fg, PrintStream out, boolean collapsed) {
+        if (collapsed) {
+            fg.dumpCollapsed(out);
+        } else {
+            fg.dump(out);
+        }
+        out.flush();
+    }
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package one.jfr;
+
+import one.jfr.event.AllocationSample;
+import one.jfr.event.ContendedLock;
+import one.jfr.event.Event;
+import one.jfr.event.ExecutionSample;
+import one.jfr.event.LiveObject;
+import one.jfr.event.MallocEvent;
+import one.jfr.event.OffCpuSample;
+
+import java.util.Arrays;
+import java.util.Set;
+
+/**
+ * Location and summary of one chunk of a JFR file.
+ * Lets the converters skip chunks that cannot contain matching events.
+ */
+public class Chunk {
+    public static final int EXECUTION_SAMPLE = 1;
+    public static final int ALLOCATION_SAMPLE = 2;
+    public static final int CONTENDED_LOCK = 4;
+    public static final int LIVE_OBJECT = 8;
+    public static final int MALLOC = 16;
+    public static final int OFF_CPU = 32;
+    public static final int ALL_EVENTS = -1;
+
+    public final long offset;
+    public final long size;
+    public final long startNanos;
+    public final long endNanos;
+    public final long startTicks;
+    public final long ticksPerSec;
+    public final int eventTypes;  // bit mask of the above, ALL_EVENTS if not indexed
+    public final int[] threads;   // sorted thread IDs, null if not indexed
+
+    public Chunk(long offset, long size, long startNanos, long endNanos, long startTicks, long ticksPerSec,
+                 int eventTypes, int[] threads) {
+        this.offset = offset;
+        this.size = size;
+        this.startNanos = startNanos;
+        this.endNanos = endNanos;
+        this.startTicks = startTicks;
+        this.ticksPerSec = ticksPerSec;
+        this.eventTypes = eventTypes;
+        this.threads = threads;
+    }
+
+    public static int eventMask(Class<? extends Event> cls) {
+        if (cls == ExecutionSample.class) {
+            return EXECUTION_SAMPLE;
+        } else if (cls == AllocationSample.class) {
+            return ALLOCATION_SAMPLE;
+        } else if (cls == ContendedLock.class) {
+            return CONTENDED_LOCK;
+        } else if (cls == LiveObject.class) {
+            return LIVE_OBJECT;
+        } else if (cls == MallocEvent.class) {
+            return MALLOC;
+        } else if (cls == OffCpuSample.class) {
+            return OFF_CPU;
+        }
+        return ALL_EVENTS;
+    }
+
+    public boolean hasEvents(int mask) {
+        return (eventTypes & mask) != 0;
+    }
+
+    public boolean hasAnyThread(Set<Integer> tids) {
+        if (threads == null) {
+            return true;
+        }
+        for (Integer tid : tids) {
+            if (Arrays.binarySearch(threads, tid) >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    public boolean overlaps(long fromNanos, long toNanos) {
+        return startNanos < toNanos && endNanos >= fromNanos;
+    }
+
+    public long ticksToNanos(long ticks) {
+        return startNanos + (long) ((ticks - startTicks) * 1e9 / ticksPerSec);
+    }
+}
@@ -20,31 +20,54 @@ import one.jfr.event.AllocationSample;
 import one.jfr.event.ContendedLock;
 import one.jfr.event.Event;
 import one.jfr.event.ExecutionSample;
+import one.jfr.event.LiveObject;
+import one.jfr.event.MallocEvent;
+import one.jfr.event.OffCpuSample;
 
+import java.io.BufferedInputStream;
+import java.io.BufferedOutputStream;
 import java.io.Closeable;
+import java.io.DataInputStream;
+import java.io.DataOutputStream;
+import java.io.EOFException;
 import java.io.IOException;
+import java.io.InputStream;
 import java.nio.ByteBuffer;
+import java.nio.channels.Channels;
 import java.nio.channels.FileChannel;
 import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
 import java.nio.file.Paths;
+import java.nio.file.StandardCopyOption;
 import java.nio.file.StandardOpenOption;
 import java.util.ArrayList;
+import java.util.Arrays;
 import java.util.Collections;
 import java.util.HashMap;
+import java.util.HashSet;
 import java.util.List;
 import java.util.Map;
+import java.util.zip.GZIPInputStream;
 
 /**
  * Parses JFR output produced by async-profiler.
+ * The file is memory mapped one chunk at a time.
  */
 public class JfrReader implements Closeable {
-    private static final int BUFFER_SIZE = 2 * 1024 * 1024;
     private static final int CHUNK_HEADER_SIZE = 68;
     private static final int CHUNK_SIGNATURE = 0x464c5200;
+    private static final int INDEX_SIGNATURE = 0x4a465249;
+    private static final int INDEX_VERSION = 1;
+    private static final String INDEX_SUFFIX = ".idx";
 
+    private final String fileName;
     private final FileChannel ch;
+    private final boolean ownsChannel;
+    private final long endPosition;
+    private final ByteBuffer header = ByteBuffer.allocate(CHUNK_HEADER_SIZE);
     private ByteBuffer buf;
-    private long filePosition;
+    private long chunkPosition;
 
     public boolean incomplete;
     public long startNanos = Long.MAX_VALUE;
@@ -61,6 +84,7 @@ public class JfrReader implements Closeable {
     public final Dictionary<StackTrace> stackTraces = new Dictionary<>();
     public final Map<Integer, String> frameTypes = new HashMap<>();
     public final Map<Integer, String> threadStates = new HashMap<>();
+    public final Map<Integer, String> sampledEvents = new HashMap<>();
     public final Map<String, String> settings = new HashMap<>();
 
     private int executionSample;
@@ -68,31 +92,163 @@ public class JfrReader implements Closeable {
     private int allocationInNewTLAB;
     private int allocationOutsideTLAB;
     private int allocationSample;
+    private int allocationBatch;
     private int monitorEnter;
     private int threadPark;
+    private int liveObject;
+    private int malloc;
+    private int offCpu;
     private int activeSetting;
+    private boolean executionSampleHasEvent;
+    private boolean executionSampleHasContext;
+    private boolean executionSampleHasCpu;
+    private boolean allocationInNewTLABHasContext;
+    private boolean allocationOutsideTLABHasContext;
     private boolean activeSettingHasStack;
 
     public JfrReader(String fileName) throws IOException {
-        this.ch = FileChannel.open(Paths.get(fileName), StandardOpenOption.READ);
-        this.buf = ByteBuffer.allocateDirect(BUFFER_SIZE);
+        this.fileName = fileName;
+        this.ch = openFile(fileName);
+        this.ownsChannel = true;
+        this.endPosition = ch.size();
 
-        buf.flip();
-        ensureBytes(CHUNK_HEADER_SIZE);
         if (!readChunk(0)) {
             throw new IOException("Incomplete JFR file");
         }
     }
 
+    // Reads a single chunk of the parent's file. Readers of different chunks
+    // share the channel and can be used concurrently from different threads
+    private JfrReader(JfrReader parent, Chunk chunk) throws IOException {
+        this.fileName = parent.fileName;
+        this.ch = parent.ch;
+        this.ownsChannel = false;
+        this.endPosition = chunk.offset + chunk.size;
+
+        if (!readChunk(chunk.offset)) {
+            throw new IOException("Incomplete JFR chunk at " + chunk.offset);
+        }
+    }
+
     @Override
     public void close() throws IOException {
-        ch.close();
+        if (ownsChannel) {
+            ch.close();
+        }
+    }
+
+    // A compressed recording is a sequence of gzip members, one per chunk.
+    // It is unpacked into a temporary file, since parsing needs random access
+    private static FileChannel openFile(String fileName) throws IOException {
+        FileChannel ch = FileChannel.open(Paths.get(fileName), StandardOpenOption.READ);
+        ByteBuffer magic = ByteBuffer.allocate(2);
+        if (ch.read(magic, 0) < 2 || (magic.get(0) & 0xff) != 0x1f || (magic.get(1) & 0xff) != 0x8b) {
+            return ch;
+        }
+
+        Path tmp = Files.createTempFile("jfr", ".tmp");
+        try (InputStream in = new GZIPInputStream(Channels.newInputStream(ch), 65536)) {
+            Files.copy(in, tmp, StandardCopyOption.REPLACE_EXISTING);
+        } catch (EOFException e) {
+            // The last chunk is incomplete: keep what has been unpacked so far
+        } catch (IOException e) {
+            Files.delete(tmp);
+            throw e;
+        }
+        return FileChannel.open(tmp, StandardOpenOption.READ, StandardOpenOption.DELETE_ON_CLOSE);
     }
 
     public long durationNanos() {
         return endNanos - startNanos;
     }
 
+    /**
+     * Creates a reader of one chunk of this file. Constant pools of the chunk
+     * are parsed into the new reader's dictionaries; see {@link #importConstants}.
+     */
+    public JfrReader chunkReader(Chunk chunk) throws IOException {
+        return new JfrReader(this, chunk);
+    }
+
+    /**
+     * Returns complete chunks of the file, found by walking chunk headers only.
+     * Event types and threads of the returned chunks are unknown.
+     */
+    public List<Chunk> chunks() throws IOException {
+        ArrayList<Chunk> chunks = new ArrayList<>();
+        for (long pos = 0; readHeader(pos); pos += header.getLong(8)) {
+            long chunkStartNanos = header.getLong(32);
+            chunks.add(new Chunk(pos, header.getLong(8), chunkStartNanos, chunkStartNanos + header.getLong(40),
+                    header.getLong(48), header.getLong(56), Chunk.ALL_EVENTS, null));
+        }
+        return chunks;
+    }
+
+    /**
+     * Returns chunks of the file along with event types and threads found in every chunk.
+     * Building the index takes a pass over the whole file; names of all threads
+     * are added to {@link #threads} on the way. When persist is set, the index is saved
+     * next to the recording and reused by later calls until the recording changes.
+     */
+    public List<Chunk> index(boolean persist) throws IOException {
+        Path indexFile = Paths.get(fileName + INDEX_SUFFIX);
+        if (persist) {
+            List<Chunk> chunks = loadIndex(indexFile);
+            if (chunks != null) {
+                return chunks;
+            }
+        }
+
+        ArrayList<Chunk> chunks = new ArrayList<>();
+        for (Chunk chunk : chunks()) {
+            JfrReader reader = chunkReader(chunk);
+            chunks.add(reader.scanChunk(chunk));
+            reader.threads.forEach(new Dictionary.Visitor<String>() {
+                @Override
+                public void visit(long key, String value) {
+                    threads.put(key, value);
+                }
+            });
+        }
+
+        if (persist) {
+            try {
+                saveIndex(indexFile, chunks);
+            } catch (IOException e) {
+                // The index is only a shortcut for the next run
+            }
+        }
+        return chunks;
+    }
+
+    /**
+     * Copies constants of another reader of the same file, e.g. one returned by {@link #chunkReader},
+     * so that stack traces and methods of its events can be resolved through this reader.
+     */
+    public void importConstants(JfrReader other) {
+        copy(other.threads, threads);
+        copy(other.classes, classes);
+        copy(other.symbols, symbols);
+        copy(other.methods, methods);
+        copy(other.stackTraces, stackTraces);
+        frameTypes.putAll(other.frameTypes);
+        threadStates.putAll(other.threadStates);
+        sampledEvents.putAll(other.sampledEvents);
+        settings.putAll(other.settings);
+        startNanos = Math.min(startNanos, other.startNanos);
+        endNanos = Math.max(endNanos, other.endNanos);
+        startTicks = Math.min(startTicks, other.startTicks);
+    }
+
+    private static <T> void copy(Dictionary<T> from, final Dictionary<T> to) {
+        from.forEach(new Dictionary.Visitor<T>() {
+            @Override
+            public void visit(long key, T value) {
+                to.put(key, value);
+            }
+        });
+    }
+
     public List<Event> readAllEvents() throws IOException {
         return readAllEvents(null);
     }
@@ -112,57 +268,254 @@ public class JfrReader implements Closeable {
 
     @SuppressWarnings("unchecked")
     public <E extends Event> E readEvent(Class<E> cls) throws IOException {
-        while (ensureBytes(CHUNK_HEADER_SIZE)) {
+        while (buf.hasRemaining() || nextChunk()) {
             int pos = buf.position();
             int size = getVarint();
             int type = getVarint();
 
-            if (type == 'L' && buf.getInt(pos) == CHUNK_SIGNATURE) {
-                if (readChunk(pos)) {
-                    continue;
-                }
-                break;
-            }
-
             if (type == executionSample || type == nativeMethodSample) {
-                if (cls == null || cls == ExecutionSample.class) return (E) readExecutionSample();
+                if (cls == null || cls == ExecutionSample.class) return (E) readExecutionSample(type == executionSample);
             } else if (type == allocationInNewTLAB) {
-                if (cls == null || cls == AllocationSample.class) return (E) readAllocationSample(true);
-            } else if (type == allocationOutsideTLAB || type == allocationSample) {
-                if (cls == null || cls == AllocationSample.class) return (E) readAllocationSample(false);
+                if (cls == null || cls == AllocationSample.class) return (E) readAllocationSample(true, allocationInNewTLABHasContext);
+            } else if (type == allocationOutsideTLAB) {
+                if (cls == null || cls == AllocationSample.class) return (E) readAllocationSample(false, allocationOutsideTLABHasContext);
+            } else if (type == allocationSample) {
+                if (cls == null || cls == AllocationSample.class) return (E) readAllocationSample(false, false);
+            } else if (type == allocationBatch) {
+                if (cls == null || cls == AllocationSample.class) return (E) readAllocationBatch();
             } else if (type == monitorEnter) {
                 if (cls == null || cls == ContendedLock.class) return (E) readContendedLock(false);
             } else if (type == threadPark) {
                 if (cls == null || cls == ContendedLock.class) return (E) readContendedLock(true);
+            } else if (type == liveObject) {
+                if (cls == null || cls == LiveObject.class) return (E) readLiveObject();
+            } else if (type == malloc) {
+                if (cls == null || cls == MallocEvent.class) return (E) readMallocEvent();
+            } else if (type == offCpu) {
+                if (cls == null || cls == OffCpuSample.class) return (E) readOffCpuSample();
             } else if (type == activeSetting) {
                 readActiveSetting();
             }
 
-            if ((pos += size) <= buf.limit()) {
-                buf.position(pos);
-            } else {
-                seek(filePosition + pos);
+            if (size <= 0) {
+                throw new IOException("Invalid event size at " + (chunkPosition + pos));
             }
+            buf.position(pos + size);
         }
         return null;
     }
 
-    private ExecutionSample readExecutionSample() {
+    // Collects event types and thread IDs of the current chunk without creating events
+    private Chunk scanChunk(Chunk chunk) throws IOException {
+        int eventTypes = 0;
+        HashSet<Integer> tids = new HashSet<>();
+
+        while (buf.hasRemaining()) {
+            int pos = buf.position();
+            int size = getVarint();
+            int type = getVarint();
+
+            if (type == executionSample || type == nativeMethodSample) {
+                eventTypes |= Chunk.EXECUTION_SAMPLE;
+                getVarlong();
+                tids.add(getVarint());
+            } else if (type == allocationInNewTLAB || type == allocationOutsideTLAB || type == allocationSample) {
+                eventTypes |= Chunk.ALLOCATION_SAMPLE;
+                getVarlong();
+                tids.add(getVarint());
+            } else if (type == allocationBatch) {
+                eventTypes |= Chunk.ALLOCATION_SAMPLE;
+                getVarlong();
+                getVarlong();
+                tids.add(getVarint());
+            } else if (type == monitorEnter || type == threadPark) {
+                eventTypes |= Chunk.CONTENDED_LOCK;
+                getVarlong();
+                getVarlong();
+                tids.add(getVarint());
+            } else if (type == liveObject) {
+                eventTypes |= Chunk.LIVE_OBJECT;
+                getVarlong();
+                tids.add(getVarint());
+            } else if (type == malloc) {
+                eventTypes |= Chunk.MALLOC;
+                getVarlong();
+                tids.add(getVarint());
+            } else if (type == offCpu) {
+                eventTypes |= Chunk.OFF_CPU;
+                getVarlong();
+                getVarlong();
+                tids.add(getVarint());
+            }
+
+            if (size <= 0) {
+                throw new IOException("Invalid event size at " + (chunkPosition + pos));
+            }
+            buf.position(pos + size);
+        }
+
+        int[] threads = new int[tids.size()];
+        int i = 0;
+        for (Integer tid : tids) {
+            threads[i++] = tid;
+        }
+        Arrays.sort(threads);
+
+        return new Chunk(chunk.offset, chunk.size, chunk.startNanos, chunk.endNanos,
+                chunk.startTicks, chunk.ticksPerSec, eventTypes, threads);
+    }
+
+    // The index is valid as long as the size and modification time of the recording stay the same
+    private List<Chunk> loadIndex(Path indexFile) {
+        if (!Files.isRegularFile(indexFile)) {
+            return null;
+        }
+
+        try (DataInputStream in = new DataInputStream(new BufferedInputStream(Files.newInputStream(indexFile), 65536))) {
+            Path source = Paths.get(fileName);
+            if (in.readInt() != INDEX_SIGNATURE || in.readInt() != INDEX_VERSION
+                    || in.readLong() != Files.size(source)
+                    || in.readLong() != Files.getLastModifiedTime(source).toMillis()) {
+                return null;
+            }
+
+            int chunkCount = in.readInt();
+            ArrayList<Chunk> chunks = new ArrayList<>(chunkCount);
+            for (int i = 0; i < chunkCount; i++) {
+                long offset = in.readLong();
+                long size = in.readLong();
+                long startNanos = in.readLong();
+                long endNanos = in.readLong();
+                long startTicks = in.readLong();
+                long ticksPerSec = in.readLong();
+                int eventTypes = in.readInt();
+                int[] tids = new int[in.readInt()];
+                for (int j = 0; j < tids.length; j++) {
+                    tids[j] = in.readInt();
+                }
+                chunks.add(new Chunk(offset, size, startNanos, endNanos, startTicks, ticksPerSec, eventTypes, tids));
+            }
+
+            int threadCount = in.readInt();
+            for (int i = 0; i < threadCount; i++) {
+                long tid = in.readLong();
+                threads.put(tid, in.readUTF());
+            }
+            return chunks;
+        } catch (IOException e) {
+            return null;
+        }
+    }
+
+    private void saveIndex(Path indexFile, List<Chunk> chunks) throws IOException {
+        Path tmp = Paths.get(indexFile + ".tmp");
+        try (DataOutputStream out = new DataOutputStream(new BufferedOutputStream(Files.newOutputStream(tmp), 65536))) {
+            Path source = Paths.get(fileName);
+            out.writeInt(INDEX_SIGNATURE);
+            out.writeInt(INDEX_VERSION);
+            out.writeLong(Files.size(source));
+            out.writeLong(Files.getLastModifiedTime(source).toMillis());
+
+            out.writeInt(chunks.size());
+            for (Chunk chunk : chunks) {
+                out.writeLong(chunk.offset);
+                out.writeLong(chunk.size);
+                out.writeLong(chunk.startNanos);
+                out.writeLong(chunk.endNanos);
+                out.writeLong(chunk.startTicks);
+                out.writeLong(chunk.ticksPerSec);
+                out.writeInt(chunk.eventTypes);
+                out.writeInt(chunk.threads.length);
+                for (int tid : chunk.threads) {
+                    out.writeInt(tid);
+                }
+            }
+
+            final ArrayList<Long> tids = new ArrayList<>();
+            final ArrayList<String> names = new ArrayList<>();
+            threads.forEach(new Dictionary.Visitor<String>() {
+                @Override
+                public void visit(long key, String value) {
+                    tids.add(key);
+                    names.add(value != null ? value : "");
+                }
+            });
+            out.writeInt(tids.size());
+            for (int i = 0; i < tids.size(); i++) {
+                out.writeLong(tids.get(i));
+                out.writeUTF(names.get(i));
+            }
+        }
+        Files.move(tmp, indexFile, StandardCopyOption.REPLACE_EXISTING);
+    }
+
+    private ExecutionSample readExecutionSample(boolean hasEvent) {
         long time = getVarlong();
         int tid = getVarint();
         int stackTraceId = getVarint();
         int threadState = getVarint();
-        return new ExecutionSample(time, tid, stackTraceId, threadState);
+        int event = hasEvent && executionSampleHasEvent ? getVarint() : 0;
+        long contextId = hasEvent && executionSampleHasContext ? getVarlong() : 0;
+        int cpu = -1;
+        int numaNode = -1;
+        if (hasEvent && executionSampleHasCpu) {
+            cpu = getVarint();
+            numaNode = getVarint();
+        }
+        return new ExecutionSample(time, tid, stackTraceId, threadState, event, contextId, cpu, numaNode);
     }
 
-    private AllocationSample readAllocationSample(boolean tlab) {
+    private AllocationSample readAllocationSample(boolean tlab, boolean hasContext) {
         long time = getVarlong();
         int tid = getVarint();
         int stackTraceId = getVarint();
         int classId = getVarint();
         long allocationSize = getVarlong();
         long tlabSize = tlab ? getVarlong() : 0;
-        return new AllocationSample(time, tid, stackTraceId, classId, allocationSize, tlabSize);
+        long contextId = hasContext ? getVarlong() : 0;
+        return new AllocationSample(time, tid, stackTraceId, classId, allocationSize, tlabSize, contextId);
+    }
+
+    // Several samples of one thread, stack trace and class merged by the allocbatch option
+    private AllocationSample readAllocationBatch() {
+        long time = getVarlong();
+        getVarlong();  // duration
+        int tid = getVarint();
+        int stackTraceId = getVarint();
+        int classId = getVarint();
+        boolean outsideTLAB = buf.get() != 0;
+        int samples = getVarint();
+        long allocationSize = getVarlong();
+        long contextId = getVarlong();
+        return new AllocationSample(time, tid, stackTraceId, classId, allocationSize,
+                outsideTLAB ? 0 : allocationSize, contextId, samples);
+    }
+
+    private LiveObject readLiveObject() {
+        long time = getVarlong();
+        int tid = getVarint();
+        int stackTraceId = getVarint();
+        int classId = getVarint();
+        long allocationSize = getVarlong();
+        long allocationTime = getVarlong();
+        return new LiveObject(time, tid, stackTraceId, classId, allocationSize, allocationTime);
+    }
+
+    private MallocEvent readMallocEvent() {
+        long time = getVarlong();
+        int tid = getVarint();
+        int stackTraceId = getVarint();
+        long address = getVarlong();
+        long size = getVarlong();
+        return new MallocEvent(time, tid, stackTraceId, address, size);
+    }
+
+    private OffCpuSample readOffCpuSample() {
+        long time = getVarlong();
+        long duration = getVarlong();
+        int tid = getVarint();
+        int stackTraceId = getVarint();
+        return new OffCpuSample(time, tid, stackTraceId, duration);
     }
 
     private ContendedLock readContendedLock(boolean hasTimeout) {
@@ -188,45 +541,76 @@ public class JfrReader implements Closeable {
         settings.put(name, value);
     }
 
-    private boolean readChunk(int pos) throws IOException {
-        if (pos + CHUNK_HEADER_SIZE > buf.limit() || buf.getInt(pos) != CHUNK_SIGNATURE) {
+    // Reads the chunk header into the header buffer; false if there is no complete chunk at this position
+    private boolean readHeader(long pos) throws IOException {
+        if (pos >= endPosition) {
+            return false;
+        }
+
+        header.clear();
+        while (header.hasRemaining() && ch.read(header, pos + header.position()) > 0) {
+            // keep reading
+        }
+        if (header.hasRemaining()) {
+            incomplete = true;
+            return false;
+        }
+        if (header.getInt(0) != CHUNK_SIGNATURE) {
             throw new IOException("Not a valid JFR file");
         }
 
-        int version = buf.getInt(pos + 4);
+        int version = header.getInt(4);
         if (version < 0x20000 || version > 0x2ffff) {
             throw new IOException("Unsupported JFR version: " + (version >>> 16) + "." + (version & 0xffff));
         }
 
-        long cpOffset = buf.getLong(pos + 16);
-        long metaOffset = buf.getLong(pos + 24);
-        if (cpOffset == 0 || metaOffset == 0) {
+        long chunkSize = header.getLong(8);
+        if (header.getLong(16) == 0 || header.getLong(24) == 0 || pos + chunkSize > endPosition) {
             incomplete = true;
             return false;
         }
+        if (chunkSize > Integer.MAX_VALUE) {
+            throw new IOException("JFR chunk is too large: " + chunkSize);
+        }
+        return true;
+    }
 
-        startNanos = Math.min(startNanos, buf.getLong(pos + 32));
-        endNanos = Math.max(endNanos, buf.getLong(pos + 32) + buf.getLong(pos + 40));
-        startTicks = Math.min(startTicks, buf.getLong(pos + 48));
-        ticksPerSec = buf.getLong(pos + 56);
+    private boolean nextChunk() throws IOException {
+        return readChunk(chunkPosition + buf.capacity());
+    }
+
+    private boolean readChunk(long pos) throws IOException {
+        if (!readHeader(pos)) {
+            return false;
+        }
+
+        long chunkSize = header.getLong(8);
+        long cpOffset = header.getLong(16);
+        long metaOffset = header.getLong(24);
+
+        startNanos = Math.min(startNanos, header.getLong(32));
+        endNanos = Math.max(endNanos, header.getLong(32) + header.getLong(40));
+        startTicks = Math.min(startTicks, header.getLong(48));
+        ticksPerSec = header.getLong(56);
+
+        buf = ch.map(FileChannel.MapMode.READ_ONLY, pos, chunkSize);
+        chunkPosition = pos;
 
         types.clear();
         typesByName.clear();
 
-        long chunkStart = filePosition + pos;
-        readMeta(chunkStart + metaOffset);
-        readConstantPool(chunkStart + cpOffset);
+        readMeta((int) metaOffset);
+        readConstantPool((int) cpOffset);
         cacheEventTypes();
 
-        seek(chunkStart + CHUNK_HEADER_SIZE);
+        buf.position(CHUNK_HEADER_SIZE);
         return true;
     }
 
-    private void readMeta(long metaOffset) throws IOException {
-        seek(metaOffset);
-        ensureBytes(5);
+    private void readMeta(int metaOffset) {
+        buf.position(metaOffset);
 
-        ensureBytes(getVarint() - buf.position());
+        getVarint();
         getVarint();
         getVarlong();
         getVarlong();
@@ -273,13 +657,12 @@ public class JfrReader implements Closeable {
         }
     }
 
-    private void readConstantPool(long cpOffset) throws IOException {
+    private void readConstantPool(int cpOffset) {
         long delta;
         do {
-            seek(cpOffset);
-            ensureBytes(5);
+            buf.position(cpOffset);
 
-            ensureBytes(getVarint() - buf.position());
+            getVarint();
             getVarint();
             getVarlong();
             getVarlong();
@@ -320,6 +703,9 @@ public class JfrReader implements Closeable {
             case "jdk.types.ThreadState":
                 readMap(threadStates);
                 break;
+            case "profiler.types.SampledEvent":
+                readMap(sampledEvents);
+                break;
             default:
                 readOtherConstants(type.fields);
         }
@@ -439,10 +825,24 @@ public class JfrReader implements Closeable {
         allocationInNewTLAB = getTypeId("jdk.ObjectAllocationInNewTLAB");
         allocationOutsideTLAB = getTypeId("jdk.ObjectAllocationOutsideTLAB");
         allocationSample = getTypeId("jdk.ObjectAllocationSample");
+        allocationBatch = getTypeId("profiler.AllocationBatch");
         monitorEnter = getTypeId("jdk.JavaMonitorEnter");
         threadPark = getTypeId("jdk.ThreadPark");
+        liveObject = getTypeId("profiler.LiveObject");
+        malloc = getTypeId("profiler.Malloc");
+        offCpu = getTypeId("profiler.OffCPU");
         activeSetting = getTypeId("jdk.ActiveSetting");
         activeSettingHasStack = activeSetting >= 0 && typesByName.get("jdk.ActiveSetting").field("stackTrace") != null;
+        executionSampleHasEvent = executionSample >= 0 && typesByName.get("jdk.ExecutionSample").field("event") != null;
+        executionSampleHasContext = hasField("jdk.ExecutionSample", "contextId");
+        executionSampleHasCpu = hasField("jdk.ExecutionSample", "cpu");
+        allocationInNewTLABHasContext = hasField("jdk.ObjectAllocationInNewTLAB", "contextId");
+        allocationOutsideTLABHasContext = hasField("jdk.ObjectAllocationOutsideTLAB", "contextId");
+    }
+
+    private boolean hasField(String typeName, String fieldName) {
+        JfrClass type = typesByName.get(typeName);
+        return type != null && type.field(fieldName) != null;
     }
 
     private int getTypeId(String typeName) {
@@ -500,32 +900,4 @@ public class JfrReader implements Closeable {
         buf.get(bytes);
         return bytes;
     }
-
-    private void seek(long pos) throws IOException {
-        filePosition = pos;
-        ch.position(pos);
-        buf.rewind().flip();
-    }
-
-    private boolean ensureBytes(int needed) throws IOException {
-        if (buf.remaining() >= needed) {
-            return true;
-        }
-
-        filePosition += buf.position();
-
-        if (buf.capacity() < needed) {
-            ByteBuffer newBuf = ByteBuffer.allocateDirect(needed);
-            newBuf.put(buf);
-            buf = newBuf;
-        } else {
-            buf.compact();
-        }
-
-        while (ch.read(buf) > 0 && buf.position() < needed) {
-            // keep reading
-        }
-        buf.flip();
-        return buf.limit() > 0;
-    }
 }
@@ -20,12 +20,22 @@ public class AllocationSample extends Event {
     public final int classId;
     public final long allocationSize;
     public final long tlabSize;
+    public final long contextId;  // set by AsyncProfiler.setContext(), 0 if none
+    public final int samples;     // more than 1 for a profiler.AllocationBatch event
 
-    public AllocationSample(long time, int tid, int stackTraceId, int classId, long allocationSize, long tlabSize) {
+    public AllocationSample(long time, int tid, int stackTraceId, int classId, long allocationSize, long tlabSize,
+                            long contextId) {
+        this(time, tid, stackTraceId, classId, allocationSize, tlabSize, contextId, 1);
+    }
+
+    public AllocationSample(long time, int tid, int stackTraceId, int classId, long allocationSize, long tlabSize,
+                            long contextId, int samples) {
         super(time, tid, stackTraceId);
         this.classId = classId;
         this.allocationSize = allocationSize;
         this.tlabSize = tlabSize;
+        this.contextId = contextId;
+        this.samples = samples;
     }
 
     @Override
@@ -46,4 +56,9 @@ public class AllocationSample extends Event {
     public long value() {
         return tlabSize != 0 ? tlabSize : allocationSize;
     }
+
+    @Override
+    public long samples() {
+        return samples;
+    }
 }
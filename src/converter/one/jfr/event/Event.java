@@ -44,4 +44,9 @@ public abstract class Event implements Comparable<Event> {
     public long value() {
         return 1;
     }
+
+    // Number of samples the event stands for
+    public long samples() {
+        return 1;
+    }
 }
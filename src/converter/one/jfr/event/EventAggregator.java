@@ -33,18 +33,31 @@ public class EventAggregator {
     }
 
     public void collect(Event e) {
+        collect(e, total ? e.value() : e.samples());
+    }
+
+    // Adds values collected by another aggregator, e.g. from a different chunk of the same recording
+    public void merge(EventAggregator other) {
+        for (int i = 0; i < other.keys.length; i++) {
+            if (other.keys[i] != null) {
+                collect(other.keys[i], other.values[i]);
+            }
+        }
+    }
+
+    private void collect(Event e, long value) {
         int mask = keys.length - 1;
         int i = hashCode(e) & mask;
         while (keys[i] != null) {
             if (sameGroup(keys[i], e)) {
-                values[i] += total ? e.value() : 1;
+                values[i] += value;
                 return;
             }
             i = (i + 1) & mask;
         }
 
         keys[i] = e;
-        values[i] = total ? e.value() : 1;
+        values[i] = value;
 
         if (++size * 2 > keys.length) {
             resize(keys.length * 2);
@@ -18,9 +18,18 @@ package one.jfr.event;
 
 public class ExecutionSample extends Event {
     public final int threadState;
+    public final int event;
+    public final long contextId;  // set by AsyncProfiler.setContext(), 0 if none
+    public final int cpu;         // -1 if unknown
+    public final int numaNode;    // -1 if unknown
 
-    public ExecutionSample(long time, int tid, int stackTraceId, int threadState) {
+    public ExecutionSample(long time, int tid, int stackTraceId, int threadState, int event, long contextId,
+                           int cpu, int numaNode) {
         super(time, tid, stackTraceId);
         this.threadState = threadState;
+        this.event = event;
+        this.contextId = contextId;
+        this.cpu = cpu;
+        this.numaNode = numaNode;
     }
 }
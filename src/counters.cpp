@@ -0,0 +1,75 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "counters.h"
+#include "tsc.h"
+
+
+Counters::Counter Counters::_counters[COUNTER_COUNT];
+Counters::SlotCounters Counters::_slot_counters[COUNTER_SLOTS];
+
+const char* const Counters::_names[COUNTER_COUNT] = {
+    "cpu_sample_time",
+    "cpu_samples",
+    "alloc_sample_time",
+    "alloc_samples",
+    "lock_sample_time",
+    "lock_samples",
+    "other_sample_time",
+    "other_samples",
+    "java_trace_time",
+    "native_trace_time",
+    "call_trace_put_time",
+    "call_trace_puts",
+    "call_trace_probes",
+    "jfr_bytes",
+    "jfr_write_time",
+    "jfr_flushes",
+    "jfr_flush_time",
+    "dictionary_lookups",
+    "dictionary_misses",
+    "vm_walk_fallbacks"
+};
+
+bool Counters::isTime(CounterId id) {
+    switch (id) {
+        case COUNTER_CPU_SAMPLE_TIME:
+        case COUNTER_ALLOC_SAMPLE_TIME:
+        case COUNTER_LOCK_SAMPLE_TIME:
+        case COUNTER_OTHER_SAMPLE_TIME:
+        case COUNTER_JAVA_TRACE_TIME:
+        case COUNTER_NATIVE_TRACE_TIME:
+        case COUNTER_CALL_TRACE_PUT_TIME:
+        case COUNTER_JFR_WRITE_TIME:
+        case COUNTER_JFR_FLUSH_TIME:
+            return true;
+        default:
+            return false;
+    }
+}
+
+u64 Counters::getNanos(CounterId id) {
+    return TSC::toNanos(get(id));
+}
+
+void Counters::reset() {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        _counters[i].value = 0;
+        for (int j = 0; j < COUNTER_SLOTS; j++) {
+            _slot_counters[j].values[i] = 0;
+        }
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COUNTERS_H
+#define _COUNTERS_H
+
+#include "arch.h"
+
+
+// Self-profiling counters. Times are measured in TSC ticks
+enum CounterId {
+    COUNTER_CPU_SAMPLE_TIME,
+    COUNTER_CPU_SAMPLES,
+    COUNTER_ALLOC_SAMPLE_TIME,
+    COUNTER_ALLOC_SAMPLES,
+    COUNTER_LOCK_SAMPLE_TIME,
+    COUNTER_LOCK_SAMPLES,
+    COUNTER_OTHER_SAMPLE_TIME,
+    COUNTER_OTHER_SAMPLES,
+    COUNTER_JAVA_TRACE_TIME,
+    COUNTER_NATIVE_TRACE_TIME,
+    COUNTER_CALL_TRACE_PUT_TIME,
+    COUNTER_CALL_TRACE_PUTS,
+    COUNTER_CALL_TRACE_PROBES,
+    COUNTER_JFR_BYTES,
+    COUNTER_JFR_WRITE_TIME,
+    COUNTER_JFR_FLUSHES,
+    COUNTER_JFR_FLUSH_TIME,
+    COUNTER_DICTIONARY_LOOKUPS,
+    COUNTER_DICTIONARY_MISSES,
+    COUNTER_VM_WALK_FALLBACKS,
+    COUNTER_COUNT
+};
+
+
+// Sample handlers add to the row of the profiler slot they hold
+const int COUNTER_SLOTS = 16;
+
+
+// Counters are always on, so every one occupies its own cache line
+// to avoid false sharing between concurrent signal handlers.
+// Counters updated on every sample are also kept in per-slot rows, so that
+// concurrent handlers do not contend for one line; reads sum up all rows
+class Counters {
+  private:
+    struct Counter {
+        volatile u64 value;
+        char padding[56];
+    };
+
+    struct SlotCounters {
+        volatile u64 values[COUNTER_COUNT];
+    } __attribute__((aligned(64)));
+
+    static Counter _counters[COUNTER_COUNT];
+    static SlotCounters _slot_counters[COUNTER_SLOTS];
+    static const char* const _names[COUNTER_COUNT];
+
+  public:
+    static void add(CounterId id, u64 delta = 1) {
+        atomicInc(_counters[id].value, delta);
+    }
+
+    static void add(int slot, CounterId id, u64 delta = 1) {
+        atomicInc(_slot_counters[slot % COUNTER_SLOTS].values[id], delta);
+    }
+
+    static u64 get(CounterId id) {
+        u64 value = _counters[id].value;
+        for (int i = 0; i < COUNTER_SLOTS; i++) {
+            value += _slot_counters[i].values[id];
+        }
+        return value;
+    }
+
+    static const char* name(CounterId id) {
+        return _names[id];
+    }
+
+    // Total time spent in the sample handlers of all engines
+    static u64 sampleTime() {
+        return get(COUNTER_CPU_SAMPLE_TIME) + get(COUNTER_ALLOC_SAMPLE_TIME)
+             + get(COUNTER_LOCK_SAMPLE_TIME) + get(COUNTER_OTHER_SAMPLE_TIME);
+    }
+
+    static bool isTime(CounterId id);
+
+    // Converts time counters to nanoseconds
+    static u64 getNanos(CounterId id);
+
+    static void reset();
+};
+
+#endif // _COUNTERS_H
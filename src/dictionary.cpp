@@ -17,58 +17,118 @@
 #include <stdlib.h>
 #include <string.h>
 #include "dictionary.h"
-#include "arch.h"
+#include "counters.h"
+#include "os.h"
 
 
-static inline char* allocateKey(const char* key, size_t length) {
-    char* result = (char*)malloc(length + 1);
-    memcpy(result, key, length);
-    result[length] = 0;
-    return result;
+const int TAG_SHIFT = 48;
+const u64 KEY_MASK = (1ULL << TAG_SHIFT) - 1;
+const u32 MAX_CAPACITY = 1 << 26;
+
+
+static inline DictKey* keyOf(u64 slot) {
+    return (DictKey*)(uintptr_t)(slot & KEY_MASK);
 }
 
-static inline bool keyEquals(const char* candidate, const char* key, size_t length) {
-    return strncmp(candidate, key, length) == 0 && candidate[length] == 0;
+// Pointers that do not fit in 48 bits are stored without a tag and always compared in full
+static inline u64 tagKey(DictKey* key, u64 tag) {
+    return ((uintptr_t)key & ~KEY_MASK) == 0 ? tag | (uintptr_t)key : (uintptr_t)key;
 }
 
+static inline bool keyEquals(u64 slot, u64 tag, u32 h, const char* key, size_t length) {
+    if (((slot ^ tag) >> TAG_SHIFT) != 0 && (slot >> TAG_SHIFT) != 0) {
+        return false;
+    }
+    DictKey* k = keyOf(slot);
+    return k->hash == h && k->length == length && memcmp(k->data, key, length) == 0;
+}
 
-Dictionary::Dictionary() {
-    _table = (DictTable*)calloc(1, sizeof(DictTable));
-    _table->base_index = _base_index = 1;
+static inline bool isArenaKey(size_t length) {
+    return sizeof(DictKey) + length <= DICT_MAX_ARENA_KEY;
+}
+
+
+Dictionary::Dictionary() : _size(0), _keys(DICT_KEY_CHUNK_SIZE) {
+    _table = allocateTable(DICT_INITIAL_CAPACITY);
 }
 
 Dictionary::~Dictionary() {
-    clear(_table);
-    free(_table);
+    freeKeys(_table);
+    for (DictTable* table = _table; table != NULL; ) {
+        DictTable* next = table->next;
+        freeTable(table);
+        table = next;
+    }
 }
 
 void Dictionary::clear() {
-    clear(_table);
-    memset(_table, 0, sizeof(DictTable));
-    _table->base_index = _base_index = 1;
+    freeKeys(_table);
+    for (DictTable* table = _table->next; table != NULL; ) {
+        DictTable* next = table->next;
+        freeTable(table);
+        table = next;
+    }
+
+    memset(_table->slots, 0, _table->capacity * sizeof(u64));
+    _table->next = NULL;
+    _size = 0;
+    _keys.clear();
 }
 
-void Dictionary::clear(DictTable* table) {
-    for (int i = 0; i < ROWS; i++) {
-        DictRow* row = &table->rows[i];
-        for (int j = 0; j < CELLS; j++) {
-            free(row->keys[j]);
-        }
-        if (row->next != NULL) {
-            clear(row->next);
-            free(row->next);
+DictTable* Dictionary::allocateTable(u32 capacity) {
+    // Anonymous memory is already zeroed, and mmap is safe to call in a signal handler
+    DictTable* table = (DictTable*)OS::safeAlloc(sizeof(DictTable) + (capacity - 1) * sizeof(u64));
+    if (table != NULL) {
+        table->capacity = capacity;
+    }
+    return table;
+}
+
+void Dictionary::freeTable(DictTable* table) {
+    OS::safeFree(table, sizeof(DictTable) + (table->capacity - 1) * sizeof(u64));
+}
+
+// Only the keys too long for the arena are allocated individually
+void Dictionary::freeKeys(DictTable* table) {
+    for (; table != NULL; table = table->next) {
+        for (u32 i = 0; i < table->capacity; i++) {
+            if (table->slots[i] != 0 && !isArenaKey(keyOf(table->slots[i])->length)) {
+                free(keyOf(table->slots[i]));
+            }
         }
     }
 }
 
-// Many popular symbols are quite short, e.g. "[B", "()V" etc.
-// FNV-1a is reasonably fast and sufficiently random.
-unsigned int Dictionary::hash(const char* key, size_t length) {
-    unsigned int h = 2166136261U;
-    for (size_t i = 0; i < length; i++) {
-        h = (h ^ key[i]) * 16777619;
+// Word-at-a-time multiplicative hash: much faster than bytewise FNV-1a on long class names,
+// and mixes well enough for both the table index and the 16-bit slot tag
+u32 Dictionary::hash(const char* key, size_t length) {
+    u64 h = length * 0x9e3779b97f4a7c15ULL;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        u64 word;
+        memcpy(&word, key + i, 8);
+        h = (h ^ word) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
     }
-    return h;
+
+    u64 tail = 0;
+    memcpy(&tail, key + i, length - i);
+    h = (h ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return (u32)(h ^ (h >> 32));
+}
+
+DictKey* Dictionary::allocateKey(const char* key, size_t length, u32 h) {
+    size_t size = (sizeof(DictKey) + length + 7) & ~(size_t)7;
+    DictKey* k = (DictKey*)(isArenaKey(length) ? _keys.alloc(size) : malloc(size));
+    if (k != NULL) {
+        k->id = __sync_add_and_fetch(&_size, 1);
+        k->hash = h;
+        k->length = (u32)length;
+        memcpy(k->data, key, length);
+        k->data[length] = 0;
+    }
+    return k;
 }
 
 unsigned int Dictionary::lookup(const char* key) {
@@ -76,51 +136,80 @@ unsigned int Dictionary::lookup(const char* key) {
 }
 
 unsigned int Dictionary::lookup(const char* key, size_t length) {
-    DictTable* table = _table;
-    unsigned int h = hash(key, length);
-
-    while (true) {
-        DictRow* row = &table->rows[h % ROWS];
-        for (int c = 0; c < CELLS; c++) {
-            if (row->keys[c] == NULL) {
-                char* new_key = allocateKey(key, length);
-                if (__sync_bool_compare_and_swap(&row->keys[c], NULL, new_key)) {
-                    return table->index(h % ROWS, c);
+    const char* added_key;
+    return lookup(key, length, added_key);
+}
+
+unsigned int Dictionary::lookup(const char* key, size_t length, const char*& added_key) {
+    Counters::add(COUNTER_DICTIONARY_LOOKUPS);
+    added_key = NULL;
+
+    u32 h = hash(key, length);
+    u64 tag = (u64)((h >> 16) | 1) << TAG_SHIFT;
+    u32 index = h;
+    DictKey* new_key = NULL;
+
+    for (DictTable* table = _table; ; ) {
+        // Probe a cache line aligned run of slots
+        u32 start = index & (table->capacity - 1) & ~(DICT_MAX_PROBE - 1);
+        for (u32 probe = 0; probe < DICT_MAX_PROBE; probe++) {
+            u64* slot = &table->slots[start + probe];
+            u64 value = loadAcquire(*slot);
+            if (value == 0) {
+                if (new_key == NULL && (new_key = allocateKey(key, length, h)) == NULL) {
+                    return 0;
+                }
+                value = __sync_val_compare_and_swap(slot, 0, tagKey(new_key, tag));
+                if (value == 0) {
+                    Counters::add(COUNTER_DICTIONARY_MISSES);
+                    added_key = new_key->data;
+                    return new_key->id;
                 }
-                free(new_key);
             }
-            if (keyEquals(row->keys[c], key, length)) {
-                return table->index(h % ROWS, c);
+
+            if (keyEquals(value, tag, h, key, length)) {
+                // Lost the race for the slot to the same key. An arena copy is just left behind
+                if (new_key != NULL && !isArenaKey(length)) {
+                    free(new_key);
+                }
+                return keyOf(value)->id;
             }
         }
 
-        if (row->next == NULL) {
-            DictTable* new_table = (DictTable*)calloc(1, sizeof(DictTable));
-            new_table->base_index = __sync_add_and_fetch(&_base_index, TABLE_CAPACITY);
-            if (!__sync_bool_compare_and_swap(&row->next, NULL, new_table)) {
-                free(new_table);
+        DictTable* next = __atomic_load_n(&table->next, __ATOMIC_ACQUIRE);
+        if (next == NULL) {
+            next = allocateTable(table->capacity < MAX_CAPACITY ? table->capacity << DICT_GROWTH_SHIFT : table->capacity);
+            if (next == NULL) {
+                return 0;
+            }
+            DictTable* prev = __sync_val_compare_and_swap(&table->next, NULL, next);
+            if (prev != NULL) {
+                freeTable(next);
+                next = prev;
             }
         }
 
-        table = row->next;
-        h = (h >> ROW_BITS) | (h << (32 - ROW_BITS));
+        table = next;
+        index = (index >> 7) | (index << 25);
     }
 }
 
 void Dictionary::collect(std::map<unsigned int, const char*>& map) {
-    collect(map, _table);
-}
-
-void Dictionary::collect(std::map<unsigned int, const char*>& map, DictTable* table) {
-    for (int i = 0; i < ROWS; i++) {
-        DictRow* row = &table->rows[i];
-        for (int j = 0; j < CELLS; j++) {
-            if (row->keys[j] != NULL) {
-                map[table->index(i, j)] = row->keys[j];
+    for (DictTable* table = _table; table != NULL; table = table->next) {
+        for (u32 i = 0; i < table->capacity; i++) {
+            if (table->slots[i] != 0) {
+                DictKey* k = keyOf(table->slots[i]);
+                map[k->id] = k->data;
             }
         }
-        if (row->next != NULL) {
-            collect(map, row->next);
-        }
     }
 }
+
+// Tables and the key arena; the rare keys allocated individually are not counted
+size_t Dictionary::usedMemory() {
+    size_t bytes = _keys.usedMemory();
+    for (DictTable* table = _table; table != NULL; table = table->next) {
+        bytes += sizeof(DictTable) + (table->capacity - 1) * sizeof(u64);
+    }
+    return bytes;
+}
@@ -19,41 +19,51 @@
 
 #include <map>
 #include <stddef.h>
-
-
-#define ROW_BITS        7
-#define ROWS            (1 << ROW_BITS)
-#define CELLS           3
-#define TABLE_CAPACITY  (ROWS * CELLS)
-
-
-struct DictTable;
-
-struct DictRow {
-    char* keys[CELLS];
-    DictTable* next;
+#include "arch.h"
+#include "linearAllocator.h"
+
+
+const u32 DICT_INITIAL_CAPACITY = 1024;
+const u32 DICT_GROWTH_SHIFT = 3;
+const u32 DICT_MAX_PROBE = 8;
+const size_t DICT_KEY_CHUNK_SIZE = 256 * 1024;
+const size_t DICT_MAX_ARENA_KEY = 4096;
+
+// Keys live in an arena together with their id and full hash
+struct DictKey {
+    u32 id;
+    u32 hash;
+    u32 length;
+    char data[1];
 };
 
+// Open addressing table: every slot holds a DictKey pointer tagged with 16 bits of the key hash
 struct DictTable {
-    DictRow rows[ROWS];
-    unsigned int base_index;
-
-    unsigned int index(int row, int col) {
-        return base_index + (col << ROW_BITS) + row;
-    }
+    DictTable* next;
+    u32 capacity;
+    // Tables are page aligned: runs of DICT_MAX_PROBE slots fall on cache line boundaries
+    char _padding[64 - sizeof(DictTable*) - sizeof(u32)];
+    u64 slots[1];
 };
 
-// Append-only concurrent hash table based on multi-level arrays
+// Append-only concurrent hash table with open addressing.
+// A key is placed into the first empty slot of its probe sequence; when there is none
+// within DICT_MAX_PROBE slots, the search continues in the next, larger table.
+// Since slots are never removed, concurrent inserters of the same key always race
+// for the same slot, and every key gets exactly one id.
 class Dictionary {
   private:
     DictTable* _table;
-    volatile unsigned int _base_index;
+    volatile u32 _size;
+    LinearAllocator _keys;
 
-    static void clear(DictTable* table);
+    static DictTable* allocateTable(u32 capacity);
+    static void freeTable(DictTable* table);
+    static void freeKeys(DictTable* table);
 
-    static unsigned int hash(const char* key, size_t length);
+    static u32 hash(const char* key, size_t length);
 
-    static void collect(std::map<unsigned int, const char*>& map, DictTable* table);
+    DictKey* allocateKey(const char* key, size_t length, u32 h);
 
   public:
     Dictionary();
@@ -64,7 +74,13 @@ class Dictionary {
     unsigned int lookup(const char* key);
     unsigned int lookup(const char* key, size_t length);
 
+    // Same as lookup(), but also returns the stored copy of the key if it has just been added,
+    // or NULL if the key was already present
+    unsigned int lookup(const char* key, size_t length, const char*& added_key);
+
     void collect(std::map<unsigned int, const char*>& map);
+
+    size_t usedMemory();
 };
 
 #endif // _DICTIONARY_H
@@ -18,6 +18,8 @@
 #define _DWARF_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include "arch.h"
 
 
@@ -70,6 +72,49 @@ struct FrameDesc {
 };
 
 
+
+const int FRAME_DESC_CACHE_SIZE = 1024;
+
+// Direct-mapped cache of PC -> FrameDesc lookups in front of CodeCache::findFrameDesc.
+// Return addresses of hot native frames repeat from sample to sample.
+// Not thread safe: every sample slot has its own instance used under the slot lock.
+class FrameDescCache {
+  private:
+    u32 _generation;
+    const void* _pc[FRAME_DESC_CACHE_SIZE];
+    FrameDesc* _frame[FRAME_DESC_CACHE_SIZE];
+
+    static u32 slot(const void* pc) {
+        uintptr_t h = (uintptr_t)pc;
+        return (u32)(h ^ (h >> 8) ^ (h >> 16)) & (FRAME_DESC_CACHE_SIZE - 1);
+    }
+
+  public:
+    FrameDescCache() : _generation(0) {
+        memset(_pc, 0, sizeof(_pc));
+    }
+
+    // Cached FrameDesc pointers are valid only for the given generation of native libraries
+    void validate(u32 generation) {
+        if (_generation != generation) {
+            memset(_pc, 0, sizeof(_pc));
+            _generation = generation;
+        }
+    }
+
+    FrameDesc* lookup(const void* pc) {
+        u32 i = slot(pc);
+        return _pc[i] == pc ? _frame[i] : NULL;
+    }
+
+    void put(const void* pc, FrameDesc* frame) {
+        u32 i = slot(pc);
+        _pc[i] = pc;
+        _frame[i] = frame;
+    }
+};
+
+
 class DwarfParser {
   private:
     const char* _name;
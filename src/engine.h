@@ -57,6 +57,12 @@ class Engine {
     virtual Error start(Arguments& args);
     virtual void stop();
 
+    // Multiplies the interval chosen at start by factor >= 1.
+    // Returns the effective interval, or 0 if the engine cannot be throttled
+    virtual long scaleInterval(double factor) {
+        return 0;
+    }
+
     void enableEvents(bool enabled) {
         _enabled = enabled;
     }
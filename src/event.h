@@ -31,8 +31,11 @@ class Event {
 class ExecutionEvent : public Event {
   public:
     ThreadState _thread_state;
+    u32 _event_index;  // which of the sampled events, when several perf events run at once
+    u64 _time;         // ticks when the sample was taken; 0 means when it is recorded
+    int _cpu;          // where the sample was taken, -1 if unknown
 
-    ExecutionEvent() : _thread_state(THREAD_RUNNING) {
+    ExecutionEvent(u64 time = 0, int cpu = -1) : _thread_state(THREAD_RUNNING), _event_index(0), _time(time), _cpu(cpu) {
     }
 };
 
@@ -43,6 +46,45 @@ class AllocEvent : public Event {
     u64 _instance_size;
 };
 
+class MallocEvent : public Event {
+  public:
+    uintptr_t _address;
+    u64 _size;
+};
+
+// Sampled object that is still reachable when the profile is dumped
+class LiveObjectEvent : public Event {
+  public:
+    u32 _class_id;
+    u64 _alloc_size;
+    u64 _alloc_time;
+};
+
+// Time between a thread leaving the CPU and getting it back
+class OffCpuEvent : public Event {
+  public:
+    u64 _start_time;
+    u64 _end_time;
+};
+
+// Stop-the-world time of one garbage collection, in TSC ticks
+class GCPauseEvent : public Event {
+  public:
+    u64 _start_time;
+    u64 _end_time;
+};
+
+// Percentiles of one latency histogram, in nanoseconds
+class LatencyEvent : public Event {
+  public:
+    u64 _count;
+    u64 _p50;
+    u64 _p90;
+    u64 _p99;
+    u64 _p999;
+    u64 _max;
+};
+
 class LockEvent : public Event {
   public:
     u32 _class_id;
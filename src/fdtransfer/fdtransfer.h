@@ -26,11 +26,16 @@
 
 #define ARRAY_SIZE(arr)  (sizeof(arr) / sizeof(arr[0]))
 
+// Maximum number of threads in one PERF_FD_BATCH request; below SCM_MAX_FD,
+// and the request still fits in the server's receive buffer
+#define MAX_PERF_FD_BATCH 128
+
 
 // base header for all requests
 enum request_type {
     PERF_FD,
     KALLSYMS_FD,
+    PERF_FD_BATCH,
 };
 
 struct fd_request {
@@ -56,6 +61,23 @@ struct perf_fd_response {
     int tid;
 };
 
+// Opens the same event for several threads at once. Only the first `count` tids are sent.
+// An empty batch tells whether the server supports batches at all
+struct perf_fd_batch_request {
+    struct fd_request header;
+    struct perf_event_attr attr;
+    int count;
+    int tids[MAX_PERF_FD_BATCH];
+};
+
+// One SCM_RIGHTS message carries the fds of all threads with errors[i] == 0, in the order of tids
+struct perf_fd_batch_response {
+    struct fd_response header;
+    int count;
+    int tids[MAX_PERF_FD_BATCH];
+    int errors[MAX_PERF_FD_BATCH];
+};
+
 
 static inline bool socketPathForPid(int pid, struct sockaddr_un *sun, socklen_t *addrlen) {
     sun->sun_path[0] = '\0';
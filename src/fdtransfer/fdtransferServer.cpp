@@ -14,14 +14,17 @@
  * limitations under the License.
  */
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -33,23 +36,56 @@
 #include "../jattach/psutil.h"
 
 
+// Maximum number of profiled processes served at the same time
+const int MAX_PEERS = 256;
+
+// The copy of /proc/kallsyms is shared by all peers and refreshed when it gets older than this
+const time_t KALLSYMS_CACHE_SECONDS = 60;
+
+struct TidMapping {
+    int ns_tid;
+    int host_tid;
+};
+
+struct Peer {
+    int fd;
+    int pid;
+    // Peer lives in another PID namespace: its thread IDs are translated with the tid map
+    bool other_ns;
+    TidMapping* tid_map;
+    int tid_map_size;
+};
+
 class FdTransferServer {
   private:
     static int _server;
-    static int _peer;
+    static int _kallsyms_fd;
+    static time_t _kallsyms_time;
+    static void* _perf_mmap_ringbuf[1024];
+    static size_t _ringbuf_index;
+
     static int copyFile(const char* src_name, const char* dst_name, mode_t mode);
-    static bool sendFd(int fd, struct fd_response *resp, size_t resp_size);
+    static bool sendFds(Peer* peer, const int* fds, int count, struct fd_response *resp, size_t resp_size);
+    static int hostTid(Peer* peer, int tid);
+    static void loadTidMap(Peer* peer);
+    static int openPerfEvent(Peer* peer, struct perf_event_attr* attr, int tid, int* error);
+    static int openKallsyms(int* error);
 
   public:
     static void closeServer() { close(_server); }
-    static void closePeer() { close(_peer); }
+    static void closePeer(Peer* peer);
     static bool bindServer(struct sockaddr_un *sun, socklen_t addrlen, int accept_timeout);
-    static bool acceptPeer(int *peer_pid);
-    static bool serveRequests(int peer_pid);
+    static bool acceptPeer(Peer* peer, int expected_pid);
+    static int serveRequest(Peer* peer);
+    static bool serveRequests(Peer* peer);
+    static bool servePeers();
 };
 
 int FdTransferServer::_server;
-int FdTransferServer::_peer;
+int FdTransferServer::_kallsyms_fd = -1;
+time_t FdTransferServer::_kallsyms_time = 0;
+void* FdTransferServer::_perf_mmap_ringbuf[1024] = {};
+size_t FdTransferServer::_ringbuf_index = 0;
 
 bool FdTransferServer::bindServer(struct sockaddr_un *sun, socklen_t addrlen, int accept_timeout) {
     _server = socket(AF_UNIX, SOCK_SEQPACKET, 0);
@@ -68,7 +104,8 @@ bool FdTransferServer::bindServer(struct sockaddr_un *sun, socklen_t addrlen, in
         }
     }
 
-    if (bind(_server, (const struct sockaddr*)sun, addrlen) < 0 || listen(_server, 1) < 0) {
+    // Many profilers may connect at once when pods on the node start together
+    if (bind(_server, (const struct sockaddr*)sun, addrlen) < 0 || listen(_server, MAX_PEERS) < 0) {
         perror("FdTransfer listen()");
         close(_server);
         return false;
@@ -77,133 +114,396 @@ bool FdTransferServer::bindServer(struct sockaddr_un *sun, socklen_t addrlen, in
     return true;
 }
 
-bool FdTransferServer::acceptPeer(int *peer_pid) {
-    _peer = accept(_server, NULL, NULL);
-    if (_peer == -1) {
+// With expected_pid == 0, a peer from any PID namespace is accepted, and its pid is seen from ours
+bool FdTransferServer::acceptPeer(Peer* peer, int expected_pid) {
+    peer->fd = accept(_server, NULL, NULL);
+    if (peer->fd == -1) {
         perror("FdTransfer accept()");
         return false;
     }
 
     struct ucred cred;
     socklen_t len = sizeof(cred);
-    if (getsockopt(_peer, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+    if (getsockopt(peer->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
         perror("getsockopt(SO_PEERCRED)");
-        close(_peer);
+        close(peer->fd);
         return false;
     }
 
-    if (*peer_pid != 0) {
-        if (cred.pid != *peer_pid) {
-            fprintf(stderr, "Unexpected connection from PID %d, expected from %d\n", cred.pid, *peer_pid);
-            close(_peer);
-            return false;
-        }
-    } else {
-        *peer_pid = cred.pid;
+    if (expected_pid != 0 && cred.pid != expected_pid) {
+        fprintf(stderr, "Unexpected connection from PID %d, expected from %d\n", cred.pid, expected_pid);
+        close(peer->fd);
+        return false;
+    }
+
+    peer->pid = cred.pid;
+    peer->other_ns = false;
+    peer->tid_map = NULL;
+    peer->tid_map_size = 0;
+
+    char path[64];
+    struct stat self_ns, peer_ns;
+    snprintf(path, sizeof(path), "/proc/%d/ns/pid", cred.pid);
+    if (stat("/proc/self/ns/pid", &self_ns) == 0 && stat(path, &peer_ns) == 0) {
+        peer->other_ns = self_ns.st_ino != peer_ns.st_ino || self_ns.st_dev != peer_ns.st_dev;
     }
 
     return true;
 }
 
-bool FdTransferServer::serveRequests(int peer_pid) {
-    // Close the server side, don't need it anymore.
-    FdTransferServer::closeServer();
+void FdTransferServer::closePeer(Peer* peer) {
+    close(peer->fd);
+    peer->fd = -1;
+    free(peer->tid_map);
+    peer->tid_map = NULL;
+    peer->tid_map_size = 0;
+}
 
-    void *perf_mmap_ringbuf[1024] = {};
-    size_t ringbuf_index = 0;
-    const size_t perf_mmap_size = 2 * sysconf(_SC_PAGESIZE);
+static int compareTidMappings(const void* a, const void* b) {
+    return ((const TidMapping*)a)->ns_tid - ((const TidMapping*)b)->ns_tid;
+}
 
-    while (1) {
-        unsigned char request_buf[1024];
-        struct fd_request *req = (struct fd_request *)request_buf;
+// The last NSpid entry of a task is its ID in the innermost namespace, i.e. the one the peer sees
+static int innermostTid(int pid, const char* task) {
+    char path[128];
+    snprintf(path, sizeof(path), "/proc/%d/task/%s/status", pid, task);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
 
-        ssize_t ret = recv(_peer, req, sizeof(request_buf), 0);
+    char buf[2048];
+    ssize_t r = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (r <= 0) {
+        return -1;
+    }
+    buf[r] = 0;
 
-        if (ret == 0) {
-            // EOF means done
-            return true;
-        } else if (ret < 0) {
-            perror("recv()");
+    char* line = strstr(buf, "\nNSpid:");
+    if (line == NULL) {
+        return -1;
+    }
+
+    int tid = -1;
+    for (char* p = line + 7; *p != 0 && *p != '\n'; ) {
+        char* end;
+        long value = strtol(p, &end, 10);
+        if (end == p) {
             break;
         }
+        tid = (int)value;
+        p = end;
+    }
+    return tid;
+}
 
-        switch (req->type) {
-        case PERF_FD: {
-            struct perf_fd_request *request = (struct perf_fd_request*)req;
-            int perf_fd = -1;
-            int error;
-
-            // In pid == 0 mode, allow all perf_event_open requests.
-            // Otherwise, verify the thread belongs to PID.
-            if (peer_pid == 0 || syscall(__NR_tgkill, peer_pid, request->tid, 0) == 0) {
-                perf_fd = syscall(__NR_perf_event_open, &request->attr, request->tid, -1, -1, 0);
-                error = perf_fd < 0 ? errno : 0;
-            } else {
-                fprintf(stderr, "Target has requested perf_event_open for TID %d which is not a thread of process %d\n", request->tid, peer_pid);
-                error = ESRCH;
-            }
+void FdTransferServer::loadTidMap(Peer* peer) {
+    free(peer->tid_map);
+    peer->tid_map = NULL;
+    peer->tid_map_size = 0;
 
-            // Map the perf buffer here (mapping perf fds may require privileges, and fdtransfer has them while the target application does not
-            // necessarily; if pages are already mapped, the same physical pages will be used when the profiler agent maps them again, requiring
-            // no privileges this time)
-            if (error == 0) {
-                // Settings match the mmap() done in PerfEvents::createForThread().
-                void *map_result = mmap(NULL, perf_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, perf_fd, 0);
-                // Ignore errors - if this fails, let it fail again in the profiler again & produce a proper error for the user.
-
-                // Free next entry in the ring buffer, if it was previously allocated.
-                if (perf_mmap_ringbuf[ringbuf_index] != NULL && perf_mmap_ringbuf[ringbuf_index] != MAP_FAILED) {
-                    (void)munmap(perf_mmap_ringbuf[ringbuf_index], perf_mmap_size);
-                }
-                // Store it in the ring buffer so we can free it later.
-                perf_mmap_ringbuf[ringbuf_index] = map_result;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", peer->pid);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
 
-                ringbuf_index++;
-                ringbuf_index = ringbuf_index % ARRAY_SIZE(perf_mmap_ringbuf);
-            }
+    int capacity = 0;
+    for (struct dirent* entry; (entry = readdir(dir)) != NULL; ) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        int ns_tid = innermostTid(peer->pid, entry->d_name);
+        if (ns_tid == -1) {
+            continue;
+        }
+        if (peer->tid_map_size == capacity) {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            peer->tid_map = (TidMapping*)realloc(peer->tid_map, capacity * sizeof(TidMapping));
+        }
+        peer->tid_map[peer->tid_map_size].ns_tid = ns_tid;
+        peer->tid_map[peer->tid_map_size].host_tid = atoi(entry->d_name);
+        peer->tid_map_size++;
+    }
+    closedir(dir);
 
-            struct perf_fd_response resp;
-            resp.header.type = request->header.type;
-            resp.header.error = error;
-            resp.tid = request->tid;
-            sendFd(perf_fd, &resp.header, sizeof(resp));
-            close(perf_fd);
-            break;
+    qsort(peer->tid_map, peer->tid_map_size, sizeof(TidMapping), compareTidMappings);
+}
+
+// Returns the ID of the peer's thread in our PID namespace, or -1 if it is not a thread of the peer.
+// Mappings are cached per peer: the task list is scanned again only when a thread is not found
+// or its cached host thread no longer belongs to the peer
+int FdTransferServer::hostTid(Peer* peer, int tid) {
+    if (!peer->other_ns) {
+        return syscall(__NR_tgkill, peer->pid, tid, 0) == 0 ? tid : -1;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        TidMapping key = {tid, 0};
+        TidMapping* m = (TidMapping*)bsearch(&key, peer->tid_map, peer->tid_map_size, sizeof(TidMapping), compareTidMappings);
+        if (m != NULL && syscall(__NR_tgkill, peer->pid, m->host_tid, 0) == 0) {
+            return m->host_tid;
         }
+        loadTidMap(peer);
+    }
+    return -1;
+}
+
+int FdTransferServer::openPerfEvent(Peer* peer, struct perf_event_attr* attr, int tid, int* error) {
+    int host_tid = hostTid(peer, tid);
+    if (host_tid == -1) {
+        fprintf(stderr, "Target has requested perf_event_open for TID %d which is not a thread of process %d\n", tid, peer->pid);
+        *error = ESRCH;
+        return -1;
+    }
+
+    int perf_fd = syscall(__NR_perf_event_open, attr, host_tid, -1, -1, 0);
+    if (perf_fd < 0) {
+        *error = errno;
+        return -1;
+    }
+
+    // Map the perf buffer here (mapping perf fds may require privileges, and fdtransfer has them while the target application does not
+    // necessarily; if pages are already mapped, the same physical pages will be used when the profiler agent maps them again, requiring
+    // no privileges this time)
+    // Settings match the mmap() done in PerfEvents::createForThread().
+    const size_t perf_mmap_size = 2 * sysconf(_SC_PAGESIZE);
+    void *map_result = mmap(NULL, perf_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, perf_fd, 0);
+    // Ignore errors - if this fails, let it fail again in the profiler again & produce a proper error for the user.
+
+    // Free next entry in the ring buffer, if it was previously allocated.
+    if (_perf_mmap_ringbuf[_ringbuf_index] != NULL && _perf_mmap_ringbuf[_ringbuf_index] != MAP_FAILED) {
+        (void)munmap(_perf_mmap_ringbuf[_ringbuf_index], perf_mmap_size);
+    }
+    // Store it in the ring buffer so we can free it later.
+    _perf_mmap_ringbuf[_ringbuf_index] = map_result;
+    _ringbuf_index = (_ringbuf_index + 1) % ARRAY_SIZE(_perf_mmap_ringbuf);
+
+    *error = 0;
+    return perf_fd;
+}
+
+int FdTransferServer::openKallsyms(int* error) {
+    // can't directly pass the fd of /proc/kallsyms, because before Linux 4.15 the permission check
+    // was conducted on each read.
+    // it's simpler to copy the file to a temporary location and pass the fd of it (compared to passing the
+    // entire contents over the peer socket)
+    time_t now = time(NULL);
+    if (_kallsyms_fd == -1 || now - _kallsyms_time > KALLSYMS_CACHE_SECONDS) {
+        char tmp_path[256];
+        snprintf(tmp_path, sizeof(tmp_path), "/tmp/async-profiler-kallsyms.%d", getpid());
+
+        *error = copyFile("/proc/kallsyms", tmp_path, 0600);
+        if (*error != 0) {
+            return -1;
+        }
+
+        int fd = open(tmp_path, O_RDONLY);
+        if (fd == -1) {
+            *error = errno;
+            return -1;
+        }
+        unlink(tmp_path);
+
+        if (_kallsyms_fd != -1) {
+            close(_kallsyms_fd);
+        }
+        _kallsyms_fd = fd;
+        _kallsyms_time = now;
+    }
+
+    // Reopening through /proc gives every peer its own file offset
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", _kallsyms_fd);
+    int fd = open(path, O_RDONLY);
+    *error = fd == -1 ? errno : 0;
+    return fd;
+}
+
+// Returns 1 if the request has been served, 0 when the peer has closed the connection, -1 on error
+int FdTransferServer::serveRequest(Peer* peer) {
+    unsigned char request_buf[1024];
+    struct fd_request *req = (struct fd_request *)request_buf;
+
+    ssize_t ret = recv(peer->fd, req, sizeof(request_buf), 0);
+    if (ret == 0) {
+        // EOF means done
+        return 0;
+    } else if (ret < 0) {
+        perror("recv()");
+        return -1;
+    }
+
+    // Nothing beyond the received bytes is trusted: a short request is answered with EINVAL
+    size_t size = (size_t)ret;
+    bool valid = size >= sizeof(struct fd_request);
+    if (valid && req->type == PERF_FD) {
+        valid = size >= sizeof(struct perf_fd_request);
+    } else if (valid && req->type == PERF_FD_BATCH) {
+        struct perf_fd_batch_request *request = (struct perf_fd_batch_request*)req;
+        valid = size >= offsetof(struct perf_fd_batch_request, tids) && request->count >= 0 &&
+                request->count <= MAX_PERF_FD_BATCH &&
+                size >= offsetof(struct perf_fd_batch_request, tids) + request->count * sizeof(int);
+    }
 
-        case KALLSYMS_FD: {
-            // can't directly pass the fd of /proc/kallsyms, because before Linux 4.15 the permission check
-            // was conducted on each read.
-            // it's simpler to copy the file to a temporary location and pass the fd of it (compared to passing the
-            // entire contents over the peer socket)
-            char tmp_path[256];
-            snprintf(tmp_path, sizeof(tmp_path), "/tmp/async-profiler-kallsyms.%d", getpid());
-
-            int kallsyms_fd = -1;
-            int error = copyFile("/proc/kallsyms", tmp_path, 0600);
-            if (error == 0) {
-                kallsyms_fd = open(tmp_path, O_RDONLY);
-                if (kallsyms_fd == -1) {
-                    error = errno;
-                } else {
-                    unlink(tmp_path);
+    if (!valid) {
+        fprintf(stderr, "Malformed request of %d bytes\n", (int)size);
+        struct fd_response resp;
+        resp.type = size >= sizeof(struct fd_request) ? req->type : 0;
+        resp.error = EINVAL;
+        return sendFds(peer, NULL, 0, &resp, sizeof(resp)) ? 1 : -1;
+    }
+
+    bool sent;
+    switch (req->type) {
+    case PERF_FD: {
+        struct perf_fd_request *request = (struct perf_fd_request*)req;
+        int error;
+        int perf_fd = openPerfEvent(peer, &request->attr, request->tid, &error);
+
+        struct perf_fd_response resp;
+        resp.header.type = request->header.type;
+        resp.header.error = error;
+        resp.tid = request->tid;
+        sent = sendFds(peer, &perf_fd, perf_fd != -1 ? 1 : 0, &resp.header, sizeof(resp));
+        close(perf_fd);
+        break;
+    }
+
+    case PERF_FD_BATCH: {
+        struct perf_fd_batch_request *request = (struct perf_fd_batch_request*)req;
+        struct perf_fd_batch_response resp;
+        resp.header.type = request->header.type;
+        resp.header.error = 0;
+        resp.count = 0;
+
+        int fds[MAX_PERF_FD_BATCH];
+        int fd_count = 0;
+        if (request->count < 0 || request->count > MAX_PERF_FD_BATCH) {
+            resp.header.error = EINVAL;
+        } else {
+            resp.count = request->count;
+            for (int i = 0; i < request->count; i++) {
+                resp.tids[i] = request->tids[i];
+                int perf_fd = openPerfEvent(peer, &request->attr, request->tids[i], &resp.errors[i]);
+                if (perf_fd != -1) {
+                    fds[fd_count++] = perf_fd;
                 }
             }
+        }
 
-            struct fd_response resp;
-            resp.type = req->type;
-            resp.error = error;
-            sendFd(kallsyms_fd, &resp, sizeof(resp));
-            close(kallsyms_fd);
-            break;
+        sent = sendFds(peer, fds, fd_count, &resp.header, sizeof(resp));
+        for (int i = 0; i < fd_count; i++) {
+            close(fds[i]);
         }
+        break;
+    }
 
-        default:
-            fprintf(stderr, "Unknown request type %u\n", req->type);
+    case KALLSYMS_FD: {
+        int error;
+        int kallsyms_fd = openKallsyms(&error);
+
+        struct fd_response resp;
+        resp.type = req->type;
+        resp.error = error;
+        sent = sendFds(peer, &kallsyms_fd, kallsyms_fd != -1 ? 1 : 0, &resp, sizeof(resp));
+        close(kallsyms_fd);
+        break;
+    }
+
+    default: {
+        // Reply anyway, so that the client does not wait forever for a request it may probe
+        fprintf(stderr, "Unknown request type %u\n", req->type);
+        struct fd_response resp;
+        resp.type = req->type;
+        resp.error = EINVAL;
+        sent = sendFds(peer, NULL, 0, &resp, sizeof(resp));
+        break;
+    }
+    }
+
+    return sent ? 1 : -1;
+}
+
+bool FdTransferServer::serveRequests(Peer* peer) {
+    // Close the server side, don't need it anymore.
+    FdTransferServer::closeServer();
+
+    int ret;
+    while ((ret = serveRequest(peer)) > 0) {
+        // Keep serving until the peer disconnects
+    }
+    return ret == 0;
+}
+
+// Serves all connected peers from one thread, so there is no process per profiled JVM
+bool FdTransferServer::servePeers() {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_create1()");
+        return false;
+    }
+
+    // The listening socket is registered with the out-of-range index MAX_PEERS
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = MAX_PEERS;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, _server, &ev) == -1) {
+        perror("epoll_ctl()");
+        close(epoll_fd);
+        return false;
+    }
+
+    static Peer peers[MAX_PEERS];
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peers[i].fd = -1;
+    }
+
+    while (1) {
+        struct epoll_event events[64];
+        int n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait()");
             break;
         }
+
+        for (int i = 0; i < n; i++) {
+            u_int32_t index = events[i].data.u32;
+            if (index == MAX_PEERS) {
+                Peer peer;
+                if (!acceptPeer(&peer, 0)) {
+                    continue;
+                }
+
+                int slot = 0;
+                while (slot < MAX_PEERS && peers[slot].fd != -1) {
+                    slot++;
+                }
+                if (slot == MAX_PEERS) {
+                    fprintf(stderr, "Too many peers, rejecting PID %d\n", peer.pid);
+                    closePeer(&peer);
+                    continue;
+                }
+
+                peers[slot] = peer;
+                ev.events = EPOLLIN;
+                ev.data.u32 = slot;
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, peer.fd, &ev);
+                printf("Serving PID %d\n", peer.pid);
+                fflush(stdout);
+            } else if (serveRequest(&peers[index]) <= 0) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, peers[index].fd, NULL);
+                closePeer(&peers[index]);
+            }
+        }
     }
 
+    close(epoll_fd);
     return false;
 }
 
@@ -233,7 +533,7 @@ int FdTransferServer::copyFile(const char* src_name, const char* dst_name, mode_
     return 0;
 }
 
-bool FdTransferServer::sendFd(int fd, struct fd_response *resp, size_t resp_size) {
+bool FdTransferServer::sendFds(Peer* peer, const int* fds, int count, struct fd_response *resp, size_t resp_size) {
     struct msghdr msg = {0};
 
     struct iovec iov[1];
@@ -243,22 +543,24 @@ bool FdTransferServer::sendFd(int fd, struct fd_response *resp, size_t resp_size
     msg.msg_iovlen = ARRAY_SIZE(iov);
 
     union {
-       char buf[CMSG_SPACE(sizeof(fd))];
+       char buf[CMSG_SPACE(sizeof(int) * MAX_PERF_FD_BATCH)];
        struct cmsghdr align;
     } u;
 
-    if (fd != -1) {
+    if (count > 0) {
         msg.msg_control = u.buf;
-        msg.msg_controllen = sizeof(u.buf);
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
 
         struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
         cmsg->cmsg_level = SOL_SOCKET;
         cmsg->cmsg_type = SCM_RIGHTS;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
-        memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
     }
 
-    ssize_t ret = sendmsg(_peer, &msg, 0);
+    // A peer that does not read its responses is dropped rather than waited for,
+    // since the other peers are served by the same thread
+    ssize_t ret = sendmsg(peer->fd, &msg, MSG_DONTWAIT);
     if (ret < 0) {
         perror("sendmsg()");
         return false;
@@ -303,7 +605,8 @@ static int single_pid_server(int pid) {
 
     // CLONE_NEWPID affects children only - so we fork here.
     if (0 == fork()) {
-        return FdTransferServer::acceptPeer(&nspid) && FdTransferServer::serveRequests(nspid) ? 0 : 1;
+        Peer peer;
+        return FdTransferServer::acceptPeer(&peer, nspid) && FdTransferServer::serveRequests(&peer) ? 0 : 1;
     } else {
         // Exit now, let our caller continue.
         return 0;
@@ -314,11 +617,6 @@ static int path_server(const char *path) {
     struct sockaddr_un sun;
     socklen_t addrlen;
 
-    struct sigaction sigchld_action;
-    sigchld_action.sa_handler = SIG_DFL;
-    sigchld_action.sa_flags = SA_NOCLDWAIT;
-    sigaction(SIGCHLD, &sigchld_action, NULL);
-
     if (!socketPath(path, &sun, &addrlen)) {
         fprintf(stderr, "Path '%s' is too long\n", path);
         return 1;
@@ -329,34 +627,10 @@ static int path_server(const char *path) {
     }
 
     printf("Server ready at '%s'\n", path);
+    fflush(stdout);
 
-    while (1) {
-        int peer_pid = 0;
-        if (!FdTransferServer::acceptPeer(&peer_pid)) {
-            return 1;
-        }
-
-        // Enter its PID namespace.
-        if (enter_ns(peer_pid, "pid") == -1) {
-            fprintf(stderr, "Failed to enter the PID NS of target process %d\n", peer_pid);
-            return 1;
-        }
-
-        printf("Serving PID %d\n", peer_pid);
-
-        // We fork(), to actually move a PID namespace.
-        if (0 == fork()) {
-            return FdTransferServer::serveRequests(0) ? 0 : 1;
-        } else {
-            FdTransferServer::closePeer();
-        }
-
-        // Move back to our original PID namespace (reverts pid_for_children)
-        if (enter_ns(getpid(), "pid") == -1) {
-            fprintf(stderr, "Failed to exit the PID NS of target process %d\n", peer_pid);
-            return 1;
-        }
-    }
+    // Thread IDs of peers in other PID namespaces are translated, so there is no need to enter them
+    return FdTransferServer::servePeers() ? 0 : 1;
 }
 
 int main(int argc, const char** argv) {
@@ -367,7 +641,7 @@ int main(int argc, const char** argv) {
 
     int pid = atoi(argv[1]);
     // 2 modes:
-    // pid == 0 - bind on a path and accept requests forever, from any PID, until being killed
+    // pid == 0 - bind on a path and accept requests forever, from any number of PIDs at once, until being killed
     // pid != 0 - bind on an abstract namespace UDS for that PID, accept requests only from that PID
     //            until the single connection is closed.
     if (pid != 0) {
@@ -20,12 +20,19 @@
 #ifdef __linux__
 
 #include "fdtransfer/fdtransfer.h"
+#include "mutex.h"
 
 class FdTransferClient {
   private:
     static int _peer;
+    // Serializes request/response pairs of different threads on the shared socket
+    static Mutex _lock;
+    // -1 if not probed yet
+    static int _batch_supported;
 
     static int recvFd(unsigned int request_id, struct fd_response *resp, size_t resp_size);
+    static bool probeBatch();
+    static int recvFds(unsigned int request_id, struct fd_response *resp, size_t resp_size, int *fds, int max_fds);
 
   public:
     static bool connectToServer(const char *path, int pid);
@@ -38,6 +45,7 @@ class FdTransferClient {
     }
 
     static int requestPerfFd(int *tid, struct perf_event_attr *attr);
+    static int requestPerfFds(int count, const int *tids, struct perf_event_attr *attr, int *fds, int *errors);
     static int requestKallsymsFd();
 };
 
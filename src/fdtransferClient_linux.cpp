@@ -23,6 +23,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include "fdtransferClient.h"
@@ -30,8 +31,14 @@
 
 
 int FdTransferClient::_peer = -1;
+Mutex FdTransferClient::_lock;
+int FdTransferClient::_batch_supported = -1;
+
+// Servers before PERF_FD_BATCH do not respond to unknown requests at all
+static const int BATCH_PROBE_TIMEOUT_MS = 1000;
 
 bool FdTransferClient::connectToServer(const char *path, int pid) {
+    _batch_supported = -1;
     _peer = socket(AF_UNIX, SOCK_SEQPACKET, 0);
     if (_peer == -1) {
         Log::warn("FdTransferClient socket(): %s", strerror(errno));
@@ -64,6 +71,7 @@ int FdTransferClient::requestPerfFd(int *tid, struct perf_event_attr *attr) {
     request.tid = *tid;
     memcpy(&request.attr, attr, sizeof(request.attr));
 
+    MutexLocker ml(_lock);
     if (send(_peer, &request, sizeof(request), 0) != sizeof(request)) {
         Log::warn("FdTransferClient send(): %s", strerror(errno));
         return -1;
@@ -75,9 +83,7 @@ int FdTransferClient::requestPerfFd(int *tid, struct perf_event_attr *attr) {
         // Update errno for our caller.
         errno = resp.header.error;
     } else {
-        // Update the TID of createForThread, in case the multiple threads' requests got mixed up and we're
-        // now handling the response destined to another. It's alright - the other thread(s) will finish the
-        // handling of our TID perf fd.
+        // The server answers with the TID it has opened the event for
         *tid = resp.tid;
     }
     return fd;
@@ -87,6 +93,7 @@ int FdTransferClient::requestKallsymsFd() {
     struct fd_request request;
     request.type = KALLSYMS_FD;
 
+    MutexLocker ml(_lock);
     if (send(_peer, &request, sizeof(request), 0) != sizeof(request)) {
         Log::warn("FdTransferClient send(): %s", strerror(errno));
         return -1;
@@ -101,7 +108,97 @@ int FdTransferClient::requestKallsymsFd() {
     return fd;
 }
 
+// Opens the event for up to MAX_PERF_FD_BATCH threads in one round trip.
+// On return, fds[i] is the event of tids[i], or -1 with the error code in errors[i].
+// Returns -1 if the request could not be served at all
+int FdTransferClient::requestPerfFds(int count, const int *tids, struct perf_event_attr *attr, int *fds, int *errors) {
+    if (count > MAX_PERF_FD_BATCH) {
+        count = MAX_PERF_FD_BATCH;
+    }
+
+    struct perf_fd_batch_request request;
+    request.header.type = PERF_FD_BATCH;
+    memcpy(&request.attr, attr, sizeof(request.attr));
+    request.count = count;
+    memcpy(request.tids, tids, count * sizeof(int));
+    size_t request_size = sizeof(request) - sizeof(request.tids) + count * sizeof(int);
+
+    MutexLocker ml(_lock);
+    if (!probeBatch()) {
+        return -1;
+    }
+
+    if (send(_peer, &request, request_size, 0) != (ssize_t)request_size) {
+        Log::warn("FdTransferClient send(): %s", strerror(errno));
+        return -1;
+    }
+
+    struct perf_fd_batch_response resp;
+    int received[MAX_PERF_FD_BATCH];
+    int received_count = recvFds(request.header.type, &resp.header, sizeof(resp), received, MAX_PERF_FD_BATCH);
+    if (received_count < 0 || resp.header.error != 0 || resp.count != count) {
+        for (int i = 0; i < received_count; i++) {
+            close(received[i]);
+        }
+        errno = received_count < 0 || resp.header.error == 0 ? EPROTO : resp.header.error;
+        return -1;
+    }
+
+    for (int i = 0, next = 0; i < count; i++) {
+        if (resp.errors[i] == 0 && next < received_count) {
+            fds[i] = received[next++];
+            errors[i] = 0;
+        } else {
+            fds[i] = -1;
+            errors[i] = resp.errors[i] != 0 ? resp.errors[i] : EPROTO;
+        }
+    }
+    return 0;
+}
+
+// Sends an empty batch once; an older server never answers it, and then only single requests are used
+bool FdTransferClient::probeBatch() {
+    if (_batch_supported >= 0) {
+        return _batch_supported != 0;
+    }
+    _batch_supported = 0;
+
+    struct perf_fd_batch_request request;
+    memset(&request, 0, sizeof(request));
+    request.header.type = PERF_FD_BATCH;
+    size_t request_size = sizeof(request) - sizeof(request.tids);
+    if (send(_peer, &request, request_size, 0) != (ssize_t)request_size) {
+        return false;
+    }
+
+    struct pollfd pfd = {_peer, POLLIN, 0};
+    if (poll(&pfd, 1, BATCH_PROBE_TIMEOUT_MS) != 1) {
+        Log::info("fdtransfer does not support batched requests");
+        return false;
+    }
+
+    struct perf_fd_batch_response resp;
+    int fd;
+    if (recvFds(request.header.type, &resp.header, sizeof(resp), &fd, 1) == 0 && resp.header.error == 0) {
+        _batch_supported = 1;
+    }
+    return _batch_supported != 0;
+}
+
 int FdTransferClient::recvFd(unsigned int type, struct fd_response *resp, size_t resp_size) {
+    int fd;
+    int count = recvFds(type, resp, resp_size, &fd, 1);
+    if (count < 0 || resp->error != 0) {
+        return -1;
+    } else if (count == 0) {
+        Log::warn("FdTransferClient recvmsg(): unexpected response with no SCM_RIGHTS");
+        return -1;
+    }
+    return fd;
+}
+
+// Returns the number of received file descriptors, or -1 if there is no valid response
+int FdTransferClient::recvFds(unsigned int type, struct fd_response *resp, size_t resp_size, int *fds, int max_fds) {
     struct msghdr msg = {0};
 
     struct iovec iov[1];
@@ -110,13 +207,12 @@ int FdTransferClient::recvFd(unsigned int type, struct fd_response *resp, size_t
     msg.msg_iov = iov;
     msg.msg_iovlen = ARRAY_SIZE(iov);
 
-    int newfd;
     union {
-        char buf[CMSG_SPACE(sizeof(newfd))];
+        char buf[CMSG_SPACE(sizeof(int) * MAX_PERF_FD_BATCH)];
         struct cmsghdr align;
     } u;
     msg.msg_control = u.buf;
-    msg.msg_controllen = sizeof(u.buf);
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * max_fds);
 
     ssize_t ret = recvmsg(_peer, &msg, 0);
     if (ret < 0) {
@@ -124,26 +220,22 @@ int FdTransferClient::recvFd(unsigned int type, struct fd_response *resp, size_t
         return -1;
     }
 
-    if (resp->type != type) {
-        Log::warn("FdTransferClient recvmsg(): bad response type");
-        return -1;
+    int count = 0;
+    struct cmsghdr *cmptr = CMSG_FIRSTHDR(&msg);
+    if (cmptr != NULL && cmptr->cmsg_level == SOL_SOCKET && cmptr->cmsg_type == SCM_RIGHTS) {
+        count = (cmptr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmptr), count * sizeof(int));
     }
 
-    if (resp->error == 0) {
-        struct cmsghdr *cmptr = CMSG_FIRSTHDR(&msg);
-        if (cmptr != NULL && cmptr->cmsg_len == CMSG_LEN(sizeof(newfd))
-            && cmptr->cmsg_level == SOL_SOCKET && cmptr->cmsg_type == SCM_RIGHTS) {
-
-            newfd = *((int*)CMSG_DATA(cmptr));
-        } else {
-            Log::warn("FdTransferClient recvmsg(): unexpected response with no SCM_RIGHTS: %s", strerror(errno));
-            newfd = -1;
+    if (resp->type != type) {
+        Log::warn("FdTransferClient recvmsg(): bad response type");
+        for (int i = 0; i < count; i++) {
+            close(fds[i]);
         }
-    } else {
-        newfd = -1;
+        return -1;
     }
 
-    return newfd;
+    return count;
 }
 
 #endif // __linux__
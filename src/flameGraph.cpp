@@ -16,14 +16,19 @@
 
 #include <algorithm>
 #include <vector>
+#include <stdint.h>
 #include <stdio.h>
 #include "flameGraph.h"
+#include "frameName.h"
 #include "vmEntry.h"
 
 
 // Browsers refuse to draw on canvas larger than 32767 px
 const int MAX_CANVAS_HEIGHT = 32767;
 
+// Flame graph frames are collected in a buffer of this size before going to the output stream
+static const size_t OUT_BUF_SIZE = 1024 * 1024;
+
 static const char FLAMEGRAPH_HEADER[] =
     "<!DOCTYPE html>\n"
     "<html lang='en'>\n"
@@ -89,8 +94,21 @@ static const char FLAMEGRAPH_HEADER[] =
     "\t\treturn '#' + (p[0] + ((p[1] * v) << 16 | (p[2] * v) << 8 | (p[3] * v))).toString(16);\n"
     "\t}\n"
     "\n"
-    "\tfunction f(level, left, width, type, title) {\n"
-    "\t\tlevels[level].push({left: left, width: width, color: getColor(palette[type]), title: title});\n"
+    "\tlet level0 = 0, left0 = 0, width0 = 0;\n"
+    "\n"
+    "\t// key is the index of the name in cpool << 3 | frame type; left is relative to the previous frame\n"
+    "\tfunction f(key, level, left, width) {\n"
+    "\t\tlevels[level0 = level].push({left: left0 += left, width: width0 = width, color: getColor(palette[key & 7]), title: cpool[key >>> 3]});\n"
+    "\t}\n"
+    "\n"
+    "\t// The first child of the previous frame at the same position\n"
+    "\tfunction u(key, width) {\n"
+    "\t\tf(key, level0 + 1, 0, width);\n"
+    "\t}\n"
+    "\n"
+    "\t// The next sibling of the previous frame on the same level\n"
+    "\tfunction n(key, width) {\n"
+    "\t\tf(key, level0, width0, width);\n"
     "\t}\n"
     "\n"
     "\tfunction samples(n) {\n"
@@ -453,33 +471,177 @@ class Format {
 };
 
 
-class Node {
+// Orders node indices by the alphabetical rank of their names
+class NameOrder {
+  private:
+    const std::vector<FlameNode>& _nodes;
+    const std::vector<u32>& _rank;
+
   public:
-    std::string _name;
-    const Trie* _trie;
+    NameOrder(const std::vector<FlameNode>& nodes, const std::vector<u32>& rank) : _nodes(nodes), _rank(rank) {
+    }
+
+    bool operator()(u32 a, u32 b) const {
+        return _rank[_nodes[a]._name] < _rank[_nodes[b]._name];
+    }
+};
+
+class StringOrder {
+  private:
+    const std::vector<std::string>& _names;
+
+  public:
+    StringOrder(const std::vector<std::string>& names) : _names(names) {
+    }
+
+    bool operator()(u32 a, u32 b) const {
+        return _names[a] < _names[b];
+    }
+};
+
+// Orders node indices by total value, largest first
+class TotalOrder {
+  private:
+    const std::vector<FlameNode>& _nodes;
 
-    Node(const std::string& name, const Trie& trie) : _name(name), _trie(&trie) {
+  public:
+    TotalOrder(const std::vector<FlameNode>& nodes) : _nodes(nodes) {
     }
 
-    bool operator<(const Node& other) const {
-        return _trie->_total > other._trie->_total;
+    bool operator()(u32 a, u32 b) const {
+        return _nodes[a]._total > _nodes[b]._total;
     }
 };
 
 
+FlameGraph::FlameGraph(const char* title, Counter counter, double minwidth, bool reverse) :
+    _nodes(),
+    _names(),
+    _title(title),
+    _counter(counter),
+    _minwidth(minwidth),
+    _reverse(reverse) {
+    _buf[sizeof(_buf) - 1] = 0;
+
+    FlameNode root = {internName("all"), 0, 0, 0, 0};
+    _nodes.push_back(root);
+}
+
+u32 FlameGraph::internName(const char* name) {
+    std::map<std::string, u32>::iterator it = _name_ids.lower_bound(name);
+    if (it != _name_ids.end() && it->first == name) {
+        return it->second;
+    }
+
+    u32 id = _names.size();
+    _names.push_back(name);
+    _name_ids.insert(it, std::map<std::string, u32>::value_type(name, id));
+    return id;
+}
+
+u32 FlameGraph::frameId(FrameName& fn, ASGCT_CallFrame& frame) {
+    // The name of a Java frame depends only on the method and the frame type, not on bci
+    u64 key2 = frame.bci < 0 ? (u32)frame.bci : 1ULL << 32 | FrameType::decode(frame.bci);
+
+    u32 id;
+    if (!_frame_ids.get((u64)(uintptr_t)frame.method_id, key2, id)) {
+        id = internName(fn.name(frame));
+        _frame_ids.put((u64)(uintptr_t)frame.method_id, key2, id);
+    }
+    return id;
+}
+
+u32 FlameGraph::addChild(u32 parent, u32 name_id, u64 value) {
+    _nodes[parent]._total += value;
+
+    u32 child;
+    if (!_child_ids.get(parent, name_id, child)) {
+        child = _nodes.size();
+        FlameNode node = {name_id, 0, _nodes[parent]._child, 0, 0};
+        _nodes.push_back(node);
+        _nodes[parent]._child = child;
+        _child_ids.put(parent, name_id, child);
+    }
+    return child;
+}
+
+int FlameGraph::depth(u32 node) const {
+    if (_nodes[node]._total < _mintotal) {
+        return 0;
+    }
+
+    int max_depth = 0;
+    for (u32 child = _nodes[node]._child; child != 0; child = _nodes[child]._sibling) {
+        int d = depth(child);
+        if (d > max_depth) max_depth = d;
+    }
+    return max_depth + 1;
+}
+
+// Parse frame types and escape every distinct name once rather than for every node
+void FlameGraph::prepareNames(bool tree) {
+    _types.resize(_names.size());
+    for (size_t i = 0; i < _names.size(); i++) {
+        std::string& name = _names[i];
+        _types[i] = frameType(name);
+        if (tree) {
+            StringUtils::replace(name, '&', "&amp;", 5);
+            StringUtils::replace(name, '<', "&lt;", 4);
+            StringUtils::replace(name, '>', "&gt;", 4);
+        } else {
+            StringUtils::replace(name, '\'', "\\'", 2);
+        }
+    }
+}
+
+// Flame graph lists children in alphabetical order
+void FlameGraph::sortChildren() {
+    std::vector<u32> order(_names.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), StringOrder(_names));
+
+    std::vector<u32> rank(_names.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        rank[order[i]] = i;
+    }
+
+    std::vector<u32> children;
+    for (size_t node = 0; node < _nodes.size(); node++) {
+        children.clear();
+        for (u32 child = _nodes[node]._child; child != 0; child = _nodes[child]._sibling) {
+            children.push_back(child);
+        }
+        if (children.size() < 2) {
+            continue;
+        }
+
+        std::sort(children.begin(), children.end(), NameOrder(_nodes, rank));
+        _nodes[node]._child = children[0];
+        for (size_t i = 1; i < children.size(); i++) {
+            _nodes[children[i - 1]]._sibling = children[i];
+        }
+        _nodes[children.back()]._sibling = 0;
+    }
+}
+
 void FlameGraph::dump(std::ostream& out, bool tree) {
-    _mintotal = _minwidth == 0 && tree ? _root._total / 1000 : (u64)(_root._total * _minwidth / 100);
-    int depth = _root.depth(_mintotal);
+    const FlameNode& root = _nodes[ROOT];
+    _mintotal = _minwidth == 0 && tree ? root._total / 1000 : (u64)(root._total * _minwidth / 100);
+    int depth = this->depth(ROOT);
 
     if (tree) {
         char buf[sizeof(TREE_HEADER) + 256];
         snprintf(buf, sizeof(buf) - 1, TREE_HEADER,
                  _reverse ? "Backtrace" : "Call tree",
                  _counter ==  COUNTER_SAMPLES ? "samples" : "counter",
-                 Format().thousands(_root._total));
+                 Format().thousands(root._total));
         out << buf;
 
-        printTreeFrame(out, _root, 0);
+        sortChildren();
+        prepareNames(true);
+        printTreeFrame(out, ROOT, 0);
 
         out << TREE_FOOTER;
     } else {
@@ -488,66 +650,134 @@ void FlameGraph::dump(std::ostream& out, bool tree) {
                  std::min(depth * 16, MAX_CANVAS_HEIGHT), _reverse ? "true" : "false", depth);
         out << buf;
 
-        printFrame(out, "all", _root, 0, 0);
+        sortChildren();
+        prepareNames(false);
+
+        // Every name that appears on the graph goes to the table once, in the order of first use
+        _out_buf.reserve(OUT_BUF_SIZE + sizeof(_buf));
+        _out_buf.assign("const cpool = [\n");
+        _cpool.assign(_names.size(), 0);
+        _cpool_size = 0;
+        addToPool(out, ROOT);
+        _out_buf.append("];\n\n");
+
+        _last_level = 0;
+        _last_left = 0;
+        _last_width = 0;
+        printFrame(out, ROOT, 0, 0);
+        out.write(_out_buf.data(), _out_buf.size());
+        std::string().swap(_out_buf);
 
         out << FLAMEGRAPH_FOOTER;
     }
 }
 
-void FlameGraph::printFrame(std::ostream& out, const std::string& name, const Trie& f, int level, u64 x) {
-    std::string name_copy = name;
-    int type = frameType(name_copy);
-    StringUtils::replace(name_copy, '\'', "\\'", 2);
+void FlameGraph::appendNumber(u64 value) {
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    do {
+        *--p = '0' + char(value % 10);
+    } while ((value /= 10) > 0);
+    _out_buf.append(p, buf + sizeof(buf) - p);
+}
+
+void FlameGraph::flushBuffer(std::ostream& out) {
+    if (_out_buf.size() >= OUT_BUF_SIZE) {
+        out.write(_out_buf.data(), _out_buf.size());
+        _out_buf.clear();
+    }
+}
+
+void FlameGraph::addToPool(std::ostream& out, u32 node) {
+    const FlameNode& f = _nodes[node];
+    if (_cpool[f._name] == 0) {
+        _cpool[f._name] = ++_cpool_size;
+        _out_buf.push_back('\'');
+        _out_buf.append(_names[f._name]);
+        _out_buf.append("',\n");
+        flushBuffer(out);
+    }
 
-    snprintf(_buf, sizeof(_buf) - 1, "f(%d,%llu,%llu,%d,'%s')\n", level, x, f._total, type, name_copy.c_str());
-    out << _buf;
+    for (u32 child = f._child; child != 0; child = _nodes[child]._sibling) {
+        if (_nodes[child]._total >= _mintotal) {
+            addToPool(out, child);
+        }
+    }
+}
+
+// Frames come in the depth-first order, so their positions never decrease.
+// The common cases of the first child and the next sibling are written in the short forms u() and n()
+void FlameGraph::printFrame(std::ostream& out, u32 node, int level, u64 x) {
+    const FlameNode& f = _nodes[node];
+    u64 key = (u64)(_cpool[f._name] - 1) << 3 | _types[f._name];
+    u64 delta = x - _last_left;
+
+    if (level == _last_level + 1 && delta == 0) {
+        _out_buf.append("u(");
+        appendNumber(key);
+    } else if (level == _last_level && delta == _last_width) {
+        _out_buf.append("n(");
+        appendNumber(key);
+    } else {
+        _out_buf.append("f(");
+        appendNumber(key);
+        _out_buf.push_back(',');
+        appendNumber(level);
+        _out_buf.push_back(',');
+        appendNumber(delta);
+    }
+    _out_buf.push_back(',');
+    appendNumber(f._total);
+    _out_buf.append(")\n");
+    flushBuffer(out);
+
+    _last_level = level;
+    _last_left = x;
+    _last_width = f._total;
 
     x += f._self;
-    for (std::map<std::string, Trie>::const_iterator it = f._children.begin(); it != f._children.end(); ++it) {
-        if (it->second._total >= _mintotal) {
-            printFrame(out, it->first, it->second, level + 1, x);
+    for (u32 child = f._child; child != 0; child = _nodes[child]._sibling) {
+        if (_nodes[child]._total >= _mintotal) {
+            printFrame(out, child, level + 1, x);
         }
-        x += it->second._total;
+        x += _nodes[child]._total;
     }
 }
 
-void FlameGraph::printTreeFrame(std::ostream& out, const Trie& f, int level) {
-    std::vector<Node> subnodes;
-    for (std::map<std::string, Trie>::const_iterator it = f._children.begin(); it != f._children.end(); ++it) {
-        subnodes.push_back(Node(it->first, it->second));
+void FlameGraph::printTreeFrame(std::ostream& out, u32 node, int level) {
+    std::vector<u32> subnodes;
+    for (u32 child = _nodes[node]._child; child != 0; child = _nodes[child]._sibling) {
+        subnodes.push_back(child);
     }
-    std::sort(subnodes.begin(), subnodes.end());
+    // Frames with equal totals stay in alphabetical order
+    std::stable_sort(subnodes.begin(), subnodes.end(), TotalOrder(_nodes));
 
-    double pct = 100.0 / _root._total;
+    double pct = 100.0 / _nodes[ROOT]._total;
     for (size_t i = 0; i < subnodes.size(); i++) {
-        std::string name = subnodes[i]._name;
-        const Trie* trie = subnodes[i]._trie;
-
-        int type = frameType(name);
-        StringUtils::replace(name, '&', "&amp;", 5);
-        StringUtils::replace(name, '<', "&lt;", 4);
-        StringUtils::replace(name, '>', "&gt;", 4);
+        const FlameNode* trie = &_nodes[subnodes[i]];
+        int type = _types[trie->_name];
+        const char* name = _names[trie->_name].c_str();
 
         if (_reverse) {
             snprintf(_buf, sizeof(_buf) - 1,
                      "<li><div>[%d] %.2f%% %s</div><span class=\"t%d\"> %s</span>\n",
                      level,
                      trie->_total * pct, Format().thousands(trie->_total),
-                     type, name.c_str());
+                     type, name);
         } else {
             snprintf(_buf, sizeof(_buf) - 1,
                      "<li><div>[%d] %.2f%% %s self: %.2f%% %s</div><span class=\"t%d\"> %s</span>\n",
                      level,
                      trie->_total * pct, Format().thousands(trie->_total),
                      trie->_self * pct, Format().thousands(trie->_self),
-                     type, name.c_str());
+                     type, name);
         }
         out << _buf;
 
-        if (trie->_children.size() > 0) {
+        if (trie->_child != 0) {
             out << "<ul>\n";
             if (trie->_total >= _mintotal) {
-                printTreeFrame(out, *trie, level + 1);
+                printTreeFrame(out, subnodes[i], level + 1);
             } else {
                 out << "<li>...\n";
             }
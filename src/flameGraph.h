@@ -19,72 +19,77 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include <iostream>
 #include "arch.h"
 #include "arguments.h"
+#include "pairMap.h"
+#include "vmEntry.h"
 
 
-class Trie {
-  public:
-    std::map<std::string, Trie> _children;
+class FrameName;
+
+// Nodes refer to each other and to frame names by index.
+// Children of a node form a singly linked list
+struct FlameNode {
+    u32 _name;
+    u32 _child;
+    u32 _sibling;
     u64 _total;
     u64 _self;
-
-    Trie() : _children(), _total(0), _self(0) {
-    }
-    
-    Trie* addChild(const std::string& key, u64 value) {
-        _total += value;
-        return &_children[key];
-    }
-
-    void addLeaf(u64 value) {
-        _total += value;
-        _self += value;
-    }
-
-    int depth(u64 cutoff) const {
-        if (_total < cutoff) {
-            return 0;
-        }
-
-        int max_depth = 0;
-        for (std::map<std::string, Trie>::const_iterator it = _children.begin(); it != _children.end(); ++it) {
-            int d = it->second.depth(cutoff);
-            if (d > max_depth) max_depth = d;
-        }
-        return max_depth + 1;
-    }
 };
 
 
 class FlameGraph {
   private:
-    Trie _root;
+    std::vector<FlameNode> _nodes;
+    std::vector<std::string> _names;
+    std::vector<int> _types;
+    std::map<std::string, u32> _name_ids;
+    PairMap _frame_ids;
+    PairMap _child_ids;
     char _buf[4096];
     u64 _mintotal;
 
+    // State of the flame graph writer: output buffer, name table indices (shifted by 1),
+    // and the previous frame, which the next one is encoded relative to
+    std::string _out_buf;
+    std::vector<u32> _cpool;
+    u32 _cpool_size;
+    int _last_level;
+    u64 _last_left;
+    u64 _last_width;
+
     const char* _title;
     Counter _counter;
     double _minwidth;
     bool _reverse;
 
-    void printFrame(std::ostream& out, const std::string& name, const Trie& f, int level, u64 x);
-    void printTreeFrame(std::ostream& out, const Trie& f, int level);
+    u32 internName(const char* name);
+    void prepareNames(bool tree);
+    void sortChildren();
+    int depth(u32 node) const;
+
+    void appendNumber(u64 value);
+    void flushBuffer(std::ostream& out);
+    void addToPool(std::ostream& out, u32 node);
+    void printFrame(std::ostream& out, u32 node, int level, u64 x);
+    void printTreeFrame(std::ostream& out, u32 node, int level);
     int frameType(std::string& name);
 
   public:
-    FlameGraph(const char* title, Counter counter, double minwidth, bool reverse) :
-        _root(),
-        _title(title),
-        _counter(counter),
-        _minwidth(minwidth),
-        _reverse(reverse) {
-        _buf[sizeof(_buf) - 1] = 0;
-    }
+    static const u32 ROOT = 0;
+
+    FlameGraph(const char* title, Counter counter, double minwidth, bool reverse);
+
+    // Returns the interned name of the frame. FrameName is asked only once per distinct frame
+    u32 frameId(FrameName& fn, ASGCT_CallFrame& frame);
+
+    u32 addChild(u32 parent, u32 name_id, u64 value);
 
-    Trie* root() {
-        return &_root;
+    void addLeaf(u32 node, u64 value) {
+        _nodes[node]._total += value;
+        _nodes[node]._self += value;
     }
 
     void dump(std::ostream& out, bool tree);
@@ -14,8 +14,11 @@
  * limitations under the License.
  */
 
+#include <deque>
 #include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include <arpa/inet.h>
 #include <cxxabi.h>
 #include <errno.h>
@@ -23,16 +26,26 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 #include "flightRecorder.h"
+#include "buffer.h"
+#include "counters.h"
 #include "jfrMetadata.h"
+#include "jfrStream.h"
 #include "dictionary.h"
+#include "mutex.h"
 #include "os.h"
+#include "perfEvents.h"
 #include "profiler.h"
 #include "spinLock.h"
 #include "symbols.h"
+#include "threadContext.h"
+#include "threadCpu.h"
 #include "threadFilter.h"
 #include "tsc.h"
 #include "vmStructs.h"
@@ -47,11 +60,9 @@ static void JNICALL JfrSync_stopProfiler(JNIEnv* env, jclass cls) {
 }
 
 
-const int BUFFER_SIZE = 1024;
-const int BUFFER_LIMIT = BUFFER_SIZE - 128;
-const int RECORDING_BUFFER_SIZE = 65536;
-const int RECORDING_BUFFER_LIMIT = RECORDING_BUFFER_SIZE - 4096;
-const int MAX_STRING_LENGTH = 8191;
+const int MAX_WRITE_BATCH = 64;
+const off_t NOCACHE_STEP = 16 * 1024 * 1024;
+const int MAX_JFR_FRAME_SIZE = 16;   // method id, line number, bci and frame type
 const u64 MAX_JLONG = 0x7fffffffffffffffULL;
 const u64 MIN_JLONG = 0x8000000000000000ULL;
 
@@ -64,7 +75,7 @@ static jmethodID _stop_method;
 static jmethodID _box_method;
 
 static const char* const SETTING_RING[] = {NULL, "kernel", "user"};
-static const char* const SETTING_CSTACK[] = {NULL, "no", "fp", "dwarf", "lbr"};
+static const char* const SETTING_CSTACK[] = {NULL, "no", "fp", "dwarf", "lbr", "auto", "vm"};
 
 
 struct CpuTime {
@@ -87,8 +98,8 @@ class MethodInfo {
     bool _mark;
     u32 _key;
     u32 _class;
-    u32 _name;
-    u32 _sig;
+    char* _name;
+    char* _sig;
     jint _modifiers;
     jint _line_number_table_size;
     jvmtiLineNumberEntry* _line_number_table;
@@ -107,6 +118,7 @@ class MethodInfo {
     }
 };
 
+// Methods are resolved once per recording and kept until the recording ends
 class MethodMap : public std::map<jmethodID, MethodInfo> {
   public:
     MethodMap() {
@@ -115,6 +127,8 @@ class MethodMap : public std::map<jmethodID, MethodInfo> {
     ~MethodMap() {
         jvmtiEnv* jvmti = VM::jvmti();
         for (const_iterator it = begin(); it != end(); ++it) {
+            free(it->second._name);
+            free(it->second._sig);
             jvmtiLineNumberEntry* line_number_table = it->second._line_number_table;
             if (line_number_table != NULL) {
                 jvmti->Deallocate((unsigned char*)line_number_table);
@@ -123,6 +137,8 @@ class MethodMap : public std::map<jmethodID, MethodInfo> {
     }
 };
 
+// Constant pool state of the current chunk. A chunk may contain several checkpoints:
+// each of them carries only constants that have not been written in the chunk yet
 class Lookup {
   public:
     MethodMap* _method_map;
@@ -130,6 +146,13 @@ class Lookup {
     Dictionary _packages;
     Dictionary _symbols;
 
+    std::set<u32> _written_traces;
+    std::set<u32> _written_classes;
+    std::vector<MethodInfo*> _chunk_methods;
+    size_t _written_methods;
+    std::vector<std::pair<u32, const char*> > _new_packages;
+    std::vector<std::pair<u32, const char*> > _new_symbols;
+
   private:
     void fillNativeMethodInfo(MethodInfo* mi, const char* name) {
         const char* lib_name = name == NULL ? NULL : Profiler::instance()->getLibraryName(name);
@@ -151,55 +174,43 @@ class Lookup {
             if (demangled != NULL) {
                 char* p = strchr(demangled, '(');
                 if (p != NULL) *p = 0;
-                mi->_name = _symbols.lookup(demangled);
-                mi->_sig = _symbols.lookup("()L;");
+                mi->_name = demangled;
+                mi->_sig = strdup("()L;");
                 mi->_type = FRAME_CPP;
-                free(demangled);
                 return;
             }
         }
 
         size_t len = strlen(name);
         if (len >= 4 && strcmp(name + len - 4, "_[k]") == 0) {
-            mi->_name = _symbols.lookup(name, len - 4);
-            mi->_sig = _symbols.lookup("(Lk;)L;");
+            mi->_name = strndup(name, len - 4);
+            mi->_sig = strdup("(Lk;)L;");
             mi->_type = FRAME_KERNEL;
         } else {
-            mi->_name = _symbols.lookup(name);
-            mi->_sig = _symbols.lookup("()L;");
+            mi->_name = strdup(name);
+            mi->_sig = strdup("()L;");
             mi->_type = FRAME_NATIVE;
         }
     }
 
-    void fillJavaMethodInfo(MethodInfo* mi, jmethodID method, bool first_time) {
+    void fillJavaMethodInfo(MethodInfo* mi, jmethodID method) {
         jvmtiEnv* jvmti = VM::jvmti();
 
-        jclass method_class;
-        char* class_name = NULL;
-        char* method_name = NULL;
-        char* method_sig = NULL;
-
-        if (jvmti->GetMethodDeclaringClass(method, &method_class) == 0 &&
-            jvmti->GetClassSignature(method_class, &class_name, NULL) == 0 &&
-            jvmti->GetMethodName(method, &method_name, &method_sig, NULL) == 0) {
-            mi->_class = _classes->lookup(class_name + 1, strlen(class_name) - 2);
-            mi->_name = _symbols.lookup(method_name);
-            mi->_sig = _symbols.lookup(method_sig);
+        // Shared with text and flame graph output, so a method is resolved once for all formats
+        ResolvedMethod resolved;
+        if (Profiler::instance()->methodTable()->resolve(method, resolved) == 0) {
+            mi->_class = resolved.class_id;
+            mi->_name = strdup(resolved.name);
+            mi->_sig = strdup(resolved.sig);
+            mi->_modifiers = resolved.modifiers;
         } else {
             mi->_class = _classes->lookup("");
-            mi->_name = _symbols.lookup("jvmtiError");
-            mi->_sig = _symbols.lookup("()L;");
-        }
-
-        jvmti->Deallocate((unsigned char*)method_sig);
-        jvmti->Deallocate((unsigned char*)method_name);
-        jvmti->Deallocate((unsigned char*)class_name);
-
-        if (first_time && jvmti->GetMethodModifiers(method, &mi->_modifiers) != 0) {
+            mi->_name = strdup("jvmtiError");
+            mi->_sig = strdup("()L;");
             mi->_modifiers = 0;
         }
 
-        if (first_time && jvmti->GetLineNumberTable(method, &mi->_line_number_table_size, &mi->_line_number_table) != 0) {
+        if (jvmti->GetLineNumberTable(method, &mi->_line_number_table_size, &mi->_line_number_table) != 0) {
             mi->_line_number_table_size = 0;
             mi->_line_number_table = NULL;
         }
@@ -209,29 +220,51 @@ class Lookup {
 
   public:
     Lookup(MethodMap* method_map, Dictionary* classes) :
-        _method_map(method_map), _classes(classes), _packages(), _symbols() {
+        _method_map(method_map), _classes(classes), _packages(), _symbols(), _written_methods(0) {
+    }
+
+    // Forgets everything written in the current chunk, but keeps resolved methods
+    void reset() {
+        for (size_t i = 0; i < _chunk_methods.size(); i++) {
+            _chunk_methods[i]->_mark = false;
+        }
+        _chunk_methods.clear();
+        _written_methods = 0;
+        _written_traces.clear();
+        _written_classes.clear();
+        _new_packages.clear();
+        _new_symbols.clear();
+        _packages.clear();
+        _symbols.clear();
     }
 
     MethodInfo* resolveMethod(ASGCT_CallFrame& frame) {
         jmethodID method = frame.method_id;
+        int bci = frame.bci;
+        if (bci == BCI_ADDRESS) {
+            // All addresses within one native function share the same MethodInfo
+            method = (jmethodID)Profiler::instance()->resolveNativeMethod((const void*)method);
+            bci = BCI_NATIVE_FRAME;
+        }
+
         MethodInfo* mi = &(*_method_map)[method];
 
-        bool first_time = mi->_key == 0;
-        if (first_time) {
+        if (mi->_key == 0) {
             mi->_key = _method_map->size();
-        }
-
-        if (!mi->_mark) {
-            mi->_mark = true;
             if (method == NULL) {
                 fillNativeMethodInfo(mi, "unknown");
-            } else if (frame.bci == BCI_NATIVE_FRAME || frame.bci == BCI_ERROR) {
+            } else if (bci == BCI_NATIVE_FRAME || bci == BCI_ERROR) {
                 fillNativeMethodInfo(mi, (const char*)method);
             } else {
-                fillJavaMethodInfo(mi, method, first_time);
+                fillJavaMethodInfo(mi, method);
             }
         }
 
+        if (!mi->_mark) {
+            mi->_mark = true;
+            _chunk_methods.push_back(mi);
+        }
+
         return mi;
     }
 
@@ -249,133 +282,125 @@ class Lookup {
         if (class_name[0] == '[') {
             class_name = strchr(class_name, 'L') + 1;
         }
-        return _packages.lookup(class_name, package - class_name);
+
+        const char* added_key;
+        u32 id = _packages.lookup(class_name, package - class_name, added_key);
+        if (added_key != NULL) {
+            _new_packages.push_back(std::make_pair(id, added_key));
+        }
+        return id;
     }
 
     u32 getSymbol(const char* name) {
-        return _symbols.lookup(name);
+        const char* added_key;
+        u32 id = _symbols.lookup(name, strlen(name), added_key);
+        if (added_key != NULL) {
+            _new_symbols.push_back(std::make_pair(id, added_key));
+        }
+        return id;
     }
 };
 
 
-class Buffer {
-  private:
-    int _offset;
-    char _data[BUFFER_SIZE - sizeof(int)];
-
-  public:
-    Buffer() : _offset(0) {
-    }
+// Consecutive allocation samples of one slot with the same key (thread, trace, class, TLAB kind, context),
+// accumulated until the key changes or the batch window ends
+struct AllocBatch {
+    u64 start_time;
+    u64 end_time;
+    u64 context_id;
+    u64 instance_size;
+    u64 total_size;
+    u32 samples;
+    u32 call_trace_id;
+    u32 class_id;
+    int tid;
+    int event_type;
+};
 
-    const char* data() const {
-        return _data;
-    }
 
-    int offset() const {
-        return _offset;
-    }
+// Every event slot owns exactly two buffers. The producer fills the active one;
+// the other is either pending (waiting for the writer thread) or spare (already written).
+// A slot has a single producer at a time (guarded by the slot lock) and a single consumer,
+// the writer thread, so the handoff is lock-free and safe to perform in a signal handler.
+struct BufferSlot {
+    RecordingBuffer* active;
+    RecordingBuffer* pending;
+    RecordingBuffer* spare;
+    // Producer-side state, guarded by the slot lock as well
+    int last_tid;
+    AllocBatch batch;
+};
 
-    int skip(int delta) {
-        int offset = _offset;
-        _offset = offset + delta;
-        return offset;
-    }
 
-    void reset() {
-        _offset = 0;
-    }
+// Finished chunks of a size or age bounded recording, oldest first.
+// Chunks stay in unlinked temporary files until they fall out of the retention window
+class ChunkRing {
+  private:
+    struct Chunk {
+        int fd;
+        size_t size;
+        u64 end_time;
+    };
 
-    void put(const char* v, u32 len) {
-        memcpy(_data + _offset, v, len);
-        _offset += (int)len;
-    }
+    std::deque<Chunk> _chunks;
+    u64 _total_size;
+    u64 _max_size;
+    u64 _max_age;
 
-    void put8(char v) {
-        _data[_offset++] = v;
+  public:
+    ChunkRing(u64 max_size, u64 max_age) : _chunks(), _total_size(0), _max_size(max_size), _max_age(max_age) {
     }
 
-    void put16(short v) {
-        *(short*)(_data + _offset) = htons(v);
-        _offset += 2;
+    ~ChunkRing() {
+        for (size_t i = 0; i < _chunks.size(); i++) {
+            close(_chunks[i].fd);
+        }
     }
 
-    void put32(int v) {
-        *(int*)(_data + _offset) = htonl(v);
-        _offset += 4;
-    }
+    // Takes ownership of fd. The newest chunk is always retained
+    void add(int fd, size_t size, u64 end_time) {
+        Chunk chunk = {fd, size, end_time};
+        _chunks.push_back(chunk);
+        _total_size += size;
 
-    void put64(u64 v) {
-        *(u64*)(_data + _offset) = OS::hton64(v);
-        _offset += 8;
+        while (_chunks.size() > 1 && ((_max_size > 0 && _total_size > _max_size) ||
+                                      (_max_age > 0 && _chunks.front().end_time + _max_age < end_time))) {
+            close(_chunks.front().fd);
+            _total_size -= _chunks.front().size;
+            _chunks.pop_front();
+        }
     }
 
-    void putFloat(float v) {
-        union {
-            float f;
-            int i;
-        } u;
-
-        u.f = v;
-        put32(u.i);
-    }
+    // Replaces the output file with all retained chunks. They are written to a temporary file
+    // next to it first, so the previous dump stays intact if the process dies in the middle
+    void writeTo(const char* file_name) {
+        size_t len = strlen(file_name) + 16;
+        char* tmp_name = (char*)malloc(len);
+        snprintf(tmp_name, len, "%s.%d~", file_name, OS::processId());
 
-    void putVar32(u32 v) {
-        while (v > 0x7f) {
-            _data[_offset++] = (char)v | 0x80;
-            v >>= 7;
+        int fd = open(tmp_name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (fd == -1) {
+            Log::warn("Could not write JFR recording to %s: %s", tmp_name, strerror(errno));
+            free(tmp_name);
+            return;
         }
-        _data[_offset++] = (char)v;
-    }
 
-    void putVar64(u64 v) {
-        int iter = 0;
-        while (v > 0x1fffff) {
-            _data[_offset++] = (char)v | 0x80; v >>= 7;
-            _data[_offset++] = (char)v | 0x80; v >>= 7;
-            _data[_offset++] = (char)v | 0x80; v >>= 7;
-            if (++iter == 3) return;
+        bool success = true;
+        for (size_t i = 0; i < _chunks.size() && success; i++) {
+            success = OS::copyFile(_chunks[i].fd, fd, 0, _chunks[i].size);
         }
-        while (v > 0x7f) {
-            _data[_offset++] = (char)v | 0x80;
-            v >>= 7;
+        if (close(fd) != 0) {
+            success = false;
         }
-        _data[_offset++] = (char)v;
-    }
 
-    void putUtf8(const char* v) {
-        if (v == NULL) {
-            put8(0);
-        } else {
-            size_t len = strlen(v);
-            putUtf8(v, len < MAX_STRING_LENGTH ? len : MAX_STRING_LENGTH);
+        if (!success) {
+            Log::warn("Could not write JFR recording to %s: %s", tmp_name, strerror(errno));
+            unlink(tmp_name);
+        } else if (rename(tmp_name, file_name) != 0) {
+            Log::warn("Could not replace JFR recording %s: %s", file_name, strerror(errno));
+            unlink(tmp_name);
         }
-    }
-
-    void putUtf8(const char* v, u32 len) {
-        put8(3);
-        putVar32(len);
-        put(v, len);
-    }
-
-    void put8(int offset, char v) {
-        _data[offset] = v;
-    }
-
-    void putVar32(int offset, u32 v) {
-        _data[offset] = v | 0x80;
-        _data[offset + 1] = (v >> 7) | 0x80;
-        _data[offset + 2] = (v >> 14) | 0x80;
-        _data[offset + 3] = (v >> 21) | 0x80;
-        _data[offset + 4] = (v >> 28);
-    }
-};
-
-class RecordingBuffer : public Buffer {
-  private:
-    char _buf[RECORDING_BUFFER_SIZE - sizeof(Buffer)];
-
-  public:
-    RecordingBuffer() : Buffer() {
+        free(tmp_name);
     }
 };
 
@@ -387,12 +412,23 @@ class Recording {
     static char* _jvm_flags;
     static char* _java_command;
 
-    RecordingBuffer _buf[CONCURRENCY_LEVEL];
+    RecordingBuffer* _buf;
+    RecordingBuffer* _log_buf;
+    RecordingBuffer* _event_bufs;
+    BufferSlot* _slots;
+    int _buf_count;
     int _fd;
     char* _master_recording_file;
+    JfrStream* _stream;
+    ChunkRing* _ring;
+    char* _ring_file;
     off_t _chunk_start;
+    off_t _last_cpool_offset;
+    bool _nocache;
+    off_t _cached_start;
     ThreadFilter _thread_set;
     MethodMap _method_map;
+    Lookup _lookup;
 
     u64 _start_time;
     u64 _start_ticks;
@@ -407,19 +443,205 @@ class Recording {
     int _tid;
     int _available_processors;
     int _recorded_lib_count;
+    std::string _event_name;
+
+    pthread_t _writer_thread;
+    volatile bool _writer_running;
+    int _wakeup_fd[2];
+    Mutex _write_lock;
+    volatile u64 _dropped_events;
+    u64 _alloc_batch_ticks;
 
     bool _cpu_monitor_enabled;
+    bool _thread_cpu_enabled;
     Buffer _cpu_monitor_buf;
     CpuTimes _last_times;
+    ProcessStats _last_stats;
+    CpuThrottling _last_throttling;
+    bool _throttling_enabled;
+    u64 _monitor_period;
+    u64 _next_monitor_time;
 
     static float ratio(float value) {
         return value < 0 ? 0 : value > 1 ? 1 : value;
     }
 
+    static void* writerThreadEntry(void* rec) {
+        ((Recording*)rec)->writerLoop();
+        return NULL;
+    }
+
+    void startWriter() {
+        _writer_running = false;
+        if (pipe(_wakeup_fd) != 0) {
+            Log::warn("Could not start JFR writer thread: %s", strerror(errno));
+            return;
+        }
+
+        // Producers must never block on a full pipe: any pending byte is enough to wake the writer
+        fcntl(_wakeup_fd[1], F_SETFL, fcntl(_wakeup_fd[1], F_GETFL) | O_NONBLOCK);
+
+        _writer_running = true;
+        if (pthread_create(&_writer_thread, NULL, writerThreadEntry, this) != 0) {
+            Log::warn("Could not start JFR writer thread, events will be written synchronously");
+            _writer_running = false;
+            close(_wakeup_fd[0]);
+            close(_wakeup_fd[1]);
+        }
+    }
+
+    void stopWriter() {
+        if (_writer_running) {
+            _writer_running = false;
+            wakeupWriter();
+            pthread_join(_writer_thread, NULL);
+            close(_wakeup_fd[0]);
+            close(_wakeup_fd[1]);
+        }
+    }
+
+    void wakeupWriter() {
+        char c = 0;
+        ssize_t result = write(_wakeup_fd[1], &c, 1);
+        (void)result;
+    }
+
+    void writerLoop() {
+        char wakeups[64];
+        while (_writer_running) {
+            if (read(_wakeup_fd[0], wakeups, sizeof(wakeups)) > 0) {
+                MutexLocker ml(_write_lock);
+                writePending();
+            }
+        }
+    }
+
+    // Writes all pending buffers with batched writev and hands them back to producers as spare.
+    // Called either by the writer thread or by finishChunk; both hold _write_lock
+    void writePending() {
+        struct iovec iov[MAX_WRITE_BATCH];
+        BufferSlot* batch[MAX_WRITE_BATCH];
+
+        for (int i = 0; i < _buf_count; ) {
+            int count = 0;
+            for (; i < _buf_count && count < MAX_WRITE_BATCH && count < IOV_MAX; i++) {
+                RecordingBuffer* buf = __atomic_load_n(&_slots[i].pending, __ATOMIC_ACQUIRE);
+                if (buf != NULL) {
+                    iov[count].iov_base = (void*)buf->data();
+                    iov[count].iov_len = buf->offset();
+                    batch[count++] = &_slots[i];
+                }
+            }
+
+            if (count > 0) {
+                ssize_t result = writev(_fd, iov, count);
+                if (result > 0) {
+                    atomicInc(_bytes_written, result);
+                }
+
+                for (int j = 0; j < count; j++) {
+                    // Clear pending before publishing the spare buffer: once the producer sees
+                    // the spare, it may immediately submit a new pending buffer
+                    RecordingBuffer* buf = batch[j]->pending;
+                    buf->reset();
+                    __atomic_store_n(&batch[j]->pending, (RecordingBuffer*)NULL, __ATOMIC_RELAXED);
+                    __atomic_store_n(&batch[j]->spare, buf, __ATOMIC_RELEASE);
+                }
+            }
+        }
+
+        if (_nocache) {
+            dropWrittenPages(NOCACHE_STEP);
+        }
+    }
+
+    // O_DIRECT does not fit JFR output: writes are unaligned, and headers are patched in place.
+    // Instead, the writer thread periodically writes back and drops what has been written so far
+    void dropWrittenPages(off_t min_size) {
+        off_t end = lseek(_fd, 0, SEEK_CUR);
+        if (end - _cached_start >= min_size) {
+            OS::dropWrittenPages(_fd, _cached_start, end);
+            _cached_start = end;
+        }
+    }
+
+    // Passes the active buffer to the writer thread and continues with the spare one.
+    // Returns false if the writer has not yet written the previous buffer of this slot.
+    // Without the writer thread, the buffer is written in place, unless a checkpoint
+    // or another flush is writing to the same file at the moment
+    bool submit(BufferSlot* slot) {
+        if (!_writer_running) {
+            if (!_write_lock.tryLock()) {
+                return false;
+            }
+            flush(slot->active);
+            _write_lock.unlock();
+            return true;
+        }
+
+        RecordingBuffer* spare = __atomic_load_n(&slot->spare, __ATOMIC_ACQUIRE);
+        if (spare == NULL) {
+            return false;
+        }
+
+        slot->spare = NULL;
+        __atomic_store_n(&slot->pending, slot->active, __ATOMIC_RELEASE);
+        slot->active = spare;
+        wakeupWriter();
+        return true;
+    }
+
+    // Writes everything recorded so far. Requires all producers to be stopped
+    void flushEventBuffers() {
+        MutexLocker ml(_write_lock);
+        writePending();
+        for (int i = 0; i < _buf_count; i++) {
+            flushAllocBatch(_slots[i].active, &_slots[i].batch);
+            flush(_slots[i].active);
+        }
+    }
+
+    // A pair of buffers per sample slot; RECORDING_BUFFER_SIZE is a multiple of the page size,
+    // so every pair occupies its own pages and can be placed on the NUMA node of the slot's CPU
+    static RecordingBuffer* allocateEventBuffers(int count, bool numa) {
+        size_t size = count * sizeof(RecordingBuffer);
+        RecordingBuffer* bufs = (RecordingBuffer*)OS::safeAlloc(size);
+        if (numa) {
+            // Before the constructors touch the pages
+            for (int i = 0; i < count; i += 2) {
+                OS::bindToNumaNode(&bufs[i], 2 * sizeof(RecordingBuffer), OS::getNumaNode(i / 2));
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            new(&bufs[i]) RecordingBuffer();
+        }
+        return bufs;
+    }
+
   public:
-    Recording(int fd, Arguments& args) : _fd(fd), _thread_set(), _method_map() {
+    Recording(int fd, Arguments& args, JfrStream* stream, const char* ring_file) :
+        _fd(fd), _stream(stream), _ring(NULL), _ring_file(NULL), _thread_set(), _method_map(),
+        _lookup(&_method_map, Profiler::instance()->classMap()) {
         _master_recording_file = args._jfr_sync == NULL ? NULL : strdup(args.file());
+        _event_name = args._event != NULL ? args._event : "";
         _chunk_start = lseek(_fd, 0, SEEK_END);
+        _last_cpool_offset = 0;
+        _nocache = args._jfr_nocache;
+        _cached_start = _chunk_start;
+        _buf_count = Profiler::instance()->concurrencyLevel();
+        _buf = new RecordingBuffer();
+        _log_buf = new RecordingBuffer();
+        _event_bufs = allocateEventBuffers(_buf_count * 2, args._numa);
+        _slots = new BufferSlot[_buf_count];
+        for (int i = 0; i < _buf_count; i++) {
+            _slots[i].active = &_event_bufs[i * 2];
+            _slots[i].pending = NULL;
+            _slots[i].spare = &_event_bufs[i * 2 + 1];
+            _slots[i].last_tid = 0;
+            _slots[i].batch.samples = 0;
+        }
+        _alloc_batch_ticks = args._alloc_batch > 0 ? TSC::fromNanos(args._alloc_batch) : 0;
+        _dropped_events = 0;
         _start_time = OS::micros();
         _start_ticks = TSC::ticks();
         _base_id = 0;
@@ -428,6 +650,19 @@ class Recording {
         _chunk_size = args._chunk_size <= 0 ? MAX_JLONG : (args._chunk_size < 262144 ? 262144 : args._chunk_size);
         _chunk_time = args._chunk_time <= 0 ? MAX_JLONG : (args._chunk_time < 5 ? 5 : args._chunk_time) * 1000000ULL;
 
+        if (ring_file != NULL) {
+            // Rotate chunks often enough so that the retained window is close to the requested one
+            u64 max_age = args._jfr_max_age * 1000000ULL;
+            if (args._jfr_max_size > 0 && _chunk_size > (u64)args._jfr_max_size / 4) {
+                _chunk_size = args._jfr_max_size / 4 < 262144 ? 262144 : args._jfr_max_size / 4;
+            }
+            if (max_age > 0 && _chunk_time > max_age / 4) {
+                _chunk_time = max_age / 4 < 5000000 ? 5000000 : max_age / 4;
+            }
+            _ring = new ChunkRing(args._jfr_max_size, max_age);
+            _ring_file = strdup(ring_file);
+        }
+
         _tid = OS::threadId();
         addThread(_tid);
         VM::jvmti()->GetAvailableProcessors(&_available_processors);
@@ -451,47 +686,74 @@ class Recording {
         }
         flush(_buf);
 
+        _thread_cpu_enabled = args._thread_cpu;
         _cpu_monitor_enabled = !args.hasOption(NO_CPU_LOAD);
         if (_cpu_monitor_enabled) {
             _last_times.proc.real = OS::getProcessCpuTime(&_last_times.proc.user, &_last_times.proc.system);
             _last_times.total.real = OS::getTotalCpuTime(&_last_times.total.user, &_last_times.total.system);
+            if (!OS::getProcessStats(&_last_stats)) {
+                memset(&_last_stats, 0, sizeof(_last_stats));
+            }
         }
+        // Containers without CFS bandwidth control do not get throttling events
+        _throttling_enabled = _cpu_monitor_enabled && OS::getCpuThrottling(&_last_throttling);
+        _monitor_period = args._monitor_period > 0 ? args._monitor_period : 1000000000;
+        _next_monitor_time = OS::nanotime() + _monitor_period;
+
+        startWriter();
     }
 
     ~Recording() {
         off_t chunk_end = finishChunk();
+        stopWriter();
 
         if (_master_recording_file != NULL) {
             appendRecording(_master_recording_file, chunk_end);
             free(_master_recording_file);
         }
 
+        if (_stream != NULL) {
+            _stream->stop();
+            delete _stream;
+        }
+
+        if (_ring != NULL) {
+            _ring->writeTo(_ring_file);
+            free(_ring_file);
+            delete _ring;
+        }
+
         close(_fd);
+        delete[] _slots;
+        OS::safeFree(_event_bufs, _buf_count * 2 * sizeof(RecordingBuffer));
+        delete _log_buf;
+        delete _buf;
+    }
+
+    // Event buffers of the sample slots, the spare ones and the buffers of the recording itself
+    size_t usedMemory() {
+        return (_buf_count * 2 + 2) * sizeof(RecordingBuffer);
     }
 
     off_t finishChunk() {
         flush(&_cpu_monitor_buf);
 
         writeNativeLibraries(_buf);
+        flush(_buf);
+
+        flushEventBuffers();
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            flush(&_buf[i]);
+        u64 dropped = __sync_lock_test_and_set(&_dropped_events, 0);
+        if (dropped > 0) {
+            Log::warn("Dropped %llu JFR events: recording writer could not keep up with the disk", (unsigned long long)dropped);
         }
 
         _stop_time = OS::micros();
         _stop_ticks = TSC::ticks();
 
-        off_t cpool_offset = lseek(_fd, 0, SEEK_CUR);
-        writeCpool(_buf);
-        flush(_buf);
-
+        off_t cpool_offset = writeCheckpoint(true);
         off_t chunk_end = lseek(_fd, 0, SEEK_CUR);
 
-        // Patch cpool size field
-        _buf->putVar32(0, chunk_end - cpool_offset);
-        ssize_t result = pwrite(_fd, _buf->data(), 5, cpool_offset);
-        (void)result;
-
         // Workaround for JDK-8191415: compute actual TSC frequency, in case JFR is wrong
         u64 tsc_frequency = TSC::frequency();
         if (tsc_frequency > 1000000000) {
@@ -506,15 +768,58 @@ class Recording {
         _buf->put64((_stop_time - _start_time) * 1000);
         _buf->put64(_start_ticks);
         _buf->put64(tsc_frequency);
-        result = pwrite(_fd, _buf->data(), 56, _chunk_start + 8);
+        ssize_t result = pwrite(_fd, _buf->data(), 56, _chunk_start + 8);
         (void)result;
 
-        OS::freePageCache(_fd, _chunk_start);
+        if (_stream != NULL) {
+            // Hand the complete chunk over to the sender thread and continue in a new file
+            MutexLocker ml(_write_lock);
+            _stream->submit(_fd, chunk_end - _chunk_start);
+            _fd = JfrStream::createChunkFile();
+            chunk_end = 0;
+        } else if (_ring != NULL) {
+            MutexLocker ml(_write_lock);
+            _ring->add(_fd, chunk_end - _chunk_start, _stop_time);
+            _fd = JfrStream::createChunkFile();
+            chunk_end = 0;
+        } else if (_nocache) {
+            MutexLocker ml(_write_lock);
+            _cached_start = _chunk_start;
+            dropWrittenPages(0);
+        } else {
+            OS::freePageCache(_fd, _chunk_start);
+        }
+        _cached_start = chunk_end;
 
         _buf->reset();
+        _lookup.reset();
+        _last_cpool_offset = 0;
         return chunk_end;
     }
 
+    // Writes constants that appeared since the previous checkpoint, while the chunk is still open.
+    // Event buffers need not be flushed: any checkpoint covers all events of the chunk
+    void flushpoint() {
+        MutexLocker ml(_write_lock);
+        writeCheckpoint(false);
+    }
+
+    off_t writeCheckpoint(bool last) {
+        off_t cpool_offset = lseek(_fd, 0, SEEK_CUR);
+        writeCpool(_buf, _last_cpool_offset == 0 ? 0 : _last_cpool_offset - cpool_offset, last);
+        flush(_buf);
+
+        off_t cpool_end = lseek(_fd, 0, SEEK_CUR);
+
+        // Patch cpool size field
+        _buf->putVar32(0, cpool_end - cpool_offset);
+        ssize_t result = pwrite(_fd, _buf->data(), 5, cpool_offset);
+        (void)result;
+
+        _last_cpool_offset = cpool_offset;
+        return cpool_offset;
+    }
+
     void switchChunk() {
         _chunk_start = finishChunk();
         _start_time = _stop_time;
@@ -528,13 +833,29 @@ class Recording {
         flush(_buf);
     }
 
+    // Writes the retained window of a ring recording to the output file
+    void dumpRing() {
+        if (_ring != NULL) {
+            _ring->writeTo(_ring_file);
+        }
+    }
+
     bool needSwitchChunk(u64 wall_time) {
         return loadAcquire(_bytes_written) >= _chunk_size || wall_time - _start_time >= _chunk_time;
     }
 
+    // Called at least once a second and more often if the monitor period is shorter
     void cpuMonitorCycle() {
         if (!_cpu_monitor_enabled) return;
 
+        // Timer wakeups are a bit late, so a monitor is due slightly before its time
+        u64 now = OS::nanotime();
+        if (now + _monitor_period / 8 < _next_monitor_time) return;
+        _next_monitor_time += _monitor_period;
+        if (_next_monitor_time <= now) {
+            _next_monitor_time = now + _monitor_period;
+        }
+
         CpuTimes times;
         times.proc.real = OS::getProcessCpuTime(&times.proc.user, &times.proc.system);
         times.total.real = OS::getTotalCpuTime(&times.total.user, &times.total.system);
@@ -557,11 +878,46 @@ class Recording {
         }
 
         recordCpuLoad(&_cpu_monitor_buf, proc_user, proc_system, machine_total);
+
+        ProcessStats stats;
+        if (OS::getProcessStats(&stats)) {
+            recordProcessStats(&_cpu_monitor_buf, &stats, &_last_stats);
+            _last_stats = stats;
+        }
+
+        CpuThrottling throttling;
+        if (_throttling_enabled && OS::getCpuThrottling(&throttling)) {
+            recordCpuThrottling(&_cpu_monitor_buf, &throttling, &_last_throttling);
+            _last_throttling = throttling;
+        }
         flushIfNeeded(&_cpu_monitor_buf, BUFFER_LIMIT);
 
         _last_times = times;
     }
 
+    // The thread CPU clock does not tell user time from system time, so all load is reported as user
+    void threadCpuCycle() {
+        if (!_thread_cpu_enabled) return;
+
+        std::vector<ThreadCpuStat> deltas;
+        u64 elapsed = ThreadCpu::update(&deltas);
+        if (elapsed == 0) return;
+
+        u64 ticks = TSC::ticks();
+        float delta = (float)elapsed * _available_processors;
+        for (size_t i = 0; i < deltas.size(); i++) {
+            addThread(deltas[i].tid);
+            recordThreadCpuLoad(&_cpu_monitor_buf, ticks, deltas[i].tid, ratio(deltas[i].cpu_time / delta));
+            flushIfNeeded(&_cpu_monitor_buf, BUFFER_LIMIT);
+        }
+    }
+
+    // Cumulative self-profiling counters, so that the profiler's own cost can be seen in the recording
+    void overheadCycle() {
+        recordOverhead(&_cpu_monitor_buf);
+        flushIfNeeded(&_cpu_monitor_buf, BUFFER_LIMIT);
+    }
+
     bool hasMasterRecording() const {
         return _master_recording_file != NULL;
     }
@@ -570,15 +926,109 @@ class Recording {
         int append_fd = open(target_file, O_WRONLY);
         if (append_fd >= 0) {
             lseek(append_fd, 0, SEEK_END);
-            OS::copyFile(_fd, append_fd, 0, size);
+            if (!OS::copyFile(_fd, append_fd, 0, size)) {
+                Log::warn("Failed to append JFR recording to %s: %s", target_file, strerror(errno));
+            }
             close(append_fd);
         } else {
             Log::warn("Failed to open JFR recording at %s: %s", target_file, strerror(errno));
         }
     }
 
+    // Returns the active buffer of an event slot, or NULL if the event should be dropped,
+    // since both buffers of the slot are full and the writer is still behind
     Buffer* buffer(int lock_index) {
-        return &_buf[lock_index];
+        BufferSlot* slot = &_slots[lock_index];
+        if (slot->active->offset() >= RECORDING_BUFFER_LIMIT && !submit(slot)) {
+            atomicInc(_dropped_events);
+            return NULL;
+        }
+        return slot->active;
+    }
+
+    void submitIfNeeded(int lock_index) {
+        BufferSlot* slot = &_slots[lock_index];
+        if (slot->active->offset() >= RECORDING_BUFFER_LIMIT) {
+            submit(slot);
+        }
+    }
+
+    // Most events of a slot come from the same few threads; skips the thread set lookup for a repeated one
+    void addSlotThread(int lock_index, int tid) {
+        BufferSlot* slot = &_slots[lock_index];
+        if (slot->last_tid != tid) {
+            slot->last_tid = tid;
+            addThread(tid);
+        }
+    }
+
+    bool batchesAllocations() const {
+        return _alloc_batch_ticks > 0;
+    }
+
+    // Either extends the pending batch of the slot, or writes it out and starts a new one with this event
+    void batchAllocation(int lock_index, Buffer* buf, int tid, u32 call_trace_id, int event_type, AllocEvent* event) {
+        AllocBatch* batch = &_slots[lock_index].batch;
+        u64 now = TSC::ticks();
+        u64 context_id = ThreadContext::get(tid);
+
+        if (batch->samples > 0 && batch->call_trace_id == call_trace_id && batch->tid == tid &&
+            batch->class_id == event->_class_id && batch->event_type == event_type &&
+            batch->context_id == context_id && now - batch->start_time < _alloc_batch_ticks) {
+            batch->samples++;
+            batch->total_size += event->_total_size;
+            batch->end_time = now;
+            return;
+        }
+
+        flushAllocBatch(buf, batch);
+        batch->start_time = batch->end_time = now;
+        batch->context_id = context_id;
+        batch->instance_size = event->_instance_size;
+        batch->total_size = event->_total_size;
+        batch->samples = 1;
+        batch->call_trace_id = call_trace_id;
+        batch->class_id = event->_class_id;
+        batch->tid = tid;
+        batch->event_type = event_type;
+    }
+
+    // A batch of one sample is written as a regular allocation event
+    void flushAllocBatch(Buffer* buf, AllocBatch* batch) {
+        if (batch->samples == 0) {
+            return;
+        }
+
+        int start = buf->skip(1);
+        if (batch->samples == 1 && batch->event_type == BCI_ALLOC) {
+            buf->put8(T_ALLOC_IN_NEW_TLAB);
+            buf->putVar64(batch->start_time);
+            buf->putVar32(batch->tid);
+            buf->putVar32(batch->call_trace_id);
+            buf->putVar32(batch->class_id);
+            buf->putVar64(batch->instance_size);
+            buf->putVar64(batch->total_size);
+        } else if (batch->samples == 1) {
+            buf->put8(T_ALLOC_OUTSIDE_TLAB);
+            buf->putVar64(batch->start_time);
+            buf->putVar32(batch->tid);
+            buf->putVar32(batch->call_trace_id);
+            buf->putVar32(batch->class_id);
+            buf->putVar64(batch->total_size);
+        } else {
+            buf->put8(T_ALLOC_BATCH);
+            buf->putVar64(batch->start_time);
+            buf->putVar64(batch->end_time - batch->start_time);
+            buf->putVar32(batch->tid);
+            buf->putVar32(batch->call_trace_id);
+            buf->putVar32(batch->class_id);
+            buf->put8(batch->event_type == BCI_ALLOC_OUTSIDE_TLAB);
+            buf->putVar32(batch->samples);
+            buf->putVar64(batch->total_size);
+        }
+        buf->putVar64(batch->context_id);
+        buf->put8(start, buf->offset() - start);
+        batch->samples = 0;
     }
 
     bool parseAgentProperties() {
@@ -631,10 +1081,13 @@ class Recording {
     }
 
     void flush(Buffer* buf) {
+        u64 start_ticks = TSC::ticks();
         ssize_t result = write(_fd, buf->data(), buf->offset());
         if (result > 0) {
             atomicInc(_bytes_written, result);
+            Counters::add(COUNTER_JFR_BYTES, result);
         }
+        Counters::add(COUNTER_JFR_WRITE_TIME, TSC::ticks() - start_ticks);
         buf->reset();
     }
 
@@ -723,7 +1176,9 @@ class Recording {
         writeIntSetting(buf, T_ACTIVE_RECORDING, "chunksize", args._chunk_size);
         writeIntSetting(buf, T_ACTIVE_RECORDING, "chunktime", args._chunk_time);
 
-        writeBoolSetting(buf, T_EXECUTION_SAMPLE, "enabled", args._event != NULL);
+        bool offcpu = args._event != NULL && strcmp(args._event, EVENT_OFFCPU) == 0;
+        writeBoolSetting(buf, T_EXECUTION_SAMPLE, "enabled", args._event != NULL && !offcpu);
+        writeBoolSetting(buf, T_OFF_CPU, "enabled", offcpu);
         if (args._event != NULL) {
             writeIntSetting(buf, T_EXECUTION_SAMPLE, "interval", args._interval);
         }
@@ -733,6 +1188,17 @@ class Recording {
         if (args._alloc > 0) {
             writeIntSetting(buf, T_ALLOC_IN_NEW_TLAB, "alloc", args._alloc);
         }
+        writeBoolSetting(buf, T_LIVE_OBJECT, "enabled", args._live > 0);
+        writeBoolSetting(buf, T_LATENCY_HISTOGRAM, "enabled", args._latency && args._lock >= 0);
+        writeBoolSetting(buf, T_THREAD_CPU_LOAD, "enabled", args._thread_cpu);
+        writeBoolSetting(buf, T_GC_PAUSE, "enabled", args._pauses);
+        writeBoolSetting(buf, T_PROCESS_STATS, "enabled", !args.hasOption(NO_CPU_LOAD));
+        writeBoolSetting(buf, T_CPU_THROTTLING, "enabled", !args.hasOption(NO_CPU_LOAD));
+
+        writeBoolSetting(buf, T_MALLOC, "enabled", args._nativemem > 0);
+        if (args._nativemem > 0) {
+            writeIntSetting(buf, T_MALLOC, "nativemem", args._nativemem);
+        }
 
         writeBoolSetting(buf, T_MONITOR_ENTER, "enabled", args._lock > 0);
         writeBoolSetting(buf, T_THREAD_PARK, "enabled", args._lock > 0);
@@ -744,10 +1210,10 @@ class Recording {
         writeBoolSetting(buf, T_ACTIVE_RECORDING, "kernelSymbols", Symbols::haveKernelSymbols());
     }
 
-    void writeStringSetting(Buffer* buf, int category, const char* key, const char* value) {
+    void writeStringSetting(Buffer* buf, int category, const char* key, const char* value, u64 time = 0) {
         int start = buf->skip(5);
         buf->put8(T_ACTIVE_SETTING);
-        buf->putVar64(_start_ticks);
+        buf->putVar64(time != 0 ? time : _start_ticks);
         buf->putVar32(0);
         buf->putVar32(_tid);
         buf->putVar32(0);
@@ -762,10 +1228,10 @@ class Recording {
         writeStringSetting(buf, category, key, value ? "true" : "false");
     }
 
-    void writeIntSetting(Buffer* buf, int category, const char* key, long long value) {
+    void writeIntSetting(Buffer* buf, int category, const char* key, long long value, u64 time = 0) {
         char str[32];
         sprintf(str, "%lld", value);
-        writeStringSetting(buf, category, key, str);
+        writeStringSetting(buf, category, key, str, time);
     }
 
     void writeListSetting(Buffer* buf, int category, const char* key, const char* base, int offset) {
@@ -878,26 +1344,31 @@ class Recording {
         _recorded_lib_count = native_lib_count;
     }
 
-    void writeCpool(Buffer* buf) {
+    // Static pools and threads go to the last checkpoint of a chunk only
+    void writeCpool(Buffer* buf, off_t delta, bool last) {
         buf->skip(5);  // size will be patched later
         buf->putVar32(T_CPOOL);
         buf->putVar64(_start_ticks);
         buf->putVar32(0);
-        buf->putVar32(0);
+        buf->putVar64((u64)delta);  // offset of the previous checkpoint in this chunk
         buf->putVar32(1);
 
-        buf->putVar32(9);
+        buf->putVar32(last ? 10 : 5);
 
-        Lookup lookup(&_method_map, Profiler::instance()->classMap());
-        writeFrameTypes(buf);
-        writeThreadStates(buf);
-        writeThreads(buf);
-        writeStackTraces(buf, &lookup);
-        writeMethods(buf, &lookup);
-        writeClasses(buf, &lookup);
-        writePackages(buf, &lookup);
-        writeSymbols(buf, &lookup);
-        writeLogLevels(buf);
+        if (last) {
+            writeFrameTypes(buf);
+            writeThreadStates(buf);
+            writeThreads(buf);
+        }
+        writeStackTraces(buf, &_lookup);
+        writeMethods(buf, &_lookup);
+        writeClasses(buf, &_lookup);
+        writePackages(buf, &_lookup);
+        writeSymbols(buf, &_lookup);
+        if (last) {
+            writeLogLevels(buf);
+            writeSampledEvents(buf);
+        }
     }
 
     void writeFrameTypes(Buffer* buf) {
@@ -922,21 +1393,16 @@ class Recording {
         std::vector<int> threads;
         _thread_set.collect(threads);
 
-        Profiler* profiler = Profiler::instance();
-        MutexLocker ml(profiler->_thread_names_lock);
-        std::map<int, std::string>& thread_names = profiler->_thread_names;
-        std::map<int, jlong>& thread_ids = profiler->_thread_ids;
+        ThreadNames& thread_names = Profiler::instance()->_thread_names;
         char name_buf[32];
 
         buf->putVar32(T_THREAD);
         buf->putVar32(threads.size());
         for (int i = 0; i < threads.size(); i++) {
-            const char* thread_name;
+            const char* thread_name = thread_names.name(threads[i]);
             jlong thread_id;
-            std::map<int, std::string>::const_iterator it = thread_names.find(threads[i]);
-            if (it != thread_names.end()) {
-                thread_name = it->second.c_str();
-                thread_id = thread_ids[threads[i]];
+            if (thread_name != NULL) {
+                thread_id = thread_names.javaThreadId(threads[i]);
             } else {
                 sprintf(name_buf, "[tid=%d]", threads[i]);
                 thread_name = name_buf;
@@ -957,68 +1423,93 @@ class Recording {
     }
 
     void writeStackTraces(Buffer* buf, Lookup* lookup) {
+        CallTraceStorage* storage = &Profiler::instance()->_call_trace_storage;
         std::map<u32, CallTrace*> traces;
-        Profiler::instance()->_call_trace_storage.collectTraces(traces);
+        storage->collectTraces(traces);
+        std::vector<ASGCT_CallFrame> frame_buf;
+
+        for (std::map<u32, CallTrace*>::iterator it = traces.begin(); it != traces.end(); ) {
+            if (lookup->_written_traces.insert(it->first).second) {
+                ++it;
+            } else {
+                traces.erase(it++);
+            }
+        }
 
         buf->putVar32(T_STACK_TRACE);
         buf->putVar32(traces.size());
         for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
             CallTrace* trace = it->second;
+            ASGCT_CallFrame* frames = storage->frames(trace, frame_buf);
+
+            // Make room for the whole trace at once, so that frames are encoded
+            // back to back without checking the buffer limit after each one
+            int max_size = (trace->num_frames + 1) * MAX_JFR_FRAME_SIZE;
+            bool batch = max_size <= RECORDING_BUFFER_LIMIT / 2;
+            if (batch) {
+                flushIfNeeded(buf, RECORDING_BUFFER_LIMIT - max_size);
+            }
+
             buf->putVar32(it->first);
             buf->putVar32(0);  // truncated
             buf->putVar32(trace->num_frames);
             for (int i = 0; i < trace->num_frames; i++) {
-                MethodInfo* mi = lookup->resolveMethod(trace->frames[i]);
-                buf->putVar32(mi->_key);
-                if (mi->_type < FRAME_NATIVE) {
-                    jint bci = trace->frames[i].bci;
-                    FrameTypeId type = FrameType::decode(bci);
-                    bci = (bci & 0x10000) ? 0 : (bci & 0xffff);
-                    buf->putVar32(mi->getLineNumber(bci));
-                    buf->putVar32(bci);
-                    buf->put8(type);
-                } else {
-                    buf->put8(0);
-                    buf->put8(0);
-                    buf->put8(mi->_type);
+                writeFrame(buf, lookup, frames[i]);
+                if (!batch) {
+                    flushIfNeeded(buf);
                 }
-                flushIfNeeded(buf);
             }
             flushIfNeeded(buf);
         }
     }
 
-    void writeMethods(Buffer* buf, Lookup* lookup) {
-        MethodMap* method_map = lookup->_method_map;
-
-        u32 marked_count = 0;
-        for (MethodMap::const_iterator it = method_map->begin(); it != method_map->end(); ++it) {
-            if (it->second._mark) {
-                marked_count++;
-            }
+    void writeFrame(Buffer* buf, Lookup* lookup, ASGCT_CallFrame& frame) {
+        MethodInfo* mi = lookup->resolveMethod(frame);
+        buf->putVar32(mi->_key);
+        if (mi->_type < FRAME_NATIVE) {
+            jint bci = frame.bci;
+            FrameTypeId type = FrameType::decode(bci);
+            bci = (bci & 0x10000) ? 0 : (bci & 0xffff);
+            buf->putVar32(mi->getLineNumber(bci));
+            buf->putVar32(bci);
+            buf->put8(type);
+        } else {
+            buf->put8(0);
+            buf->put8(0);
+            buf->put8(mi->_type);
         }
+    }
+
+    void writeMethods(Buffer* buf, Lookup* lookup) {
+        std::vector<MethodInfo*>& methods = lookup->_chunk_methods;
 
         buf->putVar32(T_METHOD);
-        buf->putVar32(marked_count);
-        for (MethodMap::iterator it = method_map->begin(); it != method_map->end(); ++it) {
-            MethodInfo& mi = it->second;
-            if (mi._mark) {
-                mi._mark = false;
-                buf->putVar32(mi._key);
-                buf->putVar32(mi._class);
-                buf->putVar64(mi._name | _base_id);
-                buf->putVar64(mi._sig | _base_id);
-                buf->putVar32(mi._modifiers);
-                buf->putVar32(0);  // hidden
-                flushIfNeeded(buf);
-            }
+        buf->putVar32(methods.size() - lookup->_written_methods);
+        for (size_t i = lookup->_written_methods; i < methods.size(); i++) {
+            MethodInfo* mi = methods[i];
+            buf->putVar32(mi->_key);
+            buf->putVar32(mi->_class);
+            buf->putVar64(lookup->getSymbol(mi->_name) | _base_id);
+            buf->putVar64(lookup->getSymbol(mi->_sig) | _base_id);
+            buf->putVar32(mi->_modifiers);
+            buf->putVar32(0);  // hidden
+            flushIfNeeded(buf);
         }
+        lookup->_written_methods = methods.size();
     }
 
     void writeClasses(Buffer* buf, Lookup* lookup) {
         std::map<u32, const char*> classes;
         lookup->_classes->collect(classes);
 
+        for (std::map<u32, const char*>::iterator it = classes.begin(); it != classes.end(); ) {
+            if (lookup->_written_classes.insert(it->first).second) {
+                ++it;
+            } else {
+                classes.erase(it++);
+            }
+        }
+
         buf->putVar32(T_CLASS);
         buf->putVar32(classes.size());
         for (std::map<u32, const char*>::const_iterator it = classes.begin(); it != classes.end(); ++it) {
@@ -1033,29 +1524,29 @@ class Recording {
     }
 
     void writePackages(Buffer* buf, Lookup* lookup) {
-        std::map<u32, const char*> packages;
-        lookup->_packages.collect(packages);
+        std::vector<std::pair<u32, const char*> >& packages = lookup->_new_packages;
 
         buf->putVar32(T_PACKAGE);
         buf->putVar32(packages.size());
-        for (std::map<u32, const char*>::const_iterator it = packages.begin(); it != packages.end(); ++it) {
-            buf->putVar64(it->first | _base_id);
-            buf->putVar64(lookup->getSymbol(it->second) | _base_id);
+        for (size_t i = 0; i < packages.size(); i++) {
+            buf->putVar64(packages[i].first | _base_id);
+            buf->putVar64(lookup->getSymbol(packages[i].second) | _base_id);
             flushIfNeeded(buf);
         }
+        packages.clear();
     }
 
     void writeSymbols(Buffer* buf, Lookup* lookup) {
-        std::map<u32, const char*> symbols;
-        lookup->_symbols.collect(symbols);
+        std::vector<std::pair<u32, const char*> >& symbols = lookup->_new_symbols;
 
         buf->putVar32(T_SYMBOL);
         buf->putVar32(symbols.size());
-        for (std::map<u32, const char*>::const_iterator it = symbols.begin(); it != symbols.end(); ++it) {
-            buf->putVar64(it->first | _base_id);
-            buf->putUtf8(it->second);
+        for (size_t i = 0; i < symbols.size(); i++) {
+            buf->putVar64(symbols[i].first | _base_id);
+            buf->putUtf8(symbols[i].second);
             flushIfNeeded(buf);
         }
+        symbols.clear();
     }
 
     void writeLogLevels(Buffer* buf) {
@@ -1067,13 +1558,29 @@ class Recording {
         }
     }
 
+    // Names for the event field of ExecutionSample: all perf events of a multi-event session,
+    // otherwise the only sampled event
+    void writeSampledEvents(Buffer* buf) {
+        int count = Profiler::instance()->_add_event_frame ? PerfEvents::eventCount() : 1;
+        buf->putVar32(T_SAMPLED_EVENT);
+        buf->putVar32(count);
+        for (int i = 0; i < count; i++) {
+            buf->putVar32(i);
+            buf->putUtf8(count > 1 ? PerfEvents::eventName(i) : _event_name.c_str());
+        }
+    }
+
     void recordExecutionSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event) {
         int start = buf->skip(1);
         buf->put8(T_EXECUTION_SAMPLE);
-        buf->putVar64(TSC::ticks());
+        buf->putVar64(event->_time != 0 ? event->_time : TSC::ticks());
         buf->putVar32(tid);
         buf->putVar32(call_trace_id);
         buf->putVar32(event->_thread_state);
+        buf->putVar32(event->_event_index);
+        buf->putVar64(ThreadContext::get(tid));
+        buf->putVar32(event->_cpu);
+        buf->putVar32(OS::getNumaNode(event->_cpu));
         buf->put8(start, buf->offset() - start);
     }
 
@@ -1086,6 +1593,7 @@ class Recording {
         buf->putVar32(event->_class_id);
         buf->putVar64(event->_instance_size);
         buf->putVar64(event->_total_size);
+        buf->putVar64(ThreadContext::get(tid));
         buf->put8(start, buf->offset() - start);
     }
 
@@ -1097,6 +1605,64 @@ class Recording {
         buf->putVar32(call_trace_id);
         buf->putVar32(event->_class_id);
         buf->putVar64(event->_total_size);
+        buf->putVar64(ThreadContext::get(tid));
+        buf->put8(start, buf->offset() - start);
+    }
+
+    void recordLiveObject(Buffer* buf, int tid, u32 call_trace_id, LiveObjectEvent* event) {
+        int start = buf->skip(1);
+        buf->put8(T_LIVE_OBJECT);
+        buf->putVar64(TSC::ticks());
+        buf->putVar32(tid);
+        buf->putVar32(call_trace_id);
+        buf->putVar32(event->_class_id);
+        buf->putVar64(event->_alloc_size);
+        buf->putVar64(event->_alloc_time);
+        buf->put8(start, buf->offset() - start);
+    }
+
+    void recordLatencyHistogram(Buffer* buf, int tid, u32 call_trace_id, LatencyEvent* event) {
+        int start = buf->skip(1);
+        buf->put8(T_LATENCY_HISTOGRAM);
+        buf->putVar64(TSC::ticks());
+        buf->putVar32(tid);
+        buf->putVar32(call_trace_id);
+        buf->putVar64(event->_count);
+        buf->putVar64(event->_p50);
+        buf->putVar64(event->_p90);
+        buf->putVar64(event->_p99);
+        buf->putVar64(event->_p999);
+        buf->putVar64(event->_max);
+        buf->put8(start, buf->offset() - start);
+    }
+
+    void recordMalloc(Buffer* buf, int tid, u32 call_trace_id, MallocEvent* event) {
+        int start = buf->skip(1);
+        buf->put8(T_MALLOC);
+        buf->putVar64(TSC::ticks());
+        buf->putVar32(tid);
+        buf->putVar32(call_trace_id);
+        buf->putVar64(event->_address);
+        buf->putVar64(event->_size);
+        buf->put8(start, buf->offset() - start);
+    }
+
+    void recordOffCpuSample(Buffer* buf, int tid, u32 call_trace_id, OffCpuEvent* event) {
+        int start = buf->skip(1);
+        buf->put8(T_OFF_CPU);
+        buf->putVar64(event->_start_time);
+        buf->putVar64(event->_end_time - event->_start_time);
+        buf->putVar32(tid);
+        buf->putVar32(call_trace_id);
+        buf->put8(start, buf->offset() - start);
+    }
+
+    void recordGCPause(Buffer* buf, int tid, GCPauseEvent* event) {
+        int start = buf->skip(1);
+        buf->put8(T_GC_PAUSE);
+        buf->putVar64(event->_start_time);
+        buf->putVar64(event->_end_time - event->_start_time);
+        buf->putVar32(tid);
         buf->put8(start, buf->offset() - start);
     }
 
@@ -1137,6 +1703,90 @@ class Recording {
         buf->put8(start, buf->offset() - start);
     }
 
+    // Counters are deltas since the previous event, memory sizes are current values
+    void recordProcessStats(Buffer* buf, ProcessStats* stats, ProcessStats* last) {
+        int start = buf->skip(1);
+        buf->put8(T_PROCESS_STATS);
+        buf->putVar64(TSC::ticks());
+        buf->putVar64(stats->rss);
+        buf->putVar64(stats->native_heap);
+        buf->putVar64(stats->voluntary_switches - last->voluntary_switches);
+        buf->putVar64(stats->involuntary_switches - last->involuntary_switches);
+        buf->putVar64(stats->minor_faults - last->minor_faults);
+        buf->putVar64(stats->major_faults - last->major_faults);
+        buf->put8(start, buf->offset() - start);
+    }
+
+    // Throttling counters are deltas since the previous event, so that throttled intervals stand out
+    void recordCpuThrottling(Buffer* buf, CpuThrottling* throttling, CpuThrottling* last) {
+        int start = buf->skip(1);
+        buf->put8(T_CPU_THROTTLING);
+        buf->putVar64(TSC::ticks());
+        buf->putVar64(throttling->periods - last->periods);
+        buf->putVar64(throttling->throttled_periods - last->throttled_periods);
+        buf->putVar64(throttling->throttled_time - last->throttled_time);
+        buf->putFloat((float)throttling->quota);
+        buf->put8(start, buf->offset() - start);
+    }
+
+    void recordThreadCpuLoad(Buffer* buf, u64 ticks, int tid, float user) {
+        int start = buf->skip(1);
+        buf->put8(T_THREAD_CPU_LOAD);
+        buf->putVar64(ticks);
+        buf->putVar32(tid);
+        buf->putFloat(user);
+        buf->putFloat(0);
+        buf->put8(start, buf->offset() - start);
+    }
+
+    void recordOverhead(Buffer* buf) {
+        int start = buf->skip(5);
+        buf->put8(T_PROFILER_OVERHEAD);
+        buf->putVar64(TSC::ticks());
+        buf->putVar64(Counters::get(COUNTER_CPU_SAMPLE_TIME));
+        buf->putVar64(Counters::get(COUNTER_ALLOC_SAMPLE_TIME));
+        buf->putVar64(Counters::get(COUNTER_LOCK_SAMPLE_TIME));
+        buf->putVar64(Counters::get(COUNTER_OTHER_SAMPLE_TIME));
+        buf->putVar64(Counters::get(COUNTER_NATIVE_TRACE_TIME));
+        buf->putVar64(Counters::get(COUNTER_JAVA_TRACE_TIME));
+        buf->putVar64(Counters::get(COUNTER_CALL_TRACE_PUT_TIME));
+        buf->putVar64(Counters::get(COUNTER_JFR_BYTES));
+        buf->putVar64(Counters::get(COUNTER_JFR_WRITE_TIME));
+        buf->putVar64(Counters::get(COUNTER_JFR_FLUSH_TIME));
+        buf->putVar32(start, buf->offset() - start);
+    }
+
+    void recordLog(Buffer* buf, LogLevel level, const char* message, size_t len, u64 ticks) {
+        if (len > MAX_STRING_LENGTH) len = MAX_STRING_LENGTH;
+        int start = buf->skip(5);
+        buf->put8(T_LOG);
+        buf->putVar64(ticks);
+        buf->put8(level);
+        buf->putUtf8(message, len);
+        buf->putVar32(start, buf->offset() - start);
+    }
+
+    // Called by the only thread that drains the log queue
+    void recordLogs(LogRecord** records, int count) {
+        RecordingBuffer* buf = _log_buf;
+        for (int i = 0; i < count; i++) {
+            if (records[i]->level < LOG_ERROR) {
+                recordLog(buf, records[i]->level, records[i]->message, records[i]->len, records[i]->time);
+                flushIfNeeded(buf);
+            }
+        }
+        if (buf->offset() > 0) {
+            flush(buf);
+        }
+    }
+
+    void recordIntervals(Buffer* buf, long interval, long alloc, long lock) {
+        u64 now = TSC::ticks();
+        if (interval > 0) writeIntSetting(buf, T_EXECUTION_SAMPLE, "interval", interval, now);
+        if (alloc > 0) writeIntSetting(buf, T_ALLOC_IN_NEW_TLAB, "alloc", alloc, now);
+        if (lock > 0) writeIntSetting(buf, T_MONITOR_ENTER, "lock", lock, now);
+    }
+
     void addThread(int tid) {
         if (!_thread_set.accept(tid)) {
             _thread_set.add(tid);
@@ -1156,8 +1806,21 @@ Error FlightRecorder::start(Arguments& args, bool reset) {
         return Error("Flight Recorder output file is not specified");
     }
 
+    size_t filename_len = strlen(filename);
+    bool stream_output = JfrStream::isStreamUrl(filename);
+    bool compress = args._jfr_compress || (filename_len > 3 && strcmp(filename + filename_len - 3, ".gz") == 0);
+    bool ring = args._jfr_max_size > 0 || args._jfr_max_age > 0;
+
+    if (ring && (stream_output || compress)) {
+        return Error("maxsize and maxage are not supported with streaming or compressed output");
+    }
+
     char* filename_tmp = NULL;
     if (args._jfr_sync != NULL) {
+        if (stream_output || compress || ring) {
+            return Error("jfrsync is not supported with streaming, compressed or size bounded output");
+        }
+
         Error error = startMasterRecording(args);
         if (error) {
             return error;
@@ -1173,6 +1836,49 @@ Error FlightRecorder::start(Arguments& args, bool reset) {
         TSC::initialize();
     }
 
+    if (stream_output || compress) {
+        // Chunks are recorded into temporary files and then sent or compressed by JfrStream
+        int fd = JfrStream::createChunkFile();
+        if (fd == -1) {
+            return Error("Could not create JFR chunk file");
+        }
+
+        JfrStream* stream = new JfrStream();
+        int out_fd = stream_output ? -1 : open(filename, O_CREAT | O_WRONLY | (reset ? O_TRUNC : O_APPEND), 0644);
+        Error error = stream_output ? stream->start(filename, compress)
+                    : out_fd == -1 ? Error("Could not open Flight Recorder output file")
+                    : stream->start(out_fd);
+        if (error) {
+            close(fd);
+            delete stream;
+            return error;
+        }
+
+        _rec = new Recording(fd, args, stream, NULL);
+        _rec_lock.unlock();
+        return Error::OK;
+    }
+
+    if (ring) {
+        // The output file is replaced with the retained chunks on every dump;
+        // opening it here only checks that it can be written
+        int fd = JfrStream::createChunkFile();
+        if (fd == -1) {
+            return Error("Could not create JFR chunk file");
+        }
+
+        int ring_fd = open(filename, O_CREAT | O_WRONLY | (reset ? O_TRUNC : 0), 0644);
+        if (ring_fd == -1) {
+            close(fd);
+            return Error("Could not open Flight Recorder output file");
+        }
+        close(ring_fd);
+
+        _rec = new Recording(fd, args, NULL, filename);
+        _rec_lock.unlock();
+        return Error::OK;
+    }
+
     int fd = open(filename, O_CREAT | O_RDWR | (reset ? O_TRUNC : 0), 0644);
     if (fd == -1) {
         free(filename_tmp);
@@ -1184,7 +1890,7 @@ Error FlightRecorder::start(Arguments& args, bool reset) {
         free(filename_tmp);
     }
 
-    _rec = new Recording(fd, args);
+    _rec = new Recording(fd, args, NULL, NULL);
     _rec_lock.unlock();
     return Error::OK;
 }
@@ -1204,9 +1910,29 @@ void FlightRecorder::stop() {
 
 void FlightRecorder::flush() {
     if (_rec != NULL) {
+        u64 start_ticks = TSC::ticks();
         _rec_lock.lock();
         _rec->switchChunk();
         _rec_lock.unlock();
+        Counters::add(COUNTER_JFR_FLUSHES);
+        Counters::add(COUNTER_JFR_FLUSH_TIME, TSC::ticks() - start_ticks);
+    }
+}
+
+void FlightRecorder::dump() {
+    if (_rec != NULL) {
+        _rec_lock.lock();
+        _rec->switchChunk();
+        _rec->dumpRing();
+        _rec_lock.unlock();
+    }
+}
+
+void FlightRecorder::flushpoint() {
+    if (_rec != NULL) {
+        _rec_lock.lock();
+        _rec->flushpoint();
+        _rec_lock.unlock();
     }
 }
 
@@ -1217,12 +1943,25 @@ bool FlightRecorder::timerTick(u64 wall_time) {
     }
 
     _rec->cpuMonitorCycle();
+    _rec->threadCpuCycle();
+    _rec->overheadCycle();
     bool need_switch_chunk = _rec->needSwitchChunk(wall_time);
 
     _rec_lock.unlockShared();
     return need_switch_chunk;
 }
 
+// Extra timer wakeups between regular ticks when the monitor period is shorter than a second
+void FlightRecorder::monitorTick() {
+    if (!_rec_lock.tryLockShared()) {
+        return;
+    }
+
+    _rec->cpuMonitorCycle();
+
+    _rec_lock.unlockShared();
+}
+
 Error FlightRecorder::startMasterRecording(Arguments& args) {
     JNIEnv* env = VM::jni();
 
@@ -1287,25 +2026,48 @@ void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
                                  int event_type, Event* event, u64 counter) {
     if (_rec != NULL) {
         Buffer* buf = _rec->buffer(lock_index);
-        switch (event_type) {
-            case 0:
-                _rec->recordExecutionSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
-                break;
-            case BCI_ALLOC:
-                _rec->recordAllocationInNewTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
-                break;
-            case BCI_ALLOC_OUTSIDE_TLAB:
-                _rec->recordAllocationOutsideTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
-                break;
-            case BCI_LOCK:
-                _rec->recordMonitorBlocked(buf, tid, call_trace_id, (LockEvent*)event);
-                break;
-            case BCI_PARK:
-                _rec->recordThreadPark(buf, tid, call_trace_id, (LockEvent*)event);
-                break;
+        if (buf == NULL) {
+            return;
         }
-        _rec->flushIfNeeded(buf);
-        _rec->addThread(tid);
+
+        if ((event_type == BCI_ALLOC || event_type == BCI_ALLOC_OUTSIDE_TLAB) && _rec->batchesAllocations()) {
+            _rec->batchAllocation(lock_index, buf, tid, call_trace_id, event_type, (AllocEvent*)event);
+        } else {
+            switch (event_type) {
+                case 0:
+                    _rec->recordExecutionSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
+                    break;
+                case BCI_ALLOC:
+                    _rec->recordAllocationInNewTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
+                    break;
+                case BCI_ALLOC_OUTSIDE_TLAB:
+                    _rec->recordAllocationOutsideTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
+                    break;
+                case BCI_LIVE_OBJECT:
+                    _rec->recordLiveObject(buf, tid, call_trace_id, (LiveObjectEvent*)event);
+                    break;
+                case BCI_LATENCY:
+                    _rec->recordLatencyHistogram(buf, tid, call_trace_id, (LatencyEvent*)event);
+                    break;
+                case BCI_NATIVE_MALLOC:
+                    _rec->recordMalloc(buf, tid, call_trace_id, (MallocEvent*)event);
+                    break;
+                case BCI_OFF_CPU:
+                    _rec->recordOffCpuSample(buf, tid, call_trace_id, (OffCpuEvent*)event);
+                    break;
+                case BCI_GC_PAUSE:
+                    _rec->recordGCPause(buf, tid, (GCPauseEvent*)event);
+                    break;
+                case BCI_LOCK:
+                    _rec->recordMonitorBlocked(buf, tid, call_trace_id, (LockEvent*)event);
+                    break;
+                case BCI_PARK:
+                    _rec->recordThreadPark(buf, tid, call_trace_id, (LockEvent*)event);
+                    break;
+            }
+        }
+        _rec->submitIfNeeded(lock_index);
+        _rec->addSlotThread(lock_index, tid);
     }
 }
 
@@ -1318,14 +2080,44 @@ void FlightRecorder::recordLog(LogLevel level, const char* message, size_t len)
     if (len > MAX_STRING_LENGTH) len = MAX_STRING_LENGTH;
     Buffer* buf = (Buffer*)alloca(len + 40);
     buf->reset();
-
-    int start = buf->skip(5);
-    buf->put8(T_LOG);
-    buf->putVar64(TSC::ticks());
-    buf->put8(level);
-    buf->putUtf8(message, len);
-    buf->putVar32(start, buf->offset() - start);
+    _rec->recordLog(buf, level, message, len, TSC::ticks());
     _rec->flush(buf);
 
     _rec_lock.unlockShared();
 }
+
+size_t FlightRecorder::usedMemory() {
+    if (!_rec_lock.tryLockShared()) {
+        // No active recording
+        return 0;
+    }
+
+    size_t bytes = _rec->usedMemory();
+
+    _rec_lock.unlockShared();
+    return bytes;
+}
+
+void FlightRecorder::recordLogs(LogRecord** records, int count) {
+    if (!_rec_lock.tryLockShared()) {
+        // No active recording
+        return;
+    }
+
+    _rec->recordLogs(records, count);
+
+    _rec_lock.unlockShared();
+}
+
+void FlightRecorder::recordIntervals(long interval, long alloc, long lock) {
+    if (!_rec_lock.tryLockShared()) {
+        // No active recording
+        return;
+    }
+
+    Buffer buf;
+    _rec->recordIntervals(&buf, interval, alloc, lock);
+    _rec->flush(&buf);
+
+    _rec_lock.unlockShared();
+}
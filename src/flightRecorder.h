@@ -38,16 +38,25 @@ class FlightRecorder {
     Error start(Arguments& args, bool reset);
     void stop();
     void flush();
+    void dump();
+    void flushpoint();
     bool timerTick(u64 wall_time);
+    void monitorTick();
 
     bool active() const {
         return _rec != NULL;
     }
 
+    size_t usedMemory();
+
     void recordEvent(int lock_index, int tid, u32 call_trace_id,
                      int event_type, Event* event, u64 counter);
 
     void recordLog(LogLevel level, const char* message, size_t len);
+    void recordLogs(LogRecord** records, int count);
+
+    // Records intervals changed by the overhead controller; 0 means unchanged
+    void recordIntervals(long interval, long alloc, long lock);
 };
 
 #endif // _FLIGHTRECORDER_H
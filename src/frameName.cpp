@@ -14,15 +14,28 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <cxxabi.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "frameName.h"
+#include "os.h"
 #include "profiler.h"
+#include "symbols.h"
 #include "vmStructs.h"
 
 
+static const size_t NAME_POOL_CHUNK = 256 * 1024;
+
+// Java methods are resolved on worker threads only when each of them gets at least that many
+static const int METHOD_BATCH_PER_THREAD = 2000;
+static const int MAX_RESOLVE_THREADS = 8;
+// Methods claimed by a worker at a time
+static const int METHOD_BATCH_CHUNK = 64;
+
+
 static inline bool isDigit(char c) {
     return c >= '0' && c <= '9';
 }
@@ -80,13 +93,52 @@ bool Matcher::matches(const char* s) {
 }
 
 
-FrameName::FrameName(Arguments& args, int style, Mutex& thread_names_lock, ThreadMap& thread_names) :
-    _cache(),
+FrameNameCache::FrameNameCache() : _index(), _names(), _stamps(), _pool(NAME_POOL_CHUNK) {
+}
+
+const char* FrameNameCache::find(u64 key1, u64 key2, u64 stamp) const {
+    u32 index;
+    return _index.get(key1, key2, index) && _stamps[index] == stamp ? _names[index] : NULL;
+}
+
+// A stale entry is replaced: the index then points to the new name
+const char* FrameNameCache::add(u64 key1, u64 key2, u64 stamp, const char* name) {
+    size_t len = strlen(name) + 1;
+    char* copy = len <= NAME_POOL_CHUNK / 2 ? (char*)_pool.alloc(len) : NULL;
+    if (copy == NULL) {
+        return name;
+    }
+
+    memcpy(copy, name, len);
+    _index.put(key1, key2, _names.size());
+    _names.push_back(copy);
+    _stamps.push_back(stamp);
+    return copy;
+}
+
+void FrameNameCache::clear() {
+    _index.clear();
+    _names.clear();
+    _stamps.clear();
+    _pool.clear();
+}
+
+
+// A FrameName with a read-only cache of resolved names can be used by a dump worker thread:
+// it finds most names there and keeps the rest in its own cache
+FrameName::FrameName(Arguments& args, int style, ThreadNames& thread_names, const FrameNameCache* resolved) :
+    _local_cache(),
+    _name_cache(args._name_cache && resolved == NULL ? Profiler::instance()->frameNameCache() : &_local_cache),
+    _resolved(resolved),
+    _cache_hits(0),
+    _cache_misses(0),
     _class_names(),
     _include(),
     _exclude(),
+    _filter_cache(),
+    _collected(),
+    _collected_keys(),
     _style(style),
-    _thread_names_lock(thread_names_lock),
     _thread_names(thread_names)
 {
     // Require printf to use standard C format regardless of system locale
@@ -99,8 +151,23 @@ FrameName::FrameName(Arguments& args, int style, Mutex& thread_names_lock, Threa
     Profiler::instance()->classMap()->collect(_class_names);
 }
 
+// The Method a jmethodID points to; native symbols and addresses are stable, they need no stamp.
+// Without VMStructs, a reused jmethodID cannot be told apart
+u64 FrameName::cacheStamp(const ASGCT_CallFrame& frame) {
+    if (frame.bci == BCI_NATIVE_FRAME || frame.bci == BCI_ADDRESS || !VMStructs::hasMethodStructs()) {
+        return 0;
+    }
+    return (u64)(uintptr_t)VMMethod::fromMethodID(frame.method_id);
+}
+
 FrameName::~FrameName() {
     freelocale(uselocale(_saved_locale));
+
+    u64 lookups = _cache_hits + _cache_misses;
+    if (lookups > 0) {
+        Log::debug("Frame name cache: %llu lookups, %.1f%% hits, %d names",
+                   (unsigned long long)lookups, _cache_hits * 100.0 / lookups, (int)_name_cache->size());
+    }
 }
 
 void FrameName::buildFilter(std::vector<Matcher>& vector, const char* base, int offset) {
@@ -152,38 +219,31 @@ const char* FrameName::typeSuffix(FrameTypeId type) {
     return NULL;
 }
 
-char* FrameName::javaMethodName(jmethodID method) {
-    jclass method_class;
-    char* class_name = NULL;
-    char* method_name = NULL;
-    char* method_sig = NULL;
-    char* result;
-
-    jvmtiEnv* jvmti = VM::jvmti();
-    jvmtiError err;
-
-    if ((err = jvmti->GetMethodName(method, &method_name, &method_sig, NULL)) == 0 &&
-        (err = jvmti->GetMethodDeclaringClass(method, &method_class)) == 0 &&
-        (err = jvmti->GetClassSignature(method_class, &class_name, NULL)) == 0) {
-        // Trim 'L' and ';' off the class descriptor like 'Ljava/lang/Object;'
-        result = javaClassName(class_name + 1, strlen(class_name) - 2, _style);
-        strcat(result, ".");
-        strcat(result, method_name);
-        if (_style & STYLE_SIGNATURES) strcat(result, truncate(method_sig, 255));
-    } else {
-        snprintf(_buf, sizeof(_buf) - 1, "[jvmtiError %d]", err);
-        result = _buf;
+char* FrameName::javaMethodName(jmethodID method, char* buf) {
+    ResolvedMethod resolved;
+    jvmtiError err = Profiler::instance()->methodTable()->resolve(method, resolved);
+    if (err != 0) {
+        snprintf(buf, NAME_BUF_SIZE - 1, "[jvmtiError %d]", err);
+        return buf;
     }
 
-    jvmti->Deallocate((unsigned char*)class_name);
-    jvmti->Deallocate((unsigned char*)method_sig);
-    jvmti->Deallocate((unsigned char*)method_name);
-
+    char* result = javaClassName(resolved.class_name, strlen(resolved.class_name), _style, buf);
+    strcat(result, ".");
+    strcat(result, resolved.name);
+    if (_style & STYLE_SIGNATURES) {
+        // The signature is shared, so at most 255 characters of it are copied, like truncate() does
+        if (strlen(resolved.sig) > 255) {
+            strncat(result, resolved.sig, 251);
+            strcat(result, "...)");
+        } else {
+            strcat(result, resolved.sig);
+        }
+    }
     return result;
 }
 
-char* FrameName::javaClassName(const char* symbol, int length, int style) {
-    char* result = _buf;
+char* FrameName::javaClassName(const char* symbol, int length, int style, char* buf) {
+    char* result = buf;
 
     int array_dimension = 0;
     while (*symbol == '[') {
@@ -230,6 +290,13 @@ char* FrameName::javaClassName(const char* symbol, int length, int style) {
     return result;
 }
 
+// Does not touch the shared buffer, so that Java names can be resolved on several threads
+const char* FrameName::javaFrameName(const ASGCT_CallFrame& frame, char* buf) {
+    const char* type_suffix = typeSuffix(FrameType::decode(frame.bci));
+    char* name = javaMethodName(frame.method_id, buf);
+    return type_suffix != NULL ? strcat(name, type_suffix) : name;
+}
+
 const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
     if (frame.method_id == NULL) {
         return "[unknown]";
@@ -237,14 +304,15 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
 
     switch (frame.bci) {
         case BCI_NATIVE_FRAME:
-            return decodeNativeSymbol((const char*)frame.method_id);
+        case BCI_ADDRESS:
+            break;
 
         case BCI_ALLOC:
         case BCI_ALLOC_OUTSIDE_TLAB:
         case BCI_LOCK:
         case BCI_PARK: {
             const char* symbol = _class_names[(uintptr_t)frame.method_id];
-            char* class_name = javaClassName(symbol, strlen(symbol), _style | STYLE_DOTTED);
+            char* class_name = javaClassName(symbol, strlen(symbol), _style | STYLE_DOTTED, _buf);
             if (!for_matching && !(_style & STYLE_DOTTED)) {
                 strcat(class_name, frame.bci == BCI_ALLOC_OUTSIDE_TLAB ? "_[k]" : "_[i]");
             }
@@ -253,12 +321,11 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
 
         case BCI_THREAD_ID: {
             int tid = (int)(uintptr_t)frame.method_id;
-            MutexLocker ml(_thread_names_lock);
-            ThreadMap::iterator it = _thread_names.find(tid);
+            const char* thread_name = _thread_names.name(tid);
             if (for_matching) {
-                return it != _thread_names.end() ? it->second.c_str() : "";
-            } else if (it != _thread_names.end()) {
-                snprintf(_buf, sizeof(_buf) - 1, "[%s tid=%d]", it->second.c_str(), tid);
+                return thread_name != NULL ? thread_name : "";
+            } else if (thread_name != NULL) {
+                snprintf(_buf, sizeof(_buf) - 1, "[%s tid=%d]", thread_name, tid);
             } else {
                 snprintf(_buf, sizeof(_buf) - 1, "[tid=%d]", tid);
             }
@@ -270,21 +337,170 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
             return _buf;
         }
 
-        default: {
-            const char* type_suffix = typeSuffix(FrameType::decode(frame.bci));
+        default:
+            break;
+    }
 
-            JMethodCache::iterator it = _cache.lower_bound(frame.method_id);
-            if (it != _cache.end() && it->first == frame.method_id) {
-                if (type_suffix != NULL) {
-                    snprintf(_buf, sizeof(_buf) - 1, "%s%s", it->second.c_str(), type_suffix);
-                    return _buf;
-                }
-                return it->second.c_str();
-            }
+    // Java and native names are the expensive ones: they take JVMTI calls or demangling
+    u64 key1 = (u64)(uintptr_t)frame.method_id;
+    u64 key2 = cacheKey(frame);
+    u64 stamp = cacheStamp(frame);
+    const char* name = _resolved != NULL ? _resolved->find(key1, key2, stamp) : NULL;
+    if (name == NULL) {
+        name = _name_cache->find(key1, key2, stamp);
+    }
+    if (name != NULL) {
+        _cache_hits++;
+        return name;
+    }
+    _cache_misses++;
+
+    if (frame.bci == BCI_NATIVE_FRAME) {
+        name = decodeNativeSymbol((const char*)frame.method_id);
+    } else if (frame.bci == BCI_ADDRESS) {
+        const char* symbol = Profiler::instance()->resolveNativeMethod((const void*)frame.method_id);
+        name = symbol != NULL ? decodeNativeSymbol(symbol) : "[unknown]";
+    } else {
+        name = javaFrameName(frame, _buf);
+    }
+    return _name_cache->add(key1, key2, stamp, name);
+}
+
+// Remembers Java and raw address frames whose names are not cached yet, each distinct frame once
+void FrameName::collect(const ASGCT_CallFrame* frames, int num_frames) {
+    for (int i = 0; i < num_frames; i++) {
+        const ASGCT_CallFrame& frame = frames[i];
+        if (frame.method_id == NULL || (frame.bci <= BCI_NATIVE_FRAME && frame.bci != BCI_ADDRESS)) {
+            continue;
+        }
+
+        u64 key1 = (u64)(uintptr_t)frame.method_id;
+        u64 key2 = cacheKey(frame);
+        u32 index;
+        if (!_collected_keys.get(key1, key2, index) && _name_cache->find(key1, key2, cacheStamp(frame)) == NULL) {
+            _collected_keys.put(key1, key2, _collected.size());
+            _collected.push_back(frame);
+        }
+    }
+}
+
+// Resolves names of all collected frames at once, so that the writers find them in the cache.
+// Raw addresses are sorted and resolved with a single merge pass over the symbols of each library.
+// Java names take several JVMTI calls each; large batches of them are resolved on worker threads
+void FrameName::resolveCollected() {
+    std::vector<const void*> addresses;
+    std::vector<ASGCT_CallFrame> methods;
+    for (size_t i = 0; i < _collected.size(); i++) {
+        if (_collected[i].bci == BCI_ADDRESS) {
+            addresses.push_back((const void*)_collected[i].method_id);
+        } else {
+            methods.push_back(_collected[i]);
+        }
+    }
+    _collected.clear();
+    _collected_keys.clear();
+
+    resolveAddresses(addresses);
+    resolveMethods(methods);
+}
+
+void FrameName::resolveAddresses(std::vector<const void*>& addresses) {
+    std::sort(addresses.begin(), addresses.end());
+
+    Profiler* profiler = Profiler::instance();
+    size_t count = addresses.size();
+    std::vector<const char*> symbols(count);
+    for (size_t i = 0; i < count; ) {
+        CodeCache* lib = profiler->findNativeLibrary(addresses[i]);
+        if (lib == NULL) {
+            symbols[i++] = NULL;
+            continue;
+        }
+        if (!lib->symbolsLoaded()) {
+            Symbols::loadSymbols(lib);
+        }
+
+        size_t end = i + 1;
+        while (end < count && lib->contains(addresses[end])) {
+            end++;
+        }
+        lib->resolveSorted(&addresses[i], (int)(end - i), &symbols[i]);
+        i = end;
+    }
+
+    u64 key2 = (u64)(u32)_style << 32 | (u32)BCI_ADDRESS;
+    for (size_t i = 0; i < count; i++) {
+        const char* name = symbols[i] != NULL ? decodeNativeSymbol(symbols[i]) : "[unknown]";
+        _name_cache->add((u64)(uintptr_t)addresses[i], key2, 0, name);
+    }
+}
+
+struct MethodBatch {
+    FrameName* frame_name;
+    const ASGCT_CallFrame* frames;
+    char** names;
+    int count;
+    volatile int next;
+};
+
+void* FrameName::resolveMethodsThread(void* arg) {
+    MethodBatch* batch = (MethodBatch*)arg;
+    JNIEnv* jni = VM::attachThread("Async-profiler Symbolizer");
+    if (jni == NULL) {
+        // Names left unresolved are looked up later one by one
+        return NULL;
+    }
 
-            char* newName = javaMethodName(frame.method_id);
-            _cache.insert(it, JMethodCache::value_type(frame.method_id, newName));
-            return type_suffix != NULL ? strcat(newName, type_suffix) : newName;
+    char buf[NAME_BUF_SIZE];
+    int start;
+    while ((start = __sync_fetch_and_add(&batch->next, METHOD_BATCH_CHUNK)) < batch->count) {
+        int end = start + METHOD_BATCH_CHUNK < batch->count ? start + METHOD_BATCH_CHUNK : batch->count;
+        // GetMethodDeclaringClass creates a local reference for every method
+        jni->PushLocalFrame(64);
+        for (int i = start; i < end; i++) {
+            batch->names[i] = strdup(batch->frame_name->javaFrameName(batch->frames[i], buf));
+        }
+        jni->PopLocalFrame(NULL);
+    }
+
+    VM::detachThread();
+    return NULL;
+}
+
+void FrameName::resolveMethods(std::vector<ASGCT_CallFrame>& methods) {
+    int count = (int)methods.size();
+    int threads = count / METHOD_BATCH_PER_THREAD;
+    int cpus = OS::getCpuCount();
+    if (threads > cpus) threads = cpus;
+    if (threads > MAX_RESOLVE_THREADS) threads = MAX_RESOLVE_THREADS;
+
+    if (threads < 2) {
+        // Not worth starting threads
+        for (int i = 0; i < count; i++) {
+            _name_cache->add((u64)(uintptr_t)methods[i].method_id, cacheKey(methods[i]), cacheStamp(methods[i]),
+                             javaFrameName(methods[i], _buf));
+        }
+        return;
+    }
+
+    std::vector<char*> names(count);
+    MethodBatch batch = {this, &methods[0], &names[0], count, 0};
+
+    pthread_t thread_ids[MAX_RESOLVE_THREADS];
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&thread_ids[started], NULL, resolveMethodsThread, &batch) == 0) {
+            started++;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (names[i] != NULL) {
+            _name_cache->add((u64)(uintptr_t)methods[i].method_id, cacheKey(methods[i]), cacheStamp(methods[i]), names[i]);
+            free(names[i]);
         }
     }
 }
@@ -307,3 +523,19 @@ bool FrameName::exclude(const char* frame_name) {
     return false;
 }
 
+// Returns FilterResult bits for the frame. All patterns are matched once per distinct frame:
+// the result is cached under the same key as the frame name, which it depends on
+int FrameName::filter(ASGCT_CallFrame& frame) {
+    u64 key1 = (u64)(uintptr_t)frame.method_id;
+    u64 key2 = cacheKey(frame);
+    u32 result;
+    if (_filter_cache.get(key1, key2, result)) {
+        return result;
+    }
+
+    const char* frame_name = name(frame, true);
+    result = (include(frame_name) ? FILTER_INCLUDE : 0) | (exclude(frame_name) ? FILTER_EXCLUDE : 0);
+    _filter_cache.put(key1, key2, result);
+    return result;
+}
+
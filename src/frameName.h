@@ -23,7 +23,9 @@
 #include <vector>
 #include <string>
 #include "arguments.h"
-#include "mutex.h"
+#include "linearAllocator.h"
+#include "pairMap.h"
+#include "threadNames.h"
 #include "vmEntry.h"
 
 #ifdef __APPLE__
@@ -31,10 +33,17 @@
 #endif
 
 
-typedef std::map<jmethodID, std::string> JMethodCache;
-typedef std::map<int, std::string> ThreadMap;
 typedef std::map<unsigned int, const char*> ClassMap;
 
+// Must be large enough for class name + method name + method signature
+const size_t NAME_BUF_SIZE = 800;
+
+
+enum FilterResult {
+  FILTER_INCLUDE = 1,
+  FILTER_EXCLUDE = 2
+};
+
 
 enum MatchType {
   MATCH_EQUALS,
@@ -61,36 +70,87 @@ class Matcher {
 };
 
 
+// Formatted names of Java and native frames keyed by (method_id, frame kind, style).
+// Strings live in an arena until clear(). Can be shared by subsequent dumps,
+// because neither jmethodIDs nor native symbol names depend on the dictionaries reset by start.
+// A jmethodID of an unloaded class may be reused by another method, so every name is stored
+// with a stamp of what the key referred to, and a hit counts only if the stamp is the same
+class FrameNameCache {
+  private:
+    PairMap _index;
+    std::vector<const char*> _names;
+    std::vector<u64> _stamps;
+    LinearAllocator _pool;
+
+  public:
+    FrameNameCache();
+
+    const char* find(u64 key1, u64 key2, u64 stamp) const;
+    const char* add(u64 key1, u64 key2, u64 stamp, const char* name);
+    void clear();
+
+    size_t size() const {
+        return _names.size();
+    }
+};
+
+
 class FrameName {
   private:
-    JMethodCache _cache;
+    FrameNameCache _local_cache;
+    FrameNameCache* _name_cache;
+    const FrameNameCache* _resolved;
+    u64 _cache_hits;
+    u64 _cache_misses;
     ClassMap _class_names;
     std::vector<Matcher> _include;
     std::vector<Matcher> _exclude;
-    char _buf[800];  // must be large enough for class name + method name + method signature
+    PairMap _filter_cache;
+    std::vector<ASGCT_CallFrame> _collected;
+    PairMap _collected_keys;
+    char _buf[NAME_BUF_SIZE];
     int _style;
-    Mutex& _thread_names_lock;
-    ThreadMap& _thread_names;
+    ThreadNames& _thread_names;
     locale_t _saved_locale;
 
     void buildFilter(std::vector<Matcher>& vector, const char* base, int offset);
     char* truncate(char* name, int max_length);
     const char* decodeNativeSymbol(const char* name);
     const char* typeSuffix(FrameTypeId type);
-    char* javaMethodName(jmethodID method);
-    char* javaClassName(const char* symbol, int length, int style);
+    char* javaMethodName(jmethodID method, char* buf);
+    char* javaClassName(const char* symbol, int length, int style, char* buf);
+    const char* javaFrameName(const ASGCT_CallFrame& frame, char* buf);
+
+    u64 cacheKey(const ASGCT_CallFrame& frame) const {
+        return (u64)(u32)_style << 32 | (u32)(frame.bci < 0 ? frame.bci : FrameType::decode(frame.bci));
+    }
+
+    static u64 cacheStamp(const ASGCT_CallFrame& frame);
+
+    void resolveAddresses(std::vector<const void*>& addresses);
+    void resolveMethods(std::vector<ASGCT_CallFrame>& methods);
+    static void* resolveMethodsThread(void* arg);
 
   public:
-    FrameName(Arguments& args, int style, Mutex& thread_names_lock, ThreadMap& thread_names);
+    FrameName(Arguments& args, int style, ThreadNames& thread_names, const FrameNameCache* resolved = NULL);
     ~FrameName();
 
+    // Names resolved so far; other FrameName instances may look them up concurrently
+    // as long as this one does not add new names
+    const FrameNameCache* cache() const {
+        return _name_cache;
+    }
+
     const char* name(ASGCT_CallFrame& frame, bool for_matching = false);
+    void collect(const ASGCT_CallFrame* frames, int num_frames);
+    void resolveCollected();
 
     bool hasIncludeList() { return !_include.empty(); }
     bool hasExcludeList() { return !_exclude.empty(); }
 
     bool include(const char* frame_name);
     bool exclude(const char* frame_name);
+    int filter(ASGCT_CallFrame& frame);
 };
 
 #endif // _FRAMENAME_H
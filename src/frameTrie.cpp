@@ -0,0 +1,257 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "frameTrie.h"
+#include "os.h"
+
+
+static const u32 INITIAL_INDEX_CAPACITY = 65536;
+
+// How many times to wait for a concurrent writer to publish a node
+// before giving up and creating a duplicate node
+static const int PUBLISH_SPIN_LIMIT = 1000;
+
+
+// Hash table from (parent, frame) to node id. Grows the same way as LongHashTable:
+// a new generation is allocated when the load factor exceeds 0.75
+class TrieIndex {
+  private:
+    TrieIndex* _prev;
+    u32 _capacity;
+    volatile u32 _size;
+
+    static size_t getSize(u32 capacity) {
+        size_t size = sizeof(TrieIndex) + (sizeof(u64) + sizeof(u32)) * capacity;
+        return (size + OS::page_mask) & ~OS::page_mask;
+    }
+
+  public:
+    static TrieIndex* allocate(TrieIndex* prev, u32 capacity) {
+        TrieIndex* index = (TrieIndex*)OS::safeAlloc(getSize(capacity));
+        if (index != NULL) {
+            index->_prev = prev;
+            index->_capacity = capacity;
+            index->_size = 0;
+        }
+        return index;
+    }
+
+    TrieIndex* destroy() {
+        TrieIndex* prev = _prev;
+        OS::safeFree(this, getSize(_capacity));
+        return prev;
+    }
+
+    TrieIndex* prev() {
+        return _prev;
+    }
+
+    u32 capacity() {
+        return _capacity;
+    }
+
+    u32 incSize() {
+        return __sync_add_and_fetch(&_size, 1);
+    }
+
+    size_t usedMemory() {
+        return getSize(_capacity);
+    }
+
+    u64* keys() {
+        return (u64*)(this + 1);
+    }
+
+    u32* values() {
+        return (u32*)(keys() + _capacity);
+    }
+
+    void clear() {
+        memset(keys(), 0, (sizeof(u64) + sizeof(u32)) * _capacity);
+        _size = 0;
+    }
+};
+
+
+static u64 hashNode(u32 parent, const ASGCT_CallFrame& frame) {
+    const u64 M = 0xc6a4a7935bd1e995ULL;
+    u64 h = ((u64)parent << 32 | (u32)frame.bci) * M;
+    h ^= (u64)(uintptr_t)frame.method_id;
+    h *= M;
+    h ^= h >> 47;
+    // Zero key denotes an empty slot
+    return h != 0 ? h : 1;
+}
+
+
+FrameTrie::FrameTrie() : _node_count(1), _index(NULL) {
+    memset((void*)_chunks, 0, sizeof(_chunks));
+}
+
+FrameTrie::~FrameTrie() {
+    clear();
+    if (_index != NULL) {
+        _index->destroy();
+    }
+}
+
+void FrameTrie::clear() {
+    for (u32 i = 0; i < MAX_TRIE_CHUNKS; i++) {
+        if (_chunks[i] != NULL) {
+            OS::safeFree(_chunks[i], TRIE_CHUNK_SIZE * sizeof(TrieNode));
+            _chunks[i] = NULL;
+        }
+    }
+    _node_count = 1;
+
+    if (_index != NULL) {
+        while (_index->prev() != NULL) {
+            _index = _index->destroy();
+        }
+        _index->clear();
+    }
+}
+
+size_t FrameTrie::usedMemory() {
+    size_t bytes = 0;
+    for (u32 i = 0; i < MAX_TRIE_CHUNKS; i++) {
+        if (_chunks[i] != NULL) {
+            bytes += TRIE_CHUNK_SIZE * sizeof(TrieNode);
+        }
+    }
+    for (TrieIndex* index = _index; index != NULL; index = index->prev()) {
+        bytes += index->usedMemory();
+    }
+    return bytes;
+}
+
+u32 FrameTrie::newNode(u32 parent, const ASGCT_CallFrame& frame) {
+    u32 id = __sync_fetch_and_add(&_node_count, 1);
+    u32 chunk = id >> TRIE_CHUNK_BITS;
+    if (chunk >= MAX_TRIE_CHUNKS) {
+        return 0;
+    }
+
+    if (_chunks[chunk] == NULL) {
+        TrieNode* nodes = (TrieNode*)OS::safeAlloc(TRIE_CHUNK_SIZE * sizeof(TrieNode));
+        if (nodes == NULL) {
+            return 0;
+        }
+        if (!__sync_bool_compare_and_swap(&_chunks[chunk], NULL, nodes)) {
+            OS::safeFree(nodes, TRIE_CHUNK_SIZE * sizeof(TrieNode));
+        }
+    }
+
+    TrieNode* n = node(id);
+    n->parent = parent;
+    n->frame = frame;
+    return id;
+}
+
+bool FrameTrie::matches(u32 id, u32 parent, const ASGCT_CallFrame& frame) {
+    TrieNode* n = node(id);
+    return n->parent == parent && n->frame.bci == frame.bci && n->frame.method_id == frame.method_id;
+}
+
+u32 FrameTrie::findNode(TrieIndex* index, u64 hash, u32 parent, const ASGCT_CallFrame& frame) {
+    u64* keys = index->keys();
+    u32* values = index->values();
+    u32 capacity = index->capacity();
+    u32 slot = hash & (capacity - 1);
+    u32 step = 0;
+
+    while (keys[slot] != 0) {
+        if (keys[slot] == hash) {
+            u32 id = loadAcquire(values[slot]);
+            if (id != 0 && matches(id, parent, frame)) {
+                return id;
+            }
+        }
+        if (++step >= capacity) {
+            break;
+        }
+        slot = (slot + step) & (capacity - 1);
+    }
+    return 0;
+}
+
+u32 FrameTrie::put(u32 parent, const ASGCT_CallFrame& frame) {
+    TrieIndex* index = _index;
+    if (index == NULL) {
+        index = TrieIndex::allocate(NULL, INITIAL_INDEX_CAPACITY);
+        if (index == NULL) {
+            return 0;
+        }
+        if (!__sync_bool_compare_and_swap(&_index, NULL, index)) {
+            index->destroy();
+            index = _index;
+        }
+    }
+
+    u64 hash = hashNode(parent, frame);
+    u64* keys = index->keys();
+    u32* values = index->values();
+    u32 capacity = index->capacity();
+    u32 slot = hash & (capacity - 1);
+    u32 step = 0;
+
+    while (true) {
+        u64 key = keys[slot];
+        if (key == hash) {
+            u32 id;
+            for (int spin = 0; (id = loadAcquire(values[slot])) == 0; spin++) {
+                if (spin >= PUBLISH_SPIN_LIMIT) {
+                    // The writer may have been interrupted by this very signal handler
+                    return newNode(parent, frame);
+                }
+                spinPause();
+            }
+            if (matches(id, parent, frame)) {
+                return id;
+            }
+        } else if (key == 0) {
+            if (!__sync_bool_compare_and_swap(&keys[slot], 0, hash)) {
+                continue;
+            }
+
+            if (index->incSize() == capacity * 3 / 4) {
+                TrieIndex* new_index = TrieIndex::allocate(index, capacity * 2);
+                if (new_index != NULL) {
+                    __sync_bool_compare_and_swap(&_index, index, new_index);
+                }
+            }
+
+            // Reuse the node from a previous generation of the index
+            u32 id = 0;
+            for (TrieIndex* prev = index->prev(); prev != NULL && id == 0; prev = prev->prev()) {
+                id = findNode(prev, hash, parent, frame);
+            }
+            if (id == 0) {
+                id = newNode(parent, frame);
+            }
+            storeRelease(values[slot], id);
+            return id;
+        }
+
+        if (++step >= capacity) {
+            // Index overflow: the node still can be created, it just won't be shared
+            return newNode(parent, frame);
+        }
+        slot = (slot + step) & (capacity - 1);
+    }
+}
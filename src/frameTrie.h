@@ -0,0 +1,75 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FRAMETRIE_H
+#define _FRAMETRIE_H
+
+#include <stddef.h>
+#include "arch.h"
+#include "vmEntry.h"
+
+
+const int TRIE_CHUNK_BITS = 16;
+const u32 TRIE_CHUNK_SIZE = 1 << TRIE_CHUNK_BITS;
+const u32 MAX_TRIE_CHUNKS = 1024;
+
+// Node 0 is the root of the trie; it has no frame
+struct TrieNode {
+    u32 parent;
+    ASGCT_CallFrame frame;
+};
+
+class TrieIndex;
+
+// Append-only prefix tree of stack frames, walking from the root (the outermost frame).
+// Every distinct (parent, frame) pair is stored once, so call traces sharing
+// a common prefix share the nodes. All operations except clear() are signal safe.
+class FrameTrie {
+  private:
+    TrieNode* volatile _chunks[MAX_TRIE_CHUNKS];
+    volatile u32 _node_count;
+    TrieIndex* volatile _index;
+
+    u32 newNode(u32 parent, const ASGCT_CallFrame& frame);
+    u32 findNode(TrieIndex* index, u64 hash, u32 parent, const ASGCT_CallFrame& frame);
+    bool matches(u32 id, u32 parent, const ASGCT_CallFrame& frame);
+
+  public:
+    FrameTrie();
+    ~FrameTrie();
+
+    void clear();
+
+    // Returns id of the node for the given frame under the parent node, or 0 if out of memory
+    u32 put(u32 parent, const ASGCT_CallFrame& frame);
+
+    TrieNode* node(u32 id) {
+        return &_chunks[id >> TRIE_CHUNK_BITS][id & (TRIE_CHUNK_SIZE - 1)];
+    }
+
+    // False for ids that were handed out when the node pool could not grow
+    bool contains(u32 id) {
+        return id < TRIE_CHUNK_SIZE * MAX_TRIE_CHUNKS && _chunks[id >> TRIE_CHUNK_BITS] != NULL;
+    }
+
+    u32 nodeCount() {
+        return _node_count - 1;
+    }
+
+    size_t usedMemory();
+};
+
+#endif // _FRAMETRIE_H
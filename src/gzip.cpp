@@ -0,0 +1,58 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dlfcn.h>
+#include "gzip.h"
+#include "log.h"
+
+
+#ifdef __APPLE__
+static const char ZLIB_NAME[] = "libz.1.dylib";
+#else
+static const char ZLIB_NAME[] = "libz.so.1";
+#endif
+
+DeflateInit2Func Gzip::_deflateInit2 = NULL;
+DeflateFunc Gzip::_deflate = NULL;
+DeflateEndFunc Gzip::_deflateEnd = NULL;
+
+
+// Concurrent loads are harmless: they resolve the same functions
+bool Gzip::load() {
+    if (__atomic_load_n(&_deflateEnd, __ATOMIC_ACQUIRE) != NULL) {
+        return true;
+    }
+
+    void* lib = dlopen(ZLIB_NAME, RTLD_LAZY);
+    if (lib == NULL) {
+        Log::warn("Could not load %s: %s", ZLIB_NAME, dlerror());
+        return false;
+    }
+
+    DeflateInit2Func deflate_init2 = (DeflateInit2Func)dlsym(lib, "deflateInit2_");
+    DeflateFunc deflate = (DeflateFunc)dlsym(lib, "deflate");
+    DeflateEndFunc deflate_end = (DeflateEndFunc)dlsym(lib, "deflateEnd");
+    if (deflate_init2 == NULL || deflate == NULL || deflate_end == NULL) {
+        Log::warn("Could not find deflate functions in %s", ZLIB_NAME);
+        dlclose(lib);
+        return false;
+    }
+
+    _deflateInit2 = deflate_init2;
+    _deflate = deflate;
+    __atomic_store_n(&_deflateEnd, deflate_end, __ATOMIC_RELEASE);
+    return true;
+}
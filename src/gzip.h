@@ -0,0 +1,53 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GZIP_H
+#define _GZIP_H
+
+#include <zlib.h>
+
+
+typedef int (*DeflateInit2Func)(z_streamp, int, int, int, int, int, const char*, int);
+typedef int (*DeflateFunc)(z_streamp, int);
+typedef int (*DeflateEndFunc)(z_streamp);
+
+// gzip compression with zlib loaded on demand: the agent does not depend on libz,
+// unless compressed output is requested. load() must succeed before other calls
+class Gzip {
+  private:
+    static DeflateInit2Func _deflateInit2;
+    static DeflateFunc _deflate;
+    static DeflateEndFunc _deflateEnd;
+
+  public:
+    static bool load();
+
+    // Starts a gzip (not raw deflate) stream with the default compression level
+    static int init(z_stream* zs) {
+        return _deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY,
+                             ZLIB_VERSION, (int)sizeof(z_stream));
+    }
+
+    static int deflate(z_stream* zs, int flush) {
+        return _deflate(zs, flush);
+    }
+
+    static int end(z_stream* zs) {
+        return _deflateEnd(zs);
+    }
+};
+
+#endif // _GZIP_H
@@ -1 +1 @@
-202,254,186,190,0,0,0,50,0,11,10,0,3,0,8,7,0,9,7,0,10,1,0,6,60,105,110,105,116,62,1,0,3,40,41,86,1,0,4,67,111,100,101,1,0,12,114,101,99,111,114,100,83,97,109,112,108,101,12,0,4,0,5,1,0,23,111,110,101,47,112,114,111,102,105,108,101,114,47,73,110,115,116,114,117,109,101,110,116,1,0,16,106,97,118,97,47,108,97,110,103,47,79,98,106,101,99,116,0,33,0,2,0,3,0,0,0,0,0,2,0,2,0,4,0,5,0,1,0,6,0,0,0,17,0,1,0,1,0,0,0,5,42,183,0,1,177,0,0,0,0,1,9,0,7,0,5,0,0,0,0,
\ No newline at end of file
+202,254,186,190,0,0,0,50,0,27,1,0,16,106,97,118,97,47,108,97,110,103,47,79,98,106,101,99,116,7,0,1,1,0,6,60,105,110,105,116,62,1,0,3,40,41,86,12,0,3,0,4,10,0,2,0,5,1,0,23,111,110,101,47,112,114,111,102,105,108,101,114,47,73,110,115,116,114,117,109,101,110,116,7,0,7,1,0,8,99,111,117,110,116,101,114,115,1,0,2,91,74,12,0,9,0,10,9,0,8,0,11,1,0,9,99,111,117,110,116,100,111,119,110,1,0,1,73,12,0,13,0,14,9,0,8,0,15,1,0,12,114,101,99,111,114,100,83,97,109,112,108,101,1,0,3,40,41,73,12,0,17,0,18,10,0,8,0,19,1,0,4,67,111,100,101,1,0,13,83,116,97,99,107,77,97,112,84,97,98,108,101,1,0,11,114,101,99,111,114,100,69,110,116,114,121,1,0,4,40,73,41,86,1,0,15,114,101,99,111,114,100,67,97,108,108,83,116,97,114,116,1,0,13,114,101,99,111,114,100,67,97,108,108,69,110,100,0,33,0,8,0,2,0,0,0,2,0,10,0,9,0,10,0,0,0,10,0,13,0,14,0,0,0,5,0,2,0,3,0,4,0,1,0,21,0,0,0,17,0,1,0,1,0,0,0,5,42,183,0,6,177,0,0,0,0,0,9,0,23,0,24,0,1,0,21,0,0,0,49,0,6,0,1,0,0,0,28,178,0,12,26,92,47,10,97,80,178,0,16,4,100,89,179,0,16,157,0,9,184,0,20,179,0,16,177,0,0,0,1,0,22,0,0,0,3,0,1,27,1,9,0,25,0,24,0,0,1,9,0,26,0,24,0,0,1,10,0,17,0,18,0,0,0,0,
\ No newline at end of file
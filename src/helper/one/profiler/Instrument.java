@@ -18,11 +18,29 @@ package one.profiler;
 
 /**
  * Instrumentation helper for Java method profiling.
+ * Every instrumented method calls recordEntry() with its own id. The call is counted
+ * in Java, and the native code is entered only once per sampling interval.
+ * When calls are timed, the native code also records the start and the end of every call.
  */
 public class Instrument {
+    private static long[] counters;
+    private static int countdown;
 
     private Instrument() {
     }
 
-    public static native void recordSample();
+    public static void recordEntry(int id) {
+        counters[id]++;
+        if (--countdown <= 0) {
+            countdown = recordSample();
+        }
+    }
+
+    // With latency, called after recordEntry() and before every exit of a timed method
+    public static native void recordCallStart(int id);
+
+    public static native void recordCallEnd(int id);
+
+    // Records a stack trace and returns the number of calls until the next sample
+    private static native int recordSample();
 }
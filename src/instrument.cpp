@@ -15,11 +15,15 @@
  */
 
 #include <arpa/inet.h>
+#include <algorithm>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "arch.h"
+#include "log.h"
 #include "os.h"
 #include "profiler.h"
+#include "tsc.h"
 #include "vmEntry.h"
 #include "instrument.h"
 
@@ -28,6 +32,16 @@ static const unsigned char INSTRUMENT_CLASS[] = {
 #include "helper/one/profiler/Instrument.class.h"
 };
 
+// Start times of the timed calls in progress on the current thread
+struct TimedCall {
+    int method_id;
+    u64 start;
+};
+
+static __thread TimedCall timed_calls[MAX_TIMED_DEPTH];
+static __thread int timed_depth;
+static __thread int timed_epoch;
+
 
 enum ConstantTag {
     CONSTANT_Utf8 = 1,
@@ -49,6 +63,29 @@ enum ConstantTag {
     CONSTANT_Package = 20
 };
 
+// '*' matches any sequence of characters, including package separators
+static bool wildcardMatch(const char* pattern, size_t pattern_len, const char* s, size_t len) {
+    size_t p = 0, i = 0, star = (size_t)-1, mark = 0;
+    while (i < len) {
+        if (p < pattern_len && pattern[p] == '*') {
+            star = p++;
+            mark = i;
+        } else if (p < pattern_len && pattern[p] == s[i]) {
+            p++;
+            i++;
+        } else if (star != (size_t)-1) {
+            p = star + 1;
+            i = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern_len && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern_len;
+}
+
 class Constant {
   private:
     u8 _tag;
@@ -100,11 +137,12 @@ class Constant {
         return _tag == CONSTANT_Utf8 && info() == len && memcmp(_info + 2, value, len) == 0;
     }
 
-    bool matches(const char* value, u16 len) {
-        if (len > 0 && value[len - 1] == '*') {
-            return _tag == CONSTANT_Utf8 && info() >= len - 1 && memcmp(_info + 2, value, len - 1) == 0;
-        }
-        return equals(value, len);
+    const char* string() {
+        return (const char*)_info + 2;
+    }
+
+    bool matches(const char* pattern, u16 len) {
+        return _tag == CONSTANT_Utf8 && wildcardMatch(pattern, len, string(), info());
     }
 };
 
@@ -117,11 +155,62 @@ enum Scope {
 };
 
 enum PatchConstants {
-    EXTRA_CONSTANTS = 6,
-    EXTRA_BYTECODES = 4,
-    EXTRA_STACKMAPS = 1
+    EXTRA_CONSTANTS = 15,
+    ENTRY_BYTECODES = 8,
+    TIMED_ENTRY_BYTECODES = 12,
+    EXIT_BYTECODES = 8,
+    HANDLER_BYTECODES = 7,
+    HANDLER_FRAME_SIZE = 10,
+    // Relocated branches keep 16-bit offsets
+    MAX_TIMED_CODE_LENGTH = 32767
 };
 
+// Length of the instruction at pc, or 0 if it does not fit in the code
+static u32 instructionLength(const u8* code, u32 pc, u32 code_length) {
+    u32 len;
+    u8 opcode = code[pc];
+    switch (opcode) {
+        case 0x10: case 0x12: case 0x15: case 0x16: case 0x17: case 0x18: case 0x19:
+        case 0x36: case 0x37: case 0x38: case 0x39: case 0x3a: case 0xa9: case 0xbc:
+            len = 2;
+            break;
+        case 0x11: case 0x13: case 0x14: case 0x84: case 0xbb: case 0xbd: case 0xc0: case 0xc1:
+        case 0xc6: case 0xc7:
+            len = 3;
+            break;
+        case 0xb2: case 0xb3: case 0xb4: case 0xb5: case 0xb6: case 0xb7: case 0xb8:
+            len = 3;
+            break;
+        case 0xc5:
+            len = 4;
+            break;
+        case 0xb9: case 0xba: case 0xc8: case 0xc9:
+            len = 5;
+            break;
+        case 0xc4:
+            len = pc + 1 < code_length && code[pc + 1] == 0x84 ? 6 : 4;
+            break;
+        case 0xaa:
+        case 0xab: {
+            u32 table = (pc + 4) & ~3;
+            if (table + 12 > code_length) return 0;
+            u32 count = opcode == 0xaa
+                ? ntohl(*(u32*)(code + table + 8)) - ntohl(*(u32*)(code + table + 4)) + 1
+                : ntohl(*(u32*)(code + table + 4)) * 2;
+            if (count > code_length / 4) return 0;
+            len = table - pc + (opcode == 0xaa ? 12 : 8) + count * 4;
+            break;
+        }
+        default:
+            len = opcode >= 0x99 && opcode <= 0xa8 ? 3 : 1;
+    }
+    return pc + len <= code_length ? len : 0;
+}
+
+static bool isReturn(u8 opcode) {
+    return opcode >= 0xac && opcode <= 0xb1;
+}
+
 
 class BytecodeRewriter {
   private:
@@ -135,12 +224,17 @@ class BytecodeRewriter {
     Constant** _cpool;
     u16 _cpool_len;
 
-    const char* _target_class;
-    u16 _target_class_len;
-    const char* _target_method;
-    u16 _target_method_len;
-    const char* _target_signature;
-    u16 _target_signature_len;
+    Constant* _class_name;
+    std::vector<const InstrumentTarget*> _class_targets;
+    int _method_id;
+
+    // Timing of the method being rewritten: the original offsets of its return instructions
+    // and the offset of the catch-all handler that records exits by exception
+    bool _time_calls;
+    bool _timed;
+    u32 _entry_len;
+    u32 _handler_pc;
+    std::vector<u32> _returns;
 
     // Reader
 
@@ -233,8 +327,49 @@ class BytecodeRewriter {
 
     // BytecodeRewriter
 
+    // Code before every return moves by the entry and all exits inserted above it.
+    // A branch to a return lands on the exit code inserted before the return
+    u32 relocate(u32 offset) {
+        return offset + _entry_len + EXIT_BYTECODES *
+            (std::lower_bound(_returns.begin(), _returns.end(), offset) - _returns.begin());
+    }
+
+    void putMethodCall(u16 method_ref) {
+        // sipush method_id
+        // invokestatic method_ref
+        put8(0x11);
+        put16(_method_id);
+        put8(0xb8);
+        put16(method_ref);
+    }
+
+    void putHandlerFrame(int offset_delta) {
+        // full_frame with no locals and java/lang/Throwable on the stack
+        put8(255);
+        put16(offset_delta);
+        put16(0);
+        put16(1);
+        put8(7);
+        put16(_cpool_len + 12);
+    }
+
+    bool matchesMethod(Constant* name, Constant* descriptor) {
+        for (size_t i = 0; i < _class_targets.size(); i++) {
+            const InstrumentTarget* t = _class_targets[i];
+            if (name->matches(t->method_name, t->method_len)
+                && (t->signature == NULL || descriptor->matches(t->signature, t->signature_len))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool findReturns(const u8* code, u32 code_length);
+    void relocateCode(const u8* code, u32 code_length);
     void rewriteCode();
     void rewriteBytecodeTable(int data_len);
+    void rewriteLocalVariableTable();
+    u16 relocateDelta(u16 offset_delta, int& offset, int& new_offset);
     void rewriteStackMapTable();
     void rewriteVerificationTypeInfo();
     void rewriteAttributes(Scope scope);
@@ -242,26 +377,21 @@ class BytecodeRewriter {
     bool rewriteClass();
 
   public:
-    BytecodeRewriter(const u8* class_data, int class_data_len, const char* target_class) :
+    BytecodeRewriter(const u8* class_data, int class_data_len) :
         _src(class_data),
         _src_limit(class_data + class_data_len),
         _dst(NULL),
         _dst_len(0),
         _dst_capacity(class_data_len + 400),
-        _cpool(NULL) {
-
-        _target_class = target_class;
-        _target_class_len = strlen(_target_class);
-
-        _target_method = _target_class + _target_class_len + 1;
-        _target_signature = strchr(_target_method, '(');
-
-        if (_target_signature == NULL) {
-            _target_method_len = strlen(_target_method);
-        } else {
-            _target_method_len = _target_signature - _target_method;
-            _target_signature_len = strlen(_target_signature);
-        }
+        _cpool(NULL),
+        _class_name(NULL),
+        _class_targets(),
+        _method_id(0),
+        _time_calls(false),
+        _timed(false),
+        _entry_len(ENTRY_BYTECODES),
+        _handler_pc(0),
+        _returns() {
     }
 
     ~BytecodeRewriter() {
@@ -281,6 +411,62 @@ class BytecodeRewriter {
 };
 
 
+bool BytecodeRewriter::findReturns(const u8* code, u32 code_length) {
+    for (u32 pc = 0; pc < code_length; ) {
+        u32 len = instructionLength(code, pc, code_length);
+        if (len == 0) {
+            return false;
+        }
+        if (isReturn(code[pc])) {
+            _returns.push_back(pc);
+        }
+        pc += len;
+    }
+    return true;
+}
+
+// Copies the code inserting a call of recordCallEnd before every return. Inserted code is
+// a multiple of 4 bytes long, so tableswitch and lookupswitch keep their padding
+void BytecodeRewriter::relocateCode(const u8* code, u32 code_length) {
+    for (u32 pc = 0; pc < code_length; ) {
+        u32 len = instructionLength(code, pc, code_length);
+        u8 opcode = code[pc];
+        u32 new_pc = relocate(pc);
+
+        if (isReturn(opcode)) {
+            putMethodCall(_cpool_len + 9);
+            put8(0);
+            put8(0);
+            put8(opcode);
+        } else if ((opcode >= 0x99 && opcode <= 0xa8) || opcode == 0xc6 || opcode == 0xc7) {
+            put8(opcode);
+            put16(relocate(pc + (short)ntohs(*(u16*)(code + pc + 1))) - new_pc);
+        } else if (opcode == 0xc8 || opcode == 0xc9) {
+            put8(opcode);
+            put32(relocate(pc + (int)ntohl(*(u32*)(code + pc + 1))) - new_pc);
+        } else if (opcode == 0xaa || opcode == 0xab) {
+            u32 table = (pc + 4) & ~3;
+            put(code + pc, table - pc);
+            put32(relocate(pc + (int)ntohl(*(u32*)(code + table))) - new_pc);
+            if (opcode == 0xaa) {
+                put(code + table + 4, 8);
+                for (u32 p = table + 12; p < pc + len; p += 4) {
+                    put32(relocate(pc + (int)ntohl(*(u32*)(code + p))) - new_pc);
+                }
+            } else {
+                put(code + table + 4, 4);
+                for (u32 p = table + 8; p < pc + len; p += 8) {
+                    put(code + p, 4);
+                    put32(relocate(pc + (int)ntohl(*(u32*)(code + p + 4))) - new_pc);
+                }
+            }
+        } else {
+            put(code + pc, len);
+        }
+        pc += len;
+    }
+}
+
 void BytecodeRewriter::rewriteCode() {
     u32 attribute_length = get32();
     put32(attribute_length);
@@ -288,36 +474,66 @@ void BytecodeRewriter::rewriteCode() {
     int code_begin = _dst_len;
 
     u16 max_stack = get16();
-    put16(max_stack);
-
     u16 max_locals = get16();
-    put16(max_locals);
-
     u32 code_length = get32();
-    put32(code_length + EXTRA_BYTECODES);
+    const u8* code = get(code_length);
+
+    _returns.clear();
+    _timed = _time_calls && findReturns(code, code_length)
+        && code_length + TIMED_ENTRY_BYTECODES + EXIT_BYTECODES * _returns.size() + HANDLER_BYTECODES
+           <= MAX_TIMED_CODE_LENGTH;
+    if (_time_calls && !_timed) {
+        Log::warn("Calls of %s are counted but not timed: the method is too large", Instrument::methodName(_method_id));
+        _returns.clear();
+    }
+    _entry_len = _timed ? TIMED_ENTRY_BYTECODES : ENTRY_BYTECODES;
+    _handler_pc = relocate(code_length);
 
-    // invokestatic "one/profiler/Instrument.recordSample()V"
-    // nop ensures that tableswitch/lookupswitch needs no realignment
-    put8(0xb8);
-    put16(_cpool_len);
-    put8(0);
-    // The rest of the code is unchanged
-    put(get(code_length), code_length);
+    // The method id is pushed on the operand stack: at the entry, on top of the return value
+    // before a return, and on top of the exception in the catch-all handler
+    put16(_timed ? std::max(max_stack + 1, 2) : std::max((int)max_stack, 1));
+    put16(max_locals);
+    put32(_handler_pc + (_timed ? HANDLER_BYTECODES : 0));
+
+    // invokestatic "one/profiler/Instrument.recordEntry(I)V"
+    // invokestatic "one/profiler/Instrument.recordCallStart(I)V" or nops, so that
+    // tableswitch/lookupswitch needs no realignment
+    putMethodCall(_cpool_len);
+    if (_timed) {
+        putMethodCall(_cpool_len + 6);
+        relocateCode(code, code_length);
+        // athrow rethrows the exception that ends the call
+        putMethodCall(_cpool_len + 9);
+        put8(0xbf);
+    } else {
+        put8(0);
+        put8(0);
+        // The rest of the code is unchanged
+        put(code, code_length);
+    }
 
     u16 exception_table_length = get16();
-    put16(exception_table_length);
+    put16(exception_table_length + (_timed ? 1 : 0));
 
     for (int i = 0; i < exception_table_length; i++) {
         u16 start_pc = get16();
         u16 end_pc = get16();
         u16 handler_pc = get16();
         u16 catch_type = get16();
-        put16(EXTRA_BYTECODES + start_pc);
-        put16(EXTRA_BYTECODES + end_pc);
-        put16(EXTRA_BYTECODES + handler_pc);
+        put16(relocate(start_pc));
+        put16(relocate(end_pc));
+        put16(relocate(handler_pc));
         put16(catch_type);
     }
 
+    // The catch-all handler comes last, after the handlers of the method itself
+    if (_timed) {
+        put16(_entry_len);
+        put16(_handler_pc);
+        put16(_handler_pc);
+        put16(0);
+    }
+
     rewriteAttributes(SCOPE_REWRITE_CODE);
 
     // Patch attribute length
@@ -333,47 +549,83 @@ void BytecodeRewriter::rewriteBytecodeTable(int data_len) {
 
     for (int i = 0; i < table_length; i++) {
         u16 start_pc = get16();
-        put16(EXTRA_BYTECODES + start_pc);
+        put16(relocate(start_pc));
 
         put(get(data_len), data_len);
     }
 }
 
+void BytecodeRewriter::rewriteLocalVariableTable() {
+    u32 attribute_length = get32();
+    put32(attribute_length);
+
+    u16 table_length = get16();
+    put16(table_length);
+
+    for (int i = 0; i < table_length; i++) {
+        u16 start_pc = get16();
+        u16 length = get16();
+        put16(relocate(start_pc));
+        put16(relocate(start_pc + length) - relocate(start_pc));
+
+        put(get(6), 6);
+    }
+}
+
+// Frame offsets are deltas from the previous frame, so they are tracked as absolute offsets
+// in both the original and the rewritten code. The first frame starts from offset -1
+u16 BytecodeRewriter::relocateDelta(u16 offset_delta, int& offset, int& new_offset) {
+    offset += offset_delta + 1;
+    int prev_offset = new_offset;
+    new_offset = relocate(offset);
+    return new_offset - prev_offset - 1;
+}
+
 void BytecodeRewriter::rewriteStackMapTable() {
     u32 attribute_length = get32();
-    put32(attribute_length + EXTRA_STACKMAPS);
+    put32(attribute_length);
 
-    u16 number_of_entries = get16();
-    put16(number_of_entries + EXTRA_STACKMAPS);
+    int table_begin = _dst_len;
 
-    // Prepend same_frame
-    put8(EXTRA_BYTECODES - 1);
+    u16 number_of_entries = get16();
+    put16(number_of_entries + (_timed ? 1 : 0));
 
+    int offset = -1;
+    int new_offset = -1;
     for (int i = 0; i < number_of_entries; i++) {
         u8 frame_type = get8();
+
+        if (frame_type <= 127) {
+            // same_frame or same_locals_1_stack_item_frame: the delta is a part of frame_type
+            // and moves to an extended frame when it does not fit there anymore
+            u16 delta = relocateDelta(frame_type & 63, offset, new_offset);
+            if (delta <= 63) {
+                put8((frame_type & 64) | delta);
+            } else {
+                put8(frame_type <= 63 ? 251 : 247);
+                put16(delta);
+            }
+            if (frame_type >= 64) {
+                rewriteVerificationTypeInfo();
+            }
+            continue;
+        }
+
         put8(frame_type);
+        put16(relocateDelta(get16(), offset, new_offset));
 
-        if (frame_type <= 63) {
-            // same_frame
-        } else if (frame_type <= 127) {
-            // same_locals_1_stack_item_frame
-            rewriteVerificationTypeInfo();
-        } else if (frame_type == 247) {
+        if (frame_type == 247) {
             // same_locals_1_stack_item_frame_extended
-            put16(get16());
             rewriteVerificationTypeInfo();
         } else if (frame_type <= 251) {
             // chop_frame or same_frame_extended
-            put16(get16());
         } else if (frame_type <= 254) {
             // append_frame
-            put16(get16());
             for (int j = 0; j < frame_type - 251; j++) {
                 rewriteVerificationTypeInfo();
             }
         } else {
             // full_frame
-            put16(get16());
             u16 number_of_locals = get16();
             put16(number_of_locals);
             for (int j = 0; j < number_of_locals; j++) {
@@ -386,6 +638,13 @@ void BytecodeRewriter::rewriteStackMapTable() {
             }
         }
     }
+
+    if (_timed) {
+        putHandlerFrame(_handler_pc - new_offset - 1);
+    }
+
+    // Patch attribute length
+    *(u32*)(_dst + table_begin - 4) = htonl(_dst_len - table_begin);
 }
 
 void BytecodeRewriter::rewriteVerificationTypeInfo() {
@@ -393,7 +652,7 @@ void BytecodeRewriter::rewriteVerificationTypeInfo() {
     put8(tag);
     if (tag >= 7) {
         // Adjust ITEM_Uninitialized offset
-        put16(tag == 8 ? EXTRA_BYTECODES + get16() : get16());
+        put16(tag == 8 ? relocate(get16()) : get16());
     }
 }
 
@@ -401,6 +660,9 @@ void BytecodeRewriter::rewriteAttributes(Scope scope) {
     u16 attributes_count = get16();
     put16(attributes_count);
 
+    int count_offset = _dst_len - 2;
+    bool has_stack_map = false;
+
     for (int i = 0; i < attributes_count; i++) {
         u16 attribute_name_index = get16();
         put16(attribute_name_index);
@@ -415,10 +677,11 @@ void BytecodeRewriter::rewriteAttributes(Scope scope) {
                 continue;
             } else if (attribute_name->equals("LocalVariableTable", 18) ||
                        attribute_name->equals("LocalVariableTypeTable", 22)) {
-                rewriteBytecodeTable(8);
+                rewriteLocalVariableTable();
                 continue;
             } else if (attribute_name->equals("StackMapTable", 13)) {
                 rewriteStackMapTable();
+                has_stack_map = true;
                 continue;
             }
         }
@@ -427,6 +690,15 @@ void BytecodeRewriter::rewriteAttributes(Scope scope) {
         put32(attribute_length);
         put(get(attribute_length), attribute_length);
     }
+
+    // The catch-all handler of a timed method needs a frame even in code without branches
+    if (scope == SCOPE_REWRITE_CODE && _timed && !has_stack_map) {
+        put16(_cpool_len + 14);
+        put32(2 + HANDLER_FRAME_SIZE);
+        put16(1);
+        putHandlerFrame(_handler_pc);
+        *(u16*)(_dst + count_offset) = htons(attributes_count + 1);
+    }
 }
 
 void BytecodeRewriter::rewriteMembers(Scope scope) {
@@ -443,9 +715,18 @@ void BytecodeRewriter::rewriteMembers(Scope scope) {
         u16 descriptor_index = get16();
         put16(descriptor_index);
 
-        bool need_rewrite = scope == SCOPE_METHOD
-            && _cpool[name_index]->matches(_target_method, _target_method_len)
-            && (_target_signature == NULL || _cpool[descriptor_index]->matches(_target_signature, _target_signature_len));
+        // Native and abstract methods (ACC_NATIVE | ACC_ABSTRACT) have no code to instrument
+        bool need_rewrite = scope == SCOPE_METHOD && (access_flags & 0x0500) == 0
+            && matchesMethod(_cpool[name_index], _cpool[descriptor_index]);
+        if (need_rewrite) {
+            Constant* name = _cpool[name_index];
+            Constant* descriptor = _cpool[descriptor_index];
+            _method_id = Instrument::methodId(_class_name->string(), _class_name->info(), name->string(), name->info(),
+                                              descriptor->string(), descriptor->info());
+            need_rewrite = _method_id >= 0;
+            // A handler around the code before super() would not pass verification, so constructors are not timed
+            _time_calls = Instrument::timeCalls() && !name->equals("<init>", 6);
+        }
 
         rewriteAttributes(need_rewrite ? SCOPE_REWRITE_METHOD : SCOPE_METHOD);
     }
@@ -475,8 +756,17 @@ bool BytecodeRewriter::rewriteClass() {
     putConstant(CONSTANT_Class, _cpool_len + 3);
     putConstant(CONSTANT_NameAndType, _cpool_len + 4, _cpool_len + 5);
     putConstant("one/profiler/Instrument");
-    putConstant("recordSample");
-    putConstant("()V");
+    putConstant("recordEntry");
+    putConstant("(I)V");
+    putConstant(CONSTANT_Methodref, _cpool_len + 1, _cpool_len + 7);
+    putConstant(CONSTANT_NameAndType, _cpool_len + 8, _cpool_len + 5);
+    putConstant("recordCallStart");
+    putConstant(CONSTANT_Methodref, _cpool_len + 1, _cpool_len + 10);
+    putConstant(CONSTANT_NameAndType, _cpool_len + 11, _cpool_len + 5);
+    putConstant("recordCallEnd");
+    putConstant(CONSTANT_Class, _cpool_len + 13);
+    putConstant("java/lang/Throwable");
+    putConstant("StackMapTable");
 
     u16 access_flags = get16();
     put16(access_flags);
@@ -484,8 +774,14 @@ bool BytecodeRewriter::rewriteClass() {
     u16 this_class = get16();
     put16(this_class);
 
-    u16 class_name_index = _cpool[this_class]->info();
-    if (!_cpool[class_name_index]->equals(_target_class, _target_class_len)) {
+    _class_name = _cpool[_cpool[this_class]->info()];
+    const std::vector<InstrumentTarget>& targets = Instrument::targets();
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (_class_name->matches(targets[i].class_name, targets[i].class_len)) {
+            _class_targets.push_back(&targets[i]);
+        }
+    }
+    if (_class_targets.empty()) {
         return false;
     }
 
@@ -504,24 +800,146 @@ bool BytecodeRewriter::rewriteClass() {
 }
 
 
-char* Instrument::_target_class = NULL;
-bool Instrument::_instrument_class_loaded = false;
+u32 ClassMatcher::hash(const char* name, size_t len) {
+    u32 h = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (u8)name[i]) * 16777619;
+    }
+    return h;
+}
+
+int ClassMatcher::findChild(int node, char c) const {
+    for (int child = _nodes[node].child; child >= 0; child = _nodes[child].sibling) {
+        if (_nodes[child].c == c) {
+            return child;
+        }
+    }
+    return -1;
+}
+
+void ClassMatcher::addName(const char* name, size_t len) {
+    size_t mask = _names.size() - 1;
+    for (size_t i = hash(name, len) & mask; ; i = (i + 1) & mask) {
+        if (_names[i].name == NULL) {
+            _names[i].name = name;
+            _names[i].len = len;
+            return;
+        } else if (_names[i].len == len && memcmp(_names[i].name, name, len) == 0) {
+            return;
+        }
+    }
+}
+
+void ClassMatcher::addPattern(const char* pattern, size_t len) {
+    int node = 0;
+    for (size_t i = 0; pattern[i] != '*'; i++) {
+        int child = findChild(node, pattern[i]);
+        if (child < 0) {
+            TrieNode n = {-1, _nodes[node].child, -1, pattern[i]};
+            child = _nodes.size();
+            _nodes.push_back(n);
+            _nodes[node].child = child;
+        }
+        node = child;
+    }
+
+    Pattern p = {pattern, len, _nodes[node].patterns};
+    _nodes[node].patterns = _patterns.size();
+    _patterns.push_back(p);
+}
+
+void ClassMatcher::build(const std::vector<InstrumentTarget>& targets) {
+    size_t exact = 0;
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (memchr(targets[i].class_name, '*', targets[i].class_len) == NULL) exact++;
+    }
+
+    // Power of two capacity with at least half of the slots empty
+    size_t capacity = 16;
+    while (capacity < exact * 2) capacity *= 2;
+
+    Name empty = {NULL, 0};
+    TrieNode root = {-1, -1, -1, 0};
+    _names.assign(exact > 0 ? capacity : 0, empty);
+    _nodes.assign(1, root);
+    _patterns.clear();
+
+    for (size_t i = 0; i < targets.size(); i++) {
+        const InstrumentTarget& t = targets[i];
+        if (memchr(t.class_name, '*', t.class_len) == NULL) {
+            addName(t.class_name, t.class_len);
+        } else {
+            addPattern(t.class_name, t.class_len);
+        }
+    }
+}
+
+bool ClassMatcher::matches(const char* name, size_t len) const {
+    if (!_names.empty()) {
+        size_t mask = _names.size() - 1;
+        for (size_t i = hash(name, len) & mask; _names[i].name != NULL; i = (i + 1) & mask) {
+            if (_names[i].len == len && memcmp(_names[i].name, name, len) == 0) {
+                return true;
+            }
+        }
+    }
+
+    // Patterns attached to a trie node share the name prefix up to this depth
+    int node = 0;
+    for (size_t depth = 0; node >= 0; depth++) {
+        for (int p = _nodes[node].patterns; p >= 0; p = _patterns[p].next) {
+            const Pattern& pattern = _patterns[p];
+            if (wildcardMatch(pattern.pattern + depth, pattern.len - depth, name + depth, len - depth)) {
+                return true;
+            }
+        }
+        if (depth == len) break;
+        node = findChild(node, name[depth]);
+    }
+    return false;
+}
+
+
+std::vector<InstrumentTarget> Instrument::_targets;
+std::vector<char*> Instrument::_target_strings;
+std::string Instrument::_target_key;
+ClassMatcher Instrument::_matcher;
+std::multimap<jint, jweak> Instrument::_matched_classes;
+Mutex Instrument::_classes_lock;
+volatile bool Instrument::_tracking = false;
+jclass Instrument::_instrument_class = NULL;
+jfieldID Instrument::_counters_field;
+jfieldID Instrument::_countdown_field;
+char* Instrument::_method_names[MAX_INSTRUMENTED_METHODS];
+int Instrument::_method_count = 0;
+Mutex Instrument::_method_lock;
 u64 Instrument::_interval;
-volatile u64 Instrument::_calls;
+u64 Instrument::_base_interval;
+bool Instrument::_call_count;
+bool Instrument::_time_calls;
+u64 Instrument::_call_time[MAX_INSTRUMENTED_METHODS];
+u64 Instrument::_timed_calls[MAX_INSTRUMENTED_METHODS];
+volatile int Instrument::_timer_epoch = 0;
 volatile bool Instrument::_running;
 
 Error Instrument::check(Arguments& args) {
-    if (!_instrument_class_loaded) {
+    if (_instrument_class == NULL) {
         JNIEnv* jni = VM::jni();
-        const JNINativeMethod native_method = {(char*)"recordSample", (char*)"()V", (void*)recordSample};
+        const JNINativeMethod native_methods[] = {
+            {(char*)"recordSample", (char*)"()I", (void*)recordSample},
+            {(char*)"recordCallStart", (char*)"(I)V", (void*)recordCallStart},
+            {(char*)"recordCallEnd", (char*)"(I)V", (void*)recordCallEnd}
+        };
 
         jclass cls = jni->DefineClass(NULL, NULL, (const jbyte*)INSTRUMENT_CLASS, sizeof(INSTRUMENT_CLASS));
-        if (cls == NULL || jni->RegisterNatives(cls, &native_method, 1) != 0) {
+        if (cls == NULL || jni->RegisterNatives(cls, native_methods, 3) != 0) {
             jni->ExceptionDescribe();
             return Error("Could not load Instrument class");
         }
 
-        _instrument_class_loaded = true;
+        _counters_field = jni->GetStaticFieldID(cls, "counters", "[J");
+        _countdown_field = jni->GetStaticFieldID(cls, "countdown", "I");
+        _instrument_class = (jclass)jni->NewGlobalRef(cls);
     }
 
     return Error::OK;
@@ -537,13 +955,39 @@ Error Instrument::start(Arguments& args) {
         return Error("interval must be positive");
     }
 
-    setupTargetClassAndMethod(args._event);
-    _interval = args._interval ? args._interval : 1;
-    _calls = 0;
+    bool targets_changed;
+    error = setupTargets(args, targets_changed);
+    if (error) {
+        return error;
+    }
+
+    // Counters are reset by replacing the array; ids of methods stay valid for the life of the VM
+    JNIEnv* jni = VM::jni();
+    jlongArray counters = jni->NewLongArray(MAX_INSTRUMENTED_METHODS);
+    if (counters == NULL) {
+        jni->ExceptionClear();
+        return Error("Could not allocate method counters");
+    }
+    jni->SetStaticObjectField(_instrument_class, _counters_field, counters);
+    jni->SetStaticIntField(_instrument_class, _countdown_field, 0);
+    jni->DeleteLocalRef(counters);
+
+    _interval = _base_interval = args._interval ? args._interval : 1;
+    _call_count = args._call_count;
     _running = true;
 
+    // Matched classes are retransformed below, so the new code follows the timing option
+    _time_calls = args._latency;
+    memset(_call_time, 0, sizeof(_call_time));
+    memset(_timed_calls, 0, sizeof(_timed_calls));
+    atomicInc(_timer_epoch);
+
     jvmtiEnv* jvmti = VM::jvmti();
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
+    if (targets_changed) {
+        // Once found, matching classes are tracked by ClassPrepare until the session stops
+        scanLoadedClasses(jvmti, jni);
+    }
     retransformMatchedClasses(jvmti);
 
     return Error::OK;
@@ -551,50 +995,253 @@ Error Instrument::start(Arguments& args) {
 
 void Instrument::stop() {
     _running = false;
+    // ClassPrepare stops looking at class signatures; the next start scans loaded classes again
+    _tracking = false;
 
     jvmtiEnv* jvmti = VM::jvmti();
     retransformMatchedClasses(jvmti);  // undo transformation
     jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
 }
 
-void Instrument::setupTargetClassAndMethod(const char* event) {
-    char* new_class = strdup(event);
-    *strrchr(new_class, '.') = 0;
+// Every event is a class.method pattern; the first one is args._event, the rest come from extra events
+Error Instrument::setupTargets(Arguments& args, bool& changed) {
+    std::vector<const char*> events;
+    events.push_back(args._event);
+    for (int offset = args._extra_events; offset != 0; offset = ((int*)(args._buf + offset))[-1]) {
+        events.push_back(args._buf + offset);
+    }
+
+    std::string key;
+    for (size_t i = 0; i < events.size(); i++) {
+        key.append(events[i]).append(1, ',');
+    }
+    changed = !_tracking || key != _target_key;
+    if (!changed) {
+        return Error::OK;
+    }
+
+    std::vector<InstrumentTarget> targets;
+    std::vector<char*> strings;
+    for (size_t i = 0; i < events.size(); i++) {
+        char* s = strdup(events[i]);
+        strings.push_back(s);
+
+        char* signature = strchr(s, '(');
+        if (signature != NULL) *signature = 0;
+        char* method = strrchr(s, '.');
+        if (method == NULL || method == s || method[1] == 0) {
+            for (size_t j = 0; j < strings.size(); j++) free(strings[j]);
+            return Error("Java method must be specified as class.method");
+        }
+        *method++ = 0;
+        if (signature != NULL) *signature = '(';
+
+        for (char* c = s; *c; c++) {
+            if (*c == '.') *c = '/';
+        }
+
+        InstrumentTarget t;
+        t.class_name = s;
+        t.class_len = strlen(s);
+        t.method_name = method;
+        t.method_len = signature != NULL ? signature - method : strlen(method);
+        t.signature = signature;
+        t.signature_len = signature != NULL ? strlen(signature) : 0;
+        targets.push_back(t);
+    }
+
+    // Classes matched by the old targets are forgotten, tracking restarts with the new matcher
+    JNIEnv* jni = VM::jni();
+    MutexLocker ml(_classes_lock);
+    _tracking = false;
+
+    for (std::multimap<jint, jweak>::iterator it = _matched_classes.begin(); it != _matched_classes.end(); ++it) {
+        jni->DeleteWeakGlobalRef(it->second);
+    }
+    _matched_classes.clear();
 
-    for (char* s = new_class; *s; s++) {
-        if (*s == '.') *s = '/';
+    _targets.swap(targets);
+    _target_strings.swap(strings);
+    _target_key = key;
+    for (size_t j = 0; j < strings.size(); j++) {
+        free(strings[j]);
     }
+    _matcher.build(_targets);
 
-    char* old_class = _target_class;
-    _target_class = new_class;
-    free(old_class);
+    _tracking = true;
+    return Error::OK;
 }
 
-void Instrument::retransformMatchedClasses(jvmtiEnv* jvmti) {
+bool Instrument::matchesClass(const char* name, size_t len) {
+    return _matcher.matches(name, len);
+}
+
+// Called with _classes_lock held
+void Instrument::trackClass(jvmtiEnv* jvmti, JNIEnv* jni, jclass klass) {
+    jint hash;
+    if (jvmti->GetObjectHashCode(klass, &hash) != 0) {
+        hash = 0;
+    }
+
+    typedef std::multimap<jint, jweak>::iterator Iterator;
+    std::pair<Iterator, Iterator> range = _matched_classes.equal_range(hash);
+    for (Iterator it = range.first; it != range.second; ++it) {
+        if (jni->IsSameObject(it->second, klass)) {
+            return;
+        }
+    }
+    _matched_classes.insert(std::make_pair(hash, jni->NewWeakGlobalRef(klass)));
+}
+
+void Instrument::scanLoadedClasses(jvmtiEnv* jvmti, JNIEnv* jni) {
     jint class_count;
     jclass* classes;
     if (jvmti->GetLoadedClasses(&class_count, &classes) != 0) {
         return;
     }
 
-    jint matched_count = 0;
-    size_t len = strlen(_target_class);
     for (int i = 0; i < class_count; i++) {
         char* signature;
         if (jvmti->GetClassSignature(classes[i], &signature, NULL) == 0) {
-            if (signature[0] == 'L' && strncmp(signature + 1, _target_class, len) == 0 && signature[len + 1] == ';') {
-                classes[matched_count++] = classes[i];
+            size_t len = strlen(signature);
+            if (signature[0] == 'L' && matchesClass(signature + 1, len - 2)) {
+                MutexLocker ml(_classes_lock);
+                trackClass(jvmti, jni, classes[i]);
             }
             jvmti->Deallocate((unsigned char*)signature);
         }
+        jni->DeleteLocalRef(classes[i]);
     }
 
-    if (matched_count > 0) {
-        jvmti->RetransformClasses(matched_count, classes);
-        VM::jni()->ExceptionClear();
+    jvmti->Deallocate((unsigned char*)classes);
+}
+
+void JNICALL Instrument::ClassPrepare(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jclass klass) {
+    if (!_tracking) return;
+
+    char* signature;
+    if (jvmti->GetClassSignature(klass, &signature, NULL) == 0) {
+        size_t len = strlen(signature);
+        if (signature[0] == 'L') {
+            MutexLocker ml(_classes_lock);
+            if (_tracking && matchesClass(signature + 1, len - 2)) {
+                trackClass(jvmti, jni, klass);
+            }
+        }
+        jvmti->Deallocate((unsigned char*)signature);
     }
+}
 
-    jvmti->Deallocate((unsigned char*)classes);
+// Assigns a permanent id to an instrumented method. Retransformation of the same class
+// gets the same ids, so the methods keep their counters
+int Instrument::methodId(const char* class_name, u16 class_len, const char* method_name, u16 method_len,
+                         const char* signature, u16 signature_len) {
+    char name[1024];
+    snprintf(name, sizeof(name), "%.*s.%.*s%.*s", class_len, class_name, method_len, method_name,
+             signature_len, signature);
+    for (char* c = name; *c && *c != '('; c++) {
+        if (*c == '/') *c = '.';
+    }
+
+    MutexLocker ml(_method_lock);
+    for (int i = 0; i < _method_count; i++) {
+        if (strcmp(_method_names[i], name) == 0) {
+            return i;
+        }
+    }
+
+    if (_method_count >= MAX_INSTRUMENTED_METHODS) {
+        Log::warn("Too many instrumented methods, %s is skipped", name);
+        return -1;
+    }
+
+    // dumpCounters reads the names without the lock
+    _method_names[_method_count] = strdup(name);
+    __atomic_store_n(&_method_count, _method_count + 1, __ATOMIC_RELEASE);
+    return _method_count - 1;
+}
+
+// Costs time proportional to the number of matching classes, not all loaded classes
+void Instrument::retransformMatchedClasses(jvmtiEnv* jvmti) {
+    JNIEnv* jni = VM::jni();
+    std::vector<jclass> classes;
+    {
+        // Retransformation may load classes, so it runs outside the lock
+        MutexLocker ml(_classes_lock);
+        for (std::multimap<jint, jweak>::iterator it = _matched_classes.begin(); it != _matched_classes.end(); ) {
+            jclass klass = (jclass)jni->NewLocalRef(it->second);
+            if (klass == NULL) {
+                // Unloaded
+                jni->DeleteWeakGlobalRef(it->second);
+                _matched_classes.erase(it++);
+                continue;
+            }
+            classes.push_back(klass);
+            ++it;
+        }
+    }
+
+    if (!classes.empty()) {
+        jvmti->RetransformClasses(classes.size(), classes.data());
+        jni->ExceptionClear();
+    }
+
+    for (size_t i = 0; i < classes.size(); i++) {
+        jni->DeleteLocalRef(classes[i]);
+    }
+}
+
+static bool sortByCalls(const std::pair<jlong, int>& a, const std::pair<jlong, int>& b) {
+    return a.first > b.first;
+}
+
+void Instrument::dumpCounters(std::ostream& out) {
+    JNIEnv* jni = VM::jni();
+    if (jni == NULL || _instrument_class == NULL) {
+        return;
+    }
+
+    jlongArray counters = (jlongArray)jni->GetStaticObjectField(_instrument_class, _counters_field);
+    if (counters == NULL) {
+        return;
+    }
+
+    int count = __atomic_load_n(&_method_count, __ATOMIC_ACQUIRE);
+    jlong* values = new jlong[MAX_INSTRUMENTED_METHODS];
+    jni->GetLongArrayRegion(counters, 0, count, values);
+    jni->DeleteLocalRef(counters);
+
+    std::vector<std::pair<jlong, int> > methods;
+    for (int i = 0; i < count; i++) {
+        if (values[i] > 0) {
+            methods.push_back(std::make_pair(values[i], i));
+        }
+    }
+    delete[] values;
+    std::sort(methods.begin(), methods.end(), sortByCalls);
+
+    char buf[1024];
+    if (_time_calls) {
+        snprintf(buf, sizeof(buf), "\n%12s  %12s  %12s  method\n"
+                                   "  ----------  ----------  ----------  ------\n", "calls", "total (ms)", "avg (us)");
+    } else {
+        snprintf(buf, sizeof(buf), "\n%12s  method\n"
+                                   "  ----------  ------\n", "calls");
+    }
+    out << buf;
+    for (size_t i = 0; i < methods.size(); i++) {
+        int id = methods[i].second;
+        if (_time_calls) {
+            // Calls entered before the session started, constructors and too large methods are not timed
+            u64 calls = __atomic_load_n(&_timed_calls[id], __ATOMIC_RELAXED);
+            u64 time = __atomic_load_n(&_call_time[id], __ATOMIC_RELAXED);
+            snprintf(buf, sizeof(buf), "%12lld  %12.3f  %12.3f  %s\n", (long long)methods[i].first,
+                     time / 1e6, calls > 0 ? time / 1e3 / calls : 0.0, _method_names[id]);
+        } else {
+            snprintf(buf, sizeof(buf), "%12lld  %s\n", (long long)methods[i].first, _method_names[id]);
+        }
+        out << buf;
+    }
 }
 
 void JNICALL Instrument::ClassFileLoadHook(jvmtiEnv* jvmti, JNIEnv* jni,
@@ -605,17 +1252,54 @@ void JNICALL Instrument::ClassFileLoadHook(jvmtiEnv* jvmti, JNIEnv* jni,
     // Do not retransform if the profiling has stopped
     if (!_running) return;
 
-    if (name == NULL || strcmp(name, _target_class) == 0) {
-        BytecodeRewriter rewriter(class_data, class_data_len, _target_class);
+    if (name == NULL || matchesClass(name, strlen(name))) {
+        BytecodeRewriter rewriter(class_data, class_data_len);
         rewriter.rewrite(new_class_data, new_class_data_len);
     }
 }
 
-void JNICALL Instrument::recordSample(JNIEnv* jni, jobject unused) {
-    if (!_enabled) return;
+// Called from Instrument.recordEntry() once per sampling interval
+jint JNICALL Instrument::recordSample(JNIEnv* jni, jclass unused) {
+    if (_call_count) {
+        // Counting only: postpone the next call as far as possible
+        return 0x7fffffff;
+    }
 
-    if (_interval <= 1 || ((atomicInc(_calls) + 1) % _interval) == 0) {
-        ExecutionEvent event;
+    if (_enabled) {
+        ExecutionEvent event(TSC::ticks());
         Profiler::instance()->recordSample(NULL, _interval, BCI_INSTRUMENT, &event);
     }
+    return _interval < 0x7fffffff ? (jint)_interval : 0x7fffffff;
+}
+
+// With latency, called from a timed method after Instrument.recordEntry()
+void JNICALL Instrument::recordCallStart(JNIEnv* jni, jclass unused, jint id) {
+    if (timed_epoch != _timer_epoch) {
+        timed_epoch = _timer_epoch;
+        timed_depth = 0;
+    }
+
+    int depth = timed_depth++;
+    if (depth < MAX_TIMED_DEPTH) {
+        timed_calls[depth].method_id = id;
+        timed_calls[depth].start = TSC::nanos();
+    }
+}
+
+// Called before every return of a timed method and when an exception leaves it
+void JNICALL Instrument::recordCallEnd(JNIEnv* jni, jclass unused, jint id) {
+    if (timed_epoch != _timer_epoch || timed_depth == 0) {
+        return;
+    }
+
+    int depth = --timed_depth;
+    if (depth < MAX_TIMED_DEPTH) {
+        if (timed_calls[depth].method_id != id) {
+            // A call started before its method was retransformed; the timers above it are not trusted
+            timed_depth = 0;
+            return;
+        }
+        atomicInc(_call_time[id], TSC::nanos() - timed_calls[depth].start);
+        atomicInc(_timed_calls[id]);
+    }
 }
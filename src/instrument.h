@@ -18,17 +18,101 @@
 #define _INSTRUMENT_H
 
 #include <jvmti.h>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "arch.h"
 #include "engine.h"
+#include "mutex.h"
 
 
+// Method ids are pushed with sipush
+const int MAX_INSTRUMENTED_METHODS = 4096;
+
+// Nested timed calls deeper than this on one thread are counted but not timed
+const int MAX_TIMED_DEPTH = 64;
+
+// Parts of a class.method(signature) pattern, where class and method may contain '*'
+struct InstrumentTarget {
+    const char* class_name;
+    const char* method_name;
+    const char* signature;  // NULL matches any signature
+    u16 class_len;
+    u16 method_len;
+    u16 signature_len;
+};
+
+// Tells whether a class name matches any target in time independent of the number of targets.
+// Exact class names live in a hash set; wildcard patterns are indexed by their literal prefix
+// in a trie, so only patterns whose prefix the name starts with are tried
+class ClassMatcher {
+  private:
+    struct Name {
+        const char* name;
+        size_t len;
+    };
+
+    struct TrieNode {
+        int child;
+        int sibling;
+        int patterns;  // head of the list of patterns with the prefix ending here
+        char c;
+    };
+
+    struct Pattern {
+        const char* pattern;
+        size_t len;
+        int next;
+    };
+
+    std::vector<Name> _names;
+    std::vector<TrieNode> _nodes;
+    std::vector<Pattern> _patterns;
+
+    static u32 hash(const char* name, size_t len);
+
+    int findChild(int node, char c) const;
+    void addName(const char* name, size_t len);
+    void addPattern(const char* pattern, size_t len);
+
+  public:
+    void build(const std::vector<InstrumentTarget>& targets);
+    bool matches(const char* name, size_t len) const;
+};
+
 class Instrument : public Engine {
   private:
-    static char* _target_class;
-    static bool _instrument_class_loaded;
+    static std::vector<InstrumentTarget> _targets;
+    static std::vector<char*> _target_strings;
+    static std::string _target_key;
+    static ClassMatcher _matcher;
+    // Weak references to matching classes by identity hash code, so that a new class
+    // is compared only with the few classes of the same hash
+    static std::multimap<jint, jweak> _matched_classes;
+    static Mutex _classes_lock;
+    static volatile bool _tracking;
+    static jclass _instrument_class;
+    static jfieldID _counters_field;
+    static jfieldID _countdown_field;
+    static char* _method_names[MAX_INSTRUMENTED_METHODS];
+    static int _method_count;
+    static Mutex _method_lock;
     static u64 _interval;
-    static volatile u64 _calls;
+    static u64 _base_interval;
+    static bool _call_count;
+    static bool _time_calls;
+    // Total time and the number of timed calls per method; the epoch discards
+    // timers that threads started in the previous session
+    static u64 _call_time[MAX_INSTRUMENTED_METHODS];
+    static u64 _timed_calls[MAX_INSTRUMENTED_METHODS];
+    static volatile int _timer_epoch;
     static volatile bool _running;
 
+    static bool matchesClass(const char* name, size_t len);
+    static void trackClass(jvmtiEnv* jvmti, JNIEnv* jni, jclass klass);
+    static void scanLoadedClasses(jvmtiEnv* jvmti, JNIEnv* jni);
+
   public:
     const char* title() {
         return "Java method profile";
@@ -42,7 +126,12 @@ class Instrument : public Engine {
     Error start(Arguments& args);
     void stop();
 
-    void setupTargetClassAndMethod(const char* event);
+    long scaleInterval(double factor) {
+        _interval = (u64)(_base_interval * factor);
+        return (long)_interval;
+    }
+
+    Error setupTargets(Arguments& args, bool& changed);
 
     void retransformMatchedClasses(jvmtiEnv* jvmti);
 
@@ -52,7 +141,28 @@ class Instrument : public Engine {
                                           jint class_data_len, const u8* class_data,
                                           jint* new_class_data_len, u8** new_class_data);
 
-    static void JNICALL recordSample(JNIEnv* jni, jobject unused);
+    void dumpCounters(std::ostream& out);
+
+    static const std::vector<InstrumentTarget>& targets() {
+        return _targets;
+    }
+
+    static bool timeCalls() {
+        return _time_calls;
+    }
+
+    static int methodId(const char* class_name, u16 class_len, const char* method_name, u16 method_len,
+                        const char* signature, u16 signature_len);
+
+    static const char* methodName(int id) {
+        return _method_names[id];
+    }
+
+    static void JNICALL ClassPrepare(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jclass klass);
+
+    static jint JNICALL recordSample(JNIEnv* jni, jclass unused);
+    static void JNICALL recordCallStart(JNIEnv* jni, jclass unused, jint id);
+    static void JNICALL recordCallEnd(JNIEnv* jni, jclass unused, jint id);
 };
 
 #endif // _INSTRUMENT_H
@@ -20,16 +20,18 @@
 #include "os.h"
 #include "profiler.h"
 #include "stackWalker.h"
+#include "tsc.h"
 
 
 long ITimer::_interval;
+long ITimer::_base_interval;
 CStack ITimer::_cstack;
 
 
 void ITimer::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     if (!_enabled) return;
 
-    ExecutionEvent event;
+    ExecutionEvent event(TSC::ticks());
     Profiler::instance()->recordSample(ucontext, _interval, 0, &event);
 }
 
@@ -40,6 +42,8 @@ void ITimer::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext) {
     const void* last_pc;
     notif.num_frames = _cstack == CSTACK_NO ? 0 : _cstack == CSTACK_DWARF
         ? StackWalker::walkDwarf(ucontext, notif.addr, MAX_J9_NATIVE_FRAMES, &last_pc)
+        : _cstack == CSTACK_AUTO || _cstack == CSTACK_VM
+        ? StackWalker::walkAuto(ucontext, notif.addr, MAX_J9_NATIVE_FRAMES, &last_pc)
         : StackWalker::walkFP(ucontext, notif.addr, MAX_J9_NATIVE_FRAMES, &last_pc);
     J9StackTraces::checkpoint(_interval, &notif);
 }
@@ -62,7 +66,7 @@ Error ITimer::start(Arguments& args) {
     if (args._interval < 0) {
         return Error("interval must be positive");
     }
-    _interval = args._interval ? args._interval : DEFAULT_INTERVAL;
+    _interval = _base_interval = args._interval ? args._interval : DEFAULT_INTERVAL;
     _cstack = args._cstack;
 
     if (VM::isOpenJ9()) {
@@ -93,3 +97,14 @@ void ITimer::stop() {
 
     J9StackTraces::stop();
 }
+
+long ITimer::scaleInterval(double factor) {
+    _interval = (long)(_base_interval * factor);
+
+    time_t sec = _interval / 1000000000;
+    suseconds_t usec = (_interval % 1000000000) / 1000;
+    struct itimerval tv = {{sec, usec}, {sec, usec}};
+    setitimer(ITIMER_PROF, &tv, NULL);
+
+    return _interval;
+}
@@ -24,6 +24,7 @@
 class ITimer : public Engine {
   private:
     static long _interval;
+    static long _base_interval;
     static CStack _cstack;
 
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
@@ -41,6 +42,7 @@ class ITimer : public Engine {
     Error check(Arguments& args);
     Error start(Arguments& args);
     void stop();
+    long scaleInterval(double factor);
 };
 
 #endif // _ITIMER_H
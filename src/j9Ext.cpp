@@ -27,6 +27,7 @@ jvmtiExtensionFunction J9Ext::_GetOSThreadID = NULL;
 jvmtiExtensionFunction J9Ext::_GetJ9vmThread = NULL;
 jvmtiExtensionFunction J9Ext::_GetStackTraceExtended = NULL;
 jvmtiExtensionFunction J9Ext::_GetAllStackTracesExtended = NULL;
+jvmtiExtensionFunction J9Ext::_GetThreadListStackTracesExtended = NULL;
 
 int J9Ext::InstrumentableObjectAlloc_id = -1;
 
@@ -48,6 +49,8 @@ bool J9Ext::initialize(jvmtiEnv* jvmti, const void* j9thread_self) {
                 _GetStackTraceExtended = ext_functions[i].func;
             } else if (strcmp(ext_functions[i].id, "com.ibm.GetAllStackTracesExtended") == 0) {
                 _GetAllStackTracesExtended = ext_functions[i].func;
+            } else if (strcmp(ext_functions[i].id, "com.ibm.GetThreadListStackTracesExtended") == 0) {
+                _GetThreadListStackTracesExtended = ext_functions[i].func;
             }
         }
        jvmti->Deallocate((unsigned char*)ext_functions);
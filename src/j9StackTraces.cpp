@@ -17,13 +17,13 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <unistd.h>
+#include <string.h>
 #include <map>
 #include "j9StackTraces.h"
 #include "j9Ext.h"
 #include "profiler.h"
 #include "perfEvents.h"
+#include "tsc.h"
 
 
 enum {
@@ -55,22 +55,38 @@ class J9VMThread {
 
 pthread_t J9StackTraces::_thread = 0;
 int J9StackTraces::_max_stack_depth;
-int J9StackTraces::_pipe[2];
+volatile bool J9StackTraces::_running = false;
+sem_t J9StackTraces::_pending;
+J9QueueSlot* J9StackTraces::_queue = NULL;
+volatile u64 J9StackTraces::_enqueue_pos = 0;
+u64 J9StackTraces::_dequeue_pos = 0;
 
 static JNIEnv* _self_env = NULL;
 
 
 Error J9StackTraces::start(Arguments& args) {
-    _max_stack_depth = args._jstackdepth; 
+    _max_stack_depth = args._jstackdepth;
 
-    if (pipe(_pipe) != 0) {
-        return Error("Failed to create pipe");
+    if (_queue == NULL) {
+        _queue = (J9QueueSlot*)calloc(J9_QUEUE_SIZE, sizeof(J9QueueSlot));
+        if (_queue == NULL) {
+            return Error("Failed to allocate sample queue");
+        }
+    }
+    for (int i = 0; i < J9_QUEUE_SIZE; i++) {
+        _queue[i].seq = i;
+    }
+    _enqueue_pos = 0;
+    _dequeue_pos = 0;
+
+    if (sem_init(&_pending, 0, 0) != 0) {
+        return Error("Failed to create semaphore");
     }
-    fcntl(_pipe[1], F_SETFL, O_NONBLOCK);
 
+    _running = true;
     if (pthread_create(&_thread, NULL, threadEntry, NULL) != 0) {
-        close(_pipe[0]);
-        close(_pipe[1]);
+        _running = false;
+        sem_destroy(&_pending);
         return Error("Unable to create sampler thread");
     }
 
@@ -79,13 +95,81 @@ Error J9StackTraces::start(Arguments& args) {
 
 void J9StackTraces::stop() {
     if (_thread != 0) {
-        close(_pipe[1]);
+        __atomic_store_n(&_running, false, __ATOMIC_RELEASE);
+        sem_post(&_pending);
         pthread_join(_thread, NULL);
-        close(_pipe[0]);
+        sem_destroy(&_pending);
         _thread = 0;
     }
 }
 
+// Called from signal handlers: claims a slot with CAS and publishes it with the sequence number.
+// Returns false if the queue is full
+bool J9StackTraces::enqueue(J9StackTraceNotification* notif) {
+    u64 pos = __atomic_load_n(&_enqueue_pos, __ATOMIC_RELAXED);
+    J9QueueSlot* slot;
+    while (true) {
+        slot = &_queue[pos & (J9_QUEUE_SIZE - 1)];
+        u64 seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&_enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((long long)(seq - pos) < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(&slot->notif, notif, notif->size());
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // sem_post is async signal safe, and it enters the kernel only when the sampler thread is waiting
+    sem_post(&_pending);
+    return true;
+}
+
+// Returns published notifications in the order of enqueueing. They stay in place until release()
+int J9StackTraces::dequeue(J9StackTraceNotification** batch, int max_count) {
+    int count = 0;
+    while (count < max_count) {
+        u64 pos = _dequeue_pos + count;
+        J9QueueSlot* slot = &_queue[pos & (J9_QUEUE_SIZE - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+        batch[count++] = &slot->notif;
+    }
+    return count;
+}
+
+void J9StackTraces::release(int count) {
+    for (int i = 0; i < count; i++) {
+        u64 pos = _dequeue_pos++;
+        __atomic_store_n(&_queue[pos & (J9_QUEUE_SIZE - 1)].seq, pos + J9_QUEUE_SIZE, __ATOMIC_RELEASE);
+    }
+}
+
+// A thread stays halted for inspection until its flag is cleared, so every notification
+// that is not turned into a sample must release its thread. J9 keeps the J9VMThread of an exited
+// thread in the VM's pool, so the flag can be cleared even if the thread is no longer listed
+void J9StackTraces::skip(J9StackTraceNotification* notif) {
+    ((J9VMThread*)notif->env)->clearFlag(J9_HALT_THREAD_INSPECTION);
+}
+
+// Releases threads of the notifications left in the queue when the sampler thread stops
+void J9StackTraces::drain() {
+    J9StackTraceNotification* batch[J9_BATCH_SIZE];
+    int count;
+    while ((count = dequeue(batch, J9_BATCH_SIZE)) > 0) {
+        for (int i = 0; i < count; i++) {
+            skip(batch[i]);
+        }
+        release(count);
+    }
+}
+
 void J9StackTraces::timerLoop() {
     JNIEnv* jni = VM::attachThread("Async-profiler Sampler");
     __atomic_store_n(&_self_env, jni, __ATOMIC_RELEASE);
@@ -93,67 +177,111 @@ void J9StackTraces::timerLoop() {
     jni->PushLocalFrame(64);
 
     jvmtiEnv* jvmti = VM::jvmti();
-    char notification_buf[65536];
     std::map<void*, jthread> known_threads;
 
     int max_frames = _max_stack_depth + MAX_J9_NATIVE_FRAMES + RESERVED_FRAMES;
     ASGCT_CallFrame* frames = (ASGCT_CallFrame*)malloc(max_frames * sizeof(ASGCT_CallFrame));
     jvmtiFrameInfoExtended* jvmti_frames = (jvmtiFrameInfoExtended*)malloc(max_frames * sizeof(jvmtiFrameInfoExtended));
 
+    J9StackTraceNotification* batch[J9_BATCH_SIZE];
+    jthread batch_threads[J9_BATCH_SIZE];
+
     while (true) {
-        ssize_t bytes = read(_pipe[0], notification_buf, sizeof(notification_buf));
-        if (bytes <= 0) {
-            if (bytes < 0 && errno == EAGAIN) {
-                continue;
-            }
+        // One post per notification: consume all of them before draining the queue,
+        // so that a notification published after the drain wakes us up again
+        while (sem_wait(&_pending) != 0 && errno == EINTR);
+        while (sem_trywait(&_pending) == 0);
+
+        if (!__atomic_load_n(&_running, __ATOMIC_ACQUIRE)) {
             break;
         }
 
-        ssize_t ptr = 0;
-        while (ptr < bytes) {
-            J9StackTraceNotification* notif = (J9StackTraceNotification*)(notification_buf + ptr);
-
-            jthread thread = known_threads[notif->env];
-            jint num_jvmti_frames;
-            if (thread == NULL || J9Ext::GetStackTraceExtended(thread, 0, _max_stack_depth, jvmti_frames, &num_jvmti_frames) != 0) {
-                jni->PopLocalFrame(NULL);
-                jni->PushLocalFrame(64);
-
-                jint thread_count;
-                jthread* threads;
-                if (jvmti->GetAllThreads(&thread_count, &threads) == 0) {
-                    known_threads.clear();
-                    for (jint i = 0; i < thread_count; i++) {
-                        known_threads[J9Ext::GetJ9vmThread(threads[i])] = threads[i];
+        int count;
+        while ((count = dequeue(batch, J9_BATCH_SIZE)) > 0) {
+            bool refreshed = false;
+            for (int i = 0; i < count; i++) {
+                if ((batch_threads[i] = known_threads[batch[i]->env]) == NULL && !refreshed) {
+                    jni->PopLocalFrame(NULL);
+                    jni->PushLocalFrame(64);
+
+                    jint thread_count;
+                    jthread* threads;
+                    if (jvmti->GetAllThreads(&thread_count, &threads) == 0) {
+                        known_threads.clear();
+                        for (jint j = 0; j < thread_count; j++) {
+                            known_threads[J9Ext::GetJ9vmThread(threads[j])] = threads[j];
+                        }
+                        jvmti->Deallocate((unsigned char*)threads);
                     }
-                    jvmti->Deallocate((unsigned char*)threads);
+                    refreshed = true;
+
+                    // Local references of the old frame are gone: resolve the whole batch again
+                    i = -1;
                 }
+            }
 
-                if ((thread = known_threads[notif->env]) == NULL ||
-                    J9Ext::GetStackTraceExtended(thread, 0, _max_stack_depth, jvmti_frames, &num_jvmti_frames) != 0) {
-                    continue;
+            jvmtiStackInfoExtended* stack_info = NULL;
+            if (J9Ext::hasThreadListStackTraces()) {
+                // Compact the list, since the batched call does not accept NULL threads
+                jthread list[J9_BATCH_SIZE];
+                int list_size = 0;
+                for (int i = 0; i < count; i++) {
+                    if (batch_threads[i] != NULL) {
+                        list[list_size++] = batch_threads[i];
+                    }
+                }
+                if (list_size > 0 && J9Ext::GetThreadListStackTracesExtended(
+                        list_size, list, _max_stack_depth, (void**)&stack_info) != 0) {
+                    stack_info = NULL;
                 }
             }
 
-            int num_frames = Profiler::instance()->convertNativeTrace(notif->num_frames, notif->addr, frames);
+            for (int i = 0, info_index = 0; i < count; i++) {
+                jthread thread = batch_threads[i];
+                if (thread == NULL) {
+                    skip(batch[i]);
+                    continue;
+                }
 
-            for (int j = 0; j < num_jvmti_frames; j++) {
-                frames[num_frames].method_id = jvmti_frames[j].method;
-                frames[num_frames].bci = FrameType::encode(jvmti_frames[j].type, jvmti_frames[j].location);
-                num_frames++;
-            }
+                jvmtiFrameInfoExtended* java_frames;
+                jint num_jvmti_frames;
+                if (stack_info != NULL) {
+                    java_frames = stack_info[info_index].frame_buffer;
+                    num_jvmti_frames = stack_info[info_index].frame_count;
+                    info_index++;
+                } else if (J9Ext::GetStackTraceExtended(thread, 0, _max_stack_depth, jvmti_frames, &num_jvmti_frames) == 0) {
+                    java_frames = jvmti_frames;
+                } else {
+                    skip(batch[i]);
+                    continue;
+                }
 
-            int tid = J9Ext::GetOSThreadID(thread);
-            Profiler::instance()->recordExternalSample(notif->counter, tid, num_frames, frames);
+                J9StackTraceNotification* notif = batch[i];
+                int num_frames = Profiler::instance()->convertNativeTrace(notif->num_frames, notif->addr, frames);
 
-            ptr += notif->size();
+                for (int j = 0; j < num_jvmti_frames; j++) {
+                    frames[num_frames].method_id = java_frames[j].method;
+                    frames[num_frames].bci = FrameType::encode(java_frames[j].type, java_frames[j].location);
+                    num_frames++;
+                }
+
+                int tid = J9Ext::GetOSThreadID(thread);
+                Profiler::instance()->recordExternalSample(notif->counter, tid, num_frames, frames, 0, notif->time);
+            }
+
+            if (stack_info != NULL) {
+                jvmti->Deallocate((unsigned char*)stack_info);
+            }
+            release(count);
         }
     }
 
     free(jvmti_frames);
     free(frames);
 
+    // No new notifications after this point; the ones already queued would never be handled
     __atomic_store_n(&_self_env, NULL, __ATOMIC_RELEASE);
+    drain();
     VM::detachThread();
 }
 
@@ -175,9 +303,12 @@ void J9StackTraces::checkpoint(u64 counter, J9StackTraceNotification* notif) {
             vm_thread->setOverflowMark();
             notif->env = env;
             notif->counter = counter;
-            if (write(_pipe[1], notif, notif->size()) > 0) {
+            notif->time = TSC::ticks();
+            if (enqueue(notif)) {
                 return;
             }
+            // The sampler thread is behind: account for the lost sample instead of dropping it silently
+            Profiler::instance()->recordSkippedSample();
         }
         // Something went wrong - rollback
         vm_thread->clearFlag(J9_HALT_THREAD_INSPECTION);
@@ -18,15 +18,19 @@
 #define _J9STACKTRACES_H
 
 #include <pthread.h>
+#include <semaphore.h>
 #include "arch.h"
 #include "arguments.h"
 
 
 const int MAX_J9_NATIVE_FRAMES = 128;
+const int J9_QUEUE_SIZE = 256;   // must be a power of 2
+const int J9_BATCH_SIZE = 64;
 
 struct J9StackTraceNotification {
     void* env;
     u64 counter;
+    u64 time;  // ticks of the signal, as the stack is walked later
     int num_frames;
     int reserved;
     const void* addr[MAX_J9_NATIVE_FRAMES];
@@ -36,12 +40,24 @@ struct J9StackTraceNotification {
     }
 };
 
+// A slot of the bounded queue between signal handlers and the sampler thread.
+// The sequence number tells whether the slot is free for the given enqueue position
+// (seq == pos) or holds a published notification (seq == pos + 1)
+struct J9QueueSlot {
+    volatile u64 seq;
+    J9StackTraceNotification notif;
+};
+
 
 class J9StackTraces {
   private:
     static pthread_t _thread;
     static int _max_stack_depth;
-    static int _pipe[2];
+    static volatile bool _running;
+    static sem_t _pending;
+    static J9QueueSlot* _queue;
+    static volatile u64 _enqueue_pos;
+    static u64 _dequeue_pos;
 
     static void* threadEntry(void* unused) {
         timerLoop();
@@ -50,6 +66,12 @@ class J9StackTraces {
 
     static void timerLoop();
 
+    static bool enqueue(J9StackTraceNotification* notif);
+    static int dequeue(J9StackTraceNotification** batch, int max_count);
+    static void release(int count);
+    static void skip(J9StackTraceNotification* notif);
+    static void drain();
+
   public:
     static Error start(Arguments& args);
     static void stop();
@@ -21,10 +21,12 @@
 
 
 long J9WallClock::_interval;
+long J9WallClock::_base_interval;
 
 Error J9WallClock::start(Arguments& args) {
-    _interval = args._interval ? args._interval : DEFAULT_INTERVAL * 5;
+    _interval = _base_interval = args._interval ? args._interval : DEFAULT_INTERVAL * 5;
     _max_stack_depth = args._jstackdepth;
+    _threads_per_tick = args._wall_threads;
 
     _running = true;
 
@@ -47,6 +49,18 @@ void J9WallClock::timerLoop() {
 
     int max_frames = _max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES;
     ASGCT_CallFrame* frames = (ASGCT_CallFrame*)malloc(max_frames * sizeof(ASGCT_CallFrame));
+    jvmtiFrameInfoExtended* jvmti_frames = NULL;
+
+    // With a per-tick thread budget, every tick walks the next slice of the thread list,
+    // so that only a bounded number of threads is halted at a time
+    int threads_per_tick = _threads_per_tick;
+    if (threads_per_tick > 0 && !J9Ext::hasThreadListStackTraces()) {
+        jvmti_frames = (jvmtiFrameInfoExtended*)malloc(_max_stack_depth * sizeof(jvmtiFrameInfoExtended));
+    }
+
+    jthread* threads = NULL;
+    jint thread_count = 0;
+    jint next_thread = 0;
 
     while (_running) {
         if (!_enabled) {
@@ -54,30 +68,96 @@ void J9WallClock::timerLoop() {
             continue;
         }
 
-        jni->PushLocalFrame(64);
-
-        jvmtiStackInfoExtended* stack_infos;
-        jint thread_count;
-        if (J9Ext::GetAllStackTracesExtended(_max_stack_depth, (void**)&stack_infos, &thread_count) == 0) {
-            for (int i = 0; i < thread_count; i++) {
-                jvmtiStackInfoExtended* si = &stack_infos[i];
-                for (int j = 0; j < si->frame_count; j++) {
-                    jvmtiFrameInfoExtended* fi = &si->frame_buffer[j];
-                    frames[j].method_id = fi->method;
-                    frames[j].bci = FrameType::encode(fi->type, fi->location);
+        if (threads_per_tick <= 0) {
+            jni->PushLocalFrame(64);
+            sampleAllThreads(frames);
+            jni->PopLocalFrame(NULL);
+        } else {
+            if (next_thread >= thread_count) {
+                // Start the next round with a fresh list of threads
+                if (threads != NULL) {
+                    jvmti->Deallocate((unsigned char*)threads);
+                    jni->PopLocalFrame(NULL);
+                    threads = NULL;
+                }
+                jni->PushLocalFrame(64);
+                if (jvmti->GetAllThreads(&thread_count, &threads) != 0) {
+                    thread_count = 0;
                 }
-                int tid = J9Ext::GetOSThreadID(si->thread);
-                Profiler::instance()->recordExternalSample(_interval, tid, si->frame_count, frames);
+                next_thread = 0;
             }
-            jvmti->Deallocate((unsigned char*)stack_infos);
-        }
 
-        jni->PopLocalFrame(NULL);
+            if (thread_count > 0) {
+                // Each thread is sampled once per round, so its sample stands for the whole round
+                long round_ticks = (thread_count + threads_per_tick - 1) / threads_per_tick;
+                int count = thread_count - next_thread < threads_per_tick ? thread_count - next_thread : threads_per_tick;
+                sampleThreads(threads + next_thread, count, _interval * round_ticks, frames, jvmti_frames);
+                next_thread += count;
+            }
+        }
 
         OS::sleep(_interval);
     }
 
+    if (threads != NULL) {
+        jvmti->Deallocate((unsigned char*)threads);
+        jni->PopLocalFrame(NULL);
+    }
+
+    free(jvmti_frames);
     free(frames);
 
     VM::detachThread();
 }
+
+void J9WallClock::sampleAllThreads(ASGCT_CallFrame* frames) {
+    jvmtiStackInfoExtended* stack_infos;
+    jint thread_count;
+    if (J9Ext::GetAllStackTracesExtended(_max_stack_depth, (void**)&stack_infos, &thread_count) == 0) {
+        for (int i = 0; i < thread_count; i++) {
+            jvmtiStackInfoExtended* si = &stack_infos[i];
+            for (int j = 0; j < si->frame_count; j++) {
+                jvmtiFrameInfoExtended* fi = &si->frame_buffer[j];
+                frames[j].method_id = fi->method;
+                frames[j].bci = FrameType::encode(fi->type, fi->location);
+            }
+            int tid = J9Ext::GetOSThreadID(si->thread);
+            Profiler::instance()->recordExternalSample(_interval, tid, si->frame_count, frames);
+        }
+        VM::jvmti()->Deallocate((unsigned char*)stack_infos);
+    }
+}
+
+void J9WallClock::sampleThreads(jthread* threads, int count, long weight,
+                                ASGCT_CallFrame* frames, jvmtiFrameInfoExtended* jvmti_frames) {
+    jvmtiStackInfoExtended* stack_infos = NULL;
+    if (jvmti_frames == NULL &&
+        J9Ext::GetThreadListStackTracesExtended(count, threads, _max_stack_depth, (void**)&stack_infos) != 0) {
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        jvmtiFrameInfoExtended* fi;
+        jint frame_count;
+        if (stack_infos != NULL) {
+            fi = stack_infos[i].frame_buffer;
+            frame_count = stack_infos[i].frame_count;
+        } else if (J9Ext::GetStackTraceExtended(threads[i], 0, _max_stack_depth, jvmti_frames, &frame_count) == 0) {
+            fi = jvmti_frames;
+        } else {
+            // The thread has probably terminated since the round started
+            continue;
+        }
+
+        for (int j = 0; j < frame_count; j++) {
+            frames[j].method_id = fi[j].method;
+            frames[j].bci = FrameType::encode(fi[j].type, fi[j].location);
+        }
+        int tid = J9Ext::GetOSThreadID(threads[i]);
+        Profiler::instance()->recordExternalSample(weight, tid, frame_count, frames);
+    }
+
+    if (stack_infos != NULL) {
+        VM::jvmti()->Deallocate((unsigned char*)stack_infos);
+    }
+}
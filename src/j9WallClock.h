@@ -19,13 +19,16 @@
 
 #include <pthread.h>
 #include "engine.h"
+#include "j9Ext.h"
 
 
 class J9WallClock : public Engine {
   private:
     static long _interval;
+    static long _base_interval;
 
     int _max_stack_depth;
+    int _threads_per_tick;
     volatile bool _running;
     pthread_t _thread;
 
@@ -35,6 +38,9 @@ class J9WallClock : public Engine {
     }
 
     void timerLoop();
+    void sampleAllThreads(ASGCT_CallFrame* frames);
+    void sampleThreads(jthread* threads, int count, long weight,
+                       ASGCT_CallFrame* frames, jvmtiFrameInfoExtended* jvmti_frames);
 
   public:
     const char* title() {
@@ -47,6 +53,11 @@ class J9WallClock : public Engine {
 
     Error start(Arguments& args);
     void stop();
+
+    long scaleInterval(double factor) {
+        _interval = (long)(_base_interval * factor);
+        return _interval;
+    }
 };
 
 #endif // _J9WALLCLOCK_H
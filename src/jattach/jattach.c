@@ -14,10 +14,15 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/wait.h>
 #include "psutil.h"
 
 
@@ -64,25 +69,175 @@ int jattach(int pid, int argc, char** argv) {
     }
 }
 
+// Output of one target, collected from the stdout and stderr pipes of the child attaching to it
+struct target {
+    int pid;
+    pid_t child;
+    int fd[2];
+    char* buf[2];
+    size_t len[2];
+};
+
+// Replaces every %p in the arguments with the pid of the target
+static char** expand_pid(int pid, int argc, char** argv) {
+    char** result = (char**)malloc(argc * sizeof(char*));
+    int i;
+    for (i = 0; i < argc; i++) {
+        const char* arg = argv[i];
+        char* dst = result[i] = (char*)malloc(strlen(arg) * 4 + 1);
+        while (*arg != 0) {
+            if (arg[0] == '%' && arg[1] == 'p') {
+                dst += sprintf(dst, "%d", pid);
+                arg += 2;
+            } else {
+                *dst++ = *arg++;
+            }
+        }
+        *dst = 0;
+    }
+    return result;
+}
+
+// Each line is prefixed with the pid, since the output of several targets goes to one stream
+static void print_output(FILE* out, int pid, const char* buf, size_t len) {
+    size_t start = 0;
+    while (start < len) {
+        const char* eol = memchr(buf + start, '\n', len - start);
+        size_t end = eol != NULL ? (size_t)(eol - buf) : len;
+        fprintf(out, "%d: %.*s\n", pid, (int)(end - start), buf + start);
+        start = end + 1;
+    }
+}
+
+// Attaching changes credentials and namespaces of the whole process, so every target
+// is served by a child process of its own. All children run at once; their output is read
+// with poll() as it comes, and printed per target when the child exits, so that responses do not mix.
+// Returns the result of the first target in the list that failed, or 0
+static int jattach_all(const int* pids, int count, int argc, char** argv) {
+    struct target* targets = (struct target*)calloc(count, sizeof(struct target));
+    struct pollfd* fds = (struct pollfd*)calloc(count * 2, sizeof(struct pollfd));
+    int* results = (int*)calloc(count, sizeof(int));
+    int running = 0;
+    int i, j;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < count; i++) {
+        int out[2], err[2];
+        targets[i].pid = pids[i];
+        targets[i].fd[0] = targets[i].fd[1] = -1;
+        if (pipe(out) != 0 || pipe(err) != 0 || (targets[i].child = fork()) < 0) {
+            fprintf(stderr, "%d: Could not start attach: %s\n", pids[i], strerror(errno));
+            results[i] = 1;
+            continue;
+        }
+
+        if (targets[i].child == 0) {
+            dup2(out[1], STDOUT_FILENO);
+            dup2(err[1], STDERR_FILENO);
+            close(out[0]);
+            close(out[1]);
+            close(err[0]);
+            close(err[1]);
+            exit(jattach(pids[i], argc, expand_pid(pids[i], argc, argv)));
+        }
+
+        close(out[1]);
+        close(err[1]);
+        targets[i].fd[0] = out[0];
+        targets[i].fd[1] = err[0];
+        fcntl(out[0], F_SETFL, O_NONBLOCK);
+        fcntl(err[0], F_SETFL, O_NONBLOCK);
+        running++;
+    }
+
+    while (running > 0) {
+        for (i = 0; i < count; i++) {
+            for (j = 0; j < 2; j++) {
+                fds[i * 2 + j].fd = targets[i].fd[j];
+                fds[i * 2 + j].events = POLLIN;
+            }
+        }
+        if (poll(fds, count * 2, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        for (i = 0; i < count * 2; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+
+            struct target* t = &targets[i / 2];
+            int stream = i % 2;
+            char chunk[8192];
+            ssize_t bytes = read(fds[i].fd, chunk, sizeof(chunk));
+            if (bytes > 0) {
+                t->buf[stream] = (char*)realloc(t->buf[stream], t->len[stream] + bytes);
+                memcpy(t->buf[stream] + t->len[stream], chunk, bytes);
+                t->len[stream] += bytes;
+                continue;
+            } else if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+
+            close(t->fd[stream]);
+            t->fd[stream] = -1;
+            if (t->fd[0] < 0 && t->fd[1] < 0) {
+                int status;
+                waitpid(t->child, &status, 0);
+                results[i / 2] = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+                print_output(stdout, t->pid, t->buf[0], t->len[0]);
+                print_output(stderr, t->pid, t->buf[1], t->len[1]);
+                fflush(stdout);
+                running--;
+            }
+        }
+    }
+
+    int result = 0;
+    for (i = 0; i < count && result == 0; i++) {
+        result = results[i];
+    }
+    return result;
+}
+
 int main(int argc, char** argv) {
     if (argc < 3) {
         printf("jattach " JATTACH_VERSION " built on " __DATE__ "\n"
                "Copyright 2021 Andrei Pangin\n"
                "\n"
-               "Usage: jattach <pid> <cmd> [args ...]\n"
+               "Usage: jattach <pid>[,<pid>...] <cmd> [args ...]\n"
                "\n"
                "Commands:\n"
                "    load  threaddump   dumpheap  setflag    properties\n"
                "    jcmd  inspectheap  datadump  printflag  agentProperties\n"
+               "\n"
+               "Several processes are attached in parallel. Their output lines are prefixed\n"
+               "with the pid, and %%p in the arguments is replaced with the pid of every target.\n"
                );
         return 1;
     }
 
-    int pid = atoi(argv[1]);
-    if (pid <= 0) {
-        fprintf(stderr, "%s is not a valid process ID\n", argv[1]);
-        return 1;
+    int count = 1;
+    const char* p;
+    for (p = argv[1]; *p != 0; p++) {
+        if (*p == ',') count++;
     }
 
-    return jattach(pid, argc - 2, argv + 2);
+    int* pids = (int*)malloc(count * sizeof(int));
+    char* next = argv[1];
+    int i;
+    for (i = 0; i < count; i++) {
+        pids[i] = (int)strtol(next, &next, 10);
+        if (pids[i] <= 0 || (*next != 0 && *next != ',')) {
+            fprintf(stderr, "%s is not a valid process ID\n", argv[1]);
+            return 1;
+        }
+        next++;
+    }
+
+    if (count == 1) {
+        return jattach(pids[0], argc - 2, argv + 2);
+    }
+    return jattach_all(pids, count, argc - 2, argv + 2);
 }
@@ -17,11 +17,13 @@
 #include <fstream>
 #include <sstream>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include "javaApi.h"
 #include "arguments.h"
 #include "os.h"
 #include "profiler.h"
+#include "threadContext.h"
 #include "vmStructs.h"
 
 
@@ -55,23 +57,8 @@ Java_one_profiler_AsyncProfiler_stop0(JNIEnv* env, jobject unused) {
     }
 }
 
-extern "C" DLLEXPORT jstring JNICALL
-Java_one_profiler_AsyncProfiler_execute0(JNIEnv* env, jobject unused, jstring command) {
-    Arguments args;
-    const char* command_str = env->GetStringUTFChars(command, NULL);
-    Error error = args.parse(command_str);
-    env->ReleaseStringUTFChars(command, command_str);
-
-    if (error) {
-        JavaAPI::throwNew(env, "java/lang/IllegalArgumentException", error.message());
-        return NULL;
-    }
-
-    Log::open(args._log, args._loglevel);
-    if (args._unknown_arg != NULL) {
-        Log::warn("Unknown argument: %s", args._unknown_arg);
-    }
-
+static jstring runCommand(JNIEnv* env, Arguments& args) {
+    Error error = Error::OK;
     if (!args.hasOutputFile()) {
         std::ostringstream out;
         error = Profiler::instance()->runInternal(args, out);
@@ -99,11 +86,219 @@ Java_one_profiler_AsyncProfiler_execute0(JNIEnv* env, jobject unused, jstring co
     return NULL;
 }
 
+static Error parseCommand(JNIEnv* env, jstring command, Arguments& args) {
+    const char* command_str = env->GetStringUTFChars(command, NULL);
+    Error error = args.parse(command_str);
+    env->ReleaseStringUTFChars(command, command_str);
+    if (error) {
+        return error;
+    }
+
+    Log::open(args._log, args._loglevel);
+    if (args._unknown_arg != NULL) {
+        Log::warn("Unknown argument: %s", args._unknown_arg);
+    }
+    return Error::OK;
+}
+
+extern "C" DLLEXPORT jstring JNICALL
+Java_one_profiler_AsyncProfiler_execute0(JNIEnv* env, jobject unused, jstring command) {
+    Arguments args;
+    Error error = parseCommand(env, command, args);
+    if (error) {
+        JavaAPI::throwNew(env, "java/lang/IllegalArgumentException", error.message());
+        return NULL;
+    }
+    return runCommand(env, args);
+}
+
+// A command parsed once and executed many times, e.g. by a controller that polls the profiler.
+// The handle is a pointer to the heap allocated Arguments
+extern "C" DLLEXPORT jlong JNICALL
+Java_one_profiler_AsyncProfiler_parseCommand0(JNIEnv* env, jobject unused, jstring command) {
+    Arguments* args = new Arguments();
+    Error error = parseCommand(env, command, *args);
+    if (error) {
+        delete args;
+        JavaAPI::throwNew(env, "java/lang/IllegalArgumentException", error.message());
+        return 0;
+    }
+    return (jlong)(uintptr_t)args;
+}
+
+extern "C" DLLEXPORT jstring JNICALL
+Java_one_profiler_AsyncProfiler_executeCommand0(JNIEnv* env, jobject unused, jlong command) {
+    return runCommand(env, *(Arguments*)(uintptr_t)command);
+}
+
+extern "C" DLLEXPORT void JNICALL
+Java_one_profiler_AsyncProfiler_releaseCommand0(JNIEnv* env, jobject unused, jlong command) {
+    delete (Arguments*)(uintptr_t)command;
+}
+
+// Writes to the memory of a direct ByteBuffer. Bytes that do not fit are only counted,
+// so that the caller learns how large the buffer should be
+class DirectBufferStream : public std::streambuf {
+  private:
+    char _scratch[256];
+    size_t _capacity;
+    size_t _discarded;
+    bool _overflowed;
+
+  public:
+    DirectBufferStream(char* start, size_t capacity) : _capacity(capacity), _discarded(0), _overflowed(false) {
+        setp(start, start + capacity);
+    }
+
+    size_t size() {
+        return _overflowed ? _capacity + _discarded + (pptr() - pbase()) : pptr() - pbase();
+    }
+
+  protected:
+    int_type overflow(int_type c) {
+        if (_overflowed) {
+            _discarded += pptr() - pbase();
+        }
+        _overflowed = true;
+        setp(_scratch, _scratch + sizeof(_scratch));
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+};
+
+// Passes data to OutputStream.write() in pieces of the Java array size
+class OutputStreamBuffer : public std::streambuf {
+  private:
+    JNIEnv* _env;
+    jobject _stream;
+    jbyteArray _array;
+    jmethodID _write;
+    char* _buf;
+    jint _size;
+    bool _failed;
+
+    bool writeBuffer() {
+        jint length = pptr() - pbase();
+        if (length > 0 && !_failed) {
+            _env->SetByteArrayRegion(_array, 0, length, (jbyte*)_buf);
+            _env->CallVoidMethod(_stream, _write, _array, 0, length);
+            if (_env->ExceptionCheck()) {
+                _failed = true;
+                return false;
+            }
+            setp(_buf, _buf + _size);
+        }
+        return !_failed;
+    }
+
+  public:
+    OutputStreamBuffer(JNIEnv* env, jobject stream, jbyteArray array) : _env(env), _stream(stream), _array(array) {
+        _write = env->GetMethodID(env->GetObjectClass(stream), "write", "([BII)V");
+        _size = env->GetArrayLength(array);
+        _buf = (char*)malloc(_size);
+        setp(_buf, _buf + _size);
+        _failed = _write == NULL;
+    }
+
+    ~OutputStreamBuffer() {
+        free(_buf);
+    }
+
+  protected:
+    int_type overflow(int_type c) {
+        if (!writeBuffer()) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() {
+        return writeBuffer() ? 0 : -1;
+    }
+};
+
+static Error parseDumpCommand(JNIEnv* env, jstring command, Arguments& args) {
+    const char* command_str = env->GetStringUTFChars(command, NULL);
+    Error error = args.parse(command_str);
+    env->ReleaseStringUTFChars(command, command_str);
+    return error;
+}
+
+extern "C" DLLEXPORT jlong JNICALL
+Java_one_profiler_AsyncProfiler_dumpBinary0(JNIEnv* env, jobject unused, jstring command, jobject buffer, jint position, jint limit) {
+    Arguments args;
+    Error error = parseDumpCommand(env, command, args);
+    if (error) {
+        JavaAPI::throwNew(env, "java/lang/IllegalArgumentException", error.message());
+        return 0;
+    }
+
+    char* address = (char*)env->GetDirectBufferAddress(buffer);
+    jlong capacity = env->GetDirectBufferCapacity(buffer);
+    if (address == NULL || position < 0 || position > limit || limit > capacity) {
+        JavaAPI::throwNew(env, "java/lang/IllegalArgumentException", "Direct buffer required");
+        return 0;
+    }
+
+    DirectBufferStream buf(address + position, limit - position);
+    std::ostream out(&buf);
+    error = Profiler::instance()->runInternal(args, out);
+    if (error) {
+        JavaAPI::throwNew(env, "java/lang/IllegalStateException", error.message());
+        return 0;
+    }
+    return buf.size();
+}
+
+extern "C" DLLEXPORT void JNICALL
+Java_one_profiler_AsyncProfiler_dumpBinary1(JNIEnv* env, jobject unused, jstring command, jobject stream, jbyteArray array) {
+    Arguments args;
+    Error error = parseDumpCommand(env, command, args);
+    if (error) {
+        JavaAPI::throwNew(env, "java/lang/IllegalArgumentException", error.message());
+        return;
+    }
+
+    OutputStreamBuffer buf(env, stream, array);
+    std::ostream out(&buf);
+    error = Profiler::instance()->runInternal(args, out);
+    out.flush();
+
+    // An exception thrown by OutputStream is already pending
+    if (error && !env->ExceptionCheck()) {
+        JavaAPI::throwNew(env, "java/lang/IllegalStateException", error.message());
+    }
+}
+
 extern "C" DLLEXPORT jlong JNICALL
 Java_one_profiler_AsyncProfiler_getSamples(JNIEnv* env, jobject unused) {
     return (jlong)Profiler::instance()->total_samples();
 }
 
+// Copies the counters into the caller's array without allocating or locking the profiler,
+// so that it can be polled at a high rate. Returns the number of available counters
+extern "C" DLLEXPORT jint JNICALL
+Java_one_profiler_AsyncProfiler_getStats0(JNIEnv* env, jobject unused, jlongArray stats) {
+    jlong values[STAT_COUNT];
+    Profiler::instance()->getStats((u64*)values);
+
+    jint length = env->GetArrayLength(stats);
+    env->SetLongArrayRegion(stats, 0, length < STAT_COUNT ? length : STAT_COUNT, values);
+    return STAT_COUNT;
+}
+
+extern "C" DLLEXPORT void JNICALL
+Java_one_profiler_AsyncProfiler_setContext0(JNIEnv* env, jobject unused, jlong context_id) {
+    ThreadContext::set(OS::threadId(), (u64)context_id);
+}
+
 extern "C" DLLEXPORT void JNICALL
 Java_one_profiler_AsyncProfiler_filterThread0(JNIEnv* env, jobject unused, jthread thread, jboolean enable) {
     int thread_id;
@@ -125,11 +320,18 @@ Java_one_profiler_AsyncProfiler_filterThread0(JNIEnv* env, jobject unused, jthre
 #define F(name, sig)  {(char*)#name, (char*)sig, (void*)Java_one_profiler_AsyncProfiler_##name}
 
 static const JNINativeMethod profiler_natives[] = {
-    F(start0,        "(Ljava/lang/String;JZ)V"),
-    F(stop0,         "()V"),
-    F(execute0,      "(Ljava/lang/String;)Ljava/lang/String;"),
-    F(getSamples,    "()J"),
-    F(filterThread0, "(Ljava/lang/Thread;Z)V"),
+    F(start0,          "(Ljava/lang/String;JZ)V"),
+    F(stop0,           "()V"),
+    F(execute0,        "(Ljava/lang/String;)Ljava/lang/String;"),
+    F(parseCommand0,   "(Ljava/lang/String;)J"),
+    F(executeCommand0, "(J)Ljava/lang/String;"),
+    F(releaseCommand0, "(J)V"),
+    F(dumpBinary0,     "(Ljava/lang/String;Ljava/nio/ByteBuffer;II)J"),
+    F(dumpBinary1,     "(Ljava/lang/String;Ljava/io/OutputStream;[B)V"),
+    F(getSamples,      "()J"),
+    F(getStats0,       "([J)I"),
+    F(setContext0,     "(J)V"),
+    F(filterThread0,   "(Ljava/lang/Thread;Z)V"),
 };
 
 #undef F
@@ -85,12 +85,19 @@ JfrMetadata::JfrMetadata() : Element("root") {
             << (type("profiler.types.LogLevel", T_LOG_LEVEL, "Log Level", true)
                 << field("name", T_STRING, "Name"))
 
+            << (type("profiler.types.SampledEvent", T_SAMPLED_EVENT, "Sampled Event", true)
+                << field("name", T_STRING, "Name"))
+
             << (type("jdk.ExecutionSample", T_EXECUTION_SAMPLE, "Method Profiling Sample")
                 << category("Java Virtual Machine", "Profiling")
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
                 << field("sampledThread", T_THREAD, "Thread", F_CPOOL)
                 << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
-                << field("state", T_THREAD_STATE, "Thread State", F_CPOOL))
+                << field("state", T_THREAD_STATE, "Thread State", F_CPOOL)
+                << field("event", T_SAMPLED_EVENT, "Sampled Event", F_CPOOL)
+                << field("contextId", T_LONG, "Context ID")
+                << field("cpu", T_INT, "CPU")
+                << field("numaNode", T_INT, "NUMA Node"))
 
             << (type("jdk.ObjectAllocationInNewTLAB", T_ALLOC_IN_NEW_TLAB, "Allocation in new TLAB")
                 << category("Java Application")
@@ -99,7 +106,8 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
                 << field("objectClass", T_CLASS, "Object Class", F_CPOOL)
                 << field("allocationSize", T_LONG, "Allocation Size", F_BYTES)
-                << field("tlabSize", T_LONG, "TLAB Size", F_BYTES))
+                << field("tlabSize", T_LONG, "TLAB Size", F_BYTES)
+                << field("contextId", T_LONG, "Context ID"))
 
             << (type("jdk.ObjectAllocationOutsideTLAB", T_ALLOC_OUTSIDE_TLAB, "Allocation outside TLAB")
                 << category("Java Application")
@@ -107,7 +115,8 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
                 << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
                 << field("objectClass", T_CLASS, "Object Class", F_CPOOL)
-                << field("allocationSize", T_LONG, "Allocation Size", F_BYTES))
+                << field("allocationSize", T_LONG, "Allocation Size", F_BYTES)
+                << field("contextId", T_LONG, "Context ID"))
 
             << (type("jdk.JavaMonitorEnter", T_MONITOR_ENTER, "Java Monitor Blocked")
                 << category("Java Application")
@@ -137,6 +146,31 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("jvmSystem", T_FLOAT, "JVM System", F_PERCENTAGE)
                 << field("machineTotal", T_FLOAT, "Machine Total", F_PERCENTAGE))
 
+            << (type("jdk.ThreadCPULoad", T_THREAD_CPU_LOAD, "Thread CPU Load")
+                << category("Operating System", "Processor")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("user", T_FLOAT, "User Mode CPU Load", F_PERCENTAGE)
+                << field("system", T_FLOAT, "System Mode CPU Load", F_PERCENTAGE))
+
+            << (type("profiler.ProcessStats", T_PROCESS_STATS, "Process Statistics")
+                << category("Operating System", "Memory")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("rss", T_LONG, "Resident Set Size", F_BYTES)
+                << field("nativeHeap", T_LONG, "Native Heap Used", F_BYTES)
+                << field("voluntarySwitches", T_LONG, "Voluntary Context Switches")
+                << field("involuntarySwitches", T_LONG, "Involuntary Context Switches")
+                << field("minorFaults", T_LONG, "Minor Page Faults")
+                << field("majorFaults", T_LONG, "Major Page Faults"))
+
+            << (type("profiler.CpuThrottling", T_CPU_THROTTLING, "CPU Throttling")
+                << category("Operating System", "Processor")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("periods", T_LONG, "Enforcement Periods")
+                << field("throttledPeriods", T_LONG, "Throttled Periods")
+                << field("throttledTime", T_LONG, "Throttled Time", F_DURATION_NANOS)
+                << field("quota", T_FLOAT, "CPU Quota"))
+
             << (type("jdk.ActiveRecording", T_ACTIVE_RECORDING, "Async-profiler Recording")
                 << category("Flight Recorder")
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
@@ -204,6 +238,74 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("level", T_LOG_LEVEL, "Level", F_CPOOL)
                 << field("message", T_STRING, "Message"))
 
+            << (type("profiler.Overhead", T_PROFILER_OVERHEAD, "Profiler Overhead")
+                << category("Profiler")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("cpuSampleTime", T_LONG, "CPU Sample Time", F_DURATION_TICKS)
+                << field("allocSampleTime", T_LONG, "Allocation Sample Time", F_DURATION_TICKS)
+                << field("lockSampleTime", T_LONG, "Lock Sample Time", F_DURATION_TICKS)
+                << field("otherSampleTime", T_LONG, "Other Sample Time", F_DURATION_TICKS)
+                << field("nativeTraceTime", T_LONG, "Native Stack Walking Time", F_DURATION_TICKS)
+                << field("javaTraceTime", T_LONG, "Java Stack Walking Time", F_DURATION_TICKS)
+                << field("callTracePutTime", T_LONG, "Call Trace Storage Time", F_DURATION_TICKS)
+                << field("bytesWritten", T_LONG, "Bytes Written", F_BYTES)
+                << field("writeTime", T_LONG, "Write Time", F_DURATION_TICKS)
+                << field("flushTime", T_LONG, "Chunk Flush Time", F_DURATION_TICKS))
+
+            << (type("profiler.LiveObject", T_LIVE_OBJECT, "Live Object")
+                << category("Java Application")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("objectClass", T_CLASS, "Object Class", F_CPOOL)
+                << field("allocationSize", T_LONG, "Allocation Size", F_BYTES)
+                << field("allocationTime", T_LONG, "Allocation Time", F_TIME_TICKS))
+
+            << (type("profiler.AllocationBatch", T_ALLOC_BATCH, "Allocation Batch")
+                << category("Java Application")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("duration", T_LONG, "Duration", F_DURATION_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("objectClass", T_CLASS, "Object Class", F_CPOOL)
+                << field("outsideTLAB", T_BOOLEAN, "Outside TLAB")
+                << field("samples", T_INT, "Samples")
+                << field("allocationSize", T_LONG, "Total Allocation Size", F_BYTES)
+                << field("contextId", T_LONG, "Context ID"))
+
+            << (type("profiler.Malloc", T_MALLOC, "Native Allocation")
+                << category("Native Memory")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("address", T_LONG, "Address", F_ADDRESS)
+                << field("size", T_LONG, "Size", F_BYTES))
+
+            << (type("profiler.OffCPU", T_OFF_CPU, "Off-CPU Sample")
+                << category("Java Virtual Machine", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("duration", T_LONG, "Duration", F_DURATION_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL))
+
+            << (type("profiler.GCPause", T_GC_PAUSE, "GC Pause")
+                << category("Java Virtual Machine", "GC")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("duration", T_LONG, "Duration", F_DURATION_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL))
+
+            << (type("profiler.LatencyHistogram", T_LATENCY_HISTOGRAM, "Latency Histogram")
+                << category("Java Application")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("count", T_LONG, "Count")
+                << field("p50", T_LONG, "Median", F_DURATION_NANOS)
+                << field("p90", T_LONG, "90th Percentile", F_DURATION_NANOS)
+                << field("p99", T_LONG, "99th Percentile", F_DURATION_NANOS)
+                << field("p999", T_LONG, "99.9th Percentile", F_DURATION_NANOS)
+                << field("max", T_LONG, "Maximum", F_DURATION_NANOS))
+
             << (type("jdk.jfr.Label", T_LABEL, NULL)
                 << field("value", T_STRING))
 
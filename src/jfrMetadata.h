@@ -49,6 +49,7 @@ enum JfrType {
     T_PACKAGE = 29,
     T_SYMBOL = 30,
     T_LOG_LEVEL = 31,
+    T_SAMPLED_EVENT = 32,
 
     T_EVENT = 100,
     T_EXECUTION_SAMPLE = 101,
@@ -65,6 +66,16 @@ enum JfrType {
     T_INITIAL_SYSTEM_PROPERTY = 112,
     T_NATIVE_LIBRARY = 113,
     T_LOG = 114,
+    T_PROFILER_OVERHEAD = 115,
+    T_LIVE_OBJECT = 116,
+    T_MALLOC = 117,
+    T_OFF_CPU = 118,
+    T_LATENCY_HISTOGRAM = 119,
+    T_THREAD_CPU_LOAD = 120,
+    T_PROCESS_STATS = 121,
+    T_CPU_THROTTLING = 122,
+    T_ALLOC_BATCH = 123,
+    T_GC_PAUSE = 124,
 
     T_ANNOTATION = 200,
     T_LABEL = 201,
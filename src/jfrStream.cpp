@@ -0,0 +1,388 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "gzip.h"
+#include "jfrStream.h"
+#include "log.h"
+#include "os.h"
+
+
+const int CONNECT_TIMEOUT_MS = 5000;
+const int SEND_TIMEOUT_SEC = 10;
+const u64 MIN_BACKOFF = 1000000;    // us
+const u64 MAX_BACKOFF = 60000000;   // us
+const size_t SEND_BLOCK_SIZE = 65536;
+
+
+JfrStream::JfrStream() : _address(NULL), _port(0), _unix_socket(false), _file_output(false), _compress(false), _socket(-1),
+    _reconnect_time(0), _backoff(MIN_BACKOFF), _running(false), _chunks(),
+    _sent_chunks(0), _dropped_chunks(0) {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+    pthread_cond_init(&_space, NULL);
+}
+
+JfrStream::~JfrStream() {
+    for (size_t i = 0; i < _chunks.size(); i++) {
+        close(_chunks[i].fd);
+    }
+    disconnect();
+    free(_address);
+    pthread_cond_destroy(&_space);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+}
+
+bool JfrStream::isStreamUrl(const char* url) {
+    return strncmp(url, "tcp://", 6) == 0 || strncmp(url, "unix:", 5) == 0;
+}
+
+int JfrStream::createChunkFile() {
+    const char* tmpdir = getenv("TMPDIR");
+    char path[256];
+    snprintf(path, sizeof(path), "%s/async-profiler-chunk.XXXXXX", tmpdir != NULL ? tmpdir : "/tmp");
+
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        Log::warn("Could not create JFR chunk file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+Error JfrStream::start(const char* url, bool compress) {
+    _compress = compress;
+    if (strncmp(url, "unix:", 5) == 0) {
+        if (strlen(url + 5) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+            return Error("Unix socket path is too long");
+        }
+        _address = strdup(url + 5);
+        _unix_socket = true;
+    } else {
+        const char* host = url + 6;
+        const char* colon = strrchr(host, ':');
+        if (colon == NULL || (_port = atoi(colon + 1)) <= 0 || _port > 65535) {
+            return Error("JFR stream address must be tcp://host:port");
+        }
+        // Allow IPv6 literals in brackets: tcp://[::1]:port
+        if (host[0] == '[' && colon[-1] == ']') {
+            _address = strndup(host + 1, colon - host - 2);
+        } else {
+            _address = strndup(host, colon - host);
+        }
+    }
+
+    return start(-1);
+}
+
+Error JfrStream::start(int fd) {
+    if (fd != -1) {
+        _address = strdup("file");
+        _file_output = true;
+        _compress = true;
+        _socket = fd;
+    }
+
+    if (_compress && !Gzip::load()) {
+        return Error("Compressed JFR output requires zlib");
+    }
+
+    _running = true;
+    if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
+        _running = false;
+        return Error("Unable to create JFR stream thread");
+    }
+
+    return Error::OK;
+}
+
+void JfrStream::stop() {
+    pthread_mutex_lock(&_lock);
+    bool running = _running;
+    _running = false;
+    pthread_cond_signal(&_cond);
+    pthread_cond_broadcast(&_space);
+    pthread_mutex_unlock(&_lock);
+
+    if (running) {
+        pthread_join(_thread, NULL);
+    }
+
+    if (_dropped_chunks > 0) {
+        Log::warn("JFR stream dropped %llu of %llu chunks", (unsigned long long)_dropped_chunks,
+                  (unsigned long long)(_dropped_chunks + _sent_chunks));
+    }
+}
+
+void JfrStream::submit(int fd, size_t size) {
+    pthread_mutex_lock(&_lock);
+
+    if (_chunks.size() >= MAX_PENDING_CHUNKS) {
+        if (_socket != -1) {
+            // The collector is slower than the recording: wait rather than lose data
+            Log::warn("JFR stream to %s is behind by %d chunks, recording waits", _address, (int)_chunks.size());
+            while (_chunks.size() >= MAX_PENDING_CHUNKS && _running && _socket != -1) {
+                pthread_cond_wait(&_space, &_lock);
+            }
+        }
+        if (_chunks.size() >= MAX_PENDING_CHUNKS) {
+            // No connection to send over: discard the oldest chunk, except the one being sent
+            std::deque<PendingChunk>::iterator victim = _chunks.begin() + 1;
+            close(victim->fd);
+            _chunks.erase(victim);
+            _dropped_chunks++;
+            Log::warn("JFR stream to %s is not connected, dropped a chunk", _address);
+        }
+    }
+
+    PendingChunk chunk = {fd, size};
+    _chunks.push_back(chunk);
+
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+}
+
+void JfrStream::senderLoop() {
+    pthread_mutex_lock(&_lock);
+
+    while (true) {
+        while (_running && _chunks.empty()) {
+            pthread_cond_wait(&_cond, &_lock);
+        }
+        if (_chunks.empty()) {
+            break;
+        }
+
+        PendingChunk chunk = _chunks.front();
+        bool running = _running;
+        pthread_mutex_unlock(&_lock);
+
+        // Do not wait for the backoff period when the recording is over: try once and give up
+        bool sent = false;
+        if ((_socket != -1 || ((OS::micros() >= _reconnect_time || !running) && connectSocket()))) {
+            sent = _compress ? sendCompressedChunk(chunk.fd, chunk.size) : sendChunk(chunk.fd, chunk.size);
+            if (!sent) {
+                Log::warn("Failed to send JFR chunk to %s: %s", _address, strerror(errno));
+                if (!_file_output) {
+                    disconnect();
+                }
+            }
+        }
+
+        pthread_mutex_lock(&_lock);
+
+        // There is no point in retrying a local file
+        if (sent || !running || _file_output) {
+            // The head of the queue is never removed by submit(), so it is still the same chunk
+            close(chunk.fd);
+            _chunks.pop_front();
+            pthread_cond_signal(&_space);
+            if (sent) {
+                _sent_chunks++;
+            } else {
+                _dropped_chunks++;
+            }
+        } else if (_running) {
+            // The connection is lost: a waiting submit() may drop a chunk now
+            pthread_cond_signal(&_space);
+            // Sleep until the next reconnect attempt or until stop()
+            u64 now = OS::micros();
+            if (_reconnect_time > now) {
+                struct timeval tv;
+                gettimeofday(&tv, NULL);
+                u64 deadline = (u64)tv.tv_sec * 1000000 + tv.tv_usec + (_reconnect_time - now);
+                struct timespec ts = {(time_t)(deadline / 1000000), (long)(deadline % 1000000) * 1000};
+                pthread_cond_timedwait(&_cond, &_lock, &ts);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&_lock);
+}
+
+bool JfrStream::connectSocket() {
+    int fd = -1;
+
+    if (_unix_socket) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, _address);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        char port[16];
+        snprintf(port, sizeof(port), "%d", _port);
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        struct addrinfo* res;
+        if (getaddrinfo(_address, port, &hints, &res) == 0) {
+            for (struct addrinfo* ai = res; ai != NULL && fd == -1; ai = ai->ai_next) {
+                if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+                    continue;
+                }
+
+                // Non-blocking connect with a timeout, so that an unreachable host does not delay stop()
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                int result = connect(fd, ai->ai_addr, ai->ai_addrlen);
+                if (result != 0 && errno == EINPROGRESS) {
+                    struct pollfd pfd = {fd, POLLOUT, 0};
+                    int error = ETIMEDOUT;
+                    socklen_t len = sizeof(error);
+                    if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) == 1) {
+                        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                    }
+                    result = error == 0 ? 0 : -1;
+                    errno = error;
+                }
+
+                if (result == 0) {
+                    fcntl(fd, F_SETFL, 0);
+                } else {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            freeaddrinfo(res);
+        }
+    }
+
+    if (fd == -1) {
+        Log::debug("Could not connect JFR stream to %s: %s", _address, strerror(errno));
+        _reconnect_time = OS::micros() + _backoff;
+        _backoff = _backoff * 2 < MAX_BACKOFF ? _backoff * 2 : MAX_BACKOFF;
+        return false;
+    }
+
+    // A stalled collector turns into a send error instead of blocking the sender forever
+    struct timeval timeout = {SEND_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    _socket = fd;
+    _backoff = MIN_BACKOFF;
+    Log::debug("JFR stream connected to %s", _address);
+    return true;
+}
+
+void JfrStream::disconnect() {
+    if (_socket != -1) {
+        close(_socket);
+        _socket = -1;
+        _reconnect_time = OS::micros() + _backoff;
+    }
+}
+
+bool JfrStream::sendBytes(const char* data, size_t size) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+
+    while (size > 0) {
+        ssize_t result = _file_output ? write(_socket, data, size) : send(_socket, data, size, flags);
+        if (result <= 0) {
+            if (result < 0 && errno == EINTR) continue;
+            return false;
+        }
+        data += result;
+        size -= result;
+    }
+    return true;
+}
+
+bool JfrStream::sendChunk(int fd, size_t size) {
+    char* buf = (char*)malloc(SEND_BLOCK_SIZE);
+    if (buf == NULL) {
+        return false;
+    }
+
+    bool success = true;
+    for (off_t offset = 0; success && offset < (off_t)size; ) {
+        ssize_t bytes = pread(fd, buf, size - offset < SEND_BLOCK_SIZE ? size - offset : SEND_BLOCK_SIZE, offset);
+        success = bytes > 0 && sendBytes(buf, bytes);
+        offset += bytes;
+    }
+
+    free(buf);
+    return success;
+}
+
+// Compresses the chunk as a standalone gzip member
+bool JfrStream::sendCompressedChunk(int fd, size_t size) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (Gzip::init(&zs) != Z_OK) {
+        return false;
+    }
+
+    char* buf = (char*)malloc(SEND_BLOCK_SIZE * 2);
+    if (buf == NULL) {
+        Gzip::end(&zs);
+        return false;
+    }
+    char* out = buf + SEND_BLOCK_SIZE;
+
+    bool success = true;
+    off_t offset = 0;
+    int flush;
+    do {
+        ssize_t bytes = pread(fd, buf, size - offset < SEND_BLOCK_SIZE ? size - offset : SEND_BLOCK_SIZE, offset);
+        if (bytes < 0 || (bytes == 0 && offset < (off_t)size)) {
+            success = false;
+            break;
+        }
+        offset += bytes;
+        flush = offset >= (off_t)size ? Z_FINISH : Z_NO_FLUSH;
+
+        zs.next_in = (Bytef*)buf;
+        zs.avail_in = bytes;
+        do {
+            zs.next_out = (Bytef*)out;
+            zs.avail_out = SEND_BLOCK_SIZE;
+            Gzip::deflate(&zs, flush);
+            success = sendBytes(out, SEND_BLOCK_SIZE - zs.avail_out);
+        } while (success && zs.avail_out == 0);
+    } while (success && flush != Z_FINISH);
+
+    Gzip::end(&zs);
+    free(buf);
+    return success;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _JFRSTREAM_H
+#define _JFRSTREAM_H
+
+#include <deque>
+#include <pthread.h>
+#include <sys/types.h>
+#include "arch.h"
+#include "arguments.h"
+
+
+const int MAX_PENDING_CHUNKS = 4;
+
+// Sends finished JFR chunks to a remote collector (file=tcp://host:port or file=unix:/path)
+// or, when compression is enabled, to a local file.
+// Every chunk is written to its own unlinked temporary file, since the chunk header
+// is patched after the chunk is complete, and then handed to the sender thread.
+// The destination receives a concatenation of self-contained chunks. With compression,
+// each chunk becomes a separate gzip member, so the output is also a valid .gz file.
+//
+// Back-pressure: at most MAX_PENDING_CHUNKS chunks wait for sending;
+// when the collector is slower, the recorder waits for the sender to catch up.
+// Only when there is no connection to send over, the oldest chunks are dropped.
+// A failed connection is re-established with exponential backoff;
+// a chunk that has not been sent completely is resent from the beginning on a new connection.
+class JfrStream {
+  private:
+    struct PendingChunk {
+        int fd;
+        size_t size;
+    };
+
+    char* _address;
+    int _port;
+    bool _unix_socket;
+    bool _file_output;
+    bool _compress;
+    int _socket;
+    u64 _reconnect_time;
+    u64 _backoff;
+
+    pthread_t _thread;
+    pthread_mutex_t _lock;
+    pthread_cond_t _cond;
+    pthread_cond_t _space;
+    bool _running;
+    std::deque<PendingChunk> _chunks;
+
+    u64 _sent_chunks;
+    u64 _dropped_chunks;
+
+    static void* threadEntry(void* stream) {
+        ((JfrStream*)stream)->senderLoop();
+        return NULL;
+    }
+
+    void senderLoop();
+    bool connectSocket();
+    void disconnect();
+    bool sendChunk(int fd, size_t size);
+    bool sendCompressedChunk(int fd, size_t size);
+    bool sendBytes(const char* data, size_t size);
+
+  public:
+    JfrStream();
+    ~JfrStream();
+
+    static bool isStreamUrl(const char* url);
+
+    // Creates an anonymous file for the next chunk
+    static int createChunkFile();
+
+    Error start(const char* url, bool compress);
+
+    // Writes compressed chunks to a local file; takes ownership of fd
+    Error start(int fd);
+    void stop();
+
+    // Takes ownership of fd
+    void submit(int fd, size_t size);
+};
+
+#endif // _JFRSTREAM_H
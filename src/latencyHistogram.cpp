@@ -0,0 +1,128 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "latencyHistogram.h"
+
+
+u64 LatencyEntry::percentile(double p) const {
+    u64 target = (u64)(count * p);
+    if (target >= count) target = count - 1;
+
+    u64 seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > target) {
+            u64 limit = LatencyHistogram::bucketLimit(i);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
+
+// Leaves the values recorded since the earlier copy of the same entry. The largest of them
+// is exact only if it raised the maximum, otherwise it is bounded by the top non-empty bucket
+void LatencyEntry::subtract(const LatencyEntry& earlier) {
+    count = 0;
+    int top = -1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        buckets[i] -= earlier.buckets[i];
+        if (buckets[i] != 0) {
+            count += buckets[i];
+            top = i;
+        }
+    }
+
+    if (max <= earlier.max && top >= 0) {
+        u64 limit = LatencyHistogram::bucketLimit(top);
+        if (limit < max) max = limit;
+    }
+}
+
+bool LatencyHistogram::init(u32 capacity) {
+    if (_entries == NULL) {
+        _entries = (LatencyEntry*)calloc(capacity, sizeof(LatencyEntry));
+        _capacity = _entries != NULL ? capacity : 0;
+    }
+    return _entries != NULL;
+}
+
+void LatencyHistogram::clear() {
+    if (_entries != NULL) {
+        memset(_entries, 0, (size_t)_capacity * sizeof(LatencyEntry));
+    }
+    _overflow = 0;
+}
+
+int LatencyHistogram::bucketOf(u64 value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// The largest value that falls into the bucket
+u64 LatencyHistogram::bucketLimit(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    u64 low = (u64)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+void LatencyHistogram::record(u64 key, u64 value) {
+    u32 mask = _capacity - 1;
+    u32 slot = (u32)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+
+    for (u32 step = 1; step <= 16; step++) {
+        LatencyEntry* e = &_entries[slot];
+        u64 prev = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+        if (prev == 0 && __sync_bool_compare_and_swap(&e->key, 0, key)) {
+            prev = key;
+        } else if (prev == 0) {
+            prev = e->key;
+        }
+
+        if (prev == key) {
+            __sync_fetch_and_add(&e->buckets[bucketOf(value)], 1);
+            __sync_fetch_and_add(&e->count, 1);
+            u64 max;
+            while ((max = e->max) < value && !__sync_bool_compare_and_swap(&e->max, max, value)) {
+                // retry
+            }
+            return;
+        }
+        slot = (slot + step) & mask;
+    }
+
+    __sync_fetch_and_add(&_overflow, 1);
+}
+
+u64 LatencyHistogram::collect(std::vector<LatencyEntry>& entries) const {
+    for (u32 i = 0; i < _capacity; i++) {
+        if (__atomic_load_n(&_entries[i].key, __ATOMIC_ACQUIRE) != 0 && _entries[i].count > 0) {
+            entries.push_back(_entries[i]);
+        }
+    }
+    return _overflow;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LATENCYHISTOGRAM_H
+#define _LATENCYHISTOGRAM_H
+
+#include <stddef.h>
+#include <vector>
+#include "arch.h"
+
+
+// Log-linear buckets: values below 2^SUB_BITS have a bucket each, then every power of two
+// is split into 2^SUB_BITS equal buckets, which bounds the relative error by 12.5%
+const int HISTOGRAM_SUB_BITS = 3;
+const int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+const int HISTOGRAM_MAX_BITS = 40;  // larger values go to the last bucket
+const int HISTOGRAM_BUCKETS = (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+
+struct LatencyEntry {
+    u64 key;  // 0 if the slot is free
+    u64 count;
+    u64 max;
+    u32 buckets[HISTOGRAM_BUCKETS];
+
+    u64 percentile(double p) const;
+    void subtract(const LatencyEntry& earlier);
+};
+
+// Fixed-size open addressing table of histograms. record() takes no locks and does not
+// allocate, so it may be called from signal handlers; keys that do not fit are only counted
+class LatencyHistogram {
+  private:
+    LatencyEntry* _entries;
+    u32 _capacity;
+    volatile u64 _overflow;
+
+  public:
+    LatencyHistogram() : _entries(NULL), _capacity(0), _overflow(0) {
+    }
+
+    bool enabled() const {
+        return _entries != NULL;
+    }
+
+    // Allocates the table on the first call; capacity must be a power of two
+    bool init(u32 capacity);
+    void clear();
+
+    void record(u64 key, u64 value);
+
+    // Copies the used entries; returns the number of values that did not fit
+    u64 collect(std::vector<LatencyEntry>& entries) const;
+
+    static int bucketOf(u64 value);
+    static u64 bucketLimit(int bucket);
+};
+
+#endif // _LATENCYHISTOGRAM_H
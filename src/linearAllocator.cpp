@@ -14,34 +14,79 @@
  * limitations under the License.
  */
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "linearAllocator.h"
 #include "os.h"
 
 
-LinearAllocator::LinearAllocator(size_t chunk_size) {
+// Threads are told apart by their stacks, which are at least this far apart
+static const int STACK_SHIFT = 20;
+
+static inline int currentStripe() {
+    uintptr_t sp = (uintptr_t)__builtin_frame_address(0);
+    return (int)((sp >> STACK_SHIFT) ^ (sp >> (STACK_SHIFT + 4))) & (ARENA_STRIPES - 1);
+}
+
+
+LinearAllocator::LinearAllocator(size_t chunk_size, bool striped) {
     _chunk_size = chunk_size;
+    _pool = NULL;
+    _pooled = 0;
+    _huge_pages = false;
+    _mapped_bytes = 0;
+    _stripes = striped ? (ArenaStripe*)calloc(ARENA_STRIPES, sizeof(ArenaStripe)) : NULL;
     _reserve = _tail = allocateChunk(NULL);
 }
 
 LinearAllocator::~LinearAllocator() {
     clear();
     freeChunk(_tail);
+    while (_pool != NULL) {
+        Chunk* current = _pool;
+        _pool = current->prev;
+        freeChunk(current);
+    }
+    free(_stripes);
 }
 
 void LinearAllocator::clear() {
     if (_reserve->prev == _tail) {
-        freeChunk(_reserve);
+        releaseChunk(_reserve);
     }
     while (_tail->prev != NULL) {
         Chunk* current = _tail;
         _tail = _tail->prev;
-        freeChunk(current);
+        releaseChunk(current);
     }
     _reserve = _tail;
     _tail->offs = sizeof(Chunk);
+
+    if (_stripes != NULL) {
+        memset(_stripes, 0, ARENA_STRIPES * sizeof(ArenaStripe));
+    }
 }
 
-void* LinearAllocator::alloc(size_t size) {
+// Transparent huge pages are only a hint: the kernel may still back chunks with small pages
+void LinearAllocator::useHugePages(bool enabled) {
+    if (enabled && !_huge_pages) {
+        for (Chunk* chunk = _tail; chunk != NULL; chunk = chunk->prev) {
+            OS::adviseHugePages(chunk, _chunk_size);
+        }
+        for (Chunk* chunk = _pool; chunk != NULL; chunk = chunk->prev) {
+            OS::adviseHugePages(chunk, _chunk_size);
+        }
+    }
+    _huge_pages = enabled;
+}
+
+void* LinearAllocator::allocShared(size_t size) {
+    if (size > _chunk_size - sizeof(Chunk)) {
+        // Would not fit even in an empty chunk
+        return NULL;
+    }
+
     Chunk* chunk = _tail;
 
     do {
@@ -60,8 +105,55 @@ void* LinearAllocator::alloc(size_t size) {
     return NULL;
 }
 
+void* LinearAllocator::allocStriped(size_t size) {
+    if (size > STRIPE_BLOCK_SIZE / 16 || STRIPE_BLOCK_SIZE > _chunk_size / 4) {
+        return allocShared(size);
+    }
+
+    ArenaStripe* stripe = &_stripes[currentStripe()];
+    StripeBlock* block = stripe->block;
+    if (block != NULL) {
+        for (size_t offs = block->offs; offs + size <= STRIPE_BLOCK_SIZE; offs = block->offs) {
+            if (__sync_bool_compare_and_swap(&block->offs, offs, offs + size)) {
+                return (char*)block + offs;
+            }
+        }
+    }
+
+    // The block is exhausted: take a new one from the shared chunk together with this allocation.
+    // If another thread of the stripe replaces the block at the same time, ours serves only one allocation
+    StripeBlock* new_block = (StripeBlock*)allocShared(STRIPE_BLOCK_SIZE);
+    if (new_block == NULL) {
+        return NULL;
+    }
+    new_block->offs = sizeof(StripeBlock) + size;
+    __sync_bool_compare_and_swap(&stripe->block, block, new_block);
+    return new_block + 1;
+}
+
 Chunk* LinearAllocator::allocateChunk(Chunk* current) {
-    Chunk* chunk = (Chunk*)OS::safeAlloc(_chunk_size);
+    // Chunks return to the pool only in clear(), when there are no concurrent allocations,
+    // so popping is free of ABA problem
+    Chunk* chunk = _pool;
+    while (chunk != NULL) {
+        Chunk* prev = __sync_val_compare_and_swap(&_pool, chunk, chunk->prev);
+        if (prev == chunk) {
+            __sync_fetch_and_sub(&_pooled, 1);
+            break;
+        }
+        chunk = prev;
+    }
+
+    if (chunk == NULL) {
+        chunk = (Chunk*)OS::safeAlloc(_chunk_size);
+        if (chunk != NULL) {
+            __sync_fetch_and_add(&_mapped_bytes, _chunk_size);
+            if (_huge_pages) {
+                OS::adviseHugePages(chunk, _chunk_size);
+            }
+        }
+    }
+
     if (chunk != NULL) {
         chunk->prev = current;
         chunk->offs = sizeof(Chunk);
@@ -70,9 +162,21 @@ Chunk* LinearAllocator::allocateChunk(Chunk* current) {
 }
 
 void LinearAllocator::freeChunk(Chunk* current) {
+    __sync_fetch_and_sub(&_mapped_bytes, _chunk_size);
     OS::safeFree(current, _chunk_size);
 }
 
+// Called only from clear()
+void LinearAllocator::releaseChunk(Chunk* current) {
+    if (_pooled < MAX_POOLED_CHUNKS) {
+        current->prev = _pool;
+        _pool = current;
+        _pooled++;
+    } else {
+        freeChunk(current);
+    }
+}
+
 void LinearAllocator::reserveChunk(Chunk* current) {
     Chunk* reserve = allocateChunk(current);
     if (reserve != NULL && !__sync_bool_compare_and_swap(&_reserve, current, reserve)) {
@@ -20,6 +20,10 @@
 #include <stddef.h>
 
 
+const int MAX_POOLED_CHUNKS = 8;
+const int ARENA_STRIPES = 16;
+const size_t STRIPE_BLOCK_SIZE = 64 * 1024;
+
 struct Chunk {
     Chunk* prev;
     volatile size_t offs;
@@ -27,24 +31,55 @@ struct Chunk {
     char _padding[56];
 };
 
+struct StripeBlock {
+    volatile size_t offs;
+};
+
+struct ArenaStripe {
+    StripeBlock* volatile block;
+    char _padding[56];
+};
+
+// Lock-free bump allocator. Chunks released by clear() are kept for reuse,
+// so that periodic resets do not mmap and munmap the same memory over and over.
+// A striped allocator serves small allocations from per-thread-group blocks
+// carved out of the chunk, so that concurrent writers rarely contend on one offset.
 class LinearAllocator {
   private:
     size_t _chunk_size;
     Chunk* _tail;
     Chunk* _reserve;
+    Chunk* volatile _pool;
+    volatile int _pooled;
+    bool _huge_pages;
+    ArenaStripe* _stripes;
+    volatile size_t _mapped_bytes;
 
     Chunk* allocateChunk(Chunk* current);
     void freeChunk(Chunk* current);
+    void releaseChunk(Chunk* current);
     void reserveChunk(Chunk* current);
     Chunk* getNextChunk(Chunk* current);
 
+    void* allocShared(size_t size);
+    void* allocStriped(size_t size);
+
   public:
-    LinearAllocator(size_t chunk_size);
+    LinearAllocator(size_t chunk_size, bool striped = false);
     ~LinearAllocator();
 
+    void useHugePages(bool enabled);
+
     void clear();
 
-    void* alloc(size_t size);
+    // Memory taken from the OS for chunks, including pooled and reserved ones
+    size_t usedMemory() {
+        return _mapped_bytes;
+    }
+
+    void* alloc(size_t size) {
+        return _stripes != NULL ? allocStriped(size) : allocShared(size);
+    }
 };
 
 #endif // _LINEARALLOCATOR_H
@@ -14,14 +14,23 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "lockTracer.h"
+#include "classIdCache.h"
 #include "profiler.h"
 #include "tsc.h"
+#include "vmStructs.h"
+
+
+// Start of the current contended monitor enter. Replaces a JVM TI tag on the thread object,
+// which would cost a tag map lookup on every MonitorContendedEnter/Entered pair
+static __thread jlong monitor_enter_time;
 
 
 double LockTracer::_ticks_to_nanos;
 jlong LockTracer::_threshold;
+jlong LockTracer::_base_threshold;
 jlong LockTracer::_start_time = 0;
 jclass LockTracer::_UnsafeClass = NULL;
 jclass LockTracer::_LockSupport = NULL;
@@ -29,15 +38,30 @@ jmethodID LockTracer::_getBlocker = NULL;
 RegisterNativesFunc LockTracer::_orig_RegisterNatives = NULL;
 UnsafeParkFunc LockTracer::_orig_Unsafe_park = NULL;
 bool LockTracer::_initialized = false;
+bool LockTracer::_use_klass = false;
+LockStat* LockTracer::_stats = NULL;
+bool LockTracer::_stats_enabled = false;
+volatile u64 LockTracer::_stats_overflow = 0;
+LatencyHistogram LockTracer::_latency;
+bool LockTracer::_latency_enabled = false;
 
 Error LockTracer::start(Arguments& args) {
     _ticks_to_nanos = 1e9 / TSC::frequency();
-    _threshold = (jlong)(args._lock * (TSC::frequency() / 1e9));
+    _threshold = _base_threshold = (jlong)TSC::fromNanos(args._lock);
 
     if (!_initialized) {
         initialize();
     }
 
+    // Lock class is found by its Klass rather than by the class signature from JVM TI
+    _use_klass = !VM::isOpenJ9() && VMStructs::hasClassNames();
+
+    if (args._lock_stats && _stats == NULL) {
+        _stats = (LockStat*)calloc(LOCK_STATS_CAPACITY, sizeof(LockStat));
+    }
+    _stats_enabled = args._lock_stats && _stats != NULL;
+    _latency_enabled = args._latency && _latency.init(LATENCY_CAPACITY);
+
     // Enable Java Monitor events
     jvmtiEnv* jvmti = VM::jvmti();
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, NULL);
@@ -101,20 +125,18 @@ void LockTracer::initialize() {
 }
 
 void JNICALL LockTracer::MonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object) {
-    jlong enter_time = TSC::ticks();
-    jvmti->SetTag(thread, enter_time);
+    monitor_enter_time = TSC::ticks();
 }
 
 void JNICALL LockTracer::MonitorContendedEntered(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object) {
     jlong entered_time = TSC::ticks();
-    jlong enter_time;
-    jvmti->GetTag(thread, &enter_time);
+    jlong enter_time = monitor_enter_time;
 
     // Time is meaningless if lock attempt has started before profiling
     if (_enabled && entered_time - enter_time >= _threshold && enter_time >= _start_time) {
-        char* lock_name = getLockName(jvmti, env, object);
-        recordContendedLock(BCI_LOCK, enter_time, entered_time, lock_name, object, 0);
-        jvmti->Deallocate((unsigned char*)lock_name);
+        bool concurrent_lock;
+        u32 class_id = getLockClassId(jvmti, env, object, &concurrent_lock);
+        recordContendedLock(BCI_LOCK, enter_time, entered_time, class_id, object, 0);
     }
 }
 
@@ -145,11 +167,11 @@ void JNICALL LockTracer::UnsafeParkHook(JNIEnv* env, jobject instance, jboolean
     if (park_blocker != NULL) {
         park_end_time = TSC::ticks();
         if (park_end_time - park_start_time >= _threshold) {
-            char* lock_name = getLockName(jvmti, env, park_blocker);
-            if (lock_name == NULL || isConcurrentLock(lock_name)) {
-                recordContendedLock(BCI_PARK, park_start_time, park_end_time, lock_name, park_blocker, time);
+            bool concurrent_lock;
+            u32 class_id = getLockClassId(jvmti, env, park_blocker, &concurrent_lock);
+            if (concurrent_lock) {
+                recordContendedLock(BCI_PARK, park_start_time, park_end_time, class_id, park_blocker, time);
             }
-            jvmti->Deallocate((unsigned char*)lock_name);
         }
     }
 }
@@ -172,32 +194,106 @@ char* LockTracer::getLockName(jvmtiEnv* jvmti, JNIEnv* env, jobject lock) {
     return class_name;
 }
 
-bool LockTracer::isConcurrentLock(const char* lock_name) {
+// Also tells if the lock is one of the synchronizers counted by the park tracer.
+// Unknown classes are counted, as before
+u32 LockTracer::getLockClassId(jvmtiEnv* jvmti, JNIEnv* env, jobject lock, bool* concurrent_lock) {
+    if (_use_klass) {
+        VMKlass* klass = VMKlass::fromJavaClass(env, env->GetObjectClass(lock));
+        VMSymbol* symbol = klass->name();
+        *concurrent_lock = isConcurrentLock(symbol->body(), symbol->length());
+        return ClassIdCache::lookup(klass);
+    }
+
+    char* lock_name = getLockName(jvmti, env, lock);
+    if (lock_name == NULL) {
+        *concurrent_lock = true;
+        return 0;
+    }
+
+    u32 class_id;
+    if (lock_name[0] == 'L') {
+        size_t len = strlen(lock_name) - 2;
+        *concurrent_lock = isConcurrentLock(lock_name + 1, len);
+        class_id = Profiler::instance()->classMap()->lookup(lock_name + 1, len);
+    } else {
+        *concurrent_lock = false;
+        class_id = Profiler::instance()->classMap()->lookup(lock_name);
+    }
+    jvmti->Deallocate((unsigned char*)lock_name);
+    return class_id;
+}
+
+bool LockTracer::isConcurrentLock(const char* class_name, size_t len) {
     // Do not count synchronizers other than ReentrantLock, ReentrantReadWriteLock and Semaphore
-    return strncmp(lock_name, "Ljava/util/concurrent/locks/ReentrantLock", 41) == 0 ||
-           strncmp(lock_name, "Ljava/util/concurrent/locks/ReentrantReadWriteLock", 50) == 0 ||
-           strncmp(lock_name, "Ljava/util/concurrent/Semaphore", 31) == 0;
+    return (len >= 40 && memcmp(class_name, "java/util/concurrent/locks/ReentrantLock", 40) == 0) ||
+           (len >= 49 && memcmp(class_name, "java/util/concurrent/locks/ReentrantReadWriteLock", 49) == 0) ||
+           (len >= 30 && memcmp(class_name, "java/util/concurrent/Semaphore", 30) == 0);
 }
 
 void LockTracer::recordContendedLock(int event_type, u64 start_time, u64 end_time,
-                                     const char* lock_name, jobject lock, jlong timeout) {
+                                     u32 class_id, jobject lock, jlong timeout) {
     LockEvent event;
-    event._class_id = 0;
+    event._class_id = class_id;
     event._start_time = start_time;
     event._end_time = end_time;
     event._address = *(uintptr_t*)lock;
     event._timeout = timeout;
 
-    if (lock_name != NULL) {
-        if (lock_name[0] == 'L') {
-            event._class_id = Profiler::instance()->classMap()->lookup(lock_name + 1, strlen(lock_name) - 2);
-        } else {
-            event._class_id = Profiler::instance()->classMap()->lookup(lock_name);
+    u64 duration_nanos = (u64)((end_time - start_time) * _ticks_to_nanos);
+    u32 call_trace_id = Profiler::instance()->recordSample(NULL, duration_nanos, event_type, &event);
+    if (_stats_enabled && call_trace_id != 0) {
+        addLockStat(class_id, call_trace_id, duration_nanos);
+    }
+    if (_latency_enabled && call_trace_id != 0) {
+        _latency.record(call_trace_id, duration_nanos);
+    }
+}
+
+void LockTracer::addLockStat(u32 class_id, u32 call_trace_id, u64 duration) {
+    u64 key = (u64)class_id << 32 | call_trace_id;
+    u32 slot = (u32)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (LOCK_STATS_CAPACITY - 1);
+
+    for (u32 step = 1; step <= 16; step++) {
+        LockStat* stat = &_stats[slot];
+        u64 prev = __atomic_load_n(&stat->key, __ATOMIC_ACQUIRE);
+        if (prev == 0 && __sync_bool_compare_and_swap(&stat->key, 0, key)) {
+            prev = key;
+        } else if (prev == 0) {
+            prev = stat->key;
+        }
+
+        if (prev == key) {
+            __sync_fetch_and_add(&stat->count, 1);
+            __sync_fetch_and_add(&stat->total_time, duration);
+            u64 max;
+            while ((max = stat->max_time) < duration && !__sync_bool_compare_and_swap(&stat->max_time, max, duration)) {
+                // retry
+            }
+            return;
         }
+        slot = (slot + step) & (LOCK_STATS_CAPACITY - 1);
     }
 
-    u64 duration_nanos = (u64)((end_time - start_time) * _ticks_to_nanos);
-    Profiler::instance()->recordSample(NULL, duration_nanos, event_type, &event);
+    __sync_fetch_and_add(&_stats_overflow, duration);
+}
+
+u64 LockTracer::collectLockStats(std::vector<LockStat>& stats) {
+    if (_stats != NULL) {
+        for (u32 i = 0; i < LOCK_STATS_CAPACITY; i++) {
+            if (__atomic_load_n(&_stats[i].key, __ATOMIC_ACQUIRE) != 0) {
+                stats.push_back(_stats[i]);
+            }
+        }
+    }
+    return _stats_overflow;
+}
+
+void LockTracer::clearLockStats() {
+    if (_stats != NULL) {
+        memset(_stats, 0, LOCK_STATS_CAPACITY * sizeof(LockStat));
+    }
+    _stats_overflow = 0;
+    _latency.clear();
 }
 
 void LockTracer::bindUnsafePark(UnsafeParkFunc entry) {
@@ -18,22 +18,48 @@
 #define _LOCKTRACER_H
 
 #include <jvmti.h>
+#include <vector>
 #include "arch.h"
 #include "engine.h"
+#include "latencyHistogram.h"
 
 
 typedef jint (JNICALL *RegisterNativesFunc)(JNIEnv*, jclass, const JNINativeMethod*, jint);
 typedef void (JNICALL *UnsafeParkFunc)(JNIEnv*, jobject, jboolean, jlong);
 
+// Wait time aggregated per (lock class, call trace)
+struct LockStat {
+    u64 key;  // class_id << 32 | call_trace_id, 0 if the slot is free
+    u64 count;
+    u64 total_time;
+    u64 max_time;
+
+    u32 classId() const   { return (u32)(key >> 32); }
+    u32 callTraceId() const { return (u32)key; }
+};
+
 class LockTracer : public Engine {
   private:
     static double _ticks_to_nanos;
     static jlong _threshold;
+    static jlong _base_threshold;
     static jlong _start_time;
     static jclass _UnsafeClass;
     static jclass _LockSupport;
     static jmethodID _getBlocker;
     static bool _initialized;
+    static bool _use_klass;
+
+    // Bounded open addressing table; contention that does not fit goes to _stats_overflow
+    static const u32 LOCK_STATS_CAPACITY = 16384;
+    static LockStat* _stats;
+    static bool _stats_enabled;
+    static volatile u64 _stats_overflow;
+
+    // Wait time distribution per call trace
+    static const u32 LATENCY_CAPACITY = 2048;
+    static LatencyHistogram _latency;
+    static bool _latency_enabled;
 
     static void initialize();
 
@@ -45,9 +71,11 @@ class LockTracer : public Engine {
 
     static jobject getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env);
     static char* getLockName(jvmtiEnv* jvmti, JNIEnv* env, jobject lock);
-    static bool isConcurrentLock(const char* lock_name);
+    static u32 getLockClassId(jvmtiEnv* jvmti, JNIEnv* env, jobject lock, bool* concurrent_lock);
+    static bool isConcurrentLock(const char* class_name, size_t len);
     static void recordContendedLock(int event_type, u64 start_time, u64 end_time,
-                                    const char* lock_name, jobject lock, jlong timeout);
+                                    u32 class_id, jobject lock, jlong timeout);
+    static void addLockStat(u32 class_id, u32 call_trace_id, u64 duration);
     static void bindUnsafePark(UnsafeParkFunc entry);
 
   public:
@@ -62,6 +90,33 @@ class LockTracer : public Engine {
     Error start(Arguments& args);
     void stop();
 
+    static void preload() {
+        if (!_initialized) {
+            initialize();
+        }
+    }
+
+    long scaleInterval(double factor) {
+        _threshold = (jlong)(_base_threshold * factor);
+        return (long)(_threshold * _ticks_to_nanos);
+    }
+
+    static bool hasLockStats() {
+        return _stats_enabled;
+    }
+
+    // Copies the used slots of the table; returns the wait time of the events that did not fit
+    static u64 collectLockStats(std::vector<LockStat>& stats);
+    static void clearLockStats();
+
+    static bool hasLatency() {
+        return _latency_enabled;
+    }
+
+    static const LatencyHistogram& latency() {
+        return _latency;
+    }
+
     static void JNICALL MonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object);
     static void JNICALL MonitorContendedEntered(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object);
 };
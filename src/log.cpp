@@ -14,9 +14,11 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "log.h"
 #include "profiler.h"
+#include "tsc.h"
 
 
 const char* const Log::LEVEL_NAME[] = {
@@ -28,11 +30,20 @@ const char* const Log::LEVEL_NAME[] = {
     "NONE"
 };
 
+Mutex Log::_file_lock;
 FILE* Log::_file = stdout;
 LogLevel Log::_level = LOG_TRACE;
+volatile bool Log::_async = false;
+LogRecord* Log::_queue = NULL;
+volatile u64 Log::_enqueue_pos = 0;
+u64 Log::_dequeue_pos = 0;
+volatile int Log::_dropped = 0;
 
 
+// The file is switched under _file_lock, since the timer thread may be draining to it
 void Log::open(const char* file_name, const char* level) {
+    MutexLocker ml(_file_lock);
+
     if (_file != stdout && _file != stderr) {
         fclose(_file);
     }
@@ -59,27 +70,135 @@ void Log::open(const char* file_name, const char* level) {
 }
 
 void Log::close() {
+    MutexLocker ml(_file_lock);
+
     if (_file != stdout && _file != stderr) {
         fclose(_file);
         _file = stdout;
     }
 }
 
+void Log::startAsync() {
+    if (_queue == NULL) {
+        LogRecord* queue = (LogRecord*)calloc(LOG_QUEUE_SIZE, sizeof(LogRecord));
+        if (queue == NULL) {
+            return;
+        }
+        for (int i = 0; i < LOG_QUEUE_SIZE; i++) {
+            queue[i].seq = i;
+        }
+        _queue = queue;
+    }
+    __atomic_store_n(&_async, true, __ATOMIC_RELEASE);
+}
+
+void Log::stopAsync() {
+    if (_async) {
+        __atomic_store_n(&_async, false, __ATOMIC_RELEASE);
+        drain();
+    }
+}
+
+// Claims a slot with CAS and publishes it with the sequence number. Returns false if the queue is full
+bool Log::enqueue(LogLevel level, const char* message, size_t len) {
+    u64 pos = __atomic_load_n(&_enqueue_pos, __ATOMIC_RELAXED);
+    LogRecord* record;
+    while (true) {
+        record = &_queue[pos & (LOG_QUEUE_SIZE - 1)];
+        u64 seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&_enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((long long)(seq - pos) < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    record->time = TSC::ticks();
+    record->level = level;
+    record->len = (u32)len;
+    memcpy(record->message, message, len + 1);
+    __atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Only one thread drains at a time: the timer thread, or the one that stops async mode after it
+void Log::drain() {
+    if (_queue == NULL) {
+        return;
+    }
+
+    LogRecord* batch[LOG_QUEUE_SIZE];
+    int count = 0;
+    while (count < LOG_QUEUE_SIZE) {
+        u64 pos = _dequeue_pos + count;
+        LogRecord* record = &_queue[pos & (LOG_QUEUE_SIZE - 1)];
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+        batch[count++] = record;
+    }
+
+    int dropped = __atomic_exchange_n(&_dropped, 0, __ATOMIC_ACQ_REL);
+    if (count == 0 && dropped == 0) {
+        return;
+    }
+
+    Profiler::instance()->writeLog(batch, count);
+
+    _file_lock.lock();
+    bool written = false;
+    for (int i = 0; i < count; i++) {
+        if (batch[i]->level >= _level) {
+            fprintf(_file, "[%s] %s\n", LEVEL_NAME[batch[i]->level], batch[i]->message);
+            written = true;
+        }
+    }
+    if (dropped > 0 && LOG_WARN >= _level) {
+        fprintf(_file, "[%s] %d log messages dropped\n", LEVEL_NAME[LOG_WARN], dropped);
+        written = true;
+    }
+    if (written) {
+        fflush(_file);
+    }
+    _file_lock.unlock();
+
+    for (int i = 0; i < count; i++) {
+        u64 pos = _dequeue_pos++;
+        __atomic_store_n(&_queue[pos & (LOG_QUEUE_SIZE - 1)].seq, pos + LOG_QUEUE_SIZE, __ATOMIC_RELEASE);
+    }
+}
+
+void Log::write(LogLevel level, const char* message) {
+    MutexLocker ml(_file_lock);
+    fprintf(_file, "[%s] %s\n", LEVEL_NAME[level], message);
+    fflush(_file);
+}
+
 void Log::log(LogLevel level, const char* msg, va_list args) {
-    char buf[1024];
+    char buf[LOG_MESSAGE_SIZE];
     size_t len = vsnprintf(buf, sizeof(buf), msg, args);
     if (len >= sizeof(buf)) {
         len = sizeof(buf) - 1;
         buf[len] = 0;
     }
 
+    if (__atomic_load_n(&_async, __ATOMIC_ACQUIRE)) {
+        if (!enqueue(level, buf, len)) {
+            atomicInc(_dropped);
+        }
+        return;
+    }
+
     if (level < LOG_ERROR) {
         Profiler::instance()->writeLog(level, buf, len);
     }
 
     if (level >= _level) {
-        fprintf(_file, "[%s] %s\n", LEVEL_NAME[level], buf);
-        fflush(_file);
+        write(level, buf);
     }
 }
 
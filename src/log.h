@@ -19,6 +19,8 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include "arch.h"
+#include "mutex.h"
 
 #ifdef __GNUC__
 #define ATTR_FORMAT __attribute__((format(printf, 1, 2)))
@@ -37,10 +39,32 @@ enum LogLevel {
 };
 
 
+const int LOG_QUEUE_SIZE = 512;  // must be a power of 2
+const int LOG_MESSAGE_SIZE = 1024;
+
+// A formatted message waiting in the queue for Log::drain()
+struct LogRecord {
+    volatile u64 seq;  // publishing protocol as in J9QueueSlot
+    u64 time;          // TSC ticks when the message was logged
+    LogLevel level;
+    u32 len;
+    char message[LOG_MESSAGE_SIZE];
+};
+
+
 class Log {
   private:
+    static Mutex _file_lock;
     static FILE* _file;
     static LogLevel _level;
+    static volatile bool _async;
+    static LogRecord* _queue;
+    static volatile u64 _enqueue_pos;
+    static u64 _dequeue_pos;
+    static volatile int _dropped;
+
+    static bool enqueue(LogLevel level, const char* message, size_t len);
+    static void write(LogLevel level, const char* message);
 
   public:
     static const char* const LEVEL_NAME[];
@@ -48,6 +72,13 @@ class Log {
     static void open(const char* file_name, const char* level);
     static void close();
 
+    // While async, messages are only queued by the threads that log them, and then written
+    // in batches by the thread that calls drain() periodically. When the queue is full until
+    // the next drain, messages are dropped and counted
+    static void startAsync();
+    static void stopAsync();
+    static void drain();
+
     static void log(LogLevel level, const char* msg, va_list args);
 
     static void ATTR_FORMAT trace(const char* msg, ...);
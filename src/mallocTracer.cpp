@@ -0,0 +1,298 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "mallocTracer.h"
+#include "codeCache.h"
+#include "os.h"
+#include "profiler.h"
+#include "tsc.h"
+#include "vmStructs.h"
+
+
+// Number of counters in the free() filter; must be a power of 2
+static const u32 FILTER_SIZE = 65536;
+
+
+u64 MallocTracer::_interval;
+u64 MallocTracer::_base_interval;
+volatile u64 MallocTracer::_allocated_bytes;
+volatile bool MallocTracer::_running = false;
+bool MallocTracer::_live = false;
+MallocLiveTable MallocTracer::_live_table;
+Mutex MallocTracer::_patch_lock;
+int MallocTracer::_patched_libs = 0;
+
+
+// Hooks run in any thread of any library. They call the original functions
+// through the GOT of the profiler library, which is never patched
+
+static void* malloc_hook(size_t size) {
+    void* result = malloc(size);
+    if (MallocTracer::running() && result != NULL && size != 0) {
+        MallocTracer::recordMalloc(result, size);
+    }
+    return result;
+}
+
+static void* calloc_hook(size_t num, size_t size) {
+    void* result = calloc(num, size);
+    if (MallocTracer::running() && result != NULL && num * size != 0) {
+        MallocTracer::recordMalloc(result, num * size);
+    }
+    return result;
+}
+
+static void* realloc_hook(void* addr, size_t size) {
+    // Untrack before the address can be reused by another thread
+    if (MallocTracer::running() && addr != NULL) {
+        MallocTracer::recordFree(addr);
+    }
+    void* result = realloc(addr, size);
+    if (MallocTracer::running() && result != NULL && size != 0) {
+        MallocTracer::recordMalloc(result, size);
+    }
+    return result;
+}
+
+static void free_hook(void* addr) {
+    if (MallocTracer::running() && addr != NULL) {
+        MallocTracer::recordFree(addr);
+    }
+    free(addr);
+}
+
+static void* mmap_hook(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    void* result = mmap(addr, length, prot, flags, fd, offset);
+    // File mappings are not counted: they are backed by the page cache rather than process memory
+    if (MallocTracer::running() && result != MAP_FAILED && (flags & MAP_ANONYMOUS)) {
+        MallocTracer::recordMalloc(result, length);
+    }
+    return result;
+}
+
+static int munmap_hook(void* addr, size_t length) {
+    // Only unmapping of a whole tracked region is recognized
+    if (MallocTracer::running() && addr != NULL) {
+        MallocTracer::recordFree(addr);
+    }
+    return munmap(addr, length);
+}
+
+
+void MallocLiveTable::init(u32 limit) {
+    u32 capacity = 1024;
+    while (capacity < limit * 2) {
+        capacity *= 2;
+    }
+
+    _lock.lock();
+    if (capacity > _capacity) {
+        // Hooks of the previous session may still read the old arrays, so they are not freed
+        uintptr_t* keys = (uintptr_t*)calloc(capacity, sizeof(uintptr_t));
+        LiveRef* values = (LiveRef*)calloc(capacity, sizeof(LiveRef));
+        volatile u32* filter = _filter != NULL ? _filter : (volatile u32*)calloc(FILTER_SIZE, sizeof(u32));
+        if (keys != NULL && values != NULL && filter != NULL) {
+            _keys = keys;
+            _values = values;
+            _filter = filter;
+            _capacity = capacity;
+        } else {
+            free(keys);
+            free(values);
+        }
+    } else {
+        memset(_keys, 0, _capacity * sizeof(uintptr_t));
+    }
+    if (_filter != NULL) {
+        memset((void*)_filter, 0, FILTER_SIZE * sizeof(u32));
+    }
+    _limit = _capacity / 2 < limit ? _capacity / 2 : limit;
+    _count = 0;
+    _lock.unlock();
+}
+
+bool MallocLiveTable::add(uintptr_t address, const LiveRef& value) {
+    u32 h = hash(address);
+    bool added = false;
+
+    _lock.lock();
+    if (_count < _limit) {
+        u32 mask = _capacity - 1;
+        u32 slot = h & mask;
+        while (_keys[slot] != 0 && _keys[slot] != address) {
+            slot = (slot + 1) & mask;
+        }
+        if (_keys[slot] == 0) {
+            _keys[slot] = address;
+            _count++;
+            _filter[h & (FILTER_SIZE - 1)]++;
+        }
+        _values[slot] = value;
+        added = true;
+    }
+    _lock.unlock();
+
+    return added;
+}
+
+void MallocLiveTable::remove(uintptr_t address) {
+    u32 h = hash(address);
+    if (_filter == NULL || _filter[h & (FILTER_SIZE - 1)] == 0) {
+        return;
+    }
+
+    _lock.lock();
+    u32 mask = _capacity - 1;
+    for (u32 slot = h & mask; _keys[slot] != 0; slot = (slot + 1) & mask) {
+        if (_keys[slot] == address) {
+            removeAt(slot);
+            _count--;
+            _filter[h & (FILTER_SIZE - 1)]--;
+            break;
+        }
+    }
+    _lock.unlock();
+}
+
+// Backward shift deletion keeps linear probing chains intact without tombstones
+void MallocLiveTable::removeAt(u32 hole) {
+    u32 mask = _capacity - 1;
+    for (u32 next = (hole + 1) & mask; _keys[next] != 0; next = (next + 1) & mask) {
+        u32 home = hash(_keys[next]) & mask;
+        // Move the entry if its home slot is not cyclically within (hole, next]
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            _keys[hole] = _keys[next];
+            _values[hole] = _values[next];
+            hole = next;
+        }
+    }
+    _keys[hole] = 0;
+}
+
+void MallocLiveTable::collect(std::vector<LiveRef>& live) {
+    _lock.lock();
+    for (u32 slot = 0; slot < _capacity; slot++) {
+        if (_keys[slot] != 0) {
+            live.push_back(_values[slot]);
+        }
+    }
+    _lock.unlock();
+}
+
+
+// The profiler itself, the C library and the JVM are not hooked: allocations of the first two
+// cannot be attributed to the application, and the JVM is often in a state where a JVM TI
+// stack walk is unsafe. JVM native memory is better tracked with Native Memory Tracking
+static bool isExcludedLibrary(CodeCache* lib, CodeCache* self) {
+    if (lib == self || lib == VMStructs::libjvm()) {
+        return true;
+    }
+
+    const char* name = lib->name();
+    const char* s = strrchr(name, '/');
+    s = s != NULL ? s + 1 : name;
+    return strncmp(s, "libc.", 5) == 0 || strncmp(s, "libc-", 5) == 0 || strncmp(s, "ld-", 3) == 0
+        || strncmp(s, "libj9", 5) == 0 || strcmp(s, "libjvm.so") == 0 || s[0] == '[';
+}
+
+void MallocTracer::installHooks() {
+    MutexLocker ml(_patch_lock);
+
+    Profiler* profiler = Profiler::instance();
+    CodeCache* self = profiler->findNativeLibrary((const void*)malloc_hook);
+
+    const int native_lib_count = profiler->_native_lib_count;
+    for (int i = _patched_libs; i < native_lib_count; i++) {
+        CodeCache* lib = profiler->_native_libs[i];
+        if (isExcludedLibrary(lib, self)) {
+            continue;
+        }
+
+        lib->patchImport(IM_MALLOC, (void*)malloc_hook);
+        lib->patchImport(IM_CALLOC, (void*)calloc_hook);
+        lib->patchImport(IM_REALLOC, (void*)realloc_hook);
+        lib->patchImport(IM_FREE, (void*)free_hook);
+        lib->patchImport(IM_MMAP, (void*)mmap_hook);
+        lib->patchImport(IM_MUNMAP, (void*)munmap_hook);
+    }
+    _patched_libs = native_lib_count;
+}
+
+void MallocTracer::recordMalloc(void* address, size_t size) {
+    if (!_enabled || !updateCounter(_allocated_bytes, size, _interval)) {
+        return;
+    }
+
+    MallocEvent event;
+    event._address = (uintptr_t)address;
+    event._size = size;
+
+    u32 call_trace_id = Profiler::instance()->recordSample(NULL, size, BCI_NATIVE_MALLOC, &event);
+    if (_live && call_trace_id != 0) {
+        LiveRef value = {NULL, (u64)size, TSC::ticks(), call_trace_id, 0, OS::threadId()};
+        _live_table.add((uintptr_t)address, value);
+    }
+}
+
+void MallocTracer::recordFree(void* address) {
+    if (_live) {
+        _live_table.remove((uintptr_t)address);
+    }
+}
+
+void MallocTracer::collectLive(std::vector<LiveRef>& live) {
+    if (_live) {
+        _live_table.collect(live);
+    }
+}
+
+Error MallocTracer::check(Arguments& args) {
+    Profiler* profiler = Profiler::instance();
+    const int native_lib_count = profiler->_native_lib_count;
+    for (int i = 0; i < native_lib_count; i++) {
+        if (profiler->_native_libs[i]->hasImport(IM_MALLOC)) {
+            return Error::OK;
+        }
+    }
+    return Error("Native memory profiling is not supported on this platform");
+}
+
+Error MallocTracer::start(Arguments& args) {
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+
+    _interval = _base_interval = args._nativemem;
+    _allocated_bytes = 0;
+
+    _live = args._live > 0;
+    if (_live) {
+        _live_table.init(args._live);
+    }
+
+    installHooks();
+    _running = true;
+    return Error::OK;
+}
+
+void MallocTracer::stop() {
+    // Unfreed allocations stay in the table, so that the live profile can be dumped after stop
+    _running = false;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MALLOCTRACER_H
+#define _MALLOCTRACER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "engine.h"
+#include "mutex.h"
+#include "objectSampler.h"
+#include "spinLock.h"
+
+
+// Sampled native allocations that have not been freed yet, at most limit entries.
+// Most free() calls are for untracked addresses: they are filtered out without locking
+// by a counting filter indexed by the address hash
+class MallocLiveTable {
+  private:
+    SpinLock _lock;
+    uintptr_t* _keys;
+    LiveRef* _values;
+    volatile u32* _filter;
+    u32 _capacity;
+    u32 _limit;
+    u32 _count;
+
+    static u32 hash(uintptr_t address) {
+        return (u32)(((u64)address >> 4) * 0x9e3779b97f4a7c15ULL >> 32);
+    }
+
+    void removeAt(u32 slot);
+
+  public:
+    MallocLiveTable() : _lock(), _keys(NULL), _values(NULL), _filter(NULL), _capacity(0), _limit(0), _count(0) {
+    }
+
+    void init(u32 limit);
+    bool add(uintptr_t address, const LiveRef& value);
+    void remove(uintptr_t address);
+    void collect(std::vector<LiveRef>& live);
+};
+
+
+// Intercepts malloc, calloc, realloc, free, mmap and munmap called from native libraries
+// by redirecting their GOT slots. Allocations are sampled every interval bytes
+class MallocTracer : public Engine {
+  private:
+    static u64 _interval;
+    static u64 _base_interval;
+    static volatile u64 _allocated_bytes;
+    static volatile bool _running;
+    static bool _live;
+    static MallocLiveTable _live_table;
+    static Mutex _patch_lock;
+    static int _patched_libs;
+
+  public:
+    const char* title() {
+        return "Native memory profile";
+    }
+
+    const char* units() {
+        return "bytes";
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    long scaleInterval(double factor) {
+        _interval = (u64)(_base_interval * factor);
+        return (long)_interval;
+    }
+
+    static bool running() {
+        return _running;
+    }
+
+    // Patches libraries loaded since the previous call. Hooks are never removed:
+    // while the profiler is stopped, they just call the original functions
+    static void installHooks();
+
+    static void recordMalloc(void* address, size_t size);
+    static void recordFree(void* address);
+
+    // Unfreed sampled allocations, if the live option was given at start
+    static void collectLive(std::vector<LiveRef>& live);
+};
+
+#endif // _MALLOCTRACER_H
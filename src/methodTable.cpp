@@ -0,0 +1,137 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "arch.h"
+#include "methodTable.h"
+
+
+static const size_t STRING_CHUNK = 256 * 1024;
+
+
+MethodTable::MethodTable(Dictionary* classes) : _lock(), _index(), _methods(), _strings(STRING_CHUNK), _classes(classes),
+    _queue(), _queue_head(0), _queue_tail(0) {
+}
+
+const char* MethodTable::copy(const char* s, size_t len) {
+    char* result = len < STRING_CHUNK / 2 ? (char*)_strings.alloc(len + 1) : NULL;
+    if (result == NULL) {
+        return "";
+    }
+    memcpy(result, s, len);
+    result[len] = 0;
+    return result;
+}
+
+jvmtiError MethodTable::resolve(jmethodID method, ResolvedMethod& result) {
+    u32 index;
+    _lock.lockShared();
+    bool found = _index.get((u64)(uintptr_t)method, 0, index);
+    if (found) {
+        result = _methods[index];
+    }
+    _lock.unlockShared();
+    if (found) {
+        return JVMTI_ERROR_NONE;
+    }
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    jclass method_class;
+    char* class_name = NULL;
+    char* method_name = NULL;
+    char* method_sig = NULL;
+
+    jvmtiError err;
+    if ((err = jvmti->GetMethodName(method, &method_name, &method_sig, NULL)) == 0 &&
+        (err = jvmti->GetMethodDeclaringClass(method, &method_class)) == 0 &&
+        (err = jvmti->GetClassSignature(method_class, &class_name, NULL)) == 0) {
+        jint modifiers;
+        if (jvmti->GetMethodModifiers(method, &modifiers) != 0) {
+            modifiers = 0;
+        }
+
+        // Trim 'L' and ';' off the class descriptor like 'Ljava/lang/Object;'
+        size_t class_len = strlen(class_name) - 2;
+
+        _lock.lock();
+        if (_index.get((u64)(uintptr_t)method, 0, index)) {
+            // Another thread has just resolved the same method
+            result = _methods[index];
+        } else {
+            result.class_name = copy(class_name + 1, class_len);
+            result.name = copy(method_name, strlen(method_name));
+            result.sig = copy(method_sig, strlen(method_sig));
+            result.class_id = _classes->lookup(class_name + 1, class_len);
+            result.modifiers = modifiers;
+            _index.put((u64)(uintptr_t)method, 0, _methods.size());
+            _methods.push_back(result);
+        }
+        _lock.unlock();
+    }
+
+    jvmti->Deallocate((unsigned char*)class_name);
+    jvmti->Deallocate((unsigned char*)method_sig);
+    jvmti->Deallocate((unsigned char*)method_name);
+    return err;
+}
+
+void MethodTable::enqueue(jmethodID method) {
+    u32 tail;
+    do {
+        tail = _queue_tail;
+        if (tail - loadAcquire(_queue_head) >= PREFETCH_QUEUE_SIZE) {
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&_queue_tail, tail, tail + 1));
+
+    // The consumer stops at a reserved slot until its method is published
+    __atomic_store_n(&_queue[tail & (PREFETCH_QUEUE_SIZE - 1)], method, __ATOMIC_RELEASE);
+}
+
+int MethodTable::prefetch() {
+    int count = 0;
+    u32 head = _queue_head;
+    u32 tail = loadAcquire(_queue_tail);
+
+    for (; head != tail; head++) {
+        jmethodID* slot = &_queue[head & (PREFETCH_QUEUE_SIZE - 1)];
+        jmethodID method = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (method == NULL) {
+            break;
+        }
+        *slot = NULL;
+
+        ResolvedMethod resolved;
+        if (resolve(method, resolved) == 0) {
+            count++;
+        }
+        storeRelease(_queue_head, head + 1);
+    }
+
+    return count;
+}
+
+void MethodTable::clear() {
+    _lock.lock();
+    for (u32 i = 0; i < PREFETCH_QUEUE_SIZE; i++) {
+        _queue[i] = NULL;
+    }
+    _queue_head = _queue_tail = 0;
+    _index.clear();
+    _methods.clear();
+    _strings.clear();
+    _lock.unlock();
+}
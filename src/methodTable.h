@@ -0,0 +1,76 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _METHODTABLE_H
+#define _METHODTABLE_H
+
+#include <vector>
+#include "dictionary.h"
+#include "linearAllocator.h"
+#include "pairMap.h"
+#include "spinLock.h"
+#include "vmEntry.h"
+
+
+struct ResolvedMethod {
+    const char* class_name;  // without 'L' and ';' of the class descriptor
+    const char* name;
+    const char* sig;
+    u32 class_id;            // in the class dictionary given to the table
+    jint modifiers;
+};
+
+// JVM TI view of Java methods shared by all output formats: FrameName for text, collapsed
+// and flame graph output, and the JFR method constant pool. Every method is resolved
+// with JVM TI once, however many dumps and writers need it. Lookups may run concurrently.
+// Methods of newly stored traces may be queued from a signal handler and resolved
+// in the background, so that a JFR chunk flush finds them already resolved
+class MethodTable {
+  private:
+    enum { PREFETCH_QUEUE_SIZE = 8192 };
+
+    SpinLock _lock;
+    PairMap _index;
+    std::vector<ResolvedMethod> _methods;
+    LinearAllocator _strings;
+    Dictionary* _classes;
+
+    jmethodID _queue[PREFETCH_QUEUE_SIZE];
+    u32 _queue_head;
+    u32 _queue_tail;
+
+    const char* copy(const char* s, size_t len);
+
+  public:
+    MethodTable(Dictionary* classes);
+
+    jvmtiError resolve(jmethodID method, ResolvedMethod& result);
+
+    // Async-signal safe. When the queue is full, the method is resolved on first use instead
+    void enqueue(jmethodID method);
+
+    // Resolves queued methods; called from a JVM attached thread outside the profiler lock
+    int prefetch();
+
+    // Must be called along with clearing the class dictionary, while nothing is being queued
+    void clear();
+
+    size_t usedMemory() {
+        return _strings.usedMemory() + _methods.capacity() * sizeof(ResolvedMethod);
+    }
+};
+
+#endif // _METHODTABLE_H
@@ -28,6 +28,7 @@ class Mutex {
     Mutex();
 
     void lock();
+    bool tryLock();
     void unlock();
 };
 
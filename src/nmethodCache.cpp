@@ -0,0 +1,91 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sched.h>
+#include "nmethodCache.h"
+#include "vmStructs.h"
+
+
+NMethodCache::Entry NMethodCache::_entries[NMethodCache::CACHE_SIZE];
+
+
+bool NMethodCache::lookup(const void* pc, NMethodInfo& info) {
+    Entry* e = slot(pc);
+
+    u32 seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) == 0 && pc >= e->start && pc < e->end) {
+        info.nmethod = e->nmethod;
+        info.method_id = e->method_id;
+        info.kind = e->kind;
+        VMMethod* method = e->method;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // The blob memory may have been reused before CompiledMethodUnload arrived:
+        // a compiled entry is still trusted only if it belongs to the same method
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq &&
+            (info.kind != NMETHOD_COMPILED || info.nmethod->method() == method)) {
+            return true;
+        }
+    }
+
+    NMethod* nmethod = CodeHeap::findNMethod(pc);
+    if (nmethod == NULL) {
+        return false;
+    }
+
+    VMMethod* method = NULL;
+    info.nmethod = nmethod;
+    info.method_id = NULL;
+    if (nmethod->isNMethod()) {
+        method = nmethod->method();
+        info.method_id = method->constMethod()->id();
+        info.kind = NMETHOD_COMPILED;
+        if (info.method_id == NULL) {
+            // jmethodID may be created later
+            return true;
+        }
+    } else {
+        info.kind = nmethod->isInterpreter() ? NMETHOD_INTERPRETER : NMETHOD_OTHER;
+    }
+
+    if ((seq & 1) == 0 && __sync_bool_compare_and_swap(&e->seq, seq, seq + 1)) {
+        e->kind = info.kind;
+        e->start = (const char*)nmethod;
+        e->end = (const char*)CodeHeap::blockEnd(nmethod);
+        e->nmethod = nmethod;
+        e->method = method;
+        e->method_id = info.method_id;
+        __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+void NMethodCache::invalidate(const void* address) {
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        Entry* e = &_entries[i];
+        while (address >= e->start && address < e->end) {
+            u32 seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+            if ((seq & 1) == 0 && __sync_bool_compare_and_swap(&e->seq, seq, seq + 1)) {
+                // The slot may have been refilled with another blob meanwhile; drop it anyway
+                e->start = NULL;
+                e->end = NULL;
+                __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NMETHODCACHE_H
+#define _NMETHODCACHE_H
+
+#include <jvmti.h>
+#include "arch.h"
+
+
+class NMethod;
+class VMMethod;
+
+enum NMethodKind {
+    NMETHOD_OTHER,        // runtime stub, adapter, etc.
+    NMETHOD_COMPILED,     // compiled Java method
+    NMETHOD_INTERPRETER
+};
+
+// Properties of a code blob that fillFrameTypes needs; computed once per blob
+struct NMethodInfo {
+    NMethod* nmethod;
+    jmethodID method_id;
+    int kind;
+};
+
+// Direct-mapped cache from a PC in the code heap to the blob that contains it.
+// Saves the segment map walk, the blob name comparison and the method ID lookup on every sample.
+// Both readers and writers run in signal handlers, so instead of a lock, every slot has a sequence
+// number that is odd while the slot is written. A writer that loses the race simply skips caching.
+// Entries of unloaded nmethods are dropped in the CompiledMethodUnload callback
+class NMethodCache {
+  private:
+    static const int CACHE_SIZE = 4096;
+    // PCs within the same 128 bytes share a slot
+    static const int SLOT_SHIFT = 7;
+
+    struct Entry {
+        volatile u32 seq;
+        int kind;
+        const char* start;
+        const char* end;
+        NMethod* nmethod;
+        VMMethod* method;
+        jmethodID method_id;
+    };
+
+    static Entry _entries[CACHE_SIZE];
+
+    static Entry* slot(const void* pc) {
+        return &_entries[((uintptr_t)pc >> SLOT_SHIFT) & (CACHE_SIZE - 1)];
+    }
+
+  public:
+    // Signal safe
+    static bool lookup(const void* pc, NMethodInfo& info);
+
+    // Drops entries of the blob containing the given address
+    static void invalidate(const void* address);
+};
+
+#endif // _NMETHODCACHE_H
@@ -14,32 +14,133 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "objectSampler.h"
+#include "classIdCache.h"
 #include "j9Ext.h"
+#include "os.h"
 #include "profiler.h"
+#include "tsc.h"
+#include "vmStructs.h"
 
 
 u64 ObjectSampler::_interval;
+u64 ObjectSampler::_base_interval;
 volatile u64 ObjectSampler::_allocated_bytes;
+int ObjectSampler::_live;
+LiveRefs ObjectSampler::_live_refs;
+
+
+void LiveRefs::init(JNIEnv* jni, int capacity) {
+    MutexLocker ml(_lock);
+    for (int i = 0; i < _count; i++) {
+        jni->DeleteWeakGlobalRef(_refs[i].ref);
+    }
+    if (capacity != _capacity) {
+        free(_refs);
+        _refs = capacity > 0 ? (LiveRef*)malloc(capacity * sizeof(LiveRef)) : NULL;
+        _capacity = _refs != NULL ? capacity : 0;
+    }
+    _count = 0;
+    _offered = 0;
+    _seed = OS::nanotime() | 1;
+    _purged_gc_count = _gc_count;
+}
+
+void LiveRefs::purge(JNIEnv* jni) {
+    int count = 0;
+    for (int i = 0; i < _count; i++) {
+        if (jni->IsSameObject(_refs[i].ref, NULL)) {
+            jni->DeleteWeakGlobalRef(_refs[i].ref);
+        } else {
+            _refs[count++] = _refs[i];
+        }
+    }
+    _count = count;
+}
+
+void LiveRefs::add(JNIEnv* jni, jobject object, const LiveRef& value) {
+    jweak replaced = NULL;
+    _lock.lock();
+
+    if (_count == _capacity && _gc_count != _purged_gc_count) {
+        _purged_gc_count = _gc_count;
+        purge(jni);
+    }
+
+    int slot = -1;
+    _offered++;
+    if (_count < _capacity) {
+        slot = _count;
+    } else if (_capacity > 0) {
+        // xorshift is good enough to pick a victim
+        _seed ^= _seed << 13;
+        _seed ^= _seed >> 7;
+        _seed ^= _seed << 17;
+        u64 r = _seed % _offered;
+        if (r < (u64)_capacity) {
+            slot = (int)r;
+        }
+    }
+
+    if (slot >= 0) {
+        jweak ref = jni->NewWeakGlobalRef(object);
+        if (ref != NULL) {
+            if (slot < _count) {
+                replaced = _refs[slot].ref;
+            } else {
+                _count++;
+            }
+            _refs[slot] = value;
+            _refs[slot].ref = ref;
+        }
+    }
+
+    _lock.unlock();
+
+    if (replaced != NULL) {
+        jni->DeleteWeakGlobalRef(replaced);
+    }
+}
+
+void LiveRefs::collect(JNIEnv* jni, std::vector<LiveRef>& live) {
+    MutexLocker ml(_lock);
+    purge(jni);
+    _purged_gc_count = _gc_count;
+    live.insert(live.end(), _refs, _refs + _count);
+}
 
 
 void ObjectSampler::JavaObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
                                     jobject object, jclass object_klass, jlong size) {
     if (_enabled) {
-        recordAllocation(jvmti, BCI_ALLOC, object_klass, size);
+        recordAllocation(jvmti, jni, BCI_ALLOC, object, object_klass, size);
     }
 }
 
 void ObjectSampler::VMObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
                                   jobject object, jclass object_klass, jlong size) {
     if (_enabled) {
-        recordAllocation(jvmti, BCI_ALLOC_OUTSIDE_TLAB, object_klass, size);
+        recordAllocation(jvmti, jni, BCI_ALLOC_OUTSIDE_TLAB, object, object_klass, size);
     }
 }
 
-void ObjectSampler::recordAllocation(jvmtiEnv* jvmti, int event_type, jclass object_klass, jlong size) {
-    if (!updateCounter(_allocated_bytes, size, _interval)) {
+void ObjectSampler::SampledObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
+                                       jobject object, jclass object_klass, jlong size) {
+    if (_enabled) {
+        recordAllocation(jvmti, jni, BCI_ALLOC, object, object_klass, size);
+    }
+}
+
+void ObjectSampler::GarbageCollectionFinish(jvmtiEnv* jvmti) {
+    // JNI cannot be used here; dead references are dropped by the next add() or collect()
+    _live_refs.onGC();
+}
+
+void ObjectSampler::recordAllocation(jvmtiEnv* jvmti, JNIEnv* jni, int event_type,
+                                     jobject object, jclass object_klass, jlong size) {
+    if (VM::isOpenJ9() && !updateCounter(_allocated_bytes, size, _interval)) {
         return;
     }
 
@@ -49,7 +150,9 @@ void ObjectSampler::recordAllocation(jvmtiEnv* jvmti, int event_type, jclass obj
     event._instance_size = size;
 
     char* class_name;
-    if (jvmti->GetClassSignature(object_klass, &class_name, NULL) == 0) {
+    if (!VM::isOpenJ9() && VMStructs::hasClassNames()) {
+        event._class_id = ClassIdCache::lookup(VMKlass::fromJavaClass(jni, object_klass));
+    } else if (jvmti->GetClassSignature(object_klass, &class_name, NULL) == 0) {
         if (class_name[0] == 'L') {
             event._class_id = Profiler::instance()->classMap()->lookup(class_name + 1, strlen(class_name) - 2);
         } else {
@@ -58,11 +161,28 @@ void ObjectSampler::recordAllocation(jvmtiEnv* jvmti, int event_type, jclass obj
         jvmti->Deallocate((unsigned char*)class_name);
     }
 
-    Profiler::instance()->recordSample(NULL, size, event_type, &event);
+    u32 call_trace_id = Profiler::instance()->recordSample(NULL, size, event_type, &event);
+    if (_live > 0 && call_trace_id != 0) {
+        LiveRef value = {NULL, (u64)size, TSC::ticks(), call_trace_id, event._class_id, OS::threadId()};
+        _live_refs.add(jni, object, value);
+    }
+}
+
+void ObjectSampler::collectLive(std::vector<LiveRef>& live) {
+    JNIEnv* jni = VM::jni();
+    if (_live > 0 && jni != NULL) {
+        _live_refs.collect(jni, live);
+    }
 }
 
 Error ObjectSampler::check(Arguments& args) {
-    if (J9Ext::InstrumentableObjectAlloc_id < 0) {
+    if (!VM::isOpenJ9()) {
+        jvmtiCapabilities capabilities = {0};
+        VM::jvmti()->GetPotentialCapabilities(&capabilities);
+        if (VM::hotspot_version() < 11 || !capabilities.can_generate_sampled_object_alloc_events) {
+            return Error("SampledObjectAlloc is not supported on this JVM");
+        }
+    } else if (J9Ext::InstrumentableObjectAlloc_id < 0) {
         return Error("InstrumentableObjectAlloc is not supported on this JVM");
     }
     return Error::OK;
@@ -74,10 +194,37 @@ Error ObjectSampler::start(Arguments& args) {
         return error;
     }
 
-    _interval = args._alloc > 1 ? args._alloc : 524287;
+    _interval = _base_interval = args._alloc > 1 ? args._alloc : 524287;
     _allocated_bytes = 0;
 
     jvmtiEnv* jvmti = VM::jvmti();
+    JNIEnv* jni = VM::jni();
+    // Without JNI, e.g. when started before the VM is initialized, objects are not tracked,
+    // and references of the previous session are released by the next start that has JNI
+    _live = jni != NULL ? args._live : 0;
+    if (jni != NULL) {
+        _live_refs.init(jni, _live);
+    }
+    if (_live > 0) {
+        jvmtiCapabilities capabilities = {0};
+        capabilities.can_generate_garbage_collection_events = 1;
+        if (jvmti->AddCapabilities(&capabilities) == 0) {
+            jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL);
+        }
+    }
+
+    if (!VM::isOpenJ9()) {
+        // The capability is taken only for the time of profiling, since it may slow down allocations
+        jvmtiCapabilities capabilities = {0};
+        capabilities.can_generate_sampled_object_alloc_events = 1;
+        if (jvmti->AddCapabilities(&capabilities) != 0) {
+            return Error("Could not enable SampledObjectAlloc events");
+        }
+        jvmti->SetHeapSamplingInterval((jint)_interval);
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, NULL);
+        return Error::OK;
+    }
+
     if (jvmti->SetExtensionEventCallback(J9Ext::InstrumentableObjectAlloc_id, (jvmtiExtensionEvent)JavaObjectAlloc) != 0) {
         return Error("Could not enable InstrumentableObjectAlloc callback");
     }
@@ -88,6 +235,29 @@ Error ObjectSampler::start(Arguments& args) {
 
 void ObjectSampler::stop() {
     jvmtiEnv* jvmti = VM::jvmti();
+    // Tracked objects stay in the reservoir, so that the live profile can be dumped after stop
+    if (_live > 0) {
+        jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL);
+        jvmtiCapabilities capabilities = {0};
+        capabilities.can_generate_garbage_collection_events = 1;
+        jvmti->RelinquishCapabilities(&capabilities);
+    }
+    if (!VM::isOpenJ9()) {
+        jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, NULL);
+        jvmtiCapabilities capabilities = {0};
+        capabilities.can_generate_sampled_object_alloc_events = 1;
+        jvmti->RelinquishCapabilities(&capabilities);
+        return;
+    }
+
     jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_VM_OBJECT_ALLOC, NULL);
     jvmti->SetExtensionEventCallback(J9Ext::InstrumentableObjectAlloc_id, NULL);
 }
+
+long ObjectSampler::scaleInterval(double factor) {
+    _interval = (u64)(_base_interval * factor);
+    if (!VM::isOpenJ9()) {
+        VM::jvmti()->SetHeapSamplingInterval((jint)_interval);
+    }
+    return (long)_interval;
+}
@@ -18,16 +18,70 @@
 #define _OBJECTSAMPLER_H
 
 #include <jvmti.h>
+#include <vector>
 #include "arch.h"
 #include "engine.h"
+#include "mutex.h"
 
 
+struct LiveRef {
+    jweak ref;
+    u64 size;
+    u64 time;
+    u32 trace_id;
+    u32 class_id;
+    int tid;
+};
+
+// Bounded reservoir of weak references to sampled objects along with their allocation sites.
+// When it is full, references to objects collected since the last GC check are dropped first;
+// if there is still no room, a new object replaces a random one with probability capacity / offered,
+// so that the reservoir remains a uniform sample of all tracked allocations.
+// JNI calls may block for a safepoint, so the reservoir is guarded by a Mutex rather than a SpinLock
+class LiveRefs {
+  private:
+    Mutex _lock;
+    LiveRef* _refs;
+    int _capacity;
+    int _count;
+    u64 _offered;
+    u64 _seed;
+    volatile u32 _gc_count;
+    u32 _purged_gc_count;
+
+    void purge(JNIEnv* jni);
+
+  public:
+    LiveRefs() : _lock(), _refs(NULL), _capacity(0), _count(0), _offered(0), _seed(0),
+                 _gc_count(0), _purged_gc_count(0) {
+    }
+
+    // Releases references of the previous session; jni must not be NULL
+    void init(JNIEnv* jni, int capacity);
+
+    void add(JNIEnv* jni, jobject object, const LiveRef& value);
+    void collect(JNIEnv* jni, std::vector<LiveRef>& live);
+
+    void onGC() {
+        __sync_fetch_and_add(&_gc_count, 1);
+    }
+};
+
+
+// Allocation profiler based on JVM TI events rather than breakpoints in HotSpot:
+// InstrumentableObjectAlloc and VMObjectAlloc on OpenJ9, SampledObjectAlloc on HotSpot 11+.
+// SampledObjectAlloc events are already sampled by the JVM with the given mean interval.
+// With the live option, sampled objects are also tracked until they are collected
 class ObjectSampler : public Engine {
   private:
     static u64 _interval;
+    static u64 _base_interval;
     static volatile u64 _allocated_bytes;
+    static int _live;
+    static LiveRefs _live_refs;
 
-    static void recordAllocation(jvmtiEnv* jvmti, int event_type, jclass object_klass, jlong size);
+    static void recordAllocation(jvmtiEnv* jvmti, JNIEnv* jni, int event_type,
+                                 jobject object, jclass object_klass, jlong size);
 
   public:
     const char* title() {
@@ -42,11 +96,21 @@ class ObjectSampler : public Engine {
     Error start(Arguments& args);
     void stop();
 
+    long scaleInterval(double factor);
+
     static void JNICALL JavaObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
                                         jobject object, jclass object_klass, jlong size);
 
     static void JNICALL VMObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
                                       jobject object, jclass object_klass, jlong size);
+
+    static void JNICALL SampledObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
+                                           jobject object, jclass object_klass, jlong size);
+
+    static void JNICALL GarbageCollectionFinish(jvmtiEnv* jvmti);
+
+    // Sampled objects that are still reachable, if the live option was given at start
+    static void collectLive(std::vector<LiveRef>& live);
 };
 
 #endif // _OBJECTSAMPLER_H
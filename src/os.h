@@ -37,6 +37,23 @@ enum ThreadState {
 };
 
 
+struct ProcessStats {
+    u64 rss;                    // bytes
+    u64 native_heap;            // bytes in use by malloc, 0 if unknown
+    u64 voluntary_switches;
+    u64 involuntary_switches;
+    u64 minor_faults;
+    u64 major_faults;
+};
+
+// CFS bandwidth control of the cgroup the process belongs to
+struct CpuThrottling {
+    u64 periods;
+    u64 throttled_periods;
+    u64 throttled_time;         // nanoseconds
+    double quota;               // CPUs, 0 if unlimited
+};
+
 class ThreadList {
   public:
     virtual ~ThreadList() {}
@@ -46,6 +63,19 @@ class ThreadList {
 };
 
 
+// Queries states of many threads repeatedly, keeping per-thread handles open between calls.
+// Not thread safe: every sampler thread owns its own reader.
+class ThreadStateReader {
+  public:
+    virtual ~ThreadStateReader() {}
+    virtual ThreadState read(int thread_id) = 0;
+
+    // Bracket one pass of the calling sampler over its threads
+    virtual void startPass() {}
+    virtual void endPass() {}
+};
+
+
 // W^X memory support
 class JitWriteProtection {
   private:
@@ -72,12 +102,23 @@ class OS {
     static u64 ntoh64(u64 x);
 
     static int getMaxThreadId();
+    static int getCpuCount();
+    static int getCurrentCpu();
+    // NUMA topology is read once by initNumaNodes(); lookups are then signal safe
+    static void initNumaNodes();
+    static int getNumaNode(int cpu);
+    static bool bindToNumaNode(void* addr, size_t size, int node);
     static int processId();
     static int threadId();
     static const char* schedPolicy(int thread_id);
     static bool threadName(int thread_id, char* name_buf, size_t name_len);
     static ThreadState threadState(int thread_id);
+    // CPU time of a thread of this process in nanoseconds, 0 if the thread does not exist
+    static u64 threadCpuTime(int thread_id);
+    // Tells apart threads that had the same ID at different times, 0 if unknown
+    static u64 threadStartTime(int thread_id);
     static ThreadList* listThreads();
+    static ThreadStateReader* threadStateReader();
 
     static bool isJavaLibraryVisible();
 
@@ -87,13 +128,20 @@ class OS {
 
     static void* safeAlloc(size_t size);
     static void safeFree(void* addr, size_t size);
+    static void adviseHugePages(void* addr, size_t size);
+    // Copies memory of this process up to the first unreadable page; returns the number of bytes copied.
+    // Unlike SafeAccess, the end of the readable range is detected without a fault. Signal safe
+    static size_t readMemory(void* dst, const void* src, size_t size);
 
     static bool getCpuDescription(char* buf, size_t size);
     static u64 getProcessCpuTime(u64* utime, u64* stime);
     static u64 getTotalCpuTime(u64* utime, u64* stime);
+    static bool getProcessStats(ProcessStats* stats);
+    static bool getCpuThrottling(CpuThrottling* stats);
 
-    static void copyFile(int src_fd, int dst_fd, off_t offset, size_t size);
+    static bool copyFile(int src_fd, int dst_fd, off_t offset, size_t size);
     static void freePageCache(int fd, off_t start_offset);
+    static void dropWrittenPages(int fd, off_t start_offset, off_t end_offset);
 };
 
 #endif // _OS_H
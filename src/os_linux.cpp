@@ -19,20 +19,25 @@
 #include <arpa/inet.h>
 #include <byteswap.h>
 #include <dirent.h>
+#include <dlfcn.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/times.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
+#include <map>
 #include "os.h"
 
 
@@ -109,6 +114,90 @@ class LinuxThreadList : public ThreadList {
 };
 
 
+// Keeps /proc/self/task/<tid>/stat open, so that every subsequent query is a single pread.
+// A descriptor of an exited thread fails with ESRCH even if the tid is reused.
+// Exited threads are not queried again, so descriptors that have not been read
+// since the previous sweep are closed; a live thread that loses its one is reopened
+class LinuxThreadStateReader : public ThreadStateReader {
+  private:
+    // Do not exhaust the application's file descriptor limit
+    static const size_t MAX_OPEN_FILES = 4096;
+    static const u64 SWEEP_INTERVAL = 1000000000;  // ns
+
+    struct StatFile {
+        int fd;
+        u32 sweep;  // the last sweep the file was read in
+    };
+
+    std::map<int, StatFile> _fds;
+    u32 _sweep;
+    u64 _sweep_time;
+
+  public:
+    LinuxThreadStateReader() : _sweep(0), _sweep_time(OS::nanotime()) {
+    }
+
+    ~LinuxThreadStateReader() {
+        for (std::map<int, StatFile>::const_iterator it = _fds.begin(); it != _fds.end(); ++it) {
+            close(it->second.fd);
+        }
+    }
+
+    void endPass() {
+        u64 now = OS::nanotime();
+        if (now - _sweep_time < SWEEP_INTERVAL) {
+            return;
+        }
+
+        for (std::map<int, StatFile>::iterator it = _fds.begin(); it != _fds.end(); ) {
+            if (it->second.sweep != _sweep) {
+                close(it->second.fd);
+                _fds.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        _sweep++;
+        _sweep_time = now;
+    }
+
+    ThreadState read(int thread_id) {
+        std::map<int, StatFile>::iterator it = _fds.find(thread_id);
+        if (it == _fds.end()) {
+            if (_fds.size() >= MAX_OPEN_FILES) {
+                return OS::threadState(thread_id);
+            }
+
+            char path[64];
+            sprintf(path, "/proc/self/task/%d/stat", thread_id);
+            int fd = open(path, O_RDONLY);
+            if (fd == -1) {
+                return THREAD_INVALID;
+            }
+            StatFile file = {fd, _sweep};
+            it = _fds.insert(std::make_pair(thread_id, file)).first;
+        }
+
+        char buf[512];
+        ssize_t r = pread(it->second.fd, buf, sizeof(buf) - 1, 0);
+        if (r <= 0) {
+            close(it->second.fd);
+            _fds.erase(it);
+            return THREAD_INVALID;
+        }
+        it->second.sweep = _sweep;
+
+        buf[r] = 0;
+        return parseThreadState(buf);
+    }
+
+    static ThreadState parseThreadState(const char* stat) {
+        const char* s = strrchr(stat, ')');
+        return s != NULL && (s[2] == 'R' || s[2] == 'D') ? THREAD_RUNNING : THREAD_SLEEPING;
+    }
+};
+
+
 JitWriteProtection::JitWriteProtection(bool enable) {
     // Not used on Linux
 }
@@ -173,6 +262,78 @@ int OS::getMaxThreadId() {
     return atoi(buf);
 }
 
+int OS::getCpuCount() {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+int OS::getCurrentCpu() {
+    // Served by vDSO, does not normally enter the kernel
+    return sched_getcpu();
+}
+
+// CPUs beyond this are treated as having no known node
+const int MAX_NUMA_CPUS = 4096;
+
+static short numa_nodes[MAX_NUMA_CPUS];
+static bool numa_nodes_ready = false;
+
+void OS::initNumaNodes() {
+    if (numa_nodes_ready) {
+        return;
+    }
+    memset(numa_nodes, 0xff, sizeof(numa_nodes));
+
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (dir != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) != 1) {
+                continue;
+            }
+
+            // cpulist is a comma-separated list of ranges, e.g. "0-17,36-53"
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            FILE* f = fopen(path, "r");
+            if (f == NULL) {
+                continue;
+            }
+            int from, to;
+            while (fscanf(f, "%d", &from) == 1) {
+                to = from;
+                int c = fgetc(f);
+                if (c == '-' && fscanf(f, "%d", &to) == 1) {
+                    c = fgetc(f);
+                }
+                for (int cpu = from; cpu <= to && cpu < MAX_NUMA_CPUS; cpu++) {
+                    numa_nodes[cpu] = (short)node;
+                }
+                if (c != ',') break;
+            }
+            fclose(f);
+        }
+        closedir(dir);
+    }
+
+    numa_nodes_ready = true;
+}
+
+int OS::getNumaNode(int cpu) {
+    return numa_nodes_ready && (u32)cpu < (u32)MAX_NUMA_CPUS ? numa_nodes[cpu] : -1;
+}
+
+// Populated pages stay where they are; only pages touched after the call follow the policy
+bool OS::bindToNumaNode(void* addr, size_t size, int node) {
+    if (node < 0 || node >= 64) {
+        return false;
+    }
+    unsigned long nodemask = 1UL << node;
+    // MPOL_PREFERRED falls back to other nodes when the preferred one is out of memory
+    return syscall(__NR_mbind, addr, size, 1, &nodemask, sizeof(nodemask) * 8, 0) == 0;
+}
+
 int OS::processId() {
     static const int self_pid = getpid();
 
@@ -218,19 +379,61 @@ ThreadState OS::threadState(int thread_id) {
     }
 
     ThreadState state = THREAD_INVALID;
-    if (read(fd, buf, sizeof(buf)) > 0) {
-        char* s = strchr(buf, ')');
-        state = s != NULL && (s[2] == 'R' || s[2] == 'D') ? THREAD_RUNNING : THREAD_SLEEPING;
+    ssize_t r = read(fd, buf, sizeof(buf) - 1);
+    if (r > 0) {
+        buf[r] = 0;
+        state = LinuxThreadStateReader::parseThreadState(buf);
     }
 
     close(fd);
     return state;
 }
 
+u64 OS::threadCpuTime(int thread_id) {
+    // Per-thread CPU clock of another thread, as encoded by MAKE_THREAD_CPUCLOCK(tid, CPUCLOCK_SCHED).
+    // Unlike /proc/self/task/<tid>/stat, it does not need a file and has nanosecond resolution
+    clockid_t clock = (clockid_t)(~(u32)thread_id << 3) | 6;
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0) {
+        return 0;
+    }
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+u64 OS::threadStartTime(int thread_id) {
+    char buf[512];
+    sprintf(buf, "/proc/self/task/%d/stat", thread_id);
+    int fd = open(buf, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+
+    u64 start_time = 0;
+    ssize_t r = read(fd, buf, sizeof(buf) - 1);
+    if (r > 0) {
+        buf[r] = 0;
+        // starttime is the 22nd field; the first two end with ')'
+        const char* s = strrchr(buf, ')');
+        for (int field = 2; field < 22 && s != NULL; field++) {
+            s = strchr(s + 1, ' ');
+        }
+        if (s != NULL) {
+            start_time = strtoull(s + 1, NULL, 10);
+        }
+    }
+
+    close(fd);
+    return start_time;
+}
+
 ThreadList* OS::listThreads() {
     return new LinuxThreadList();
 }
 
+ThreadStateReader* OS::threadStateReader() {
+    return new LinuxThreadStateReader();
+}
+
 bool OS::isJavaLibraryVisible() {
     return false;
 }
@@ -279,6 +482,20 @@ void OS::safeFree(void* addr, size_t size) {
     syscall(__NR_munmap, addr, size);
 }
 
+void OS::adviseHugePages(void* addr, size_t size) {
+#ifdef MADV_HUGEPAGE
+    syscall(__NR_madvise, addr, size, MADV_HUGEPAGE);
+#endif
+}
+
+size_t OS::readMemory(void* dst, const void* src, size_t size) {
+    // Reading own memory needs no ptrace permissions, and a partial read ends at the first unmapped page
+    struct iovec local = {dst, size};
+    struct iovec remote = {(void*)src, size};
+    long result = syscall(__NR_process_vm_readv, processId(), &local, 1, &remote, 1, 0);
+    return result > 0 ? (size_t)result : 0;
+}
+
 bool OS::getCpuDescription(char* buf, size_t size) {
     int fd = open("/proc/cpuinfo", O_RDONLY);
     if (fd == -1) {
@@ -309,15 +526,32 @@ u64 OS::getProcessCpuTime(u64* utime, u64* stime) {
     return real;
 }
 
+// Monitors read the same /proc files periodically; a file opened once
+// returns up-to-date contents on every pread() at offset 0
+static int openProcFile(volatile int* fd, const char* path) {
+    if (*fd == -1) {
+        int new_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (new_fd != -1 && !__sync_bool_compare_and_swap(fd, -1, new_fd)) {
+            close(new_fd);
+        }
+    }
+    return *fd;
+}
+
+static volatile int proc_stat_fd = -1;
+static volatile int proc_statm_fd = -1;
+
 u64 OS::getTotalCpuTime(u64* utime, u64* stime) {
-    int fd = open("/proc/stat", O_RDONLY);
+    int fd = openProcFile(&proc_stat_fd, "/proc/stat");
     if (fd == -1) {
         return (u64)-1;
     }
 
     u64 real = (u64)-1;
     char buf[512];
-    if (read(fd, buf, sizeof(buf)) >= 12) {
+    ssize_t r = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (r >= 12) {
+        buf[r] = 0;
         u64 user, nice, system, idle;
         if (sscanf(buf + 4, "%llu %llu %llu  %llu", &user, &nice, &system, &idle) == 4) {
             *utime = user + nice;
@@ -326,12 +560,235 @@ u64 OS::getTotalCpuTime(u64* utime, u64* stime) {
         }
     }
 
-    close(fd);
     return real;
 }
 
-void OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
-    // copy_file_range() is probably better, but not supported on all kernels
+// Layout of struct mallinfo2 (glibc 2.33+), looked up dynamically to run on older libc and musl
+struct MallInfo2 {
+    size_t arena;
+    size_t ordblks;
+    size_t smblks;
+    size_t hblks;
+    size_t hblkhd;
+    size_t usmblks;
+    size_t fsmblks;
+    size_t uordblks;
+    size_t fordblks;
+    size_t keepcost;
+};
+
+typedef MallInfo2 (*MallInfo2Func)();
+
+bool OS::getProcessStats(ProcessStats* stats) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return false;
+    }
+    stats->voluntary_switches = usage.ru_nvcsw;
+    stats->involuntary_switches = usage.ru_nivcsw;
+    stats->minor_faults = usage.ru_minflt;
+    stats->major_faults = usage.ru_majflt;
+
+    stats->rss = 0;
+    int fd = openProcFile(&proc_statm_fd, "/proc/self/statm");
+    if (fd != -1) {
+        char buf[128];
+        ssize_t r = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (r > 0) {
+            buf[r] = 0;
+            unsigned long long size, resident;
+            if (sscanf(buf, "%llu %llu", &size, &resident) == 2) {
+                stats->rss = resident * page_size;
+            }
+        }
+    }
+
+    static MallInfo2Func mallinfo2 = (MallInfo2Func)dlsym(RTLD_DEFAULT, "mallinfo2");
+    if (mallinfo2 != NULL) {
+        MallInfo2 info = mallinfo2();
+        stats->native_heap = info.uordblks + info.hblkhd;
+    } else {
+        stats->native_heap = 0;
+    }
+
+    return true;
+}
+
+static bool hasToken(const char* list, const char* token) {
+    size_t len = strlen(token);
+    for (const char* p = list; (p = strstr(p, token)) != NULL; p += len) {
+        if ((p == list || p[-1] == ',') && (p[len] == 0 || p[len] == ',')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finds the cgroup directory with the CPU controller: the v1 hierarchy that has "cpu" controller,
+// otherwise the unified v2 hierarchy. In a container with a private cgroup namespace,
+// the mount root is the cgroup itself, so the path is taken relative to the root of the mount
+static bool findCgroupCpuDir(char* dir, size_t size, bool* v2) {
+    FILE* f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    char line[PATH_MAX + 256];
+    char cgroup_path[PATH_MAX] = "";
+    *v2 = true;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = 0;
+        // hierarchy-ID:controller-list:cgroup-path
+        char* controllers = strchr(line, ':');
+        char* path = controllers != NULL ? strchr(++controllers, ':') : NULL;
+        if (path == NULL) {
+            continue;
+        }
+        *path++ = 0;
+
+        if (controllers[0] == 0) {
+            if (*v2) strncpy(cgroup_path, path, sizeof(cgroup_path) - 1);
+        } else if (hasToken(controllers, "cpu")) {
+            strncpy(cgroup_path, path, sizeof(cgroup_path) - 1);
+            *v2 = false;
+        }
+    }
+    fclose(f);
+
+    if (cgroup_path[0] == 0 || (f = fopen("/proc/self/mountinfo", "r")) == NULL) {
+        return false;
+    }
+
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        // ID parent-ID major:minor root mount-point options [optional fields] - fstype source super-options
+        char* separator = strstr(line, " - ");
+        if (separator == NULL) {
+            continue;
+        }
+        *separator = 0;
+
+        char root[PATH_MAX], mount_point[PATH_MAX], fstype[32], super_options[256];
+        if (sscanf(line, "%*s %*s %*s %s %s", root, mount_point) != 2 ||
+            sscanf(separator + 3, "%31s %*s %255s", fstype, super_options) != 2) {
+            continue;
+        }
+
+        if (*v2 ? strcmp(fstype, "cgroup2") == 0 : strcmp(fstype, "cgroup") == 0 && hasToken(super_options, "cpu")) {
+            const char* relative = cgroup_path;
+            size_t root_len = strlen(root);
+            if (strcmp(root, "/") != 0 && strncmp(cgroup_path, root, root_len) == 0) {
+                relative += root_len;
+            }
+            snprintf(dir, size, "%s%s", mount_point, strcmp(relative, "/") == 0 ? "" : relative);
+            found = true;
+
+            // The cgroup path is not always visible from inside a container
+            char file[PATH_MAX];
+            snprintf(file, sizeof(file), "%s/cpu.stat", dir);
+            if (access(file, R_OK) != 0) {
+                snprintf(dir, size, "%s", mount_point);
+            }
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// Discovered once; files stay open. -2 means not discovered yet
+static volatile int cgroup_cpu_stat_fd = -2;
+static int cgroup_quota_fd = -1;
+static int cgroup_period_fd = -1;
+static bool cgroup_v2;
+
+static void discoverCgroup() {
+    char dir[PATH_MAX];
+    int stat_fd = -1;
+    if (findCgroupCpuDir(dir, sizeof(dir) - 32, &cgroup_v2)) {
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%s/cpu.stat", dir);
+        stat_fd = open(file, O_RDONLY | O_CLOEXEC);
+
+        snprintf(file, sizeof(file), cgroup_v2 ? "%s/cpu.max" : "%s/cpu.cfs_quota_us", dir);
+        cgroup_quota_fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (!cgroup_v2) {
+            snprintf(file, sizeof(file), "%s/cpu.cfs_period_us", dir);
+            cgroup_period_fd = open(file, O_RDONLY | O_CLOEXEC);
+        }
+    }
+    cgroup_cpu_stat_fd = stat_fd;
+}
+
+static ssize_t preadString(int fd, char* buf, size_t size) {
+    ssize_t r = fd == -1 ? -1 : pread(fd, buf, size - 1, 0);
+    buf[r > 0 ? r : 0] = 0;
+    return r;
+}
+
+bool OS::getCpuThrottling(CpuThrottling* stats) {
+    if (cgroup_cpu_stat_fd == -2) {
+        discoverCgroup();
+    }
+
+    char buf[1024];
+    if (preadString(cgroup_cpu_stat_fd, buf, sizeof(buf)) <= 0) {
+        return false;
+    }
+
+    memset(stats, 0, sizeof(CpuThrottling));
+    char* save;
+    for (char* line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        char key[32];
+        unsigned long long value;
+        if (sscanf(line, "%31s %llu", key, &value) != 2) {
+            continue;
+        }
+        if (strcmp(key, "nr_periods") == 0) {
+            stats->periods = value;
+        } else if (strcmp(key, "nr_throttled") == 0) {
+            stats->throttled_periods = value;
+        } else if (strcmp(key, "throttled_usec") == 0) {
+            stats->throttled_time = value * 1000;
+        } else if (strcmp(key, "throttled_time") == 0) {
+            stats->throttled_time = value;
+        }
+    }
+
+    // v2: "max 100000" or "$QUOTA $PERIOD"; v1: quota is -1 when unlimited
+    long long quota = -1, period = 0;
+    if (cgroup_v2) {
+        if (preadString(cgroup_quota_fd, buf, sizeof(buf)) > 0 && sscanf(buf, "%lld %lld", &quota, &period) != 2) {
+            quota = -1;
+        }
+    } else if (preadString(cgroup_quota_fd, buf, sizeof(buf)) > 0) {
+        quota = atoll(buf);
+        if (preadString(cgroup_period_fd, buf, sizeof(buf)) > 0) {
+            period = atoll(buf);
+        }
+    }
+    stats->quota = quota > 0 && period > 0 ? (double)quota / period : 0;
+
+    return true;
+}
+
+// Copies in the kernel when possible: copy_file_range() shares or copies extents without
+// touching user space (Linux 4.5+, across file systems since 5.3), sendfile() moves data
+// through the page cache only; plain read/write is the last resort. Returns false on a short copy
+bool OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
+    off_t start = offset;
+
+#ifdef __NR_copy_file_range
+    while (size > 0) {
+        loff_t src_offset = offset;
+        ssize_t bytes = syscall(__NR_copy_file_range, src_fd, &src_offset, dst_fd, NULL, size, 0);
+        if (bytes <= 0) {
+            break;
+        }
+        offset += bytes;
+        size -= (size_t)bytes;
+    }
+#endif
+
     while (size > 0) {
         ssize_t bytes = sendfile(dst_fd, src_fd, &offset, size);
         if (bytes <= 0) {
@@ -339,10 +796,34 @@ void OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
         }
         size -= (size_t)bytes;
     }
+
+    if (size > 0) {
+        char buf[65536];
+        while (size > 0) {
+            ssize_t bytes = pread(src_fd, buf, size < sizeof(buf) ? size : sizeof(buf), offset);
+            if (bytes <= 0 || write(dst_fd, buf, bytes) != bytes) {
+                break;
+            }
+            offset += bytes;
+            size -= (size_t)bytes;
+        }
+    }
+
+    // The source is not going to be read again
+    posix_fadvise(src_fd, start & ~page_mask, offset - (start & ~page_mask), POSIX_FADV_DONTNEED);
+    return size == 0;
 }
 
 void OS::freePageCache(int fd, off_t start_offset) {
     posix_fadvise(fd, start_offset & ~page_mask, 0, POSIX_FADV_DONTNEED);
 }
 
+// Dirty pages cannot be dropped: write them back first
+void OS::dropWrittenPages(int fd, off_t start_offset, off_t end_offset) {
+    start_offset &= ~page_mask;
+    sync_file_range(fd, start_offset, end_offset - start_offset,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, start_offset, end_offset - start_offset, POSIX_FADV_DONTNEED);
+}
+
 #endif // __linux__
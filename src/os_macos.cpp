@@ -18,12 +18,14 @@
 
 #include <libkern/OSByteOrder.h>
 #include <libproc.h>
+#include <malloc/malloc.h>
 #include <mach/mach.h>
 #include <mach/mach_host.h>
 #include <mach/mach_time.h>
 #include <mach/processor_info.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/sysctl.h>
 #include <sys/time.h>
 #include <sys/times.h>
@@ -82,6 +84,58 @@ class MacThreadList : public ThreadList {
 };
 
 
+// How long the number of running threads of the task is trusted
+const u64 RUNNING_COUNT_INTERVAL = 1000000;  // ns
+
+// There is no batched thread_info(), but one proc_pidinfo() call tells how many threads
+// of the task are running. Samplers stop querying threads once they have seen that many:
+// in a large mostly idle process, the rest are known to be sleeping without a Mach call each.
+// Every wall sampler covers its own subset of threads, so the count is shared by all readers,
+// and samplers in the middle of a pass are not expected to be found
+class MacThreadStateReader : public ThreadStateReader {
+  private:
+    static volatile u64 _count_time;
+    static volatile int _running_left;  // running threads not seen yet since the count was taken
+    static volatile int _active_passes;
+
+  public:
+    ThreadState read(int thread_id) {
+        u64 now = OS::nanotime();
+        u64 count_time = _count_time;
+        if (now - count_time >= RUNNING_COUNT_INTERVAL && __sync_bool_compare_and_swap(&_count_time, count_time, now)) {
+            struct proc_taskinfo info;
+            if (proc_pidinfo(OS::processId(), PROC_PIDTASKINFO, 0, &info, sizeof(info)) == sizeof(info)) {
+                _running_left = info.pti_numrunning - _active_passes;
+            } else {
+                _running_left = 0x7fffffff;
+            }
+        }
+
+        if (_running_left <= 0) {
+            return THREAD_SLEEPING;
+        }
+
+        ThreadState state = OS::threadState(thread_id);
+        if (state == THREAD_RUNNING) {
+            atomicInc(_running_left, -1);
+        }
+        return state;
+    }
+
+    void startPass() {
+        atomicInc(_active_passes);
+    }
+
+    void endPass() {
+        atomicInc(_active_passes, -1);
+    }
+};
+
+volatile u64 MacThreadStateReader::_count_time = 0;
+volatile int MacThreadStateReader::_running_left = 0;
+volatile int MacThreadStateReader::_active_passes = 0;
+
+
 JitWriteProtection::JitWriteProtection(bool enable) {
 #ifdef __aarch64__
     // Mimic pthread_jit_write_protect_np(), but save the previous state
@@ -160,6 +214,27 @@ int OS::getMaxThreadId() {
     return 0x7fffffff;
 }
 
+int OS::getCpuCount() {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+int OS::getCurrentCpu() {
+    // No cheap way to find the current CPU
+    return -1;
+}
+
+void OS::initNumaNodes() {
+}
+
+int OS::getNumaNode(int cpu) {
+    return -1;
+}
+
+bool OS::bindToNumaNode(void* addr, size_t size, int node) {
+    return false;
+}
+
 int OS::processId() {
     static const int self_pid = getpid();
 
@@ -193,10 +268,34 @@ ThreadState OS::threadState(int thread_id) {
     return info.run_state == TH_STATE_RUNNING ? THREAD_RUNNING : THREAD_SLEEPING;
 }
 
+u64 OS::threadCpuTime(int thread_id) {
+    struct thread_basic_info info;
+    mach_msg_type_number_t size = sizeof(info);
+    if (thread_info((thread_act_t)thread_id, THREAD_BASIC_INFO, (thread_info_t)&info, &size) != 0) {
+        return 0;
+    }
+    return ((u64)info.user_time.seconds + info.system_time.seconds) * 1000000000 +
+           ((u64)info.user_time.microseconds + info.system_time.microseconds) * 1000;
+}
+
+u64 OS::threadStartTime(int thread_id) {
+    // Mach ports are recycled, but the system-wide thread ID is unique
+    struct thread_identifier_info info;
+    mach_msg_type_number_t size = THREAD_IDENTIFIER_INFO_COUNT;
+    if (thread_info((thread_act_t)thread_id, THREAD_IDENTIFIER_INFO, (thread_info_t)&info, &size) != 0) {
+        return 0;
+    }
+    return info.thread_id;
+}
+
 ThreadList* OS::listThreads() {
     return new MacThreadList();
 }
 
+ThreadStateReader* OS::threadStateReader() {
+    return new MacThreadStateReader();
+}
+
 bool OS::isJavaLibraryVisible() {
     return true;
 }
@@ -261,6 +360,29 @@ void OS::safeFree(void* addr, size_t size) {
     munmap(addr, size);
 }
 
+void OS::adviseHugePages(void* addr, size_t size) {
+    // Superpages are not available for anonymous memory allocated this way
+}
+
+size_t OS::readMemory(void* dst, const void* src, size_t size) {
+    // vm_read_overwrite fails as a whole if any page is unreadable, so read page by page
+    size_t copied = 0;
+    while (copied < size) {
+        uintptr_t addr = (uintptr_t)src + copied;
+        size_t chunk = vm_page_size - (addr & (vm_page_size - 1));
+        if (chunk > size - copied) {
+            chunk = size - copied;
+        }
+        vm_size_t out_size;
+        if (vm_read_overwrite(mach_task_self(), addr, chunk, (vm_address_t)dst + copied, &out_size) != KERN_SUCCESS ||
+            out_size == 0) {
+            break;
+        }
+        copied += out_size;
+    }
+    return copied;
+}
+
 bool OS::getCpuDescription(char* buf, size_t size) {
     return sysctlbyname("machdep.cpu.brand_string", buf, &size, NULL, 0) == 0;
 }
@@ -301,10 +423,39 @@ u64 OS::getTotalCpuTime(u64* utime, u64* stime) {
     return user + system + idle;
 }
 
-void OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
+bool OS::getProcessStats(ProcessStats* stats) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return false;
+    }
+    stats->voluntary_switches = usage.ru_nvcsw;
+    stats->involuntary_switches = usage.ru_nivcsw;
+    stats->minor_faults = usage.ru_minflt;
+    stats->major_faults = usage.ru_majflt;
+
+    struct mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) == 0) {
+        stats->rss = info.resident_size;
+    } else {
+        stats->rss = 0;
+    }
+
+    malloc_statistics_t malloc_stats;
+    malloc_zone_statistics(NULL, &malloc_stats);
+    stats->native_heap = malloc_stats.size_in_use;
+
+    return true;
+}
+
+bool OS::getCpuThrottling(CpuThrottling* stats) {
+    return false;
+}
+
+bool OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
     char* buf = (char*)mmap(NULL, size + offset, PROT_READ, MAP_PRIVATE, src_fd, 0);
-    if (buf == NULL) {
-        return;
+    if (buf == MAP_FAILED) {
+        return false;
     }
 
     while (size > 0) {
@@ -317,10 +468,15 @@ void OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
     }
 
     munmap(buf, offset);
+    return size == 0;
 }
 
 void OS::freePageCache(int fd, off_t start_offset) {
     // Not supported on macOS
 }
 
+void OS::dropWrittenPages(int fd, off_t start_offset, off_t end_offset) {
+    // Not supported on macOS
+}
+
 #endif // __APPLE__
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pairMap.h"
+
+
+static const u32 INITIAL_PAIR_MAP_CAPACITY = 1024;
+
+
+PairMap::PairMap() : _capacity(INITIAL_PAIR_MAP_CAPACITY), _size(0) {
+    _table = new Entry[_capacity]();
+}
+
+PairMap::~PairMap() {
+    delete[] _table;
+}
+
+u32 PairMap::hash(u64 key1, u64 key2) {
+    const u64 M = 0xc6a4a7935bd1e995ULL;
+    u64 h = (key1 * M) ^ key2;
+    h *= M;
+    h ^= h >> 47;
+    return (u32)h;
+}
+
+bool PairMap::get(u64 key1, u64 key2, u32& value) const {
+    u32 mask = _capacity - 1;
+    for (u32 slot = hash(key1, key2) & mask; _table[slot].value != 0; slot = (slot + 1) & mask) {
+        if (_table[slot].key1 == key1 && _table[slot].key2 == key2) {
+            value = _table[slot].value - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void PairMap::put(u64 key1, u64 key2, u32 value) {
+    if (_size >= _capacity / 2) {
+        grow();
+    }
+
+    u32 mask = _capacity - 1;
+    u32 slot = hash(key1, key2) & mask;
+    while (_table[slot].value != 0 && (_table[slot].key1 != key1 || _table[slot].key2 != key2)) {
+        slot = (slot + 1) & mask;
+    }
+
+    if (_table[slot].value == 0) {
+        _table[slot].key1 = key1;
+        _table[slot].key2 = key2;
+        _size++;
+    }
+    _table[slot].value = value + 1;
+}
+
+void PairMap::clear() {
+    delete[] _table;
+    _capacity = INITIAL_PAIR_MAP_CAPACITY;
+    _size = 0;
+    _table = new Entry[_capacity]();
+}
+
+void PairMap::grow() {
+    Entry* old_table = _table;
+    u32 old_capacity = _capacity;
+
+    _capacity = old_capacity * 2;
+    _table = new Entry[_capacity]();
+
+    u32 mask = _capacity - 1;
+    for (u32 i = 0; i < old_capacity; i++) {
+        if (old_table[i].value != 0) {
+            u32 slot = hash(old_table[i].key1, old_table[i].key2) & mask;
+            while (_table[slot].value != 0) {
+                slot = (slot + 1) & mask;
+            }
+            _table[slot] = old_table[i];
+        }
+    }
+
+    delete[] old_table;
+}
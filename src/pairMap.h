@@ -0,0 +1,48 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PAIRMAP_H
+#define _PAIRMAP_H
+
+#include "arch.h"
+
+
+// Open addressing hash map from a pair of 64-bit keys to u32 values
+class PairMap {
+  private:
+    struct Entry {
+        u64 key1;
+        u64 key2;
+        u32 value;  // 0 denotes an empty slot; stored values are shifted by 1
+    };
+
+    Entry* _table;
+    u32 _capacity;
+    u32 _size;
+
+    static u32 hash(u64 key1, u64 key2);
+    void grow();
+
+  public:
+    PairMap();
+    ~PairMap();
+
+    bool get(u64 key1, u64 key2, u32& value) const;
+    void put(u64 key1, u64 key2, u32 value);
+    void clear();
+};
+
+#endif // _PAIRMAP_H
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pauseTracker.h"
+#include "objectSampler.h"
+#include "profiler.h"
+#include "tsc.h"
+#include "vmStructs.h"
+
+
+bool PauseTracker::_enabled = false;
+volatile bool PauseTracker::_in_gc = false;
+u64 PauseTracker::_gc_start = 0;
+
+
+Error PauseTracker::start() {
+    jvmtiEnv* jvmti = VM::jvmti();
+    if (jvmti == NULL) {
+        return Error("GC pauses can be tracked only in a JVM");
+    }
+
+    jvmtiCapabilities capabilities = {0};
+    capabilities.can_generate_garbage_collection_events = 1;
+    if (jvmti->AddCapabilities(&capabilities) != 0) {
+        return Error("Could not enable GarbageCollectionStart events");
+    }
+
+    _in_gc = false;
+    _enabled = true;
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, NULL);
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL);
+    return Error::OK;
+}
+
+void PauseTracker::stop() {
+    if (!_enabled) {
+        return;
+    }
+
+    // Called after ObjectSampler has stopped, so it no longer needs GarbageCollectionFinish either
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, NULL);
+    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL);
+    jvmtiCapabilities capabilities = {0};
+    capabilities.can_generate_garbage_collection_events = 1;
+    jvmti->RelinquishCapabilities(&capabilities);
+    _enabled = false;
+    _in_gc = false;
+}
+
+const char* PauseTracker::pauseName() {
+    if (_in_gc) {
+        return "gc_pause";
+    }
+    return VMStructs::atSafepoint() ? "safepoint_pause" : NULL;
+}
+
+void PauseTracker::GarbageCollectionStart(jvmtiEnv* jvmti) {
+    if (_enabled) {
+        _gc_start = TSC::ticks();
+        _in_gc = true;
+    }
+}
+
+void PauseTracker::GarbageCollectionFinish(jvmtiEnv* jvmti) {
+    // The only GarbageCollectionFinish callback is shared with the live object tracker
+    ObjectSampler::GarbageCollectionFinish(jvmti);
+
+    if (_enabled && _in_gc) {
+        _in_gc = false;
+        GCPauseEvent event;
+        event._start_time = _gc_start;
+        event._end_time = TSC::ticks();
+        Profiler::instance()->recordPause(&event);
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PAUSETRACKER_H
+#define _PAUSETRACKER_H
+
+#include <jvmti.h>
+#include "arch.h"
+#include "arguments.h"
+
+
+// Tells whether the JVM is in a GC or at a safepoint right now. GC pauses are timed
+// with JVM TI GarbageCollectionStart/Finish and recorded as JFR events; samples taken
+// during a pause get a pseudo-frame naming it, so that any output format shows them apart
+class PauseTracker {
+  private:
+    static bool _enabled;
+    static volatile bool _in_gc;
+    static u64 _gc_start;
+
+  public:
+    static Error start();
+    static void stop();
+
+    // Async-signal safe; NULL when the JVM is not paused
+    static const char* pauseName();
+
+    static void JNICALL GarbageCollectionStart(jvmtiEnv* jvmti);
+    static void JNICALL GarbageCollectionFinish(jvmtiEnv* jvmti);
+};
+
+#endif // _PAUSETRACKER_H
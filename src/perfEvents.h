@@ -17,25 +17,88 @@
 #ifndef _PERFEVENTS_H
 #define _PERFEVENTS_H
 
+#include <pthread.h>
 #include <signal.h>
+#include <vector>
 #include "arch.h"
 #include "engine.h"
 
 
+// Number of perf events that can be sampled together in one session
+const int MAX_PERF_EVENTS = 4;
+
 class PerfEvent;
 class PerfEventType;
+class RingBuffer;
+struct TimeBase;
+struct perf_event_attr;
 
 class PerfEvents : public Engine {
   private:
     static int _max_events;
     static PerfEvent* _events;
     static PerfEventType* _event_type;
+    static PerfEventType* _event_types[MAX_PERF_EVENTS];
+    static char _event_names[MAX_PERF_EVENTS][64];
+    static int _event_count;
     static long _interval;
+    static long _base_interval;
     static Ring _ring;
     static CStack _cstack;
     static bool _use_mmap_page;
 
+    // Batch mode: samples are drained from the mmap rings by a collector thread
+    static bool _batch;
+    static bool _stack_copy;
+    static size_t _mmap_size;
+    static int _epoll_fd;
+    static int _wakeup_fd[2];
+    static pthread_t _collector;
+    static u64 _lost_samples;
+
+    // Per-CPU mode: _events are indexed by CPU rather than by thread ID
+    static bool _per_cpu;
+    static int _cgroup_fd;
+
+    // Number of calls the hardware LBR stack holds; deeper stacks are continued in software
+    static int _lbr_depth;
+
+    // Off-CPU mode: every sched_switch is sampled and weighted by the time until the thread runs again
+    static bool _offcpu;
+
+    // Compiled Java frames keep the frame pointer, so the kernel callchain goes on past them
+    static bool _java_fp;
+
+    // Call count mode: the kernel counts every hit, stacks are still sampled once per interval
+    static bool _count_hits;
+
+    static void* collectorEntry(void* unused) {
+        collectorLoop();
+        return NULL;
+    }
+
+    static void collectorLoop();
+    static Error startCollector();
+    static void stopCollector();
+    static void drainBuffer(PerfEvent* event);
+    static void recordRingSample(RingBuffer& ring, PerfEvent* event, u32 pid, const TimeBase& time_base);
+    static int convertCallchain(RingBuffer& ring, u64 nr, ASGCT_CallFrame* frames);
+    static void recordSwitchIn(PerfEvent* event, const TimeBase& time_base, u64 switch_in_time);
+
+    static Error resolveEvents(Arguments& args);
+    static int createEvent(int tid, int cpu, int fd = -1);
+    static int createForThreads(ThreadList* thread_list, bool* created);
+    static void initAttr(struct perf_event_attr* attr, PerfEventType* event_type, long interval);
+    static long memberInterval(PerfEventType* event_type);
+    static u32 findEventIndex(PerfEvent* event, int fd);
+    static int createForCpu(int cpu);
+    static void closeCgroup();
+
+    static int continueLbrStack(void* ucontext, const void* lbr_bottom, int lbr_bottom_calls,
+                                const void** callchain, int max_depth, const void** last_pc);
+
     static u64 readCounter(siginfo_t* siginfo, void* ucontext);
+    static void countHits(int fd);
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
     static void signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext);
 
@@ -43,6 +106,7 @@ class PerfEvents : public Engine {
     Error check(Arguments& args);
     Error start(Arguments& args);
     void stop();
+    long scaleInterval(double factor);
 
     const char* title();
     const char* units();
@@ -53,6 +117,26 @@ class PerfEvents : public Engine {
     static bool supported();
     static const char* getEventName(int event_id);
 
+    static int eventCount() {
+        return _event_count;
+    }
+
+    static const char* eventName(int index) {
+        return _event_names[index];
+    }
+
+    static bool countsHits() {
+        return _count_hits;
+    }
+
+    // Set after start, when ring=kernel has survived the check for kernel symbols
+    static bool kernelOnly() {
+        return _ring == RING_KERNEL;
+    }
+
+    // Total number of events per thread since the start, including threads that have exited
+    static u64 collectHits(std::vector<std::pair<int, u64> >& hits);
+
     static int createForThread(int tid);
     static void destroyForThread(int tid);
 };
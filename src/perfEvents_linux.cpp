@@ -17,21 +17,25 @@
 #ifdef __linux__
 
 #include <jvmti.h>
+#include <limits.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <linux/perf_event.h>
 #include "arch.h"
+#include "dwarf.h"
 #include "j9StackTraces.h"
 #include "log.h"
 #include "os.h"
@@ -42,6 +46,8 @@
 #include "stackFrame.h"
 #include "stackWalker.h"
 #include "symbols.h"
+#include "threadRegistry.h"
+#include "tsc.h"
 #include "vmStructs.h"
 
 
@@ -78,6 +84,43 @@ static int fetchInt(const char* file_name) {
     return atoi(num);
 }
 
+// Opens the cgroup of the current process for PERF_FLAG_PID_CGROUP.
+// Returns -1 if the process runs in the root cgroup or the cgroup is not found
+static int openCgroup() {
+    FILE* f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    // Prefer perf_event controller of cgroup v1, otherwise the unified hierarchy of cgroup v2
+    char line[1024];
+    char path[PATH_MAX] = "";
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = 0;
+        char* controllers = strchr(line, ':');
+        char* cgroup = controllers != NULL ? strchr(controllers + 1, ':') : NULL;
+        if (cgroup == NULL) {
+            continue;
+        }
+        *cgroup++ = 0;
+        controllers++;
+
+        if (strcmp(controllers, "perf_event") == 0 || strstr(controllers, ",perf_event") != NULL) {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup/perf_event%s", cgroup);
+            break;
+        } else if (controllers[0] == 0 && strncmp(line, "0", 2) == 0) {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s", cgroup);
+        }
+    }
+    fclose(f);
+
+    size_t len = strlen(path);
+    if (len == 0 || path[len - 1] == '/') {
+        return -1;
+    }
+    return open(path, O_RDONLY | O_DIRECTORY);
+}
+
 // Get perf_event_attr.config numeric value of the given tracepoint name
 // by reading /sys/kernel/debug/tracing/events/<name>/id file
 static int findTracepointId(const char* name) {
@@ -88,7 +131,14 @@ static int findTracepointId(const char* name) {
 
     *strchr(buf, ':') = '/';  // make path from event name
 
-    return fetchInt(buf);
+    int id = fetchInt(buf);
+    if (id <= 0) {
+        // tracefs may be mounted without debugfs
+        snprintf(buf, sizeof(buf), "/sys/kernel/tracing/events/%s/id", name);
+        *strchr(buf, ':') = '/';
+        id = fetchInt(buf);
+    }
+    return id;
 }
 
 // Get perf_event_attr.type for the given event source
@@ -165,10 +215,14 @@ static int pthread_setspecific_hook(pthread_key_t key, const void* value) {
 
     if (value != NULL) {
         int result = pthread_setspecific(key, value);
-        PerfEvents::createForThread(OS::threadId());
+        int tid = OS::threadId();
+        ThreadRegistry::add(tid);
+        PerfEvents::createForThread(tid);
         return result;
     } else {
-        PerfEvents::destroyForThread(OS::threadId());
+        int tid = OS::threadId();
+        PerfEvents::destroyForThread(tid);
+        ThreadRegistry::remove(tid);
         return pthread_setspecific(key, value);
     }
 }
@@ -201,6 +255,7 @@ struct PerfEventType {
         IDX_TRACEPOINT,
         IDX_KPROBE,
         IDX_UPROBE,
+        IDX_OFFCPU,
     };
 
     static PerfEventType AVAILABLE_EVENTS[];
@@ -297,6 +352,16 @@ struct PerfEventType {
         return tracepoint;
     }
 
+    static PerfEventType* getOffCpu() {
+        int tracepoint_id = findTracepointId("sched:sched_switch");
+        if (tracepoint_id <= 0) {
+            return NULL;
+        }
+        PerfEventType* offcpu = &AVAILABLE_EVENTS[IDX_OFFCPU];
+        offcpu->config = tracepoint_id;
+        return offcpu;
+    }
+
     static PerfEventType* getProbe(PerfEventType* probe, const char* type, const char* name, __u64 ret) {
         strncpy(probe_func, name, sizeof(probe_func) - 1);
         probe_func[sizeof(probe_func) - 1] = 0;
@@ -390,6 +455,10 @@ struct PerfEventType {
             }
         }
 
+        if (strcmp(name, EVENT_OFFCPU) == 0) {
+            return getOffCpu();
+        }
+
         // Hardware breakpoint
         if (strncmp(name, "mem:", 4) == 0) {
             return getBreakpoint(name + 4, HW_BREAKPOINT_RW, 1);
@@ -473,6 +542,8 @@ PerfEventType PerfEventType::AVAILABLE_EVENTS[] = {
 
     {"kprobe:func",                 1, 0, 0}, /* IDX_KPROBE */
     {"uprobe:path",                 1, 0, 0}, /* IDX_UPROBE */
+
+    {EVENT_OFFCPU,                  1, PERF_TYPE_TRACEPOINT, 0}, /* IDX_OFFCPU */
 };
 
 FunctionWithCounter PerfEventType::KNOWN_FUNCTIONS[] = {
@@ -491,37 +562,69 @@ FunctionWithCounter PerfEventType::KNOWN_FUNCTIONS[] = {
 char PerfEventType::probe_func[256];
 
 
+// Number of data pages in the ring of every thread in batch mode
+const int BATCH_RING_PAGES = 16;
+const int MAX_BATCH_FRAMES = 256;
+const int MAX_EPOLL_EVENTS = 64;
+const int COLLECTOR_TIMEOUT_MS = 100;
+
+// LBR depth of the CPUs where the kernel does not report it
+const int DEFAULT_LBR_DEPTH = 16;
+
+// Longest x86 instruction; a return address follows its call site within this distance
+const uintptr_t MAX_CALL_INSN_SIZE = 15;
+
+
 class RingBuffer {
   private:
     const char* _start;
+    unsigned long _mask;
     unsigned long _offset;
 
   public:
-    RingBuffer(struct perf_event_mmap_page* page) {
+    RingBuffer(struct perf_event_mmap_page* page, unsigned long mask = OS::page_mask) {
         _start = (const char*)page + OS::page_size;
+        _mask = mask;
     }
 
     struct perf_event_header* seek(u64 offset) {
-        _offset = (unsigned long)offset & OS::page_mask;
+        _offset = (unsigned long)offset & _mask;
         return (struct perf_event_header*)(_start + _offset);
     }
 
     u64 next() {
-        _offset = (_offset + sizeof(u64)) & OS::page_mask;
+        _offset = (_offset + sizeof(u64)) & _mask;
         return *(u64*)(_start + _offset);
     }
 
     u64 peek(unsigned long words) {
-        unsigned long peek_offset = (_offset + words * sizeof(u64)) & OS::page_mask;
+        unsigned long peek_offset = (_offset + words * sizeof(u64)) & _mask;
         return *(u64*)(_start + peek_offset);
     }
 };
 
 
+// In off-CPU mode, the last sched_switch sample of a thread waits here until the thread
+// is switched back in; num_frames is 0 when nothing is pending
+struct SwitchOutSample {
+    u64 time;  // CLOCK_MONOTONIC nanoseconds when the thread left the CPU
+    int tid;
+    int num_frames;
+    ASGCT_CallFrame frames[MAX_BATCH_FRAMES + RESERVED_FRAMES];
+};
+
+
 class PerfEvent : public SpinLock {
   private:
     int _fd;
     struct perf_event_mmap_page* _page;
+    // Other members of the group led by _fd, writing to the same ring
+    int _group_fds[MAX_PERF_EVENTS - 1];
+    u64 _ids[MAX_PERF_EVENTS];
+    // In call count mode, hits of the leader counted before its last reset
+    u64 _hits;
+    // In off-CPU mode, allocated by the collector on the first sample
+    SwitchOutSample* _switch_out;
 
     friend class PerfEvents;
 };
@@ -530,10 +633,30 @@ class PerfEvent : public SpinLock {
 int PerfEvents::_max_events = 0;
 PerfEvent* PerfEvents::_events = NULL;
 PerfEventType* PerfEvents::_event_type = NULL;
+PerfEventType* PerfEvents::_event_types[MAX_PERF_EVENTS];
+char PerfEvents::_event_names[MAX_PERF_EVENTS][64];
+int PerfEvents::_event_count = 0;
+static PerfEventType _event_type_copies[MAX_PERF_EVENTS];
 long PerfEvents::_interval;
+long PerfEvents::_base_interval;
 Ring PerfEvents::_ring;
 CStack PerfEvents::_cstack;
 bool PerfEvents::_use_mmap_page;
+bool PerfEvents::_batch = false;
+bool PerfEvents::_stack_copy = false;
+size_t PerfEvents::_mmap_size;
+int PerfEvents::_epoll_fd = -1;
+int PerfEvents::_wakeup_fd[2] = {-1, -1};
+pthread_t PerfEvents::_collector;
+u64 PerfEvents::_lost_samples;
+bool PerfEvents::_per_cpu = false;
+int PerfEvents::_cgroup_fd = -1;
+bool PerfEvents::_offcpu = false;
+bool PerfEvents::_java_fp = false;
+bool PerfEvents::_count_hits = false;
+static Mutex _exited_hits_lock;
+static std::vector<std::pair<int, u64> > _exited_hits;
+int PerfEvents::_lbr_depth = DEFAULT_LBR_DEPTH;
 
 int PerfEvents::createForThread(int tid) {
     if (tid >= _max_events) {
@@ -551,83 +674,237 @@ int PerfEvents::createForThread(int tid) {
         // Lost race. The event is created either from PerfEvents::start() or from pthread hook.
         return -1;
     }
+    _events[tid]._hits = 0;
 
-    struct perf_event_attr attr = {0};
-    attr.size = sizeof(attr);
-    attr.type = event_type->type;
+    return createEvent(tid, -1);
+}
 
-    if (attr.type == PERF_TYPE_BREAKPOINT) {
-        attr.bp_type = event_type->config;
+// In per-CPU mode, one event per CPU counts all threads of the process cgroup
+// (or of the whole system, if the cgroup is unknown); samples of other processes are filtered out
+int PerfEvents::createForCpu(int cpu) {
+    _events[cpu]._fd = -1;
+    return createEvent(_cgroup_fd, cpu);
+}
+
+void PerfEvents::initAttr(struct perf_event_attr* attr, PerfEventType* event_type, long interval) {
+    memset(attr, 0, sizeof(struct perf_event_attr));
+    attr->size = sizeof(struct perf_event_attr);
+    attr->type = event_type->type;
+
+    if (attr->type == PERF_TYPE_BREAKPOINT) {
+        attr->bp_type = event_type->config;
     } else {
-        attr.config = event_type->config;
+        attr->config = event_type->config;
     }
-    attr.config1 = event_type->config1;
-    attr.config2 = event_type->config2;
+    attr->config1 = event_type->config1;
+    attr->config2 = event_type->config2;
 
     // Hardware events may not always support zero skid
-    if (attr.type == PERF_TYPE_SOFTWARE) {
-        attr.precise_ip = 2;
+    if (attr->type == PERF_TYPE_SOFTWARE) {
+        attr->precise_ip = 2;
+    }
+
+    attr->sample_period = interval;
+    attr->sample_type = PERF_SAMPLE_CALLCHAIN;
+    attr->disabled = 1;
+
+    if (_batch) {
+        // No signals: the collector is woken up when a quarter of the ring is filled.
+        // The kernel timestamps every sample, since it is recorded long after it is taken
+        attr->sample_type |= PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD;
+        attr->use_clockid = 1;
+        attr->clockid = CLOCK_MONOTONIC;
+        attr->watermark = 1;
+        attr->wakeup_watermark = BATCH_RING_PAGES * OS::page_size / 4;
+    } else {
+        attr->wakeup_events = 1;
     }
 
-    attr.sample_period = _interval;
-    attr.sample_type = PERF_SAMPLE_CALLCHAIN;
-    attr.disabled = 1;
-    attr.wakeup_events = 1;
+    if (_event_count > 1) {
+        // Records of all group members share one ring, the identifier tells them apart
+        attr->sample_type |= PERF_SAMPLE_IDENTIFIER;
+    }
 
-    if (_ring == RING_USER) {
-        attr.exclude_kernel = 1;
+    if (_offcpu) {
+        // sched_switch samples give the stack and the time a thread leaves the CPU;
+        // PERF_RECORD_SWITCH records, which carry the time as well, tell when it comes back
+        attr->context_switch = 1;
+        attr->sample_id_all = 1;
+
+        // The tracepoint always fires in the kernel, so only the kernel part of the stack can be dropped
+        if (_ring == RING_USER) {
+            attr->exclude_callchain_kernel = 1;
+        }
+    } else if (_ring == RING_USER) {
+        attr->exclude_kernel = 1;
     } else if (_ring == RING_KERNEL) {
-        attr.exclude_user = 1;
+        attr->exclude_user = 1;
     }
 
-    if (_cstack == CSTACK_FP || _cstack == CSTACK_DWARF) {
-        attr.exclude_callchain_user = 1;
+    if ((_cstack == CSTACK_FP || _cstack == CSTACK_DWARF || _cstack == CSTACK_AUTO || _cstack == CSTACK_VM) && !_batch) {
+        attr->exclude_callchain_user = 1;
     }
 
 #ifdef PERF_ATTR_SIZE_VER5
     if (_cstack == CSTACK_LBR) {
-        attr.sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
-        attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
-        attr.sample_regs_user = 1ULL << PERF_REG_PC;
-        attr.exclude_callchain_user = 1;
+        attr->sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
+        attr->branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
+        attr->sample_regs_user = 1ULL << PERF_REG_PC;
+        attr->exclude_callchain_user = 1;
     }
 #else
 #warning "Compiling without LBR support. Kernel headers 4.1+ required"
 #endif
+}
+
+// Requests the events of many threads from fdtransfer at once, MAX_PERF_FD_BATCH threads per round trip
+int PerfEvents::createForThreads(ThreadList* thread_list, bool* created) {
+    struct perf_event_attr attr;
+    initAttr(&attr, _event_type, _interval);
+
+    int err = 0;
+    int tids[MAX_PERF_FD_BATCH];
+    int fds[MAX_PERF_FD_BATCH];
+    int errors[MAX_PERF_FD_BATCH];
+
+    for (bool more = true; more; ) {
+        int count = 0;
+        for (int tid; count < MAX_PERF_FD_BATCH && (more = (tid = thread_list->next()) != -1); ) {
+            if (tid >= _max_events) {
+                Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_events);
+            } else if (__sync_bool_compare_and_swap(&_events[tid]._fd, 0, -1)) {
+                _events[tid]._hits = 0;
+                tids[count++] = tid;
+            }
+        }
+
+        if (count > 0 && FdTransferClient::requestPerfFds(count, tids, &attr, fds, errors) != 0) {
+            // Fall back to one request per thread
+            for (int i = 0; i < count; i++) {
+                if ((err = createEvent(tids[i], -1)) == 0) {
+                    *created = true;
+                }
+            }
+            continue;
+        }
 
-    int fd;
-    if (FdTransferClient::hasPeer()) {
+        for (int i = 0; i < count; i++) {
+            if (fds[i] == -1) {
+                err = errors[i];
+                Log::warn("perf_event_open for TID %d failed: %s", tids[i], strerror(err));
+                // Let the thread be retried, e.g. in the next profiling session
+                _events[tids[i]]._fd = 0;
+            } else if ((err = createEvent(tids[i], -1, fds[i])) == 0) {
+                *created = true;
+            }
+        }
+    }
+    return err;
+}
+
+// Opens the event for the given thread, or for all threads on the given CPU if cpu != -1.
+// The event is stored in _events[tid] or _events[cpu] respectively.
+// With several events, the first one leads a group, so that the kernel schedules all counters together.
+// An fd already obtained from fdtransfer can be passed to complete the setup
+int PerfEvents::createEvent(int tid, int cpu, int fd) {
+    struct perf_event_attr attr;
+    initAttr(&attr, _event_type, _interval);
+
+    unsigned long flags = cpu != -1 && tid != -1 ? PERF_FLAG_PID_CGROUP : 0;
+    int index = cpu != -1 ? cpu : tid;
+    if (fd != -1) {
+        // Opened by the caller
+    } else if (cpu == -1 && FdTransferClient::hasPeer()) {
         fd = FdTransferClient::requestPerfFd(&tid, &attr);
+        index = tid;
     } else {
-        fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+        fd = syscall(__NR_perf_event_open, &attr, tid, cpu, -1, flags);
     }
 
     if (fd == -1) {
         int err = errno;
-        Log::warn("perf_event_open for TID %d failed: %s", tid, strerror(errno));
+        if (cpu != -1) {
+            Log::warn("perf_event_open for CPU %d failed: %s", cpu, strerror(errno));
+        } else {
+            Log::warn("perf_event_open for TID %d failed: %s", tid, strerror(errno));
+        }
+        _events[index]._fd = 0;
         return err;
     }
 
-    void* page = _use_mmap_page ? mmap(NULL, 2 * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : NULL;
+    void* page = _use_mmap_page ? mmap(NULL, _mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : NULL;
     if (page == MAP_FAILED) {
         Log::warn("perf_event mmap failed: %s", strerror(errno));
         page = NULL;
+        if (_batch) {
+            // Samples have nowhere to go without the ring
+            int err = errno;
+            close(fd);
+            _events[index]._fd = 0;
+            return err;
+        }
+    }
+
+    PerfEvent* event = &_events[index];
+    event->reset();
+    event->_page = (struct perf_event_mmap_page*)page;
+
+    for (int i = 1; i < _event_count; i++) {
+        struct perf_event_attr member_attr;
+        initAttr(&member_attr, _event_types[i], memberInterval(_event_types[i]));
+        member_attr.disabled = 0;  // enabled together with the leader
+
+        int member_fd = syscall(__NR_perf_event_open, &member_attr, tid, cpu, fd, flags);
+        if (member_fd == -1) {
+            Log::warn("perf_event_open for %s failed: %s", _event_names[i], strerror(errno));
+            event->_group_fds[i - 1] = 0;
+            continue;
+        }
+        if (page != NULL) {
+            ioctl(member_fd, PERF_EVENT_IOC_SET_OUTPUT, fd);
+        }
+        ioctl(member_fd, PERF_EVENT_IOC_ID, &event->_ids[i]);
+        event->_group_fds[i - 1] = member_fd;
+    }
+    if (_event_count > 1) {
+        ioctl(fd, PERF_EVENT_IOC_ID, &event->_ids[0]);
     }
+    event->_fd = fd;
 
-    _events[tid].reset();
-    _events[tid]._fd = fd;
-    _events[tid]._page = (struct perf_event_mmap_page*)page;
+    if (_batch) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = index;
+        epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+        ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        return 0;
+    }
 
     struct f_owner_ex ex;
     ex.type = F_OWNER_TID;
     ex.pid = tid;
 
-    fcntl(fd, F_SETFL, O_ASYNC);
-    fcntl(fd, F_SETSIG, SIGPROF);
-    fcntl(fd, F_SETOWN_EX, &ex);
+    // Every member of the group overflows on its own and sends its own signal
+    for (int i = 0; i < _event_count; i++) {
+        int member_fd = i == 0 ? fd : event->_group_fds[i - 1];
+        if (member_fd <= 0) {
+            continue;
+        }
+        fcntl(member_fd, F_SETFL, O_ASYNC);
+        fcntl(member_fd, F_SETSIG, SIGPROF);
+        fcntl(member_fd, F_SETOWN_EX, &ex);
+        ioctl(member_fd, PERF_EVENT_IOC_RESET, 0);
+    }
 
-    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
-    ioctl(fd, PERF_EVENT_IOC_REFRESH, 1);
+    // The leader goes last, since it enables the whole group
+    for (int i = _event_count - 1; i >= 0; i--) {
+        int member_fd = i == 0 ? fd : event->_group_fds[i - 1];
+        if (member_fd > 0) {
+            ioctl(member_fd, PERF_EVENT_IOC_REFRESH, 1);
+        }
+    }
 
     return 0;
 }
@@ -641,16 +918,250 @@ void PerfEvents::destroyForThread(int tid) {
     int fd = event->_fd;
     if (fd > 0 && __sync_bool_compare_and_swap(&event->_fd, fd, 0)) {
         ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (_count_hits && !_per_cpu) {
+            u64 value;
+            u64 hits = event->_hits + (read(fd, &value, sizeof(value)) == sizeof(value) ? value : 0);
+            if (hits > 0) {
+                MutexLocker ml(_exited_hits_lock);
+                _exited_hits.push_back(std::make_pair(tid, hits));
+            }
+        }
+        for (int i = 1; i < _event_count; i++) {
+            if (event->_group_fds[i - 1] > 0) {
+                close(event->_group_fds[i - 1]);
+                event->_group_fds[i - 1] = 0;
+            }
+        }
         close(fd);
     }
     if (event->_page != NULL) {
         event->lock();
-        munmap(event->_page, 2 * OS::page_size);
+        if (_batch) {
+            // Do not lose the last samples of an exiting thread
+            drainBuffer(event);
+        }
+        munmap(event->_page, _mmap_size);
         event->_page = NULL;
+        if (event->_switch_out != NULL) {
+            // The thread is still off the CPU when profiling stops: count the time until now
+            TimeBase time_base = {TSC::ticks(), OS::nanotime()};
+            recordSwitchIn(event, time_base, time_base.nanos);
+            free(event->_switch_out);
+            event->_switch_out = NULL;
+        }
         event->unlock();
     }
 }
 
+void PerfEvents::closeCgroup() {
+    if (_cgroup_fd != -1) {
+        close(_cgroup_fd);
+        _cgroup_fd = -1;
+    }
+}
+
+Error PerfEvents::startCollector() {
+    _lost_samples = 0;
+
+    if ((_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 || pipe(_wakeup_fd) != 0) {
+        stopCollector();
+        return Error("Could not create perf_event collector");
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (u64)-1;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wakeup_fd[0], &ev);
+
+    if (pthread_create(&_collector, NULL, collectorEntry, NULL) != 0) {
+        close(_wakeup_fd[1]);
+        _wakeup_fd[1] = -1;
+        stopCollector();
+        return Error("Unable to create perf_event collector thread");
+    }
+    return Error::OK;
+}
+
+void PerfEvents::stopCollector() {
+    if (_wakeup_fd[1] != -1) {
+        // Closing the write end makes the read end ready and terminates the collector
+        close(_wakeup_fd[1]);
+        _wakeup_fd[1] = -1;
+        pthread_join(_collector, NULL);
+    }
+
+    if (_wakeup_fd[0] != -1) {
+        close(_wakeup_fd[0]);
+        _wakeup_fd[0] = -1;
+    }
+    if (_epoll_fd != -1) {
+        close(_epoll_fd);
+        _epoll_fd = -1;
+    }
+}
+
+void PerfEvents::collectorLoop() {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    while (true) {
+        int count = epoll_wait(_epoll_fd, events, MAX_EPOLL_EVENTS, COLLECTOR_TIMEOUT_MS);
+        if (count < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.u64 == (u64)-1) {
+                return;
+            }
+
+            // The event may be destroyed concurrently: drainBuffer() checks the page under the lock
+            PerfEvent* event = &_events[events[i].data.u64];
+            event->lock();
+            drainBuffer(event);
+            event->unlock();
+        }
+    }
+}
+
+// Converts all pending records of the ring into samples. Java frames cannot be walked
+// outside the signal context, so they are resolved from the return addresses of the kernel callchain.
+// Must be called with the event lock held.
+void PerfEvents::drainBuffer(PerfEvent* event) {
+    struct perf_event_mmap_page* page = event->_page;
+    if (page == NULL) {
+        return;
+    }
+
+    u64 tail = page->data_tail;
+    u64 head = page->data_head;
+    rmb();
+
+    RingBuffer ring(page, BATCH_RING_PAGES * OS::page_size - 1);
+    u32 pid = OS::processId();
+
+    // Sample times are CLOCK_MONOTONIC; the whole batch is converted to ticks against one reference point
+    TimeBase time_base = {TSC::ticks(), OS::nanotime()};
+
+    while (tail < head) {
+        struct perf_event_header* hdr = ring.seek(tail);
+        if (hdr->type == PERF_RECORD_SAMPLE && _enabled) {
+            recordRingSample(ring, event, pid, time_base);
+        } else if (hdr->type == PERF_RECORD_SWITCH && _offcpu && !(hdr->misc & PERF_RECORD_MISC_SWITCH_OUT)) {
+            // struct { u32 pid, tid; u64 time; }
+            ring.next();
+            recordSwitchIn(event, time_base, ring.next());
+        } else if (hdr->type == PERF_RECORD_LOST) {
+            ring.next();  // id
+            _lost_samples += ring.next();
+        }
+        tail += hdr->size;
+    }
+
+    __atomic_store_n(&page->data_tail, head, __ATOMIC_RELEASE);
+}
+
+// Parses the sample record the ring is positioned at. In off-CPU mode, the sample is kept
+// until the thread is switched back in, and then weighted by the nanoseconds it spent off the CPU
+void PerfEvents::recordRingSample(RingBuffer& ring, PerfEvent* event, u32 pid, const TimeBase& time_base) {
+    u32 event_index = 0;
+    if (_event_count > 1) {
+        u64 id = ring.next();
+        while (event_index < _event_count - 1 && event->_ids[event_index] != id) {
+            event_index++;
+        }
+    }
+
+    // struct { u32 pid, tid; }
+    u64 ids = ring.next();
+    u32 pid_tid[2];
+    memcpy(pid_tid, &ids, sizeof(pid_tid));
+    if (pid_tid[0] != pid) {
+        // Per-CPU events also see other processes of the cgroup
+        return;
+    }
+
+    u64 sample_time = ring.next();
+    // struct { u32 cpu, res; }
+    u64 cpu_res = ring.next();
+    int cpu = (int)(u32)cpu_res;
+    u64 period = ring.next();
+    u64 nr = ring.next();
+
+    if (_offcpu) {
+        SwitchOutSample* sample = event->_switch_out;
+        if (sample == NULL && (sample = event->_switch_out = (SwitchOutSample*)malloc(sizeof(SwitchOutSample))) == NULL) {
+            return;
+        }
+        // For sched_switch, the sample time is when the thread left the CPU
+        sample->time = sample_time;
+        sample->tid = pid_tid[1];
+        sample->num_frames = convertCallchain(ring, nr, sample->frames);
+        return;
+    }
+
+    ASGCT_CallFrame frames[MAX_BATCH_FRAMES + RESERVED_FRAMES];
+    int num_frames = convertCallchain(ring, nr, frames);
+    Profiler::instance()->recordExternalSample(period, pid_tid[1], num_frames, frames, event_index,
+                                               time_base.toTicks(sample_time), cpu);
+}
+
+// Native frames are resolved as in the signal handler. A return address in the code heap is
+// a Java frame; past a compiled frame, the frame pointer is only trusted with PreserveFramePointer
+int PerfEvents::convertCallchain(RingBuffer& ring, u64 nr, ASGCT_CallFrame* frames) {
+    Profiler* profiler = Profiler::instance();
+    const void* callchain[MAX_BATCH_FRAMES];
+    int depth = 0;
+    int num_frames = 0;
+    bool java = false;
+
+    for (; nr > 0; nr--) {
+        const void* ip = (const void*)ring.next();
+        if ((u64)ip >= PERF_CONTEXT_MAX) {
+            continue;
+        } else if (CodeHeap::contains(ip)) {
+            num_frames += profiler->convertNativeTrace(depth, callchain, frames + num_frames);
+            depth = 0;
+            java = true;
+
+            bool compiled;
+            num_frames += StackWalker::resolveJavaFrames(ip, frames + num_frames, MAX_BATCH_FRAMES - num_frames, &compiled);
+            if (compiled && !_java_fp) {
+                if (num_frames < MAX_BATCH_FRAMES && nr > 1) {
+                    frames[num_frames].bci = BCI_ERROR;
+                    frames[num_frames].method_id = (jmethodID)"break_compiled";
+                    num_frames++;
+                }
+                break;
+            }
+        } else if (num_frames + depth < MAX_BATCH_FRAMES) {
+            callchain[depth++] = ip;
+        }
+    }
+
+
+    num_frames += profiler->convertNativeTrace(depth, callchain, frames + num_frames);
+    if (num_frames == 0) {
+        frames[0].bci = BCI_ERROR;
+        frames[0].method_id = (jmethodID)(java ? "Java_code" : "no_Java_frame");
+        num_frames = 1;
+    }
+    return num_frames;
+}
+
+void PerfEvents::recordSwitchIn(PerfEvent* event, const TimeBase& time_base, u64 switch_in_time) {
+    SwitchOutSample* sample = event->_switch_out;
+    if (sample == NULL || sample->num_frames == 0) {
+        return;
+    }
+
+    u64 duration = switch_in_time > sample->time ? switch_in_time - sample->time : 0;
+    OffCpuEvent offcpu;
+    offcpu._start_time = time_base.toTicks(sample->time);
+    offcpu._end_time = offcpu._start_time + TSC::fromNanos(duration);
+    Profiler::instance()->recordExternalSample(duration, sample->tid, sample->num_frames, sample->frames, BCI_OFF_CPU, &offcpu);
+    sample->num_frames = 0;
+}
+
 u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext) {
     switch (_event_type->counter_arg) {
         case 1: return StackFrame(ucontext).arg0();
@@ -664,6 +1175,51 @@ u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext) {
     }
 }
 
+// Saves the hits of the current thread before the signal handler resets the counter.
+// Only the thread itself updates its _hits
+void PerfEvents::countHits(int fd) {
+    int tid = OS::threadId();
+    u64 value;
+    if (tid < _max_events && _events[tid]._fd == fd && read(fd, &value, sizeof(value)) == sizeof(value)) {
+        _events[tid]._hits += value;
+    }
+}
+
+u64 PerfEvents::collectHits(std::vector<std::pair<int, u64> >& hits) {
+    u64 total = 0;
+    {
+        MutexLocker ml(_exited_hits_lock);
+        for (size_t i = 0; i < _exited_hits.size(); i++) {
+            hits.push_back(_exited_hits[i]);
+            total += _exited_hits[i].second;
+        }
+    }
+
+    if (_events != NULL && !_per_cpu) {
+        ThreadList* thread_list = OS::listThreads();
+        for (int tid; (tid = thread_list->next()) != -1; ) {
+            if (tid >= _max_events) continue;
+            int fd = _events[tid]._fd;
+            u64 value;
+            if (fd > 0 && read(fd, &value, sizeof(value)) == sizeof(value) && _events[tid]._hits + value > 0) {
+                hits.push_back(std::make_pair(tid, _events[tid]._hits + value));
+                total += _events[tid]._hits + value;
+            }
+        }
+        delete thread_list;
+    }
+    return total;
+}
+
+u32 PerfEvents::findEventIndex(PerfEvent* event, int fd) {
+    for (int i = 1; i < _event_count; i++) {
+        if (event->_group_fds[i - 1] == fd) {
+            return i;
+        }
+    }
+    return 0;
+}
+
 void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     if (siginfo->si_code <= 0) {
         // Looks like an external signal; don't treat as a profiling event
@@ -671,13 +1227,21 @@ void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     }
 
     if (_enabled) {
+        // Timestamp first, so that the time of the sample does not include its processing
+        ExecutionEvent event(TSC::ticks());
         u64 counter = readCounter(siginfo, ucontext);
-        ExecutionEvent event;
+        if (_event_count > 1) {
+            int tid = OS::threadId();
+            event._event_index = tid < _max_events ? findEventIndex(&_events[tid], siginfo->si_fd) : 0;
+        }
         Profiler::instance()->recordSample(ucontext, counter, 0, &event);
     } else {
         resetBuffer(OS::threadId());
     }
 
+    if (_count_hits) {
+        countHits(siginfo->si_fd);
+    }
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, 0);
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_REFRESH, 1);
 }
@@ -698,6 +1262,9 @@ void PerfEvents::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext)
         resetBuffer(OS::threadId());
     }
 
+    if (_count_hits) {
+        countHits(siginfo->si_fd);
+    }
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, 0);
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_REFRESH, 1);
 }
@@ -705,6 +1272,8 @@ void PerfEvents::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext)
 const char* PerfEvents::title() {
     if (_event_type == NULL || _event_type->name == EVENT_CPU) {
         return "CPU profile";
+    } else if (_offcpu) {
+        return "Off-CPU profile";
     } else if (_event_type->type == PERF_TYPE_SOFTWARE || _event_type->type == PERF_TYPE_HARDWARE || _event_type->type == PERF_TYPE_HW_CACHE) {
         return _event_type->name;
     } else {
@@ -713,7 +1282,7 @@ const char* PerfEvents::title() {
 }
 
 const char* PerfEvents::units() {
-    return _event_type == NULL || _event_type->name == EVENT_CPU ? "ns" : "total";
+    return _event_type == NULL || _event_type->name == EVENT_CPU || _offcpu ? "ns" : "total";
 }
 
 Error PerfEvents::check(Arguments& args) {
@@ -753,7 +1322,7 @@ Error PerfEvents::check(Arguments& args) {
         attr.exclude_kernel = Symbols::haveKernelSymbols() ? 0 : 1;
     }
 
-    if (_cstack == CSTACK_FP || _cstack == CSTACK_DWARF) {
+    if (_cstack == CSTACK_FP || _cstack == CSTACK_DWARF || _cstack == CSTACK_AUTO || _cstack == CSTACK_VM) {
         attr.exclude_callchain_user = 1;
     }
 
@@ -775,12 +1344,56 @@ Error PerfEvents::check(Arguments& args) {
     return Error::OK;
 }
 
+// The first event comes from event=, the others from repeated event= options in the reverse order.
+// Types are copied, since probes and breakpoints share one PerfEventType descriptor per kind
+Error PerfEvents::resolveEvents(Arguments& args) {
+    const char* names[MAX_PERF_EVENTS];
+    int count = 1;
+    names[0] = args._event;
+    for (int offset = args._extra_events; offset != 0; offset = ((int*)(args._buf + offset))[-1]) {
+        if (count == MAX_PERF_EVENTS) {
+            return Error("Too many perf events");
+        }
+        names[count++] = args._buf + offset;
+    }
+    for (int i = 1, j = count - 1; i < j; i++, j--) {
+        const char* tmp = names[i];
+        names[i] = names[j];
+        names[j] = tmp;
+    }
+
+    if (count > 1) {
+        if (FdTransferClient::hasPeer()) {
+            return Error("Multiple perf events are not supported with fdtransfer");
+        } else if (VM::isOpenJ9()) {
+            return Error("Multiple perf events are not supported on OpenJ9");
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        PerfEventType* event_type = PerfEventType::forName(names[i]);
+        if (event_type == NULL) {
+            return Error("Unsupported event type");
+        } else if (event_type->counter_arg > 4) {
+            return Error("Only arguments 1-4 can be counted");
+        } else if (event_type->counter_arg > 0 && i > 0) {
+            return Error("Function arguments can be counted only for the first event");
+        }
+        _event_type_copies[i] = *event_type;
+        _event_types[i] = &_event_type_copies[i];
+        strncpy(_event_names[i], names[i], sizeof(_event_names[i]) - 1);
+        _event_names[i][sizeof(_event_names[i]) - 1] = 0;
+    }
+
+    _event_type = _event_types[0];
+    _event_count = count;
+    return Error::OK;
+}
+
 Error PerfEvents::start(Arguments& args) {
-    _event_type = PerfEventType::forName(args._event);
-    if (_event_type == NULL) {
-        return Error("Unsupported event type");
-    } else if (_event_type->counter_arg > 4) {
-        return Error("Only arguments 1-4 can be counted");
+    Error error = resolveEvents(args);
+    if (error) {
+        return error;
     }
 
     if (_pthread_entry == NULL && (_pthread_entry = lookupThreadEntry()) == NULL) {
@@ -790,7 +1403,21 @@ Error PerfEvents::start(Arguments& args) {
     if (args._interval < 0) {
         return Error("interval must be positive");
     }
-    _interval = args._interval ? args._interval : _event_type->default_interval;
+    _interval = _base_interval = args._interval ? args._interval : _event_type->default_interval;
+
+    _offcpu = strcmp(_event_type->name, EVENT_OFFCPU) == 0;
+    if (_offcpu) {
+        if (_event_count > 1) {
+            return Error("offcpu cannot be combined with other perf events");
+        } else if (args._perf_per_cpu) {
+            return Error("offcpu is not supported with percpu");
+        }
+        // Every context switch is recorded; the weight comes from the off-CPU time, not from the period
+        _interval = _base_interval = 1;
+    }
+
+    char* preserve_fp = (char*)JVMFlag::find("PreserveFramePointer");
+    _java_fp = preserve_fp != NULL && *preserve_fp;
 
     _ring = args._ring;
     if (_ring != RING_USER && !Symbols::haveKernelSymbols()) {
@@ -800,19 +1427,58 @@ Error PerfEvents::start(Arguments& args) {
         _ring = RING_USER;
     }
     _cstack = args._cstack;
-    _use_mmap_page = _cstack != CSTACK_NO && (_ring != RING_USER || _cstack == CSTACK_DEFAULT || _cstack == CSTACK_LBR);
+    if (_cstack == CSTACK_LBR) {
+        int lbr_depth = fetchInt("/sys/bus/event_source/devices/cpu/caps/branches");
+        _lbr_depth = lbr_depth > 0 ? lbr_depth : DEFAULT_LBR_DEPTH;
+    }
+    _per_cpu = args._perf_per_cpu;
+    _batch = args._perf_batch || _per_cpu || _offcpu;
+    _stack_copy = args._stack_copy > 0;
+    if (_per_cpu && FdTransferClient::hasPeer()) {
+        return Error("percpu is not supported with fdtransfer");
+    }
+    if (args._call_count && (_per_cpu || _offcpu)) {
+        return Error("callcount needs per-thread perf events");
+    }
+    _count_hits = args._call_count;
+    {
+        MutexLocker ml(_exited_hits_lock);
+        _exited_hits.clear();
+    }
+    if (_batch) {
+        if (_cstack == CSTACK_DWARF || _cstack == CSTACK_LBR || _cstack == CSTACK_AUTO || _cstack == CSTACK_VM) {
+            return Error(_offcpu ? "offcpu supports only cstack=fp or cstack=no" : "perfbatch supports only cstack=fp or cstack=no");
+        } else if (_stack_copy) {
+            return Error(_offcpu ? "offcpu does not support stackcopy" : "perfbatch does not support stackcopy");
+        } else if (_event_type->counter_arg > 0) {
+            return Error("perfbatch cannot count function arguments");
+        } else if (VM::isOpenJ9()) {
+            return Error("perfbatch is not supported on OpenJ9");
+        }
+        // Even with cstack=no, the ring is needed to deliver samples
+        _use_mmap_page = true;
+        _mmap_size = (1 + BATCH_RING_PAGES) * OS::page_size;
+    } else {
+        _use_mmap_page = _cstack != CSTACK_NO && (_ring != RING_USER || _cstack == CSTACK_DEFAULT || _cstack == CSTACK_LBR);
+        _mmap_size = 2 * OS::page_size;
+    }
 
-    int max_events = OS::getMaxThreadId();
+    int max_events = _per_cpu ? OS::getCpuCount() : OS::getMaxThreadId();
     if (max_events != _max_events) {
         free(_events);
         _events = (PerfEvent*)calloc(max_events, sizeof(PerfEvent));
         _max_events = max_events;
     }
 
-    if (VM::isOpenJ9()) {
+    if (_batch) {
+        error = startCollector();
+        if (error) {
+            return error;
+        }
+    } else if (VM::isOpenJ9()) {
         if (_cstack == CSTACK_DEFAULT) _cstack = CSTACK_DWARF;
         OS::installSignalHandler(SIGPROF, signalHandlerJ9);
-        Error error = J9StackTraces::start(args);
+        error = J9StackTraces::start(args);
         if (error) {
             return error;
         }
@@ -820,24 +1486,44 @@ Error PerfEvents::start(Arguments& args) {
         OS::installSignalHandler(SIGPROF, signalHandler);
     }
 
-    // Enable pthread hook before traversing currently running threads
-    __atomic_store_n(_pthread_entry, (void*)pthread_setspecific_hook, __ATOMIC_RELEASE);
-
-    // Create perf_events for all existing threads
     int err;
     bool created = false;
-    ThreadList* thread_list = OS::listThreads();
-    for (int tid; (tid = thread_list->next()) != -1; ) {
-        if ((err = createForThread(tid)) == 0) {
-            created = true;
+    if (_per_cpu) {
+        // Thread start and exit need no syscalls, so the pthread hook is not installed
+        _cgroup_fd = openCgroup();
+        for (int cpu = 0; cpu < _max_events; cpu++) {
+            if ((err = createForCpu(cpu)) == 0) {
+                created = true;
+            }
+        }
+    } else {
+        // Enable pthread hook before traversing currently running threads
+        __atomic_store_n(_pthread_entry, (void*)pthread_setspecific_hook, __ATOMIC_RELEASE);
+
+        // Create perf_events for all existing threads
+        ThreadList* thread_list = OS::listThreads();
+        if (FdTransferClient::hasPeer()) {
+            err = createForThreads(thread_list, &created);
+        } else {
+            for (int tid; (tid = thread_list->next()) != -1; ) {
+                if ((err = createForThread(tid)) == 0) {
+                    created = true;
+                }
+            }
         }
+        delete thread_list;
     }
-    delete thread_list;
 
     if (!created) {
         __atomic_store_n(_pthread_entry, (void*)pthread_setspecific, __ATOMIC_RELEASE);
+        if (_batch) {
+            stopCollector();
+        }
+        closeCgroup();
         J9StackTraces::stop();
-        if (err == EACCES || err == EPERM) {
+        if (_per_cpu && (err == EACCES || err == EPERM)) {
+            return Error("No access to per-CPU perf events. Try 'sysctl kernel.perf_event_paranoid=0' or CAP_PERFMON");
+        } else if (err == EACCES || err == EPERM) {
             return Error("No access to perf events. Try --fdtransfer or --all-user option or 'sysctl kernel.perf_event_paranoid=1'");
         } else {
             return Error("Perf events unavailable");
@@ -848,10 +1534,53 @@ Error PerfEvents::start(Arguments& args) {
 
 void PerfEvents::stop() {
     __atomic_store_n(_pthread_entry, (void*)pthread_setspecific, __ATOMIC_RELEASE);
+    if (_batch) {
+        stopCollector();
+    }
+    // In per-CPU mode, the same loop destroys events of all CPUs
     for (int i = 0; i < _max_events; i++) {
         destroyForThread(i);
     }
+    closeCgroup();
     J9StackTraces::stop();
+
+    if (_batch && _lost_samples > 0) {
+        Log::warn("perf_event rings overflowed, %llu samples lost", (unsigned long long)_lost_samples);
+    }
+}
+
+// Group members are throttled in proportion to the leader
+long PerfEvents::memberInterval(PerfEventType* event_type) {
+    return (long)((double)event_type->default_interval * _interval / _base_interval);
+}
+
+long PerfEvents::scaleInterval(double factor) {
+    if (_offcpu) {
+        // Skipping context switches would lose the matching switch-in
+        return _interval;
+    }
+
+    // Events created after this point get the new period from initAttr
+    _interval = (long)(_base_interval * factor);
+
+    for (int i = 0; i < _max_events; i++) {
+        PerfEvent* event = &_events[i];
+        if (event->_fd <= 0) {
+            continue;
+        }
+
+        // The new period takes effect after the next overflow
+        u64 period = _interval;
+        ioctl(event->_fd, PERF_EVENT_IOC_PERIOD, &period);
+        for (int j = 1; j < _event_count; j++) {
+            if (event->_group_fds[j - 1] > 0) {
+                u64 member_period = memberInterval(_event_types[j]);
+                ioctl(event->_group_fds[j - 1], PERF_EVENT_IOC_PERIOD, &member_period);
+            }
+        }
+    }
+
+    return _interval;
 }
 
 int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_depth, const void** last_pc) {
@@ -861,6 +1590,8 @@ int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_de
     }
 
     int depth = 0;
+    const void* lbr_bottom = NULL;
+    int lbr_bottom_calls = 0;
 
     struct perf_event_mmap_page* page = event->_page;
     if (page != NULL) {
@@ -873,6 +1604,9 @@ int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_de
         while (tail < head) {
             struct perf_event_header* hdr = ring.seek(tail);
             if (hdr->type == PERF_RECORD_SAMPLE) {
+                if (_event_count > 1) {
+                    ring.next();  // PERF_SAMPLE_IDENTIFIER
+                }
                 u64 nr = ring.next();
                 while (nr-- > 0) {
                     u64 ip = ring.next();
@@ -889,6 +1623,8 @@ int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_de
 
                 if (_cstack == CSTACK_LBR) {
                     u64 bnr = ring.next();
+                    bool lbr_full = bnr >= (u64)_lbr_depth;
+                    int lbr_start = depth;
 
                     // Last userspace PC is stored right after branch stack
                     const void* pc = (const void*)ring.peek(bnr * 3 + 2);
@@ -915,6 +1651,15 @@ int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_de
                         }
                         callchain[depth++] = from;
                     }
+
+                    if (lbr_full) {
+                        // The hardware stack is exhausted before reaching Java code or the thread root.
+                        // With recursion, the bottom call site occurs in the LBR stack more than once
+                        lbr_bottom = callchain[depth - 1];
+                        for (int i = lbr_start; i < depth; i++) {
+                            if (callchain[i] == lbr_bottom) lbr_bottom_calls++;
+                        }
+                    }
                 }
 
                 break;
@@ -928,15 +1673,49 @@ stack_complete:
 
     event->unlock();
 
-    if (_cstack == CSTACK_FP) {
+    if (_stack_copy) {
+        // User frames are unwound later from the copy of the stack
+    } else if (_cstack == CSTACK_FP) {
         depth += StackWalker::walkFP(ucontext, callchain + depth, max_depth - depth, last_pc);
     } else if (_cstack == CSTACK_DWARF) {
         depth += StackWalker::walkDwarf(ucontext, callchain + depth, max_depth - depth, last_pc);
+    } else if (_cstack == CSTACK_AUTO) {
+        depth += StackWalker::walkAuto(ucontext, callchain + depth, max_depth - depth, last_pc);
+    } else if (_cstack == CSTACK_VM) {
+        // User frames are walked by the profiler together with Java frames
+    } else if (lbr_bottom != NULL && depth < max_depth) {
+        depth += continueLbrStack(ucontext, lbr_bottom, lbr_bottom_calls, callchain + depth, max_depth - depth, last_pc);
     }
 
     return depth;
 }
 
+// LBR call stack is only as deep as the hardware rings. When it is full, the rest of the stack
+// is stitched from the frame pointer chain, like perf does: it is cheap to follow, and functions
+// without a frame pointer, which is what LBR is for, do not break it but are only skipped.
+// The frames LBR has already given are dropped: the return address that follows the bottom
+// LBR call site as many times as the site occurs in the LBR stack marks where LBR has stopped
+int PerfEvents::continueLbrStack(void* ucontext, const void* lbr_bottom, int lbr_bottom_calls,
+                                 const void** callchain, int max_depth, const void** last_pc) {
+    const void* java_pc = NULL;
+    int depth = StackWalker::walkFP(ucontext, callchain, max_depth, &java_pc);
+
+    for (int i = 0; i < depth; i++) {
+        uintptr_t ret = (uintptr_t)callchain[i] - (uintptr_t)lbr_bottom;
+        if (ret > 0 && ret <= MAX_CALL_INSN_SIZE && --lbr_bottom_calls <= 0) {
+            int rest = depth - i - 1;
+            memmove(callchain, callchain + i + 1, rest * sizeof(const void*));
+            if (java_pc != NULL) {
+                *last_pc = java_pc;
+            }
+            return rest;
+        }
+    }
+
+    // The unwinder has not got that far, so it has nothing to add
+    return 0;
+}
+
 void PerfEvents::resetBuffer(int tid) {
     PerfEvent* event = &_events[tid];
     if (!event->tryLock()) {
@@ -22,11 +22,16 @@
 int PerfEvents::_max_events;
 PerfEvent* PerfEvents::_events;
 PerfEventType* PerfEvents::_event_type;
+char PerfEvents::_event_names[MAX_PERF_EVENTS][64];
+int PerfEvents::_event_count;
 long PerfEvents::_interval;
+long PerfEvents::_base_interval;
 Ring PerfEvents::_ring;
 CStack PerfEvents::_cstack;
 bool PerfEvents::_use_mmap_page;
 
+bool PerfEvents::_count_hits;
+
 u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext) {
     return 0;
 }
@@ -56,6 +61,10 @@ Error PerfEvents::start(Arguments& args) {
 void PerfEvents::stop() {
 }
 
+long PerfEvents::scaleInterval(double factor) {
+    return 0;
+}
+
 int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_depth, const void** last_pc) {
     return 0;
 }
@@ -71,6 +80,10 @@ const char* PerfEvents::getEventName(int event_id) {
     return NULL;
 }
 
+u64 PerfEvents::collectHits(std::vector<std::pair<int, u64> >& hits) {
+    return 0;
+}
+
 int PerfEvents::createForThread(int tid) {
     return -1;
 }
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "pprofProfile.h"
+#include "frameName.h"
+
+
+// Compressed output is written in blocks of this size
+static const size_t ZBUF_SIZE = 65536;
+
+// Field numbers of profile.proto
+enum {
+    PROFILE_SAMPLE_TYPE = 1,
+    PROFILE_SAMPLE = 2,
+    PROFILE_LOCATION = 4,
+    PROFILE_FUNCTION = 5,
+    PROFILE_STRING_TABLE = 6,
+    PROFILE_TIME_NANOS = 9,
+    PROFILE_DURATION_NANOS = 10,
+    PROFILE_DEFAULT_SAMPLE_TYPE = 14,
+
+    VALUE_TYPE_TYPE = 1,
+    VALUE_TYPE_UNIT = 2,
+
+    SAMPLE_LOCATION_ID = 1,
+    SAMPLE_VALUE = 2,
+
+    LOCATION_ID = 1,
+    LOCATION_LINE = 4,
+    LINE_FUNCTION_ID = 1,
+
+    FUNCTION_ID = 1,
+    FUNCTION_NAME = 2,
+    FUNCTION_SYSTEM_NAME = 3
+};
+
+enum {
+    WIRE_VARINT = 0,
+    WIRE_BYTES = 2
+};
+
+
+PprofProfile::PprofProfile(std::ostream& out, const char* type, const char* unit, Counter counter,
+                           u64 time_nanos, u64 duration_nanos) : _out(out) {
+    memset(&_zs, 0, sizeof(_zs));
+    // Falls back to plain protobuf, which pprof reads as well
+    _compress = Gzip::load() && Gzip::init(&_zs) == Z_OK;
+
+    // The first string of the table must be empty
+    internString("");
+
+    putValueType(PROFILE_SAMPLE_TYPE, "samples", "count");
+    putValueType(PROFILE_SAMPLE_TYPE, type, unit);
+    putField(_buf, PROFILE_DEFAULT_SAMPLE_TYPE, internString(counter == COUNTER_TOTAL ? type : "samples"));
+    putField(_buf, PROFILE_TIME_NANOS, time_nanos);
+    putField(_buf, PROFILE_DURATION_NANOS, duration_nanos);
+    write(Z_NO_FLUSH);
+}
+
+PprofProfile::~PprofProfile() {
+    if (_compress) {
+        Gzip::end(&_zs);
+    }
+}
+
+void PprofProfile::putVarint(std::string& buf, u64 value) {
+    while (value > 0x7f) {
+        buf.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    buf.push_back((char)value);
+}
+
+void PprofProfile::putField(std::string& buf, int field, u64 value) {
+    putVarint(buf, field << 3 | WIRE_VARINT);
+    putVarint(buf, value);
+}
+
+void PprofProfile::putBytes(std::string& buf, int field, const char* data, size_t length) {
+    putVarint(buf, field << 3 | WIRE_BYTES);
+    putVarint(buf, length);
+    buf.append(data, length);
+}
+
+// Index in the string table; a new string is appended to the output right away
+u64 PprofProfile::internString(const char* str) {
+    std::map<std::string, u64>::iterator it = _strings.lower_bound(str);
+    if (it != _strings.end() && it->first == str) {
+        return it->second;
+    }
+
+    u64 index = _strings.size();
+    _strings.insert(it, std::map<std::string, u64>::value_type(str, index));
+    putBytes(_buf, PROFILE_STRING_TABLE, str, strlen(str));
+    return index;
+}
+
+void PprofProfile::putValueType(int field, const char* type, const char* unit) {
+    _msg.clear();
+    putField(_msg, VALUE_TYPE_TYPE, internString(type));
+    putField(_msg, VALUE_TYPE_UNIT, internString(unit));
+    putBytes(_buf, field, _msg.data(), _msg.size());
+}
+
+u32 PprofProfile::locationId(FrameName& fn, ASGCT_CallFrame& frame) {
+    u64 key2 = frame.bci < 0 ? (u32)frame.bci : 1ULL << 32 | FrameType::decode(frame.bci);
+
+    u32 id;
+    if (_frame_ids.get((u64)(uintptr_t)frame.method_id, key2, id)) {
+        return id;
+    }
+
+    const char* name = fn.name(frame);
+    std::map<std::string, u64>::iterator it = _functions.lower_bound(name);
+    if (it != _functions.end() && it->first == name) {
+        id = (u32)it->second;
+    } else {
+        id = (u32)_functions.size() + 1;
+        _functions.insert(it, std::map<std::string, u64>::value_type(name, id));
+
+        u64 name_index = internString(name);
+        _msg.clear();
+        putField(_msg, FUNCTION_ID, id);
+        putField(_msg, FUNCTION_NAME, name_index);
+        putField(_msg, FUNCTION_SYSTEM_NAME, name_index);
+        putBytes(_buf, PROFILE_FUNCTION, _msg.data(), _msg.size());
+
+        std::string line;
+        putField(line, LINE_FUNCTION_ID, id);
+        _msg.clear();
+        putField(_msg, LOCATION_ID, id);
+        putBytes(_msg, LOCATION_LINE, line.data(), line.size());
+        putBytes(_buf, PROFILE_LOCATION, _msg.data(), _msg.size());
+    }
+
+    _frame_ids.put((u64)(uintptr_t)frame.method_id, key2, id);
+    return id;
+}
+
+void PprofProfile::addSample(u64 samples, u64 counter, int num_frames, const u32* location_ids) {
+    if (num_frames <= 0) {
+        return;
+    }
+
+    std::string packed;
+    for (int i = 0; i < num_frames; i++) {
+        putVarint(packed, location_ids[i]);
+    }
+
+    _msg.clear();
+    putBytes(_msg, SAMPLE_LOCATION_ID, packed.data(), packed.size());
+    packed.clear();
+    putVarint(packed, samples);
+    putVarint(packed, counter);
+    putBytes(_msg, SAMPLE_VALUE, packed.data(), packed.size());
+
+    putBytes(_buf, PROFILE_SAMPLE, _msg.data(), _msg.size());
+    if (_buf.size() >= ZBUF_SIZE) {
+        write(Z_NO_FLUSH);
+    }
+}
+
+void PprofProfile::finish() {
+    write(Z_FINISH);
+    _out.flush();
+}
+
+// Passes the pending protobuf bytes through the compressor to the output stream
+void PprofProfile::write(int flush) {
+    if (!_compress) {
+        _out.write(_buf.data(), _buf.size());
+        _buf.clear();
+        return;
+    }
+
+    char out[ZBUF_SIZE];
+    _zs.next_in = (Bytef*)_buf.data();
+    _zs.avail_in = _buf.size();
+    do {
+        _zs.next_out = (Bytef*)out;
+        _zs.avail_out = sizeof(out);
+        Gzip::deflate(&_zs, flush);
+        _out.write(out, sizeof(out) - _zs.avail_out);
+    } while (_zs.avail_out == 0);
+    _buf.clear();
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PPROFPROFILE_H
+#define _PPROFPROFILE_H
+
+#include <iostream>
+#include <map>
+#include <string>
+#include "arch.h"
+#include "arguments.h"
+#include "gzip.h"
+#include "pairMap.h"
+#include "vmEntry.h"
+
+
+class FrameName;
+
+// Profile in the pprof format (profile.proto of github.com/google/pprof), gzip compressed.
+// Samples are encoded and compressed as soon as they are added, so that only the interned
+// strings, functions and locations are kept in memory. Protobuf lets repeated fields of
+// a message come in any order, so table entries are written interleaved with the samples,
+// each one before the first sample that refers to it.
+//
+// Every sample has two values: the number of samples and the total counter.
+// A location has one line with the function of the same name; both share the id.
+class PprofProfile {
+  private:
+    std::ostream& _out;
+    z_stream _zs;
+    bool _compress;
+    std::map<std::string, u64> _strings;
+    std::map<std::string, u64> _functions;
+    PairMap _frame_ids;
+    std::string _buf;
+    std::string _msg;
+
+    static void putVarint(std::string& buf, u64 value);
+    static void putField(std::string& buf, int field, u64 value);
+    static void putBytes(std::string& buf, int field, const char* data, size_t length);
+
+    u64 internString(const char* str);
+    void putValueType(int field, const char* type, const char* unit);
+    void write(int flush);
+
+  public:
+    PprofProfile(std::ostream& out, const char* type, const char* unit, Counter counter,
+                 u64 time_nanos, u64 duration_nanos);
+    ~PprofProfile();
+
+    // Same interning rules as FlameGraph::frameId
+    u32 locationId(FrameName& fn, ASGCT_CallFrame& frame);
+
+    // Location ids go from the leaf to the root
+    void addSample(u64 samples, u64 counter, int num_frames, const u32* location_ids);
+
+    void finish();
+};
+
+#endif // _PPROFPROFILE_H
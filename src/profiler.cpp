@@ -16,6 +16,7 @@
 
 #include <algorithm>
 #include <fstream>
+#include <sstream>
 #include <dlfcn.h>
 #include <unistd.h>
 #include <stdint.h>
@@ -24,25 +25,36 @@
 #include <string.h>
 #include <sys/param.h>
 #include "profiler.h"
+#include "counters.h"
 #include "perfEvents.h"
 #include "allocTracer.h"
 #include "lockTracer.h"
+#include "mallocTracer.h"
 #include "objectSampler.h"
 #include "wallClock.h"
 #include "j9StackTraces.h"
 #include "j9WallClock.h"
 #include "instrument.h"
 #include "itimer.h"
+#include "binaryProfile.h"
+#include "pprofProfile.h"
+#include "classIdCache.h"
 #include "dwarf.h"
 #include "flameGraph.h"
 #include "flightRecorder.h"
 #include "fdtransferClient.h"
 #include "frameName.h"
 #include "os.h"
+#include "pauseTracker.h"
 #include "safeAccess.h"
+#include "stackCopier.h"
 #include "stackFrame.h"
 #include "stackWalker.h"
 #include "symbols.h"
+#include "threadContext.h"
+#include "threadCpu.h"
+#include "tsc.h"
+#include "threadRegistry.h"
 #include "vmStructs.h"
 
 
@@ -50,13 +62,30 @@
 // can be still accessed concurrently during VM termination
 Profiler* const Profiler::_instance = new Profiler();
 
-static void (*orig_trapHandler)(int signo, siginfo_t* siginfo, void* ucontext);
+// Limits of the interval multiplier used by the overhead controller
+const double MAX_INTERVAL_SCALE = 1000;
+const double MAX_SCALE_STEP = 4;
+
+// Usage thresholds of memlimit, and how many innermost frames the traces keep after them
+const u64 MEMORY_TRUNCATE_PERCENT = 70;
+const u64 MEMORY_MERGE_PERCENT = 85;
+const int MEMORY_TRUNCATE_DEPTH = 64;
+const int MEMORY_MERGE_DEPTH = 8;
+
+static const char* const MEMORY_LEVEL_ACTION[] = {
+    "full resolution restored",
+    "deep stacks truncated",
+    "deep stacks truncated, new traces merged",
+    "deep stacks truncated, new traces merged, sampling slowed down"
+};
+
 static void (*orig_segvHandler)(int signo, siginfo_t* siginfo, void* ucontext);
 
 static Engine noop_engine;
 static PerfEvents perf_events;
 static AllocTracer alloc_tracer;
 static LockTracer lock_tracer;
+static MallocTracer malloc_tracer;
 static ObjectSampler object_sampler;
 static WallClock wall_clock;
 static J9WallClock j9_wall_clock;
@@ -82,7 +111,8 @@ enum StackRecovery {
 enum EventMask {
     EM_CPU   = 1,
     EM_ALLOC = 2,
-    EM_LOCK  = 4
+    EM_LOCK  = 4,
+    EM_NATIVEMEM = 8
 };
 
 
@@ -102,6 +132,52 @@ static bool sortByCounter(const NamedMethodSample& a, const NamedMethodSample& b
     return a.second.counter > b.second.counter;
 }
 
+// Self samples per distinct top frame, keyed the same way as frames in FrameNameCache.
+// Names are formatted afterwards once per frame, rather than once per call trace
+struct MethodHistogram {
+    PairMap index;
+    std::vector<ASGCT_CallFrame> frames;
+    std::vector<MethodSample> samples;
+
+    void add(const ASGCT_CallFrame& frame, u64 add_samples, u64 add_counter) {
+        u64 kind = (u32)(frame.bci < 0 ? frame.bci : FrameType::decode(frame.bci));
+        u32 i;
+        if (!index.get((u64)(uintptr_t)frame.method_id, kind, i)) {
+            i = frames.size();
+            index.put((u64)(uintptr_t)frame.method_id, kind, i);
+            frames.push_back(frame);
+            samples.push_back(MethodSample());
+        }
+        samples[i].add(add_samples, add_counter);
+    }
+};
+
+// Selects the top count elements in place in O(n log count), leaving the rest unordered
+template<class T, class Compare>
+static size_t selectTop(std::vector<T>& v, size_t count, Compare less) {
+    count = std::min(count, v.size());
+    std::partial_sort(v.begin(), v.begin() + count, v.end(), less);
+    return count;
+}
+
+// Samples are formatted on worker threads only when each of them gets at least that many
+static const size_t DUMP_SAMPLES_PER_THREAD = 20000;
+static const int MAX_DUMP_THREADS = 8;
+
+// Contiguous range of samples handled by one dump worker, and its results.
+// Workers never touch the output stream: their buffers are written in order after all of them finish
+struct DumpBatch {
+    Arguments* args;
+    int style;
+    const FrameNameCache* resolved;
+    CallTraceSample* const* samples;
+    size_t start;
+    size_t end;
+    std::string output;
+    std::vector<CallTraceSample> kept;
+    MethodHistogram histogram;
+};
+
 
 void Profiler::addJavaMethod(const void* address, int length, jmethodID method) {
     CodeHeap::updateBounds(address, (const char*)address + length);
@@ -116,16 +192,28 @@ void Profiler::addRuntimeStub(const void* address, int length, const char* name)
 }
 
 void Profiler::onThreadStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
+    int tid = OS::threadId();
     if (_thread_filter.enabled()) {
-        _thread_filter.remove(OS::threadId());
+        _thread_filter.remove(tid);
     }
+    ThreadRegistry::add(tid);
     updateThreadName(jvmti, jni, thread);
 }
 
 void Profiler::onThreadEnd(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
+    int tid = OS::threadId();
     if (_thread_filter.enabled()) {
-        _thread_filter.remove(OS::threadId());
+        _thread_filter.remove(tid);
+    }
+    if (_thread_window) {
+        _window_threads.remove(tid);
+    }
+    ThreadRegistry::remove(tid);
+    if (_alloc_poll) {
+        AllocTracer::removeThread(tid);
     }
+    // A new thread with the same tid must not inherit the context
+    ThreadContext::set(tid, 0);
     updateThreadName(jvmti, jni, thread);
 }
 
@@ -159,14 +247,43 @@ const char* Profiler::asgctError(int code) {
 }
 
 inline u32 Profiler::getLockIndex(int tid) {
+    // Signal handlers running on different CPUs never share a slot
+    // as long as the number of slots is not less than the number of CPUs
+    int cpu = OS::getCurrentCpu();
+    if (cpu >= 0) {
+        return (u32)cpu % _concurrency_level;
+    }
+
     u32 lock_index = tid;
     lock_index ^= lock_index >> 8;
     lock_index ^= lock_index >> 4;
-    return lock_index % CONCURRENCY_LEVEL;
+    return lock_index % _concurrency_level;
+}
+
+// Returns the index of the acquired slot, or -1 if all probed slots are busy
+inline int Profiler::tryLockSlot(int tid) {
+    u32 lock_index = getLockIndex(tid);
+    if (_slots[lock_index]._lock.tryLock() ||
+        _slots[lock_index = (lock_index + 1) % _concurrency_level]._lock.tryLock() ||
+        _slots[lock_index = (lock_index + 2) % _concurrency_level]._lock.tryLock())
+    {
+        return lock_index;
+    }
+    return -1;
 }
 
 void Profiler::updateSymbols(bool kernel_symbols) {
+    MutexLocker ml(_native_libs_lock);
+    int prev_count = _native_lib_count;
+    u64 start_time = OS::nanotime();
+
     Symbols::parseLibraries(_native_libs, _native_lib_count, MAX_NATIVE_LIBS, kernel_symbols);
+    _native_lib_index.update(_native_libs, _native_lib_count);
+
+    if (_native_lib_count > prev_count) {
+        Log::debug("Parsed %d libraries in %.3f ms (%s symbols)", _native_lib_count - prev_count,
+                   (OS::nanotime() - start_time) / 1e6, Symbols::lazyLoading() ? "lazy" : "eager");
+    }
 }
 
 void Profiler::mangle(const char* name, char* buf, size_t size) {
@@ -195,6 +312,13 @@ const void* Profiler::resolveSymbol(const char* name) {
         name = mangled_name;
     }
 
+    // Symbol lookup needs all libraries parsed, including lazily registered ones
+    for (int i = 0; i < _native_lib_count; i++) {
+        if (!_native_libs[i]->symbolsLoaded()) {
+            Symbols::loadSymbols(_native_libs[i]);
+        }
+    }
+
     size_t len = strlen(name);
     if (len > 0 && name[len - 1] == '*') {
         for (int i = 0; i < _native_lib_count; i++) {
@@ -248,13 +372,7 @@ CodeCache* Profiler::findJvmLibrary(const char* lib_name) {
 }
 
 CodeCache* Profiler::findNativeLibrary(const void* address) {
-    const int native_lib_count = _native_lib_count;
-    for (int i = 0; i < native_lib_count; i++) {
-        if (_native_libs[i]->contains(address)) {
-            return _native_libs[i];
-        }
-    }
-    return NULL;
+    return _native_lib_index.find(address);
 }
 
 const char* Profiler::findNativeMethod(const void* address) {
@@ -262,6 +380,18 @@ const char* Profiler::findNativeMethod(const void* address) {
     return lib == NULL ? NULL : lib->binarySearch(address);
 }
 
+// Unlike findNativeMethod, parses symbols of a lazily registered library. Not signal safe
+const char* Profiler::resolveNativeMethod(const void* address) {
+    CodeCache* lib = findNativeLibrary(address);
+    if (lib == NULL) {
+        return NULL;
+    }
+    if (!lib->symbolsLoaded()) {
+        Symbols::loadSymbols(lib);
+    }
+    return lib->binarySearch(address);
+}
+
 // Make sure the top frame is Java, otherwise AsyncGetCallTrace
 // will attempt to use frame pointer based stack walking
 bool Profiler::inJavaCode(void* ucontext) {
@@ -287,32 +417,141 @@ bool Profiler::isAddressInCode(const void* pc) {
     }
 }
 
-int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_type, int tid, const void** last_pc) {
+int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_type, int tid, const void** last_pc,
+                             FrameDescCache* dwarf_cache) {
     const void* callchain[MAX_NATIVE_FRAMES];
     int native_frames;
 
-    if (_cstack == CSTACK_NO || (event_type != 0 && _cstack == CSTACK_DEFAULT)) {
+    // Native allocations are attributed to native call sites, so their stacks are always walked
+    if (_cstack == CSTACK_NO || (event_type != BCI_NATIVE_MALLOC && _cstack == CSTACK_DEFAULT)) {
         return 0;
     }
 
-    // Use PerfEvents stack walker for execution samples, or basic stack walker for other events
-    if (event_type == 0 && _engine == &perf_events) {
-        native_frames = PerfEvents::walk(tid, ucontext, callchain, MAX_NATIVE_FRAMES, last_pc);
-    } else if (_cstack == CSTACK_DWARF) {
-        native_frames = StackWalker::walkDwarf(ucontext, callchain, MAX_NATIVE_FRAMES, last_pc);
+    // Execution samples go through walkNativeExecution; other events use the basic stack walker
+    if (_cstack == CSTACK_DWARF) {
+        native_frames = StackWalker::walkDwarf(ucontext, callchain, MAX_NATIVE_FRAMES, last_pc, dwarf_cache);
+    } else if (_cstack == CSTACK_AUTO || _cstack == CSTACK_VM) {
+        native_frames = StackWalker::walkAuto(ucontext, callchain, MAX_NATIVE_FRAMES, last_pc, dwarf_cache);
     } else {
         native_frames = StackWalker::walkFP(ucontext, callchain, MAX_NATIVE_FRAMES, last_pc);
     }
 
+    if (event_type == BCI_NATIVE_MALLOC) {
+        // Drop profiler frames above the hook, which stands for the intercepted function
+        CodeCache* self = findNativeLibrary((const void*)MallocTracer::installHooks);
+        int skip = 0;
+        while (skip + 1 < native_frames && findNativeLibrary(callchain[skip + 1]) == self) {
+            skip++;
+        }
+        return convertNativeTrace(native_frames - skip, callchain + skip, frames);
+    }
+
+    return convertNativeTrace(native_frames, callchain, frames);
+}
+
+enum NativeWalkKind {
+    NATIVE_WALK_NONE,
+    NATIVE_WALK_PERF,
+    NATIVE_WALK_FP,
+    NATIVE_WALK_DWARF,
+    NATIVE_WALK_AUTO
+};
+
+enum JavaWalkKind {
+    JAVA_WALK_ASYNC,
+    JAVA_WALK_VM,
+    JAVA_WALK_MIXED
+};
+
+// Native part of an execution sample; the walker is a template argument rather than a runtime check
+template <int W>
+int Profiler::walkNativeExecution(void* ucontext, ASGCT_CallFrame* frames, int tid, const void** last_pc,
+                                  FrameDescCache* dwarf_cache) {
+    if (W == NATIVE_WALK_NONE) {
+        return 0;
+    }
+
+    const void* callchain[MAX_NATIVE_FRAMES];
+    int native_frames;
+    if (W == NATIVE_WALK_PERF) {
+        native_frames = PerfEvents::walk(tid, ucontext, callchain, MAX_NATIVE_FRAMES, last_pc);
+    } else if (W == NATIVE_WALK_DWARF) {
+        native_frames = StackWalker::walkDwarf(ucontext, callchain, MAX_NATIVE_FRAMES, last_pc, dwarf_cache);
+    } else if (W == NATIVE_WALK_AUTO) {
+        native_frames = StackWalker::walkAuto(ucontext, callchain, MAX_NATIVE_FRAMES, last_pc, dwarf_cache);
+    } else {
+        native_frames = StackWalker::walkFP(ucontext, callchain, MAX_NATIVE_FRAMES, last_pc);
+    }
     return convertNativeTrace(native_frames, callchain, frames);
 }
 
+// depth is the number of native or kernel frames already in the buffer
+template <int W>
+int Profiler::walkJavaExecution(void* ucontext, ASGCT_CallFrame* frames, int depth, const void* last_pc,
+                                FrameDescCache* dwarf_cache, bool& java_types) {
+    if (W == JAVA_WALK_MIXED) {
+        // Native and Java frames in one pass; kernel frames, if any, are already there
+        return StackWalker::walkMixed(ucontext, frames, MAX_NATIVE_FRAMES + _max_stack_depth - depth, dwarf_cache);
+    }
+
+    int java_frames = W == JAVA_WALK_VM ? getJavaTraceVM(ucontext, frames, _max_stack_depth) : -1;
+    if (java_frames < 0) {
+        java_frames = getJavaTraceAsync(ucontext, frames, _max_stack_depth);
+        java_types = java_frames > 0;
+        if (java_frames > 0 && last_pc != NULL) {
+            NMethodInfo nmethod;
+            if (NMethodCache::lookup(last_pc, nmethod)) {
+                fillFrameTypes(frames, java_frames, nmethod);
+            }
+        }
+    }
+    return java_frames;
+}
+
+// Must be called before the engine starts, when every setting the walks depend on is final
+void Profiler::selectExecutionWalk() {
+    if (_cstack == CSTACK_NO) {
+        _native_walk = &Profiler::walkNativeExecution<NATIVE_WALK_NONE>;
+    } else if (_engine == &perf_events) {
+        _native_walk = &Profiler::walkNativeExecution<NATIVE_WALK_PERF>;
+    } else if (_cstack == CSTACK_VM || _stack_copy) {
+        // User frames are walked together with Java frames, or later from the copy of the stack
+        _native_walk = &Profiler::walkNativeExecution<NATIVE_WALK_NONE>;
+    } else if (_cstack == CSTACK_DWARF) {
+        _native_walk = &Profiler::walkNativeExecution<NATIVE_WALK_DWARF>;
+    } else if (_cstack == CSTACK_AUTO) {
+        _native_walk = &Profiler::walkNativeExecution<NATIVE_WALK_AUTO>;
+    } else {
+        _native_walk = &Profiler::walkNativeExecution<NATIVE_WALK_FP>;
+    }
+
+    if (_cstack == CSTACK_VM) {
+        _java_walk = &Profiler::walkJavaExecution<JAVA_WALK_MIXED>;
+    } else if (_vm_walker) {
+        _java_walk = &Profiler::walkJavaExecution<JAVA_WALK_VM>;
+    } else {
+        _java_walk = &Profiler::walkJavaExecution<JAVA_WALK_ASYNC>;
+    }
+}
+
 int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames) {
     int depth = 0;
     jmethodID prev_method = NULL;
 
     for (int i = 0; i < native_frames; i++) {
-        const char* current_method_name = findNativeMethod(callchain[i]);
+        CodeCache* lib = findNativeLibrary(callchain[i]);
+        if (lib != NULL && (!lib->symbolsLoaded() || (_raw_pc && !lib->hasMarks()))) {
+            // Symbols cannot be parsed in a signal handler, or the address is kept as is by request;
+            // either way, it is resolved at dump time. Libraries with marked functions are still
+            // searched, since a marked frame terminates the native stack
+            frames[depth].bci = BCI_ADDRESS;
+            frames[depth].method_id = (jmethodID)callchain[i];
+            prev_method = NULL;
+            depth++;
+            continue;
+        }
+
+        const char* current_method_name = lib == NULL ? NULL : lib->binarySearch(callchain[i]);
         if (current_method_name != NULL && NativeFunc::isMarked(current_method_name)) {
             // This is C++ interpreter frame, this and later frames should be reported
             // as Java frames returned by AGCT. Terminate the scan here.
@@ -504,6 +743,15 @@ int Profiler::getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max
     return trace.frames - frames + 1;
 }
 
+// Returns -1 if the VM walker cannot decode the top frame, and AsyncGetCallTrace should be tried
+int Profiler::getJavaTraceVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth) {
+    int num_frames = StackWalker::walkJava(ucontext, frames, max_depth);
+    if (num_frames < 0) {
+        Counters::add(COUNTER_VM_WALK_FALLBACKS);
+    }
+    return num_frames;
+}
+
 int Profiler::getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int start_depth, int max_depth) {
     int num_frames;
     if (VM::jvmti()->GetStackTrace(NULL, start_depth, _max_stack_depth, jvmti_frames, &num_frames) == 0 && num_frames > 0) {
@@ -563,23 +811,20 @@ bool Profiler::fillTopFrame(const void* pc, ASGCT_CallFrame* frame, bool* is_ent
             return true;
         }
     } else if (VMStructs::hasMethodStructs()) {
-        NMethod* nmethod = CodeHeap::findNMethod(pc);
-        if (nmethod != NULL && nmethod->isNMethod()) {
-            jmethodID method_id = nmethod->method()->constMethod()->id();
-            if (method_id != NULL) {
-                frame->bci = 0;
-                frame->method_id = method_id;
-                return true;
-            }
+        NMethodInfo info;
+        if (NMethodCache::lookup(pc, info) && info.kind == NMETHOD_COMPILED && info.method_id != NULL) {
+            frame->bci = 0;
+            frame->method_id = info.method_id;
+            return true;
         }
     }
 
     return false;
 }
 
-void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod* nmethod) {
-    if (nmethod->isNMethod()) {
-        jmethodID current_method_id = nmethod->method()->constMethod()->id();
+void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, const NMethodInfo& nmethod) {
+    if (nmethod.kind == NMETHOD_COMPILED) {
+        jmethodID current_method_id = nmethod.method_id;
         if (current_method_id == NULL) {
             return;
         }
@@ -595,7 +840,7 @@ void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod*
             }
             frames[i].bci = FrameType::encode(FRAME_INLINED, frames[i].bci);
         }
-    } else if (nmethod->isInterpreter()) {
+    } else if (nmethod.kind == NMETHOD_INTERPRETER) {
         // Mark the first Java frame as INTERPRETED
         for (int i = 0; i < num_frames; i++) {
             if (frames[i].bci > BCI_NATIVE_FRAME) {
@@ -606,15 +851,31 @@ void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod*
     }
 }
 
-void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event* event) {
+u32 Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event* event) {
+    u64 start_ticks = TSC::ticks();
+    int tid = OS::threadId();
+    if ((_context_filter && ThreadContext::get(tid) == 0) || (_thread_window && !_window_threads.accept(tid))) {
+        // Only samples in the context of a request or inside the thread's begin/end window are of interest
+        if (event_type == 0 && _engine == &perf_events) {
+            PerfEvents::resetBuffer(tid);
+        }
+        return 0;
+    }
+
     atomicInc(_total_samples);
+    if (event_type == 0) {
+        // A signal handler runs on the CPU of the sampled thread
+        ((ExecutionEvent*)event)->_cpu = OS::getCurrentCpu();
+        if (_thread_cpu) {
+            ThreadCpu::recordSample(tid);
+        }
+        if (_alloc_poll) {
+            AllocTracer::pollThread(tid);
+        }
+    }
 
-    int tid = OS::threadId();
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
+    int lock_index = tryLockSlot(tid);
+    if (lock_index < 0) {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
 
@@ -622,11 +883,15 @@ void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event*
             // Need to reset PerfEvents ring buffer, even though we discard the collected trace
             PerfEvents::resetBuffer(tid);
         }
-        return;
+        return 0;
+    }
+
+    if (event_type == 0 && _kernel_only) {
+        return recordKernelSample(lock_index, ucontext, counter, tid, event);
     }
 
-    ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
-    jvmtiFrameInfo* jvmti_frames = _calltrace_buffer[lock_index]->_jvmti_frames;
+    ASGCT_CallFrame* frames = _slots[lock_index]._buffer->_asgct_frames;
+    jvmtiFrameInfo* jvmti_frames = _slots[lock_index]._buffer->_jvmti_frames;
 
     int num_frames = 0;
     if (!_jfr.active() && event_type <= BCI_ALLOC && event_type >= BCI_PARK && event->id()) {
@@ -634,74 +899,205 @@ void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event*
     }
 
     const void* last_pc = NULL;
-    num_frames += getNativeTrace(ucontext, frames + num_frames, event_type, tid, &last_pc);
+    FrameDescCache* dwarf_cache = _slots[lock_index]._dwarf_cache;
+    num_frames += event_type == 0 ? (this->*_native_walk)(ucontext, frames + num_frames, tid, &last_pc, dwarf_cache)
+                                  : getNativeTrace(ucontext, frames + num_frames, event_type, tid, &last_pc, dwarf_cache);
+    int kernel_frames = num_frames;
+    bool java_types = false;
+
+    u64 java_ticks = TSC::ticks();
+    Counters::add(lock_index, COUNTER_NATIVE_TRACE_TIME, java_ticks - start_ticks);
 
     if (event_type == 0) {
         // Async events
-        int java_frames = getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth);
-        if (java_frames > 0 && last_pc != NULL) {
-            NMethod* nmethod = CodeHeap::findNMethod((const void*)last_pc);
-            if (nmethod != NULL) {
-                fillFrameTypes(frames + num_frames, java_frames, nmethod);
-            }
-        }
-        num_frames += java_frames;
-    } else if (event_type >= BCI_ALLOC_OUTSIDE_TLAB && VMStructs::_get_stack_trace != NULL) {
+        num_frames += (this->*_java_walk)(ucontext, frames + num_frames, num_frames, last_pc, dwarf_cache, java_types);
+    } else if (event_type >= BCI_ALLOC_OUTSIDE_TLAB && _alloc_engine == &alloc_tracer && VMStructs::_get_stack_trace != NULL) {
         // Object allocation in HotSpot happens at known places where it is safe to call JVM TI,
         // but not directly, since the thread is in_vm rather than in_native
         num_frames += getJavaTraceInternal(jvmti_frames + num_frames, frames + num_frames, _max_stack_depth);
-    } else if (event_type >= BCI_ALLOC_OUTSIDE_TLAB && !VM::isOpenJ9()) {
+    } else if (event_type >= BCI_ALLOC_OUTSIDE_TLAB && _alloc_engine == &alloc_tracer) {
         num_frames += getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth);
+    } else if (event_type == BCI_NATIVE_MALLOC) {
+        // Native allocations happen in any thread; JVM TI can walk only a Java thread in native state
+        VMThread* vm_thread = VMThread::current();
+        if (vm_thread != NULL && vm_thread->state() == 4) {
+            num_frames += getJavaTraceJvmti(jvmti_frames + num_frames, frames + num_frames, 0, _max_stack_depth);
+        }
     } else {
-        // Lock events and instrumentation events can safely call synchronous JVM TI stack walker.
-        // Skip Instrument.recordSample() method
-        int start_depth = event_type == BCI_INSTRUMENT ? 1 : 0;
+        // Lock events, instrumentation events and JVM TI allocation events
+        // can safely call synchronous JVM TI stack walker.
+        // Skip Instrument.recordSample() and Instrument.recordEntry() methods
+        int start_depth = event_type == BCI_INSTRUMENT ? 2 : 0;
         num_frames += getJavaTraceJvmti(jvmti_frames + num_frames, frames + num_frames, start_depth, _max_stack_depth);
     }
 
+    if (event_type == 0 && _stack_copy) {
+        // Native frames are unwound on the unwinder thread, which then records the sample
+        if (!StackCopier::enqueue(ucontext, counter, tid, (ExecutionEvent*)event,
+                                  kernel_frames, num_frames, frames, java_types)) {
+            atomicInc(_failures[-ticks_skipped]);
+        }
+        _slots[lock_index]._lock.unlock();
+        Counters::add(lock_index, COUNTER_CPU_SAMPLE_TIME, TSC::ticks() - start_ticks);
+        return 0;
+    }
+
     if (num_frames == 0) {
         num_frames += makeEventFrame(frames + num_frames, BCI_ERROR, (uintptr_t)"no_Java_frame");
     }
 
-    if (_add_thread_frame) {
-        num_frames += makeEventFrame(frames + num_frames, BCI_THREAD_ID, tid);
-    }
+    Counters::add(lock_index, COUNTER_JAVA_TRACE_TIME, TSC::ticks() - java_ticks);
+
+    // With the live option, allocations are counted by the live heap profile, see collectLiveSamples()
+    bool count = !_live || (event_type != BCI_ALLOC && event_type != BCI_ALLOC_OUTSIDE_TLAB && event_type != BCI_NATIVE_MALLOC);
+    return storeSample(lock_index, tid, frames, num_frames, counter, event_type, event, count, start_ticks);
+}
+
+// Common tail of the samples recorded in a signal handler: appends the pseudo-frames that follow
+// the thread frame, stores the trace, records the JFR event and releases the slot
+u32 Profiler::storeSample(int lock_index, int tid, ASGCT_CallFrame* frames, int num_frames, u64 counter,
+                          jint event_type, Event* event, bool count, u64 start_ticks) {
+    u64 put_ticks = TSC::ticks();
+
+    // The thread is stored out of band, pseudo-frames after it are counted from here
+    int thread_frame_pos = num_frames;
     if (_add_sched_frame) {
         num_frames += makeEventFrame(frames + num_frames, BCI_ERROR, (uintptr_t)OS::schedPolicy(0));
     }
+    if (_add_pause_frame) {
+        const char* pause = PauseTracker::pauseName();
+        if (pause != NULL) {
+            num_frames += makeEventFrame(frames + num_frames, BCI_ERROR, (uintptr_t)pause);
+        }
+    }
+    if (_add_event_frame && event_type == 0) {
+        // Distinguishes samples of several perf events in one session
+        const char* event_name = PerfEvents::eventName(((ExecutionEvent*)event)->_event_index);
+        num_frames += makeEventFrame(frames + num_frames, BCI_ERROR, (uintptr_t)event_name);
+    }
+
+    u32 call_trace_id = _fold ? _call_tree.put(num_frames, frames, counter, _add_thread_frame ? tid : 0, num_frames - thread_frame_pos)
+                              : _call_trace_storage.put(num_frames, frames, counter, _add_thread_frame ? tid : 0,
+                                                        num_frames - thread_frame_pos, count);
+    Counters::add(lock_index, COUNTER_CALL_TRACE_PUT_TIME, TSC::ticks() - put_ticks);
+    Counters::add(lock_index, COUNTER_CALL_TRACE_PUTS);
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
     _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
 
-    _locks[lock_index].unlock();
+    _slots[lock_index]._lock.unlock();
+
+    CounterId time_counter, sample_counter;
+    if (event_type == 0) {
+        time_counter = COUNTER_CPU_SAMPLE_TIME;
+        sample_counter = COUNTER_CPU_SAMPLES;
+    } else if (event_type == BCI_ALLOC || event_type == BCI_ALLOC_OUTSIDE_TLAB || event_type == BCI_NATIVE_MALLOC) {
+        time_counter = COUNTER_ALLOC_SAMPLE_TIME;
+        sample_counter = COUNTER_ALLOC_SAMPLES;
+    } else if (event_type == BCI_LOCK || event_type == BCI_PARK) {
+        time_counter = COUNTER_LOCK_SAMPLE_TIME;
+        sample_counter = COUNTER_LOCK_SAMPLES;
+    } else {
+        time_counter = COUNTER_OTHER_SAMPLE_TIME;
+        sample_counter = COUNTER_OTHER_SAMPLES;
+    }
+    Counters::add(lock_index, time_counter, TSC::ticks() - start_ticks);
+    Counters::add(lock_index, sample_counter);
+    return call_trace_id;
 }
 
-void Profiler::recordExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames) {
-    atomicInc(_total_samples);
+// With ring=kernel, perf samples only the kernel, and the callchain holds kernel frames only.
+// Java and native user stacks are never walked, nor copied; only the cheap pseudo-frames are kept
+u32 Profiler::recordKernelSample(int lock_index, void* ucontext, u64 counter, int tid, Event* event) {
+    u64 start_ticks = TSC::ticks();
+    ASGCT_CallFrame* frames = _slots[lock_index]._buffer->_asgct_frames;
+
+    int num_frames = 0;
+    if (_cstack != CSTACK_NO) {
+        const void* callchain[MAX_NATIVE_FRAMES];
+        const void* last_pc = NULL;
+        int kernel_frames = PerfEvents::walk(tid, ucontext, callchain, MAX_NATIVE_FRAMES, &last_pc);
+        num_frames = convertNativeTrace(kernel_frames, callchain, frames);
+    } else {
+        PerfEvents::resetBuffer(tid);
+    }
+    if (num_frames == 0) {
+        num_frames = makeEventFrame(frames, BCI_ERROR, (uintptr_t)"no_kernel_frame");
+    }
+
+    Counters::add(lock_index, COUNTER_NATIVE_TRACE_TIME, TSC::ticks() - start_ticks);
+
+    return storeSample(lock_index, tid, frames, num_frames, counter, 0, event, true, start_ticks);
+}
+
+void Profiler::recordExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames, u32 event_index, u64 time,
+                                    int cpu) {
+    ExecutionEvent event(time, cpu);
+    event._event_index = event_index;
+    recordExternalSample(counter, tid, num_frames, frames, 0, &event);
+}
+
+// Samples collected outside the signal context, e.g. drained from perf_event rings
+void Profiler::recordExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames, int event_type, Event* event) {
+    if ((_context_filter && ThreadContext::get(tid) == 0) || (_thread_window && !_window_threads.accept(tid))) {
+        return;
+    }
 
-    if (_add_thread_frame) {
-        num_frames += makeEventFrame(frames + num_frames, BCI_THREAD_ID, tid);
+    atomicInc(_total_samples);
+    if (_thread_cpu && event_type == 0) {
+        ThreadCpu::recordSample(tid);
     }
+
+    recordDeferredSample(counter, tid, num_frames, frames, event_type, event);
+}
+
+// Stores a sample that has already passed the filters and has been counted in the signal handler
+void Profiler::recordDeferredSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames, int event_type, Event* event) {
+    u32 event_index = event_type == 0 ? ((ExecutionEvent*)event)->_event_index : 0;
+    u64 start_ticks = TSC::ticks();
+
+    int thread_frame_pos = num_frames;
     if (_add_sched_frame) {
         num_frames += makeEventFrame(frames + num_frames, BCI_ERROR, (uintptr_t)OS::schedPolicy(tid));
     }
+    if (_add_event_frame) {
+        num_frames += makeEventFrame(frames + num_frames, BCI_ERROR, (uintptr_t)PerfEvents::eventName(event_index));
+    }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
-
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
+    // Call trace storage is updated under the slot lock, so that lockAll() stops all writers
+    int lock_index = tryLockSlot(tid);
+    if (lock_index < 0) {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
         return;
     }
 
-    ExecutionEvent event;
-    _jfr.recordEvent(lock_index, tid, call_trace_id, 0, &event, counter);
+    u64 put_ticks = TSC::ticks();
+    u32 call_trace_id = _fold ? _call_tree.put(num_frames, frames, counter, _add_thread_frame ? tid : 0, num_frames - thread_frame_pos)
+                              : _call_trace_storage.put(num_frames, frames, counter, _add_thread_frame ? tid : 0,
+                                                        num_frames - thread_frame_pos);
+    Counters::add(lock_index, COUNTER_CALL_TRACE_PUT_TIME, TSC::ticks() - put_ticks);
+    Counters::add(lock_index, COUNTER_CALL_TRACE_PUTS);
+
+    _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
+
+    _slots[lock_index]._lock.unlock();
+
+    Counters::add(lock_index, COUNTER_CPU_SAMPLE_TIME, TSC::ticks() - start_ticks);
+    Counters::add(lock_index, COUNTER_CPU_SAMPLES);
+}
+
+// Called on the VM thread at the end of a GC
+void Profiler::recordPause(GCPauseEvent* event) {
+    if (!_jfr.active()) {
+        return;
+    }
 
-    _locks[lock_index].unlock();
+    int tid = OS::threadId();
+    int lock_index = tryLockSlot(tid);
+    if (lock_index >= 0) {
+        _jfr.recordEvent(lock_index, tid, 0, BCI_GC_PAUSE, event, 0);
+        _slots[lock_index]._lock.unlock();
+    }
 }
 
 void Profiler::writeLog(LogLevel level, const char* message) {
@@ -712,10 +1108,17 @@ void Profiler::writeLog(LogLevel level, const char* message, size_t len) {
     _jfr.recordLog(level, message, len);
 }
 
+void Profiler::writeLog(LogRecord** records, int count) {
+    _jfr.recordLogs(records, count);
+}
+
 void* Profiler::dlopen_hook(const char* filename, int flags) {
     void* result = dlopen(filename, flags);
     if (result != NULL) {
         instance()->updateSymbols(false);
+        if (MallocTracer::running()) {
+            MallocTracer::installHooks();
+        }
     }
     return result;
 }
@@ -739,7 +1142,19 @@ Error Profiler::installTraps(const char* begin, const char* end) {
     _begin_trap.assign(begin_addr);
     _end_trap.assign(end_addr);
 
-    if (_begin_trap.entry() == 0) {
+    if (_thread_window) {
+        // Both traps stay installed, since other threads may enter their windows any time
+        if (begin_addr == NULL) {
+            return Error("threadwindow requires begin function");
+        } else if (!StackFrame::canEmulate((instruction_t*)_begin_trap.entry()) ||
+                   (end_addr != NULL && !StackFrame::canEmulate((instruction_t*)_end_trap.entry()))) {
+            return Error("Cannot trap begin/end function per thread: unsupported first instruction");
+        }
+        _engine->enableEvents(true);
+        if (!_begin_trap.install() || !_end_trap.install()) {
+            return Error("Cannot install begin/end breakpoint");
+        }
+    } else if (_begin_trap.entry() == 0) {
         _engine->enableEvents(true);
     } else {
         _engine->enableEvents(false);
@@ -756,21 +1171,30 @@ void Profiler::uninstallTraps() {
     _end_trap.uninstall();
 }
 
-void Profiler::trapHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+void Profiler::trapHandler(Trap* trap, void* ucontext) {
+    Profiler* profiler = instance();
     StackFrame frame(ucontext);
 
-    if (_begin_trap.covers(frame.pc())) {
-        _engine->enableEvents(true);
-        _begin_trap.uninstall();
-        _end_trap.install();
-        frame.pc() = _begin_trap.entry();
-    } else if (_end_trap.covers(frame.pc())) {
-        _engine->enableEvents(false);
-        _end_trap.uninstall();
-        _begin_trap.install();
-        frame.pc() = _end_trap.entry();
-    } else if (orig_trapHandler != NULL) {
-        orig_trapHandler(signo, siginfo, ucontext);
+    if (profiler->_thread_window) {
+        int tid = OS::threadId();
+        if (trap == &profiler->_begin_trap) {
+            profiler->_window_threads.add(tid);
+        } else {
+            profiler->_window_threads.remove(tid);
+        }
+        // installTraps has checked that the replaced instruction can be emulated
+        frame.pc() = trap->entry();
+        frame.emulate(trap->savedInstruction());
+    } else if (trap == &profiler->_begin_trap) {
+        profiler->_engine->enableEvents(true);
+        profiler->_begin_trap.uninstall();
+        profiler->_end_trap.install();
+        frame.pc() = profiler->_begin_trap.entry();
+    } else {
+        profiler->_engine->enableEvents(false);
+        profiler->_end_trap.uninstall();
+        profiler->_begin_trap.install();
+        frame.pc() = profiler->_end_trap.entry();
     }
 }
 
@@ -793,10 +1217,7 @@ void Profiler::segvHandler(int signo, siginfo_t* siginfo, void* ucontext) {
 }
 
 void Profiler::setupSignalHandlers() {
-    orig_trapHandler = OS::installSignalHandler(SIGTRAP, AllocTracer::trapHandler);
-    if (orig_trapHandler == (void*)SIG_DFL || orig_trapHandler == (void*)SIG_IGN) {
-        orig_trapHandler = NULL;
-    }
+    Trap::installSignalHandler();
     if (VM::hotspot_version() > 0) {
         // HotSpot tolerates interposed SIGSEGV/SIGBUS handler; other JVMs probably not
         orig_segvHandler = OS::replaceCrashHandler(segvHandler);
@@ -804,9 +1225,7 @@ void Profiler::setupSignalHandlers() {
 }
 
 void Profiler::setThreadInfo(int tid, const char* name, jlong java_thread_id) {
-    MutexLocker ml(_thread_names_lock);
-    _thread_names[tid] = name;
-    _thread_ids[tid] = java_thread_id;
+    _thread_names.set(tid, name, java_thread_id);
 }
 
 void Profiler::updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
@@ -842,16 +1261,13 @@ void Profiler::updateJavaThreadNames() {
 
 void Profiler::updateNativeThreadNames() {
     if (_update_thread_names) {
-        ThreadList* thread_list = OS::listThreads();
+        ThreadRegistry::reconcileIfStale();
+        ThreadList* thread_list = ThreadRegistry::listThreads();
         char name_buf[64];
 
         for (int tid; (tid = thread_list->next()) != -1; ) {
-            MutexLocker ml(_thread_names_lock);
-            std::map<int, std::string>::iterator it = _thread_names.lower_bound(tid);
-            if (it == _thread_names.end() || it->first != tid) {
-                if (OS::threadName(tid, name_buf, sizeof(name_buf))) {
-                    _thread_names.insert(it, std::map<int, std::string>::value_type(tid, name_buf));
-                }
+            if (!_thread_names.contains(tid) && OS::threadName(tid, name_buf, sizeof(name_buf))) {
+                _thread_names.set(tid, name_buf, 0);
             }
         }
 
@@ -859,19 +1275,19 @@ void Profiler::updateNativeThreadNames() {
     }
 }
 
-bool Profiler::excludeTrace(FrameName* fn, CallTrace* trace) {
+bool Profiler::excludeTrace(FrameName* fn, int num_frames, ASGCT_CallFrame* frames) {
     bool checkInclude = fn->hasIncludeList();
     bool checkExclude = fn->hasExcludeList();
     if (!(checkInclude || checkExclude)) {
         return false;
     }
 
-    for (int i = 0; i < trace->num_frames; i++) {
-        const char* frame_name = fn->name(trace->frames[i], true);
-        if (checkExclude && fn->exclude(frame_name)) {
+    for (int i = 0; i < num_frames; i++) {
+        int result = fn->filter(frames[i]);
+        if (checkExclude && (result & FILTER_EXCLUDE)) {
             return true;
         }
-        if (checkInclude && fn->include(frame_name)) {
+        if (checkInclude && (result & FILTER_INCLUDE)) {
             checkInclude = false;
             if (!checkExclude) break;
         }
@@ -896,16 +1312,19 @@ Engine* Profiler::selectEngine(const char* event_name) {
     }
 }
 
-Engine* Profiler::allocEngine() {
-    return VM::isOpenJ9() ? (Engine*)&object_sampler : (Engine*)&alloc_tracer;
+Engine* Profiler::selectAllocEngine(Arguments& args) {
+    bool sampled = VM::isOpenJ9() || args._sampled_alloc || args._live > 0;
+    return sampled ? (Engine*)&object_sampler : (Engine*)&alloc_tracer;
 }
 
 Engine* Profiler::activeEngine() {
     switch (_event_mask) {
         case EM_ALLOC:
-            return allocEngine();
+            return _alloc_engine;
         case EM_LOCK:
             return &lock_tracer;
+        case EM_NATIVEMEM:
+            return &malloc_tracer;
         default:
             return _engine;
     }
@@ -935,6 +1354,19 @@ Error Profiler::checkJvmCapabilities() {
     return Error::OK;
 }
 
+// Does the part of start() that depends only on the JVM, so that the first start takes no time
+void Profiler::preload() {
+    MutexLocker ml(_state_lock);
+
+    Error error = checkJvmCapabilities();
+    if (error) {
+        Log::warn("%s", error.message());
+        return;
+    }
+
+    LockTracer::preload();
+}
+
 Error Profiler::start(Arguments& args, bool reset) {
     MutexLocker ml(_state_lock);
     if (_state > IDLE) {
@@ -948,7 +1380,8 @@ Error Profiler::start(Arguments& args, bool reset) {
 
     _event_mask = (args._event != NULL ? EM_CPU : 0) |
                   (args._alloc > 0 ? EM_ALLOC : 0) |
-                  (args._lock > 0 ? EM_LOCK : 0);
+                  (args._lock > 0 ? EM_LOCK : 0) |
+                  (args._nativemem > 0 ? EM_NATIVEMEM : 0);
     if (_event_mask == 0) {
         return Error("No profiling events specified");
     } else if ((_event_mask & (_event_mask - 1)) && args._output != OUTPUT_JFR) {
@@ -961,34 +1394,85 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    // The time source is settled before any engine takes timestamps
+    if (!TSC::initialized()) {
+        TSC::initialize();
+    }
+
     if (reset || _start_time == 0) {
-        // Reset counters
+        // Reset counters. Time counters are in ticks, so this is when the tick frequency may be refined
+        TSC::recalibrate();
         _total_samples = 0;
         memset(_failures, 0, sizeof(_failures));
+        Counters::reset();
 
         // Reset dicrionaries and bitmaps
         _class_map.clear();
+        _method_table.clear();
+        ClassIdCache::clear();
+        LockTracer::clearLockStats();
+        _latency_reported.clear();
         _thread_filter.clear();
         _call_trace_storage.clear();
+        _call_trace_storage.useFrameTrie(args._trace_trie);
+        _call_trace_storage.useRootSegments(args._leaf_depth);
+        _call_trace_storage.useHugePages(args._huge_pages);
+        _call_trace_storage.useThreadTable(args._threads && args._output != OUTPUT_JFR);
+        _call_tree.clear();
+        _fold = args._fold;
+        if (!args._name_cache) {
+            _frame_name_cache.clear();
+        }
 
         // Reset thread names and IDs
-        MutexLocker ml(_thread_names_lock);
         _thread_names.clear();
-        _thread_ids.clear();
     }
 
+    // Samples are tagged with the NUMA node of their CPU; sample buffers may be placed there as well
+    OS::initNumaNodes();
+
+    int concurrency_level = args._concurrency;
+    if (concurrency_level <= 0) {
+        // By default, have at least one sample slot per CPU
+        concurrency_level = OS::getCpuCount();
+        if (concurrency_level < CONCURRENCY_LEVEL) concurrency_level = CONCURRENCY_LEVEL;
+    }
+    if (concurrency_level > MAX_CONCURRENCY_LEVEL) concurrency_level = MAX_CONCURRENCY_LEVEL;
+
     // (Re-)allocate calltrace buffers
-    if (_max_stack_depth != args._jstackdepth) {
-        _max_stack_depth = args._jstackdepth;
-        size_t buffer_size = (_max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES) * sizeof(CallTraceBuffer);
+    if (_max_stack_depth != args._jstackdepth || _concurrency_level < concurrency_level) {
+        size_t buffer_size = (args._jstackdepth + MAX_NATIVE_FRAMES + RESERVED_FRAMES) * sizeof(CallTraceBuffer);
+
+        // Buffers are mmapped rather than malloced, so that their pages can be placed on a NUMA node
+        for (int i = 0; i < MAX_CONCURRENCY_LEVEL; i++) {
+            if (_slots[i]._buffer != NULL) {
+                OS::safeFree(_slots[i]._buffer, _slot_buffer_size);
+                _slots[i]._buffer = NULL;
+            }
+        }
+        _slot_buffer_size = buffer_size;
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            free(_calltrace_buffer[i]);
-            _calltrace_buffer[i] = (CallTraceBuffer*)malloc(buffer_size);
-            if (_calltrace_buffer[i] == NULL) {
+        for (int i = 0; i < concurrency_level; i++) {
+            _slots[i]._buffer = (CallTraceBuffer*)OS::safeAlloc(buffer_size);
+            if (_slots[i]._buffer == NULL) {
                 _max_stack_depth = 0;
+                _concurrency_level = 0;
                 return Error("Not enough memory to allocate stack trace buffers (try smaller jstackdepth)");
             }
+            if (args._numa) {
+                // Slot i is normally taken by CPU i, see getLockIndex()
+                OS::bindToNumaNode(_slots[i]._buffer, buffer_size, OS::getNumaNode(i));
+            }
+        }
+        _max_stack_depth = args._jstackdepth;
+    }
+    _concurrency_level = concurrency_level;
+
+    if (args._cstack == CSTACK_DWARF || args._cstack == CSTACK_AUTO || args._cstack == CSTACK_VM) {
+        for (int i = 0; i < concurrency_level; i++) {
+            if (_slots[i]._dwarf_cache == NULL) {
+                _slots[i]._dwarf_cache = new FrameDescCache();
+            }
         }
     }
 
@@ -997,17 +1481,57 @@ Error Profiler::start(Arguments& args, bool reset) {
         _safe_mode |= GC_TRACES | LAST_JAVA_PC;
     }
 
+    _vm_walker = args._vm_walker && VMStructs::hasStackStructs();
+    if (args._vm_walker && !_vm_walker) {
+        Log::warn("VM stack walker is not supported on this JVM, using AsyncGetCallTrace");
+    }
+
     _add_thread_frame = args._threads && args._output != OUTPUT_JFR;
     _add_sched_frame = args._sched;
+    _add_pause_frame = args._pauses;
+    _alloc_poll = args._alloc_poll && (_event_mask & EM_ALLOC);
     _update_thread_names = args._threads || args._output == OUTPUT_JFR;
     _thread_filter.init(args._filter);
+    _context_filter = args._context;
+    _thread_window = args._thread_window;
+    _thread_cpu = args._thread_cpu;
+    _window_threads.clear();
 
     _engine = selectEngine(args._event);
+    _add_event_frame = args._extra_events != 0 && _engine == &perf_events;
     _cstack = args._cstack;
+    if (args._stack_copy > 0 && _cstack == CSTACK_DEFAULT) {
+        // Kernel callchains would walk user frames in the signal context, too
+        _cstack = args._cstack = CSTACK_FP;
+    }
+    if (_cstack == CSTACK_VM && !VMStructs::hasStackStructs()) {
+        Log::warn("VM stack walker is not supported on this JVM, using cstack=auto");
+        _cstack = args._cstack = CSTACK_AUTO;
+    }
+    if (_cstack == CSTACK_AUTO && !DWARF_SUPPORTED) {
+        // Without DWARF, frame pointers are all there is
+        _cstack = args._cstack = CSTACK_FP;
+    }
+    // LBR stacks need symbol names to drop duplicate branch records
+    _raw_pc = args._raw_pc && _cstack != CSTACK_LBR;
+    _live = args._live > 0 && (_event_mask & (EM_ALLOC | EM_NATIVEMEM));
+    // Trace ids of tracked allocations and lock stats must survive until the dump,
+    // so the storage is not compacted
+    _keep_trace_ids = _live || ((args._lock_stats || args._latency) && (_event_mask & EM_LOCK));
     if (_cstack == CSTACK_DWARF && !DWARF_SUPPORTED) {
         return Error("DWARF unwinding is not supported on this platform");
     } else if (_cstack == CSTACK_LBR && _engine != &perf_events) {
         return Error("Branch stack is supported only with PMU events");
+    } else if (args._stack_copy > 0 && (_cstack == CSTACK_NO || _cstack == CSTACK_LBR || _cstack == CSTACK_VM)) {
+        return Error("stackcopy requires cstack=fp, dwarf or auto");
+    } else if (args._stack_copy > 0 && VM::isOpenJ9()) {
+        return Error("stackcopy is not supported on OpenJ9");
+    } else if (args._extra_events != 0 && _engine != &perf_events && _engine != &instrument) {
+        return Error("Only perf events or Java methods can be sampled together");
+    } else if (args._fold != _fold) {
+        return Error("fold cannot be changed without reset");
+    } else if (_fold && (args._output == OUTPUT_JFR || _keep_trace_ids)) {
+        return Error("fold is incompatible with JFR output, live objects and lock stats");
     }
 
     // Kernel symbols are useful only for perf_events without --all-user
@@ -1029,13 +1553,30 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    // Engines iterate the registry instead of /proc, so fill it before starting them
+    ThreadRegistry::reconcile();
+    if (_thread_cpu && (reset || _start_time == 0)) {
+        ThreadCpu::reset();
+    }
+
+    _stack_copy = args._stack_copy > 0;
+    if (_stack_copy) {
+        error = StackCopier::start(args);
+        if (error) {
+            goto error1;
+        }
+    }
+
+    selectExecutionWalk();
     error = _engine->start(args);
     if (error) {
         goto error1;
     }
+    _kernel_only = _engine == &perf_events && PerfEvents::kernelOnly();
 
     if (_event_mask & EM_ALLOC) {
-        error = allocEngine()->start(args);
+        _alloc_engine = selectAllocEngine(args);
+        error = _alloc_engine->start(args);
         if (error) {
             goto error2;
         }
@@ -1046,25 +1587,59 @@ Error Profiler::start(Arguments& args, bool reset) {
             goto error3;
         }
     }
+    if (_event_mask & EM_NATIVEMEM) {
+        error = malloc_tracer.start(args);
+        if (error) {
+            goto error4;
+        }
+    }
+    if (_add_pause_frame) {
+        // Safepoints are still marked without GC events
+        error = PauseTracker::start();
+        if (error) {
+            Log::warn("%s", error.message());
+        }
+    }
 
     switchThreadEvents(JVMTI_ENABLE);
 
+    _overhead_target = args._overhead / 100;
+    _interval_scale = 1;
+    _last_sample_ticks = Counters::sampleTime();
+    _last_overhead_check = TSC::ticks();
+
+    _mem_limit = args._mem_limit;
+    _memory_level = MEMORY_OK;
+    _memory_scale = 1;
+    _last_memory_used = 0;
+    _call_trace_storage.limitDepth(0);
+    _call_trace_storage.mergeColdTraces(0);
+    // JFR resolves methods at chunk flush under the state lock, so the timer resolves them ahead
+    _call_trace_storage.prefetchMethods(VM::jvmti() != NULL && args._output == OUTPUT_JFR ? &_method_table : NULL);
+
     _state = RUNNING;
     _start_time = time(NULL);
+    _rotate_interval = args._rotate;
+    _monitor_period = args._monitor_period;
 
-    if (args._timeout != 0 || args._output == OUTPUT_JFR) {
+    if (args._timeout != 0 || args._output == OUTPUT_JFR || _overhead_target > 0 || _rotate_interval > 0 || _thread_cpu ||
+        _mem_limit > 0) {
         startTimer(args._timeout);
     }
 
     return Error::OK;
 
+error4:
+    if (_event_mask & EM_LOCK) lock_tracer.stop();
+
 error3:
-    if (_event_mask & EM_ALLOC) allocEngine()->stop();
+    if (_event_mask & EM_ALLOC) _alloc_engine->stop();
 
 error2:
     _engine->stop();
 
 error1:
+    if (_stack_copy) StackCopier::stop();
     uninstallTraps();
     switchLibraryTrap(false);
 
@@ -1083,10 +1658,14 @@ Error Profiler::stop() {
 
     uninstallTraps();
 
+    if (_event_mask & EM_NATIVEMEM) malloc_tracer.stop();
     if (_event_mask & EM_LOCK) lock_tracer.stop();
-    if (_event_mask & EM_ALLOC) allocEngine()->stop();
+    if (_event_mask & EM_ALLOC) _alloc_engine->stop();
+    PauseTracker::stop();
 
     _engine->stop();
+    // Remaining stack copies are recorded before JFR stops
+    if (_stack_copy) StackCopier::stop();
 
     switchLibraryTrap(false);
     switchThreadEvents(JVMTI_DISABLE);
@@ -1095,10 +1674,16 @@ Error Profiler::stop() {
 
     // Make sure no periodic events sent after JFR stops
     stopTimer();
+    // Messages queued since the last timer tick still go to JFR
+    Log::stopAsync();
+
+    recordLiveObjects();
+    recordLatencyHistograms();
 
     // Acquire all spinlocks to avoid race with remaining signals
     lockAll();
     _jfr.stop();
+    if (!_keep_trace_ids) _call_trace_storage.compact();
     unlockAll();
 
     FdTransferClient::closePeer();
@@ -1119,11 +1704,14 @@ Error Profiler::check(Arguments& args) {
         error = _engine->check(args);
     }
     if (!error && args._alloc > 0) {
-        error = allocEngine()->check(args);
+        error = selectAllocEngine(args)->check(args);
     }
     if (!error && args._lock > 0) {
         error = lock_tracer.check(args);
     }
+    if (!error && args._nativemem > 0) {
+        error = malloc_tracer.check(args);
+    }
 
     return error;
 }
@@ -1139,11 +1727,24 @@ Error Profiler::flushJfr() {
 
     lockAll();
     _jfr.flush();
+    // Trace IDs may change only at a chunk boundary
+    _call_trace_storage.compact();
     unlockAll();
 
     return Error::OK;
 }
 
+void Profiler::flushpointJfr() {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return;
+    }
+
+    // Samples keep being recorded: the recording is guarded by its own locks, and stack traces
+    // are read from the storage without stopping writers, as in a delta dump
+    _jfr.flushpoint();
+}
+
 Error Profiler::dump(std::ostream& out, Arguments& args) {
     MutexLocker ml(_state_lock);
     if (_state != IDLE && _state != RUNNING) {
@@ -1155,6 +1756,20 @@ Error Profiler::dump(std::ostream& out, Arguments& args) {
         updateNativeThreadNames();
     }
 
+    if (_fold && ((args._output != OUTPUT_FLAMEGRAPH && args._output != OUTPUT_TREE) || args._reverse || args._delta ||
+                  args._include || args._exclude)) {
+        return Error("fold supports only flamegraph and tree output without reverse, delta and filters");
+    }
+
+    // Compaction pauses recording. Delta dumps visit only the dirty lists, so they compact only
+    // after the table has grown, which happens a few times per session rather than at every dump
+    if (args._output != OUTPUT_JFR && !_jfr.active() && !_keep_trace_ids && !_fold
+        && (!args._delta || _call_trace_storage.hasGenerations())) {
+        lockAll();
+        _call_trace_storage.compact();
+        unlockAll();
+    }
+
     switch (args._output) {
         case OUTPUT_COLLAPSED:
             dumpCollapsed(out, args);
@@ -1168,10 +1783,19 @@ Error Profiler::dump(std::ostream& out, Arguments& args) {
         case OUTPUT_TEXT:
             dumpText(out, args);
             break;
+        case OUTPUT_BINARY:
+            dumpBinary(out, args);
+            break;
+        case OUTPUT_PPROF:
+            dumpPprof(out, args);
+            break;
         case OUTPUT_JFR:
             if (_state == RUNNING) {
+                recordLiveObjects();
+                recordLatencyHistograms();
                 lockAll();
-                _jfr.flush();
+                _jfr.dump();
+                if (!_keep_trace_ids) _call_trace_storage.compact();
                 unlockAll();
             }
             break;
@@ -1183,11 +1807,11 @@ Error Profiler::dump(std::ostream& out, Arguments& args) {
 }
 
 void Profiler::lockAll() {
-    for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].lock();
+    for (int i = 0; i < _concurrency_level; i++) _slots[i]._lock.lock();
 }
 
 void Profiler::unlockAll() {
-    for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].unlock();
+    for (int i = 0; i < _concurrency_level; i++) _slots[i]._lock.unlock();
 }
 
 void Profiler::switchThreadEvents(jvmtiEventMode mode) {
@@ -1199,102 +1823,559 @@ void Profiler::switchThreadEvents(jvmtiEventMode mode) {
     }
 }
 
-/*
- * Dump stacks in FlameGraph input format:
- * 
- * <frame>;<frame>;...;<topmost frame> <count>
- */
-void Profiler::dumpCollapsed(std::ostream& out, Arguments& args) {
-    FrameName fn(args, args._style, _thread_names_lock, _thread_names);
+static void printSampleTime(std::ostream& out, const char* title, CounterId time_counter, CounterId sample_counter) {
+    u64 samples = Counters::get(sample_counter);
+    if (samples > 0) {
+        u64 nanos = Counters::getNanos(time_counter);
+        out << "  " << title << ": " << samples << " samples in " << nanos / 1000000
+            << " ms, " << nanos / samples << " ns per sample\n";
+    }
+}
 
-    std::vector<CallTraceSample*> samples;
-    _call_trace_storage.collectSamples(samples);
+// Summarizes self-profiling counters for the status command
+void Profiler::printOverhead(std::ostream& out) {
+    out << "Profiler overhead:\n";
+    printSampleTime(out, "cpu", COUNTER_CPU_SAMPLE_TIME, COUNTER_CPU_SAMPLES);
+    printSampleTime(out, "alloc", COUNTER_ALLOC_SAMPLE_TIME, COUNTER_ALLOC_SAMPLES);
+    printSampleTime(out, "lock", COUNTER_LOCK_SAMPLE_TIME, COUNTER_LOCK_SAMPLES);
+    printSampleTime(out, "other", COUNTER_OTHER_SAMPLE_TIME, COUNTER_OTHER_SAMPLES);
 
-    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-        u64 samples = args._counter == COUNTER_SAMPLES ? loadAcquire((*it)->samples) : loadAcquire((*it)->counter);
-        if (samples == 0) continue;
+    out << "  stack walking: native " << Counters::getNanos(COUNTER_NATIVE_TRACE_TIME) / 1000000
+        << " ms, Java " << Counters::getNanos(COUNTER_JAVA_TRACE_TIME) / 1000000 << " ms\n";
 
-        CallTrace* trace = (*it)->trace;
-        if (excludeTrace(&fn, trace)) continue;
+    u64 puts = Counters::get(COUNTER_CALL_TRACE_PUTS);
+    out << "  call trace storage: " << puts << " puts in " << Counters::getNanos(COUNTER_CALL_TRACE_PUT_TIME) / 1000000
+        << " ms, " << Counters::get(COUNTER_CALL_TRACE_PROBES) << " extra probes\n";
 
-        for (int j = trace->num_frames - 1; j >= 0; j--) {
-            const char* frame_name = fn.name(trace->frames[j]);
-            out << frame_name << (j == 0 ? ' ' : ';');
-        }
-        out << samples << "\n";
+    if (_jfr.active()) {
+        out << "  jfr: " << Counters::get(COUNTER_JFR_BYTES) << " bytes written in "
+            << Counters::getNanos(COUNTER_JFR_WRITE_TIME) / 1000000 << " ms, "
+            << Counters::get(COUNTER_JFR_FLUSHES) << " chunk flushes in "
+            << Counters::getNanos(COUNTER_JFR_FLUSH_TIME) / 1000000 << " ms\n";
     }
+
+    out << "  dictionaries: " << Counters::get(COUNTER_DICTIONARY_LOOKUPS) << " lookups, "
+        << Counters::get(COUNTER_DICTIONARY_MISSES) << " new entries\n";
 }
 
-void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
-    char title[64];
-    if (args._title == NULL) {
-        Engine* active_engine = activeEngine();
-        if (args._counter == COUNTER_SAMPLES) {
-            strcpy(title, active_engine->title());
-        } else {
-            sprintf(title, "%s (%s)", active_engine->title(), active_engine->units());
-        }
+// Racy reads of plain counters, which is fine for monitoring; never takes _state_lock
+void Profiler::getStats(u64* values) {
+    values[STAT_RUNNING] = _state == RUNNING ? 1 : 0;
+    values[STAT_SAMPLES] = _total_samples;
+    for (int i = 0; i < ASGCT_FAILURE_TYPES; i++) {
+        values[STAT_FAILURES + i] = _failures[i];
     }
+    values[STAT_STORAGE_OVERFLOW] = _call_trace_storage.overflow();
+    values[STAT_JFR_BYTES] = Counters::get(COUNTER_JFR_BYTES);
+}
 
-    FlameGraph flamegraph(args._title == NULL ? title : args._title, args._counter, args._minwidth, args._reverse);
-    FrameName fn(args, args._style | STYLE_ANNOTATE, _thread_names_lock, _thread_names);
+// Samples to dump: either all of them or, in delta mode, only the changes since the previous delta dump.
+// Deltas are copies of the storage values taken at an epoch switch, so recording goes on meanwhile
+void Profiler::collectSamples(Arguments& args, std::vector<CallTraceSample*>& samples,
+                              std::vector<CallTraceSample>& deltas) {
+    // Live heap profile replaces the allocation profile: only objects that are still reachable.
+    // Other events of the session are dumped as usual. Traces of live objects are looked up
+    // before a delta dump may clear the storage
+    std::vector<CallTraceSample> live;
+    if (_live) {
+        collectLiveSamples(live);
+    }
 
-    std::vector<CallTraceSample*> samples;
-    _call_trace_storage.collectSamples(samples);
+    if (!args._delta) {
+        _call_trace_storage.collectSamples(samples);
+    } else if (_reset_storage) {
+        // Writers are paused only while the deltas are copied out of the storage
+        lockAll();
+        _call_trace_storage.collectDeltas(deltas);
+        _detached_traces = _call_trace_storage.detachDeltas(deltas);
+        if (_detached_traces != NULL) {
+            _call_trace_storage.clear();
+        }
+        unlockAll();
+    } else {
+        _call_trace_storage.collectDeltas(deltas);
+    }
+
+    deltas.insert(deltas.end(), live.begin(), live.end());
+    samples.reserve(samples.size() + deltas.size());
+    for (size_t i = 0; i < deltas.size(); i++) {
+        samples.push_back(&deltas[i]);
+    }
+}
+
+// Tracked objects that survived GC, aggregated by allocation site: samples is the number of objects
+// and counter is their total size in bytes
+void Profiler::collectLiveSamples(std::vector<CallTraceSample>& live) {
+    std::vector<LiveRef> refs;
+    if (_event_mask & EM_ALLOC) ObjectSampler::collectLive(refs);
+    if (_event_mask & EM_NATIVEMEM) MallocTracer::collectLive(refs);
+
+    std::map<u32, size_t> index;
+    lockAll();
+    for (size_t i = 0; i < refs.size(); i++) {
+        std::map<u32, size_t>::iterator it = index.find(refs[i].trace_id);
+        if (it == index.end()) {
+            CallTrace* trace = _call_trace_storage.findTrace(refs[i].trace_id);
+            if (trace == NULL) continue;
+
+            CallTraceSample sample;
+            memset(&sample, 0, sizeof(sample));
+            sample.trace = trace;
+            it = index.insert(std::make_pair(refs[i].trace_id, live.size())).first;
+            live.push_back(sample);
+        }
+        live[it->second].samples++;
+        live[it->second].counter += refs[i].size;
+    }
+    unlockAll();
+}
+
+// Appends tracked objects that are still alive to the recording as LiveObject events.
+// Called before the chunk with their stack traces is finished. Every dump writes a new snapshot
+// of all live objects; converters take only the last one, see jfr2flame.collectLiveSnapshot()
+void Profiler::recordLiveObjects() {
+    if (!_live || !_jfr.active() || !(_event_mask & EM_ALLOC)) {
+        return;
+    }
+
+    std::vector<LiveRef> refs;
+    ObjectSampler::collectLive(refs);
+
+    for (size_t i = 0; i < refs.size(); i++) {
+        LiveObjectEvent event;
+        event._class_id = refs[i].class_id;
+        event._alloc_size = refs[i].size;
+        event._alloc_time = refs[i].time;
+
+        int lock_index = tryLockSlot(refs[i].tid);
+        if (lock_index >= 0) {
+            _jfr.recordEvent(lock_index, refs[i].tid, refs[i].trace_id, BCI_LIVE_OBJECT, &event, 0);
+            _slots[lock_index]._lock.unlock();
+        }
+    }
+}
+
+// Every event covers the waits since the previous event of the same call trace,
+// so the events of a recording add up to the whole distribution
+void Profiler::recordLatencyHistograms() {
+    if (!LockTracer::hasLatency() || !_jfr.active() || !(_event_mask & EM_LOCK)) {
+        return;
+    }
+
+    std::vector<LatencyEntry> entries;
+    LockTracer::latency().collect(entries);
+
+    int tid = OS::threadId();
+    for (size_t i = 0; i < entries.size(); i++) {
+        LatencyEntry& e = entries[i];
+        LatencyEntry& reported = _latency_reported[e.key];
+        LatencyEntry total = e;
+        if (reported.key != 0) {
+            e.subtract(reported);
+            if (e.count == 0) continue;
+        }
+
+        LatencyEvent event;
+        event._count = e.count;
+        event._p50 = e.percentile(0.5);
+        event._p90 = e.percentile(0.9);
+        event._p99 = e.percentile(0.99);
+        event._p999 = e.percentile(0.999);
+        event._max = e.max;
+
+        int lock_index = tryLockSlot(tid);
+        if (lock_index >= 0) {
+            _jfr.recordEvent(lock_index, tid, (u32)e.key, BCI_LATENCY, &event, 0);
+            _slots[lock_index]._lock.unlock();
+            reported = total;
+        }
+    }
+}
+
+// Resolves names of all distinct frames in one pass before the writers ask for them;
+// see FrameName::resolveCollected
+void Profiler::resolveFrames(FrameName& fn, std::vector<CallTraceSample*>& samples) {
+    std::vector<ASGCT_CallFrame> frame_buf;
+    for (size_t i = 0; i < samples.size(); i++) {
+        if (loadAcquire(samples[i]->samples) == 0) continue;
+
+        int num_frames;
+        ASGCT_CallFrame* frames = _call_trace_storage.frames(samples[i], frame_buf, num_frames);
+        fn.collect(frames, num_frames);
+    }
+    fn.resolveCollected();
+}
+
+int Profiler::dumpThreads(size_t sample_count) {
+    size_t threads = sample_count / DUMP_SAMPLES_PER_THREAD;
+    int cpus = OS::getCpuCount();
+    if (threads > (size_t)cpus) threads = cpus;
+    if (threads > MAX_DUMP_THREADS) threads = MAX_DUMP_THREADS;
+    return (int)threads;
+}
+
+// Batches of a thread that could not be started are handled by the calling thread
+void Profiler::runDumpThreads(void* (*body)(void*), DumpBatch* batches, int count) {
+    pthread_t thread_ids[MAX_DUMP_THREADS];
+    bool started[MAX_DUMP_THREADS];
+    for (int i = 0; i < count; i++) {
+        started[i] = pthread_create(&thread_ids[i], NULL, body, &batches[i]) == 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (started[i]) {
+            pthread_join(thread_ids[i], NULL);
+        } else {
+            FrameName fn(*batches[i].args, batches[i].style, _thread_names, batches[i].resolved);
+            if (body == dumpCollapsedThread) {
+                std::ostringstream out;
+                dumpCollapsedBatch(fn, &batches[i], out);
+                batches[i].output = out.str();
+            } else {
+                filterTextBatch(fn, &batches[i]);
+            }
+        }
+    }
+}
+
+void Profiler::dumpCollapsedBatch(FrameName& fn, DumpBatch* batch, std::ostream& out) {
+    Arguments& args = *batch->args;
+    std::vector<ASGCT_CallFrame> frame_buf;
+
+    for (size_t i = batch->start; i < batch->end; i++) {
+        CallTraceSample* sample = batch->samples[i];
+        u64 samples = args._counter == COUNTER_SAMPLES ? loadAcquire(sample->samples) : loadAcquire(sample->counter);
+        if (samples == 0) continue;
+
+        int num_frames;
+        ASGCT_CallFrame* frames = _call_trace_storage.frames(sample, frame_buf, num_frames);
+        if (excludeTrace(&fn, num_frames, frames)) continue;
+
+        for (int j = num_frames - 1; j >= 0; j--) {
+            const char* frame_name = fn.name(frames[j]);
+            out << frame_name << (j == 0 ? ' ' : ';');
+        }
+        out << samples << "\n";
+    }
+}
+
+// Keeps samples that pass the include/exclude filters and counts their top frames
+void Profiler::filterTextBatch(FrameName& fn, DumpBatch* batch) {
+    bool top_methods = batch->args->_dump_flat > 0;
+    std::vector<ASGCT_CallFrame> frame_buf;
+
+    for (size_t i = batch->start; i < batch->end; i++) {
+        CallTraceSample* sample = batch->samples[i];
+        int num_frames;
+        ASGCT_CallFrame* frames = _call_trace_storage.frames(sample, frame_buf, num_frames);
+        if (excludeTrace(&fn, num_frames, frames)) continue;
+
+        batch->kept.push_back(*sample);
+        if (top_methods) {
+            batch->histogram.add(frames[0], sample->samples, sample->counter);
+        }
+    }
+}
+
+void* Profiler::dumpCollapsedThread(void* arg) {
+    DumpBatch* batch = (DumpBatch*)arg;
+    // Java frame names that were not resolved in advance need JVMTI
+    JNIEnv* jni = VM::jvmti() != NULL ? VM::attachThread("Async-profiler Dump") : NULL;
+    {
+        FrameName fn(*batch->args, batch->style, _instance->_thread_names, batch->resolved);
+        std::ostringstream out;
+        _instance->dumpCollapsedBatch(fn, batch, out);
+        batch->output = out.str();
+    }
+    if (jni != NULL) {
+        VM::detachThread();
+    }
+    return NULL;
+}
+
+void* Profiler::filterTextThread(void* arg) {
+    DumpBatch* batch = (DumpBatch*)arg;
+    JNIEnv* jni = VM::jvmti() != NULL ? VM::attachThread("Async-profiler Dump") : NULL;
+    {
+        FrameName fn(*batch->args, batch->style, _instance->_thread_names, batch->resolved);
+        _instance->filterTextBatch(fn, batch);
+    }
+    if (jni != NULL) {
+        VM::detachThread();
+    }
+    return NULL;
+}
+
+/*
+ * Dump stacks in FlameGraph input format:
+ * 
+ * <frame>;<frame>;...;<topmost frame> <count>
+ *
+ * Large profiles are formatted by several threads, each over its own range of samples.
+ * Frame names are resolved once beforehand and shared read-only by all workers
+ */
+void Profiler::dumpCollapsed(std::ostream& out, Arguments& args) {
+    FrameName fn(args, args._style, _thread_names);
+
+    std::vector<CallTraceSample*> samples;
+    std::vector<CallTraceSample> deltas;
+    collectSamples(args, samples, deltas);
+    resolveFrames(fn, samples);
+
+    int threads = dumpThreads(samples.size());
+    if (threads < 2) {
+        DumpBatch batch;
+        batch.args = &args;
+        batch.style = args._style;
+        batch.resolved = NULL;
+        batch.samples = samples.data();
+        batch.start = 0;
+        batch.end = samples.size();
+        dumpCollapsedBatch(fn, &batch, out);
+        return;
+    }
+
+    DumpBatch batches[MAX_DUMP_THREADS];
+    for (int i = 0; i < threads; i++) {
+        batches[i].args = &args;
+        batches[i].style = args._style;
+        batches[i].resolved = fn.cache();
+        batches[i].samples = samples.data();
+        batches[i].start = samples.size() * i / threads;
+        batches[i].end = samples.size() * (i + 1) / threads;
+    }
+    runDumpThreads(dumpCollapsedThread, batches, threads);
+
+    for (int i = 0; i < threads; i++) {
+        out << batches[i].output;
+    }
+}
+
+void Profiler::dumpBinary(std::ostream& out, Arguments& args) {
+    BinaryProfile profile(out, args._counter);
+    FrameName fn(args, args._style, _thread_names);
+
+    std::vector<CallTraceSample*> samples;
+    std::vector<CallTraceSample> deltas;
+    collectSamples(args, samples, deltas);
+    resolveFrames(fn, samples);
+    std::vector<ASGCT_CallFrame> frame_buf;
+    std::vector<u32> name_ids;
 
     for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
         u64 samples = args._counter == COUNTER_SAMPLES ? loadAcquire((*it)->samples) : loadAcquire((*it)->counter);
         if (samples == 0) continue;
 
-        CallTrace* trace = (*it)->trace;
-        if (excludeTrace(&fn, trace)) continue;
+        int num_frames;
+        ASGCT_CallFrame* frames = _call_trace_storage.frames(*it, frame_buf, num_frames);
+        if (excludeTrace(&fn, num_frames, frames)) continue;
+
+        name_ids.resize(num_frames);
+        for (int j = 0; j < num_frames; j++) {
+            name_ids[j] = profile.frameId(fn, frames[num_frames - 1 - j]);
+        }
+        profile.addTrace(samples, num_frames, name_ids.data());
+    }
+
+    profile.finish();
+}
+
+void Profiler::dumpPprof(std::ostream& out, Arguments& args) {
+    // Unit names recognized by pprof
+    const char* units = activeEngine()->units();
+    const char* type = "total";
+    const char* unit = "count";
+    if (strcmp(units, "ns") == 0) {
+        type = "time";
+        unit = "nanoseconds";
+    } else if (strcmp(units, "bytes") == 0) {
+        type = "space";
+        unit = "bytes";
+    } else if (strcmp(units, "calls") == 0) {
+        type = "calls";
+    }
+
+    PprofProfile profile(out, type, unit, args._counter, (u64)_start_time * 1000000000ULL,
+                         (u64)uptime() * 1000000000ULL);
+    FrameName fn(args, args._style, _thread_names);
+
+    std::vector<CallTraceSample*> samples;
+    std::vector<CallTraceSample> deltas;
+    collectSamples(args, samples, deltas);
+    resolveFrames(fn, samples);
+    std::vector<ASGCT_CallFrame> frame_buf;
+    std::vector<u32> location_ids;
+
+    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        u64 counter = loadAcquire((*it)->counter);
+        if (counter == 0) continue;
+
+        int num_frames;
+        ASGCT_CallFrame* frames = _call_trace_storage.frames(*it, frame_buf, num_frames);
+        if (excludeTrace(&fn, num_frames, frames)) continue;
+
+        location_ids.resize(num_frames);
+        for (int j = 0; j < num_frames; j++) {
+            location_ids[j] = profile.locationId(fn, frames[j]);
+        }
+        profile.addSample(loadAcquire((*it)->samples), counter, num_frames, location_ids.data());
+    }
+
+    profile.finish();
+}
+
+void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
+    char title[64];
+    if (args._title == NULL) {
+        Engine* active_engine = activeEngine();
+        if (args._counter == COUNTER_SAMPLES) {
+            strcpy(title, active_engine->title());
+        } else {
+            sprintf(title, "%s (%s)", active_engine->title(), active_engine->units());
+        }
+    }
+
+    FlameGraph flamegraph(args._title == NULL ? title : args._title, args._counter, args._minwidth, args._reverse);
+    FrameName fn(args, args._style | STYLE_ANNOTATE, _thread_names);
+
+    if (_fold) {
+        dumpFoldedTree(flamegraph, fn, args._counter);
+        flamegraph.dump(out, tree);
+        return;
+    }
+
+    std::vector<CallTraceSample*> samples;
+    std::vector<CallTraceSample> deltas;
+    collectSamples(args, samples, deltas);
+    resolveFrames(fn, samples);
+    std::vector<ASGCT_CallFrame> frame_buf;
+
+    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        u64 samples = args._counter == COUNTER_SAMPLES ? loadAcquire((*it)->samples) : loadAcquire((*it)->counter);
+        if (samples == 0) continue;
 
-        int num_frames = trace->num_frames;
+        int num_frames;
+        ASGCT_CallFrame* frames = _call_trace_storage.frames(*it, frame_buf, num_frames);
+        if (excludeTrace(&fn, num_frames, frames)) continue;
 
-        Trie* f = flamegraph.root();
+        u32 f = FlameGraph::ROOT;
         if (args._reverse) {
             // Thread frames always come first
+            if (_add_event_frame) {
+                f = flamegraph.addChild(f, flamegraph.frameId(fn, frames[--num_frames]), samples);
+            }
             if (_add_sched_frame) {
-                const char* frame_name = fn.name(trace->frames[--num_frames]);
-                f = f->addChild(frame_name, samples);
+                f = flamegraph.addChild(f, flamegraph.frameId(fn, frames[--num_frames]), samples);
             }
             if (_add_thread_frame) {
-                const char* frame_name = fn.name(trace->frames[--num_frames]);
-                f = f->addChild(frame_name, samples);
+                f = flamegraph.addChild(f, flamegraph.frameId(fn, frames[--num_frames]), samples);
             }
 
             for (int j = 0; j < num_frames; j++) {
-                const char* frame_name = fn.name(trace->frames[j]);
-                f = f->addChild(frame_name, samples);
+                f = flamegraph.addChild(f, flamegraph.frameId(fn, frames[j]), samples);
             }
         } else {
             for (int j = num_frames - 1; j >= 0; j--) {
-                const char* frame_name = fn.name(trace->frames[j]);
-                f = f->addChild(frame_name, samples);
+                f = flamegraph.addChild(f, flamegraph.frameId(fn, frames[j]), samples);
             }
         }
-        f->addLeaf(samples);
+        flamegraph.addLeaf(f, samples);
     }
 
     flamegraph.dump(out, tree);
 }
 
+// The folded tree needs only one pass: totals are summed up from the children, which follow
+// their parents in the order of node ids, and then nodes are added to the flame graph top-down
+void Profiler::dumpFoldedTree(FlameGraph& flamegraph, FrameName& fn, Counter counter) {
+    u32 count = _call_tree.nodeCount();
+    std::vector<u64> self(count);
+    std::vector<u64> total(count);
+    for (u32 id = count; id-- > 0; ) {
+        CallTreeCounter value;
+        if (_call_tree.getCounter(id, value)) {
+            self[id] = counter == COUNTER_SAMPLES ? value.samples : value.counter;
+            total[id] += self[id];
+        }
+        if (id > 0 && total[id] > 0) {
+            total[_call_tree.node(id)->parent] += total[id];
+        }
+    }
+
+    std::vector<u32> flame_ids(count);
+    flame_ids[0] = FlameGraph::ROOT;
+    if (self[0] > 0) {
+        flamegraph.addLeaf(FlameGraph::ROOT, self[0]);
+    }
+    for (u32 id = 1; id < count; id++) {
+        if (total[id] == 0) continue;
+
+        TrieNode* node = _call_tree.node(id);
+        u32 f = flamegraph.addChild(flame_ids[node->parent], flamegraph.frameId(fn, node->frame), total[id]);
+        flame_ids[id] = f;
+        if (self[id] > 0) {
+            flamegraph.addLeaf(f, self[id]);
+        }
+    }
+}
+
+// Distinct frames may still share a name, e.g. when line numbers are not shown
+void Profiler::addMethodNames(FrameName& fn, MethodHistogram& frames, std::map<std::string, MethodSample>& histogram) {
+    for (size_t i = 0; i < frames.frames.size(); i++) {
+        histogram[fn.name(frames.frames[i])].add(frames.samples[i].samples, frames.samples[i].counter);
+    }
+}
+
 void Profiler::dumpText(std::ostream& out, Arguments& args) {
-    FrameName fn(args, args._style | STYLE_DOTTED, _thread_names_lock, _thread_names);
+    FrameName fn(args, args._style | STYLE_DOTTED, _thread_names);
     char buf[1024] = {0};
 
     std::vector<CallTraceSample> samples;
+    std::vector<ASGCT_CallFrame> frame_buf;
+    std::map<std::string, MethodSample> histogram;
     u64 total_counter = 0;
     {
-        std::map<u64, CallTraceSample> map;
-        _call_trace_storage.collectSamples(map);
-        samples.reserve(map.size());
+        std::vector<CallTraceSample> collected;
+        _call_trace_storage.collectSamples(collected);
+
+        std::vector<CallTraceSample*> all;
+        all.reserve(collected.size());
+        for (size_t i = 0; i < collected.size(); i++) {
+            total_counter += collected[i].counter;
+            if (collected[i].trace->num_frames == 0) continue;
+            all.push_back(&collected[i]);
+        }
 
-        for (std::map<u64, CallTraceSample>::const_iterator it = map.begin(); it != map.end(); ++it) {
-            total_counter += it->second.counter;
-            CallTrace* trace = it->second.trace;
-            if (trace->num_frames == 0 || excludeTrace(&fn, trace)) continue;
-            samples.push_back(it->second);
+        int threads = dumpThreads(all.size());
+        if (threads < 2) {
+            DumpBatch batch;
+            batch.args = &args;
+            batch.style = args._style | STYLE_DOTTED;
+            batch.resolved = NULL;
+            batch.samples = all.data();
+            batch.start = 0;
+            batch.end = all.size();
+            filterTextBatch(fn, &batch);
+            samples.swap(batch.kept);
+            addMethodNames(fn, batch.histogram, histogram);
+        } else {
+            resolveFrames(fn, all);
+
+            DumpBatch batches[MAX_DUMP_THREADS];
+            for (int i = 0; i < threads; i++) {
+                batches[i].args = &args;
+                batches[i].style = args._style | STYLE_DOTTED;
+                batches[i].resolved = fn.cache();
+                batches[i].samples = all.data();
+                batches[i].start = all.size() * i / threads;
+                batches[i].end = all.size() * (i + 1) / threads;
+            }
+            runDumpThreads(filterTextThread, batches, threads);
+
+            samples.reserve(all.size());
+            for (int i = 0; i < threads; i++) {
+                samples.insert(samples.end(), batches[i].kept.begin(), batches[i].kept.end());
+                addMethodNames(fn, batches[i].histogram, histogram);
+            }
         }
     }
 
@@ -1308,11 +2389,24 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
     double spercent = 100.0 / _total_samples;
     for (int i = 1; i < ASGCT_FAILURE_TYPES; i++) {
         const char* err_string = asgctError(-i);
-        if (err_string != NULL && _failures[i] > 0) {
+        if (err_string != NULL && (_failures[i] > 0 || i == -ticks_skipped)) {
             snprintf(buf, sizeof(buf), "%-20s: %lld (%.2f%%)\n", err_string, _failures[i], _failures[i] * spercent);
             out << buf;
         }
     }
+
+    CallTraceStorageStats stats;
+    _call_trace_storage.getStats(stats);
+    snprintf(buf, sizeof(buf), "%-20s: %llu (tables: %u, capacity: %llu, avg probe: %.2f, max probe: %u)\n",
+             "Call traces", (unsigned long long)stats.size, stats.generations, (unsigned long long)stats.capacity,
+             stats.avg_probe, stats.max_probe);
+    out << buf;
+    if (stats.trie_nodes > 0 || stats.root_segments > 0) {
+        snprintf(buf, sizeof(buf), "%-20s: %llu bytes (flat: %llu bytes, saved: %lld bytes, trie nodes: %u, root segments: %llu)\n",
+                 "Call trace memory", (unsigned long long)stats.used_bytes, (unsigned long long)stats.flat_bytes,
+                 (long long)(stats.flat_bytes - stats.used_bytes), stats.trie_nodes, (unsigned long long)stats.root_segments);
+        out << buf;
+    }
     out << "\n";
 
     double cpercent = 100.0 / total_counter;
@@ -1320,18 +2414,17 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
 
     // Print top call stacks
     if (args._dump_traces > 0) {
-        std::sort(samples.begin(), samples.end());
-
-        int max_count = args._dump_traces;
-        for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end() && --max_count >= 0; ++it) {
+        size_t count = selectTop(samples, args._dump_traces, std::less<CallTraceSample>());
+        for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.begin() + count; ++it) {
             snprintf(buf, sizeof(buf) - 1, "--- %lld %s (%.2f%%), %lld sample%s\n",
                      it->counter, units_str, it->counter * cpercent,
                      it->samples, it->samples == 1 ? "" : "s");
             out << buf;
 
-            CallTrace* trace = it->trace;
-            for (int j = 0; j < trace->num_frames; j++) {
-                const char* frame_name = fn.name(trace->frames[j]);
+            int num_frames;
+            ASGCT_CallFrame* frames = _call_trace_storage.frames(&*it, frame_buf, num_frames);
+            for (int j = 0; j < num_frames; j++) {
+                const char* frame_name = fn.name(frames[j]);
                 snprintf(buf, sizeof(buf) - 1, "  [%2d] %s\n", j, frame_name);
                 out << buf;
             }
@@ -1341,26 +2434,257 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
 
     // Print top methods
     if (args._dump_flat > 0) {
-        std::map<std::string, MethodSample> histogram;
-        for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-            const char* frame_name = fn.name(it->trace->frames[0]);
-            histogram[frame_name].add(it->samples, it->counter);
-        }
-
         std::vector<NamedMethodSample> methods(histogram.begin(), histogram.end());
-        std::sort(methods.begin(), methods.end(), sortByCounter);
+        size_t count = selectTop(methods, args._dump_flat, sortByCounter);
 
         snprintf(buf, sizeof(buf) - 1, "%12s  percent  samples  top\n"
                                        "  ----------  -------  -------  ---\n", units_str);
         out << buf;
 
-        int max_count = args._dump_flat;
-        for (std::vector<NamedMethodSample>::const_iterator it = methods.begin(); it != methods.end() && --max_count >= 0; ++it) {
+        for (std::vector<NamedMethodSample>::const_iterator it = methods.begin(); it != methods.begin() + count; ++it) {
             snprintf(buf, sizeof(buf) - 1, "%12lld  %6.2f%%  %7lld  %s\n",
                      it->second.counter, it->second.counter * cpercent, it->second.samples, it->first.c_str());
             out << buf;
         }
     }
+
+    if ((_event_mask & EM_LOCK) && LockTracer::hasLockStats()) {
+        dumpLockStats(out, fn, args);
+    }
+
+    if ((_event_mask & EM_LOCK) && LockTracer::hasLatency()) {
+        dumpLatency(out, fn, args);
+    }
+
+    if (_engine == &instrument) {
+        instrument.dumpCounters(out);
+    }
+
+    if (_engine == &perf_events && PerfEvents::countsHits()) {
+        dumpHitCounts(out, args);
+    }
+
+    if (_thread_cpu) {
+        dumpThreadCpu(out, args);
+    }
+}
+
+static bool sortByTotalTime(const LockStat& a, const LockStat& b) {
+    return a.total_time > b.total_time;
+}
+
+// Lock classes with the most wait time, each with the call site where the lock was acquired
+void Profiler::dumpLockStats(std::ostream& out, FrameName& fn, Arguments& args) {
+    char buf[1024] = {0};
+
+    std::vector<LockStat> stats;
+    u64 overflow = LockTracer::collectLockStats(stats);
+    std::sort(stats.begin(), stats.end(), sortByTotalTime);
+
+    u64 total_time = overflow;
+    for (size_t i = 0; i < stats.size(); i++) {
+        total_time += stats[i].total_time;
+    }
+    double percent = total_time > 0 ? 100.0 / total_time : 0;
+
+    out << "\n--- Contention by lock ---\n";
+    snprintf(buf, sizeof(buf) - 1, "%14s  percent    count  %12s  lock / acquired at\n"
+                                   "  ------------  -------  -------  ------------  ------------------\n",
+             "wait ns", "max ns");
+    out << buf;
+
+    int max_count = args._dump_flat > 0 ? args._dump_flat : (int)stats.size();
+    std::vector<ASGCT_CallFrame> frame_buf;
+    lockAll();
+    for (size_t i = 0; i < stats.size() && --max_count >= 0; i++) {
+        const LockStat& s = stats[i];
+        ASGCT_CallFrame lock_frame = {BCI_LOCK, (jmethodID)(uintptr_t)s.classId()};
+        snprintf(buf, sizeof(buf) - 1, "%14llu  %6.2f%%  %7llu  %12llu  %s\n",
+                 (unsigned long long)s.total_time, s.total_time * percent,
+                 (unsigned long long)s.count, (unsigned long long)s.max_time,
+                 s.classId() != 0 ? fn.name(lock_frame) : "unknown");
+        out << buf;
+
+        // Skip the pseudo-frame with the lock class
+        CallTrace* trace = _call_trace_storage.findTrace(s.callTraceId());
+        if (trace != NULL) {
+            ASGCT_CallFrame* frames = _call_trace_storage.frames(trace, frame_buf);
+            for (int j = 0; j < trace->num_frames; j++) {
+                if (frames[j].bci != BCI_LOCK && frames[j].bci != BCI_PARK) {
+                    snprintf(buf, sizeof(buf) - 1, "%62s  at %s\n", "", fn.name(frames[j]));
+                    out << buf;
+                    break;
+                }
+            }
+        }
+    }
+    unlockAll();
+
+    if (overflow > 0) {
+        snprintf(buf, sizeof(buf) - 1, "%14llu  %6.2f%%  (not aggregated: too many distinct locks and call sites)\n",
+                 (unsigned long long)overflow, overflow * percent);
+        out << buf;
+    }
+}
+
+static bool sortByP99(const std::pair<u64, LatencyEntry*>& a, const std::pair<u64, LatencyEntry*>& b) {
+    return a.first > b.first;
+}
+
+// Frames of a histogram call trace copied out of the storage
+struct LatencySite {
+    ASGCT_CallFrame lock;
+    ASGCT_CallFrame caller;
+    bool has_lock;
+    bool has_caller;
+};
+
+// Call traces with the worst tail latency, each with the lock class and the call site
+void Profiler::dumpLatency(std::ostream& out, FrameName& fn, Arguments& args) {
+    char buf[1024] = {0};
+
+    std::vector<LatencyEntry> entries;
+    u64 overflow = LockTracer::latency().collect(entries);
+
+    std::vector<std::pair<u64, LatencyEntry*> > sorted;
+    sorted.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        sorted.push_back(std::make_pair(entries[i].percentile(0.99), &entries[i]));
+    }
+    std::sort(sorted.begin(), sorted.end(), sortByP99);
+
+    out << "\n--- Wait time distribution ---\n";
+    snprintf(buf, sizeof(buf) - 1, "%9s  %12s  %12s  %12s  %12s  %12s  lock / acquired at\n"
+                                   "  -------  ------------  ------------  ------------  ------------  ------------  ------------------\n",
+             "count", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+    out << buf;
+
+    // Only the frames are copied under the lock; names are resolved after it is released
+    size_t count = args._dump_flat > 0 ? std::min((size_t)args._dump_flat, sorted.size()) : sorted.size();
+    LatencySite none = {{0, NULL}, {0, NULL}, false, false};
+    std::vector<LatencySite> sites(count, none);
+    std::vector<ASGCT_CallFrame> frame_buf;
+    lockAll();
+    for (size_t i = 0; i < count; i++) {
+        CallTrace* trace = _call_trace_storage.findTrace((u32)sorted[i].second->key);
+        if (trace == NULL) {
+            continue;
+        }
+
+        // The lock class is the pseudo-frame on top of the trace
+        ASGCT_CallFrame* frames = _call_trace_storage.frames(trace, frame_buf);
+        if (trace->num_frames > 0 && (frames[0].bci == BCI_LOCK || frames[0].bci == BCI_PARK)) {
+            sites[i].lock = frames[0];
+            sites[i].has_lock = true;
+        }
+        for (int j = 0; j < trace->num_frames; j++) {
+            if (frames[j].bci != BCI_LOCK && frames[j].bci != BCI_PARK) {
+                sites[i].caller = frames[j];
+                sites[i].has_caller = true;
+                break;
+            }
+        }
+    }
+    unlockAll();
+
+    for (size_t i = 0; i < count; i++) {
+        const LatencyEntry& e = *sorted[i].second;
+        const char* lock_name = sites[i].has_lock ? fn.name(sites[i].lock) : "unknown";
+
+        snprintf(buf, sizeof(buf) - 1, "%9llu  %12llu  %12llu  %12llu  %12llu  %12llu  %s\n",
+                 (unsigned long long)e.count, (unsigned long long)e.percentile(0.5),
+                 (unsigned long long)e.percentile(0.9), (unsigned long long)sorted[i].first,
+                 (unsigned long long)e.percentile(0.999), (unsigned long long)e.max, lock_name);
+        out << buf;
+
+        if (sites[i].has_caller) {
+            snprintf(buf, sizeof(buf) - 1, "%81s  at %s\n", "", fn.name(sites[i].caller));
+            out << buf;
+        }
+    }
+
+    if (overflow > 0) {
+        snprintf(buf, sizeof(buf) - 1, "%9llu  (not aggregated: too many distinct call traces)\n",
+                 (unsigned long long)overflow);
+        out << buf;
+    }
+}
+
+static bool sortByHits(const std::pair<int, u64>& a, const std::pair<int, u64>& b) {
+    return a.second > b.second;
+}
+
+// Exact number of perf events per thread, which the sampled stacks alone cannot tell
+void Profiler::dumpHitCounts(std::ostream& out, Arguments& args) {
+    char buf[1024] = {0};
+
+    std::vector<std::pair<int, u64> > hits;
+    u64 total = PerfEvents::collectHits(hits);
+
+    // A thread ID may be reused after the thread has exited
+    std::map<int, u64> per_thread;
+    for (size_t i = 0; i < hits.size(); i++) {
+        per_thread[hits[i].first] += hits[i].second;
+    }
+    std::vector<std::pair<int, u64> > sorted(per_thread.begin(), per_thread.end());
+    std::sort(sorted.begin(), sorted.end(), sortByHits);
+
+    snprintf(buf, sizeof(buf) - 1, "\n--- Event counts ---\n"
+                                   "%-20s: %llu\n\n"
+                                   "%14s  thread\n"
+                                   "  ------------  ------\n",
+             "Total events", (unsigned long long)total, "count");
+    out << buf;
+
+    int max_count = args._dump_flat > 0 ? args._dump_flat : (int)sorted.size();
+    for (size_t i = 0; i < sorted.size() && --max_count >= 0; i++) {
+        char name_buf[64];
+        const char* name = _thread_names.name(sorted[i].first);
+        if (name == NULL) {
+            name = OS::threadName(sorted[i].first, name_buf, sizeof(name_buf)) ? name_buf : "unknown";
+        }
+        snprintf(buf, sizeof(buf) - 1, "%14llu  %s [tid=%d]\n", (unsigned long long)sorted[i].second, name, sorted[i].first);
+        out << buf;
+    }
+}
+
+static bool sortByCpuTime(const ThreadCpuStat& a, const ThreadCpuStat& b) {
+    return a.cpu_time > b.cpu_time;
+}
+
+// CPU time next to the number of samples tells threads that are undersampled,
+// e.g. because they were filtered out or run mostly in code the engine cannot see
+void Profiler::dumpThreadCpu(std::ostream& out, Arguments& args) {
+    char buf[1024] = {0};
+
+    ThreadCpu::update(NULL);
+    std::vector<ThreadCpuStat> stats;
+    ThreadCpu::collect(stats);
+    std::sort(stats.begin(), stats.end(), sortByCpuTime);
+
+    u64 total_time = 0;
+    for (size_t i = 0; i < stats.size(); i++) {
+        total_time += stats[i].cpu_time;
+    }
+    double percent = total_time > 0 ? 100.0 / total_time : 0;
+
+    out << "\n--- CPU time by thread ---\n";
+    snprintf(buf, sizeof(buf) - 1, "%14s  percent  %9s  thread\n"
+                                   "  ------------  -------  ---------  ------\n",
+             "cpu ms", "samples");
+    out << buf;
+
+    int max_count = args._dump_flat > 0 ? args._dump_flat : (int)stats.size();
+    for (size_t i = 0; i < stats.size() && --max_count >= 0; i++) {
+        char name_buf[64];
+        const char* name = _thread_names.name(stats[i].tid);
+        if (name == NULL) {
+            name = OS::threadName(stats[i].tid, name_buf, sizeof(name_buf)) ? name_buf : "unknown";
+        }
+        snprintf(buf, sizeof(buf) - 1, "%14.3f  %6.2f%%  %9lld  %s [tid=%d]\n",
+                 stats[i].cpu_time / 1e6, stats[i].cpu_time * percent, stats[i].samples, name, stats[i].tid);
+        out << buf;
+    }
 }
 
 time_t Profiler::addTimeout(time_t start, int timeout) {
@@ -1415,15 +2739,39 @@ void Profiler::stopTimer() {
 
 void Profiler::timerLoop(int timeout) {
     u64 stop_micros = addTimeout(_start_time, timeout) * 1000000ULL;
-    u64 current_time = OS::nanotime();
-    u64 sleep_until = current_time + (_jfr.active() || timeout <= 0 ? 1000000000 : timeout * 1000000000ULL);
+    u64 current_time = TSC::nanos();
+    u64 sleep_until = current_time + (_jfr.active() || timeout <= 0 || _overhead_target > 0 || _rotate_interval > 0 ||
+                                      _thread_cpu || _mem_limit > 0 ? 1000000000 : timeout * 1000000000ULL);
+    u64 rotate_nanos = _rotate_interval * 1000000000ULL;
+    u64 next_rotation = current_time + rotate_nanos;
+
+    // JFR monitors with a sub-second period wake the timer up between regular ticks
+    u64 monitor_nanos = _jfr.active() && _monitor_period < 1000000000 ? _monitor_period : 0;
+    u64 next_tick = sleep_until;
+    if (monitor_nanos > 0 && current_time + monitor_nanos < next_tick) {
+        sleep_until = current_time + monitor_nanos;
+    }
+
+    // Logging threads only queue messages while the timer wakes up often enough to write them
+    if (sleep_until - current_time <= 1000000000) {
+        Log::startAsync();
+    }
 
     while (_timer_is_running) {
-        while ((current_time = OS::nanotime()) < sleep_until) {
+        while ((current_time = TSC::nanos()) < sleep_until) {
             OS::sleep(sleep_until - current_time);
             if (!_timer_is_running) return;
         }
 
+        Log::drain();
+        _method_table.prefetch();
+
+        if (current_time < next_tick) {
+            _jfr.monitorTick();
+            sleep_until = current_time + monitor_nanos < next_tick ? current_time + monitor_nanos : next_tick;
+            continue;
+        }
+
         u64 wall_time = OS::micros();
         if (wall_time >= stop_micros) {
             VM::restartProfiler();
@@ -1434,9 +2782,124 @@ void Profiler::timerLoop(int timeout) {
         if (need_switch_chunk) {
             // Flush under profiler state lock
             flushJfr();
+        } else if (_jfr.active()) {
+            flushpointJfr();
         }
 
-        sleep_until = current_time + 1000000000;
+        if (_thread_cpu && !_jfr.active()) {
+            // Keep the last CPU time of threads that exit before the dump
+            ThreadCpu::update(NULL);
+        }
+
+        if (_overhead_target > 0) {
+            controlOverhead();
+        }
+
+        if (_mem_limit > 0) {
+            controlMemory();
+        }
+
+        if (rotate_nanos > 0 && current_time >= next_rotation) {
+            VM::rotateProfiler();
+            // Skip rotations missed while the dump was in progress rather than catching up
+            next_rotation += rotate_nanos;
+            if (next_rotation <= current_time) {
+                next_rotation = current_time + rotate_nanos;
+            }
+        }
+
+        next_tick = current_time + 1000000000;
+        sleep_until = monitor_nanos > 0 ? current_time + monitor_nanos : next_tick;
+    }
+}
+
+// Keeps the time spent in recordSample within overhead=PCT of one CPU
+// by scaling the intervals of all running engines, but never below the configured ones
+void Profiler::controlOverhead() {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return;
+    }
+
+    u64 current_ticks = TSC::ticks();
+    u64 sample_ticks = Counters::sampleTime();
+    if (current_ticks <= _last_overhead_check) {
+        return;
+    }
+
+    double load = (double)(sample_ticks - _last_sample_ticks) / (current_ticks - _last_overhead_check);
+    _last_sample_ticks = sample_ticks;
+    _last_overhead_check = current_ticks;
+
+    double scale = _interval_scale;
+    if (load > _overhead_target) {
+        scale *= load / _overhead_target < MAX_SCALE_STEP ? load / _overhead_target : MAX_SCALE_STEP;
+        if (scale > MAX_INTERVAL_SCALE) scale = MAX_INTERVAL_SCALE;
+    } else if (load < _overhead_target / 2 && scale > 1) {
+        // Relax slowly, so that the load does not oscillate around the target
+        scale = scale / 2 > 1 ? scale / 2 : 1;
+    }
+
+    if (scale == _interval_scale) {
+        return;
+    }
+    _interval_scale = scale;
+    applyIntervalScale();
+
+    Log::debug("Sampling overhead %.2f%%, intervals scaled by %.2f", load * 100, scale);
+}
+
+// The overhead and the memory controllers scale intervals independently; engines get the product
+void Profiler::applyIntervalScale() {
+    double scale = _interval_scale * _memory_scale;
+    if (scale > MAX_INTERVAL_SCALE) scale = MAX_INTERVAL_SCALE;
+
+    long interval = _engine->scaleInterval(scale);
+    long alloc = (_event_mask & EM_ALLOC) ? _alloc_engine->scaleInterval(scale) : 0;
+    long lock = (_event_mask & EM_LOCK) ? lock_tracer.scaleInterval(scale) : 0;
+    if (_event_mask & EM_NATIVEMEM) malloc_tracer.scaleInterval(scale);
+    _jfr.recordIntervals(interval, alloc, lock);
+}
+
+u64 Profiler::memoryUsage() {
+    return _call_trace_storage.usedMemory() + _call_tree.usedMemory() + _class_map.usedMemory() + _method_table.usedMemory() + _symbol_map.usedMemory() + _jfr.usedMemory();
+}
+
+// Degrades the profile step by step as the memory of the profiler approaches memlimit, instead of
+// losing all new traces once the storage cannot grow. Levels follow the usage both ways: they go down
+// after the storage is reset. At the limit, intervals double on every tick while the memory still grows
+void Profiler::controlMemory() {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return;
+    }
+
+    u64 used = memoryUsage();
+    MemoryLevel level = used >= _mem_limit ? MEMORY_SLOWDOWN
+        : used >= _mem_limit / 100 * MEMORY_MERGE_PERCENT ? MEMORY_MERGE
+        : used >= _mem_limit / 100 * MEMORY_TRUNCATE_PERCENT ? MEMORY_TRUNCATE
+        : MEMORY_OK;
+
+    if (level != _memory_level) {
+        _memory_level = level;
+        _call_trace_storage.limitDepth(level >= MEMORY_TRUNCATE ? MEMORY_TRUNCATE_DEPTH : 0);
+        _call_trace_storage.mergeColdTraces(level >= MEMORY_MERGE ? MEMORY_MERGE_DEPTH : 0);
+        Log::warn("Memory limit: %llu of %llu bytes used, %s", (unsigned long long)used,
+                  (unsigned long long)_mem_limit, MEMORY_LEVEL_ACTION[level]);
+    }
+
+    double scale = _memory_scale;
+    if (level < MEMORY_SLOWDOWN) {
+        scale = 1;
+    } else if (used > _last_memory_used && scale < MAX_INTERVAL_SCALE) {
+        scale *= 2;
+    }
+    _last_memory_used = used;
+
+    if (scale != _memory_scale) {
+        _memory_scale = scale;
+        applyIntervalScale();
+        Log::warn("Memory limit: intervals scaled by %.0f", scale);
     }
 }
 
@@ -1488,11 +2951,52 @@ Error Profiler::runInternal(Arguments& args, std::ostream& out) {
             MutexLocker ml(_state_lock);
             if (_state == RUNNING) {
                 out << "Profiling is running for " << uptime() << " seconds\n";
+                out << "Samples: " << _total_samples << ", skipped: " << _failures[-ticks_skipped]
+                    << " (" << _concurrency_level << " sample slots)\n";
+
+                if (_fold) {
+                    out << "Call tree: " << _call_tree.nodeCount() - 1 << " nodes, " << _call_tree.usedMemory()
+                        << " bytes, samples cut short of free nodes: " << _call_tree.truncated() << "\n";
+                }
+
+                CallTraceStorageStats stats;
+                _call_trace_storage.getStats(stats);
+                out << "Call traces: " << stats.size << " in " << stats.generations << " table(s) of total capacity "
+                    << stats.capacity << ", max probe length: " << stats.max_probe << "\n";
+                if (stats.trie_nodes > 0 || stats.root_segments > 0) {
+                    out << "Call trace memory: " << stats.used_bytes << " bytes, saved by frame trie and root segments: "
+                        << (long long)(stats.flat_bytes - stats.used_bytes) << " bytes\n";
+                }
+                if (_mem_limit > 0) {
+                    out << "Memory: " << memoryUsage() << " of " << _mem_limit << " bytes";
+                    if (_memory_level > MEMORY_OK) {
+                        out << ", " << MEMORY_LEVEL_ACTION[_memory_level] << " (traces truncated: "
+                            << _call_trace_storage.truncated() << ", merged: " << _call_trace_storage.merged()
+                            << ", intervals scaled by " << _memory_scale << ")";
+                    }
+                    out << "\n";
+                }
+                printOverhead(out);
             } else {
                 out << "Profiler is not active\n";
             }
             break;
         }
+        case ACTION_METRICS: {
+            MutexLocker ml(_state_lock);
+            out << "async_profiler_running " << (_state == RUNNING ? 1 : 0) << "\n";
+            out << "async_profiler_samples " << _total_samples << "\n";
+            out << "async_profiler_skipped_samples " << _failures[-ticks_skipped] << "\n";
+            for (int i = 0; i < COUNTER_COUNT; i++) {
+                CounterId id = (CounterId)i;
+                if (Counters::isTime(id)) {
+                    out << "async_profiler_" << Counters::name(id) << "_ns " << Counters::getNanos(id) << "\n";
+                } else {
+                    out << "async_profiler_" << Counters::name(id) << " " << Counters::get(id) << "\n";
+                }
+            }
+            break;
+        }
         case ACTION_LIST: {
             out << "Basic events:\n";
             out << "  " << EVENT_CPU << "\n";
@@ -1569,6 +3073,31 @@ Error Profiler::restart(Arguments& args) {
     return Error::OK;
 }
 
+// Continuous mode: writes the samples of the last interval to the next file without stopping
+// the profiler, so engines, symbols and method caches stay warm. Once the storage grows large,
+// it is reset along with the dump, which keeps memory flat however long the profiler runs
+Error Profiler::rotate(Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return Error::OK;
+    }
+
+    std::ofstream out(args.file(), std::ios::out | std::ios::trunc);
+    if (!out.is_open()) {
+        return Error("Could not open output file");
+    }
+
+    _reset_storage = !_keep_trace_ids && _call_trace_storage.storedBytes() > MAX_ROTATE_STORAGE;
+    Error error = dump(out, args);
+    _reset_storage = false;
+    free(_detached_traces);
+    _detached_traces = NULL;
+
+    out.close();
+    args._rotation++;
+    return error;
+}
+
 void Profiler::shutdown(Arguments& args) {
     MutexLocker ml(_state_lock);
 
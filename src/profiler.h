@@ -23,15 +23,21 @@
 #include "arch.h"
 #include "arguments.h"
 #include "callTraceStorage.h"
+#include "callTree.h"
 #include "codeCache.h"
 #include "dictionary.h"
 #include "engine.h"
 #include "event.h"
 #include "flightRecorder.h"
+#include "frameName.h"
+#include "latencyHistogram.h"
 #include "log.h"
+#include "methodTable.h"
 #include "mutex.h"
+#include "nmethodCache.h"
 #include "spinLock.h"
 #include "threadFilter.h"
+#include "threadNames.h"
 #include "trap.h"
 #include "vmEntry.h"
 
@@ -44,16 +50,44 @@ const int MAX_NATIVE_FRAMES = 128;
 const int RESERVED_FRAMES   = 4;
 const int MAX_NATIVE_LIBS   = 2048;
 const int CONCURRENCY_LEVEL = 16;
+const int MAX_CONCURRENCY_LEVEL = 1024;
+
+// In rotate mode, call trace storage is reset once it holds more than this
+const u64 MAX_ROTATE_STORAGE = 64 * 1024 * 1024;
+
+// Layout of the counters filled by Profiler::getStats(); mirrored by STAT_* in AsyncProfiler.java
+enum StatId {
+    STAT_RUNNING,
+    STAT_SAMPLES,
+    STAT_FAILURES,  // ASGCT_FAILURE_TYPES entries indexed by -ASGCT_Failure
+    STAT_STORAGE_OVERFLOW = STAT_FAILURES + ASGCT_FAILURE_TYPES,
+    STAT_JFR_BYTES,
+    STAT_COUNT
+};
+
 
+class FrameDescCache;
 
 union CallTraceBuffer {
     ASGCT_CallFrame _asgct_frames[1];
     jvmtiFrameInfo _jvmti_frames[1];
 };
 
+// A sample slot is normally owned by one CPU, so signal handlers rarely contend for it
+struct SampleSlot {
+    SpinLock _lock;
+    CallTraceBuffer* _buffer;
+    FrameDescCache* _dwarf_cache;
+    // To avoid false sharing
+    char _padding[64 - sizeof(SpinLock) - sizeof(CallTraceBuffer*) - sizeof(FrameDescCache*)];
+};
 
-class FrameName;
+
+class FlameGraph;
 class NMethod;
+struct DumpBatch;
+struct MethodHistogram;
+struct MethodSample;
 
 enum State {
     NEW,
@@ -62,45 +96,95 @@ enum State {
     TERMINATED
 };
 
+// Steps of degradation as the profiler approaches memlimit; every step includes the previous ones
+enum MemoryLevel {
+    MEMORY_OK,
+    MEMORY_TRUNCATE,
+    MEMORY_MERGE,
+    MEMORY_SLOWDOWN
+};
+
 class Profiler {
   private:
+    typedef int (Profiler::*NativeWalk)(void* ucontext, ASGCT_CallFrame* frames, int tid, const void** last_pc,
+                                        FrameDescCache* dwarf_cache);
+    typedef int (Profiler::*JavaWalk)(void* ucontext, ASGCT_CallFrame* frames, int depth, const void* last_pc,
+                                      FrameDescCache* dwarf_cache, bool& java_types);
+
     Mutex _state_lock;
     State _state;
     Trap _begin_trap;
     Trap _end_trap;
-    Mutex _thread_names_lock;
-    // TODO: single map?
-    std::map<int, std::string> _thread_names;
-    std::map<int, jlong> _thread_ids;
+    ThreadNames _thread_names;
     Dictionary _class_map;
     Dictionary _symbol_map;
     ThreadFilter _thread_filter;
+    ThreadFilter _window_threads;
     CallTraceStorage _call_trace_storage;
+    CallTree _call_tree;
+    FrameNameCache _frame_name_cache;
+    MethodTable _method_table;
     FlightRecorder _jfr;
     Engine* _engine;
+    Engine* _alloc_engine;
     int _event_mask;
 
     time_t _start_time;
     volatile bool _timer_is_running;
     pthread_t _timer_thread;
+    int _rotate_interval;
+    u64 _monitor_period;
+    bool _reset_storage;
+    void* _detached_traces;
 
     u64 _total_samples;
     u64 _failures[ASGCT_FAILURE_TYPES];
 
-    SpinLock _locks[CONCURRENCY_LEVEL];
-    CallTraceBuffer* _calltrace_buffer[CONCURRENCY_LEVEL];
+    double _overhead_target;
+    double _interval_scale;
+    u64 _last_sample_ticks;
+    u64 _last_overhead_check;
+
+    u64 _mem_limit;
+    MemoryLevel _memory_level;
+    double _memory_scale;
+    u64 _last_memory_used;
+
+    SampleSlot _slots[MAX_CONCURRENCY_LEVEL];
+    int _concurrency_level;
+    size_t _slot_buffer_size;
     int _max_stack_depth;
     int _safe_mode;
     CStack _cstack;
+    bool _raw_pc;
+    bool _live;
+    bool _keep_trace_ids;
+    // Histograms as of the last JFR event for each call trace
+    std::map<u64, LatencyEntry> _latency_reported;
+    bool _context_filter;
+    bool _thread_window;
+    bool _thread_cpu;
+    bool _vm_walker;
+    bool _stack_copy;
+    bool _fold;
     bool _add_thread_frame;
     bool _add_sched_frame;
+    bool _add_pause_frame;
+    bool _alloc_poll;
+    bool _kernel_only;
+    // Picked once per session, so that an execution sample does not dispatch on the settings again
+    NativeWalk _native_walk;
+    JavaWalk _java_walk;
+    bool _add_event_frame;
     bool _update_thread_names;
     volatile bool _thread_events_state;
 
     SpinLock _stubs_lock;
     CodeCache _runtime_stubs;
+    Mutex _native_libs_lock;
     CodeCache* _native_libs[MAX_NATIVE_LIBS];
     volatile int _native_lib_count;
+    CodeCacheIndex _native_lib_index;
 
     // dlopen() hook support
     const void** _dlopen_entry;
@@ -118,24 +202,36 @@ class Profiler {
 
     const char* asgctError(int code);
     u32 getLockIndex(int tid);
+    int tryLockSlot(int tid);
     bool inJavaCode(void* ucontext);
     bool isAddressInCode(const void* pc);
-    int getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_type, int tid, const void** last_pc);
+    int getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_type, int tid, const void** last_pc,
+                       FrameDescCache* dwarf_cache);
+
+    // Stack walks of execution samples, instantiated for every walker; see selectExecutionWalk()
+    template <int W>
+    int walkNativeExecution(void* ucontext, ASGCT_CallFrame* frames, int tid, const void** last_pc,
+                            FrameDescCache* dwarf_cache);
+    template <int W>
+    int walkJavaExecution(void* ucontext, ASGCT_CallFrame* frames, int depth, const void* last_pc,
+                          FrameDescCache* dwarf_cache, bool& java_types);
+    void selectExecutionWalk();
     int getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth);
+    int getJavaTraceVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth);
     int getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int start_depth, int max_depth);
     int getJavaTraceInternal(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int max_depth);
     int convertFrames(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int num_frames);
     int makeEventFrame(ASGCT_CallFrame* frames, jint event_type, uintptr_t id);
     bool fillTopFrame(const void* pc, ASGCT_CallFrame* frame, bool* is_entry_frame);
-    void fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod* nmethod);
+    void fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, const NMethodInfo& nmethod);
     void setThreadInfo(int tid, const char* name, jlong java_thread_id);
     void updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
     void updateJavaThreadNames();
     void updateNativeThreadNames();
-    bool excludeTrace(FrameName* fn, CallTrace* trace);
+    bool excludeTrace(FrameName* fn, int num_frames, ASGCT_CallFrame* frames);
     void mangle(const char* name, char* buf, size_t size);
     Engine* selectEngine(const char* event_name);
-    Engine* allocEngine();
+    Engine* selectAllocEngine(Arguments& args);
     Engine* activeEngine();
     Error checkJvmCapabilities();
 
@@ -143,37 +239,86 @@ class Profiler {
     void startTimer(int timeout);
     void stopTimer();
     void timerLoop(int timeout);
+    void controlOverhead();
+    void controlMemory();
+    void applyIntervalScale();
+    u64 memoryUsage();
     static void* timerThreadEntry(void* arg);
 
     void lockAll();
     void unlockAll();
 
+    void printOverhead(std::ostream& out);
+    void collectSamples(Arguments& args, std::vector<CallTraceSample*>& samples, std::vector<CallTraceSample>& deltas);
+    void collectLiveSamples(std::vector<CallTraceSample>& live);
+    void recordLiveObjects();
+    void recordLatencyHistograms();
+    void resolveFrames(FrameName& fn, std::vector<CallTraceSample*>& samples);
+    int dumpThreads(size_t sample_count);
+    void runDumpThreads(void* (*body)(void*), DumpBatch* batches, int count);
+    void dumpCollapsedBatch(FrameName& fn, DumpBatch* batch, std::ostream& out);
+    void filterTextBatch(FrameName& fn, DumpBatch* batch);
+    void addMethodNames(FrameName& fn, MethodHistogram& frames, std::map<std::string, MethodSample>& histogram);
+    static void* dumpCollapsedThread(void* arg);
+    static void* filterTextThread(void* arg);
     void dumpCollapsed(std::ostream& out, Arguments& args);
     void dumpFlameGraph(std::ostream& out, Arguments& args, bool tree);
+    void dumpFoldedTree(FlameGraph& flamegraph, FrameName& fn, Counter counter);
     void dumpText(std::ostream& out, Arguments& args);
+    void dumpLockStats(std::ostream& out, FrameName& fn, Arguments& args);
+    void dumpLatency(std::ostream& out, FrameName& fn, Arguments& args);
+    void dumpHitCounts(std::ostream& out, Arguments& args);
+    void dumpThreadCpu(std::ostream& out, Arguments& args);
+    void dumpBinary(std::ostream& out, Arguments& args);
+    void dumpPprof(std::ostream& out, Arguments& args);
 
     static Profiler* const _instance;
 
   public:
     Profiler() :
         _state(NEW),
-        _begin_trap(2),
-        _end_trap(3),
+        _begin_trap(2, trapHandler),
+        _end_trap(3, trapHandler),
         _thread_filter(),
+        _window_threads(),
         _call_trace_storage(),
+        _method_table(&_class_map),
         _jfr(),
+        _alloc_engine(NULL),
         _start_time(0),
         _timer_is_running(false),
+        _rotate_interval(0),
+        _monitor_period(0),
+        _reset_storage(false),
+        _detached_traces(NULL),
+        _overhead_target(0),
+        _interval_scale(1),
+        _mem_limit(0),
+        _memory_level(MEMORY_OK),
+        _memory_scale(1),
+        _last_memory_used(0),
+        _concurrency_level(0),
+        _slot_buffer_size(0),
         _max_stack_depth(0),
         _safe_mode(0),
+        _raw_pc(false),
+        _live(false),
+        _keep_trace_ids(false),
+        _context_filter(false),
+        _thread_window(false),
+        _thread_cpu(false),
+        _vm_walker(false),
+        _stack_copy(false),
+        _fold(false),
         _thread_events_state(JVMTI_DISABLE),
         _stubs_lock(),
         _runtime_stubs("[stubs]"),
         _native_lib_count(0),
         _dlopen_entry(NULL) {
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            _calltrace_buffer[i] = NULL;
+        for (int i = 0; i < MAX_CONCURRENCY_LEVEL; i++) {
+            _slots[i]._buffer = NULL;
+            _slots[i]._dwarf_cache = NULL;
         }
     }
 
@@ -182,35 +327,70 @@ class Profiler {
     }
 
     u64 total_samples() { return _total_samples; }
+    void getStats(u64* values);
+    int concurrencyLevel() { return _concurrency_level; }
     time_t uptime()     { return time(NULL) - _start_time; }
 
     Dictionary* classMap() { return &_class_map; }
     ThreadFilter* threadFilter() { return &_thread_filter; }
+    ThreadFilter* windowThreads() { return _thread_window ? &_window_threads : NULL; }
 
     Error run(Arguments& args);
     Error runInternal(Arguments& args, std::ostream& out);
     Error restart(Arguments& args);
+    Error rotate(Arguments& args);
     void shutdown(Arguments& args);
     Error check(Arguments& args);
     Error start(Arguments& args, bool reset);
     Error stop();
     Error flushJfr();
+    void flushpointJfr();
     Error dump(std::ostream& out, Arguments& args);
     void switchThreadEvents(jvmtiEventMode mode);
     int convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames);
-    void recordSample(void* ucontext, u64 counter, jint event_type, Event* event);
-    void recordExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames);
+    u32 recordSample(void* ucontext, u64 counter, jint event_type, Event* event);
+    u32 recordKernelSample(int lock_index, void* ucontext, u64 counter, int tid, Event* event);
+    u32 storeSample(int lock_index, int tid, ASGCT_CallFrame* frames, int num_frames, u64 counter,
+                    jint event_type, Event* event, bool count, u64 start_ticks);
+    void recordExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames, u32 event_index = 0, u64 time = 0,
+                              int cpu = -1);
+    void recordExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames, int event_type, Event* event);
+    void recordDeferredSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames, int event_type, Event* event);
+    void recordPause(GCPauseEvent* event);
+    void recordSkippedSample() {
+        atomicInc(_total_samples);
+        atomicInc(_failures[-ticks_skipped]);
+    }
     void writeLog(LogLevel level, const char* message);
     void writeLog(LogLevel level, const char* message, size_t len);
+    void writeLog(LogRecord** records, int count);
 
     void updateSymbols(bool kernel_symbols);
+    void preload();
     const void* resolveSymbol(const char* name);
     const char* getLibraryName(const char* native_symbol);
     CodeCache* findJvmLibrary(const char* lib_name);
     CodeCache* findNativeLibrary(const void* address);
     const char* findNativeMethod(const void* address);
+    const char* resolveNativeMethod(const void* address);
 
-    void trapHandler(int signo, siginfo_t* siginfo, void* ucontext);
+    FrameNameCache* frameNameCache() {
+        return &_frame_name_cache;
+    }
+
+    MethodTable* methodTable() {
+        return &_method_table;
+    }
+
+    u32 nativeLibGeneration() {
+        return _native_lib_index.generation();
+    }
+
+    bool rawPC() {
+        return _raw_pc;
+    }
+
+    static void trapHandler(Trap* trap, void* ucontext);
     static void segvHandler(int signo, siginfo_t* siginfo, void* ucontext);
     static void setupSignalHandlers();
 
@@ -222,6 +402,10 @@ class Profiler {
         instance()->addJavaMethod(code_addr, code_size, method);
     }
 
+    static void JNICALL CompiledMethodUnload(jvmtiEnv* jvmti, jmethodID method, const void* code_addr) {
+        NMethodCache::invalidate(code_addr);
+    }
+
     static void JNICALL DynamicCodeGenerated(jvmtiEnv* jvmti, const char* name,
                                              const void* address, jint length) {
         instance()->addRuntimeStub(address, length, name);
@@ -235,6 +419,8 @@ class Profiler {
         instance()->onThreadEnd(jvmti, jni, thread);
     }
 
+    friend class MallocTracer;
+    friend class StackCopier;
     friend class Recording;
 };
 
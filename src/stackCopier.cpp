@@ -0,0 +1,219 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stackCopier.h"
+#include "dwarf.h"
+#include "nmethodCache.h"
+#include "os.h"
+#include "profiler.h"
+#include "stackFrame.h"
+#include "stackWalker.h"
+#include "tsc.h"
+
+
+pthread_t StackCopier::_thread = 0;
+volatile bool StackCopier::_running = false;
+sem_t StackCopier::_pending;
+char* StackCopier::_queue = NULL;
+size_t StackCopier::_slot_size = 0;
+int StackCopier::_max_frames = 0;
+size_t StackCopier::_copy_size = 0;
+bool StackCopier::_trust_fp = false;
+volatile u64 StackCopier::_enqueue_pos = 0;
+u64 StackCopier::_dequeue_pos = 0;
+
+
+Error StackCopier::start(Arguments& args) {
+    // process_vm_readv may be denied by seccomp or a security module; then every copy would be empty,
+    // and native frames would disappear from the profile without a trace
+    u64 probe = 0x5354434b;
+    u64 probe_copy = 0;
+    if (OS::readMemory(&probe_copy, &probe, sizeof(probe)) != sizeof(probe) || probe_copy != probe) {
+        Log::warn("Cannot copy the stack: %s", strerror(errno));
+        return Error("stackcopy is not available: reading own memory with process_vm_readv is not permitted");
+    }
+
+    // Kernel frames and Java frames are collected in the signal handler
+    int max_frames = MAX_NATIVE_FRAMES + args._jstackdepth;
+    size_t copy_size = (size_t)args._stack_copy;
+    size_t slot_size = (sizeof(StackCopy) + max_frames * sizeof(ASGCT_CallFrame) + copy_size + 63) & ~(size_t)63;
+
+    if (_queue == NULL || slot_size != _slot_size) {
+        if (_queue != NULL) {
+            OS::safeFree(_queue, _slot_size * STACK_COPY_QUEUE_SIZE);
+        }
+        // Pages of the queue are committed as the slots get used
+        _queue = (char*)OS::safeAlloc(slot_size * STACK_COPY_QUEUE_SIZE);
+        if (_queue == NULL) {
+            _slot_size = 0;
+            return Error("Failed to allocate stack copy queue");
+        }
+        _slot_size = slot_size;
+    }
+    _max_frames = max_frames;
+    _copy_size = copy_size;
+    // Unwinding follows the cstack mode, except that the DWARF table is always consulted for the top frame
+    _trust_fp = args._cstack != CSTACK_DWARF;
+
+    for (int i = 0; i < STACK_COPY_QUEUE_SIZE; i++) {
+        slotAt(i)->seq = i;
+    }
+    _enqueue_pos = 0;
+    _dequeue_pos = 0;
+
+    if (sem_init(&_pending, 0, 0) != 0) {
+        return Error("Failed to create semaphore");
+    }
+
+    _running = true;
+    if (pthread_create(&_thread, NULL, threadEntry, NULL) != 0) {
+        _running = false;
+        _thread = 0;
+        sem_destroy(&_pending);
+        return Error("Unable to create unwinder thread");
+    }
+
+    return Error::OK;
+}
+
+// Copies that are still in the queue are unwound before the thread exits
+void StackCopier::stop() {
+    if (_thread != 0) {
+        __atomic_store_n(&_running, false, __ATOMIC_RELEASE);
+        sem_post(&_pending);
+        pthread_join(_thread, NULL);
+        sem_destroy(&_pending);
+        _thread = 0;
+    }
+}
+
+// Called from signal handlers. Only registers and the top of the stack are copied here;
+// returns false if the queue is full or the unwinder thread is not running
+bool StackCopier::enqueue(void* ucontext, u64 counter, int tid, ExecutionEvent* event,
+                          int kernel_frames, int num_frames, ASGCT_CallFrame* frames, bool java_types) {
+    if (ucontext == NULL || !__atomic_load_n(&_running, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    u64 pos = __atomic_load_n(&_enqueue_pos, __ATOMIC_RELAXED);
+    StackCopy* copy;
+    while (true) {
+        copy = slotAt(pos);
+        u64 seq = __atomic_load_n(&copy->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&_enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((long long)(seq - pos) < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    StackFrame frame(ucontext);
+    copy->counter = counter;
+    copy->event = *event;
+    if (copy->event._time == 0) {
+        copy->event._time = TSC::ticks();
+    }
+    copy->tid = tid;
+    copy->kernel_frames = kernel_frames;
+    copy->num_frames = num_frames;
+    copy->java_types = java_types;
+    copy->pc = frame.pc();
+    copy->sp = frame.sp();
+    copy->fp = frame.fp();
+    memcpy(copy->frames(), frames, num_frames * sizeof(ASGCT_CallFrame));
+    copy->stack_size = OS::readMemory((void*)stackOf(copy), (const void*)copy->sp, _copy_size);
+
+    __atomic_store_n(&copy->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // sem_post is async signal safe, and it enters the kernel only when the unwinder thread is waiting
+    sem_post(&_pending);
+    return true;
+}
+
+void StackCopier::unwindLoop() {
+    FrameDescCache* cache = new FrameDescCache();
+    const void** callchain = (const void**)malloc(MAX_NATIVE_FRAMES * sizeof(const void*));
+    ASGCT_CallFrame* frames = (ASGCT_CallFrame*)malloc((_max_frames + MAX_NATIVE_FRAMES + RESERVED_FRAMES) * sizeof(ASGCT_CallFrame));
+
+    while (true) {
+        // One post per copy: consume all of them before draining the queue,
+        // so that a copy published after the drain wakes us up again
+        while (sem_wait(&_pending) != 0 && errno == EINTR);
+        while (sem_trywait(&_pending) == 0);
+
+        bool running = __atomic_load_n(&_running, __ATOMIC_ACQUIRE);
+
+        while (true) {
+            u64 pos = _dequeue_pos;
+            StackCopy* copy = slotAt(pos);
+            if (__atomic_load_n(&copy->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+                break;
+            }
+
+            unwind(copy, cache, callchain, frames);
+
+            _dequeue_pos = pos + 1;
+            __atomic_store_n(&copy->seq, pos + STACK_COPY_QUEUE_SIZE, __ATOMIC_RELEASE);
+        }
+
+        if (!running) {
+            break;
+        }
+    }
+
+    free(frames);
+    free(callchain);
+    delete cache;
+}
+
+void StackCopier::unwind(StackCopy* copy, FrameDescCache* cache, const void** callchain, ASGCT_CallFrame* frames) {
+    Profiler* profiler = Profiler::instance();
+    ASGCT_CallFrame* collected = copy->frames();
+
+    // Kernel frames, then native frames unwound from the copy, then Java frames
+    int num_frames = copy->kernel_frames;
+    memcpy(frames, collected, num_frames * sizeof(ASGCT_CallFrame));
+
+    const void* last_pc = NULL;
+    int native_frames = StackWalker::walkCopy((const void*)copy->pc, copy->sp, copy->fp, stackOf(copy), copy->stack_size,
+                                              callchain, MAX_NATIVE_FRAMES, &last_pc, cache, _trust_fp);
+    num_frames += profiler->convertNativeTrace(native_frames, callchain, frames + num_frames);
+
+    int java_frames = copy->num_frames - copy->kernel_frames;
+    memcpy(frames + num_frames, collected + copy->kernel_frames, java_frames * sizeof(ASGCT_CallFrame));
+    if (copy->java_types && java_frames > 0 && last_pc != NULL) {
+        NMethodInfo nmethod;
+        if (NMethodCache::lookup(last_pc, nmethod)) {
+            profiler->fillFrameTypes(frames + num_frames, java_frames, nmethod);
+        }
+    }
+    num_frames += java_frames;
+
+    if (num_frames == 0) {
+        frames[0].bci = BCI_ERROR;
+        frames[0].method_id = (jmethodID)"no_Java_frame";
+        num_frames = 1;
+    }
+
+    profiler->recordDeferredSample(copy->counter, copy->tid, num_frames, frames, 0, &copy->event);
+}
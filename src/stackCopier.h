@@ -0,0 +1,91 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STACKCOPIER_H
+#define _STACKCOPIER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include "arch.h"
+#include "arguments.h"
+#include "event.h"
+#include "vmEntry.h"
+
+
+const int STACK_COPY_QUEUE_SIZE = 64;   // must be a power of 2
+const int MAX_STACK_COPY = 64 * 1024;
+
+class FrameDescCache;
+
+// A sample whose native frames are unwound outside of the signal handler.
+// The header is followed by the frames collected in the handler, and then by the copy of the stack
+struct StackCopy {
+    volatile u64 seq;  // publishing protocol as in J9QueueSlot
+    u64 counter;
+    ExecutionEvent event;
+    int tid;
+    int kernel_frames;  // kernel frames come first, the rest are Java frames
+    int num_frames;
+    bool java_types;    // Java frames came from AsyncGetCallTrace and do not have frame types yet
+    uintptr_t pc;
+    uintptr_t sp;
+    uintptr_t fp;
+    size_t stack_size;
+
+    ASGCT_CallFrame* frames() {
+        return (ASGCT_CallFrame*)(this + 1);
+    }
+};
+
+
+class StackCopier {
+  private:
+    static pthread_t _thread;
+    static volatile bool _running;
+    static sem_t _pending;
+    static char* _queue;
+    static size_t _slot_size;
+    static int _max_frames;
+    static size_t _copy_size;
+    static bool _trust_fp;
+    static volatile u64 _enqueue_pos;
+    static u64 _dequeue_pos;
+
+    static StackCopy* slotAt(u64 pos) {
+        return (StackCopy*)(_queue + (pos & (STACK_COPY_QUEUE_SIZE - 1)) * _slot_size);
+    }
+
+    static const char* stackOf(StackCopy* copy) {
+        return (const char*)(copy->frames() + _max_frames);
+    }
+
+    static void* threadEntry(void* unused) {
+        unwindLoop();
+        return NULL;
+    }
+
+    static void unwindLoop();
+    static void unwind(StackCopy* copy, FrameDescCache* cache, const void** callchain, ASGCT_CallFrame* frames);
+
+  public:
+    static Error start(Arguments& args);
+    static void stop();
+
+    static bool enqueue(void* ucontext, u64 counter, int tid, ExecutionEvent* event,
+                        int kernel_frames, int num_frames, ASGCT_CallFrame* frames, bool java_types);
+};
+
+#endif // _STACKCOPIER_H
@@ -67,6 +67,20 @@ class StackFrame {
 
     bool checkInterruptedSyscall();
 
+    // Executes the instruction at PC, which is replaced by a breakpoint, on behalf of the thread,
+    // so that the breakpoint can stay in place. insn is the original instruction.
+    // Only a few simple instructions that commonly start a function are supported
+    bool emulate(instruction_t insn);
+
+    // Check if emulate() supports the (not yet patched) instruction at PC
+    static bool canEmulate(instruction_t* pc);
+
+    // Unwinds the top frame of JIT-compiled code interrupted in the prologue or the epilogue,
+    // where the frame described by CodeBlob::_frame_size is not set up yet or is already torn down.
+    // pc, sp and fp are those of the signal context; returns false if PC is in the frame body
+    bool unwindCompiled(const instruction_t* entry, const instruction_t* frame_complete,
+                        uintptr_t& pc, uintptr_t& sp, uintptr_t& fp);
+
     // Look that many stack slots for a return address candidate.
     // 0 = do not use stack snooping heuristics.
     static int callerLookupSlots();
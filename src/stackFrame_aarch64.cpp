@@ -106,6 +106,103 @@ bool StackFrame::checkInterruptedSyscall() {
 #endif
 }
 
+// nop, bti, sub sp, sp, #imm and mov x29, sp. Stores below SP (stp x29, x30, [sp, #-16]!)
+// are not emulated: without a red zone, the kernel puts the signal frame right there
+static bool isSimpleInstruction(instruction_t insn) {
+    return insn == 0xd503201f || (insn & 0xffffff3f) == 0xd503241f ||
+           (insn & 0xff8003ff) == 0xd10003ff || insn == 0x910003fd;
+}
+
+bool StackFrame::emulate(instruction_t insn) {
+    if (!isSimpleInstruction(insn)) {
+        return false;
+    }
+
+    if ((insn & 0xff8003ff) == 0xd10003ff) {
+        uintptr_t imm = (insn >> 10) & 0xfff;
+        sp() -= (insn & (1 << 22)) ? imm << 12 : imm;
+    } else if (insn == 0x910003fd) {
+        fp() = sp();
+    }
+
+    pc() += sizeof(instruction_t);
+    return true;
+}
+
+bool StackFrame::canEmulate(instruction_t* pc) {
+    return isSimpleInstruction(*pc);
+}
+
+static inline bool isSubSP(instruction_t insn) {
+    // sub sp, sp, #imm
+    return (insn & 0xff8003ff) == 0xd10003ff;
+}
+
+static inline bool isPushFrame(instruction_t insn) {
+    // stp x29, x30, [sp, #-16]!
+    return insn == 0xa9bf7bfd;
+}
+
+// HotSpot frames start with either sub sp, sp, #N; stp x29, x30, [sp, #N-16]
+// or stp x29, x30, [sp, #-16]!; sub sp, sp, #N-16.
+// They end with ldp x29, x30, [sp, #N-16]; add sp, sp, #N or the reverse, then ret
+bool StackFrame::unwindCompiled(const instruction_t* entry, const instruction_t* frame_complete,
+                                uintptr_t& pc, uintptr_t& sp, uintptr_t& fp) {
+    const instruction_t* ip = (const instruction_t*)pc;
+    uintptr_t* stack = (uintptr_t*)sp;
+    uintptr_t link = (uintptr_t)stripPointer((const void*)REG(regs[30], lr));
+
+    if (ip < frame_complete) {
+        const instruction_t* adjust = NULL;
+        for (const instruction_t* p = entry; p < ip; p++) {
+            if (isSubSP(*p) || isPushFrame(*p)) {
+                adjust = p;
+                break;
+            }
+        }
+
+        if (adjust == NULL) {
+            // Nothing is allocated yet
+            pc = link;
+            return true;
+        } else if (isSubSP(*adjust) && (*ip & 0xffc07fff) == 0xa9007bfd) {
+            // stp x29, x30, [sp, #offset] is about to store the frame record
+            sp += ((*ip >> 15) & 0x7f) * 8 + 16;
+            pc = link;
+            return true;
+        } else if (isPushFrame(*adjust)) {
+            bool allocated = false;
+            for (const instruction_t* p = adjust + 1; p < ip; p++) {
+                allocated |= isSubSP(*p);
+            }
+            if (!allocated) {
+                // Only the frame record is pushed
+                fp = stack[0];
+                pc = (uintptr_t)stripPointer((const void*)stack[1]);
+                sp += 16;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (*ip == 0xd65f03c0) {
+        // ret
+        pc = link;
+        return true;
+    } else if (ip[-1] == 0xa8c17bfd) {
+        // after ldp x29, x30, [sp], #16
+        pc = link;
+        return true;
+    } else if ((ip[-1] & 0xffc07fff) == 0xa9407bfd && (*ip & 0xff8003ff) == 0x910003ff) {
+        // ldp x29, x30, [sp, #offset] is done, add sp, sp, #N is next
+        sp += (*ip >> 10) & 0xfff;
+        pc = link;
+        return true;
+    }
+    return false;
+}
+
 int StackFrame::callerLookupSlots() {
     return 0;
 }
@@ -120,6 +120,19 @@ bool StackFrame::checkInterruptedSyscall() {
     return retval() == (uintptr_t)-EINTR;
 }
 
+bool StackFrame::emulate(instruction_t insn) {
+    return false;
+}
+
+bool StackFrame::canEmulate(instruction_t* pc) {
+    return false;
+}
+
+bool StackFrame::unwindCompiled(const instruction_t* entry, const instruction_t* frame_complete,
+                                uintptr_t& pc, uintptr_t& sp, uintptr_t& fp) {
+    return false;
+}
+
 int StackFrame::callerLookupSlots() {
     return 0;
 }
@@ -17,6 +17,7 @@
 #ifdef __x86_64__
 
 #include <errno.h>
+#include <stddef.h>
 #include <sys/syscall.h>
 #include "stackFrame.h"
 
@@ -134,6 +135,135 @@ bool StackFrame::checkInterruptedSyscall() {
 #endif
 }
 
+// Returns the length of nop, endbr64, or push of a general purpose register; 0 for other instructions.
+// Bytes after the first one are read from the code, since the breakpoint overwrites only one byte
+static int simpleInstruction(instruction_t* pc, instruction_t insn, int* pushed_reg) {
+    *pushed_reg = -1;
+    if (insn == 0x90) {
+        return 1;
+    } else if (insn == 0xf3 && pc[1] == 0x0f && pc[2] == 0x1e && pc[3] == 0xfa) {
+        return 4;
+    } else if (insn >= 0x50 && insn <= 0x57) {
+        *pushed_reg = insn - 0x50;
+        return 1;
+    } else if (insn == 0x41 && pc[1] >= 0x50 && pc[1] <= 0x57) {
+        *pushed_reg = pc[1] - 0x50 + 8;
+        return 2;
+    }
+    return 0;
+}
+
+bool StackFrame::emulate(instruction_t insn) {
+    int reg;
+    int length = simpleInstruction((instruction_t*)pc(), insn, &reg);
+    if (length == 0) {
+        return false;
+    }
+
+    if (reg >= 0) {
+        uintptr_t value;
+        switch (reg) {
+            case 0:  value = REG(RAX, rax); break;
+            case 1:  value = REG(RCX, rcx); break;
+            case 2:  value = REG(RDX, rdx); break;
+            case 3:  value = REG(RBX, rbx); break;
+            case 4:  value = REG(RSP, rsp); break;
+            case 5:  value = REG(RBP, rbp); break;
+            case 6:  value = REG(RSI, rsi); break;
+            case 7:  value = REG(RDI, rdi); break;
+            case 8:  value = REG(R8,  r8);  break;
+            case 9:  value = REG(R9,  r9);  break;
+            case 10: value = REG(R10, r10); break;
+            case 11: value = REG(R11, r11); break;
+            case 12: value = REG(R12, r12); break;
+            case 13: value = REG(R13, r13); break;
+            case 14: value = REG(R14, r14); break;
+            default: value = REG(R15, r15); break;
+        }
+        // The red zone keeps the signal frame away from the slot below SP
+        sp() -= 8;
+        *(uintptr_t*)sp() = value;
+    }
+
+    pc() += length;
+    return true;
+}
+
+bool StackFrame::canEmulate(instruction_t* pc) {
+    int reg;
+    return simpleInstruction(pc, *pc, &reg) > 0;
+}
+
+// The safepoint poll of a method return, from the given instruction up to ret:
+//   test [rip + polling_page], eax                          (JDK 8)
+//   mov r10, [r15 + polling_page]; test [r10], eax          (JDK 10+)
+//   cmp rsp, [r15 + poll_word]; ja stub                     (JDK 16+)
+// Loop back-edge polls look the same but are never followed by ret
+static bool isReturnPoll(const instruction_t* ip) {
+    if (ip[0] == 0x85 && ip[1] == 0x05) {
+        return ip[6] == 0xc3;
+    } else if (ip[0] == 0x4d && ip[1] == 0x8b && ip[2] == 0x97) {
+        return ip[7] == 0x41 && ip[8] == 0x85 && ip[9] == 0x02 && ip[10] == 0xc3;
+    } else if (ip[0] == 0x41 && ip[1] == 0x85 && ip[2] == 0x02) {
+        return ip[3] == 0xc3;
+    } else if (ip[0] == 0x49 && ip[1] == 0x3b && ip[2] == 0xa7) {
+        return ip[7] == 0x0f && ip[8] == 0x87 && ip[13] == 0xc3;
+    } else if (ip[0] == 0x0f && ip[1] == 0x87) {
+        return ip[6] == 0xc3 && ip[-7] == 0x49 && ip[-6] == 0x3b && ip[-5] == 0xa7;
+    }
+    return false;
+}
+
+// HotSpot frames start with [stack bang,] push rbp, [mov rbp, rsp,] sub rsp, N
+// and end with add rsp, N, pop rbp, [safepoint poll,] ret
+bool StackFrame::unwindCompiled(const instruction_t* entry, const instruction_t* frame_complete,
+                                uintptr_t& pc, uintptr_t& sp, uintptr_t& fp) {
+    const instruction_t* ip = (const instruction_t*)pc;
+    uintptr_t* stack = (uintptr_t*)sp;
+
+    if (ip < frame_complete) {
+        const instruction_t* push = NULL;
+        for (const instruction_t* p = entry; p < frame_complete; p++) {
+            if (p[0] == 0x55 && p[1] == 0x48) {
+                push = p;
+                break;
+            }
+        }
+
+        if (push == NULL || ip <= push) {
+            // Nothing is pushed yet
+            pc = stack[0];
+            sp += 8;
+            return true;
+        } else if (ip == push + 1 || (ip == push + 4 && ((push[2] == 0x89 && push[3] == 0xe5) ||
+                                                        (push[2] == 0x8b && push[3] == 0xec)))) {
+            // Only RBP is pushed
+            fp = stack[0];
+            pc = stack[1];
+            sp += 16;
+            return true;
+        }
+        // SP is adjusted, the rest of the prologue does not touch the stack
+        return false;
+    }
+
+    if (ip[0] == 0x5d) {
+        // pop rbp
+        fp = stack[0];
+        pc = stack[1];
+        sp += 16;
+        return true;
+    } else if (ip[0] == 0xc3 || isReturnPoll(ip)) {
+        // ret, or the safepoint poll between pop rbp and ret. A byte 0x5d before ip may be
+        // a displacement or an immediate, and a poll may be a loop back-edge, so only the whole
+        // sequence up to ret counts
+        pc = stack[0];
+        sp += 8;
+        return true;
+    }
+    return false;
+}
+
 int StackFrame::callerLookupSlots() {
     return 7;
 }
@@ -16,6 +16,7 @@
 
 #include "stackWalker.h"
 #include "dwarf.h"
+#include "nmethodCache.h"
 #include "profiler.h"
 #include "safeAccess.h"
 #include "stackFrame.h"
@@ -75,11 +76,102 @@ int StackWalker::walkFP(void* ucontext, const void** callchain, int max_depth, c
     return depth;
 }
 
-int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth, const void** last_pc) {
+int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth, const void** last_pc,
+                           FrameDescCache* cache) {
+    return walkDwarfImpl(ucontext, callchain, max_depth, last_pc, cache, false);
+}
+
+// Like walkDwarf, but frames of libraries compiled with frame pointers are unwound
+// by the frame pointer rule without looking up the DWARF table. The top frame is still
+// looked up, since the signal may come in the middle of a prologue
+int StackWalker::walkAuto(void* ucontext, const void** callchain, int max_depth, const void** last_pc,
+                          FrameDescCache* cache) {
+    return walkDwarfImpl(ucontext, callchain, max_depth, last_pc, cache, true);
+}
+
+// Finds the unwind rule for PC. Consecutive frames often belong to the same library, so the last one is kept in cc
+static inline FrameDesc* findFrameDesc(Profiler* profiler, const void* pc, CodeCache*& cc, FrameDescCache* cache,
+                                       bool use_fp) {
+    FrameDesc* f = cache != NULL ? cache->lookup(pc) : NULL;
+    if (f == NULL) {
+        if (cc == NULL || !cc->contains(pc)) {
+            cc = profiler->findNativeLibrary(pc);
+        }
+        if (cc == NULL || (use_fp && cc->hasFramePointers()) || (f = cc->findFrameDesc(pc)) == NULL) {
+            f = &FrameDesc::default_frame;
+        }
+        if (cache != NULL) {
+            cache->put(pc, f);
+        }
+    }
+    return f;
+}
+
+// Reads stack slots of the current thread
+struct LiveStack {
+    uintptr_t load(uintptr_t addr) const {
+        return (uintptr_t)SafeAccess::load((void**)addr);
+    }
+};
+
+// Reads stack slots from a copy of the top of the stack made at the time of the sample;
+// anything beyond the copy reads as 0, which stops the walk
+struct CopiedStack {
+    uintptr_t base;
+    const char* data;
+    size_t size;
+
+    uintptr_t load(uintptr_t addr) const {
+        uintptr_t offset = addr - base;
+        return offset < size && size - offset >= sizeof(uintptr_t) ? *(uintptr_t*)(data + offset) : 0;
+    }
+};
+
+// Applies the unwind rule of the current native frame. Returns false if the caller frame looks invalid
+template <class Stack>
+static inline bool unwindNative(FrameDesc* f, const void*& pc, uintptr_t& sp, uintptr_t& fp, uintptr_t bottom,
+                                const Stack& stack) {
+    uintptr_t prev_sp = sp;
+
+    u8 cfa_reg = (u8)f->cfa;
+    int cfa_off = f->cfa >> 8;
+    if (cfa_reg == DW_REG_SP) {
+        sp = sp + cfa_off;
+    } else if (cfa_reg == DW_REG_FP) {
+        sp = fp + cfa_off;
+    } else if (cfa_reg == DW_REG_PLT) {
+        sp += ((uintptr_t)pc & 15) >= 11 ? cfa_off * 2 : cfa_off;
+    } else {
+        return false;
+    }
+
+    // Check if the next frame is below on the current stack
+    if (sp < prev_sp || sp >= prev_sp + MAX_FRAME_SIZE || sp >= bottom) {
+        return false;
+    }
+
+    // Stack pointer must be word aligned
+    if ((sp & (sizeof(uintptr_t) - 1)) != 0) {
+        return false;
+    }
+
+    if (f->fp_off & DW_PC_OFFSET) {
+        pc = (const char*)pc + (f->fp_off >> 1);
+    } else {
+        if (f->fp_off != DW_SAME_FP && f->fp_off < MAX_FRAME_SIZE && f->fp_off > -MAX_FRAME_SIZE) {
+            fp = stack.load(sp + f->fp_off);
+        }
+        pc = stripPointer((const void*)stack.load(sp - sizeof(uintptr_t)));
+    }
+
+    return pc >= (const void*)MIN_VALID_PC && pc <= (const void*)-MIN_VALID_PC;
+}
+
+int StackWalker::walkDwarfImpl(void* ucontext, const void** callchain, int max_depth, const void** last_pc,
+                               FrameDescCache* cache, bool trust_fp) {
     const void* pc;
     uintptr_t fp;
     uintptr_t sp;
-    uintptr_t prev_sp;
     uintptr_t bottom = (uintptr_t)&sp + MAX_WALK_SIZE;
 
     if (ucontext == NULL) {
@@ -95,6 +187,10 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
 
     int depth = 0;
     Profiler* profiler = Profiler::instance();
+    CodeCache* cc = NULL;
+    if (cache != NULL) {
+        cache->validate(profiler->nativeLibGeneration());
+    }
 
     // Walk until the bottom of the stack or until the first Java frame
     while (depth < max_depth) {
@@ -104,49 +200,348 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
          }
 
         callchain[depth++] = pc;
-        prev_sp = sp;
 
-        FrameDesc* f;
-        CodeCache* cc = profiler->findNativeLibrary(pc);
-        if (cc == NULL || (f = cc->findFrameDesc(pc)) == NULL) {
-            f = &FrameDesc::default_frame;
+        FrameDesc* f = findFrameDesc(profiler, pc, cc, cache, trust_fp && depth > 1);
+        if (!unwindNative(f, pc, sp, fp, bottom, LiveStack())) {
+            break;
         }
+    }
 
-        u8 cfa_reg = (u8)f->cfa;
-        int cfa_off = f->cfa >> 8;
-        if (cfa_reg == DW_REG_SP) {
-            sp = sp + cfa_off;
-        } else if (cfa_reg == DW_REG_FP) {
-            sp = fp + cfa_off;
-        } else if (cfa_reg == DW_REG_PLT) {
-            sp += ((uintptr_t)pc & 15) >= 11 ? cfa_off * 2 : cfa_off;
-        } else {
+    return depth;
+}
+
+// Same as walkDwarfImpl, but on a copy of the top of the stack starting at sp, possibly in another thread
+int StackWalker::walkCopy(const void* pc, uintptr_t sp, uintptr_t fp, const char* stack, size_t stack_size,
+                          const void** callchain, int max_depth, const void** last_pc, FrameDescCache* cache,
+                          bool trust_fp) {
+    CopiedStack copy = {sp, stack, stack_size};
+    uintptr_t bottom = sp + stack_size;
+
+    int depth = 0;
+    Profiler* profiler = Profiler::instance();
+    CodeCache* cc = NULL;
+    if (cache != NULL) {
+        cache->validate(profiler->nativeLibGeneration());
+    }
+
+    while (depth < max_depth) {
+        if (CodeHeap::contains(pc)) {
+            *last_pc = pc;
             break;
         }
 
-        // Check if the next frame is below on the current stack
-        if (sp < prev_sp || sp >= prev_sp + MAX_FRAME_SIZE || sp >= bottom) {
+        callchain[depth++] = pc;
+
+        FrameDesc* f = findFrameDesc(profiler, pc, cc, cache, trust_fp && depth > 1);
+        if (!unwindNative(f, pc, sp, fp, bottom, copy)) {
             break;
         }
+    }
+
+    return depth;
+}
+
+static inline int fillFrame(ASGCT_CallFrame* frame, int type, int bci, jmethodID method_id) {
+    frame->bci = FrameType::encode(type, bci);
+    frame->method_id = method_id;
+    return 1;
+}
 
-        // Stack pointer must be word aligned
-        if ((sp & (sizeof(uintptr_t) - 1)) != 0) {
+static inline int fillError(ASGCT_CallFrame* frame, const char* error) {
+    frame->bci = BCI_ERROR;
+    frame->method_id = (jmethodID)error;
+    return 1;
+}
+
+static inline uintptr_t loadSlot(uintptr_t addr, int slot) {
+    return (uintptr_t)SafeAccess::load((void**)addr + slot);
+}
+
+static inline int fillNativeFrame(ASGCT_CallFrame* frame, const void* pc, CodeCache* cc, bool raw_pc) {
+    if (cc != NULL && (!cc->symbolsLoaded() || raw_pc)) {
+        // Resolved at dump time, like in Profiler::convertNativeTrace
+        frame->bci = BCI_ADDRESS;
+        frame->method_id = (jmethodID)pc;
+    } else {
+        frame->bci = BCI_NATIVE_FRAME;
+        frame->method_id = (jmethodID)(cc != NULL ? cc->binarySearch(pc) : NULL);
+    }
+    return 1;
+}
+
+// Moves to the last Java frame recorded by the VM when the thread left Java code
+static inline bool jumpToAnchor(JavaFrameAnchor* anchor, const void*& pc, uintptr_t& sp, uintptr_t& fp) {
+    uintptr_t anchor_sp = anchor->lastJavaSP();
+    if (anchor_sp == 0) {
+        return false;
+    }
+    sp = anchor_sp;
+    fp = anchor->lastJavaFP();
+    pc = (const void*)anchor->lastJavaPC();
+    if (pc == NULL) {
+        pc = stripPointer((const void*)loadSlot(sp, -1));
+    }
+    return true;
+}
+
+// Walks Java frames using the layout of interpreted and compiled frames known from VMStructs,
+// without AsyncGetCallTrace. Unlike ASGCT, frame types and inlined methods come out of the same pass.
+// Returns the number of frames, 0 if the thread has no Java frames, or -1 if the top Java frame
+// cannot be decoded, in which case the caller may try AsyncGetCallTrace with its recovery heuristics
+int StackWalker::walkJava(void* ucontext, ASGCT_CallFrame* frames, int max_depth) {
+    return walkVM(ucontext, frames, max_depth, NULL, false);
+}
+
+// Walks native and Java frames together in one pass from the top of the stack down:
+// native frames are unwound as in walkAuto, Java frames are decoded as in walkJava,
+// so native code called from Java and Java code called back from native code
+// come out in their actual order. Always returns the number of frames
+int StackWalker::walkMixed(void* ucontext, ASGCT_CallFrame* frames, int max_depth, FrameDescCache* cache) {
+    return walkVM(ucontext, frames, max_depth, cache, true);
+}
+
+int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, FrameDescCache* cache, bool mixed) {
+    // Frame anchors exist only in Java threads
+    VMThread* vm_thread = VMThread::current();
+    if (vm_thread != NULL && VM::jni() == NULL) {
+        vm_thread = NULL;
+    }
+    if (vm_thread == NULL && !mixed) {
+        return 0;
+    }
+
+    const void* pc;
+    uintptr_t sp;
+    uintptr_t fp;
+    if (ucontext == NULL) {
+        pc = __builtin_return_address(0);
+        fp = (uintptr_t)__builtin_frame_address(1);
+        sp = (uintptr_t)__builtin_frame_address(0);
+    } else {
+        StackFrame frame(ucontext);
+        pc = (const void*)frame.pc();
+        fp = frame.fp();
+        sp = frame.sp();
+    }
+
+    // The last Java frame before the thread called into native code or the VM.
+    // An entry frame switches to the anchor saved when native code called Java
+    JavaFrameAnchor* anchor = vm_thread != NULL ? vm_thread->anchor() : NULL;
+
+    bool top_frame = true;
+    if (!mixed && !CodeHeap::contains(pc)) {
+        // Not interrupted in Java code: start from the last Java frame
+        int state = vm_thread->state();
+        if (state == 8 || state == 9) {
+            // In Java, but not in the code heap: the anchor is not set
+            return -1;
+        }
+        if (!jumpToAnchor(anchor, pc, sp, fp)) {
+            return 0;
+        }
+        top_frame = false;
+    }
+
+    int depth = 0;
+    const char* error = NULL;
+    bool after_native = false;
+
+    Profiler* profiler = Profiler::instance();
+    bool raw_pc = profiler->rawPC();
+    CodeCache* cc = NULL;
+    if (cache != NULL) {
+        cache->validate(profiler->nativeLibGeneration());
+    }
+
+    for (; depth < max_depth; top_frame = false) {
+        uintptr_t prev_sp = sp;
+
+        if (VMStructs::isCallStubReturn(pc)) {
+            // Entry frame: continue from the code that called Java
+            if (fp <= sp || fp >= sp + MAX_FRAME_SIZE) {
+                error = "break_entry_frame";
+                break;
+            }
+            JavaFrameAnchor* saved = JavaFrameAnchor::fromEntryFrame(fp);
+            if (mixed) {
+                // Native frames of the caller are unwound from the call stub frame
+                anchor = saved;
+                sp = fp + 2 * sizeof(uintptr_t);
+                pc = stripPointer((const void*)loadSlot(fp, FRAME_PC_SLOT));
+                fp = loadSlot(fp, 0);
+                after_native = true;
+            } else if (saved == NULL || !jumpToAnchor(saved, pc, sp, fp)) {
+                break;
+            }
+            if (sp <= prev_sp) {
+                error = "break_entry_frame";
+                break;
+            }
+            continue;
+        }
+
+        if (!CodeHeap::contains(pc)) {
+            if (!mixed) {
+                error = "unknown_nmethod";
+                break;
+            }
+
+            FrameDesc* f = findFrameDesc(profiler, pc, cc, cache, !top_frame);
+            if (cc == NULL || !cc->contains(pc)) {
+                // The rule came from the cache, but the frame still needs a name
+                cc = profiler->findNativeLibrary(pc);
+            }
+            depth += fillNativeFrame(frames + depth, pc, cc, raw_pc);
+            after_native = true;
+
+            if (!unwindNative(f, pc, sp, fp, (uintptr_t)-1, LiveStack())) {
+                // Broken native frame: resume from the last Java frame below, if there is one
+                if (anchor == NULL || anchor->lastJavaSP() <= prev_sp || !jumpToAnchor(anchor, pc, sp, fp)) {
+                    break;
+                }
+                anchor = NULL;
+                after_native = false;
+            }
+            continue;
+        }
+
+        if (after_native && anchor != NULL && anchor->lastJavaSP() >= sp) {
+            // Native frames have led to Java code; the anchor tells exactly where the Java frame is
+            const void* anchor_pc;
+            uintptr_t anchor_sp;
+            uintptr_t anchor_fp;
+            if (jumpToAnchor(anchor, anchor_pc, anchor_sp, anchor_fp) && CodeHeap::contains(anchor_pc)) {
+                pc = anchor_pc;
+                sp = anchor_sp;
+                fp = anchor_fp;
+            }
+            anchor = NULL;
+        }
+        after_native = false;
+
+        NMethodInfo info;
+        if (!NMethodCache::lookup(pc, info)) {
+            error = "unknown_nmethod";
             break;
         }
 
-        if (f->fp_off & DW_PC_OFFSET) {
-            pc = (const char*)pc + (f->fp_off >> 1);
+        NMethod* nm = info.nmethod;
+        if (info.kind == NMETHOD_INTERPRETER) {
+            if (fp < sp || fp >= sp + MAX_FRAME_SIZE || (fp & (sizeof(uintptr_t) - 1)) != 0) {
+                error = "break_interpreted";
+                break;
+            }
+
+            // The frame may be half built: nothing behind the Method pointer is trusted
+            VMMethod* method = (VMMethod*)loadSlot(fp, InterpreterFrame::method_offset);
+            ConstMethod* cmethod = method->validatedConstMethod();
+            jmethodID method_id = cmethod != NULL ? cmethod->validatedId() : NULL;
+            if (method_id == NULL) {
+                error = "break_interpreted";
+                break;
+            }
+
+            const char* bytecodes = cmethod->bytecodes();
+            const char* bcp = (const char*)loadSlot(fp, InterpreterFrame::bcp_offset());
+            int bci = bcp >= bytecodes && bcp < bytecodes + cmethod->codeSize() ? bcp - bytecodes : 0;
+            depth += fillFrame(frames + depth, FRAME_INTERPRETED, bci, method_id);
+
+            sp = loadSlot(fp, InterpreterFrame::sender_sp_offset);
+            pc = stripPointer((const void*)loadSlot(fp, FRAME_PC_SLOT));
+            fp = loadSlot(fp, 0);
         } else {
-            if (f->fp_off != DW_SAME_FP && f->fp_off < MAX_FRAME_SIZE && f->fp_off > -MAX_FRAME_SIZE) {
-                fp = (uintptr_t)SafeAccess::load((void**)(sp + f->fp_off));
+            if (info.kind == NMETHOD_COMPILED) {
+                if (info.method_id == NULL) {
+                    error = "unknown_Java";
+                    break;
+                }
+                depth += fillCompiledFrames(nm, pc, frames + depth, max_depth - depth, info.method_id);
+            }
+
+            // Top frame may be interrupted before the frame is built or after it is destroyed
+            uintptr_t top_pc = (uintptr_t)pc;
+            if (top_frame && ucontext != NULL && unwindTopFrame(ucontext, nm, top_pc, sp, fp)) {
+                pc = (const void*)top_pc;
+            } else if (nm->frameSize() > 0) {
+                sp += nm->frameSize() * sizeof(uintptr_t);
+                fp = loadSlot(sp, -FRAME_PC_SLOT - 1);
+                pc = stripPointer((const void*)loadSlot(sp, -FRAME_PC_SLOT));
+            } else {
+                error = info.kind == NMETHOD_COMPILED ? "break_compiled" : "break_stub";
+                break;
             }
-            pc = stripPointer(SafeAccess::load((void**)sp - 1));
         }
 
-        if (pc < (const void*)MIN_VALID_PC || pc > (const void*)-MIN_VALID_PC) {
+        // The next frame must be below on the stack
+        if (sp <= prev_sp || sp >= prev_sp + MAX_FRAME_SIZE || (sp & (sizeof(uintptr_t) - 1)) != 0 ||
+            pc < (const void*)MIN_VALID_PC) {
+            error = "break_java_stack";
             break;
         }
     }
 
+    if (error != NULL) {
+        if (!mixed && (depth == 0 || top_frame)) {
+            return -1;
+        }
+        if (depth < max_depth) {
+            depth += fillError(frames + depth, error);
+        }
+    }
+    return depth;
+}
+
+bool StackWalker::unwindTopFrame(void* ucontext, NMethod* nm, uintptr_t& pc, uintptr_t& sp, uintptr_t& fp) {
+    const instruction_t* entry = (const instruction_t*)nm->codeBegin();
+    int complete_offset = nm->frameCompleteOffset();
+    const instruction_t* frame_complete = complete_offset > 0 ? entry + complete_offset : entry;
+    return StackFrame(ucontext).unwindCompiled(entry, frame_complete, pc, sp, fp);
+}
+
+// Java frames at a return address into the code heap, when nothing but the address is known,
+// e.g. in a kernel callchain. An interpreted frame has no method without its frame
+int StackWalker::resolveJavaFrames(const void* pc, ASGCT_CallFrame* frames, int max_depth, bool* compiled) {
+    *compiled = false;
+
+    NMethodInfo info;
+    if (max_depth <= 0 || !NMethodCache::lookup(pc, info)) {
+        return 0;
+    }
+
+    if (info.kind == NMETHOD_COMPILED) {
+        *compiled = true;
+        if (info.method_id == NULL) {
+            return fillError(frames, "unknown_Java");
+        }
+        return fillCompiledFrames(info.nmethod, pc, frames, max_depth, info.method_id);
+    } else if (info.kind == NMETHOD_INTERPRETER) {
+        return fillError(frames, "interpreted_Java");
+    }
+    return 0;
+}
+
+// Expands inlined methods at the given PC of an nmethod; the outermost one is the compiled method itself
+int StackWalker::fillCompiledFrames(NMethod* nm, const void* pc, ASGCT_CallFrame* frames, int max_depth,
+                                    jmethodID method_id) {
+    int depth = 0;
+    if (NMethod::hasScopeDescs() && !nm->isNativeMethod()) {
+        ScopeDesc scope(nm);
+        for (int offset = nm->findScopeOffset(pc); offset > 0 && depth < max_depth; ) {
+            offset = scope.decode(offset);
+            jmethodID id = offset >= 0 ? scope.method()->validatedId() : NULL;
+            if (id == NULL) {
+                break;
+            }
+            if (offset == 0) {
+                return depth + fillFrame(frames + depth, FRAME_JIT_COMPILED, scope.bci(), id);
+            }
+            depth += fillFrame(frames + depth, FRAME_INLINED, scope.bci(), id);
+        }
+    }
+
+    // No debug info: only the compiled method is known
+    if (depth < max_depth) {
+        depth += fillFrame(frames + depth, FRAME_JIT_COMPILED, 0, method_id);
+    }
     return depth;
 }
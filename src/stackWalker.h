@@ -17,11 +17,35 @@
 #ifndef _STACKWALKER_H
 #define _STACKWALKER_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "vmEntry.h"
+
+
+class FrameDescCache;
+class NMethod;
 
 class StackWalker {
   public:
     static int walkFP(void* ucontext, const void** callchain, int max_depth, const void** last_pc);
-    static int walkDwarf(void* ucontext, const void** callchain, int max_depth, const void** last_pc);
+    static int walkDwarf(void* ucontext, const void** callchain, int max_depth, const void** last_pc,
+                         FrameDescCache* cache = NULL);
+    static int walkAuto(void* ucontext, const void** callchain, int max_depth, const void** last_pc,
+                        FrameDescCache* cache = NULL);
+    static int walkJava(void* ucontext, ASGCT_CallFrame* frames, int max_depth);
+    static int walkMixed(void* ucontext, ASGCT_CallFrame* frames, int max_depth, FrameDescCache* cache = NULL);
+    static int walkCopy(const void* pc, uintptr_t sp, uintptr_t fp, const char* stack, size_t stack_size,
+                        const void** callchain, int max_depth, const void** last_pc, FrameDescCache* cache,
+                        bool trust_fp);
+    static int resolveJavaFrames(const void* pc, ASGCT_CallFrame* frames, int max_depth, bool* compiled);
+
+  private:
+    static int walkDwarfImpl(void* ucontext, const void** callchain, int max_depth, const void** last_pc,
+                             FrameDescCache* cache, bool trust_fp);
+    static int walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, FrameDescCache* cache, bool mixed);
+    static bool unwindTopFrame(void* ucontext, NMethod* nm, uintptr_t& pc, uintptr_t& sp, uintptr_t& fp);
+    static int fillCompiledFrames(NMethod* nm, const void* pc, ASGCT_CallFrame* frames, int max_depth,
+                                  jmethodID method_id);
 };
 
 #endif // _STACKWALKER_H
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "symbolCache.h"
+#include "dwarf.h"
+#include "log.h"
+
+
+static const u32 SYMBOL_CACHE_MAGIC = 0x43535041;  // "APSC"
+static const u32 SYMBOL_CACHE_VERSION = 1;
+
+// File layout: header, symbol entries, FrameDesc table, symbol names
+struct SymbolCacheHeader {
+    u32 magic;
+    u32 version;
+    u32 pointer_size;
+    u32 symbol_count;
+    u32 dwarf_count;
+    u32 reserved;
+    u64 names_size;
+};
+
+struct SymbolCacheEntry {
+    u64 offset;  // symbol address relative to the library base
+    u32 length;
+    u32 name;    // offset in the names area
+};
+
+
+char* SymbolCache::_dir = NULL;
+
+void SymbolCache::setDirectory(const char* dir) {
+    free(_dir);
+    _dir = dir == NULL ? NULL : strdup(dir);
+}
+
+void SymbolCache::filePath(char* path, size_t size, const char* build_id, const char* suffix) {
+    snprintf(path, size, "%s/%s%s", _dir, build_id, suffix);
+}
+
+int SymbolCache::load(CodeCache* cc, const char* base, const char* build_id, int parts) {
+    char path[PATH_MAX];
+    filePath(path, sizeof(path), build_id, ".symcache");
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+
+    struct stat st;
+    void* addr = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SymbolCacheHeader)
+        ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)
+        : MAP_FAILED;
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        return 0;
+    }
+
+    const SymbolCacheHeader* header = (const SymbolCacheHeader*)addr;
+    const SymbolCacheEntry* entries = (const SymbolCacheEntry*)(header + 1);
+    const FrameDesc* dwarf = (const FrameDesc*)(entries + header->symbol_count);
+    const char* names = (const char*)(dwarf + header->dwarf_count);
+
+    int loaded = 0;
+    if (header->magic != SYMBOL_CACHE_MAGIC || header->version != SYMBOL_CACHE_VERSION
+            || header->pointer_size != sizeof(void*) || header->names_size == 0
+            || sizeof(SymbolCacheHeader) + (u64)header->symbol_count * sizeof(SymbolCacheEntry)
+               + (u64)header->dwarf_count * sizeof(FrameDesc) + header->names_size != (u64)st.st_size
+            || names[header->names_size - 1] != 0) {
+        Log::warn("Ignoring invalid symbol cache %s", path);
+        goto done;
+    }
+
+    if (parts & CACHED_SYMBOLS) {
+        for (u32 i = 0; i < header->symbol_count; i++) {
+            if (entries[i].name < header->names_size) {
+                cc->add((const char*)((uintptr_t)base + entries[i].offset), entries[i].length, names + entries[i].name);
+            }
+        }
+        loaded |= CACHED_SYMBOLS;
+    }
+
+    if ((parts & CACHED_UNWIND_INFO) && header->dwarf_count > 0) {
+        size_t dwarf_size = header->dwarf_count * sizeof(FrameDesc);
+        FrameDesc* table = (FrameDesc*)malloc(dwarf_size);
+        if (table != NULL) {
+            memcpy(table, dwarf, dwarf_size);
+            cc->setDwarfTable(table, header->dwarf_count);
+            loaded |= CACHED_UNWIND_INFO;
+        }
+    }
+
+done:
+    munmap(addr, st.st_size);
+    return loaded;
+}
+
+void SymbolCache::save(CodeCache* cc, const char* base, const char* build_id, int mode) {
+    SymbolCacheHeader header;
+    header.magic = SYMBOL_CACHE_MAGIC;
+    header.version = SYMBOL_CACHE_VERSION;
+    header.pointer_size = sizeof(void*);
+    header.symbol_count = cc->symbolCount();
+    header.dwarf_count = cc->dwarfTableLength();
+    header.reserved = 0;
+    header.names_size = 0;
+    for (int i = 0; i < cc->symbolCount(); i++) {
+        header.names_size += strlen(cc->symbolName(i)) + 1;
+    }
+    if (header.names_size == 0) {
+        header.names_size = 1;
+    }
+
+    size_t size = sizeof(header) + header.symbol_count * sizeof(SymbolCacheEntry)
+                + header.dwarf_count * sizeof(FrameDesc) + header.names_size;
+
+    mkdir(_dir, 0755);
+
+    // Write to a temporary file first: other processes may read the cache concurrently
+    char tmp_path[PATH_MAX];
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+    filePath(tmp_path, sizeof(tmp_path), build_id, suffix);
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, mode);
+    if (fd == -1) {
+        Log::debug("Could not create symbol cache %s: %s", tmp_path, strerror(errno));
+        return;
+    }
+
+    void* addr = ftruncate(fd, size) == 0
+        ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+        : MAP_FAILED;
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        Log::debug("Could not write symbol cache %s: %s", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return;
+    }
+
+    memcpy(addr, &header, sizeof(header));
+    SymbolCacheEntry* entries = (SymbolCacheEntry*)((SymbolCacheHeader*)addr + 1);
+    FrameDesc* dwarf = (FrameDesc*)(entries + header.symbol_count);
+    char* names = (char*)(dwarf + header.dwarf_count);
+
+    u32 name_offset = 0;
+    for (u32 i = 0; i < header.symbol_count; i++) {
+        const char* name = cc->symbolName(i);
+        size_t len = strlen(name) + 1;
+        entries[i].offset = (u64)((uintptr_t)cc->symbolAddress(i) - (uintptr_t)base);
+        entries[i].length = cc->symbolLength(i);
+        entries[i].name = name_offset;
+        memcpy(names + name_offset, name, len);
+        name_offset += len;
+    }
+    if (header.dwarf_count > 0) {
+        memcpy(dwarf, cc->dwarfTable(), header.dwarf_count * sizeof(FrameDesc));
+    }
+    names[header.names_size - 1] = 0;
+
+    munmap(addr, size);
+
+    char path[PATH_MAX];
+    filePath(path, sizeof(path), build_id, ".symcache");
+    if (rename(tmp_path, path) != 0) {
+        Log::debug("Could not write symbol cache %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+// The kernel symbol table stays the same until reboot, unless modules are loaded or unloaded
+bool SymbolCache::kernelKey(char* key, size_t size) {
+    char boot_id[64];
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t len = read(fd, boot_id, sizeof(boot_id) - 1);
+    close(fd);
+    if (len <= 0) {
+        return false;
+    }
+    while (len > 0 && (boot_id[len - 1] == '\n' || boot_id[len - 1] == 0)) len--;
+    boot_id[len] = 0;
+
+    // FNV-1a of /proc/modules: names, sizes and load addresses of all modules
+    u64 hash = 0xcbf29ce484222325ULL;
+    fd = open("/proc/modules", O_RDONLY);
+    if (fd != -1) {
+        char buf[4096];
+        ssize_t r;
+        while ((r = read(fd, buf, sizeof(buf))) > 0) {
+            for (ssize_t i = 0; i < r; i++) {
+                hash = (hash ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+            }
+        }
+        close(fd);
+    }
+
+    snprintf(key, size, "kernel-%s-%016llx", boot_id, (unsigned long long)hash);
+    return true;
+}
+
+bool SymbolCache::loadKernel(CodeCache* cc) {
+    char key[128];
+    return kernelKey(key, sizeof(key)) && load(cc, NULL, key, CACHED_SYMBOLS) != 0;
+}
+
+void SymbolCache::saveKernel(CodeCache* cc) {
+    // Kernel addresses are not for other users to see
+    char key[128];
+    if (kernelKey(key, sizeof(key))) {
+        save(cc, NULL, key, 0600);
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SYMBOLCACHE_H
+#define _SYMBOLCACHE_H
+
+#include "codeCache.h"
+
+
+// Parts of a parsed library that can be restored from the cache
+enum CachedParts {
+    CACHED_SYMBOLS     = 1,
+    CACHED_UNWIND_INFO = 2
+};
+
+// On-disk cache of parsed symbol tables and DWARF unwind tables.
+// One file per library, named after its build-id, so that a library parsed once
+// does not need to be parsed again by the next profiler instance on the same host.
+// All addresses are stored relative to the library base and thus do not depend on ASLR.
+class SymbolCache {
+  private:
+    static char* _dir;
+
+    static void filePath(char* path, size_t size, const char* build_id, const char* suffix);
+    static bool kernelKey(char* key, size_t size);
+
+  public:
+    static void setDirectory(const char* dir);
+
+    static bool enabled() {
+        return _dir != NULL;
+    }
+
+    // Adds cached symbols and/or unwind info of the library to the CodeCache.
+    // Returns a bit mask of CachedParts actually restored
+    static int load(CodeCache* cc, const char* base, const char* build_id, int parts);
+
+    static void save(CodeCache* cc, const char* base, const char* build_id, int mode = 0644);
+
+    // Kernel symbols are keyed by the boot ID and the list of loaded modules instead of a build-id
+    static bool loadKernel(CodeCache* cc);
+    static void saveKernel(CodeCache* cc);
+};
+
+#endif // _SYMBOLCACHE_H
@@ -27,11 +27,23 @@ class Symbols {
     static Mutex _parse_lock;
     static std::set<const void*> _parsed_libraries;
     static bool _have_kernel_symbols;
+    static bool _lazy_loading;
 
   public:
     static void parseKernelSymbols(CodeCache* cc);
     static void parseLibraries(CodeCache** array, volatile int& count, int size, bool kernel_symbols);
 
+    // Parses symbols of a library registered in lazy mode. Not signal safe
+    static void loadSymbols(CodeCache* cc);
+
+    static void setLazyLoading(bool lazy) {
+        _lazy_loading = lazy;
+    }
+
+    static bool lazyLoading() {
+        return _lazy_loading;
+    }
+
     static void makePatchable(CodeCache* cc);
 
     static bool haveKernelSymbols() {
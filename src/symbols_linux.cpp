@@ -33,6 +33,7 @@
 #include "fdtransferClient.h"
 #include "log.h"
 #include "os.h"
+#include "symbolCache.h"
 
 
 class SymbolDesc {
@@ -104,6 +105,13 @@ typedef Elf32_Rel  ElfRelocation;
 #endif // __LP64__
 
 
+// Parts of an ELF file to parse
+enum ElfParts {
+    ELF_SYMBOLS     = 1,  // symbol tables, including PLT stubs
+    ELF_RUNTIME     = 2,  // text base, GOT and DWARF unwind info
+    ELF_ALL         = ELF_SYMBOLS | ELF_RUNTIME
+};
+
 class ElfParser {
   private:
     CodeCache* _cc;
@@ -137,14 +145,20 @@ class ElfParser {
 
     ElfSection* findSection(uint32_t type, const char* name);
 
+    const char* buildId(int& len);
+    bool buildIdString(char* buf, size_t size);
+
+    void parse(bool use_debug, int parts);
     void loadSymbols(bool use_debug);
+    void loadRuntimeInfo(bool load_dwarf);
     bool loadSymbolsUsingBuildId();
     bool loadSymbolsUsingDebugLink();
     void loadSymbolTable(ElfSection* symtab);
     void addRelocationSymbols(ElfSection* reltab, const char* plt);
+    void addImports(ElfSection* reltab);
 
   public:
-    static bool parseFile(CodeCache* cc, const char* base, const char* file_name, bool use_debug);
+    static bool parseFile(CodeCache* cc, const char* base, const char* file_name, bool use_debug, int parts = ELF_ALL);
     static void parseMem(CodeCache* cc, const char* base);
 };
 
@@ -164,7 +178,7 @@ ElfSection* ElfParser::findSection(uint32_t type, const char* name) {
     return NULL;
 }
 
-bool ElfParser::parseFile(CodeCache* cc, const char* base, const char* file_name, bool use_debug) {
+bool ElfParser::parseFile(CodeCache* cc, const char* base, const char* file_name, bool use_debug, int parts) {
     int fd = open(file_name, O_RDONLY);
     if (fd == -1) {
         return false;
@@ -178,7 +192,7 @@ bool ElfParser::parseFile(CodeCache* cc, const char* base, const char* file_name
         Log::warn("Could not parse symbols from %s: %s", file_name, strerror(errno));
     } else {
         ElfParser elf(cc, base, addr, file_name);
-        elf.loadSymbols(use_debug);
+        elf.parse(use_debug, parts);
         munmap(addr, length);
     }
     return true;
@@ -186,14 +200,42 @@ bool ElfParser::parseFile(CodeCache* cc, const char* base, const char* file_name
 
 void ElfParser::parseMem(CodeCache* cc, const char* base) {
     ElfParser elf(cc, base, base);
-    elf.loadSymbols(false);
+    elf.parse(false, ELF_ALL);
 }
 
-void ElfParser::loadSymbols(bool use_debug) {
+void ElfParser::parse(bool use_debug, int parts) {
     if (!valid_header()) {
         return;
     }
 
+    // The symbol cache is consulted only for the primary file, not for debuginfo
+    char build_id[132];
+    bool cacheable = use_debug && SymbolCache::enabled() && buildIdString(build_id, sizeof(build_id));
+
+    int cached = 0;
+    if (cacheable) {
+        cached = SymbolCache::load(_cc, _base, build_id,
+                                   ((parts & ELF_SYMBOLS) ? CACHED_SYMBOLS : 0) |
+                                   ((parts & ELF_RUNTIME) ? CACHED_UNWIND_INFO : 0));
+        if (cached != 0) {
+            Log::debug("Restored %s from the symbol cache", _file_name);
+        }
+    }
+
+    if ((parts & ELF_SYMBOLS) && !(cached & CACHED_SYMBOLS)) {
+        loadSymbols(use_debug);
+    }
+    if ((parts & ELF_RUNTIME) && use_debug) {
+        loadRuntimeInfo(!(cached & CACHED_UNWIND_INFO));
+    }
+
+    // Unwind info of a lazily registered library is ready by the time symbols are parsed
+    if (cacheable && (parts & ELF_SYMBOLS) && !(cached & CACHED_SYMBOLS)) {
+        SymbolCache::save(_cc, _base, build_id);
+    }
+}
+
+void ElfParser::loadSymbols(bool use_debug) {
     // Look for debug symbols in the original .so
     ElfSection* section = findSection(SHT_SYMTAB, ".symtab");
     if (section != NULL) {
@@ -216,8 +258,6 @@ void ElfParser::loadSymbols(bool use_debug) {
 
 loaded:
     if (use_debug) {
-        _cc->setTextBase(_base);
-
         // Synthesize names for PLT stubs
         ElfSection* plt = findSection(SHT_PROGBITS, ".plt");
         ElfSection* reltab = findSection(SHT_RELA, ".rela.plt");
@@ -227,38 +267,73 @@ loaded:
         if (plt != NULL && reltab != NULL) {
             addRelocationSymbols(reltab, _base + plt->sh_offset + PLT_HEADER_SIZE);
         }
+    }
+}
 
-        // Find the bounds of the Global Offset Table
-        ElfSection* got = findSection(SHT_PROGBITS, ".got.plt");
-        if (got != NULL
-            || (got = findSection(SHT_NOBITS, ".plt")) != NULL   /* ppc64le binaries */
-            || (got = findSection(SHT_PROGBITS, ".got")) != NULL /* RELRO technique */) {
-            _cc->setGlobalOffsetTable(_base + got->sh_addr, got->sh_size);
-        }
+void ElfParser::loadRuntimeInfo(bool load_dwarf) {
+    _cc->setTextBase(_base);
+
+    // Find the bounds of the Global Offset Table
+    ElfSection* got = findSection(SHT_PROGBITS, ".got.plt");
+    if (got != NULL
+        || (got = findSection(SHT_NOBITS, ".plt")) != NULL   /* ppc64le binaries */
+        || (got = findSection(SHT_PROGBITS, ".got")) != NULL /* RELRO technique */) {
+        _cc->setGlobalOffsetTable(_base + got->sh_addr, got->sh_size);
+    }
 
-        // Read DWARF unwind info
-        ElfSection* eh_frame_hdr = findSection(0, ".eh_frame_hdr");
-        if (eh_frame_hdr != NULL && DWARF_SUPPORTED) {
-            DwarfParser dwarf(_cc->name(), (const char*)_header, at(eh_frame_hdr));
-            _cc->setDwarfTable(dwarf.table(), dwarf.count());
+    // Remember GOT slots of the functions that can be hooked: both PLT slots and GLOB_DAT slots,
+    // the latter are used by -fno-plt code and wherever the function address is taken
+    const char* reltab_names[] = {".rela.plt", ".rel.plt", ".rela.dyn", ".rel.dyn"};
+    for (int i = 0; i < 4; i++) {
+        ElfSection* reltab = findSection(i & 1 ? SHT_REL : SHT_RELA, reltab_names[i]);
+        if (reltab != NULL) {
+            addImports(reltab);
         }
     }
+
+    // Read DWARF unwind info
+    ElfSection* eh_frame_hdr = findSection(0, ".eh_frame_hdr");
+    if (eh_frame_hdr != NULL && DWARF_SUPPORTED && load_dwarf) {
+        DwarfParser dwarf(_cc->name(), (const char*)_header, at(eh_frame_hdr));
+        _cc->setDwarfTable(dwarf.table(), dwarf.count());
+    }
 }
 
-// Load symbols from /usr/lib/debug/.build-id/ab/cdef1234.debug, where abcdef1234 is Build ID
-bool ElfParser::loadSymbolsUsingBuildId() {
+const char* ElfParser::buildId(int& len) {
     ElfSection* section = findSection(SHT_NOTE, ".note.gnu.build-id");
     if (section == NULL || section->sh_size <= 16) {
-        return false;
+        return NULL;
     }
 
     ElfNote* note = (ElfNote*)at(section);
     if (note->n_namesz != 4 || note->n_descsz < 2 || note->n_descsz > 64) {
+        return NULL;
+    }
+
+    len = note->n_descsz;
+    return (const char*)note + sizeof(*note) + 4;
+}
+
+bool ElfParser::buildIdString(char* buf, size_t size) {
+    int build_id_len;
+    const char* build_id = buildId(build_id_len);
+    if (build_id == NULL || size < (size_t)build_id_len * 2 + 1) {
         return false;
     }
 
-    const char* build_id = (const char*)note + sizeof(*note) + 4;
-    int build_id_len = note->n_descsz;
+    for (int i = 0; i < build_id_len; i++) {
+        sprintf(buf + i * 2, "%02hhx", build_id[i]);
+    }
+    return true;
+}
+
+// Load symbols from /usr/lib/debug/.build-id/ab/cdef1234.debug, where abcdef1234 is Build ID
+bool ElfParser::loadSymbolsUsingBuildId() {
+    int build_id_len;
+    const char* build_id = buildId(build_id_len);
+    if (build_id == NULL) {
+        return false;
+    }
 
     char path[PATH_MAX];
     char* p = path + sprintf(path, "/usr/lib/debug/.build-id/%02hhx/", build_id[0]);
@@ -355,10 +430,40 @@ void ElfParser::addRelocationSymbols(ElfSection* reltab, const char* plt) {
     }
 }
 
+void ElfParser::addImports(ElfSection* reltab) {
+    if (reltab->sh_link == 0 || reltab->sh_entsize == 0) {
+        return;
+    }
+
+    ElfSection* symtab = section(reltab->sh_link);
+    const char* symbols = at(symtab);
+
+    ElfSection* strtab = section(symtab->sh_link);
+    const char* strings = at(strtab);
+
+    const char* relocations = at(reltab);
+    const char* relocations_end = relocations + reltab->sh_size;
+    for (; relocations < relocations_end; relocations += reltab->sh_entsize) {
+        ElfRelocation* r = (ElfRelocation*)relocations;
+        ElfSymbol* sym = (ElfSymbol*)(symbols + ELF_R_SYM(r->r_info) * symtab->sh_entsize);
+        if (sym->st_name != 0 && sym->st_shndx == SHN_UNDEF) {
+            _cc->addImport((const void**)(_base + r->r_offset), strings + sym->st_name);
+        }
+    }
+}
+
 
 Mutex Symbols::_parse_lock;
 std::set<const void*> Symbols::_parsed_libraries;
 bool Symbols::_have_kernel_symbols = false;
+bool Symbols::_lazy_loading = false;
+
+// Symbols of the JVM libraries are needed right away to find VMStructs and mark interpreter frames
+static bool needsEagerSymbols(const char* file_name) {
+    const char* s = strrchr(file_name, '/');
+    s = s != NULL ? s + 1 : file_name;
+    return strncmp(s, "libjvm", 6) == 0 || strncmp(s, "libj9", 5) == 0;
+}
 
 void Symbols::parseKernelSymbols(CodeCache* cc) {
     int fd;
@@ -404,10 +509,18 @@ void Symbols::parseLibraries(CodeCache** array, volatile int& count, int size, b
 
     if (kernel_symbols && !haveKernelSymbols()) {
         CodeCache* cc = new CodeCache("[kernel]");
-        parseKernelSymbols(cc);
+        bool cached = SymbolCache::enabled() && SymbolCache::loadKernel(cc);
+        if (cached) {
+            _have_kernel_symbols = cc->symbolCount() > 0;
+        } else {
+            parseKernelSymbols(cc);
+        }
 
         if (haveKernelSymbols()) {
             cc->sort();
+            if (!cached && SymbolCache::enabled()) {
+                SymbolCache::saveKernel(cc);
+            }
             array[count] = cc;
             atomicInc(count);
         } else {
@@ -437,7 +550,14 @@ void Symbols::parseLibraries(CodeCache** array, volatile int& count, int size, b
             CodeCache* cc = new CodeCache(map.file(), count, image_base, map.end());
 
             if (map.inode() != 0) {
-                ElfParser::parseFile(cc, image_base - map.offs(), map.file(), true);
+                if (_lazy_loading && !needsEagerSymbols(map.file())) {
+                    // Register the address range and unwind info now, parse symbols on demand
+                    if (ElfParser::parseFile(cc, image_base - map.offs(), map.file(), true, ELF_RUNTIME)) {
+                        cc->setSymbolsLoaded(false);
+                    }
+                } else {
+                    ElfParser::parseFile(cc, image_base - map.offs(), map.file(), true);
+                }
             } else if (strcmp(map.file(), "[vdso]") == 0) {
                 ElfParser::parseMem(cc, image_base);
             }
@@ -452,6 +572,20 @@ void Symbols::parseLibraries(CodeCache** array, volatile int& count, int size, b
     fclose(f);
 }
 
+void Symbols::loadSymbols(CodeCache* cc) {
+    MutexLocker ml(_parse_lock);
+
+    if (!cc->symbolsLoaded()) {
+        u64 start_time = OS::nanotime();
+        if (cc->textBase() != NULL) {
+            ElfParser::parseFile(cc, cc->textBase(), cc->name(), true, ELF_SYMBOLS);
+        }
+        cc->sort();
+        cc->setSymbolsLoaded(true);
+        Log::debug("Loaded symbols of %s in %.3f ms", cc->name(), (OS::nanotime() - start_time) / 1e6);
+    }
+}
+
 void Symbols::makePatchable(CodeCache* cc) {
     uintptr_t got_start = (uintptr_t)cc->gotStart() & ~OS::page_mask;
     uintptr_t got_size = ((uintptr_t)cc->gotEnd() - got_start + OS::page_mask) & ~OS::page_mask;
@@ -113,6 +113,7 @@ class MachOParser {
 Mutex Symbols::_parse_lock;
 std::set<const void*> Symbols::_parsed_libraries;
 bool Symbols::_have_kernel_symbols = false;
+bool Symbols::_lazy_loading = false;
 
 void Symbols::parseKernelSymbols(CodeCache* cc) {
 }
@@ -148,6 +149,10 @@ void Symbols::parseLibraries(CodeCache** array, volatile int& count, int size, b
     }
 }
 
+void Symbols::loadSymbols(CodeCache* cc) {
+    // Mach-O symbols are always parsed eagerly
+}
+
 void Symbols::makePatchable(CodeCache* cc) {
     // Global Offset Table is always writable
 }
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "threadContext.h"
+#include "os.h"
+
+
+u64* ThreadContext::_slots = NULL;
+
+
+void ThreadContext::set(int thread_id, u64 context_id) {
+    if ((u32)thread_id >= MAX_CONTEXT_THREADS) {
+        return;
+    }
+
+    if (_slots == NULL) {
+        if (context_id == 0) {
+            return;
+        }
+        u64* slots = (u64*)OS::safeAlloc(MAX_CONTEXT_THREADS * sizeof(u64));
+        if (slots == NULL) {
+            return;
+        }
+        if (!__sync_bool_compare_and_swap(&_slots, NULL, slots)) {
+            OS::safeFree(slots, MAX_CONTEXT_THREADS * sizeof(u64));
+        }
+    }
+
+    _slots[thread_id] = context_id;
+}
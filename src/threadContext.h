@@ -0,0 +1,48 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _THREADCONTEXT_H
+#define _THREADCONTEXT_H
+
+#include <stddef.h>
+#include "arch.h"
+
+
+// Thread IDs covered by context slots; the kernel never assigns IDs above PID_MAX_LIMIT
+const u32 MAX_CONTEXT_THREADS = 1 << 22;
+
+
+// Application-defined context, e.g. the span ID of the request a thread is serving.
+// The slots are one array indexed by thread ID and reserved upfront, so that a signal handler
+// reads the context of a thread with a single load. Physical memory is committed only
+// for the pages of threads that have ever set a context
+class ThreadContext {
+  private:
+    static u64* _slots;
+
+  public:
+    static bool enabled() {
+        return _slots != NULL;
+    }
+
+    static u64 get(int thread_id) {
+        return _slots != NULL && (u32)thread_id < MAX_CONTEXT_THREADS ? _slots[thread_id] : 0;
+    }
+
+    static void set(int thread_id, u64 context_id);
+};
+
+#endif // _THREADCONTEXT_H
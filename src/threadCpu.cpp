@@ -0,0 +1,133 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string.h>
+#include "threadCpu.h"
+#include "os.h"
+#include "threadRegistry.h"
+
+
+ThreadCpu::Slot* ThreadCpu::_slots = NULL;
+ThreadFilter* ThreadCpu::_seen = NULL;
+std::vector<ThreadCpuStat> ThreadCpu::_exited;
+Mutex ThreadCpu::_lock;
+u64 ThreadCpu::_last_update = 0;
+
+
+void ThreadCpu::reset() {
+    if (_slots == NULL) {
+        Slot* slots = (Slot*)OS::safeAlloc(MAX_CPU_THREADS * sizeof(Slot));
+        if (slots == NULL) {
+            return;
+        }
+        _seen = new ThreadFilter();
+        _slots = slots;
+    }
+
+    MutexLocker ml(_lock);
+
+    std::vector<int> tids;
+    _seen->collect(tids);
+    for (size_t i = 0; i < tids.size(); i++) {
+        memset(&_slots[tids[i]], 0, sizeof(Slot));
+    }
+    _seen->clear();
+    _exited.clear();
+
+    // CPU time a thread has consumed before profiling does not count
+    readThreads(NULL);
+    _last_update = OS::nanotime();
+
+    tids.clear();
+    _seen->collect(tids);
+    for (size_t i = 0; i < tids.size(); i++) {
+        _slots[tids[i]].start_time = _slots[tids[i]].cpu_time;
+    }
+}
+
+// Threads started after reset() have a zero start time, i.e. all their CPU time counts
+void ThreadCpu::readThreads(std::vector<ThreadCpuStat>* deltas) {
+    ThreadList* thread_list = ThreadRegistry::listThreads();
+    for (int tid; (tid = thread_list->next()) != -1; ) {
+        if ((u32)tid >= MAX_CPU_THREADS) {
+            continue;
+        }
+
+        u64 cpu_time = OS::threadCpuTime(tid);
+        if (cpu_time == 0) {
+            // The thread has exited
+            continue;
+        }
+
+        see(tid);
+        Slot* slot = &_slots[tid];
+
+        // A new thread has taken the ID of an exited one: keep what the old thread has
+        // consumed, and count the new one from zero. Thread CPU time never goes back,
+        // which tells a reused ID even where the start time is unknown
+        u64 thread_start = OS::threadStartTime(tid);
+        if ((slot->thread_start != 0 && slot->thread_start != thread_start) || cpu_time < slot->cpu_time) {
+            u64 old_time = slot->cpu_time > slot->start_time ? slot->cpu_time - slot->start_time : 0;
+            ThreadCpuStat stat = {tid, slot->samples, old_time};
+            _exited.push_back(stat);
+            slot->samples = 0;
+            slot->start_time = 0;
+            slot->cpu_time = 0;
+        }
+        slot->thread_start = thread_start;
+
+        if (deltas != NULL && cpu_time > slot->cpu_time) {
+            ThreadCpuStat delta = {tid, 0, cpu_time - slot->cpu_time};
+            deltas->push_back(delta);
+        }
+        slot->cpu_time = cpu_time;
+    }
+    delete thread_list;
+}
+
+u64 ThreadCpu::update(std::vector<ThreadCpuStat>* deltas) {
+    if (_slots == NULL) {
+        return 0;
+    }
+
+    MutexLocker ml(_lock);
+    readThreads(deltas);
+
+    u64 now = OS::nanotime();
+    u64 elapsed = now - _last_update;
+    _last_update = now;
+    return elapsed;
+}
+
+void ThreadCpu::collect(std::vector<ThreadCpuStat>& stats) {
+    if (_slots == NULL) {
+        return;
+    }
+
+    MutexLocker ml(_lock);
+
+    std::vector<int> tids;
+    _seen->collect(tids);
+    stats.reserve(stats.size() + tids.size() + _exited.size());
+    stats.insert(stats.end(), _exited.begin(), _exited.end());
+    for (size_t i = 0; i < tids.size(); i++) {
+        Slot* slot = &_slots[tids[i]];
+        u64 cpu_time = slot->cpu_time > slot->start_time ? slot->cpu_time - slot->start_time : 0;
+        ThreadCpuStat stat = {tids[i], slot->samples, cpu_time};
+        stats.push_back(stat);
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _THREADCPU_H
+#define _THREADCPU_H
+
+#include <vector>
+#include "arch.h"
+#include "mutex.h"
+#include "threadFilter.h"
+
+
+// Thread IDs covered by CPU time slots; the kernel never assigns IDs above PID_MAX_LIMIT
+const u32 MAX_CPU_THREADS = 1 << 22;
+
+struct ThreadCpuStat {
+    int tid;
+    u64 samples;
+    u64 cpu_time;  // nanoseconds consumed while profiling
+};
+
+// Per-thread CPU time next to the number of execution samples, so that the two can be compared.
+// Like ThreadContext, slots are one array indexed by thread ID with physical memory committed
+// lazily; threads that have a slot are tracked in a ThreadFilter bitmap.
+// CPU time of all threads is read in one pass on the timer thread, never in a signal handler
+class ThreadCpu {
+  private:
+    struct Slot {
+        volatile u64 samples;
+        u64 start_time;
+        u64 cpu_time;
+        u64 thread_start;  // OS::threadStartTime() of the thread that owns the slot
+    };
+
+    static Slot* _slots;
+    static ThreadFilter* _seen;
+    static std::vector<ThreadCpuStat> _exited;
+    static Mutex _lock;
+    static u64 _last_update;
+
+    static void see(int thread_id) {
+        if (!_seen->accept(thread_id)) {
+            _seen->add(thread_id);
+        }
+    }
+
+    static void readThreads(std::vector<ThreadCpuStat>* deltas);
+
+  public:
+    // Forgets all threads and takes the current CPU time of live threads as the starting point
+    static void reset();
+
+    static void recordSample(int thread_id) {
+        if (_slots != NULL && (u32)thread_id < MAX_CPU_THREADS) {
+            see(thread_id);
+            atomicInc(_slots[thread_id].samples);
+        }
+    }
+
+    // Reads CPU time of all live threads. If deltas is not NULL, it receives the CPU time
+    // of every thread since the previous update. Returns wall clock nanoseconds since then
+    static u64 update(std::vector<ThreadCpuStat>* deltas);
+
+    static void collect(std::vector<ThreadCpuStat>& stats);
+};
+
+#endif // _THREADCPU_H
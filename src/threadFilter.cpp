@@ -22,7 +22,7 @@
     
 ThreadFilter::ThreadFilter() {
     memset(_bitmap, 0, sizeof(_bitmap));
-    _bitmap[0] = (u32*)OS::safeAlloc(BITMAP_SIZE);
+    _bitmap[0] = (u64*)OS::safeAlloc(BITMAP_ALLOC_SIZE);
 
     _enabled = false;
     _size = 0;
@@ -31,7 +31,7 @@ ThreadFilter::ThreadFilter() {
 ThreadFilter::~ThreadFilter() {
     for (int i = 0; i < MAX_BITMAPS; i++) {
         if (_bitmap[i] != NULL) {
-            OS::safeFree(_bitmap[i], BITMAP_SIZE);
+            OS::safeFree(_bitmap[i], BITMAP_ALLOC_SIZE);
         }
     }
 }
@@ -67,59 +67,75 @@ void ThreadFilter::init(const char* filter) {
 void ThreadFilter::clear() {
     for (int i = 0; i < MAX_BITMAPS; i++) {
         if (_bitmap[i] != NULL) {
-            memset(_bitmap[i], 0, BITMAP_SIZE);
+            memset(_bitmap[i], 0, BITMAP_ALLOC_SIZE);
         }
     }
     _size = 0;
 }
 
 bool ThreadFilter::accept(int thread_id) {
-    u32* b = bitmap(thread_id);
-    return b != NULL && (word(b, thread_id) & (1 << (thread_id & 0x1f)));
+    u64* b = bitmap(thread_id);
+    return b != NULL && (b[wordIndex(thread_id)] & (1ULL << (thread_id & 0x3f)));
 }
 
 void ThreadFilter::add(int thread_id) {
-    u32* b = bitmap(thread_id);
+    u64* b = bitmap(thread_id);
     if (b == NULL) {
-        b = (u32*)OS::safeAlloc(BITMAP_SIZE);
-        u32* oldb = __sync_val_compare_and_swap(&_bitmap[(u32)thread_id / BITMAP_CAPACITY], NULL, b);
+        b = (u64*)OS::safeAlloc(BITMAP_ALLOC_SIZE);
+        u64* oldb = __sync_val_compare_and_swap(&_bitmap[(u32)thread_id / BITMAP_CAPACITY], NULL, b);
         if (oldb != NULL) {
-            OS::safeFree(b, BITMAP_SIZE);
+            OS::safeFree(b, BITMAP_ALLOC_SIZE);
             b = oldb;
         }
     }
 
-    u32 bit = 1 << (thread_id & 0x1f);
-    if (!(__sync_fetch_and_or(&word(b, thread_id), bit) & bit)) {
+    u32 index = wordIndex(thread_id);
+    u64 bit = 1ULL << (thread_id & 0x3f);
+    if (!(__sync_fetch_and_or(&b[index], bit) & bit)) {
         atomicInc(_size);
     }
+    __sync_fetch_and_or(&summary(b)[index >> 6], 1ULL << (index & 0x3f));
 }
 
 void ThreadFilter::remove(int thread_id) {
-    u32* b = bitmap(thread_id);
+    u64* b = bitmap(thread_id);
     if (b == NULL) {
         return;
     }
 
-    u32 bit = 1 << (thread_id & 0x1f);
-    if (__sync_fetch_and_and(&word(b, thread_id), ~bit) & bit) {
+    u32 index = wordIndex(thread_id);
+    u64 bit = 1ULL << (thread_id & 0x3f);
+    u64 old_word = __sync_fetch_and_and(&b[index], ~bit);
+    if (old_word & bit) {
         atomicInc(_size, -1);
     }
+
+    if ((old_word & ~bit) == 0) {
+        // Clear the summary bit, but restore it if another thread has been added concurrently
+        u64 summary_bit = 1ULL << (index & 0x3f);
+        __sync_fetch_and_and(&summary(b)[index >> 6], ~summary_bit);
+        if (b[index] != 0) {
+            __sync_fetch_and_or(&summary(b)[index >> 6], summary_bit);
+        }
+    }
 }
 
 void ThreadFilter::collect(std::vector<int>& v) {
+    v.reserve(v.size() + _size);
+
     for (int i = 0; i < MAX_BITMAPS; i++) {
-        u32* b = _bitmap[i];
-        if (b != NULL) {
-            int start_id = i * BITMAP_CAPACITY;
-            for (int j = 0; j < BITMAP_SIZE / sizeof(u32); j++) {
-                u32 word = b[j];
-                if (word) {
-                    for (int bit = 0; bit < 32; bit++) {
-                        if (word & (1 << bit)) {
-                            v.push_back(start_id + j * 32 + bit);
-                        }
-                    }
+        u64* b = _bitmap[i];
+        if (b == NULL) {
+            continue;
+        }
+
+        int start_id = i * BITMAP_CAPACITY;
+        u64* s = summary(b);
+        for (u32 j = 0; j < SUMMARY_WORDS; j++) {
+            for (u64 summary_word = s[j]; summary_word != 0; summary_word &= summary_word - 1) {
+                u32 index = j * 64 + __builtin_ctzll(summary_word);
+                for (u64 word = b[index]; word != 0; word &= word - 1) {
+                    v.push_back(start_id + index * 64 + __builtin_ctzll(word));
                 }
             }
         }
@@ -27,22 +27,32 @@ const u32 BITMAP_SIZE = 65536;
 const u32 BITMAP_CAPACITY = BITMAP_SIZE * 8;
 // Total number of bitmaps required to hold the entire range of thread IDs
 const u32 MAX_BITMAPS = (1 << 31) / BITMAP_CAPACITY;
+// Every bitmap is followed by a summary with one bit per non-empty 64-bit word
+const u32 BITMAP_WORDS = BITMAP_SIZE / sizeof(u64);
+const u32 SUMMARY_WORDS = BITMAP_WORDS / 64;
+const u32 BITMAP_ALLOC_SIZE = BITMAP_SIZE + SUMMARY_WORDS * sizeof(u64);
 
 
 // ThreadFilter query operations must be lock-free and signal-safe;
-// update operations are mostly lock-free, except rare bitmap allocations
+// update operations are mostly lock-free, except rare bitmap allocations.
+// The summary may have false positives, but never misses a non-empty word,
+// so that collect() touches only the words that contain threads.
 class ThreadFilter {
   private:
-    u32* _bitmap[MAX_BITMAPS];
+    u64* _bitmap[MAX_BITMAPS];
     bool _enabled;
     volatile int _size;
 
-    u32* bitmap(int thread_id) {
+    u64* bitmap(int thread_id) {
         return _bitmap[(u32)thread_id / BITMAP_CAPACITY];
     }
 
-    u32& word(u32* bitmap, int thread_id) {
-        return bitmap[((u32)thread_id % BITMAP_CAPACITY) >> 5];
+    static u32 wordIndex(int thread_id) {
+        return ((u32)thread_id % BITMAP_CAPACITY) >> 6;
+    }
+
+    static u64* summary(u64* bitmap) {
+        return bitmap + BITMAP_WORDS;
     }
 
   public:
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "threadNames.h"
+#include "log.h"
+#include "os.h"
+
+
+ThreadNames::ThreadNames() {
+    memset((void*)_pages, 0, sizeof(_pages));
+    memset((void*)_chunks, 0, sizeof(_chunks));
+
+    // Offset 0 is never used, so that a zero entry means no name
+    _arena_offset = sizeof(jlong);
+    _epoch = 1;
+    _full_reported = false;
+}
+
+ThreadNames::~ThreadNames() {
+    for (u32 i = 0; i < MAX_THREAD_NAME_PAGES; i++) {
+        if (_pages[i] != NULL) {
+            OS::safeFree(_pages[i], THREAD_NAMES_PER_PAGE * sizeof(Entry));
+        }
+    }
+    for (u32 i = 0; i < MAX_NAME_ARENA_CHUNKS; i++) {
+        free(_chunks[i]);
+    }
+}
+
+void ThreadNames::clear() {
+    MutexLocker ml(_lock);
+    _arena_offset = sizeof(jlong);
+    _epoch++;
+    _full_reported = false;
+}
+
+u32 ThreadNames::store(const char* name, jlong java_thread_id) {
+    size_t length = strlen(name);
+    if (length > MAX_THREAD_NAME_LENGTH) {
+        length = MAX_THREAD_NAME_LENGTH;
+    }
+
+    // A record never crosses a chunk boundary; records are aligned for the Java ID
+    u32 size = (u32)(sizeof(jlong) + length + 1 + sizeof(jlong) - 1) & ~(u32)(sizeof(jlong) - 1);
+    u32 offset = _arena_offset;
+    if (offset % NAME_ARENA_CHUNK_SIZE + size > NAME_ARENA_CHUNK_SIZE) {
+        offset = (offset / NAME_ARENA_CHUNK_SIZE + 1) * NAME_ARENA_CHUNK_SIZE;
+    }
+
+    u32 chunk = offset / NAME_ARENA_CHUNK_SIZE;
+    if (chunk >= MAX_NAME_ARENA_CHUNKS) {
+        if (!_full_reported) {
+            Log::warn("Thread name table is full, names of new threads are not recorded until the profiler restarts");
+            _full_reported = true;
+        }
+        return 0;
+    } else if (_chunks[chunk] == NULL && (_chunks[chunk] = (char*)malloc(NAME_ARENA_CHUNK_SIZE)) == NULL) {
+        return 0;
+    }
+
+    char* dst = _chunks[chunk] + offset % NAME_ARENA_CHUNK_SIZE;
+    *(jlong*)dst = java_thread_id;
+    memcpy(dst + sizeof(jlong), name, length);
+    dst[sizeof(jlong) + length] = 0;
+
+    _arena_offset = offset + size;
+    return offset;
+}
+
+void ThreadNames::set(int thread_id, const char* name, jlong java_thread_id) {
+    if ((u32)thread_id >= MAX_NAMED_THREAD_ID) {
+        return;
+    }
+
+    MutexLocker ml(_lock);
+
+    u32 page = (u32)thread_id / THREAD_NAMES_PER_PAGE;
+    if (_pages[page] == NULL) {
+        Entry* entries = (Entry*)OS::safeAlloc(THREAD_NAMES_PER_PAGE * sizeof(Entry));
+        if (entries == NULL) {
+            return;
+        }
+        __atomic_store_n(&_pages[page], entries, __ATOMIC_RELEASE);
+    }
+
+    // Rescanning threads with the same names does not grow the arena
+    Entry* e = &_pages[page][(u32)thread_id % THREAD_NAMES_PER_PAGE];
+    const char* current = nameAt(e->name);
+    if (current != NULL && javaIdOf(current) == java_thread_id && strncmp(current, name, MAX_THREAD_NAME_LENGTH) == 0) {
+        return;
+    }
+
+    u32 offset = store(name, java_thread_id);
+    if (offset != 0) {
+        __atomic_store_n(&e->name, (u64)_epoch << 32 | offset, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _THREADNAMES_H
+#define _THREADNAMES_H
+
+#include <jni.h>
+#include "arch.h"
+#include "mutex.h"
+
+
+// Thread IDs above this limit (PID_MAX_LIMIT on 64-bit Linux) are not named
+const u32 MAX_NAMED_THREAD_ID = 1 << 22;
+const u32 THREAD_NAMES_PER_PAGE = 4096;
+const u32 MAX_THREAD_NAME_PAGES = MAX_NAMED_THREAD_ID / THREAD_NAMES_PER_PAGE;
+
+const u32 NAME_ARENA_CHUNK_SIZE = 65536;
+const u32 MAX_NAME_ARENA_CHUNKS = 256;
+const size_t MAX_THREAD_NAME_LENGTH = 255;
+
+
+// Names and Java IDs of threads in a flat table indexed by native thread ID.
+// Names are copied into an append-only arena once, when a thread starts or gets renamed.
+// An arena record is the Java ID followed by the name, so that both are published by one store.
+// Updates are serialized by a mutex; lookups are lock-free and return pointers into the arena
+// that remain valid until clear(). Entries of the previous epoch are treated as missing,
+// so clear() does not need to touch the table.
+class ThreadNames {
+  private:
+    struct Entry {
+        volatile u64 name;  // epoch << 32 | arena offset of the record
+    };
+
+    Mutex _lock;
+    Entry* volatile _pages[MAX_THREAD_NAME_PAGES];
+    char* volatile _chunks[MAX_NAME_ARENA_CHUNKS];
+    u32 _arena_offset;
+    volatile u32 _epoch;
+    bool _full_reported;
+
+    Entry* entry(int thread_id) {
+        if ((u32)thread_id >= MAX_NAMED_THREAD_ID) {
+            return NULL;
+        }
+        Entry* page = __atomic_load_n(&_pages[(u32)thread_id / THREAD_NAMES_PER_PAGE], __ATOMIC_ACQUIRE);
+        return page != NULL ? &page[(u32)thread_id % THREAD_NAMES_PER_PAGE] : NULL;
+    }
+
+    const char* nameAt(u64 name) {
+        if ((u32)(name >> 32) != _epoch) {
+            return NULL;
+        }
+        u32 offset = (u32)name;
+        return _chunks[offset / NAME_ARENA_CHUNK_SIZE] + offset % NAME_ARENA_CHUNK_SIZE + sizeof(jlong);
+    }
+
+    static jlong javaIdOf(const char* name) {
+        return *(const jlong*)(name - sizeof(jlong));
+    }
+
+    u32 store(const char* name, jlong java_thread_id);
+
+  public:
+    ThreadNames();
+    ~ThreadNames();
+
+    void clear();
+    void set(int thread_id, const char* name, jlong java_thread_id);
+
+    // Returns NULL for unknown threads
+    const char* name(int thread_id) {
+        Entry* e = entry(thread_id);
+        return e != NULL ? nameAt(__atomic_load_n(&e->name, __ATOMIC_ACQUIRE)) : NULL;
+    }
+
+    bool contains(int thread_id) {
+        return name(thread_id) != NULL;
+    }
+
+    // Returns 0 for native threads
+    jlong javaThreadId(int thread_id) {
+        const char* name = this->name(thread_id);
+        return name != NULL ? javaIdOf(name) : 0;
+    }
+};
+
+#endif // _THREADNAMES_H
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <vector>
+#include "threadRegistry.h"
+
+
+volatile u64 ThreadRegistry::_slots[MAX_REGISTERED_THREADS];
+volatile int ThreadRegistry::_high = 0;
+volatile int ThreadRegistry::_count = 0;
+volatile u32 ThreadRegistry::_generation = 0;
+volatile u64 ThreadRegistry::_last_reconcile = 0;
+volatile bool ThreadRegistry::_overflow = false;
+
+
+class RegistryThreadList : public ThreadList {
+  private:
+    int _index;
+
+  public:
+    RegistryThreadList() : _index(0) {
+    }
+
+    void rewind() {
+        _index = 0;
+        ThreadRegistry::reconcileIfStale();
+    }
+
+    int next() {
+        for (int high = ThreadRegistry::high(); _index < high; ) {
+            u32 thread_id = (u32)ThreadRegistry::_slots[_index++];
+            if (thread_id != 0) {
+                return (int)thread_id;
+            }
+        }
+        return -1;
+    }
+
+    int size() {
+        return ThreadRegistry::size();
+    }
+};
+
+
+bool ThreadRegistry::contains(int thread_id) {
+    for (int i = 0, h = high(); i < h; i++) {
+        if ((u32)_slots[i] == (u32)thread_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadRegistry::add(int thread_id) {
+    if (contains(thread_id)) {
+        return;
+    }
+
+    u64 entry = (u64)__sync_add_and_fetch(&_generation, 1) << 32 | (u32)thread_id;
+
+    // Reuse a vacant slot, otherwise append a new one
+    for (int i = 0, h = high(); i < h; i++) {
+        if (_slots[i] == 0 && __sync_bool_compare_and_swap(&_slots[i], 0, entry)) {
+            atomicInc(_count);
+            return;
+        }
+    }
+
+    while (true) {
+        int i = atomicInc(_high);
+        if (i >= MAX_REGISTERED_THREADS) {
+            _overflow = true;
+            return;
+        }
+        if (__sync_bool_compare_and_swap(&_slots[i], 0, entry)) {
+            atomicInc(_count);
+            return;
+        }
+    }
+}
+
+void ThreadRegistry::remove(int thread_id) {
+    for (int i = 0, h = high(); i < h; i++) {
+        u64 entry = _slots[i];
+        if ((u32)entry == (u32)thread_id && __sync_bool_compare_and_swap(&_slots[i], entry, 0)) {
+            atomicInc(_count, -1);
+        }
+    }
+}
+
+void ThreadRegistry::reconcile() {
+    _last_reconcile = OS::nanotime();
+    u32 generation = _generation;
+
+    std::vector<int> live;
+    ThreadList* thread_list = OS::listThreads();
+    for (int tid; (tid = thread_list->next()) != -1; ) {
+        live.push_back(tid);
+    }
+    delete thread_list;
+    std::sort(live.begin(), live.end());
+
+    // Drop exited threads, unless they have been registered after the OS list was taken
+    std::vector<int> registered;
+    for (int i = 0, h = high(); i < h; i++) {
+        u64 entry = _slots[i];
+        int tid = (int)(u32)entry;
+        if (tid == 0) {
+            continue;
+        } else if (std::binary_search(live.begin(), live.end(), tid)) {
+            registered.push_back(tid);
+        } else if ((int)((u32)(entry >> 32) - generation) <= 0 && __sync_bool_compare_and_swap(&_slots[i], entry, 0)) {
+            atomicInc(_count, -1);
+        }
+    }
+    std::sort(registered.begin(), registered.end());
+
+    for (size_t i = 0; i < live.size(); i++) {
+        if (!std::binary_search(registered.begin(), registered.end(), live[i])) {
+            add(live[i]);
+        }
+    }
+}
+
+void ThreadRegistry::reconcileIfStale() {
+    u64 last_reconcile = _last_reconcile;
+    u64 now = OS::nanotime();
+    if (now - last_reconcile >= RECONCILE_INTERVAL && __sync_bool_compare_and_swap(&_last_reconcile, last_reconcile, now)) {
+        reconcile();
+    }
+}
+
+ThreadList* ThreadRegistry::listThreads() {
+    if (_overflow) {
+        return OS::listThreads();
+    }
+    return new RegistryThreadList();
+}
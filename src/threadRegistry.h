@@ -0,0 +1,73 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _THREADREGISTRY_H
+#define _THREADREGISTRY_H
+
+#include "arch.h"
+#include "os.h"
+
+
+// Number of registry slots. Processes with more threads fall back to OS::listThreads()
+const int MAX_REGISTERED_THREADS = 65536;
+
+// How often the registry is compared against /proc/self/task
+const u64 RECONCILE_INTERVAL = 1000000000ULL;  // ns
+
+
+// Live threads of the process, kept up to date by thread start/end hooks
+// (JVMTI ThreadStart/ThreadEnd and the perf_events pthread hook),
+// so that samplers do not have to scan /proc on every pass.
+// Threads created outside these hooks are picked up by an occasional reconciliation.
+//
+// Every slot holds a thread id and the generation at which it was added.
+// Additions and removals are lock-free; reconciliation does not remove
+// slots added after it has started listing the threads.
+class ThreadRegistry {
+  private:
+    static volatile u64 _slots[MAX_REGISTERED_THREADS];
+    static volatile int _high;
+    static volatile int _count;
+    static volatile u32 _generation;
+    static volatile u64 _last_reconcile;
+    static volatile bool _overflow;
+
+    static bool contains(int thread_id);
+
+    static int high() {
+        return _high < MAX_REGISTERED_THREADS ? _high : MAX_REGISTERED_THREADS;
+    }
+
+    friend class RegistryThreadList;
+
+  public:
+    static int size() {
+        return _count;
+    }
+
+    static void add(int thread_id);
+    static void remove(int thread_id);
+
+    // Synchronizes the registry with the list of threads provided by the OS
+    static void reconcile();
+    static void reconcileIfStale();
+
+    // Iterates registered threads; reconciles the registry when a stale list is rewound.
+    // Returns OS::listThreads() if the registry has ever overflowed.
+    static ThreadList* listThreads();
+};
+
+#endif // _THREADREGISTRY_H
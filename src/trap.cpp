@@ -17,13 +17,23 @@
 #include <sys/mman.h>
 #include "trap.h"
 #include "os.h"
+#include "stackFrame.h"
 
 
-uintptr_t Trap::_page_start[TRAP_COUNT] = {0};
+// Marks a slot of a removed trap: lookups continue past it, inserts may reuse it
+static Trap* const TRAP_REMOVED = (Trap*)-1;
 
+uintptr_t Trap::_page_start[MAX_TRAPS] = {0};
+Trap* volatile Trap::_table[TRAP_TABLE_SIZE] = {NULL};
+SigAction Trap::_orig_handler = NULL;
+
+
+static u32 trapSlot(uintptr_t entry) {
+    return (u32)(((u64)entry * 0x9e3779b97f4a7c15ULL) >> 32) & (TRAP_TABLE_SIZE - 1);
+}
 
 bool Trap::isFaultInstruction(uintptr_t pc) {
-    for (int i = 0; i < TRAP_COUNT; i++) {
+    for (int i = 0; i < MAX_TRAPS; i++) {
         if (pc - _page_start[i] < OS::page_size) {
             return true;
         }
@@ -32,6 +42,7 @@ bool Trap::isFaultInstruction(uintptr_t pc) {
 }
 
 void Trap::assign(const void* address, uintptr_t offset) {
+    unregisterEntry();
     _entry = (uintptr_t)address;
     if (_entry == 0) {
         return;
@@ -45,6 +56,66 @@ void Trap::assign(const void* address, uintptr_t offset) {
 
     _saved_insn = *(instruction_t*)_entry;
     _page_start[_id] = _entry & -OS::page_size;
+    registerEntry();
+}
+
+// Traps are registered and removed outside signal handlers, one at a time
+void Trap::registerEntry() {
+    u32 slot = trapSlot(_entry);
+    for (int i = 0; i < TRAP_TABLE_SIZE; i++) {
+        Trap* t = _table[slot];
+        if (t == NULL || t == TRAP_REMOVED) {
+            __atomic_store_n(&_table[slot], this, __ATOMIC_RELEASE);
+            return;
+        }
+        slot = (slot + 1) & (TRAP_TABLE_SIZE - 1);
+    }
+}
+
+void Trap::unregisterEntry() {
+    for (int i = 0; i < TRAP_TABLE_SIZE; i++) {
+        if (_table[i] == this) {
+            __atomic_store_n(&_table[i], TRAP_REMOVED, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+Trap* Trap::find(uintptr_t entry) {
+    u32 slot = trapSlot(entry);
+    for (int i = 0; i < TRAP_TABLE_SIZE; i++) {
+        Trap* t = __atomic_load_n(&_table[slot], __ATOMIC_ACQUIRE);
+        if (t == NULL) {
+            return NULL;
+        } else if (t != TRAP_REMOVED && t->_entry == entry) {
+            return t;
+        }
+        slot = (slot + 1) & (TRAP_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+void Trap::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    StackFrame frame(ucontext);
+    uintptr_t pc = frame.pc();
+
+    // PC points either to BREAKPOINT instruction or to the next one
+    Trap* trap = find(pc);
+    if (trap == NULL) {
+        trap = find(pc - sizeof(instruction_t));
+    }
+
+    if (trap != NULL) {
+        trap->_handler(trap, ucontext);
+    } else if (_orig_handler != NULL) {
+        _orig_handler(signo, siginfo, ucontext);
+    }
+}
+
+void Trap::installSignalHandler() {
+    SigAction orig = OS::installSignalHandler(SIGTRAP, signalHandler);
+    if (orig != (SigAction)SIG_DFL && orig != (SigAction)SIG_IGN && orig != signalHandler) {
+        _orig_handler = orig;
+    }
 }
 
 // Two allocation traps are always enabled/disabled together.
@@ -17,12 +17,23 @@
 #ifndef _TRAP_H
 #define _TRAP_H
 
+#include <signal.h>
 #include <stdint.h>
 #include "arch.h"
+#include "os.h"
 
 
-const int TRAP_COUNT = 4;
+// Trap ids index per-trap state; every trap-based feature gets its own id
+const int MAX_TRAPS = 16;
 
+// Open addressing table from a trap entry address to its Trap; much larger than MAX_TRAPS,
+// so a lookup almost always probes a single slot
+const int TRAP_TABLE_SIZE = 256;
+
+class Trap;
+
+// Called from the SIGTRAP handler when the trap is hit
+typedef void (*TrapHandler)(Trap* trap, void* ucontext);
 
 class Trap {
   private:
@@ -32,22 +43,29 @@ class Trap {
     uintptr_t _entry;
     instruction_t _breakpoint_insn;
     instruction_t _saved_insn;
+    TrapHandler _handler;
 
     bool patch(instruction_t insn);
+    void registerEntry();
+    void unregisterEntry();
 
-    static uintptr_t _page_start[TRAP_COUNT];
+    static uintptr_t _page_start[MAX_TRAPS];
+    static Trap* volatile _table[TRAP_TABLE_SIZE];
+    static SigAction _orig_handler;
+
+    static Trap* find(uintptr_t entry);
 
   public:
-    Trap(int id) : _id(id), _unprotect(true), _protect(WX_MEMORY), _entry(0), _breakpoint_insn(BREAKPOINT) {
+    Trap(int id, TrapHandler handler) : _id(id), _unprotect(true), _protect(WX_MEMORY), _entry(0),
+        _breakpoint_insn(BREAKPOINT), _handler(handler) {
     }
 
     uintptr_t entry() {
         return _entry;
     }
 
-    bool covers(uintptr_t pc) {
-        // PC points either to BREAKPOINT instruction or to the next one
-        return pc - _entry <= sizeof(instruction_t);
+    instruction_t savedInstruction() {
+        return _saved_insn;
     }
 
     void assign(const void* address, uintptr_t offset = BREAKPOINT_OFFSET);
@@ -62,6 +80,11 @@ class Trap {
     }
 
     static bool isFaultInstruction(uintptr_t pc);
+
+    // The only SIGTRAP handler: finds the trap by PC in constant time, regardless of
+    // how many traps are installed, and passes foreign breakpoints to the original handler
+    static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
+    static void installSignalHandler();
 };
 
 #endif // _TRAP_H
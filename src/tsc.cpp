@@ -15,19 +15,43 @@
  */
 
 #include <jvmti.h>
+#include <stdio.h>
+#include <string.h>
 #include "tsc.h"
 #include "vmEntry.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+
+// Calibration period at startup; later calibrations extend the base interval for better precision
+const u64 CALIBRATION_NANOS = 10000000;
 
 bool TSC::_initialized = false;
 bool TSC::_enabled = false;
+bool TSC::_calibrated = false;
 u64 TSC::_offset = 0;
 u64 TSC::_frequency = 1000000000;
+double TSC::_nanos_per_tick = 1.0;
+u64 TSC::_base_ticks = 0;
+u64 TSC::_base_nanos = 0;
 
 
-void TSC::initialize() {
+void TSC::setFrequency(u64 frequency) {
+    _frequency = frequency;
+    _nanos_per_tick = 1e9 / frequency;
+}
+
+// When JFR is available in the JVM, share its time base, so that events of jfrsync
+// recordings and of the profiler are on the same timeline
+bool TSC::initializeFromJvm() {
     JNIEnv* env = VM::jni();
+    if (env == NULL) {
+        return false;
+    }
 
+    bool result = false;
     jfieldID jvm;
     jmethodID getTicksFrequency, counterTime;
     jclass cls = env->FindClass("jdk/jfr/internal/JVM");
@@ -41,11 +65,62 @@ void TSC::initialize() {
             // Default 1GHz frequency might mean that rdtsc is not available
             u64 jvm_ticks = env->CallStaticLongMethod(cls, counterTime);
             _offset = rdtsc() - jvm_ticks;
-            _frequency = frequency;
-            _enabled = true;
+            setFrequency(frequency);
+            result = true;
         }
     }
 
     env->ExceptionClear();
+    return result;
+}
+
+// The counter must tick at a constant rate regardless of frequency scaling and sleep states
+bool TSC::reliable() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || (edx & (1 << 8)) == 0) {
+        return false;
+    }
+
+    // The kernel may have found TSC unstable despite the invariant flag, e.g. on some hypervisors
+    FILE* f = fopen("/sys/devices/system/clocksource/clocksource0/available_clocksource", "r");
+    if (f != NULL) {
+        char buf[256];
+        bool tsc = fgets(buf, sizeof(buf), f) != NULL && strstr(buf, "tsc") != NULL;
+        fclose(f);
+        return tsc;
+    }
+    return true;
+#else
+    return TSC_SUPPORTED;
+#endif
+}
+
+void TSC::initialize() {
+    if (TSC_SUPPORTED) {
+        if (initializeFromJvm()) {
+            _enabled = true;
+        } else if (reliable()) {
+            _offset = 0;
+            _base_ticks = rdtsc();
+            _base_nanos = OS::nanotime();
+            OS::sleep(CALIBRATION_NANOS);
+            _calibrated = true;
+            _enabled = true;
+            recalibrate();
+        }
+    }
     _initialized = true;
 }
+
+// Measures the counter frequency against CLOCK_MONOTONIC since the initial calibration.
+// Should be called when no tick intervals are pending conversion, e.g. before counters are reset
+void TSC::recalibrate() {
+    if (_calibrated) {
+        u64 ticks = rdtsc();
+        u64 nanos = OS::nanotime();
+        if (nanos > _base_nanos && ticks > _base_ticks) {
+            setFrequency((u64)((double)(ticks - _base_ticks) * 1e9 / (nanos - _base_nanos)));
+        }
+    }
+}
@@ -40,6 +40,17 @@ static inline u64 rdtsc() {
     return result;
 }
 
+#elif defined(__aarch64__)
+
+#define TSC_SUPPORTED true
+
+// The generic timer virtual counter runs at a constant frequency on all cores
+static inline u64 rdtsc() {
+    u64 result;
+    asm volatile("mrs %0, cntvct_el0" : "=r" (result));
+    return result;
+}
+
 #else
 
 #define TSC_SUPPORTED false
@@ -48,18 +59,30 @@ static inline u64 rdtsc() {
 #endif
 
 
+// The time source of all engines and the JFR writer. Ticks come from the hardware counter
+// when it runs at a constant rate, otherwise from CLOCK_MONOTONIC; either way, ticks() and
+// the conversions are async signal safe
 class TSC {
   private:
     static bool _initialized;
     static bool _enabled;
+    static bool _calibrated;
     static u64 _offset;
     static u64 _frequency;
+    static double _nanos_per_tick;
+    static u64 _base_ticks;
+    static u64 _base_nanos;
+
+    static bool initializeFromJvm();
+    static bool reliable();
+    static void setFrequency(u64 frequency);
 
   public:
     static void initialize();
+    static void recalibrate();
 
     static bool initialized() {
-        return TSC_SUPPORTED ? _initialized : true;
+        return _initialized;
     }
 
     static bool enabled() {
@@ -73,6 +96,30 @@ class TSC {
     static u64 frequency() {
         return _frequency;
     }
+
+    static u64 toNanos(u64 ticks) {
+        return (u64)(ticks * _nanos_per_tick);
+    }
+
+    static u64 fromNanos(u64 nanos) {
+        return (u64)(nanos / _nanos_per_tick);
+    }
+
+    // Monotonic time in nanoseconds, cheaper than OS::nanotime() where the hardware counter is usable
+    static u64 nanos() {
+        return enabled() ? toNanos(ticks()) : OS::nanotime();
+    }
+};
+
+// Converts CLOCK_MONOTONIC timestamps, e.g. of perf samples, to ticks.
+// Taking one reference point per batch keeps the conversion cheap and consistent within the batch
+struct TimeBase {
+    u64 ticks;
+    u64 nanos;
+
+    u64 toTicks(u64 time) const {
+        return time < nanos ? ticks - TSC::fromNanos(nanos - time) : ticks + TSC::fromNanos(time - nanos);
+    }
 };
 
 #endif // _TSC_H
@@ -26,7 +26,11 @@
 #include "instrument.h"
 #include "lockTracer.h"
 #include "log.h"
+#include "mutex.h"
 #include "objectSampler.h"
+#include "pauseTracker.h"
+#include "symbolCache.h"
+#include "symbols.h"
 #include "vmStructs.h"
 
 
@@ -36,6 +40,9 @@ const int COMMAND_ERROR = 200;
 
 static Arguments _agent_args(true);
 
+// Agent_OnAttach or JNI_OnLoad may come while the preload thread is still initializing
+static Mutex _init_lock;
+
 JavaVM* VM::_vm;
 jvmtiEnv* VM::_jvmti = NULL;
 
@@ -79,6 +86,7 @@ static bool isOpenJ9JitStub(const char* blob_name) {
 
 
 bool VM::init(JavaVM* vm, bool attach) {
+    MutexLocker ml(_init_lock);
     if (_jvmti != NULL) return true;
 
     _vm = vm;
@@ -172,12 +180,16 @@ bool VM::init(JavaVM* vm, bool attach) {
     callbacks.ClassPrepare = ClassPrepare;
     callbacks.ClassFileLoadHook = Instrument::ClassFileLoadHook;
     callbacks.CompiledMethodLoad = Profiler::CompiledMethodLoad;
+    callbacks.CompiledMethodUnload = Profiler::CompiledMethodUnload;
     callbacks.DynamicCodeGenerated = Profiler::DynamicCodeGenerated;
     callbacks.ThreadStart = Profiler::ThreadStart;
     callbacks.ThreadEnd = Profiler::ThreadEnd;
     callbacks.MonitorContendedEnter = LockTracer::MonitorContendedEnter;
     callbacks.MonitorContendedEntered = LockTracer::MonitorContendedEntered;
     callbacks.VMObjectAlloc = ObjectSampler::VMObjectAlloc;
+    callbacks.SampledObjectAlloc = ObjectSampler::SampledObjectAlloc;
+    callbacks.GarbageCollectionStart = PauseTracker::GarbageCollectionStart;
+    callbacks.GarbageCollectionFinish = PauseTracker::GarbageCollectionFinish;
     _jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
 
     _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, NULL);
@@ -195,6 +207,9 @@ bool VM::init(JavaVM* vm, bool attach) {
         if (flag_addr != NULL) {
             *flag_addr = 1;
         }
+
+        // Keeps NMethodCache from returning blobs that no longer exist
+        _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_UNLOAD, NULL);
     }
 
     if (attach) {
@@ -210,6 +225,23 @@ bool VM::init(JavaVM* vm, bool attach) {
     return true;
 }
 
+// Starts the agent dormant: a separate JVM TI environment only waits for VMInit,
+// then the agent is initialized in a background thread the same way as on dynamic attach
+bool VM::preload(JavaVM* vm) {
+    jvmtiEnv* jvmti;
+    if (vm->GetEnv((void**)&jvmti, JVMTI_VERSION_1_0) != 0) {
+        return false;
+    }
+
+    jvmtiEventCallbacks callbacks = {0};
+    callbacks.VMInit = PreloadVMInit;
+    jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, NULL);
+
+    _vm = vm;
+    return true;
+}
+
 // Run late initialization when JVM is ready
 void VM::ready() {
     {
@@ -240,6 +272,11 @@ void* VM::getLibraryHandle(const char* name) {
     return RTLD_DEFAULT;
 }
 
+void JNICALL VM::ClassPrepare(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jclass klass) {
+    loadMethodIDs(jvmti, jni, klass);
+    Instrument::ClassPrepare(jvmti, jni, thread, klass);
+}
+
 void VM::loadMethodIDs(jvmtiEnv* jvmti, JNIEnv* jni, jclass klass) {
     if (VMStructs::hasClassLoaderData()) {
         VMKlass* vmklass = VMKlass::fromJavaClass(jni, klass);
@@ -278,6 +315,13 @@ void VM::restartProfiler() {
     Profiler::instance()->restart(_agent_args);
 }
 
+void VM::rotateProfiler() {
+    Error error = Profiler::instance()->rotate(_agent_args);
+    if (error) {
+        Log::warn("%s", error.message());
+    }
+}
+
 void JNICALL VM::VMInit(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
     ready();
     loadAllMethodIDs(jvmti, jni);
@@ -289,6 +333,37 @@ void JNICALL VM::VMInit(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
     }
 }
 
+void JNICALL VM::PreloadVMInit(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
+    jclass thread_class = jni->FindClass("java/lang/Thread");
+    jmethodID thread_init = thread_class != NULL ? jni->GetMethodID(thread_class, "<init>", "(Ljava/lang/String;)V") : NULL;
+    jobject preload_thread = thread_init != NULL
+        ? jni->NewObject(thread_class, thread_init, jni->NewStringUTF("Async-profiler Preload")) : NULL;
+
+    if (preload_thread == NULL ||
+        jvmti->RunAgentThread(preload_thread, preloadThread, NULL, JVMTI_THREAD_MIN_PRIORITY) != 0) {
+        jni->ExceptionClear();
+        Log::warn("Could not start preload thread, initializing synchronously");
+        preloadThread(jvmti, jni, NULL);
+    }
+}
+
+void JNICALL VM::preloadThread(jvmtiEnv* jvmti, JNIEnv* jni, void* arg) {
+    u64 start_time = OS::nanotime();
+    if (!init(_vm, true)) {
+        Log::error("JVM does not support Tool Interface");
+        return;
+    }
+
+    Profiler::instance()->preload();
+    Log::debug("Agent preloaded in %.3f ms", (OS::nanotime() - start_time) / 1e6);
+
+    // Delayed start of profiler, as in VMInit
+    Error error = Profiler::instance()->run(_agent_args);
+    if (error) {
+        Log::error("%s", error.message());
+    }
+}
+
 void JNICALL VM::VMDeath(jvmtiEnv* jvmti, JNIEnv* jni) {
     Profiler::instance()->shutdown(_agent_args);
 }
@@ -340,6 +415,16 @@ Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
         return ARGUMENTS_ERROR;
     }
 
+    Symbols::setLazyLoading(_agent_args._lazy_symbols);
+    SymbolCache::setDirectory(_agent_args._symbol_cache);
+    if (_agent_args._preload) {
+        if (!VM::preload(vm)) {
+            Log::error("JVM does not support Tool Interface");
+            return COMMAND_ERROR;
+        }
+        return 0;
+    }
+
     if (!VM::init(vm, false)) {
         Log::error("JVM does not support Tool Interface");
         return COMMAND_ERROR;
@@ -363,6 +448,8 @@ Agent_OnAttach(JavaVM* vm, char* options, void* reserved) {
         return ARGUMENTS_ERROR;
     }
 
+    Symbols::setLazyLoading(args._lazy_symbols);
+    SymbolCache::setDirectory(args._symbol_cache);
     if (!VM::init(vm, true)) {
         Log::error("JVM does not support Tool Interface");
         return COMMAND_ERROR;
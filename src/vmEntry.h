@@ -58,6 +58,12 @@ enum ASGCT_CallFrameType {
     BCI_THREAD_ID           = -15,  // method_id designates a thread
     BCI_ERROR               = -16,  // method_id is an error string
     BCI_INSTRUMENT          = -17,  // synthetic method_id that should not appear in the call stack
+    BCI_ADDRESS             = -18,  // native PC in a library whose symbols are not loaded yet
+    BCI_LIVE_OBJECT         = -19,  // not a frame: event type of LiveObjectEvent in FlightRecorder
+    BCI_NATIVE_MALLOC       = -20,  // not a frame: event type of a sampled native allocation
+    BCI_OFF_CPU             = -21,  // not a frame: event type of OffCpuEvent
+    BCI_LATENCY             = -22,  // not a frame: event type of LatencyEvent
+    BCI_GC_PAUSE            = -23,  // not a frame: event type of GCPauseEvent
 };
 
 // See hotspot/src/share/vm/prims/forte.cpp
@@ -128,8 +134,10 @@ class VM {
     static JVM_GetManagement _getManagement;
 
     static bool init(JavaVM* vm, bool attach);
+    static bool preload(JavaVM* vm);
 
     static void restartProfiler();
+    static void rotateProfiler();
 
     static jvmtiEnv* jvmti() {
         return _jvmti;
@@ -163,15 +171,15 @@ class VM {
     }
 
     static void JNICALL VMInit(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
+    static void JNICALL PreloadVMInit(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
+    static void JNICALL preloadThread(jvmtiEnv* jvmti, JNIEnv* jni, void* arg);
     static void JNICALL VMDeath(jvmtiEnv* jvmti, JNIEnv* jni);
 
     static void JNICALL ClassLoad(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jclass klass) {
         // Needed only for AsyncGetCallTrace support
     }
 
-    static void JNICALL ClassPrepare(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jclass klass) {
-        loadMethodIDs(jvmti, jni, klass);
-    }
+    static void JNICALL ClassPrepare(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jclass klass);
 
     static jvmtiError JNICALL RedefineClassesHook(jvmtiEnv* jvmti, jint class_count, const jvmtiClassDefinition* class_definitions);
     static jvmtiError JNICALL RetransformClassesHook(jvmtiEnv* jvmti, jint class_count, const jclass* classes);
@@ -19,6 +19,7 @@
 #include "vmStructs.h"
 #include "vmEntry.h"
 #include "j9Ext.h"
+#include "safeAccess.h"
 
 
 CodeCache* VMStructs::_libjvm = NULL;
@@ -28,6 +29,8 @@ bool VMStructs::_has_method_structs = false;
 bool VMStructs::_has_class_loader_data = false;
 bool VMStructs::_has_native_thread_id = false;
 bool VMStructs::_has_perm_gen = false;
+bool VMStructs::_has_stack_structs = false;
+bool VMStructs::_has_scope_descs = false;
 
 int VMStructs::_klass_name_offset = -1;
 int VMStructs::_symbol_length_offset = -1;
@@ -40,17 +43,31 @@ int VMStructs::_jmethod_ids_offset = -1;
 int VMStructs::_thread_osthread_offset = -1;
 int VMStructs::_thread_anchor_offset = -1;
 int VMStructs::_thread_state_offset = -1;
+int VMStructs::_thread_allocated_bytes_offset = -1;
 int VMStructs::_osthread_id_offset = -1;
 int VMStructs::_anchor_sp_offset = -1;
 int VMStructs::_anchor_pc_offset = -1;
+int VMStructs::_anchor_fp_offset = -1;
+int VMStructs::_call_wrapper_anchor_offset = -1;
 int VMStructs::_frame_size_offset = -1;
 int VMStructs::_frame_complete_offset = -1;
 int VMStructs::_nmethod_name_offset = -1;
 int VMStructs::_nmethod_method_offset = -1;
+int VMStructs::_code_begin_offset = -1;
+int VMStructs::_code_offset = -1;
+int VMStructs::_scopes_pcs_offset = -1;
+int VMStructs::_dependencies_offset = -1;
+int VMStructs::_metadata_offset = -1;
+int VMStructs::_scopes_data_offset = -1;
+int VMStructs::_scopes_data_begin_offset = -1;
+int VMStructs::_unsigned5_base = 0;
 int VMStructs::_method_constmethod_offset = -1;
 int VMStructs::_method_code_offset = -1;
 int VMStructs::_constmethod_constants_offset = -1;
 int VMStructs::_constmethod_idnum_offset = -1;
+int VMStructs::_constmethod_code_size_offset = -1;
+int VMStructs::_constmethod_size = -1;
+int VMStructs::_interpreter_frame_bcp_offset = 0;
 int VMStructs::_pool_holder_offset = -1;
 int VMStructs::_array_data_offset = -1;
 int VMStructs::_code_heap_memory_offset = -1;
@@ -72,6 +89,7 @@ char** VMStructs::_code_heap_addr = NULL;
 const void** VMStructs::_code_heap_low_addr = NULL;
 const void** VMStructs::_code_heap_high_addr = NULL;
 int* VMStructs::_klass_offset_addr = NULL;
+const void** VMStructs::_call_stub_return_addr = NULL;
 
 jfieldID VMStructs::_eetop;
 jfieldID VMStructs::_tid;
@@ -82,6 +100,7 @@ intptr_t VMStructs::_env_offset;
 VMStructs::GetStackTraceFunc VMStructs::_get_stack_trace = NULL;
 VMStructs::LockFunc VMStructs::_lock_func;
 VMStructs::LockFunc VMStructs::_unlock_func;
+volatile int* VMStructs::_safepoint_state = NULL;
 
 
 uintptr_t VMStructs::readSymbol(const char* symbol_name) {
@@ -144,6 +163,16 @@ void VMStructs::initOffsets() {
         } else if (strcmp(type, "CompiledMethod") == 0 || strcmp(type, "nmethod") == 0) {
             if (strcmp(field, "_method") == 0) {
                 _nmethod_method_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_scopes_pcs_offset") == 0) {
+                _scopes_pcs_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_dependencies_offset") == 0) {
+                _dependencies_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_metadata_offset") == 0) {
+                _metadata_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_scopes_data_offset") == 0) {
+                _scopes_data_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_scopes_data_begin") == 0) {
+                _scopes_data_begin_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "Method") == 0) {
             if (strcmp(field, "_constMethod") == 0) {
@@ -156,6 +185,8 @@ void VMStructs::initOffsets() {
                 _constmethod_constants_offset = *(int*)(entry + offset_offset);
             } else if (strcmp(field, "_method_idnum") == 0) {
                 _constmethod_idnum_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_code_size") == 0) {
+                _constmethod_code_size_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "ConstantPool") == 0) {
             if (strcmp(field, "_pool_holder") == 0) {
@@ -185,6 +216,10 @@ void VMStructs::initOffsets() {
             } else if (strcmp(field, "_thread_state") == 0) {
                 _thread_state_offset = *(int*)(entry + offset_offset);
             }
+        } else if (strcmp(type, "Thread") == 0) {
+            if (strcmp(field, "_allocated_bytes") == 0) {
+                _thread_allocated_bytes_offset = *(int*)(entry + offset_offset);
+            }
         } else if (strcmp(type, "OSThread") == 0) {
             if (strcmp(field, "_thread_id") == 0) {
                 _osthread_id_offset = *(int*)(entry + offset_offset);
@@ -194,6 +229,16 @@ void VMStructs::initOffsets() {
                 _anchor_sp_offset = *(int*)(entry + offset_offset);
             } else if (strcmp(field, "_last_Java_pc") == 0) {
                 _anchor_pc_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_last_Java_fp") == 0) {
+                _anchor_fp_offset = *(int*)(entry + offset_offset);
+            }
+        } else if (strcmp(type, "JavaCallWrapper") == 0) {
+            if (strcmp(field, "_anchor") == 0) {
+                _call_wrapper_anchor_offset = *(int*)(entry + offset_offset);
+            }
+        } else if (strcmp(type, "StubRoutines") == 0) {
+            if (strcmp(field, "_call_stub_return_address") == 0) {
+                _call_stub_return_addr = *(const void***)(entry + address_offset);
             }
         } else if (strcmp(type, "CodeBlob") == 0) {
             if (strcmp(field, "_frame_size") == 0) {
@@ -202,6 +247,10 @@ void VMStructs::initOffsets() {
                 _frame_complete_offset = *(int*)(entry + offset_offset);
             } else if (strcmp(field, "_name") == 0) {
                 _nmethod_name_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_code_begin") == 0) {
+                _code_begin_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_code_offset") == 0) {
+                _code_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "CodeCache") == 0) {
             if (strcmp(field, "_heap") == 0) {
@@ -267,7 +316,8 @@ void VMStructs::initOffsets() {
 
         if (strcmp(type, "JVMFlag") == 0 || strcmp(type, "Flag") == 0) {
             _flag_size = *(int*)(entry + size_offset);
-            break;
+        } else if (strcmp(type, "ConstMethod") == 0) {
+            _constmethod_size = *(int*)(entry + size_offset);
         }
     }
 }
@@ -319,10 +369,44 @@ void VMStructs::resolveOffsets() {
         _code_heap_segment_shift < 0 || _code_heap_segment_shift > 16) {
         memset(_code_heap, 0, sizeof(_code_heap));
     }
+
+    // Interpreter frames got a mirror slot in JDK 9, and AArch64 frames an extended SP slot in JDK 21
+    int hotspot_version = VM::hotspot_version();
+#if defined(__aarch64__)
+    _interpreter_frame_bcp_offset = hotspot_version >= 21 ? -9 : hotspot_version >= 9 ? -8 : -7;
+#else
+    _interpreter_frame_bcp_offset = hotspot_version >= 9 ? -8 : -7;
+#endif
+
+    _has_stack_structs = _has_method_structs
+        && (_code_begin_offset >= 0 || _code_offset >= 0)
+        && _frame_size_offset >= 0
+        && _frame_complete_offset >= 0
+        && _thread_anchor_offset >= 0
+        && _anchor_sp_offset >= 0
+        && _anchor_pc_offset >= 0
+        && _anchor_fp_offset >= 0
+        && _call_wrapper_anchor_offset >= 0
+        && _call_stub_return_addr != NULL
+        && _constmethod_code_size_offset >= 0
+        && _constmethod_size > 0
+        && hotspot_version >= 8
+        && _code_heap[0] != NULL
+        && JavaFrameAnchor::hasEntryFrameLayout();
+
+    // nmethod layout was reorganized in JDK 23, and CompressedStream excludes zero bytes since JDK 21
+    _has_scope_descs = _has_stack_structs
+        && _scopes_pcs_offset >= 0
+        && _dependencies_offset >= 0
+        && _metadata_offset >= 0
+        && (_scopes_data_offset >= 0 || _scopes_data_begin_offset >= 0)
+        && hotspot_version <= 22;
+    _unsigned5_base = hotspot_version >= 21 ? 1 : 0;
 }
 
 void VMStructs::initJvmFunctions() {
     _get_stack_trace = (GetStackTraceFunc)_libjvm->findSymbolByPrefix("_ZN8JvmtiEnv13GetStackTraceEP10JavaThreadiiP");
+    _safepoint_state = (volatile int*)_libjvm->findSymbol("_ZN20SafepointSynchronize6_stateE");
 
     if (VM::hotspot_version() == 8) {
         _lock_func = (LockFunc)_libjvm->findSymbol("_ZN7Monitor28lock_without_safepoint_checkEv");
@@ -419,6 +503,100 @@ jmethodID ConstMethod::id() {
     return NULL;
 }
 
+jmethodID ConstMethod::validatedId() {
+    const char* cpool = (const char*)SafeAccess::load((void**) at(_constmethod_constants_offset));
+    if (cpool == NULL || ((uintptr_t)cpool & (sizeof(uintptr_t) - 1)) != 0) {
+        return NULL;
+    }
+    const char* holder = (const char*)SafeAccess::load((void**)(cpool + _pool_holder_offset));
+    if (holder == NULL || ((uintptr_t)holder & (sizeof(uintptr_t) - 1)) != 0) {
+        return NULL;
+    }
+    jmethodID* ids = (jmethodID*)SafeAccess::load((void**)(holder + _jmethod_ids_offset));
+    if (ids == NULL || ((uintptr_t)ids & (sizeof(uintptr_t) - 1)) != 0) {
+        return NULL;
+    }
+    // The ConstantPool pointer next to it has been read, so the header of ConstMethod is mapped
+    unsigned short num = *(unsigned short*) at(_constmethod_idnum_offset);
+    if (num >= (uintptr_t)SafeAccess::load((void**)ids)) {
+        return NULL;
+    }
+    return (jmethodID)SafeAccess::load((void**)(ids + num + 1));
+}
+
+ConstMethod* VMMethod::validatedConstMethod() {
+    if (((uintptr_t)this & (sizeof(uintptr_t) - 1)) != 0 || (uintptr_t)this < 0x1000) {
+        return NULL;
+    }
+
+    // Follow Method -> ConstMethod -> ConstantPool -> holder Klass with loads that tolerate faults
+    const char* cmethod = (const char*)SafeAccess::load((void**) at(_method_constmethod_offset));
+    if (cmethod == NULL || ((uintptr_t)cmethod & (sizeof(uintptr_t) - 1)) != 0) {
+        return NULL;
+    }
+    const char* cpool = (const char*)SafeAccess::load((void**)(cmethod + _constmethod_constants_offset));
+    if (cpool == NULL || ((uintptr_t)cpool & (sizeof(uintptr_t) - 1)) != 0) {
+        return NULL;
+    }
+    if (SafeAccess::load((void**)(cpool + _pool_holder_offset)) == NULL) {
+        return NULL;
+    }
+    return (ConstMethod*)cmethod;
+}
+
+jmethodID VMMethod::validatedId() {
+    ConstMethod* cmethod = validatedConstMethod();
+    return cmethod != NULL ? cmethod->validatedId() : NULL;
+}
+
+ScopeDesc::ScopeDesc(NMethod* nm) {
+    _scopes = nm->scopesData();
+    _scopes_end = (const unsigned char*)CodeHeap::blockEnd(nm);
+    _metadata = nm->metadata(&_metadata_count);
+    if (_scopes < (const unsigned char*)nm || _scopes > _scopes_end || _metadata_count < 0 ||
+        (const unsigned char*)(_metadata + _metadata_count) > _scopes_end) {
+        // Unexpected layout: decode() finds nothing
+        _scopes_end = _scopes;
+        _metadata_count = 0;
+    }
+}
+
+int NMethod::findScopeOffset(const void* pc) {
+    struct PcDesc {
+        int _pc_offset;
+        int _scope_decode_offset;
+        int _obj_decode_offset;
+        int _flags;
+    };
+
+    intptr_t pc_offset = (const char*)pc - codeBegin();
+    if (pc_offset < 0 || pc_offset > 0x7fffffff) {
+        return 0;
+    }
+
+    const PcDesc* pcd = (const PcDesc*) at(*(int*) at(_scopes_pcs_offset));
+    const PcDesc* pcd_end = (const PcDesc*) at(*(int*) at(_dependencies_offset));
+    if (pcd_end <= pcd || (const void*)pcd_end > CodeHeap::blockEnd(this)) {
+        return 0;
+    }
+
+    // PcDescs are sorted by PC; a return address matches exactly, any other PC
+    // belongs to the nearest following descriptor, like in PcDesc lookup of the JVM
+    int low = 0;
+    int high = (int)(pcd_end - pcd) - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (pcd[mid]._pc_offset < pc_offset) {
+            low = mid + 1;
+        } else if (pcd[mid]._pc_offset > pc_offset) {
+            high = mid - 1;
+        } else {
+            return pcd[mid]._scope_decode_offset;
+        }
+    }
+    return pcd + low < pcd_end ? pcd[low]._scope_decode_offset : 0;
+}
+
 NMethod* CodeHeap::findNMethod(char* heap, const void* pc) {
     unsigned char* heap_start = *(unsigned char**)(heap + _code_heap_memory_offset + _vs_low_offset);
     unsigned char* segmap = *(unsigned char**)(heap + _code_heap_segmap_offset + _vs_low_offset);
@@ -21,8 +21,11 @@
 #include <stdint.h>
 #include <string.h>
 #include "codeCache.h"
+#include "safeAccess.h"
 
 
+class NMethod;
+
 class VMStructs {
   protected:
     static CodeCache* _libjvm;
@@ -32,6 +35,8 @@ class VMStructs {
     static bool _has_class_loader_data;
     static bool _has_native_thread_id;
     static bool _has_perm_gen;
+    static bool _has_stack_structs;
+    static bool _has_scope_descs;
 
     static int _klass_name_offset;
     static int _symbol_length_offset;
@@ -44,17 +49,31 @@ class VMStructs {
     static int _thread_osthread_offset;
     static int _thread_anchor_offset;
     static int _thread_state_offset;
+    static int _thread_allocated_bytes_offset;
     static int _osthread_id_offset;
     static int _anchor_sp_offset;
     static int _anchor_pc_offset;
+    static int _anchor_fp_offset;
+    static int _call_wrapper_anchor_offset;
     static int _frame_size_offset;
     static int _frame_complete_offset;
     static int _nmethod_name_offset;
     static int _nmethod_method_offset;
+    static int _code_begin_offset;
+    static int _code_offset;
+    static int _scopes_pcs_offset;
+    static int _dependencies_offset;
+    static int _metadata_offset;
+    static int _scopes_data_offset;
+    static int _scopes_data_begin_offset;
+    static int _unsigned5_base;
     static int _method_constmethod_offset;
     static int _method_code_offset;
     static int _constmethod_constants_offset;
     static int _constmethod_idnum_offset;
+    static int _constmethod_code_size_offset;
+    static int _constmethod_size;
+    static int _interpreter_frame_bcp_offset;
     static int _pool_holder_offset;
     static int _array_data_offset;
     static int _code_heap_memory_offset;
@@ -76,6 +95,7 @@ class VMStructs {
     static const void** _code_heap_low_addr;
     static const void** _code_heap_high_addr;
     static int* _klass_offset_addr;
+    static const void** _call_stub_return_addr;
 
     static jfieldID _eetop;
     static jfieldID _tid;
@@ -86,6 +106,7 @@ class VMStructs {
     typedef void (*LockFunc)(void*);
     static LockFunc _lock_func;
     static LockFunc _unlock_func;
+    static volatile int* _safepoint_state;
 
     static uintptr_t readSymbol(const char* symbol_name);
     static void initOffsets();
@@ -123,6 +144,15 @@ class VMStructs {
         return _tid != NULL;
     }
 
+    // Everything StackWalker::walkJava needs to unwind interpreted and compiled frames
+    static bool hasStackStructs() {
+        return _has_stack_structs;
+    }
+
+    static bool isCallStubReturn(const void* pc) {
+        return _call_stub_return_addr != NULL && pc == *_call_stub_return_addr;
+    }
+
     typedef jvmtiError (*GetStackTraceFunc)(void* self, void* thread,
                                             jint start_depth, jint max_frame_count,
                                             jvmtiFrameInfo* frame_buffer, jint* count_ptr);
@@ -131,6 +161,11 @@ class VMStructs {
     static bool hasDebugSymbols() {
         return _get_stack_trace != NULL;
     }
+
+    // SafepointSynchronize::_state is _synchronizing or _synchronized
+    static bool atSafepoint() {
+        return _safepoint_state != NULL && *_safepoint_state != 0;
+    }
 };
 
 
@@ -228,6 +263,48 @@ class VMKlass : VMStructs {
     }
 };
 
+class JavaFrameAnchor : VMStructs {
+  private:
+    enum {
+        // Slot of JavaCallWrapper* in the entry frame created by StubRoutines::call_stub
+#if defined(__x86_64__)
+        entry_frame_call_wrapper_offset = -6
+#elif defined(__aarch64__)
+        entry_frame_call_wrapper_offset = -8
+#else
+        entry_frame_call_wrapper_offset = 0
+#endif
+    };
+
+  public:
+    static bool hasEntryFrameLayout() {
+        return entry_frame_call_wrapper_offset != 0;
+    }
+
+    // The anchor that was current before Java code was called from the VM
+    // The entry frame is found by a stack walk in a signal handler, so the call wrapper
+    // and the anchor fields are read with loads that tolerate faults
+    static JavaFrameAnchor* fromEntryFrame(uintptr_t fp) {
+        const char* call_wrapper = (const char*)SafeAccess::load((void**)fp + entry_frame_call_wrapper_offset);
+        if (call_wrapper == NULL || ((uintptr_t)call_wrapper & (sizeof(uintptr_t) - 1)) != 0) {
+            return NULL;
+        }
+        return (JavaFrameAnchor*)(call_wrapper + _call_wrapper_anchor_offset);
+    }
+
+    uintptr_t lastJavaSP() {
+        return (uintptr_t)SafeAccess::load((void**) at(_anchor_sp_offset));
+    }
+
+    uintptr_t lastJavaPC() {
+        return (uintptr_t)SafeAccess::load((void**) at(_anchor_pc_offset));
+    }
+
+    uintptr_t lastJavaFP() {
+        return (uintptr_t)SafeAccess::load((void**) at(_anchor_fp_offset));
+    }
+};
+
 class VMThread : VMStructs {
   public:
     static VMThread* current();
@@ -259,6 +336,15 @@ class VMThread : VMStructs {
         return _thread_state_offset >= 0 ? *(int*) at(_thread_state_offset) : 0;
     }
 
+    static bool hasAllocatedBytes() {
+        return _thread_allocated_bytes_offset >= 0;
+    }
+
+    // Bytes in retired TLABs and outside TLABs; the current TLAB is not counted yet
+    u64 allocatedBytes() {
+        return *(u64*) at(_thread_allocated_bytes_offset);
+    }
+
     uintptr_t& lastJavaSP() {
         return *(uintptr_t*) (at(_thread_anchor_offset) + _anchor_sp_offset);
     }
@@ -266,11 +352,27 @@ class VMThread : VMStructs {
     uintptr_t& lastJavaPC() {
         return *(uintptr_t*) (at(_thread_anchor_offset) + _anchor_pc_offset);
     }
+
+    JavaFrameAnchor* anchor() {
+        return (JavaFrameAnchor*) at(_thread_anchor_offset);
+    }
 };
 
 class ConstMethod : VMStructs {
   public:
     jmethodID id();
+
+    // Like id(), but every pointer on the way to the jmethodID is loaded with SafeAccess
+    jmethodID validatedId();
+
+    // Bytecodes immediately follow the ConstMethod structure
+    const char* bytecodes() {
+        return (const char*)this + _constmethod_size;
+    }
+
+    int codeSize() {
+        return *(unsigned short*) at(_constmethod_code_size_offset);
+    }
 };
 
 class VMMethod : VMStructs {
@@ -286,6 +388,12 @@ class VMMethod : VMStructs {
     NMethod* code() {
         return *(NMethod**) at(_method_code_offset);
     }
+
+    // Like constMethod(), but survives a garbage pointer taken from a frame being walked:
+    // returns NULL unless Method -> ConstMethod -> ConstantPool -> holder Klass can be followed
+    ConstMethod* validatedConstMethod();
+
+    jmethodID validatedId();
 };
 
 class NMethod : VMStructs {
@@ -319,6 +427,103 @@ class NMethod : VMStructs {
     VMMethod* method() {
         return *(VMMethod**) at(_nmethod_method_offset);
     }
+
+    const char* codeBegin() {
+        return _code_begin_offset >= 0 ? *(const char**) at(_code_begin_offset) : at(*(int*) at(_code_offset));
+    }
+
+    bool isNativeMethod() {
+        const char* n = name();
+        return n != NULL && strcmp(n, "native nmethod") == 0;
+    }
+
+    // Offset of the innermost ScopeDesc at the given PC in scopes data, or 0 if there is none
+    int findScopeOffset(const void* pc);
+
+    const unsigned char* scopesData() {
+        return _scopes_data_begin_offset >= 0 ? *(const unsigned char**) at(_scopes_data_begin_offset)
+                                              : (const unsigned char*) at(*(int*) at(_scopes_data_offset));
+    }
+
+    // Metadata section is followed by scopes data in all supported versions
+    VMMethod** metadata(int* count) {
+        VMMethod** begin = (VMMethod**) at(*(int*) at(_metadata_offset));
+        *count = (VMMethod**)scopesData() - begin;
+        return begin;
+    }
+
+    static bool hasScopeDescs() {
+        return _has_scope_descs;
+    }
+};
+
+// Decodes debug info of compiled frames: a chain of scopes from the innermost inlined method
+// to the outermost one, as written by DebugInformationRecorder
+class ScopeDesc : VMStructs {
+  private:
+    const unsigned char* _scopes;
+    const unsigned char* _scopes_end;
+    VMMethod** _metadata;
+    int _metadata_count;
+    const unsigned char* _stream;
+    VMMethod* _method;
+    int _bci;
+
+    // UNSIGNED5 encoding of CompressedStream
+    int readInt() {
+        unsigned int c = *_stream++;
+        unsigned int n = c - _unsigned5_base;
+        if (c >= 192) {
+            for (int shift = 6; shift <= 24; shift += 6) {
+                c = *_stream++;
+                n += (c - _unsigned5_base) << shift;
+                if (c < 192) break;
+            }
+        }
+        return n;
+    }
+
+  public:
+    ScopeDesc(NMethod* nm);
+
+    // Returns the offset of the sender (caller) scope, 0 for the outermost one, or -1 on malformed data.
+    // The offset comes from a PcDesc found by a signal handler, so it is checked against the nmethod bounds
+    int decode(int offset) {
+        // Three ints of at most 5 bytes each
+        if (offset <= 0 || offset > _scopes_end - _scopes - 15) {
+            return -1;
+        }
+        _stream = _scopes + offset;
+        int sender_offset = readInt();
+        int method_index = readInt();
+        _bci = readInt() - 1;
+        if (method_index <= 0 || method_index > _metadata_count || sender_offset < 0) {
+            return -1;
+        }
+        _method = _metadata[method_index - 1];
+        return sender_offset;
+    }
+
+    VMMethod* method() {
+        return _method;
+    }
+
+    int bci() {
+        return _bci;
+    }
+};
+
+// HotSpot interpreter frame layout relative to the frame pointer, the same on x86_64 and AArch64
+class InterpreterFrame : VMStructs {
+  public:
+    enum {
+        sender_sp_offset = -1,
+        method_offset = -3
+    };
+
+    static int bcp_offset() {
+        return _interpreter_frame_bcp_offset;
+    }
 };
 
 class CodeHeap : VMStructs {
@@ -349,6 +554,12 @@ class CodeHeap : VMStructs {
              high = _code_heap_high);
     }
 
+    // End of the heap block occupied by the blob
+    static const void* blockEnd(NMethod* nmethod) {
+        const char* block = (const char*)nmethod - 2 * sizeof(size_t);
+        return block + (*(size_t*)block << _code_heap_segment_shift);
+    }
+
     static NMethod* findNMethod(const void* pc) {
         if (contains(_code_heap[0], pc)) return findNMethod(_code_heap[0], pc);
         if (contains(_code_heap[1], pc)) return findNMethod(_code_heap[1], pc);
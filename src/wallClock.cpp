@@ -20,13 +20,23 @@
 #include "wallClock.h"
 #include "profiler.h"
 #include "stackFrame.h"
+#include "threadRegistry.h"
+#include "tsc.h"
 
 
-// Maximum number of threads sampled in one iteration. This limit serves as a throttle
-// when generating profiling signals. Otherwise applications with too many threads may
-// suffer from a big profiling overhead. Also, keeping this limit low enough helps
-// to avoid contention on a spin lock inside Profiler::recordSample().
+// Minimum number of threads sampled in one iteration. The actual number is chosen so that
+// signal handlers triggered by one tick take no more than HANDLER_OVERHEAD_PERCENT
+// of the sampling interval; until the handler cost is known, this conservative limit is used.
+// Otherwise applications with too many threads may suffer from a big profiling overhead.
 const int THREADS_PER_TICK = 8;
+const int MAX_THREADS_PER_TICK = 1024;
+const u64 HANDLER_OVERHEAD_PERCENT = 5;
+
+// Handler cost is recalculated after this many new samples
+const u64 MIN_COST_SAMPLES = 16;
+
+// One more sampler thread for every THREADS_PER_SAMPLER application threads
+const int THREADS_PER_SAMPLER = 1024;
 
 // Set the hard limit for thread walking interval to 100 microseconds.
 // Smaller intervals are practically unusable due to large overhead.
@@ -34,7 +44,11 @@ const long MIN_INTERVAL = 100000;
 
 
 long WallClock::_interval;
+long WallClock::_base_interval;
 bool WallClock::_sample_idle_threads;
+int WallClock::_fixed_budget;
+volatile u64 WallClock::_handler_time;
+volatile u64 WallClock::_handler_calls;
 
 ThreadState WallClock::getThreadState(void* ucontext) {
     StackFrame frame(ucontext);
@@ -58,18 +72,47 @@ ThreadState WallClock::getThreadState(void* ucontext) {
 }
 
 void WallClock::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
-    ExecutionEvent event;
+    u64 start_ticks = TSC::ticks();
+
+    ExecutionEvent event(start_ticks);
     event._thread_state = _sample_idle_threads ? getThreadState(ucontext) : THREAD_RUNNING;
     Profiler::instance()->recordSample(ucontext, _interval, 0, &event);
+
+    atomicInc(_handler_time, TSC::ticks() - start_ticks);
+    atomicInc(_handler_calls);
 }
 
-long WallClock::adjustInterval(long interval, int thread_count) {
-    if (thread_count > THREADS_PER_TICK) {
-        interval /= (thread_count + THREADS_PER_TICK - 1) / THREADS_PER_TICK;
+long WallClock::adjustInterval(long interval, int thread_count, int budget) {
+    if (thread_count > budget) {
+        interval /= (thread_count + budget - 1) / budget;
     }
     return interval;
 }
 
+bool WallClock::isSampler(int thread_id) {
+    for (int i = 0; i < _sampler_count; i++) {
+        if (_samplers[i].thread_id == thread_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int WallClock::threadBudget(u64 handler_cost) {
+    if (_fixed_budget > 0) {
+        return _fixed_budget;
+    } else if (handler_cost == 0) {
+        return THREADS_PER_TICK;
+    }
+
+    // All samplers together should stay within the overhead limit
+    u64 budget = (u64)_interval * HANDLER_OVERHEAD_PERCENT / 100 / handler_cost / _sampler_count;
+    if (budget < THREADS_PER_TICK) {
+        return THREADS_PER_TICK;
+    }
+    return budget < MAX_THREADS_PER_TICK ? (int)budget : MAX_THREADS_PER_TICK;
+}
+
 Error WallClock::start(Arguments& args) {
     if (args._interval < 0) {
         return Error("interval must be positive");
@@ -79,13 +122,34 @@ Error WallClock::start(Arguments& args) {
 
     // Increase default interval for wall clock mode due to larger number of sampled threads
     _interval = args._interval ? args._interval : (_sample_idle_threads ? DEFAULT_INTERVAL * 5 : DEFAULT_INTERVAL);
+    _base_interval = _interval;
+
+    _fixed_budget = args._wall_threads;
+    _handler_time = 0;
+    _handler_calls = 0;
+
+    if (args._wall_samplers > 0) {
+        _sampler_count = args._wall_samplers < MAX_WALL_SAMPLERS ? args._wall_samplers : MAX_WALL_SAMPLERS;
+    } else {
+        _sampler_count = 1 + ThreadRegistry::size() / THREADS_PER_SAMPLER;
+
+        int max_samplers = OS::getCpuCount() < MAX_WALL_SAMPLERS ? OS::getCpuCount() : MAX_WALL_SAMPLERS;
+        if (_sampler_count > max_samplers) _sampler_count = max_samplers;
+    }
 
     OS::installSignalHandler(SIGVTALRM, signalHandler);
 
     _running = true;
 
-    if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
-        return Error("Unable to create timer thread");
+    for (int i = 0; i < _sampler_count; i++) {
+        _samplers[i].engine = this;
+        _samplers[i].index = i;
+        _samplers[i].thread_id = -1;
+        if (pthread_create(&_samplers[i].thread, NULL, threadEntry, &_samplers[i]) != 0) {
+            _sampler_count = i;
+            stop();
+            return Error("Unable to create timer thread");
+        }
     }
 
     return Error::OK;
@@ -93,18 +157,36 @@ Error WallClock::start(Arguments& args) {
 
 void WallClock::stop() {
     _running = false;
-    pthread_kill(_thread, WAKEUP_SIGNAL);
-    pthread_join(_thread, NULL);
+    for (int i = 0; i < _sampler_count; i++) {
+        pthread_kill(_samplers[i].thread, WAKEUP_SIGNAL);
+    }
+    for (int i = 0; i < _sampler_count; i++) {
+        pthread_join(_samplers[i].thread, NULL);
+    }
+}
+
+long WallClock::scaleInterval(double factor) {
+    // Samplers pick up the new interval on the next tick
+    _interval = (long)(_base_interval * factor);
+    return _interval;
 }
 
-void WallClock::timerLoop() {
-    int self = OS::threadId();
+void WallClock::timerLoop(int index) {
+    _samplers[index].thread_id = OS::threadId();
+    int sampler_count = _sampler_count;
+
     ThreadFilter* thread_filter = Profiler::instance()->threadFilter();
     bool thread_filter_enabled = thread_filter->enabled();
+    ThreadFilter* window_threads = Profiler::instance()->windowThreads();
     bool sample_idle_threads = _sample_idle_threads;
 
-    ThreadList* thread_list = OS::listThreads();
-    long long next_cycle_time = OS::nanotime();
+    ThreadList* thread_list = ThreadRegistry::listThreads();
+    ThreadStateReader* state_reader = sample_idle_threads ? NULL : OS::threadStateReader();
+    long long next_cycle_time = TSC::nanos();
+
+    u64 handler_cost = 0;
+    u64 last_handler_time = 0;
+    u64 last_handler_calls = 0;
 
     while (_running) {
         if (!_enabled) {
@@ -112,32 +194,54 @@ void WallClock::timerLoop() {
             continue;
         }
 
+        // Moving average of the signal handler time over the recent samples of all samplers
+        u64 handler_calls = _handler_calls;
+        if (handler_calls - last_handler_calls >= MIN_COST_SAMPLES) {
+            u64 handler_time = _handler_time;
+            u64 cost = TSC::toNanos(handler_time - last_handler_time) / (handler_calls - last_handler_calls);
+            handler_cost = handler_cost == 0 ? cost : (handler_cost * 3 + cost) / 4;
+            last_handler_time = handler_time;
+            last_handler_calls = handler_calls;
+        }
+        int budget = threadBudget(handler_cost);
+
         if (sample_idle_threads) {
             // Try to keep the wall clock interval stable, regardless of the number of profiled threads
-            int estimated_thread_count = thread_filter_enabled ? thread_filter->size() : thread_list->size();
-            next_cycle_time += adjustInterval(_interval, estimated_thread_count);
+            int estimated_thread_count = window_threads != NULL ? window_threads->size()
+                                       : thread_filter_enabled ? thread_filter->size() : thread_list->size();
+            next_cycle_time += adjustInterval(_interval, estimated_thread_count / sampler_count, budget);
         }
 
-        for (int count = 0; count < THREADS_PER_TICK; ) {
+        if (state_reader != NULL) {
+            state_reader->startPass();
+        }
+
+        for (int count = 0; count < budget; ) {
             int thread_id = thread_list->next();
             if (thread_id == -1) {
                 thread_list->rewind();
                 break;
             }
 
-            if (thread_id == self || (thread_filter_enabled && !thread_filter->accept(thread_id))) {
+            if (thread_id % sampler_count != index || isSampler(thread_id) ||
+                (thread_filter_enabled && !thread_filter->accept(thread_id)) ||
+                (window_threads != NULL && !window_threads->accept(thread_id))) {
                 continue;
             }
 
-            if (sample_idle_threads || OS::threadState(thread_id) == THREAD_RUNNING) {
+            if (sample_idle_threads || state_reader->read(thread_id) == THREAD_RUNNING) {
                 if (OS::sendSignalToThread(thread_id, SIGVTALRM)) {
                     count++;
                 }
             }
         }
 
+        if (state_reader != NULL) {
+            state_reader->endPass();
+        }
+
         if (sample_idle_threads) {
-            long long current_time = OS::nanotime();
+            long long current_time = TSC::nanos();
             if (next_cycle_time - current_time > MIN_INTERVAL) {
                 OS::sleep(next_cycle_time - current_time);
             } else {
@@ -149,5 +253,6 @@ void WallClock::timerLoop() {
         }
     }
 
+    delete state_reader;
     delete thread_list;
 }
@@ -24,18 +24,35 @@
 #include "os.h"
 
 
+const int MAX_WALL_SAMPLERS = 4;
+
 class WallClock : public Engine {
   private:
+    // Every sampler signals its own share of threads: those with thread_id % _sampler_count == index
+    struct Sampler {
+        WallClock* engine;
+        int index;
+        volatile int thread_id;
+        pthread_t thread;
+    };
+
     static long _interval;
+    static long _base_interval;
     static bool _sample_idle_threads;
+    static int _fixed_budget;
+    static volatile u64 _handler_time;
+    static volatile u64 _handler_calls;
 
     volatile bool _running;
-    pthread_t _thread;
+    int _sampler_count;
+    Sampler _samplers[MAX_WALL_SAMPLERS];
 
-    void timerLoop();
+    void timerLoop(int index);
+    bool isSampler(int thread_id);
+    int threadBudget(u64 handler_cost);
 
-    static void* threadEntry(void* wall_clock) {
-        ((WallClock*)wall_clock)->timerLoop();
+    static void* threadEntry(void* sampler) {
+        ((Sampler*)sampler)->engine->timerLoop(((Sampler*)sampler)->index);
         return NULL;
     }
 
@@ -43,7 +60,7 @@ class WallClock : public Engine {
 
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
 
-    static long adjustInterval(long interval, int thread_count);
+    static long adjustInterval(long interval, int thread_count, int budget);
 
   public:
     const char* title() {
@@ -56,6 +73,7 @@ class WallClock : public Engine {
 
     Error start(Arguments& args);
     void stop();
+    long scaleInterval(double factor);
 };
 
 #endif // _WALLCLOCK_H
@@ -0,0 +1,89 @@
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.concurrent.atomic.AtomicLong;
+
+// Mixed CPU, allocation and lock workload that reports its own throughput.
+// Run it with and without the profiler to see the application slowdown.
+// Usage: java ThroughputTarget <threads> <warmup seconds> <measure seconds>
+public class ThroughputTarget {
+    private static final Object lock = new Object();
+    private static final AtomicLong operations = new AtomicLong();
+    private static volatile boolean running = true;
+    private static volatile Object sink;
+    private static long shared;
+
+    private static long compute(long seed) {
+        long x = seed;
+        for (int i = 0; i < 2000; i++) {
+            x = x * 6364136223846793005L + 1442695040888963407L;
+            x ^= x >>> 29;
+        }
+        return x;
+    }
+
+    private static void allocate(long seed) {
+        List<Object> list = new ArrayList<>();
+        for (int i = 0; i < 16; i++) {
+            list.add(new long[16 + (int) (seed & 63)]);
+        }
+        Map<Long, Object> map = new HashMap<>();
+        map.put(seed, list);
+        sink = map;
+    }
+
+    private static void contend(long seed) {
+        synchronized (lock) {
+            shared += seed;
+        }
+    }
+
+    private static void recurse(int depth, long seed) {
+        if (depth > 0) {
+            recurse(depth - 1, seed + depth);
+            return;
+        }
+        long x = compute(seed);
+        allocate(x);
+        if ((x & 7) == 0) {
+            contend(x);
+        }
+    }
+
+    public static void main(String[] args) throws Exception {
+        int threadCount = args.length > 0 ? Integer.parseInt(args[0]) : 4;
+        int warmup = args.length > 1 ? Integer.parseInt(args[1]) : 5;
+        int duration = args.length > 2 ? Integer.parseInt(args[2]) : 10;
+
+        Thread[] threads = new Thread[threadCount];
+        for (int i = 0; i < threadCount; i++) {
+            final int id = i;
+            threads[i] = new Thread("Worker-" + i) {
+                @Override
+                public void run() {
+                    long seed = id;
+                    while (running) {
+                        recurse((int) (seed & 31), seed++);
+                        operations.incrementAndGet();
+                    }
+                }
+            };
+            threads[i].start();
+        }
+
+        Thread.sleep(warmup * 1000L);
+        long start = System.nanoTime();
+        long startOps = operations.get();
+        Thread.sleep(duration * 1000L);
+        long ops = operations.get() - startOps;
+        long time = System.nanoTime() - start;
+
+        running = false;
+        for (Thread thread : threads) {
+            thread.join();
+        }
+
+        System.out.printf("ops/s %.0f%n", ops * 1e9 / time);
+    }
+}
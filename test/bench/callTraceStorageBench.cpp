@@ -0,0 +1,118 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures CallTraceStorage::put throughput when several threads record samples concurrently,
+// as signal handlers on different CPUs do. Stacks share deep common prefixes like real ones,
+// and a small fraction of new traces keeps the table growing during the run
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "callTraceStorage.h"
+#include "os.h"
+
+
+static const int DISTINCT_TRACES = 20000;
+static const int MIN_DEPTH = 16;
+static const int MAX_DEPTH = 96;
+static const int PUTS_PER_THREAD = 2000000;
+static const int MAX_THREADS = 16;
+
+struct Trace {
+    int num_frames;
+    ASGCT_CallFrame frames[MAX_DEPTH];
+};
+
+static Trace* traces;
+static CallTraceStorage* storage;
+
+// Keeps the compiler from optimizing puts away
+volatile u32 sink;
+
+static void generateTraces() {
+    traces = new Trace[DISTINCT_TRACES];
+    for (int i = 0; i < DISTINCT_TRACES; i++) {
+        Trace* t = &traces[i];
+        t->num_frames = MIN_DEPTH + rand() % (MAX_DEPTH - MIN_DEPTH);
+        for (int j = 0; j < t->num_frames; j++) {
+            // Outer frames (at the end of the array) come from a small set of methods
+            int depth_from_root = t->num_frames - 1 - j;
+            int fanout = depth_from_root < 8 ? 2 : 64;
+            t->frames[j].bci = rand() % 100;
+            t->frames[j].method_id = (jmethodID)(uintptr_t)(0x10000 + depth_from_root * 1000 + rand() % fanout);
+        }
+    }
+}
+
+static void* putLoop(void* arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    u32 result = 0;
+    for (int i = 0; i < PUTS_PER_THREAD; i++) {
+        // Skewed towards hot traces: half of the samples hit 1% of the traces
+        int index = (i & 1) ? rand_r(&seed) % (DISTINCT_TRACES / 100) : rand_r(&seed) % DISTINCT_TRACES;
+        Trace* t = &traces[index];
+        result += storage->put(t->num_frames, t->frames, 1);
+    }
+    sink = result;
+    return NULL;
+}
+
+static double run(int thread_count, bool use_trie) {
+    storage = new CallTraceStorage();
+    storage->useFrameTrie(use_trie);
+
+    pthread_t threads[MAX_THREADS];
+    u64 start = OS::nanotime();
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i], NULL, putLoop, (void*)(uintptr_t)(i + 1));
+    }
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    u64 time = OS::nanotime() - start;
+
+    std::vector<CallTraceSample*> samples;
+    storage->collectSamples(samples);
+    u64 total = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        total += samples[i]->samples;
+    }
+    delete storage;
+
+    if (total != (u64)PUTS_PER_THREAD * thread_count) {
+        fprintf(stderr, "Lost samples: %llu of %llu\n", (unsigned long long)total,
+                (unsigned long long)PUTS_PER_THREAD * thread_count);
+        exit(1);
+    }
+
+    // Aggregate throughput of all threads
+    return (double)PUTS_PER_THREAD * thread_count * 1000 / time;
+}
+
+int main() {
+    srand(1);
+    generateTraces();
+
+    printf("%8s %18s %18s\n", "threads", "flat, Mputs/s", "trie, Mputs/s");
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double flat = run(threads, false);
+        double trie = run(threads, true);
+        printf("%8d %18.2f %18.2f\n", threads, flat, trie);
+    }
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the cost of finding a native library by address:
+// linear scan over CodeCache array vs. CodeCacheIndex binary search
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "codeCache.cpp"
+#include "linearAllocator.cpp"
+#include "os_linux.cpp"
+#include "os_macos.cpp"
+
+
+static const int LOOKUPS = 10000000;
+static const uintptr_t LIB_SIZE = 0x10000;
+static const uintptr_t LIB_GAP = 0x1000;
+
+static CodeCache* linearSearch(CodeCache** libs, int count, const void* address) {
+    for (int i = 0; i < count; i++) {
+        if (libs[i]->contains(address)) {
+            return libs[i];
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    printf("%8s %14s %14s\n", "libs", "linear, ns", "index, ns");
+
+    for (int count = 16; count <= 2048; count *= 2) {
+        CodeCache** libs = new CodeCache*[count];
+        for (int i = 0; i < count; i++) {
+            // Libraries are not necessarily loaded in the address order
+            uintptr_t base = 0x7f0000000000ULL + ((i * 7919) % count) * (LIB_SIZE + LIB_GAP);
+            libs[i] = new CodeCache("lib", i, (const void*)base, (const void*)(base + LIB_SIZE));
+        }
+
+        CodeCacheIndex index;
+        index.update(libs, count);
+
+        const void** addresses = new const void*[1024];
+        srand(count);
+        for (int i = 0; i < 1024; i++) {
+            addresses[i] = (const char*)libs[rand() % count]->minAddress() + rand() % LIB_SIZE;
+        }
+
+        u64 found = 0;
+        u64 start = OS::nanotime();
+        for (int i = 0; i < LOOKUPS; i++) {
+            found += linearSearch(libs, count, addresses[i & 1023]) != NULL;
+        }
+        u64 linear_time = OS::nanotime() - start;
+
+        start = OS::nanotime();
+        for (int i = 0; i < LOOKUPS; i++) {
+            found += index.find(addresses[i & 1023]) != NULL;
+        }
+        u64 index_time = OS::nanotime() - start;
+
+        if (found != 2ULL * LOOKUPS) {
+            fprintf(stderr, "Lookup failed for %d libraries\n", count);
+            return 1;
+        }
+
+        printf("%8d %14.2f %14.2f\n", count, (double)linear_time / LOOKUPS, (double)index_time / LOOKUPS);
+
+        for (int i = 0; i < count; i++) {
+            delete libs[i];
+        }
+        delete[] libs;
+        delete[] addresses;
+    }
+
+    return 0;
+}
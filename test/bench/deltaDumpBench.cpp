@@ -0,0 +1,116 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Collects deltas in a loop while several threads keep calling CallTraceStorage::put,
+// like periodic delta dumps of a running profiler do. New traces keep the table growing,
+// so deltas also come from several generations. The sum of all deltas must match
+// the number of puts exactly: an increment may go to either delta, but never to both or none
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "callTraceStorage.h"
+#include "os.h"
+
+
+static const int DISTINCT_TRACES = 200000;
+static const int DEPTH = 32;
+static const int PUTS_PER_THREAD = 4000000;
+static const int THREADS = 4;
+
+struct Trace {
+    ASGCT_CallFrame frames[DEPTH];
+};
+
+static Trace* traces;
+static CallTraceStorage* storage;
+static volatile int running;
+
+static void generateTraces() {
+    traces = new Trace[DISTINCT_TRACES];
+    for (int i = 0; i < DISTINCT_TRACES; i++) {
+        for (int j = 0; j < DEPTH; j++) {
+            traces[i].frames[j].bci = j;
+            traces[i].frames[j].method_id = (jmethodID)(uintptr_t)(0x10000 + (j == 0 ? i : rand() % 64));
+        }
+    }
+}
+
+static void* putLoop(void* arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    for (int i = 0; i < PUTS_PER_THREAD; i++) {
+        // Hot traces are updated in every epoch, the rest appear gradually
+        int index = (i & 1) ? rand_r(&seed) % 100 : (int)((u64)i * DISTINCT_TRACES / PUTS_PER_THREAD);
+        storage->put(DEPTH, traces[index].frames, 1);
+    }
+    __sync_fetch_and_sub(&running, 1);
+    return NULL;
+}
+
+// Every put() adds 1 to both samples and counter. Within one delta they may differ
+// by the puts in progress, but the sums over all deltas must be the same
+static void collect(u64& samples, u64& counter, u64& time) {
+    std::vector<CallTraceSample> deltas;
+    u64 start = OS::nanotime();
+    storage->collectDeltas(deltas);
+    time += OS::nanotime() - start;
+
+    for (size_t i = 0; i < deltas.size(); i++) {
+        samples += deltas[i].samples;
+        counter += deltas[i].counter;
+    }
+}
+
+int main() {
+    srand(1);
+    generateTraces();
+    storage = new CallTraceStorage();
+
+    running = THREADS;
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, putLoop, (void*)(uintptr_t)(i + 1));
+    }
+
+    u64 samples = 0;
+    u64 counter = 0;
+    u64 time = 0;
+    int dumps = 0;
+    while (running > 0) {
+        collect(samples, counter, time);
+        dumps++;
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // A put() that started before an epoch switch may list its slot after the drain;
+    // such slots wait for the next epoch of the same parity, so both lists are drained
+    collect(samples, counter, time);
+    collect(samples, counter, time);
+    dumps += 2;
+
+    u64 expected = (u64)PUTS_PER_THREAD * THREADS;
+    printf("%d delta dumps, %.2f us per dump\n", dumps, time / 1000.0 / dumps);
+    if (samples != expected || counter != expected) {
+        fprintf(stderr, "Sum of deltas: %llu samples, %llu counter, expected %llu\n", (unsigned long long)samples,
+                (unsigned long long)counter, (unsigned long long)expected);
+        return 1;
+    }
+
+    delete storage;
+    return 0;
+}
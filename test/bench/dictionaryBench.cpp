@@ -0,0 +1,115 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures Dictionary::lookup on class names shaped like those of an application
+// with many generated classes (lambdas, proxies): first insertion of all keys,
+// then repeated lookups of existing keys, as allocation samples do with _class_map
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dictionary.h"
+#include "os.h"
+
+
+static const int LOOKUPS = 5000000;
+
+// Keeps the compiler from optimizing lookups away
+volatile unsigned int sink;
+
+static char** generateKeys(int count) {
+    static const char* const packages[] = {
+        "java/lang/", "java/util/concurrent/", "org/springframework/beans/factory/support/",
+        "com/fasterxml/jackson/databind/deser/", "io/netty/buffer/", "com/example/service/impl/"
+    };
+
+    char** keys = new char*[count];
+    for (int i = 0; i < count; i++) {
+        char buf[128];
+        const char* package = packages[i % 6];
+        switch (i % 3) {
+            case 0:
+                snprintf(buf, sizeof(buf), "%sGeneratedClass%d", package, i);
+                break;
+            case 1:
+                snprintf(buf, sizeof(buf), "%sHandler$$Lambda$%d/0x%016llx", package, i,
+                         (unsigned long long)(0x800000000ULL + i * 0x248ULL));
+                break;
+            default:
+                snprintf(buf, sizeof(buf), "jdk/proxy%d/$Proxy%d", i % 16, i);
+                break;
+        }
+        keys[i] = strdup(buf);
+    }
+    return keys;
+}
+
+int main() {
+    srand(1);
+
+    printf("%10s %16s %16s\n", "keys", "insert, ns", "lookup, ns");
+
+    for (int count = 1000; count <= 1000000; count *= 10) {
+        char** keys = generateKeys(count);
+        size_t* lengths = new size_t[count];
+        for (int i = 0; i < count; i++) {
+            lengths[i] = strlen(keys[i]);
+        }
+
+        int* order = new int[LOOKUPS];
+        for (int i = 0; i < LOOKUPS; i++) {
+            order[i] = rand() % count;
+        }
+
+        Dictionary* dict = new Dictionary();
+
+        u64 start = OS::nanotime();
+        for (int i = 0; i < count; i++) {
+            sink = dict->lookup(keys[i], lengths[i]);
+        }
+        u64 insert_time = OS::nanotime() - start;
+
+        unsigned int result = 0;
+        start = OS::nanotime();
+        for (int i = 0; i < LOOKUPS; i++) {
+            int k = order[i];
+            result += dict->lookup(keys[k], lengths[k]);
+        }
+        u64 lookup_time = OS::nanotime() - start;
+        sink = result;
+
+        // Every key must map to a distinct id
+        std::map<unsigned int, const char*> map;
+        dict->collect(map);
+        if (map.size() != (size_t)count) {
+            fprintf(stderr, "Expected %d keys, found %d\n", count, (int)map.size());
+            return 1;
+        }
+
+        printf("%10d %16.2f %16.2f\n", count, (double)insert_time / count, (double)lookup_time / LOOKUPS);
+
+        delete dict;
+        for (int i = 0; i < count; i++) {
+            free(keys[i]);
+        }
+        delete[] keys;
+        delete[] lengths;
+        delete[] order;
+    }
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the dump side of CallTraceStorage: collectSamples over large tables,
+// and the pass over the frames of every collected sample, like the one that resolves
+// frame names before formatting. Hash slots of the samples are scattered over the table
+// as in a long profiling session. The last columns compare selecting the top traces
+// of a text dump from a flat copy of the samples with sorting the whole copy
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "callTraceStorage.h"
+#include "os.h"
+
+
+static const int DEPTH = 16;
+static const int RUNS = 5;
+static const int TOP = 200;
+
+// Keeps the compiler from optimizing the frame pass away
+volatile u64 sink;
+
+static CallTraceStorage* fill(int trace_count) {
+    CallTraceStorage* storage = new CallTraceStorage();
+    ASGCT_CallFrame frames[DEPTH];
+    for (int i = 0; i < trace_count; i++) {
+        for (int j = 0; j < DEPTH; j++) {
+            frames[j].bci = j;
+            frames[j].method_id = (jmethodID)(uintptr_t)(0x10000 + (j == 0 ? rand() : rand() % 64));
+        }
+        storage->put(DEPTH, frames, 1 + rand() % 1000);
+    }
+    return storage;
+}
+
+static u64 framePass(CallTraceStorage* storage, std::vector<CallTraceSample*>& samples) {
+    std::vector<ASGCT_CallFrame> buf;
+    u64 result = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        int num_frames;
+        ASGCT_CallFrame* frames = storage->frames(samples[i], buf, num_frames);
+        result += (uintptr_t)frames[num_frames - 1].method_id;
+    }
+    return result;
+}
+
+int main() {
+    srand(1);
+
+    printf("%10s %16s %16s %16s %16s\n", "traces", "collect, ns/tr", "frames, ns/tr", "top, ns/tr", "sort, ns/tr");
+    for (int trace_count = 16384; trace_count <= 1048576; trace_count *= 4) {
+        CallTraceStorage* storage = fill(trace_count);
+
+        u64 collect_time = 0;
+        u64 frames_time = 0;
+        u64 top_time = 0;
+        u64 sort_time = 0;
+        size_t collected = 0;
+        for (int run = 0; run < RUNS; run++) {
+            std::vector<CallTraceSample*> samples;
+            u64 start = OS::nanotime();
+            storage->collectSamples(samples);
+            u64 collected_time = OS::nanotime();
+            sink = framePass(storage, samples);
+            u64 end = OS::nanotime();
+
+            collect_time += collected_time - start;
+            frames_time += end - collected_time;
+            collected = samples.size();
+
+            std::vector<CallTraceSample> copy;
+            start = OS::nanotime();
+            storage->collectSamples(copy);
+            std::partial_sort(copy.begin(), copy.begin() + TOP, copy.end());
+            top_time += OS::nanotime() - start;
+            sink = copy[0].counter;
+
+            copy.clear();
+            start = OS::nanotime();
+            storage->collectSamples(copy);
+            std::sort(copy.begin(), copy.end());
+            sort_time += OS::nanotime() - start;
+            sink = copy[0].counter;
+        }
+        delete storage;
+
+        if (collected < (size_t)trace_count * 9 / 10) {
+            fprintf(stderr, "Collected %d of %d traces\n", (int)collected, trace_count);
+            exit(1);
+        }
+        printf("%10d %16.2f %16.2f %16.2f %16.2f\n", trace_count, (double)collect_time / RUNS / collected,
+               (double)frames_time / RUNS / collected, (double)top_time / RUNS / collected,
+               (double)sort_time / RUNS / collected);
+    }
+
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the FrameDesc lookup cost of walkDwarf depending on the walk depth:
+// plain binary search over the DWARF table vs. the two-level block index
+// vs. the block index behind a per-slot FrameDescCache
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "codeCache.cpp"
+#include "linearAllocator.cpp"
+#include "os_linux.cpp"
+#include "os_macos.cpp"
+
+
+static const int LIBS = 8;
+static const int FRAMES_PER_LIB = 100000;
+static const int HOT_STACKS = 1000;
+static const int MAX_DEPTH = 128;
+static const int WALKS = 200000;
+
+// Keeps the compiler from optimizing lookups away
+volatile intptr_t sink;
+
+static FrameDesc* binarySearch(CodeCache* cc, const void* pc) {
+    FrameDesc* table = cc->dwarfTable();
+    u32 target_loc = (const char*)pc - cc->textBase();
+    int low = 0;
+    int high = cc->dwarfTableLength() - 1;
+
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (table[mid].loc < target_loc) {
+            low = mid + 1;
+        } else if (table[mid].loc > target_loc) {
+            high = mid - 1;
+        } else {
+            return &table[mid];
+        }
+    }
+
+    return low > 0 ? &table[low - 1] : NULL;
+}
+
+static CodeCache* createLibrary(int index) {
+    const char* base = (const char*)(0x7f0000000000ULL + (uintptr_t)index * 0x10000000);
+    FrameDesc* table = (FrameDesc*)malloc(FRAMES_PER_LIB * sizeof(FrameDesc));
+    u32 loc = 0x1000;
+    for (int i = 0; i < FRAMES_PER_LIB; i++) {
+        // Mostly short functions with an occasional large gap
+        loc += rand() % 100 == 0 ? 0x10000 + rand() % 0x10000 : 1 + rand() % 64;
+        table[i].loc = loc;
+        table[i].cfa = i;
+        table[i].fp_off = 0;
+    }
+
+    CodeCache* cc = new CodeCache("lib", index, base, base + loc + 0x1000);
+    cc->setTextBase(base);
+    cc->setDwarfTable(table, FRAMES_PER_LIB);
+    return cc;
+}
+
+int main() {
+    srand(1);
+
+    CodeCache* libs[LIBS];
+    for (int i = 0; i < LIBS; i++) {
+        libs[i] = createLibrary(i);
+    }
+
+    CodeCacheIndex index;
+    index.update(libs, LIBS);
+
+    // Return addresses at each depth come from a pool of call sites:
+    // leaf frames vary the most, outer frames are shared by many stacks
+    const void** sites = new const void*[MAX_DEPTH * HOT_STACKS];
+    for (int i = 0; i < MAX_DEPTH * HOT_STACKS; i++) {
+        CodeCache* cc = libs[rand() % LIBS];
+        const char* first = cc->textBase() + cc->dwarfTable()[0].loc;
+        sites[i] = first + rand() % ((const char*)cc->maxAddress() - first);
+    }
+
+    const void** stacks = new const void*[HOT_STACKS * MAX_DEPTH];
+    for (int i = 0; i < HOT_STACKS; i++) {
+        for (int d = 0; d < MAX_DEPTH; d++) {
+            int pool = HOT_STACKS >> (d < 8 ? d : 8);
+            stacks[i * MAX_DEPTH + d] = sites[d * HOT_STACKS + rand() % pool];
+        }
+    }
+
+    for (int i = 0; i < MAX_DEPTH * HOT_STACKS; i++) {
+        CodeCache* cc = index.find(sites[i]);
+        if (cc->findFrameDesc(sites[i]) != binarySearch(cc, sites[i])) {
+            printf("Lookup mismatch at %p\n", sites[i]);
+            return 1;
+        }
+    }
+
+    FrameDescCache* cache = new FrameDescCache();
+    int* order = new int[WALKS];
+    for (int i = 0; i < WALKS; i++) {
+        order[i] = rand() % HOT_STACKS;
+    }
+
+    printf("%8s %14s %14s %14s\n", "depth", "search, ns", "blocks, ns", "cached, ns");
+
+    for (int depth = 4; depth <= MAX_DEPTH; depth *= 2) {
+        u64 ns[3];
+
+        for (int mode = 0; mode < 3; mode++) {
+            u64 start = OS::nanotime();
+            for (int w = 0; w < WALKS; w++) {
+                const void** stack = stacks + order[w] * MAX_DEPTH;
+                if (mode == 2) {
+                    cache->validate(index.generation());
+                }
+                for (int d = 0; d < depth; d++) {
+                    const void* pc = stack[d];
+                    FrameDesc* f = mode == 2 ? cache->lookup(pc) : NULL;
+                    if (f == NULL) {
+                        CodeCache* cc = index.find(pc);
+                        f = mode == 0 ? binarySearch(cc, pc) : cc->findFrameDesc(pc);
+                        if (mode == 2) {
+                            cache->put(pc, f);
+                        }
+                    }
+                    sink = f->cfa;
+                }
+            }
+            ns[mode] = (OS::nanotime() - start) / WALKS;
+        }
+
+        printf("%8d %14llu %14llu %14llu\n", depth,
+               (unsigned long long)ns[0], (unsigned long long)ns[1], (unsigned long long)ns[2]);
+    }
+
+    return 0;
+}
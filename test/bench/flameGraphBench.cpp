@@ -0,0 +1,114 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the flame graph dump of a recorded corpus: building the tree from CallTraceStorage
+// the same way Profiler::dumpFlameGraph does, and printing it as HTML flame graph and as tree.
+// Frames are native, so that frame names are resolved without a JVM
+
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "callTraceStorage.h"
+#include "flameGraph.h"
+#include "frameName.h"
+#include "log.h"
+#include "os.h"
+#include "threadNames.h"
+
+
+static const int DISTINCT_TRACES = 20000;
+static const int METHODS = 20000;
+static const int MIN_DEPTH = 10;
+static const int MAX_DEPTH = 64;
+static const int ROUNDS = 5;
+
+static char* method_names[METHODS];
+
+static void recordCorpus(CallTraceStorage& storage) {
+    for (int i = 0; i < METHODS; i++) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "com/example/module%d/Class%d.method%d", i % 50, i / 10, i % 10);
+        method_names[i] = strdup(buf);
+    }
+
+    ASGCT_CallFrame frames[MAX_DEPTH];
+    for (int i = 0; i < DISTINCT_TRACES; i++) {
+        int num_frames = MIN_DEPTH + rand() % (MAX_DEPTH - MIN_DEPTH);
+        for (int j = 0; j < num_frames; j++) {
+            // Methods near the root are shared by most traces
+            int depth_from_root = num_frames - 1 - j;
+            int range = depth_from_root < 5 ? 3 : METHODS;
+            frames[j].bci = BCI_NATIVE_FRAME;
+            frames[j].method_id = (jmethodID)method_names[(depth_from_root * 997 + rand() % range) % METHODS];
+        }
+        storage.put(num_frames, frames, 1 + rand() % 100);
+    }
+}
+
+static u64 dump(CallTraceStorage& storage, Arguments& args, ThreadNames& thread_names, bool tree, size_t* size) {
+    u64 start = OS::nanotime();
+
+    FlameGraph flamegraph("Benchmark", args._counter, args._minwidth, args._reverse);
+    FrameName fn(args, args._style | STYLE_ANNOTATE, thread_names);
+
+    std::vector<CallTraceSample*> samples;
+    storage.collectSamples(samples);
+    std::vector<ASGCT_CallFrame> frame_buf;
+
+    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        CallTrace* trace = (*it)->trace;
+        ASGCT_CallFrame* frames = storage.frames(trace, frame_buf);
+
+        u32 f = FlameGraph::ROOT;
+        for (int j = trace->num_frames - 1; j >= 0; j--) {
+            f = flamegraph.addChild(f, flamegraph.frameId(fn, frames[j]), (*it)->samples);
+        }
+        flamegraph.addLeaf(f, (*it)->samples);
+    }
+
+    std::ostringstream out;
+    flamegraph.dump(out, tree);
+    *size = out.str().size();
+
+    return OS::nanotime() - start;
+}
+
+int main() {
+    Log::open(NULL, "warn");
+    srand(1);
+
+    CallTraceStorage storage;
+    storage.useFrameTrie(true);
+    recordCorpus(storage);
+
+    Arguments args;
+    ThreadNames thread_names;
+
+    printf("%10s %14s %14s\n", "output", "dump, ms", "size, KB");
+    for (int tree = 0; tree <= 1; tree++) {
+        u64 best = (u64)-1;
+        size_t size = 0;
+        for (int r = 0; r < ROUNDS; r++) {
+            u64 time = dump(storage, args, thread_names, tree != 0, &size);
+            if (time < best) best = time;
+        }
+        printf("%10s %14.2f %14llu\n", tree ? "tree" : "flamegraph", best / 1e6, (unsigned long long)size / 1024);
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Measures how long the profiler's signal handler takes per execution sample.
+# Runs ThroughputTarget under the common setups, cpu with JFR output and wall with collapsed output,
+# and prints the handler time per sample from the self-profiling counters of the status command:
+# the whole handler, and the native and Java stack walks within it.
+#
+# Environment: THREADS (default 4), WARMUP and DURATION in seconds (default 5 and 10),
+# INTERVAL of the sampled events (default 1ms)
+
+set -e  # exit on any failure
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+THREADS=${THREADS:-4}
+WARMUP=${WARMUP:-5}
+DURATION=${DURATION:-10}
+INTERVAL=${INTERVAL:-1ms}
+
+(
+  cd $(dirname $0)
+
+  if [ "ThroughputTarget.class" -ot "ThroughputTarget.java" ]; then
+     ${JAVA_HOME}/bin/javac ThroughputTarget.java
+  fi
+
+  BUILD=$(cd ../../build && pwd)
+  PROFILER=$BUILD/libasyncProfiler.so
+  OUTPUT=/tmp/sample-cost-bench
+  STATUS=/tmp/sample-cost-bench.status
+
+  function run() {
+    local name=$1 options=$2
+    ${JAVA_HOME}/bin/java -agentpath:$PROFILER=start,$options,interval=$INTERVAL,file=$OUTPUT \
+      ThroughputTarget $THREADS $WARMUP $DURATION > /dev/null &
+    local pid=$!
+
+    # Counters are read while the profiler is still running, before the target exits.
+    # Without file=, the status would go to the stdout of the target
+    sleep $((WARMUP + DURATION - 1))
+    rm -f $STATUS
+    $BUILD/jattach $pid load $PROFILER true status,file=$STATUS > /dev/null
+    wait $pid
+
+    awk -v name="$name" '
+      / cpu: / { samples = $2; ns = $(NF - 3) }
+      / stack walking: / { native = $4; java = $7 }
+      END {
+        if (samples > 0) {
+          printf "%-16s %10d %12d %14.1f %14.1f\n", name, samples, ns, native * 1e6 / samples, java * 1e6 / samples
+        } else {
+          printf "%-16s %10s\n", name, "no samples"
+        }
+      }' $STATUS
+  }
+
+  printf "%-16s %10s %12s %14s %14s\n" "setup" "samples" "ns/sample" "native, ns" "java, ns"
+  run "cpu+jfr" "event=cpu,jfr"
+  run "wall+collapsed" "event=wall,collapsed"
+
+  rm -f $OUTPUT $STATUS
+)
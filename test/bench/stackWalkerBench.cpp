@@ -0,0 +1,107 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures native stack walking cost depending on the stack depth:
+// frame pointer walk vs. DWARF walk with and without the per-slot FrameDescCache
+// vs. the auto walk, which follows frame pointers in libraries compiled with them,
+// vs. the mixed walk, which unwinds like auto and also names every native frame.
+// Synthetic stacks are built by recursion through a few functions of this binary,
+// which is parsed the same way as any other native library
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "dwarf.h"
+#include "log.h"
+#include "profiler.h"
+#include "stackWalker.h"
+
+
+static const int MAX_DEPTH = 1024;
+static const int WALKS = 100000;
+
+enum WalkMode {
+    WALK_FP,
+    WALK_DWARF,
+    WALK_DWARF_CACHED,
+    WALK_AUTO,
+    WALK_MIXED
+};
+
+static const void* callchain[MAX_DEPTH];
+static ASGCT_CallFrame frames[MAX_DEPTH];
+static FrameDescCache* cache;
+
+// Keeps the compiler from optimizing walks and recursion away
+volatile int sink;
+
+extern "C" __attribute__((noinline)) u64 walk(WalkMode mode, int expected_depth) {
+    const void* last_pc = NULL;
+    u64 start = OS::nanotime();
+    for (int i = 0; i < WALKS; i++) {
+        int depth;
+        if (mode == WALK_FP) {
+            depth = StackWalker::walkFP(NULL, callchain, MAX_DEPTH, &last_pc);
+        } else if (mode == WALK_AUTO) {
+            depth = StackWalker::walkAuto(NULL, callchain, MAX_DEPTH, &last_pc);
+        } else if (mode == WALK_MIXED) {
+            depth = StackWalker::walkMixed(NULL, frames, MAX_DEPTH, cache);
+        } else {
+            depth = StackWalker::walkDwarf(NULL, callchain, MAX_DEPTH, &last_pc, mode == WALK_DWARF_CACHED ? cache : NULL);
+        }
+        if (depth < expected_depth) {
+            fprintf(stderr, "Walk mode %d stopped at depth %d of %d\n", mode, depth, expected_depth);
+            exit(1);
+        }
+    }
+    return OS::nanotime() - start;
+}
+
+extern "C" __attribute__((noinline)) u64 recurseB(WalkMode mode, int depth, int target);
+
+extern "C" __attribute__((noinline)) u64 recurseA(WalkMode mode, int depth, int target) {
+    u64 result = depth >= target ? walk(mode, target) : recurseB(mode, depth + 1, target);
+    sink = depth;
+    return result;
+}
+
+extern "C" __attribute__((noinline)) u64 recurseB(WalkMode mode, int depth, int target) {
+    char frame[32];
+    frame[depth & 31] = (char)depth;
+    u64 result = depth >= target ? walk(mode, target) : recurseA(mode, depth + 1, target);
+    sink = frame[depth & 31];
+    return result;
+}
+
+int main() {
+    Log::open(NULL, "warn");
+    Profiler::instance()->updateSymbols(false);
+    cache = new FrameDescCache();
+
+    printf("%8s %14s %14s %14s %14s %14s\n", "depth", "fp, ns", "dwarf, ns", "cached, ns", "auto, ns", "mixed, ns");
+
+    for (int depth = 16; depth <= 512; depth *= 2) {
+        u64 fp = recurseA(WALK_FP, 0, depth);
+        u64 dwarf = recurseA(WALK_DWARF, 0, depth);
+        u64 cached = recurseA(WALK_DWARF_CACHED, 0, depth);
+        u64 automatic = recurseA(WALK_AUTO, 0, depth);
+        u64 mixed = recurseA(WALK_MIXED, 0, depth);
+        printf("%8d %14.1f %14.1f %14.1f %14.1f %14.1f\n", depth, (double)fp / WALKS, (double)dwarf / WALKS,
+               (double)cached / WALKS, (double)automatic / WALKS, (double)mixed / WALKS);
+    }
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Measures how much the profiler slows down an application.
+# Runs ThroughputTarget without the profiler and then with each of the profiling modes,
+# and prints the throughput of every run relative to the baseline.
+#
+# Environment: THREADS (default 4), WARMUP and DURATION in seconds (default 5 and 10),
+# INTERVAL of the cpu and wall events (default 1ms), EVENTS to compare (default cpu itimer wall alloc lock)
+
+set -e  # exit on any failure
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+THREADS=${THREADS:-4}
+WARMUP=${WARMUP:-5}
+DURATION=${DURATION:-10}
+INTERVAL=${INTERVAL:-1ms}
+EVENTS=${EVENTS:-cpu itimer wall alloc lock}
+
+(
+  cd $(dirname $0)
+
+  if [ "ThroughputTarget.class" -ot "ThroughputTarget.java" ]; then
+     ${JAVA_HOME}/bin/javac ThroughputTarget.java
+  fi
+
+  PROFILER=$(cd ../../build && pwd)/libasyncProfiler.so
+  OUTPUT=/tmp/throughput-bench.collapsed
+
+  function run() {
+    ${JAVA_HOME}/bin/java "$@" ThroughputTarget $THREADS $WARMUP $DURATION | sed -n 's/^ops\/s //p'
+  }
+
+  BASELINE=$(run)
+  printf "%-10s %14s %10s\n" "event" "ops/s" "slowdown"
+  printf "%-10s %14s %10s\n" "none" $BASELINE "-"
+
+  for EVENT in $EVENTS; do
+    case $EVENT in
+      alloc|lock) OPTIONS="event=$EVENT" ;;
+      *)          OPTIONS="event=$EVENT,interval=$INTERVAL" ;;
+    esac
+
+    OPS=$(run -agentpath:$PROFILER=start,$OPTIONS,collapsed,file=$OUTPUT)
+    awk -v e=$EVENT -v ops=$OPS -v base=$BASELINE 'BEGIN { printf "%-10s %14s %9.2f%%\n", e, ops, (1 - ops / base) * 100 }'
+  done
+
+  rm -f $OUTPUT
+)
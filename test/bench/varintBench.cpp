@@ -0,0 +1,159 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the byte-at-a-time varint encoder with Buffer::putVar32/putVar64
+// on values shaped like JFR constant pools: small method and class ids,
+// line numbers and bcis, and 64-bit symbol ids tagged with the chunk base id
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "buffer.h"
+#include "os_linux.cpp"
+#include "os_macos.cpp"
+
+
+static const int VALUES = 1 << 20;
+static const int ROUNDS = 50;
+
+// Keeps the compiler from optimizing encoding away
+volatile int sink;
+
+// The encoder Buffer used before the single-store fast path
+class LoopBuffer {
+  private:
+    int _offset;
+    char _data[RECORDING_BUFFER_SIZE];
+
+  public:
+    LoopBuffer() : _offset(0) {
+    }
+
+    const char* data() const {
+        return _data;
+    }
+
+    int offset() const {
+        return _offset;
+    }
+
+    int skip(int delta) {
+        int offset = _offset;
+        _offset = offset + delta;
+        return offset;
+    }
+
+    void reset() {
+        _offset = 0;
+    }
+
+    void putVar32(u32 v) {
+        while (v > 0x7f) {
+            _data[_offset++] = (char)v | 0x80;
+            v >>= 7;
+        }
+        _data[_offset++] = (char)v;
+    }
+
+    void putVar64(u64 v) {
+        int iter = 0;
+        while (v > 0x1fffff) {
+            _data[_offset++] = (char)v | 0x80; v >>= 7;
+            _data[_offset++] = (char)v | 0x80; v >>= 7;
+            _data[_offset++] = (char)v | 0x80; v >>= 7;
+            if (++iter == 3) return;
+        }
+        while (v > 0x7f) {
+            _data[_offset++] = (char)v | 0x80;
+            v >>= 7;
+        }
+        _data[_offset++] = (char)v;
+    }
+};
+
+template <class B>
+static u64 encode(B* buf, const u64* values, const bool* wide) {
+    u64 start = OS::nanotime();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < VALUES; i++) {
+            if (wide[i]) {
+                buf->putVar64(values[i]);
+            } else {
+                buf->putVar32((u32)values[i]);
+            }
+            if (buf->offset() >= RECORDING_BUFFER_LIMIT) {
+                sink = buf->skip(0);
+                buf->reset();
+            }
+        }
+    }
+    return OS::nanotime() - start;
+}
+
+int main() {
+    srand(1);
+
+    u64* values = new u64[VALUES];
+    bool* wide = new bool[VALUES];
+    for (int i = 0; i < VALUES; i++) {
+        int kind = rand() % 8;
+        wide[i] = kind == 0;
+        if (kind == 0) {
+            values[i] = (u64)(rand() % 100000) | (u64)(1 + rand() % 1000) << 32;
+        } else if (kind < 4) {
+            values[i] = rand() % 200000;
+        } else if (kind < 6) {
+            values[i] = rand() % 2000;
+        } else {
+            values[i] = rand() % 100;
+        }
+    }
+
+    // Both encoders must produce identical bytes
+    LoopBuffer* expected = new LoopBuffer();
+    RecordingBuffer* actual = new RecordingBuffer();
+    for (int i = 0; i < VALUES; i++) {
+        u64 v = i < 64 ? (1ULL << i) - 1 : values[i];
+        if (i < 64 || wide[i]) {
+            expected->putVar64(v);
+            actual->putVar64(v);
+        } else {
+            expected->putVar32((u32)v);
+            actual->putVar32((u32)v);
+        }
+        if (expected->offset() != actual->offset() ||
+            memcmp(expected->data(), actual->data(), expected->offset()) != 0) {
+            printf("Encoding mismatch at value %llx\n", (unsigned long long)v);
+            return 1;
+        }
+        if (expected->offset() >= RECORDING_BUFFER_LIMIT) {
+            expected->reset();
+            actual->reset();
+        }
+    }
+    expected->reset();
+    actual->reset();
+
+    u64 loop_ns = encode(expected, values, wide);
+    u64 fast_ns = encode(actual, values, wide);
+    double count = (double)VALUES * ROUNDS;
+
+    printf("%10s %14s %14s\n", "encoder", "ns/value", "Mvalues/s");
+    printf("%10s %14.2f %14.1f\n", "loop", loop_ns / count, count * 1000 / loop_ns);
+    printf("%10s %14.2f %14.1f\n", "buffer", fast_ns / count, count * 1000 / fast_ns);
+
+    return 0;
+}
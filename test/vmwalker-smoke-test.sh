@@ -0,0 +1,54 @@
+#!/bin/bash
+
+# Checks that the VMStructs-based Java stack walker (--vm-walker) and the mixed walker
+# (--cstack vm) produce the same Java stacks as AsyncGetCallTrace, including interpreted,
+# compiled and inlined frames, and that broken frames do not dominate the profile
+
+set -e  # exit on any failure
+set -x  # print all executed lines
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+(
+  cd $(dirname $0)
+
+  if [ "Target.class" -ot "Target.java" ]; then
+     ${JAVA_HOME}/bin/javac Target.java
+  fi
+
+  ${JAVA_HOME}/bin/java Target &
+
+  FILENAME=/tmp/java.trace
+  JAVAPID=$!
+
+  sleep 1     # allow the Java runtime to initialize
+
+  function assert_string() {
+    if ! grep -q "$1" $FILENAME; then
+      kill $JAVAPID
+      exit 1
+    fi
+  }
+
+  # At most 10% of samples may end in a walker error frame like break_compiled or unknown_nmethod
+  function assert_few_errors() {
+    if ! awk '{ n = $NF; total += n } /;break_|;unknown_/ { errors += n } END { exit !(total > 0 && errors * 10 <= total) }' $FILENAME; then
+      kill $JAVAPID
+      exit 1
+    fi
+  }
+
+  for MODE in "--vm-walker" "--cstack vm"; do
+    ../profiler.sh -f $FILENAME -o collapsed -d 5 $MODE $JAVAPID
+
+    assert_string "Target.main;Target.method1 "
+    assert_string "Target.main;Target.method2 "
+    assert_string "Target.main;Target.method3;java/io/File"
+    assert_few_errors
+  done
+
+  kill $JAVAPID
+)